@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+#
+# Find flows in the catalog tcpflow writes with -S catalog=NAME.
+# See src/flow_catalog.h for the layout.
+#
+#   tcpflow_catalog.py FILE                      list every flow, by start time
+#   tcpflow_catalog.py FILE --host ADDR          the flows to or from ADDR
+#   tcpflow_catalog.py FILE --start T1 --end T2  the flows that were open
+#                                                between T1 and T2 (seconds
+#                                                since the epoch)
+#
+# The catalog is mapped, and the host and time are found by binary search
+# of its indexes, so a query doesn't read the records it doesn't return.
+#
+import ipaddress
+import mmap
+import socket
+import struct
+
+MAGIC = b"TCPFLCAT"
+HEADER_SIZE = 64
+TIME_ENTRY_SIZE = 16
+ADDR_ENTRY_SIZE = 32
+
+class Flow:
+    def __init__(self, fields, path):
+        (self.id, tstart, tlast, self.packets, self.bytes, _, src, dst, md5,
+         self.vlan, _, self.sport, self.dport, self.family) = fields
+        self.tstart = tstart / 1e6
+        self.tlast = tlast / 1e6
+        self.src = address(self.family, src)
+        self.dst = address(self.family, dst)
+        self.md5 = md5.hex() if any(md5) else None
+        self.path = path
+
+def address(family, raw):
+    if family == 4:
+        return socket.inet_ntop(socket.AF_INET, raw[:4])
+    return socket.inet_ntop(socket.AF_INET6, raw)
+
+def key(addr):
+    a = ipaddress.ip_address(addr)
+    return (4, a.packed + b"\0"*12) if a.version == 4 else (6, a.packed)
+
+class Catalog:
+    def __init__(self, path):
+        self.f = open(path, "rb")
+        self.m = mmap.mmap(self.f.fileno(), 0, access=mmap.ACCESS_READ)
+        if self.m[0:8] != MAGIC:
+            raise ValueError("%s is not a tcpflow catalog" % path)
+        for bo in "<>":
+            if struct.unpack_from(bo + "I", self.m, 12)[0] == 0x01020304:
+                break
+        else:
+            raise ValueError("%s: unknown byte order" % path)
+        (self.version, _, self.record_size, _, self.records, self.by_time, self.by_addr,
+         self.paths, self.max_duration) = struct.unpack_from(bo + "IIIIQQQQq", self.m, 8)
+        if self.records == 0 and len(self.m) > HEADER_SIZE:
+            raise ValueError("%s has no indexes; tcpflow didn't finish it" % path)
+        self.record_fmt = struct.Struct(bo + "QqqQQQ16s16s16siIHHB")
+        self.time_fmt = struct.Struct(bo + "qI")
+        self.addr_fmt = struct.Struct(bo + "16sqIB")
+
+    def flow(self, n):
+        fields = self.record_fmt.unpack_from(self.m, HEADER_SIZE + n*self.record_size)
+        start = self.paths + fields[5]
+        path = self.m[start:start + fields[10]].decode("utf-8", "replace")
+        return Flow(fields, path)
+
+    def time_entry(self, i):
+        return self.time_fmt.unpack_from(self.m, self.by_time + i*TIME_ENTRY_SIZE)
+
+    def addr_entry(self, i):
+        raw, tstart, record, family = self.addr_fmt.unpack_from(self.m, self.by_addr + i*ADDR_ENTRY_SIZE)
+        return (family, raw, tstart, record)
+
+    @staticmethod
+    def lower_bound(lo, hi, before):
+        while lo < hi:
+            mid = (lo + hi) // 2
+            if before(mid):
+                lo = mid + 1
+            else:
+                hi = mid
+        return lo
+
+    def between(self, t1, t2):
+        """Records of the flows open at some time in [t1,t2], by start time"""
+        first = int(t1*1e6) - self.max_duration
+        i = self.lower_bound(0, self.records, lambda i: self.time_entry(i)[0] < first)
+        while i < self.records:
+            tstart, record = self.time_entry(i)
+            if tstart > t2*1e6:
+                break
+            if self.flow(record).tlast >= t1:
+                yield record
+            i += 1
+
+    def host(self, addr, t1=None, t2=None):
+        """Records of the flows to or from addr, open between t1 and t2, by start time"""
+        family, raw = key(addr)
+        first = -2**63 if t1 is None else int(t1*1e6) - self.max_duration
+        n = self.records*2
+        i = self.lower_bound(0, n, lambda i: self.addr_entry(i)[:3] < (family, raw, first))
+        seen = set()
+        while i < n:
+            f, r, tstart, record = self.addr_entry(i)
+            if (f, r) != (family, raw) or (t2 is not None and tstart > t2*1e6):
+                break
+            if record not in seen and (t1 is None or self.flow(record).tlast >= t1):
+                seen.add(record)        # once, if it is from addr to addr
+                yield record
+            i += 1
+
+if __name__=="__main__":
+    import argparse
+    parser = argparse.ArgumentParser(description="Find flows in a tcpflow catalog")
+    parser.add_argument("catalog", help="the file tcpflow wrote with -S catalog")
+    parser.add_argument("--host", help="only the flows to or from this address")
+    parser.add_argument("--start", type=float, help="only the flows open at or after this time")
+    parser.add_argument("--end", type=float, help="only the flows open at or before this time")
+    args = parser.parse_args()
+
+    cat = Catalog(args.catalog)
+    t1 = args.start
+    t2 = args.end
+    if args.host:
+        records = cat.host(args.host, t1, t2)
+    else:
+        records = cat.between(-2**40 if t1 is None else t1, 2**40 if t2 is None else t2)
+    for record in records:
+        f = cat.flow(record)
+        print("%.6f %.6f %s:%u > %s:%u %u packets %u bytes %s" %
+              (f.tstart, f.tlast, f.src, f.sport, f.dst, f.dport, f.packets, f.bytes, f.path))
@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+#
+# List or expand the flows tcpflow appended to segment files with
+# -S segment_mb=N. See src/flow_container.h for the layout.
+#
+#   tcpflow_container.py DIR                 list the flows in DIR
+#   tcpflow_container.py -x DIR [NAME ...]   write the flows (all, or those
+#                                            matching the NAME patterns) to
+#                                            the files tcpflow would have made
+#
+# With --scan the flows are read from the segments' records rather than
+# from flows.idx, for a container whose index was not written.
+#
+import fnmatch
+import glob
+import os
+import struct
+
+SEGMENT_MAGIC = b"TCPFLSEG"
+SEGMENT_HEADER_SIZE = 16
+RECORD_HEADER_SIZE = 24
+DATA, SHIFT, CLOSE = 1, 2, 3
+
+class Flow:
+    def __init__(self, fid):
+        self.id = fid
+        self.name = None
+        self.tstart = None
+        self.extents = []               # (segment, position, offset, length), in the order written
+
+    def length(self):
+        return max([e[2]+e[3] for e in self.extents] or [0])
+
+def segment_path(dirname, segment):
+    return os.path.join(dirname, "flows.%06u.seg" % segment)
+
+def read_index(dirname):
+    flows = {}
+    order = []
+    with open(os.path.join(dirname, "flows.idx"), "rb") as f:
+        for line in f:
+            fid, length, tstart, extents, name = line.rstrip(b"\n").split(b"\t", 4)
+            fid = int(fid)
+            if fid not in flows:
+                flows[fid] = Flow(fid)
+                order.append(fid)
+            flow = flows[fid]
+            flow.name = os.fsdecode(name)
+            flow.tstart = float(tstart)
+            for e in extents.split(b","):
+                if e:
+                    flow.extents.append(tuple(int(v) for v in e.split(b":")))
+    return [flows[fid] for fid in order]
+
+def byte_order(header, path):
+    if header[0:8] != SEGMENT_MAGIC:
+        raise ValueError("%s is not a tcpflow segment" % path)
+    for order in "<>":
+        if struct.unpack(order + "II", header[8:16])[1] == 0x01020304:
+            return order
+    raise ValueError("%s: unknown byte order" % path)
+
+def scan_segments(dirname):
+    """Read the flows from the records, as the index would have given them"""
+    flows = {}
+    order = []
+    segment = 0
+    while os.path.exists(segment_path(dirname, segment)):
+        path = segment_path(dirname, segment)
+        with open(path, "rb") as f:
+            bo = byte_order(f.read(SEGMENT_HEADER_SIZE), path)
+            position = SEGMENT_HEADER_SIZE
+            while True:
+                header = f.read(RECORD_HEADER_SIZE)
+                if len(header) < RECORD_HEADER_SIZE:
+                    break               # the end, or a segment cut short
+                rtype, length, fid, offset = struct.unpack(bo + "IIQQ", header)
+                position += RECORD_HEADER_SIZE
+                if fid not in flows:
+                    flows[fid] = Flow(fid)
+                    order.append(fid)
+                flow = flows[fid]
+                if rtype == DATA:
+                    flow.extents.append((segment, position, offset, length))
+                    f.seek(length, os.SEEK_CUR)
+                elif rtype == SHIFT:
+                    flow.extents = [(s, p, o+offset, l) for (s, p, o, l) in flow.extents]
+                elif rtype == CLOSE:
+                    flow.name = os.fsdecode(f.read(length))
+                position += length
+        segment += 1
+    for flow in flows.values():
+        if flow.name is None:
+            flow.name = "flow-%u" % flow.id  # still open when tcpflow stopped
+    return [flows[fid] for fid in order]
+
+def expand(dirname, flow, outdir):
+    path = os.path.join(outdir, flow.name)
+    if os.path.dirname(path):
+        os.makedirs(os.path.dirname(path), exist_ok=True)
+    segments = {}
+    with open(path, "wb") as out:
+        for (segment, position, offset, length) in flow.extents:
+            if segment not in segments:
+                segments[segment] = open(segment_path(dirname, segment), "rb")
+            f = segments[segment]
+            f.seek(position)
+            out.seek(offset)
+            out.write(f.read(length))
+        out.truncate(flow.length())
+    for f in segments.values():
+        f.close()
+    if flow.tstart is not None:
+        os.utime(path, (flow.tstart, flow.tstart))
+    return path
+
+if __name__=="__main__":
+    import argparse
+    parser = argparse.ArgumentParser(description="List or expand the flows in a tcpflow segment container")
+    parser.add_argument("dir", help="the directory tcpflow wrote the segments to")
+    parser.add_argument("names", nargs="*", help="flows to expand (shell patterns); all if none are given")
+    parser.add_argument("-x", "--extract", action="store_true", help="write the flows to their files")
+    parser.add_argument("-o", "--outdir", help="where to write them (default: the container's directory)")
+    parser.add_argument("--scan", action="store_true", help="read the segments rather than flows.idx")
+    args = parser.parse_args()
+
+    flows = scan_segments(args.dir) if args.scan else read_index(args.dir)
+    if args.names:
+        flows = [f for f in flows if any(fnmatch.fnmatch(f.name, n) for n in args.names)]
+    for flow in flows:
+        if args.extract:
+            print(expand(args.dir, flow, args.outdir or args.dir))
+        else:
+            print("%10u %s" % (flow.length(), flow.name))
@@ -0,0 +1,122 @@
+/*
+ * cidr_filter.cpp:
+ *
+ * The -S prefilter allow/deny list; see cidr_filter.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "cidr_filter.h"
+#include "dfxml/src/dfxml_writer.h"
+
+#include <fstream>
+#include <sstream>
+
+int32_t cidr_filter::longest(const ipaddr &a,sa_family_t family) const
+{
+    uint32_t n = family==AF_INET6 ? ROOT6 : ROOT4;
+    int bits = family==AF_INET6 ? 128 : 32;
+    int32_t best = nodes[n].rule;
+    for(int i=0;i<bits;i++){
+        n = nodes[n].child[a.bit(i)];
+        if(n==0) break;
+        if(nodes[n].rule>=0) best = nodes[n].rule;
+    }
+    return best;
+}
+
+bool cidr_filter::add(const std::string &prefix,bool allow,std::string &err)
+{
+    std::string addr = prefix;
+    int length = -1;
+    size_t slash = prefix.find('/');
+    if(slash!=std::string::npos){
+        addr = prefix.substr(0,slash);
+        std::string len = prefix.substr(slash+1);
+        if(len.size()==0 || len.size()>3 || len.find_first_not_of("0123456789")!=std::string::npos){
+            err = "bad prefix length in " + prefix;
+            return false;
+        }
+        length = atoi(len.c_str());
+    }
+    ipaddr a;
+    uint32_t n = ROOT4;
+    int bits = 32;
+    if(inet_pton(AF_INET,addr.c_str(),a.addr)!=1){
+        if(inet_pton(AF_INET6,addr.c_str(),a.addr)!=1){
+            err = "not an address: " + addr;
+            return false;
+        }
+        n = ROOT6;
+        bits = 128;
+    }
+    if(length<0) length = bits;
+    if(length>bits){
+        err = "prefix too long: " + prefix;
+        return false;
+    }
+    for(int i=0;i<length;i++){
+        int b = a.bit(i);
+        if(nodes[n].child[b]==0){
+            nodes[n].child[b] = nodes.size();
+            nodes.push_back(node());
+        }
+        n = nodes[n].child[b];
+    }
+    nodes[n].rule = rules.size();       // a prefix given again takes the later rule
+    rules.push_back(rule(prefix,allow));
+    if(allow) allows++;
+    return true;
+}
+
+cidr_filter *cidr_filter::open(const std::string &fname,std::string &err)
+{
+    std::ifstream in(fname.c_str());
+    if(!in.is_open()){
+        err = fname + ": " + strerror(errno);
+        return 0;
+    }
+    cidr_filter *f = new cidr_filter();
+    std::string line;
+    int lineno = 0;
+    while(std::getline(in,line)){
+        lineno++;
+        size_t hash = line.find('#');
+        if(hash!=std::string::npos) line.resize(hash);
+        std::istringstream words(line);
+        std::string first, prefix, extra;
+        if(!(words >> first)) continue; // blank
+        bool allow = false;
+        if(first=="allow" || first=="deny"){
+            allow = first=="allow";
+            words >> prefix;
+        } else {
+            prefix = first;             // a bare prefix is denied
+        }
+        std::string why;
+        if(prefix.size()==0) why = "no prefix";
+        else if(words >> extra) why = "more than a rule on the line";
+        else f->add(prefix,allow,why);
+        if(why.size()){
+            err = ssprintf("%s:%d: %s",fname.c_str(),lineno,why.c_str());
+            delete f;
+            return 0;
+        }
+    }
+    return f;
+}
+
+void cidr_filter::write(dfxml_writer &x,const std::vector<uint64_t> &hits) const
+{
+    x.push("prefilter");
+    for(size_t i=0;i<rules.size();i++){
+        x.xmlout("rule","",ssprintf("prefix='%s' action='%s' hits='%" PRIu64 "'",
+                                    rules[i].text.c_str(),rules[i].allow ? "allow" : "deny",
+                                    i<hits.size() ? hits[i] : 0),false);
+    }
+    if(allows) x.xmlout("unmatched",(int64_t)(rules.size()<hits.size() ? hits[rules.size()] : 0));
+    x.pop();
+}
@@ -0,0 +1,88 @@
+/*
+ * cidr_filter.h:
+ *
+ * An allow/deny list of IPv4 and IPv6 prefixes (-S prefilter=FILE), for
+ * the thousands of subnets that would make a BPF expression that libpcap
+ * runs as one long program on every packet.
+ *
+ * The file has a rule a line, "allow" or "deny" and a prefix:
+ *
+ *   # the backup network
+ *   deny  10.20.0.0/16
+ *   allow 192.0.2.0/24
+ *   allow 2001:db8::/32
+ *   198.51.100.7           a bare prefix is denied; without /n it is one address
+ *
+ * Each of a packet's addresses is looked up for the longest prefix that
+ * holds it. The packet is dropped if either address's is denied and,
+ * when there are allow rules, if neither's is allowed; so allow rules
+ * alone keep only those subnets, deny rules alone keep all but theirs,
+ * and a deny inside an allow punches a hole in it.
+ *
+ * The prefixes are kept in a binary trie, one for each family, in one
+ * vector of nodes; a lookup visits at most one node per bit of the
+ * longest prefix. The filter is read-only once loaded and shared by the
+ * shards; each demux counts its own hits, by rule, and the counts are
+ * added up for report.xml.
+ *
+ * process_ip4() and process_ip6() look the addresses up before
+ * process_tcp(); with -j, the master does it before a packet is queued.
+ *
+ * #include this file after tcpip.h
+ */
+
+#ifndef CIDR_FILTER_H
+#define CIDR_FILTER_H
+
+#include <string>
+#include <vector>
+
+class cidr_filter {
+    /* These are not implemented */
+    cidr_filter(const cidr_filter &);
+    cidr_filter &operator=(const cidr_filter &);
+
+    struct node {
+        node():rule(-1){ child[0] = child[1] = 0; }
+        uint32_t child[2];              // 0 for none; the roots are never anyone's child
+        int32_t  rule;                  // ending here, or -1
+    };
+    enum { ROOT4 = 0, ROOT6 = 1 };
+    std::vector<node> nodes;
+    size_t  allows;                     // rules that allow
+
+    int32_t longest(const ipaddr &a,sa_family_t family) const; // rule, or -1
+    bool    add(const std::string &prefix,bool allow,std::string &err);
+    cidr_filter():nodes(2),allows(0),rules(){}
+
+public:
+    struct rule {
+        rule(const std::string &text_,bool allow_):text(text_),allow(allow_){}
+        std::string text;               // as the file gave it
+        bool        allow;
+    };
+    std::vector<rule> rules;
+
+    /** Returns 0 and sets err if fname can't be read or has a line that isn't a rule */
+    static cidr_filter *open(const std::string &fname,std::string &err);
+    virtual ~cidr_filter(){}
+
+    /** True if the packet gets through. hit is set to the rule that decided;
+     * to rules.size() if it was dropped for not being allowed; or to -1, and
+     * true, if there was nothing to decide.
+     */
+    bool pass(const ipaddr &src,const ipaddr &dst,sa_family_t family,int32_t &hit) const {
+        int32_t s = longest(src,family);
+        int32_t d = longest(dst,family);
+        if(s>=0 && !rules[s].allow){ hit = s; return false; }
+        if(d>=0 && !rules[d].allow){ hit = d; return false; }
+        if(s>=0){ hit = s; return true; } // allowed, since it isn't denied
+        if(d>=0){ hit = d; return true; }
+        hit = allows ? (int32_t)rules.size() : -1;
+        return allows==0;
+    }
+    /** report.xml's <prefilter>, from hits indexed as pass() sets hit */
+    void write(class dfxml_writer &x,const std::vector<uint64_t> &hits) const;
+};
+
+#endif
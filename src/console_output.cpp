@@ -0,0 +1,455 @@
+/*
+ * console_output.cpp:
+ *
+ * Rendering of packets for the console; see console_output.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "console_output.h"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef HAVE_PTHREAD
+#include <sched.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static const char hex_digits[] = "0123456789abcdef";
+
+#define HEX_BYTES_PER_LINE 32
+#define HEX_LINE_MAX (2+16+HEX_BYTES_PER_LINE*2+HEX_BYTES_PER_LINE/2+1+HEX_BYTES_PER_LINE+1) // without the padding
+
+/* The bytes -s keeps: isprint() in the C locale, and the line ends */
+static inline bool keep_byte(u_char ch)
+{
+    return (ch>=' ' && ch<='~') || ch=='\n' || ch=='\r';
+}
+
+/* Lines are 32 bytes of hex, grouped in pairs, then the same bytes as ASCII.
+ * A short last line is padded so that its ASCII lines up with the others.
+ */
+/* static */ void console_format::hex_dump(std::string &out,const u_char *data,size_t length)
+{
+    if(length==0) return;
+    size_t lines = (length + HEX_BYTES_PER_LINE - 1) / HEX_BYTES_PER_LINE;
+    size_t start = out.size();
+    out.resize(start + lines*HEX_LINE_MAX + HEX_LINE_MAX); // room for one line's padding
+    char *p = &out[start];
+    size_t max_spaces = 0;
+    for(size_t i=0;i<length;i+=HEX_BYTES_PER_LINE){
+        const char *line = p;
+
+        /* The offset, as with %04x */
+        int digits = 4;
+        while(digits<16 && (i >> (digits*4))) digits++;
+        for(int d=digits-1;d>=0;d--) *p++ = hex_digits[(i >> (d*4)) & 0xf];
+        *p++ = ':';
+        *p++ = ' ';
+
+        /* The hex bytes */
+        size_t n = std::min((size_t)HEX_BYTES_PER_LINE,length-i);
+        for(size_t j=0;j<n;j++){
+            u_char ch = data[i+j];
+            *p++ = hex_digits[ch >> 4];
+            *p++ = hex_digits[ch & 0xf];
+            if(j%2==1) *p++ = ' ';
+        }
+
+        /* space out to where the ASCII region is */
+        size_t spaces = p - line;
+        if(spaces>max_spaces) max_spaces = spaces;
+        for(;spaces<max_spaces;spaces++) *p++ = ' ';
+        *p++ = ' ';
+
+        /* The ascii */
+        for(size_t j=0;j<n;j++){
+            u_char ch = data[i+j];
+            *p++ = (ch>=' ' && ch<='~') ? ch : '.';
+        }
+        *p++ = '\n';
+    }
+    out.resize(p - &out[0]);
+}
+
+/* static */ void console_format::printable(std::string &out,const u_char *data,size_t length)
+{
+    if(length==0) return;
+    size_t start = out.size();
+    out.resize(start + length);
+    char *p = &out[start];
+    size_t i = 0;
+#ifdef __SSE2__
+    /* Whole runs of 16 kept bytes are copied as they are; the others are
+     * compacted without branching on each byte.
+     */
+    const __m128i below = _mm_set1_epi8(' '-1);
+    const __m128i above = _mm_set1_epi8('~'+1);
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    for(;i+16<=length;i+=16){
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data+i));
+        /* signed compares: bytes from 0x80 up are negative, so not kept */
+        __m128i keep = _mm_and_si128(_mm_cmpgt_epi8(v,below),_mm_cmplt_epi8(v,above));
+        keep = _mm_or_si128(keep,_mm_or_si128(_mm_cmpeq_epi8(v,nl),_mm_cmpeq_epi8(v,cr)));
+        int mask = _mm_movemask_epi8(keep);
+        if(mask==0xffff){
+            memcpy(p,data+i,16);
+            p += 16;
+            continue;
+        }
+        for(int j=0;j<16;j++){
+            *p = data[i+j];
+            p += (mask >> j) & 1;
+        }
+    }
+#endif
+    for(;i<length;i++){
+        *p = data[i];
+        p += keep_byte(data[i]);
+    }
+    out.resize(p - &out[0]);
+}
+
+#ifdef HAVE_CONSOLE_WRITER
+
+console_writer::console_writer(size_t batch_max_,bool exit_on_error_):
+    stub(),head(&stub),tail(&stub),returned(0),
+    batch_max(batch_max_),queue_max(std::max((size_t)QUEUE_MIN,batch_max_*QUEUE_BATCHES)),
+    queued_bytes(0),pending(0),exit_on_error(exit_on_error_),
+    writer_waiting(0),producers_waiting(0),stopping(false),running(false),batch(),
+    lock(),work(),room(),thread()
+{
+    pthread_mutex_init(&lock,0);
+    pthread_cond_init(&work,0);
+    pthread_cond_init(&room,0);
+    batch.reserve(batch_max);
+}
+
+console_writer *console_writer::open(size_t batch_max,bool exit_on_error)
+{
+    if(batch_max==0) return 0;
+    console_writer *w = new console_writer(batch_max,exit_on_error);
+    if(pthread_create(&w->thread,0,run,w)!=0){
+        DEBUG(2)("cannot start the console writer thread; printing packets synchronously");
+        delete w;
+        return 0;
+    }
+    w->running = true;
+    return w;
+}
+
+console_writer::~console_writer()
+{
+    stop();
+    free_chunks(returned);
+    pthread_cond_destroy(&room);
+    pthread_cond_destroy(&work);
+    pthread_mutex_destroy(&lock);
+}
+
+/* static */ void console_writer::free_chunks(console_chunk *list)
+{
+    while(list){
+        console_chunk *next = list->next;
+        delete list;
+        list = next;
+    }
+}
+
+/* Chunks come back from the writer a batch at a time, and a shard takes all
+ * of them at once when it runs out, so neither side ever pops a single
+ * chunk off a shared list.
+ */
+console_chunk *console_writer::get(console_chunk **spares)
+{
+    console_chunk *c = *spares;
+    if(c==0) c = __atomic_exchange_n(&returned,(console_chunk *)0,__ATOMIC_ACQUIRE);
+    if(c==0) return new console_chunk();
+    *spares = c->next;
+    c->next = 0;
+    return c;
+}
+
+void console_writer::give_back(console_chunk *first,console_chunk *last)
+{
+    console_chunk *old = __atomic_load_n(&returned,__ATOMIC_RELAXED);
+    do {
+        last->next = old;
+    } while(!__atomic_compare_exchange_n(&returned,&old,first,true,__ATOMIC_RELEASE,__ATOMIC_RELAXED));
+}
+
+void console_writer::push(console_chunk *c)
+{
+    c->next = 0;
+    console_chunk *prev = __atomic_exchange_n(&head,c,__ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next,c,__ATOMIC_RELEASE);
+}
+
+/* Only the writer pops. Returns 0 if the queue is empty, or if a push is
+ * half done (it has swapped head but not linked the chunk before it yet).
+ */
+console_chunk *console_writer::pop()
+{
+    console_chunk *t = tail;
+    console_chunk *next = __atomic_load_n(&t->next,__ATOMIC_ACQUIRE);
+    if(t==&stub){
+        if(next==0) return 0;
+        tail = t = next;
+        next = __atomic_load_n(&t->next,__ATOMIC_ACQUIRE);
+    }
+    if(next){
+        tail = next;
+        return t;
+    }
+    if(t!=__atomic_load_n(&head,__ATOMIC_ACQUIRE)) return 0;
+    push(&stub);                        // so the last chunk has a successor
+    next = __atomic_load_n(&t->next,__ATOMIC_ACQUIRE);
+    if(next){
+        tail = next;
+        return t;
+    }
+    return 0;
+}
+
+/* The sleepers set their flag and then look at the counters; we change the
+ * counters and then look at the flags, as report_writer does.
+ */
+void console_writer::put(console_chunk *c)
+{
+    if(__atomic_load_n(&queued_bytes,__ATOMIC_ACQUIRE) > queue_max){
+        demux_lock l(&lock);
+        __atomic_add_fetch(&producers_waiting,1,__ATOMIC_SEQ_CST);
+        while(__atomic_load_n(&queued_bytes,__ATOMIC_SEQ_CST) > queue_max && !stopping){
+            pthread_cond_wait(&room,&lock);
+        }
+        __atomic_sub_fetch(&producers_waiting,1,__ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&queued_bytes,c->text.size(),__ATOMIC_RELAXED);
+    push(c);
+    __atomic_add_fetch(&pending,1,__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&writer_waiting,__ATOMIC_SEQ_CST)){
+        demux_lock l(&lock);
+        pthread_cond_signal(&work);
+    }
+}
+
+void console_writer::stop()
+{
+    if(!running) return;
+    {
+        demux_lock l(&lock);
+        stopping = true;
+        pthread_cond_signal(&work);
+        pthread_cond_broadcast(&room);
+    }
+    pthread_join(thread,0);
+    running = false;
+}
+
+void *console_writer::run(void *arg)
+{
+    reinterpret_cast<console_writer *>(arg)->writer_loop();
+    return 0;
+}
+
+void console_writer::write_batch()
+{
+    if(semlock){
+        if(sem_wait(semlock)){
+            fprintf(stderr,"%s: attempt to acquire semaphore failed: %s\n",progname,strerror(errno));
+            exit(1);
+        }
+    }
+    if(fwrite(batch.data(),1,batch.size(),stdout)!=batch.size()){
+        if(exit_on_error){
+            std::cerr << "EOF on write to stdout\n";
+            exit(1);
+        }
+        perror("fwrite");
+    }
+    fflush(stdout);
+    if(semlock){
+        if(sem_post(semlock)){
+            fprintf(stderr,"%s: attempt to post semaphore failed: %s\n",progname,strerror(errno));
+            exit(1);
+        }
+    }
+    batch.clear();
+}
+
+void console_writer::writer_loop()
+{
+    console_chunk *done_first = 0;      // chunks in the batch, to give back once it is written
+    console_chunk *done_last = 0;
+    while(true){
+        console_chunk *c = pop();
+        if(c){
+            __atomic_sub_fetch(&pending,1,__ATOMIC_RELAXED);
+            batch.append(c->text);
+            if(c->text.capacity() > CHUNK_KEEP){
+                delete c;
+            } else {
+                c->text.clear();
+                c->next = done_first;
+                done_first = c;
+                if(done_last==0) done_last = c;
+            }
+            if(batch.size() < batch_max) continue;
+        }
+        if(batch.size()){
+            size_t n = batch.size();
+            write_batch();
+            __atomic_sub_fetch(&queued_bytes,n,__ATOMIC_SEQ_CST);
+            if(done_first) give_back(done_first,done_last);
+            done_first = done_last = 0;
+            if(__atomic_load_n(&producers_waiting,__ATOMIC_SEQ_CST)){
+                demux_lock l(&lock);
+                pthread_cond_broadcast(&room);
+            }
+            continue;
+        }
+        if(__atomic_load_n(&pending,__ATOMIC_ACQUIRE)){
+            sched_yield();              // a push is half done
+            continue;
+        }
+        demux_lock l(&lock);
+        __atomic_store_n(&writer_waiting,1,__ATOMIC_SEQ_CST);
+        while(__atomic_load_n(&pending,__ATOMIC_SEQ_CST)==0 && !stopping) pthread_cond_wait(&work,&lock);
+        __atomic_store_n(&writer_waiting,0,__ATOMIC_RELAXED);
+        if(__atomic_load_n(&pending,__ATOMIC_SEQ_CST)==0) break; // stopping, and everything is written
+    }
+}
+
+#endif
+
+#ifdef HAVE_CONSOLE_SPLICE
+#include <sys/mman.h>
+
+/* static */ console_splice *console_splice::open(int fd)
+{
+    struct stat st;
+    if(fstat(fd,&st) || !S_ISFIFO(st.st_mode)) return 0;
+#ifdef F_SETPIPE_SZ
+    fcntl(fd,F_SETPIPE_SZ,BYTES_BATCH); // fewer waits for the reader; it's fine if we may not
+#endif
+    return new console_splice(fd);
+}
+
+console_splice::~console_splice()
+{
+    flush();
+}
+
+void console_splice::input(const u_char *base,size_t len)
+{
+    flush();                            // the last file's pages are about to be unmapped
+    stable = base;
+    stable_len = len;
+}
+
+void console_splice::piece(const void *p,size_t len)
+{
+    if(len==0) return;
+    if(iov.size() && (const char *)iov.back().iov_base + iov.back().iov_len == (const char *)p){
+        iov.back().iov_len += len;      // the newline of one packet and the header of the next
+        return;
+    }
+    struct iovec v;
+    v.iov_base = const_cast<void *>(p);
+    v.iov_len  = len;
+    iov.push_back(v);
+}
+
+void console_splice::text(const char *p,size_t len)
+{
+    memcpy(arena+arena_used,p,len);
+    piece(arena+arena_used,len);
+    arena_used += len;
+}
+
+bool console_splice::print(const std::string &head,const u_char *data,size_t length,const char *tail)
+{
+    size_t tail_len = strlen(tail);
+    if(stable==0 || data < stable || length > stable_len - (size_t)(data - stable)
+       || head.size() + tail_len > ARENA_SIZE){
+        flush();
+        return false;
+    }
+    if(iov.size()+3 > IOV_BATCH || pending >= BYTES_BATCH || arena_used + head.size() + tail_len > ARENA_SIZE){
+        flush();
+    }
+    if(arena==0){
+        void *m = mmap(0,ARENA_SIZE,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+        if(m==MAP_FAILED) return false;
+        arena = (char *)m;
+        arena_used = 0;
+    }
+    text(head.data(),head.size());
+    piece(data,length);
+    pending += length;
+    text(tail,tail_len);
+    return true;
+}
+
+void console_splice::flush()
+{
+    if(iov.size()){
+        fflush(stdout);                 // anything printed through stdio goes first
+#ifdef HAVE_PTHREAD
+        if(semlock){
+            if(sem_wait(semlock)){
+                fprintf(stderr,"%s: attempt to acquire semaphore failed: %s\n",progname,strerror(errno));
+                exit(1);
+            }
+        }
+#endif
+        size_t i = 0;
+        while(i < iov.size()){
+            ssize_t n = copying ? writev(fd,&iov[i],(int)(iov.size()-i)) : vmsplice(fd,&iov[i],iov.size()-i,0);
+            if(n<0){
+                if(errno==EINTR) continue;
+                if(!copying && (errno==EINVAL || errno==ENOSYS)){
+                    copying = true;     // not here; the same pieces, copied by the kernel
+                    continue;
+                }
+                perror(copying ? "writev" : "vmsplice");
+                break;
+            }
+            while(n>0){                 // a pipe that fills up takes part of the batch
+                if((size_t)n >= iov[i].iov_len){
+                    n -= iov[i].iov_len;
+                    i++;
+                } else {
+                    iov[i].iov_base = (char *)iov[i].iov_base + n;
+                    iov[i].iov_len -= n;
+                    n = 0;
+                }
+            }
+        }
+#ifdef HAVE_PTHREAD
+        if(semlock){
+            if(sem_post(semlock)){
+                fprintf(stderr,"%s: attempt to post semaphore failed: %s\n",progname,strerror(errno));
+                exit(1);
+            }
+        }
+#endif
+        iov.clear();
+        pending = 0;
+    }
+    if(arena){
+        munmap(arena,ARENA_SIZE);       // the pipe keeps the pages it was given
+        arena = 0;
+        arena_used = 0;
+    }
+}
+#endif
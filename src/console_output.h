@@ -0,0 +1,155 @@
+/*
+ * console_output.h:
+ *
+ * Rendering of packets for the console (-c, -C, -D, -s).
+ *
+ * print_packet() formats each packet into its demux's console buffer and
+ * writes that with one fwrite(), rather than making a stdio call per byte.
+ * The printable-byte filter for -s checks 16 bytes at a time with SSE2
+ * where the compiler has it, and the hex dump (-D) is built from a table
+ * of digit pairs. The output is byte for byte what it was.
+ *
+ * With -S console_batch=N the packets are written by a console_writer
+ * thread instead. print_packet() formats each packet into a console_chunk
+ * and pushes it onto the writer's queue, which is a lock-free list that
+ * any number of shards may push onto at once. The writer joins up to N
+ * bytes of chunks and writes them with one fwrite() and fflush(), taking
+ * the -L semaphore once for each write rather than for each packet.
+ * A packet is never split between writes, and a flow's packets come out in
+ * the order they were pushed, since each flow is printed by one shard.
+ * N is the most that another process sharing the -L semaphore waits for,
+ * and the most of this one's output that comes between two of its packets.
+ *
+ * With -cB into a pipe, a console_splice hands the payloads to the pipe
+ * with vmsplice() instead of copying them, when they are in the mapping of
+ * the -r file being read: that memory doesn't change while the pipe holds
+ * its pages. The headers and newlines between them are copied into an
+ * arena mapped for each batch and unmapped once the batch is in the pipe,
+ * for the same reason. A batch is written when it has IOV_BATCH pieces,
+ * BYTES_BATCH bytes of payload, or a packet that isn't in the mapping
+ * comes along, and before the file is unmapped. Packets that don't come
+ * from a mapping (live capture, .gz or merged input, -j) are printed as
+ * before. Where vmsplice() isn't supported, the batches go with writev().
+ *
+ * #include this file after tcpflow.h
+ */
+
+#ifndef CONSOLE_OUTPUT_H
+#define CONSOLE_OUTPUT_H
+
+#include <string>
+
+class console_format {
+public:
+    /* -D: offset, hex and ASCII, 32 bytes to a line */
+    static void hex_dump(std::string &out,const u_char *data,size_t length);
+    /* -s: only the printable bytes, newlines and returns */
+    static void printable(std::string &out,const u_char *data,size_t length);
+};
+
+class console_chunk {
+public:
+    console_chunk():next(0),text(){}
+    console_chunk *next;
+    std::string    text;                // one packet, as it is to be printed
+};
+
+#ifdef HAVE_PTHREAD
+#define HAVE_CONSOLE_WRITER
+
+class console_writer {
+    /* These are not implemented */
+    console_writer(const console_writer &);
+    console_writer &operator=(const console_writer &);
+
+    enum { QUEUE_BATCHES=8 };           // put() waits when this many batches are queued
+    enum { QUEUE_MIN=1024*1024 };       // ...or this many bytes, if that is more
+    enum { CHUNK_KEEP=1024*1024 };      // the largest chunk kept for reuse with its buffer
+
+    /* The queue is Vyukov's intrusive MPSC list: producers swap themselves
+     * in at head, and the writer takes chunks from tail.
+     */
+    console_chunk  stub;
+    console_chunk *head;
+    console_chunk *tail;                // the writer's
+    console_chunk *returned;            // written chunks, for get()
+    size_t      batch_max;
+    size_t      queue_max;
+    uint64_t    queued_bytes;           // pushed and not yet written
+    uint64_t    pending;                // chunks pushed and not yet taken by the writer
+    bool        exit_on_error;
+    int         writer_waiting;         // set while the writer sleeps on work
+    int         producers_waiting;      // the put()s sleeping on room
+    bool        stopping;
+    bool        running;
+    std::string batch;
+    pthread_mutex_t lock;
+    pthread_cond_t  work;
+    pthread_cond_t  room;
+    pthread_t   thread;
+
+    console_writer(size_t batch_max,bool exit_on_error);
+    static void *run(void *arg);
+    void        writer_loop();
+    void        push(console_chunk *c);
+    console_chunk *pop();
+    void        write_batch();
+    void        give_back(console_chunk *first,console_chunk *last);
+
+public:
+    /** Returns 0 if the thread can't be started; print synchronously then. */
+    static console_writer *open(size_t batch_max,bool exit_on_error);
+    static void free_chunks(console_chunk *list);
+    virtual ~console_writer();          // stops the thread
+
+    console_chunk *get(console_chunk **spares); // an empty chunk, from the caller's spares if it has any
+    void        put(console_chunk *c);  // queue it to be printed
+    void        stop();                 // print everything queued and stop the thread
+};
+
+#endif
+
+#if defined(HAVE_VMSPLICE) && defined(HAVE_MMAP)
+#define HAVE_CONSOLE_SPLICE
+
+#include <sys/uio.h>
+#include <vector>
+
+class console_splice {
+    /* These are not implemented */
+    console_splice(const console_splice &);
+    console_splice &operator=(const console_splice &);
+
+    enum { IOV_BATCH   = 512,           // pieces handed to each vmsplice()
+           BYTES_BATCH = 1024*1024,     // of payload in a batch
+           ARENA_SIZE  = 64*1024 };     // for a batch's headers and newlines
+    int         fd;
+    const u_char *stable;               // the mapping of the file being read
+    size_t      stable_len;
+    char       *arena;                  // mapped when a batch starts
+    size_t      arena_used;
+    std::vector<struct iovec> iov;
+    size_t      pending;                // payload bytes in iov
+    bool        copying;                // vmsplice() doesn't work on fd; writev() instead
+
+    console_splice(int fd_):fd(fd_),stable(0),stable_len(0),arena(0),arena_used(0),
+                            iov(),pending(0),copying(false){}
+    void        text(const char *p,size_t len); // copied into the arena
+    void        piece(const void *p,size_t len);
+
+public:
+    static console_splice *open(int fd);        // 0 unless fd is a pipe
+    virtual ~console_splice();                  // writes what is batched
+
+    void        input(const u_char *base,size_t len); // where payloads may be spliced from; 0 after the file
+    /**
+     * Batch a packet: head, then the payload, then tail. Returns false if
+     * the payload isn't in the mapping, after writing what is batched, so
+     * that the caller prints the packet itself.
+     */
+    bool        print(const std::string &head,const u_char *data,size_t length,const char *tail);
+    void        flush();
+};
+#endif
+
+#endif
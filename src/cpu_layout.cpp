@@ -0,0 +1,165 @@
+/*
+ * cpu_layout.cpp:
+ *
+ * Pinning threads to CPUs; see cpu_layout.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "cpu_layout.h"
+
+#include <fstream>
+#include <sstream>
+
+#ifdef HAVE_CPU_LAYOUT
+#include <sched.h>
+#endif
+
+#define MAX_NUMA_NODES 256              // node directories looked for in sysfs
+
+/* "0-3,8,10-11", as the kernel and taskset write them */
+static bool parse_cpulist(const std::string &s,std::vector<int> &out)
+{
+    std::stringstream ss(s);
+    std::string range;
+    while(std::getline(ss,range,',')){
+        range.erase(0,range.find_first_not_of(" \t\n"));
+        range.erase(range.find_last_not_of(" \t\n")+1);
+        if(range.size()==0) continue;
+        size_t dash = range.find('-');
+        std::string lo = range.substr(0,dash);
+        std::string hi = dash==std::string::npos ? lo : range.substr(dash+1);
+        if(lo.size()==0 || hi.size()==0 || lo.size()>5 || hi.size()>5 ||
+           lo.find_first_not_of("0123456789")!=std::string::npos ||
+           hi.find_first_not_of("0123456789")!=std::string::npos) return false;
+        int a = atoi(lo.c_str());
+        int b = atoi(hi.c_str());
+        if(b<a) return false;
+        for(int i=a;i<=b;i++) out.push_back(i);
+    }
+    return true;
+}
+
+static std::string read_line(const std::string &fname)
+{
+    std::ifstream in(fname.c_str());
+    std::string line;
+    if(in.is_open()) std::getline(in,line);
+    return line;
+}
+
+static std::string cpus_str(std::vector<int>::const_iterator begin,std::vector<int>::const_iterator end)
+{
+    std::stringstream ss;
+    for(std::vector<int>::const_iterator it=begin;it!=end;it++){
+        if(it!=begin) ss << ",";
+        ss << *it;
+    }
+    return ss.str();
+}
+
+cpu_layout *cpu_layout::open(const std::string &spec,const char *device,uint32_t shards,std::string &err)
+{
+#ifdef HAVE_CPU_LAYOUT
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    if(sched_getaffinity(0,sizeof(mask),&mask)){
+        err = ssprintf("sched_getaffinity: %s",strerror(errno));
+        return 0;
+    }
+    std::vector<int> cpus;
+    if(spec=="auto"){
+        int nic_node = -1;
+        if(device){
+            std::string n = read_line(ssprintf("/sys/class/net/%s/device/numa_node",device));
+            if(n.size()) nic_node = atoi(n.c_str());
+        }
+        std::vector<std::vector<int> > nodes(MAX_NUMA_NODES);
+        for(int i=0;i<MAX_NUMA_NODES;i++){
+            parse_cpulist(read_line(ssprintf("/sys/devices/system/node/node%d/cpulist",i)),nodes[i]);
+        }
+        std::vector<bool> taken(CPU_SETSIZE,false);
+        for(int pass=0;pass<2;pass++){  // the NIC's node, then the others
+            for(int i=0;i<MAX_NUMA_NODES;i++){
+                if((i==nic_node) != (pass==0)) continue;
+                for(std::vector<int>::const_iterator it=nodes[i].begin();it!=nodes[i].end();it++){
+                    if(*it<CPU_SETSIZE && CPU_ISSET(*it,&mask) && !taken[*it]){
+                        cpus.push_back(*it);
+                        taken[*it] = true;
+                    }
+                }
+            }
+        }
+        for(int i=0;i<CPU_SETSIZE;i++){ // on no node sysfs knows of
+            if(CPU_ISSET(i,&mask) && !taken[i]) cpus.push_back(i);
+        }
+        DEBUG(2)("cpus=auto: %s is on NUMA node %d",device ? device : "the input",nic_node);
+    } else {
+        if(!parse_cpulist(spec,cpus)){
+            err = "not a CPU list: " + spec;
+            return 0;
+        }
+        for(std::vector<int>::const_iterator it=cpus.begin();it!=cpus.end();it++){
+            if(*it>=CPU_SETSIZE || !CPU_ISSET(*it,&mask)){
+                err = ssprintf("CPU %d is not one this process may run on",*it);
+                return 0;
+            }
+        }
+    }
+    if(cpus.size()==0){
+        err = "no CPUs in " + spec;
+        return 0;
+    }
+    cpu_layout *l = new cpu_layout(cpus,shards);
+    DEBUG(1)("CPU layout: %s",l->str().c_str());
+    return l;
+#else
+    err = "threads can't be pinned to CPUs on this system";
+    return 0;
+#endif
+}
+
+bool cpu_layout::pin(const std::vector<int> &set)
+{
+#ifdef HAVE_CPU_LAYOUT
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for(std::vector<int>::const_iterator it=set.begin();it!=set.end();it++) CPU_SET(*it,&mask);
+    if(sched_setaffinity(0,sizeof(mask),&mask)==0) return true; // 0 is the calling thread
+    DEBUG(1)("cannot pin a thread to CPU %s: %s",cpus_str(set.begin(),set.end()).c_str(),strerror(errno));
+#endif
+    return false;
+}
+
+void cpu_layout::pin_capture()
+{
+    pin(std::vector<int>(1,cpus[0]));
+}
+
+void cpu_layout::pin_shard(uint32_t index)
+{
+    pin(std::vector<int>(1,cpus[(1+index) % cpus.size()]));
+}
+
+void cpu_layout::pin_worker()
+{
+    size_t used = 1+shards;
+    if(used<cpus.size()) pin(std::vector<int>(cpus.begin()+used,cpus.end()));
+    else pin(cpus);
+}
+
+std::string cpu_layout::str() const
+{
+    std::stringstream ss;
+    ss << "capture on " << cpus[0];
+    if(shards){
+        ss << ", shards on ";
+        for(uint32_t i=0;i<shards;i++) ss << (i ? "," : "") << cpus[(1+i) % cpus.size()];
+    }
+    size_t used = 1+shards;
+    ss << ", post-processing on " << (used<cpus.size() ? cpus_str(cpus.begin()+used,cpus.end())
+                                                        : cpus_str(cpus.begin(),cpus.end()));
+    return ss.str();
+}
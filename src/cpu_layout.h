@@ -0,0 +1,72 @@
+/*
+ * cpu_layout.h:
+ *
+ * Which CPUs tcpflow's threads run on (-S cpus=LIST or -S cpus=auto).
+ *
+ * LIST is a Linux cpulist, "0-3,8,10-11", and hands the CPUs out in the
+ * order it gives them:
+ *
+ *   the first           the capture thread, which reads the packets and
+ *                       runs the master demux
+ *   one each after it   the demux shards of -j, in order; a TPACKET_V3
+ *                       fanout socket's capture thread runs its shard's
+ *                       demux and shares the shard's CPU
+ *   the rest            the post-processing threads (post_workers and
+ *                       scan_threads), free to run on any of them
+ *
+ * A list too short wraps around, and with nothing left over the
+ * post-processing threads may use all of it.
+ *
+ * "auto" makes the list from the sysfs topology: the CPUs of the NUMA node
+ * of the -i device (/sys/class/net/DEV/device/numa_node) first, then those
+ * of the other nodes, leaving out any the process may not run on. The
+ * capture thread and as many shards as fit there share the NIC's node.
+ * Without -i, or without NUMA, it is the CPUs the process may use, in
+ * order.
+ *
+ * A shard's flow table, tcpip arena and write buffers are made on first
+ * use by the shard's own thread, which is pinned before it starts, so
+ * Linux puts their pages on that thread's node; nothing is allocated
+ * with a NUMA policy of its own.
+ *
+ * netviz's threads start with the scanners, before the layout is made,
+ * and aren't pinned.
+ *
+ * #include this file after tcpflow.h
+ */
+
+#ifndef CPU_LAYOUT_H
+#define CPU_LAYOUT_H
+
+#if defined(HAVE_SCHED_H) && defined(HAVE_SCHED_SETAFFINITY)
+#define HAVE_CPU_LAYOUT
+#endif
+
+#include <string>
+#include <vector>
+
+class cpu_layout {
+    /* These are not implemented */
+    cpu_layout(const cpu_layout &);
+    cpu_layout &operator=(const cpu_layout &);
+
+    std::vector<int> cpus;              // in the order they are handed out
+    uint32_t shards;
+    cpu_layout(const std::vector<int> &cpus_,uint32_t shards_):cpus(cpus_),shards(shards_){}
+    static bool pin(const std::vector<int> &set);
+
+public:
+    /** Returns 0 and sets err if spec isn't "auto" or a cpulist of CPUs
+     * the process may use. device may be 0.
+     */
+    static cpu_layout *open(const std::string &spec,const char *device,uint32_t shards,std::string &err);
+    virtual ~cpu_layout(){}
+
+    /* Each pins the calling thread */
+    void pin_capture();
+    void pin_shard(uint32_t index);
+    void pin_worker();
+    std::string str() const;            // for DEBUG
+};
+
+#endif
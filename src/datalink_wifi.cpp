@@ -6,17 +6,13 @@
 
 #include "tcpflow.h"
 #include "datalink_wifi.h"
+#include "wifipcap_decode.h"
 
 /**
  * TFCB --- TCPFLOW callbacks for wifippcap
  */
 
-void TFCB::Handle80211(const WifiPacket &p, u_int16_t fc, const MAC& sa, const MAC& da, const MAC& ra, const MAC& ta, const u_char *ptr, size_t len)
-{
-}
-
 void TFCB::HandleLLC(const WifiPacket &p, const struct llc_hdr_t *hdr, const u_char *rest, size_t len) {
-    sbuf_t sb(pos0_t(),rest,len,len,0);
     struct timeval tv;
     be13::packet_info pi(p.header_type,p.header,p.packet,tvshift(tv,p.header->ts),rest,len);
     be13::plugin::process_packet(pi);
@@ -27,8 +23,161 @@ void TFCB::Handle80211MgmtBeacon(const WifiPacket &p, const mgmt_header_t *hdr,
 #ifdef DEBUG_WIFI
     std::cerr << "  " << "802.11 mgmt: " << hdr->sa << " beacon " << body->ssid.ssid << "\"";
 #endif
-    mac_ssid bcn(hdr->sa,std::string(body->ssid.ssid));
-    mac_to_ssid[bcn] += 1;
+    size_t len = mac_ssid_table::ssid_length(body->ssid.ssid);
+    mac_to_ssid.add(hdr->sa,body->ssid.ssid,len,p.header->ts.tv_sec);
+    mac_ssid_table::entry &last = last_beacon[last_beacon_slot(hdr->sa)];
+    last.key = hdr->sa.val | mac_ssid_table::entry::USED;
+    last.ssid_len = len;
+    memcpy(last.ssid,body->ssid.ssid,len);
+}
+
+bool TFCB::Handle80211MgmtBeaconRepeat(const WifiPacket &p, const mgmt_header_t *hdr, const beacon_seen &seen)
+{
+    const mac_ssid_table::entry &last = last_beacon[last_beacon_slot(hdr->sa)];
+    if(last.key != (hdr->sa.val | mac_ssid_table::entry::USED)) return false; // another MAC's since
+    mac_to_ssid.add(hdr->sa,last.ssid,last.ssid_len,p.header->ts.tv_sec);
+    return true;
+}
+
+/**
+ * mac_ssid_table
+ */
+
+uint64_t mac_ssid_table::hash(uint64_t key,const char *ssid,size_t len)
+{
+    uint64_t h = key * 0x9e3779b97f4a7c15ULL;
+    for(size_t i=0;i<len;i++){
+        h = (h ^ (uint8_t)ssid[i]) * 0x100000001b3ULL;
+    }
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    return h ^ (h >> 32);
+}
+
+bool mac_ssid_table::insert(const entry &e)
+{
+    size_t mask = slots.size()-1;
+    size_t home = hash(e.key,e.ssid,e.ssid_len) & mask;
+    for(size_t i=0;i<PROBES;i++){
+        entry &slot = slots[(home+i) & mask];
+        if(slot.key==0){
+            slot = e;
+            used++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void mac_ssid_table::grow()
+{
+    std::vector<entry> old(slots.size()*2);
+    old.swap(slots);
+    used = 0;
+    for(std::vector<entry>::const_iterator it=old.begin();it!=old.end();it++){
+        if(it->key && !insert(*it)) evict(*it);
+    }
+}
+
+void mac_ssid_table::evict(const entry &e)
+{
+    evicted_entries++;
+    evicted_count += e.count;
+    if(summary_size==0) return;
+    heavy_hitter *least = 0;
+    for(std::vector<heavy_hitter>::iterator it=summary.begin();it!=summary.end();it++){
+        if(it->e.matches(e.key,e.ssid,e.ssid_len)){
+            it->e.count += e.count;
+            it->e.last_seen = std::max(it->e.last_seen,e.last_seen);
+            return;
+        }
+        if(least==0 || it->e.count < least->e.count) least = &*it;
+    }
+    if(summary.size() < summary_size){
+        summary.push_back(heavy_hitter());
+        summary.back().e = e;
+        return;
+    }
+    /* Space-Saving: the new entry takes the place of the least, and may have been it */
+    uint64_t error = least->e.count;
+    least->e = e;
+    least->e.count += error;
+    least->error = error;
+}
+
+void mac_ssid_table::add(const MAC &mac,const char *ssid,size_t ssid_len,uint32_t when)
+{
+    size_t capacity = PROBES;
+    while(capacity < max_entries) capacity *= 2;
+    if(slots.empty()) slots.resize(std::min(capacity,(size_t)256));
+
+    uint64_t key = mac.val | entry::USED;
+    size_t mask = slots.size()-1;
+    size_t home = hash(key,ssid,ssid_len) & mask;
+    for(size_t i=0;i<PROBES;i++){
+        entry &slot = slots[(home+i) & mask];
+        if(slot.matches(key,ssid,ssid_len)){
+            slot.count++;
+            slot.last_seen = when;
+            return;
+        }
+        if(slot.key==0) break;          // nothing is ever removed, so it isn't further on
+    }
+
+    entry e;
+    e.key = key;
+    e.count = 1;
+    e.last_seen = when;
+    e.ssid_len = ssid_len;
+    memcpy(e.ssid,ssid,ssid_len);
+    if(used*4 >= slots.size()*3 && slots.size() < capacity) grow();
+    while(!insert(e)){
+        if(slots.size() < capacity){
+            grow();
+            continue;
+        }
+        mask = slots.size()-1;
+        entry *victim = &slots[home & mask];
+        for(size_t i=1;i<PROBES;i++){
+            entry &slot = slots[(home+i) & mask];
+            if(slot.count < victim->count ||
+               (slot.count == victim->count && slot.last_seen < victim->last_seen)){
+                victim = &slot;
+            }
+        }
+        evict(*victim);
+        *victim = e;
+        return;
+    }
+}
+
+static bool entry_lt(const mac_ssid_table::entry *a,const mac_ssid_table::entry *b)
+{
+    return *a < *b;
+}
+
+void mac_ssid_table::sorted(std::vector<const entry *> &out) const
+{
+    out.clear();
+    for(std::vector<entry>::const_iterator it=slots.begin();it!=slots.end();it++){
+        if(it->key) out.push_back(&*it);
+    }
+    std::sort(out.begin(),out.end(),entry_lt);
+}
+
+static bool heavier(const mac_ssid_table::heavy_hitter *a,const mac_ssid_table::heavy_hitter *b)
+{
+    if(a->e.count != b->e.count) return a->e.count > b->e.count;
+    return a->e < b->e;
+}
+
+void mac_ssid_table::sorted_summary(std::vector<const heavy_hitter *> &out) const
+{
+    out.clear();
+    for(std::vector<heavy_hitter>::const_iterator it=summary.begin();it!=summary.end();it++){
+        out.push_back(&*it);
+    }
+    std::sort(out.begin(),out.end(),heavier);
 }
 
 
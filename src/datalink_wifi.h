@@ -2,48 +2,104 @@
 #define DATALINK_WIFI_H
 
 #include <algorithm>
-#include <map>
+#include <cstring>
+#include <string>
+#include <vector>
 #include "wifipcap.h"
 
 //#define DEBUG_WIFI
 
+/*
+ * The count of beacons for each MAC and SSID, in a table that never grows
+ * past max_entries (rounded up to a power of two), so that a week-long
+ * capture full of made-up MACs takes no more memory than a short one.
+ *
+ * It's open-addressed: an entry is in one of the PROBES slots from where
+ * its MAC and SSID hash to. When those are all taken and the table can't
+ * grow, the one with the fewest beacons, and of those the one seen longest
+ * ago, is evicted for the new one. Evicted entries are added up, and the
+ * heaviest of them kept in a Space-Saving summary of summary_size, each
+ * of whose counts is over by at most its error.
+ */
+class mac_ssid_table {
+public:
+    struct entry {
+        static const uint64_t USED = 1ULL<<48;
+        entry():key(),count(),last_seen(),ssid_len(),ssid(){}
+        uint64_t key;                   // the MAC's 48 bits, and USED; 0 for a free slot
+        uint64_t count;
+        uint32_t last_seen;             // seconds
+        uint8_t  ssid_len;
+        char     ssid[32];
+
+        MAC         mac() const { return MAC(key & (USED-1)); }
+        std::string get_ssid() const { return std::string(ssid,ssid_len); }
+        bool matches(uint64_t key_,const char *ssid_,size_t len_) const {
+            return key==key_ && ssid_len==len_ && memcmp(ssid,ssid_,len_)==0;
+        }
+        bool operator<(const entry &b) const {
+            if (key != b.key) return key < b.key;
+            return get_ssid() < b.get_ssid();
+        }
+    };
+    struct heavy_hitter {
+        heavy_hitter():e(),error(){}
+        entry    e;
+        uint64_t error;
+    };
+
+    mac_ssid_table():max_entries(65536),summary_size(32),slots(),used(),summary(),
+                     evicted_entries(),evicted_count(){}
+    uint32_t max_entries;               // set these before the first add()
+    uint32_t summary_size;
+
+    /** the length of a NUL-terminated SSID, as the table keeps it */
+    static size_t ssid_length(const char *ssid) { return strnlen(ssid,sizeof(entry().ssid)); }
+    void add(const MAC &mac,const char *ssid,size_t ssid_len,uint32_t when);
+    void sorted(std::vector<const entry *> &out) const; // by MAC and SSID
+    void sorted_summary(std::vector<const heavy_hitter *> &out) const; // most beacons first
+    uint64_t evicted() const { return evicted_entries; }
+    uint64_t evicted_beacons() const { return evicted_count; }
+
+private:
+    static const size_t PROBES = 16;
+    std::vector<entry> slots;
+    size_t   used;
+    std::vector<heavy_hitter> summary;
+    uint64_t evicted_entries;
+    uint64_t evicted_count;
+
+    static uint64_t hash(uint64_t key,const char *ssid,size_t len);
+    bool insert(const entry &e);        // false if its slots are all taken
+    void grow();
+    void evict(const entry &e);
+};
+
 class TFCB : public WifipcapCallbacks {
 private:
+    /* the SSID each MAC last beaconed, to count repeats of the beacon under */
+    static const size_t LAST_BEACONS = 1024;
+    mac_ssid_table::entry last_beacon[LAST_BEACONS];
+    static size_t last_beacon_slot(const MAC &mac) { return mac.hash() >> 54; }
 
 public:
     bool opt_check_fcs;
-
-    typedef struct mac_ssid {
-        mac_ssid(const MAC &mac_,const std::string &ssid_):mac(mac_),ssid(ssid_){}
-        const MAC mac;
-        const std::string ssid;
-        bool operator<(const struct mac_ssid &b) const{
-            if (mac < b.mac) return true;
-            if (b.mac < mac) return false;
-            return ssid < b.ssid;
-        };
-    } mac_ssid_t;
-
-    typedef struct {
-        bool operator() (const struct mac_ssid &a, const struct mac_ssid &b) const {
-            if (a.mac < b.mac) return true;
-            if (b.mac < a.mac) return false;
-            return a.ssid < b.ssid;
-        }
-    } mac_ssid_lt;
-    typedef std::set<mac_ssid_t,mac_ssid_lt> mac_ssid_set_t;
-    typedef std::map<mac_ssid_t,uint64_t> mac_ssid_map_t;
-    mac_ssid_map_t mac_to_ssid;        // mapping of macs to SSIDs
+    mac_ssid_table mac_to_ssid;        // mapping of macs to SSIDs
 
     static TFCB   theTFCB;
-    TFCB():opt_check_fcs(true),mac_to_ssid(){}
+    TFCB():last_beacon(),opt_check_fcs(true),mac_to_ssid(){}
 
-    virtual bool Check80211FCS(const WifiPacket &p) { return opt_check_fcs; }  
-    virtual void Handle80211(const WifiPacket &p,u_int16_t fc, const MAC& sa, const MAC& da,
-                             const MAC& ra, const MAC& ta, const u_char *ptr, size_t len)  ;
+    /* Wifipcap decodes for TFCB itself (see wifipcap_decode.h), so the
+     * handlers not declared here cost nothing; don't derive from TFCB.
+     */
+    virtual bool Check80211FCS(const WifiPacket &p) { return opt_check_fcs; }
+    virtual bool Check80211FCSIfHandled(const WifiPacket &p) { return true; }
+    virtual u_int32_t Mgmt80211Elements(const WifiPacket &p) { return 1<<E_SSID; }
+    virtual bool Dedup80211Beacons(const WifiPacket &p) { return true; }
 
     void HandleLLC(const WifiPacket &p,const struct llc_hdr_t *hdr, const u_char *rest, size_t len) ;
     void Handle80211MgmtBeacon(const WifiPacket &p,const mgmt_header_t *hdr, const mgmt_body_t *body) ;
+    bool Handle80211MgmtBeaconRepeat(const WifiPacket &p,const mgmt_header_t *hdr, const beacon_seen &seen) ;
 };
 
 #endif
@@ -0,0 +1,139 @@
+/*
+ * demux_bench.cpp:
+ *
+ * A throughput benchmark for the demultiplexer; see demux_bench.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "demux_bench.h"
+
+#include <sys/resource.h>
+
+#ifndef DLT_LINUX_SLL
+#define DLT_LINUX_SLL 113
+#endif
+#ifndef DLT_LOOP
+#define DLT_LOOP 108
+#endif
+
+/* static */ int32_t demux_bench::ip_offset(int dlt,const u_char *p,uint32_t caplen)
+{
+    uint32_t off = 0;
+    switch(dlt){
+    case DLT_EN10MB: {
+        uint32_t type_at = 12;
+        while(caplen >= type_at+2){
+            uint16_t type = (p[type_at]<<8) | p[type_at+1];
+            if(type!=0x8100 && type!=0x88a8) break;
+            type_at += 4;               // a VLAN tag
+        }
+        off = type_at + 2;
+        break;
+    }
+    case 12: case 14: case 101:         // DLT_RAW; see datalink.cpp
+        off = 0;
+        break;
+    case DLT_NULL:
+    case DLT_LOOP:
+        off = 4;
+        break;
+    case DLT_LINUX_SLL:
+        off = 16;
+        break;
+    default:
+        return -1;
+    }
+    if(caplen > off && (p[off]>>4)==4 && caplen >= off+20) return (int32_t)off;
+    if(caplen > off && (p[off]>>4)==6 && caplen >= off+40) return (int32_t)off;
+    return -1;
+}
+
+/* static */ void demux_bench::collect(u_char *user,const struct pcap_pkthdr *h,const u_char *p)
+{
+    demux_bench *b = (demux_bench *)user;
+    b->packets.push_back(packet(*h,b->data.size(),b->loading_dlt,ip_offset(b->loading_dlt,p,h->caplen)));
+    b->data.insert(b->data.end(),p,p+h->caplen);
+    b->bytes += h->caplen;
+}
+
+bool demux_bench::load(pcap_t *pd,std::string &errmsg)
+{
+    loading_dlt = pcap_datalink(pd);
+    if(pcap_loop(pd,-1,collect,(u_char *)this) == -1){
+        errmsg = pcap_geterr(pd);
+        return false;
+    }
+    return true;
+}
+
+/* XOR the pass into the middle of each address, the same for both directions of a flow */
+void demux_bench::mark(uint16_t pass)
+{
+    uint16_t x = applied ^ pass;
+    applied = pass;
+    if(x==0) return;
+    u_char hi = (u_char)(x>>8), lo = (u_char)x;
+    for(std::vector<packet>::const_iterator it=packets.begin();it!=packets.end();it++){
+        if(it->ip<0) continue;
+        u_char *ip = &data[it->offset + it->ip];
+        if((ip[0]>>4)==4){
+            ip[13] ^= hi; ip[14] ^= lo;     // source, then destination
+            ip[17] ^= hi; ip[18] ^= lo;
+        } else {
+            ip[10] ^= hi; ip[11] ^= lo;
+            ip[26] ^= hi; ip[27] ^= lo;
+        }
+    }
+}
+
+void demux_bench::run(tcpdemux &demux)
+{
+    if(packets.empty()) return;
+    data.insert(data.end(),PAD,0);
+    time_t first = packets[0].h.ts.tv_sec, last = first;
+    for(std::vector<packet>::const_iterator it=packets.begin();it!=packets.end();it++){
+        if(it->h.ts.tv_sec < first) first = it->h.ts.tv_sec;
+        if(it->h.ts.tv_sec > last)  last  = it->h.ts.tv_sec;
+    }
+    time_t span = last - first + 1;
+    DEBUG(2)("bench: %u passes of %u packets",(unsigned)loops,(unsigned)packets.size());
+
+    start_usec = perf_counters::now_usec();
+    int dlt = -1;
+    pcap_handler handler = 0;
+    for(uint32_t pass=0;pass<loops;pass++){
+        mark((uint16_t)pass);
+        for(std::vector<packet>::const_iterator it=packets.begin();it!=packets.end();it++){
+            if(it->dlt != dlt){
+                dlt = it->dlt;
+                demux.set_datalink(dlt);
+                handler = find_handler(dlt,"bench");
+            }
+            struct pcap_pkthdr h = it->h;
+            h.ts.tv_sec += pass*span;
+            (*handler)((u_char *)&demux,&h,&data[it->offset]);
+        }
+    }
+    demux.flush_shards();
+}
+
+void demux_bench::finish(tcpdemux &demux)
+{
+    double secs = (perf_counters::now_usec() - start_usec) / 1000000.0;
+    if(secs<=0) secs = 0.000001;
+    uint64_t total_packets = (uint64_t)packets.size() * loops;
+    uint64_t total_bytes = bytes * loops;
+    struct rusage ru;
+    memset(&ru,0,sizeof(ru));
+    getrusage(RUSAGE_SELF,&ru);         // ru_maxrss is in KiB on Linux and the BSDs, bytes on OS X
+    fprintf(stderr,"%s: bench: %u passes, %" PRIu64 " packets, %" PRIu64 " bytes in %.3f s\n",
+            progname,(unsigned)loops,total_packets,total_bytes,secs);
+    fprintf(stderr,"%s: bench: %.0f packets/s, %.2f MB/s, peak RSS %ld KiB\n",
+            progname,total_packets/secs,total_bytes/secs/1000000.0,(long)ru.ru_maxrss);
+    fprintf(stderr,"%s: bench: %s\n",progname,demux.perf_totals().line().c_str());
+}
@@ -0,0 +1,70 @@
+/*
+ * demux_bench.h:
+ *
+ * A throughput benchmark for the demultiplexer (-S bench_loops=N), so
+ * that releases can be compared on the same hardware with more packets
+ * than the captures in tests/ have.
+ *
+ * The -r and -R files are read into memory first, through libpcap and the
+ * filter, so that what is timed is tcpflow's work and not the reading.
+ * Then the packets are handed to their datalink handlers N times over, as
+ * process_infile() hands them, and from there to tcpdemux::process_pkt().
+ * Each pass after the first XORs the pass number into both addresses of
+ * the IPv4 and IPv6 packets, so that it makes new flows rather than
+ * retransmissions of the last pass's, and moves the timestamps past the
+ * end of the last pass. Packets of other datalinks are replayed as they
+ * are.
+ *
+ * Where the output goes is up to the other options: -c with stdout on
+ * /dev/null, -o on a tmpfs or on a disk, with -a, -e netviz and so on;
+ * "make benchdemux" runs a few. Once the flows are closed, finish() prints
+ * the packets and bytes per second, the peak RSS and the perf_counters to
+ * stderr.
+ *
+ * #include this file after tcpdemux.h
+ */
+
+#ifndef DEMUX_BENCH_H
+#define DEMUX_BENCH_H
+
+#include <string>
+#include <vector>
+
+class demux_bench {
+    /* These are not implemented */
+    demux_bench(const demux_bench &);
+    demux_bench &operator=(const demux_bench &);
+
+    enum { PAD = 4096 };                // zeros after the last packet, for decoders that look past caplen
+    struct packet {
+        packet(const struct pcap_pkthdr &h_,size_t offset_,int dlt_,int32_t ip_):
+            h(h_),offset(offset_),dlt(dlt_),ip(ip_){}
+        struct pcap_pkthdr h;
+        size_t  offset;                 // of its data in data
+        int     dlt;
+        int32_t ip;                     // offset of its IP header; -1 if it has none we know of
+    };
+    uint32_t    loops;
+    std::vector<u_char> data;
+    std::vector<packet> packets;
+    uint64_t    bytes;
+    int         loading_dlt;
+    uint16_t    applied;                // what is XORed into the addresses now
+    uint64_t    start_usec;
+
+    static void collect(u_char *user,const struct pcap_pkthdr *h,const u_char *p);
+    static int32_t ip_offset(int dlt,const u_char *p,uint32_t caplen);
+    void        mark(uint16_t pass);    // make the addresses those of pass
+
+public:
+    demux_bench(uint32_t loops_):loops(loops_),data(),packets(),bytes(0),loading_dlt(0),
+                                 applied(0),start_usec(0){}
+    virtual ~demux_bench(){}
+
+    /** Read the rest of pd's packets; its filter must be set. False if it can't be read. */
+    bool        load(pcap_t *pd,std::string &errmsg);
+    void        run(tcpdemux &demux);   // every pass; the clock starts here
+    void        finish(tcpdemux &demux); // after close_all_fd() and flush_scans(); prints the results
+};
+
+#endif
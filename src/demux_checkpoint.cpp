@@ -0,0 +1,384 @@
+/*
+ * demux_checkpoint.cpp:
+ *
+ * Demultiplexer state saved at exit and restored by the next run; see
+ * demux_checkpoint.h
+ *
+ * The file is:
+ *   MAGIC, VERSION (4), next flow id (8), packet counter (8),
+ *   the number of flows (8) and of saved flows (8),
+ *   each flow, then each saved flow, oldest first.
+ * An address is its family (1: 4 or 6), source and destination (16 each)
+ * and ports (2 each); a string its length (4) and bytes; a time seconds (8)
+ * and microseconds (4). A list of segment digests is its count (4), then
+ * offset (8), digest (8) and length (4) for each.
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "flow_gzip.h"
+#include "demux_checkpoint.h"
+
+const char demux_checkpoint::MAGIC[8] = {'T','C','P','F','L','C','K','P'};
+
+namespace {
+    /* A record at a time, into a buffer that is then written out */
+    class writer {
+        writer(const writer &);
+        writer &operator=(const writer &);
+    public:
+        FILE *f;
+        std::string rec;
+        bool ok;
+        writer(FILE *f_):f(f_),rec(),ok(true){}
+
+        void put(uint64_t v,int n){
+            for(int i=0;i<n;i++) rec.push_back((char)(uint8_t)(v >> (8*i)));
+        }
+        void bytes(const void *p,size_t n){ rec.append((const char *)p,n); }
+        void str(const std::string &s){
+            put(s.size(),4);
+            rec.append(s);
+        }
+        void time(const struct timeval &tv){
+            put((uint64_t)(int64_t)tv.tv_sec,8);
+            put((uint64_t)tv.tv_usec,4);
+        }
+        void addr(const flow_addr &a){
+            put(a.family==AF_INET6 ? 6 : 4,1);
+            bytes(a.src.addr,16);
+            bytes(a.dst.addr,16);
+            put(a.sport,2);
+            put(a.dport,2);
+        }
+        void digests(const segment_index &d){
+            put(d.segments.size(),4);
+            for(std::vector<segment_index::segment>::const_iterator it=d.segments.begin();it!=d.segments.end();it++){
+                put(it->offset,8);
+                put(it->digest,8);
+                put(it->length,4);
+            }
+        }
+        void end_record(){
+            if(rec.size() && fwrite(rec.data(),rec.size(),1,f)!=1) ok = false;
+            rec.clear();
+        }
+    };
+
+    class reader {
+        reader(const reader &);
+        reader &operator=(const reader &);
+    public:
+        FILE *f;
+        bool ok;                        // false once the file ends early
+        reader(FILE *f_):f(f_),ok(true){}
+
+        void bytes(void *p,size_t n){
+            if(ok && n && fread(p,n,1,f)!=1) ok = false;
+            if(!ok) memset(p,0,n);
+        }
+        uint64_t get(int n){
+            uint8_t b[8];
+            bytes(b,n);
+            uint64_t v = 0;
+            for(int i=n-1;i>=0;i--) v = (v<<8) | b[i];
+            return v;
+        }
+        std::string str(){
+            size_t n = (size_t)get(4);
+            std::string s;
+            if(n > 65536) ok = false;   // no pathname is this long
+            if(!ok) return s;
+            s.resize(n);
+            if(n) bytes(&s[0],n);
+            return s;
+        }
+        struct timeval time(){
+            struct timeval tv;
+            tv.tv_sec  = (time_t)(int64_t)get(8);
+            tv.tv_usec = (suseconds_t)get(4);
+            return tv;
+        }
+        flow_addr addr(){
+            flow_addr a;
+            a.family = get(1)==6 ? AF_INET6 : AF_INET;
+            bytes(a.src.addr,16);
+            bytes(a.dst.addr,16);
+            a.sport = (uint16_t)get(2);
+            a.dport = (uint16_t)get(2);
+            return a;
+        }
+        void digests(segment_index &d){
+            uint32_t n = (uint32_t)get(4);
+            d.segments.clear();
+            for(uint32_t i=0;i<n && ok;i++){
+                segment_index::segment s;
+                s.offset = get(8);
+                s.digest = get(8);
+                s.length = (uint32_t)get(4);
+                d.segments.push_back(s);
+            }
+        }
+    };
+}
+
+static void write_flow(writer &w,const tcpip &tcp)
+{
+    const flow &f = tcp.myflow;
+    w.addr(f);
+    w.put(f.id,8);
+    w.put((uint32_t)f.vlan,4);
+    w.bytes(f.mac_daddr,6);
+    w.bytes(f.mac_saddr,6);
+    w.time(f.tstart);
+    w.time(f.tlast);
+    w.put(f.packet_count,8);
+
+    w.put(tcp.dir,1);
+    w.put(tcp.isn,4);
+    w.put(tcp.nsn,4);
+    w.put(tcp.syn_count,4);
+    w.put(tcp.fin_count,4);
+    w.put(tcp.fin_size,4);
+    w.put(tcp.pos,8);
+    w.str(tcp.flow_pathname);
+    w.put(tcp.file_created,1);
+    w.put(tcp.track_seen,1);
+    w.put(tcp.last_byte,8);
+    w.put(tcp.last_packet_number,8);
+    w.put(tcp.out_of_order_count,8);
+    w.put(tcp.violations,8);
+    w.put(tcp.sample_rate,4);
+    w.put(tcp.wend,8);
+    w.put(tcp.pindex!=0,1);
+    if(tcp.pindex){
+        w.put(tcp.pindex->last_offset,8);
+        w.put(tcp.pindex->sorted,1);
+        w.put(tcp.pindex->created,1);
+    }
+    w.put(tcp.gz!=0,1);
+
+    recon_set::ranges_t ranges;
+    if(tcp.track_seen) tcp.seen.get_ranges(ranges);
+    w.put(ranges.size(),4);
+    for(recon_set::ranges_t::const_iterator it=ranges.begin();it!=ranges.end();it++){
+        w.put(it->start,8);
+        w.put(it->end,8);
+    }
+    w.digests(tcp.digests);
+    w.end_record();
+}
+
+static bool read_flow(reader &r,tcpdemux &demux,std::string &errmsg)
+{
+    flow_addr addr = r.addr();
+    uint64_t id = r.get(8);
+    int32_t vlan = (int32_t)r.get(4);
+    uint8_t mac_daddr[6],mac_saddr[6];
+    r.bytes(mac_daddr,6);
+    r.bytes(mac_saddr,6);
+    struct timeval tstart = r.time();
+    struct timeval tlast  = r.time();
+    uint64_t packet_count = r.get(8);
+    tcpip::dir_t dir = (tcpip::dir_t)r.get(1);
+    be13::tcp_seq isn = (be13::tcp_seq)r.get(4);
+    if(!r.ok) return false;
+
+    tcpdemux *d = demux.demux_for(addr);
+    if(d->find_tcpip(addr)){
+        errmsg = "the flow " + addr.str() + " is in it twice";
+        return false;
+    }
+    be13::packet_info pi(DLT_NULL,0,0,tstart,0,0); // the flow's first packet is long gone
+    tcpip *tcp = new(d->tcpip_pool.allocate()) tcpip(*d,addr,id,pi,isn);
+    tcp->myflow.vlan = vlan;
+    memcpy(tcp->myflow.mac_daddr,mac_daddr,6);
+    memcpy(tcp->myflow.mac_saddr,mac_saddr,6);
+    tcp->myflow.tlast = tlast;
+    tcp->myflow.packet_count = packet_count;
+    tcp->dir       = dir;
+    tcp->nsn       = (be13::tcp_seq)r.get(4);
+    tcp->syn_count = (uint32_t)r.get(4);
+    tcp->fin_count = (uint32_t)r.get(4);
+    tcp->fin_size  = (uint32_t)r.get(4);
+    tcp->pos       = r.get(8);
+    tcp->flow_pathname = r.str();
+    tcp->file_created  = r.get(1)!=0;
+    tcp->track_seen    = r.get(1)!=0;
+    tcp->last_byte          = r.get(8);
+    tcp->last_packet_number = r.get(8);
+    tcp->out_of_order_count = r.get(8);
+    tcp->violations         = r.get(8);
+    tcp->sample_rate        = (uint32_t)r.get(4);
+    tcp->wend               = r.get(8);
+    if(r.get(1)){
+        tcp->pindex = new packet_index();
+        tcp->pindex->last_offset = r.get(8);
+        tcp->pindex->sorted  = r.get(1)!=0;
+        tcp->pindex->created = r.get(1)!=0;
+    }
+    bool compressed = r.get(1)!=0;
+    uint32_t nranges = (uint32_t)r.get(4);
+    for(uint32_t i=0;i<nranges && r.ok;i++){
+        uint64_t start = r.get(8);
+        uint64_t end   = r.get(8);
+        tcp->seen.insert(start,end);
+    }
+    r.digests(tcp->digests);
+
+    if(d->flow_map.capacity()==0) d->flow_map.reserve(d->opt.flow_table_size);
+    d->flow_map.insert(addr,tcp);      // so that a failure below still leaves it to be freed
+    d->pair(tcp);
+    if(!r.ok) return false;
+    if(compressed){
+        /* the blocks' places were in the earlier run's memory; find them again */
+        tcp->gz = new flow_gzip(*d->gzip());
+        int fd = ::open(tcp->flow_pathname.c_str(),O_RDONLY|O_BINARY);
+        bool found = fd>=0 && tcp->gz->resume(fd);
+        if(fd>=0) close(fd);
+        if(!found){
+            errmsg = tcp->flow_pathname + ": not a complete compressed flow file";
+            return false;
+        }
+    }
+    if(tcpdemux::tcp_timeout) d->expiry.schedule(tcp,tlast.tv_sec + tcpdemux::tcp_timeout + 1);
+    return true;
+}
+
+/* static */ bool demux_checkpoint::save(tcpdemux &demux,const std::string &path,std::string &errmsg)
+{
+    if(demux.container){
+        errmsg = "flows in segment files (-S segment_mb) can't be checkpointed";
+        return false;
+    }
+    std::string tmp = path + ".tmp";    // so that a failed run leaves the old checkpoint
+    FILE *f = fopen(tmp.c_str(),"wb");
+    if(f==0){
+        errmsg = tmp + ": " + strerror(errno);
+        return false;
+    }
+    std::vector<tcpdemux *> demuxes;
+    demux.flow_demuxes(demuxes);
+    uint64_t next_id = 0;
+    uint64_t flows = 0;
+    uint64_t saved = 0;
+    for(std::vector<tcpdemux *>::const_iterator it=demuxes.begin();it!=demuxes.end();it++){
+        next_id = std::max(next_id,(*it)->flow_counter * (*it)->shard_count); // above every id it gave
+        flows += (*it)->flow_map.size();
+        saved += (*it)->saved_flows.size();
+    }
+    writer w(f);
+    w.bytes(MAGIC,sizeof(MAGIC));
+    w.put(VERSION,4);
+    w.put(next_id,8);
+    w.put(demux.packet_counter,8);      // stop_shards() has added up the shards'
+    w.put(flows,8);
+    w.put(saved,8);
+    w.end_record();
+
+    for(std::vector<tcpdemux *>::const_iterator it=demuxes.begin();it!=demuxes.end();it++){
+        tcpdemux *d = *it;
+        std::vector<tcpip *> open;
+        d->flow_map.values(open);
+        for(std::vector<tcpip *>::const_iterator t=open.begin();t!=open.end();t++){
+            tcpip *tcp = *t;
+            tcp->close_file();          // writes what it holds, as when the fd is needed
+            write_flow(w,*tcp);
+            d->expiry.cancel(tcp);
+            tcp->~tcpip();
+            d->tcpip_pool.release(tcp);
+        }
+        d->flow_map.clear();
+        d->drain_writes(-1);
+    }
+    for(std::vector<tcpdemux *>::const_iterator it=demuxes.begin();it!=demuxes.end();it++){
+        const saved_flow_ring &ring = (*it)->saved_flows;
+        for(size_t i=0;i<ring.size();i++){
+            const saved_flow &sf = ring.at(i);
+            w.addr(sf.key.addr());
+            w.put(sf.isn,4);
+            w.str(ring.filename(sf));
+            w.digests(sf.digests);
+            w.end_record();
+        }
+    }
+    bool ok = w.ok;
+    if(fclose(f)) ok = false;
+    if(!ok){
+        errmsg = tmp + ": " + strerror(errno);
+        unlink(tmp.c_str());
+        return false;
+    }
+    if(rename(tmp.c_str(),path.c_str())){
+        errmsg = path + ": " + strerror(errno);
+        return false;
+    }
+    DEBUG(2)("checkpoint %s: %" PRIu64 " open flows, %" PRIu64 " saved flows",path.c_str(),flows,saved);
+    return true;
+}
+
+/* static */ bool demux_checkpoint::load(tcpdemux &demux,const std::string &path,std::string &errmsg)
+{
+    if(demux.container){
+        errmsg = "flows can't be restored into segment files (-S segment_mb)";
+        return false;
+    }
+    FILE *f = fopen(path.c_str(),"rb");
+    if(f==0){
+        errmsg = path + ": " + strerror(errno);
+        return false;
+    }
+    reader r(f);
+    char magic[sizeof(MAGIC)];
+    r.bytes(magic,sizeof(magic));
+    uint32_t version = (uint32_t)r.get(4);
+    if(!r.ok || memcmp(magic,MAGIC,sizeof(MAGIC))!=0 || version!=VERSION){
+        fclose(f);
+        errmsg = path + ": not a tcpflow checkpoint, or from another version";
+        return false;
+    }
+    uint64_t next_id = r.get(8);
+    uint64_t packets = r.get(8);
+    uint64_t flows   = r.get(8);
+    uint64_t saved   = r.get(8);
+    bool ok = r.ok;
+    for(uint64_t i=0;i<flows && ok;i++){
+        ok = read_flow(r,demux,errmsg);
+    }
+    for(uint64_t i=0;i<saved && ok;i++){
+        flow_addr addr = r.addr();
+        be13::tcp_seq isn = (be13::tcp_seq)r.get(4);
+        std::string name = r.str();
+        segment_index digests;
+        r.digests(digests);
+        ok = r.ok;
+        if(!ok) break;
+        tcpdemux *d = demux.demux_for(addr);
+        if(d->saved_flows.capacity()!=tcpdemux::max_saved_flows) d->saved_flows.reserve(tcpdemux::max_saved_flows);
+        d->saved_flows.save(addr,isn,name,digests);
+    }
+    fclose(f);
+    if(!ok){
+        if(errmsg.empty()) errmsg = path + ": the file ends early";
+        else errmsg = path + ": " + errmsg;
+        return false;
+    }
+
+    /* New flows are numbered after the restored ones, and their packets after theirs */
+    std::vector<tcpdemux *> demuxes;
+    demux.flow_demuxes(demuxes);
+    for(std::vector<tcpdemux *>::const_iterator it=demuxes.begin();it!=demuxes.end();it++){
+        (*it)->flow_counter   = (next_id + (*it)->shard_count - 1) / (*it)->shard_count;
+        (*it)->packet_counter = packets;
+    }
+    if(demuxes[0]!=&demux){
+        /* stop_shards() adds the shards' counts to ours; count the earlier runs' packets once */
+        demux.packet_counter = packets - packets * demuxes.size();
+    }
+    DEBUG(2)("restored %s: %" PRIu64 " open flows, %" PRIu64 " saved flows",path.c_str(),flows,saved);
+    return true;
+}
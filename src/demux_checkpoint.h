@@ -0,0 +1,55 @@
+/*
+ * demux_checkpoint.h:
+ *
+ * The demultiplexer's state carried from one run to the next, so that a
+ * capture rotated into several files can be processed a file at a time
+ * and the flows that span two files still come out whole.
+ *
+ * With -S checkpoint=FILE, the flows still open when the input ends are
+ * not finished. Their files are closed as though we had run out of fds,
+ * and what the tcpip needs in order to carry on is written to FILE:
+ * its addresses and times, ISN and NSN, where it is written and how much
+ * of it has been seen. The saved flows (for matching stragglers) and the
+ * flow and packet counters go too. None of them appear in report.xml.
+ *
+ * With -S restore=FILE, those flows are made again before the first
+ * packet, each on the shard that will see its packets, and carry on as
+ * though the files had been read in one run. The number of shards (-j)
+ * may differ from the run that wrote the checkpoint.
+ *
+ * What is in memory only is not kept: an http_stream or flow_hash a flow
+ * had is dropped, and scan_http and scan_md5 read its file back when it
+ * is finished. Held and queued data is written to the file first, as for
+ * any flow whose file is closed. Flows in segment files (-S segment_mb)
+ * can't be carried over.
+ *
+ * The file is a header, then the flows and the saved flows, in fixed-width
+ * little-endian fields; see demux_checkpoint.cpp.
+ *
+ * #include this file after tcpdemux.h
+ */
+
+#ifndef DEMUX_CHECKPOINT_H
+#define DEMUX_CHECKPOINT_H
+
+#include <string>
+
+class demux_checkpoint {
+    /* These are not implemented */
+    demux_checkpoint();
+    demux_checkpoint(const demux_checkpoint &);
+    demux_checkpoint &operator=(const demux_checkpoint &);
+
+public:
+    enum { VERSION = 2 };
+    static const char MAGIC[8];
+    /**
+     * Write the flows still open in demux, and its saved flows, to path.
+     * Call after stop_shards(); the flows are closed and forgotten.
+     */
+    static bool save(tcpdemux &demux,const std::string &path,std::string &errmsg);
+    /** Make the flows saved in path again; after start_shards() and before the first packet. */
+    static bool load(tcpdemux &demux,const std::string &path,std::string &errmsg);
+};
+
+#endif
@@ -0,0 +1,103 @@
+/*
+ * dir_cache.cpp:
+ *
+ * Flow files opened through held directories; see dir_cache.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "dir_cache.h"
+
+#if defined(HAVE_OPENAT) && defined(O_DIRECTORY)
+#define HAVE_DIR_CACHE
+#endif
+
+#ifdef O_PATH
+# define DIR_OPEN_MODE (O_PATH | O_DIRECTORY)
+#else
+# define DIR_OPEN_MODE (O_RDONLY | O_DIRECTORY)
+#endif
+
+/* static */ uint64_t dir_cache::hash_of(const char *s,size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL; // FNV-1a
+    for(size_t i=0;i<len;i++){
+        h ^= (uint8_t)s[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* The fd of the directory path[0,slash), opening it if it isn't held */
+int dir_cache::dir_fd(const std::string &path,size_t slash,size_t capacity)
+{
+    clock++;
+    const char *p = path.c_str();
+    uint64_t h = hash_of(p,slash);
+    for(size_t n=0;n<entries.size();n++){
+        size_t i = (last+n) % entries.size(); // last first
+        entry &e = entries[i];
+        if(e.hash==h && e.dir.size()==slash && memcmp(e.dir.data(),p,slash)==0){
+            e.used = clock;
+            last = i;
+            nhits++;
+            return e.fd;
+        }
+    }
+    nmisses++;
+    std::string dir(path,0,slash);
+    int fd = ::open(dir.c_str(),DIR_OPEN_MODE);
+    if(fd<0) return -1;
+    size_t i = entries.size();
+    if(i<capacity){
+        entries.push_back(entry());
+    } else {
+        i = 0;                          // the least recently used
+        for(size_t j=1;j<entries.size();j++){
+            if(entries[j].used < entries[i].used) i = j;
+        }
+        ::close(entries[i].fd);
+    }
+    entry &e = entries[i];
+    e.dir  = dir;
+    e.hash = h;
+    e.fd   = fd;
+    e.used = clock;
+    last = i;
+    return fd;
+}
+
+void dir_cache::forget(size_t i)
+{
+    ::close(entries[i].fd);
+    entries[i] = entries.back();
+    entries.pop_back();
+    last = 0;
+}
+
+int dir_cache::open(const std::string &path,int oflag,int mode,size_t capacity)
+{
+#ifdef HAVE_DIR_CACHE
+    size_t slash = path.rfind('/');
+    if(capacity>0 && slash!=std::string::npos && slash>0){
+        int dfd = dir_fd(path,slash,capacity);
+        if(dfd>=0){
+            int fd = ::openat(dfd,path.c_str()+slash+1,oflag,mode);
+            if(fd>=0 || errno!=ENOENT) return fd;
+            forget(last);               // the directory may have been removed since we opened it
+        }
+    }
+#endif
+    return ::open(path.c_str(),oflag,mode); // and errno is what the caller expects
+}
+
+void dir_cache::clear()
+{
+    for(std::vector<entry>::const_iterator it=entries.begin();it!=entries.end();it++){
+        ::close(it->fd);
+    }
+    entries.clear();
+    last = 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * dir_cache.h:
+ *
+ * The directories flow files were last opened in, each held open, so a
+ * flow file is opened with openat() on its directory and its own name
+ * rather than with its whole path.
+ *
+ * With -Fk/-Fm/-Fg every flow file is a few directories down, and every
+ * open, including each reopen of a flow whose fd was closed to make room
+ * for another, has the kernel walk the path again from the working
+ * directory. The flows of a bin share one directory, so a few held
+ * directories resolve nearly every open to a single lookup, and the walk
+ * no longer contends on the parents shared by the shards.
+ *
+ * The directories are opened with O_PATH where there is one, so they are
+ * only a handle. The cache holds at most capacity of them and closes the
+ * least recently used when it needs room; with a capacity of 0, or
+ * without openat(), open() is plain ::open(). Each demux has its own
+ * cache, used only by its own thread.
+ *
+ * #include this file after tcpflow.h
+ */
+
+#ifndef DIR_CACHE_H
+#define DIR_CACHE_H
+
+#include <string>
+#include <vector>
+
+class dir_cache {
+    /* These are not implemented */
+    dir_cache(const dir_cache &);
+    dir_cache &operator=(const dir_cache &);
+
+    struct entry {
+        entry():dir(),hash(0),fd(-1),used(0){}
+        std::string dir;                // as the path gave it, without the trailing '/'
+        uint64_t    hash;               // of dir
+        int         fd;
+        uint64_t    used;               // clock when last found
+    };
+    std::vector<entry> entries;
+    size_t      last;                   // the entry found last, looked at first
+    uint64_t    clock;
+    uint64_t    nhits;                  // opens through a held directory
+    uint64_t    nmisses;                // opens that had to open the directory
+
+    static uint64_t hash_of(const char *s,size_t len);
+    int         dir_fd(const std::string &path,size_t slash,size_t capacity); // -1 if it can't be opened
+    void        forget(size_t i);
+
+public:
+    enum { DEFAULT_CAPACITY = 16 };
+    dir_cache():entries(),last(0),clock(0),nhits(0),nmisses(0){}
+    virtual ~dir_cache(){ clear(); }
+
+    /** As ::open(path,oflag,mode), through the held directory of path */
+    int    open(const std::string &path,int oflag,int mode,size_t capacity);
+    void   clear();                     // close the directories
+    size_t size() const { return entries.size(); }
+    uint64_t hits() const { return nhits; }
+    uint64_t misses() const { return nmisses; }
+};
+
+#endif
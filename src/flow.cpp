@@ -45,106 +45,231 @@ void flow::usage()
     std::cout << "\n";
 }
 
-std::string flow::filename(uint32_t connection_count)
+/*
+ * The filename template is compiled into a list of ops, each of which
+ * appends one piece of the name; literal text, including the outdir, is
+ * kept in template_text. It is recompiled whenever filename_template or
+ * outdir no longer match what it was compiled from, so setting them is all
+ * that is needed, but compile_filename_template() should be called once
+ * they are final so that the flows' threads only ever read it.
+ */
+namespace {
+    enum template_code {
+        T_TEXT,
+        T_SRC_ADDR, T_SRC_PORT, T_DST_ADDR, T_DST_PORT, T_SRC_MAC, T_DST_MAC,
+        T_BIN_N, T_BIN_K, T_BIN_M, T_BIN_G,
+        T_ISO_TIME, T_UNIX_TIME, T_VLAN_DASH, T_VLAN,
+        T_COUNT_FLAG, T_COUNT_IF, T_COUNT
+    };
+    struct template_op {
+        template_op(template_code code_,size_t offset_,size_t length_):code(code_),offset(offset_),length(length_){}
+        template_code code;
+        size_t offset;                  // T_TEXT: the text in template_text
+        size_t length;
+    };
+}
+static std::vector<template_op> template_ops;
+static std::string template_text;
+static std::string compiled_template;
+static std::string compiled_outdir;
+static bool template_compiled = false;
+
+static void add_text(const std::string &text)
 {
-    std::stringstream ss;
+    if(text.size()==0) return;
+    if(template_ops.size() && template_ops.back().code==T_TEXT){
+        template_ops.back().length += text.size(); // text ops are always at the end of template_text
+    } else {
+        template_ops.push_back(template_op(T_TEXT,template_text.size(),text.size()));
+    }
+    template_text += text;
+}
+
+void flow::compile_filename_template()
+{
+    template_ops.clear();
+    template_text.clear();
 
     /* Add the outdir */
     if(flow::outdir!="." && flow::outdir!=""){
-        ss << flow::outdir;
-        ss << '/';
+        add_text(flow::outdir);
+        add_text("/");
     }
 
     for(unsigned int i=0;i<filename_template.size();i++){
-	switch(filename_template.at(i)){
-	default:
-	    ss << filename_template.at(i);
-	    break;
-	case '%':
-	    if(i==filename_template.size()-1){
-		std::cerr << "Invalid filename_template: " << filename_template << " cannot end with a %\n";
-		exit(1);
-	    }
-	    /* put the substitute in ss or buf */
-	    char buf[1024];
-	    buf[0] = 0;
-	    switch(filename_template.at(++i)){
-	    case 'A': // source IP address
-		switch(family){
-		case AF_INET:
-		    snprintf(buf,sizeof(buf),"%03d.%03d.%03d.%03d",
-                             src.addr[0], src.addr[1], src.addr[2], src.addr[3]);
-		    break;
-		case AF_INET6:
-		    inet_ntop(family, src.addr, buf,sizeof(buf));
-		}
-		break;
-	    case 'a': // source IP port
-		snprintf(buf,sizeof(buf),"%05d",sport);
-		break;
-	    case 'B': // dest IP address
-		switch(family){
-		case AF_INET:
-		    snprintf(buf,sizeof(buf),"%03d.%03d.%03d.%03d",
-                             dst.addr[0], dst.addr[1], dst.addr[2], dst.addr[3]);
-		    break;
-		case AF_INET6:
-		    inet_ntop(family, dst.addr, buf,sizeof(buf));
-		}
-		break;
-	    case 'b': // dest IP port
-		snprintf(buf,sizeof(buf),"%05d",dport);
-		break;
-                /* binning by connection number */
-            case 'E':
-                snprintf(buf,sizeof(buf),"%02x:%02x:%02x:%02x:%02x:%02x",
-                         mac_saddr[0],mac_saddr[1],mac_saddr[2],mac_saddr[3],mac_saddr[4],mac_saddr[5]);
-                break;
-            case 'e':
-                snprintf(buf,sizeof(buf),"%02x:%02x:%02x:%02x:%02x:%02x",
-                         mac_daddr[0],mac_daddr[1],mac_daddr[2],mac_daddr[3],mac_daddr[4],mac_daddr[5]);
-                break;
-            case 'N': snprintf(buf,sizeof(buf),"%03d",(int)(id)             % 1000);break;
-            case 'K': snprintf(buf,sizeof(buf),"%03d",(int)(id /1000 )      % 1000);break;
-            case 'M': snprintf(buf,sizeof(buf),"%03d",(int)(id /1000000)    % 1000);break;
-            case 'G': snprintf(buf,sizeof(buf),"%03d",(int)(id /1000000000) % 1000);break;
-
-	    case 'T': // Timestamp in ISO8601 format
-	      {
-		time_t t = tstart.tv_sec;
-		strftime(buf,sizeof(buf),"%Y-%m-%dT%H:%M:%SZ",gmtime(&t));
-		break;
-	      }
-	    case 't': // Unix time_t
-		ss << tstart.tv_sec;
-		break;
-	    case 'V': // '--' if VLAN is present
-		if(vlan!=be13::packet_info::NO_VLAN) ss << "--";
-		break;
-	    case 'v': // VLAN number if VLAN is present
-		if(vlan!=be13::packet_info::NO_VLAN) ss << vlan;
-		break;
-	    case 'C': // 'c' if connection_count >0
-		if(connection_count>0) ss << "c";
-		break;
-	    case 'c': // connection_count if connection_count >0
-		if(connection_count>0) ss << connection_count;
-		break;
-	    case '#': // always output connection count
-		ss << connection_count;
-		break;
-	    case '%': // Output a '%'
-		ss << "%";
-		break;
-	    default:
-		std::cerr << "Invalid filename_template: " << filename_template << "\n";
-		std::cerr << "unknown character: " << filename_template.at(i+1) << "\n";
-		exit(1);
-	    }
-	    if(buf[0]) ss << buf;
-	}
+        if(filename_template.at(i)!='%'){
+            add_text(std::string(1,filename_template.at(i)));
+            continue;
+        }
+        if(i==filename_template.size()-1){
+            std::cerr << "Invalid filename_template: " << filename_template << " cannot end with a %\n";
+            exit(1);
+        }
+        template_code code = T_TEXT;
+        switch(filename_template.at(++i)){
+        case 'A': code = T_SRC_ADDR; break;
+        case 'a': code = T_SRC_PORT; break;
+        case 'B': code = T_DST_ADDR; break;
+        case 'b': code = T_DST_PORT; break;
+        case 'E': code = T_SRC_MAC; break;
+        case 'e': code = T_DST_MAC; break;
+        case 'N': code = T_BIN_N; break;
+        case 'K': code = T_BIN_K; break;
+        case 'M': code = T_BIN_M; break;
+        case 'G': code = T_BIN_G; break;
+        case 'T': code = T_ISO_TIME; break;
+        case 't': code = T_UNIX_TIME; break;
+        case 'V': code = T_VLAN_DASH; break;
+        case 'v': code = T_VLAN; break;
+        case 'C': code = T_COUNT_FLAG; break;
+        case 'c': code = T_COUNT_IF; break;
+        case '#': code = T_COUNT; break;
+        case '%': add_text("%"); continue;
+        default:
+            std::cerr << "Invalid filename_template: " << filename_template << "\n";
+            std::cerr << "unknown character: " << filename_template.at(i) << "\n";
+            exit(1);
+        }
+        template_ops.push_back(template_op(code,0,0));
+    }
+    compiled_template = filename_template;
+    compiled_outdir = outdir;
+    template_compiled = true;
+}
+
+/* Append v in decimal, zero-padded to width digits */
+static void append_digits(std::string &out,uint64_t v,size_t width)
+{
+    char buf[24];
+    size_t i = sizeof(buf);
+    do {
+        buf[--i] = (char)('0' + v % 10);
+        v /= 10;
+    } while(v);
+    while(sizeof(buf)-i < width) buf[--i] = '0';
+    out.append(buf+i,sizeof(buf)-i);
+}
+
+static void append_signed(std::string &out,int64_t v)
+{
+    if(v<0){
+        out += '-';
+        append_digits(out,(uint64_t)0-(uint64_t)v,0);
+        return;
+    }
+    append_digits(out,(uint64_t)v,0);
+}
+
+/* One of the %N/%K/%M/%G bins */
+static void append_bin(std::string &out,int v)
+{
+    if(v<0){                            // an id too large for an int; keep printf's rendering
+        char buf[16];
+        snprintf(buf,sizeof(buf),"%03d",v);
+        out += buf;
+        return;
+    }
+    append_digits(out,(uint64_t)v,3);
+}
+
+static void append_addr(std::string &out,sa_family_t family,const uint8_t *addr)
+{
+    switch(family){
+    case AF_INET:
+        for(int i=0;i<4;i++){
+            if(i) out += '.';
+            append_digits(out,addr[i],3);
+        }
+        break;
+    case AF_INET6:
+        char buf[INET6_ADDRSTRLEN];
+        if(inet_ntop(family,addr,buf,sizeof(buf))) out += buf;
+        break;
     }
-    return ss.str();
+}
+
+static void append_mac(std::string &out,const uint8_t *mac)
+{
+    char buf[MACADDR_BUFSIZE];
+    out.append(macaddr(mac,buf),MACADDR_BUFSIZE-1);
+}
+
+void flow::filename(std::string &out,uint32_t connection_count) const
+{
+    if(!template_compiled || compiled_template!=filename_template || compiled_outdir!=outdir){
+        compile_filename_template();
+    }
+    out.clear();
+    for(std::vector<template_op>::const_iterator op=template_ops.begin();op!=template_ops.end();op++){
+        switch(op->code){
+        case T_TEXT:      out.append(template_text,op->offset,op->length); break;
+        case T_SRC_ADDR:  append_addr(out,family,src.addr); break;
+        case T_SRC_PORT:  append_digits(out,sport,5); break;
+        case T_DST_ADDR:  append_addr(out,family,dst.addr); break;
+        case T_DST_PORT:  append_digits(out,dport,5); break;
+        case T_SRC_MAC:   append_mac(out,mac_saddr); break;
+        case T_DST_MAC:   append_mac(out,mac_daddr); break;
+            /* binning by connection number */
+        case T_BIN_N:     append_bin(out,(int)(id)             % 1000); break;
+        case T_BIN_K:     append_bin(out,(int)(id /1000 )      % 1000); break;
+        case T_BIN_M:     append_bin(out,(int)(id /1000000)    % 1000); break;
+        case T_BIN_G:     append_bin(out,(int)(id /1000000000) % 1000); break;
+        case T_ISO_TIME: {
+            char buf[64];
+            time_t t = tstart.tv_sec;
+            if(strftime(buf,sizeof(buf),"%Y-%m-%dT%H:%M:%SZ",gmtime(&t))) out += buf;
+            break;
+        }
+        case T_UNIX_TIME: append_signed(out,tstart.tv_sec); break;
+        case T_VLAN_DASH: if(vlan!=be13::packet_info::NO_VLAN) out += "--"; break;
+        case T_VLAN:      if(vlan!=be13::packet_info::NO_VLAN) append_signed(out,vlan); break;
+        case T_COUNT_FLAG: if(connection_count>0) out += 'c'; break;
+        case T_COUNT_IF:  if(connection_count>0) append_digits(out,connection_count,0); break;
+        case T_COUNT:     append_digits(out,connection_count,0); break;
+        }
+    }
+}
+
+/* Make the directories that the %N/%K/%M/%G bins of the first ids flows
+ * will go in, so that mkdirs_for_path() finds them all made. Does nothing if
+ * the directories depend on anything but the flow id.
+ */
+void flow::make_bin_dirs(uint64_t ids)
+{
+    if(!template_compiled || compiled_template!=filename_template || compiled_outdir!=outdir){
+        compile_filename_template();
+    }
+    size_t dir_ops = 0;                 // the ops up to the last '/'
+    for(size_t i=0;i<template_ops.size();i++){
+        const template_op &op = template_ops[i];
+        if(op.code==T_TEXT && template_text.substr(op.offset,op.length).find('/')!=std::string::npos) dir_ops = i+1;
+    }
+    uint64_t step = ids;                // ids that share a directory
+    for(size_t i=0;i<dir_ops;i++){
+        switch(template_ops[i].code){
+        case T_TEXT:  break;
+        case T_BIN_N: step = 1; break;
+        case T_BIN_K: step = std::min(step,(uint64_t)1000); break;
+        case T_BIN_M: step = std::min(step,(uint64_t)1000000); break;
+        case T_BIN_G: step = std::min(step,(uint64_t)1000000000); break;
+        default: return;
+        }
+    }
+    if(dir_ops==0 || step==0) return;
+    flow f;
+    std::string name;
+    for(uint64_t id=0;id<ids;id+=step){
+        f.id = id;
+        f.filename(name,0);
+        mkdirs_for_path(name);
+    }
+}
+
+std::string flow::filename(uint32_t connection_count)
+{
+    std::string name;
+    filename(name,connection_count);
+    return name;
 }
 
 /**
@@ -152,11 +277,13 @@ std::string flow::filename(uint32_t connection_count)
  * This is called from tcpip::open_file().
  */
 
-std::string flow::new_filename(int *fd,int flags,int mode)
+std::string flow::new_filename(int *fd,int flags,int mode,const char *suffix)
 {
     /* Loop connection count until we find a file that doesn't exist */
+    std::string nfn;
     for(uint32_t connection_count=0;;connection_count++){
-        std::string nfn = filename(connection_count);
+        filename(nfn,connection_count);
+        nfn.append(suffix);
         if(nfn.find('/')!=std::string::npos) mkdirs_for_path(nfn.c_str());
         int nfd = tcpdemux::getInstance()->retrying_open(nfn,flags,mode);
         if(nfd>=0){
@@ -0,0 +1,209 @@
+/*
+ * flow_catalog.cpp:
+ *
+ * A binary catalog of the finished flows; see flow_catalog.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "flow_catalog.h"
+
+#include <algorithm>
+
+/* static */ const char *flow_catalog::MAGIC = "TCPFLCAT";
+
+namespace {
+    template <typename T> void put(u_char *p,T v){ memcpy(p,&v,sizeof(v)); }
+    template <typename T> T get(const u_char *p){ T v; memcpy(&v,p,sizeof(v)); return v; }
+
+    int64_t usec(const struct timeval &tv){ return (int64_t)tv.tv_sec*1000000 + tv.tv_usec; }
+
+    /* The digest scan_md5 put in the flow's XML, if it is there */
+    bool md5_of(const std::string &xmladd,u_char md5[16])
+    {
+        static const std::string md5_start("<hashdigest type='MD5'>");
+        size_t p = xmladd.find(md5_start);
+        if(p==std::string::npos || xmladd.size() < p + md5_start.size() + 32) return false;
+        p += md5_start.size();
+        for(int i=0;i<16;i++){
+            unsigned int byte = 0;
+            if(sscanf(xmladd.c_str()+p+i*2,"%2x",&byte)!=1) return false;
+            md5[i] = (u_char)byte;
+        }
+        return true;
+    }
+
+    struct time_entry {
+        int64_t  tstart;
+        uint32_t record;
+        bool operator<(const time_entry &b) const {
+            return tstart<b.tstart || (tstart==b.tstart && record<b.record);
+        }
+    };
+
+    struct addr_entry {
+        u_char   addr[16];
+        int64_t  tstart;
+        uint32_t record;
+        uint8_t  family;
+        bool operator<(const addr_entry &b) const {
+            if(family!=b.family) return family<b.family;
+            int c = memcmp(addr,b.addr,sizeof(addr));
+            if(c!=0) return c<0;
+            return tstart<b.tstart || (tstart==b.tstart && record<b.record);
+        }
+    };
+}
+
+flow_catalog::flow_catalog(const std::string &fname_):
+    fname(fname_),f(0),paths(0),records(0),paths_length(0),max_duration(0),failed(false)
+{
+}
+
+/* static */ flow_catalog *flow_catalog::open(const std::string &fname)
+{
+    flow_catalog *fc = new flow_catalog(fname);
+    std::string pname = fname + ".paths";
+    fc->f = fopen(fname.c_str(),"w+b");
+    fc->paths = fc->f ? fopen(pname.c_str(),"w+b") : 0;
+    if(fc->paths==0){
+        perror(fc->f ? pname.c_str() : fname.c_str());
+        if(fc->f){                      // not a catalog yet; the destructor would write its indexes
+            fclose(fc->f);
+            unlink(fname.c_str());
+            fc->f = 0;
+        }
+        delete fc;
+        return 0;
+    }
+    fc->write_header(0,0,0,0);          // until the indexes are written
+    return fc;
+}
+
+flow_catalog::~flow_catalog()
+{
+    if(f){
+        if(!write_indexes()) failed = true;
+        if(fclose(f)) failed = true;
+    }
+    if(paths){
+        fclose(paths);
+        if(!failed) unlink((fname + ".paths").c_str());
+    }
+    if(failed) fprintf(stderr,"%s: the flow catalog %s is incomplete\n",progname,fname.c_str());
+}
+
+void flow_catalog::write_header(uint64_t nrecords,uint64_t time_offset,uint64_t addr_offset,uint64_t paths_offset)
+{
+    u_char h[HEADER_SIZE];
+    memset(h,0,sizeof(h));
+    memcpy(h,MAGIC,8);
+    put<uint32_t>(h+8,VERSION);
+    put<uint32_t>(h+12,0x01020304);
+    put<uint32_t>(h+16,RECORD_SIZE);
+    put<uint64_t>(h+24,nrecords);
+    put<uint64_t>(h+32,time_offset);
+    put<uint64_t>(h+40,addr_offset);
+    put<uint64_t>(h+48,paths_offset);
+    put<int64_t>(h+56,max_duration);
+    if(fseeko(f,0,SEEK_SET) || fwrite(h,sizeof(h),1,f)!=1) failed = true;
+}
+
+void flow_catalog::add(const flow_report &fr)
+{
+    const flow &fl = fr.myflow;
+    u_char r[RECORD_SIZE];
+    memset(r,0,sizeof(r));
+    put<uint64_t>(r+0,fl.id);
+    put<int64_t>(r+8,usec(fl.tstart));
+    put<int64_t>(r+16,usec(fl.tlast));
+    put<uint64_t>(r+24,fl.packet_count);
+    put<uint64_t>(r+32,fr.last_byte);
+    put<uint64_t>(r+40,paths_length);
+    memcpy(r+48,fl.src.addr,16);
+    memcpy(r+64,fl.dst.addr,16);
+    md5_of(fr.xmladd,r+80);
+    put<int32_t>(r+96,fl.vlan);
+    put<uint32_t>(r+100,fr.flow_pathname.size());
+    put<uint16_t>(r+104,fl.sport);
+    put<uint16_t>(r+106,fl.dport);
+    r[108] = fl.family==AF_INET6 ? 6 : 4;
+
+    if(fwrite(r,sizeof(r),1,f)!=1) failed = true;
+    if(fwrite(fr.flow_pathname.c_str(),fr.flow_pathname.size()+1,1,paths)!=1) failed = true;
+    paths_length += fr.flow_pathname.size()+1;
+    records++;
+    int64_t duration = usec(fl.tlast) - usec(fl.tstart);
+    if(duration>max_duration) max_duration = duration;
+}
+
+/* The records are read back in batches for their keys, so the index is
+ * built without having kept them as the flows were recorded.
+ */
+bool flow_catalog::write_indexes()
+{
+    if(fflush(f) || fflush(paths) || records > 0xffffffffULL) return false; // record numbers are 32 bits
+    std::vector<time_entry> by_time;
+    std::vector<addr_entry> by_addr;
+    by_time.reserve(records);
+    by_addr.reserve(records*2);
+    std::vector<u_char> batch(RECORD_BATCH*RECORD_SIZE);
+    if(fseeko(f,HEADER_SIZE,SEEK_SET)) return false;
+    for(uint64_t i=0;i<records;){
+        size_t n = std::min<uint64_t>(RECORD_BATCH,records-i);
+        if(fread(&batch[0],RECORD_SIZE,n,f)!=n) return false;
+        for(size_t j=0;j<n;j++,i++){
+            const u_char *r = &batch[j*RECORD_SIZE];
+            time_entry te;
+            te.tstart = get<int64_t>(r+8);
+            te.record = (uint32_t)i;
+            by_time.push_back(te);
+            for(int side=0;side<2;side++){
+                addr_entry ae;
+                memcpy(ae.addr,r+48+side*16,16);
+                ae.tstart = te.tstart;
+                ae.record = te.record;
+                ae.family = r[108];
+                by_addr.push_back(ae);
+            }
+        }
+    }
+    std::sort(by_time.begin(),by_time.end());
+    std::sort(by_addr.begin(),by_addr.end());
+
+    /* Reading and writing a stdio stream must be separated by a seek */
+    uint64_t time_offset = HEADER_SIZE + records*RECORD_SIZE;
+    if(fseeko(f,time_offset,SEEK_SET)) return false;
+    for(std::vector<time_entry>::const_iterator it=by_time.begin();it!=by_time.end();it++){
+        u_char e[TIME_ENTRY_SIZE];
+        memset(e,0,sizeof(e));
+        put<int64_t>(e,it->tstart);
+        put<uint32_t>(e+8,it->record);
+        if(fwrite(e,sizeof(e),1,f)!=1) return false;
+    }
+    uint64_t addr_offset = time_offset + records*TIME_ENTRY_SIZE;
+    for(std::vector<addr_entry>::const_iterator it=by_addr.begin();it!=by_addr.end();it++){
+        u_char e[ADDR_ENTRY_SIZE];
+        memset(e,0,sizeof(e));
+        memcpy(e,it->addr,16);
+        put<int64_t>(e+16,it->tstart);
+        put<uint32_t>(e+24,it->record);
+        e[28] = it->family;
+        if(fwrite(e,sizeof(e),1,f)!=1) return false;
+    }
+    uint64_t paths_offset = addr_offset + records*2*ADDR_ENTRY_SIZE;
+    rewind(paths);
+    char buf[65536];
+    size_t count;
+    while((count = fread(buf,1,sizeof(buf),paths))>0){
+        if(fwrite(buf,1,count,f)!=count) return false;
+    }
+    if(ferror(paths)) return false;
+
+    write_header(records,time_offset,addr_offset,paths_offset);
+    return !failed;
+}
@@ -0,0 +1,82 @@
+/*
+ * flow_catalog.h:
+ *
+ * A binary catalog of the finished flows (-S catalog=NAME), written in
+ * the output directory next to report.xml, for tools that would rather
+ * mmap() a file and search it than parse report.xml or walk the tree.
+ *
+ * The file is, in the host's byte order:
+ *
+ *   header     MAGIC, version (4), byte order 0x01020304 (4),
+ *              RECORD_SIZE (4), 0 (4), records (8), and the offsets of
+ *              the time index (8), the address index (8) and the paths
+ *              (8), and the longest flow's duration in microseconds (8)
+ *   records    RECORD_SIZE bytes for each flow, in the order they closed:
+ *                id (8), start and end time in microseconds (8 each),
+ *                packets (8), bytes written (8), path offset (8),
+ *                source and destination address (16 each; IPv4 in the
+ *                first 4 bytes), MD5 (16; zero if scan_md5 didn't run),
+ *                vlan (4; -1 for none), path length (4), source and
+ *                destination port (2 each), family (1: 4 or 6), and
+ *                zeros to RECORD_SIZE
+ *   by time    TIME_ENTRY_SIZE for each record, sorted by start time:
+ *                start time (8), record number (4), 0 (4)
+ *   by address ADDR_ENTRY_SIZE twice for each record, once for its source
+ *              and once for its destination, sorted by family, address
+ *              and start time:
+ *                address (16), start time (8), record number (4),
+ *                family (1), zeros (3)
+ *   paths      each flow's filename, NUL-terminated, at its path offset
+ *
+ * So the flows of host X between T1 and T2 are a binary search of the
+ * address index for X, then for T1 - the longest duration, then a scan
+ * to T2. python/tcpflow_catalog.py does just that.
+ *
+ * A record is written as each flow is recorded and its path appended to
+ * NAME.paths; the indexes are built when the catalog is closed, from the
+ * records read back, and the paths copied after them. Until then the
+ * header says there are 0 records; the records of a run that didn't
+ * finish can still be read up to the end of the file.
+ *
+ * tcpdemux::record_flow() adds the flows, one at a time.
+ *
+ * #include this file after tcpip.h and report_writer.h
+ */
+
+#ifndef FLOW_CATALOG_H
+#define FLOW_CATALOG_H
+
+#include <string>
+#include <vector>
+
+class flow_catalog {
+    /* These are not implemented */
+    flow_catalog(const flow_catalog &);
+    flow_catalog &operator=(const flow_catalog &);
+
+    enum { RECORD_BATCH = 4096 };       // records read back at a time by write_indexes()
+
+    std::string fname;
+    FILE       *f;                      // the catalog
+    FILE       *paths;                  // NAME.paths, until it is copied into f
+    uint64_t    records;
+    uint64_t    paths_length;
+    int64_t     max_duration;
+    bool        failed;                 // a write failed; the catalog is incomplete
+
+    flow_catalog(const std::string &fname);
+    void write_header(uint64_t nrecords,uint64_t time_offset,uint64_t addr_offset,uint64_t paths_offset);
+    bool write_indexes();               // and the paths; false if they couldn't be
+
+public:
+    static const char *MAGIC;           // 8 bytes
+    enum { VERSION = 1 };
+    enum { HEADER_SIZE = 64, RECORD_SIZE = 128, TIME_ENTRY_SIZE = 16, ADDR_ENTRY_SIZE = 32 };
+
+    static flow_catalog *open(const std::string &fname); // 0 if it can't be created
+    virtual ~flow_catalog();            // writes the indexes and closes the file
+
+    void add(const flow_report &fr);
+};
+
+#endif
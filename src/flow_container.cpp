@@ -0,0 +1,256 @@
+/*
+ * flow_container.cpp:
+ *
+ * Flows appended to segment files, with an index; see flow_container.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "flow_container.h"
+
+#include <algorithm>
+
+/* static */ const char *flow_container::SEGMENT_MAGIC = "TCPFLSEG";
+
+static bool write_all(int fd,const u_char *data,size_t len)
+{
+    while(len>0){
+        ssize_t count = ::write(fd,data,len);
+        if(count<0 && errno==EINTR) continue;
+        if(count<=0) return false;
+        data += count;
+        len  -= count;
+    }
+    return true;
+}
+
+flow_container::flow_container(const std::string &dir_,uint64_t segment_size_):
+    dir(dir_),segment_size(segment_size_),fd(-1),segment(0),position(0),buf(),
+    last_record(std::string::npos),last_id(0),index(0),failed(false),flows(),
+    names(1024),names_used(0)
+#ifdef HAVE_PTHREAD
+    ,lock()
+#endif
+{
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init(&lock,0);
+#endif
+    buf.reserve(BUFFER_SIZE);
+}
+
+/* static */ flow_container *flow_container::open(const std::string &dir,uint64_t segment_size)
+{
+    flow_container *fc = new flow_container(dir,segment_size);
+    std::string fname = dir + "/flows.idx";
+    fc->index = fopen(fname.c_str(),"w");
+    if(fc->index==0 || !fc->open_segment()){
+        perror(fname.c_str());
+        delete fc;
+        return 0;
+    }
+    return fc;
+}
+
+flow_container::~flow_container()
+{
+    while(flows.size()) close(flows.begin()->first);
+    flush_buffer();
+    if(fd>=0) ::close(fd);
+    if(index && fclose(index)) failed = true;
+    if(failed) fprintf(stderr,"%s: the flows in %s are incomplete\n",progname,dir.c_str());
+#ifdef HAVE_PTHREAD
+    pthread_mutex_destroy(&lock);
+#endif
+}
+
+bool flow_container::open_segment()
+{
+    char fname[32];
+    snprintf(fname,sizeof(fname),"/flows.%06u.seg",segment);
+    std::string path = dir + fname;
+    fd = ::open(path.c_str(),O_WRONLY|O_CREAT|O_TRUNC|O_BINARY,0666);
+    if(fd<0){
+        perror(path.c_str());
+        failed = true;
+        return false;
+    }
+    uint32_t header[2] = {1,0x01020304}; // version, and the byte order of what follows
+    buf.insert(buf.end(),SEGMENT_MAGIC,SEGMENT_MAGIC+8);
+    buf.insert(buf.end(),(const u_char *)header,(const u_char *)header+sizeof(header));
+    position = SEGMENT_HEADER_SIZE;
+    return true;
+}
+
+void flow_container::flush_buffer()
+{
+    if(buf.size() && (fd<0 || !write_all(fd,&buf[0],buf.size()))) failed = true;
+    buf.clear();
+    last_record = std::string::npos;
+}
+
+void flow_container::put_record(record_type type,uint64_t id,uint64_t offset,const u_char *data,uint32_t length)
+{
+    size_t total = RECORD_HEADER_SIZE + length;
+    if(position > SEGMENT_HEADER_SIZE && position + total > segment_size){
+        flush_buffer();                 // on to the next segment
+        if(fd>=0) ::close(fd);
+        segment++;
+        open_segment();
+    }
+    if(buf.size() + total > BUFFER_SIZE) flush_buffer();
+    uint32_t h32[2] = {(uint32_t)type,length};
+    uint64_t h64[2] = {id,offset};
+    last_record = buf.size();
+    last_id = id;
+    buf.insert(buf.end(),(const u_char *)h32,(const u_char *)h32+sizeof(h32));
+    buf.insert(buf.end(),(const u_char *)h64,(const u_char *)h64+sizeof(h64));
+    if(total > BUFFER_SIZE){            // too big to buffer; write it after the header
+        flush_buffer();
+        if(fd<0 || !write_all(fd,data,length)) failed = true;
+    } else if(length){
+        buf.insert(buf.end(),data,data+length);
+    }
+    position += total;
+}
+
+void flow_container::write_index(uint64_t id,const contained_flow &cf)
+{
+    uint64_t length = 0;
+    for(std::vector<extent>::const_iterator it=cf.extents.begin();it!=cf.extents.end();it++){
+        length = std::max(length,it->offset + it->length);
+    }
+    fprintf(index,"%" PRIu64 "\t%" PRIu64 "\t%ld.%06ld\t",id,length,
+            (long)cf.tstart.tv_sec,(long)cf.tstart.tv_usec);
+    for(std::vector<extent>::const_iterator it=cf.extents.begin();it!=cf.extents.end();it++){
+        fprintf(index,"%s%u:%" PRIu64 ":%" PRIu64 ":%u",it==cf.extents.begin() ? "" : ",",
+                it->segment,it->position,it->offset,it->length);
+    }
+    fprintf(index,"\t%s\n",cf.name.c_str());
+}
+
+bool flow_container::claim_name(const std::string &name)
+{
+    uint64_t h = segment_index::digest((const u_char *)name.data(),name.size());
+    if(h==0) h = 1;
+    if(names_used*2 >= names.size()){
+        std::vector<uint64_t> old(names.size()*2);
+        old.swap(names);
+        for(std::vector<uint64_t>::const_iterator it=old.begin();it!=old.end();it++){
+            if(*it==0) continue;
+            size_t i = *it & (names.size()-1);
+            while(names[i]) i = (i+1) & (names.size()-1);
+            names[i] = *it;
+        }
+    }
+    size_t i = h & (names.size()-1);
+    while(names[i]){
+        if(names[i]==h) return false;
+        i = (i+1) & (names.size()-1);
+    }
+    names[i] = h;
+    names_used++;
+    return true;
+}
+
+/* The name of the file a flow would have been written to, relative to the directory */
+static std::string relative_name(const std::string &dir,const std::string &path)
+{
+    if(path.size() > dir.size() && path.compare(0,dir.size(),dir)==0 && path[dir.size()]=='/'){
+        return path.substr(dir.size()+1);
+    }
+    return path;
+}
+
+/* As flow::new_filename(), but the names are only checked against each other */
+std::string flow_container::new_flow(const flow &f)
+{
+#ifdef HAVE_PTHREAD
+    demux_lock l(&lock);
+#endif
+    std::string nfn;
+    for(uint32_t connection_count=0;;connection_count++){
+        f.filename(nfn,connection_count);
+        if(claim_name(relative_name(dir,nfn))) break;
+    }
+    contained_flow &cf = flows[f.id];
+    cf.name = relative_name(dir,nfn);
+    cf.tstart = f.tstart;
+    return nfn;
+}
+
+void flow_container::reopen(const flow &f,const std::string &name)
+{
+#ifdef HAVE_PTHREAD
+    demux_lock l(&lock);
+#endif
+    contained_flow &cf = flows[f.id];
+    cf.name = relative_name(dir,name);
+    cf.tstart = f.tstart;
+}
+
+bool flow_container::write(uint64_t id,uint64_t offset,const u_char *data,size_t length)
+{
+#ifdef HAVE_PTHREAD
+    demux_lock l(&lock);
+#endif
+    flows_t::iterator it = flows.find(id);
+    if(it==flows.end() || length==0) return !failed;
+    std::vector<extent> &extents = it->second.extents;
+    while(length>0){
+        uint32_t n = (uint32_t)std::min(length,(size_t)BUFFER_SIZE);
+        /* The flow's next bytes, just after its last record: make that record longer */
+        if(last_record!=std::string::npos && last_id==id && extents.size()){
+            extent &last = extents.back();
+            if(last.segment==segment && last.position+last.length==position &&
+               last.offset+last.length==offset && buf.size()+n <= BUFFER_SIZE &&
+               position+n <= segment_size && (uint64_t)last.length+n <= UINT32_MAX){
+                buf.insert(buf.end(),data,data+n);
+                last.length += n;
+                memcpy(&buf[last_record+4],&last.length,4);
+                position += n;
+                offset += n;
+                data   += n;
+                length -= n;
+                continue;
+            }
+        }
+        put_record(DATA,id,offset,data,n);
+        extents.push_back(extent(segment,position-n,offset,n));
+        offset += n;
+        data   += n;
+        length -= n;
+    }
+    return !failed;
+}
+
+void flow_container::shift(uint64_t id,uint64_t inslen)
+{
+#ifdef HAVE_PTHREAD
+    demux_lock l(&lock);
+#endif
+    flows_t::iterator it = flows.find(id);
+    if(it==flows.end() || it->second.extents.empty()) return; // nothing to move, as with shift_file()
+    for(std::vector<extent>::iterator e=it->second.extents.begin();e!=it->second.extents.end();e++){
+        e->offset += inslen;
+    }
+    put_record(SHIFT,id,inslen,0,0);
+    last_record = std::string::npos;    // data after this is not part of an earlier record
+}
+
+void flow_container::close(uint64_t id)
+{
+#ifdef HAVE_PTHREAD
+    demux_lock l(&lock);
+#endif
+    flows_t::iterator it = flows.find(id);
+    if(it==flows.end()) return;
+    const contained_flow &cf = it->second;
+    put_record(CLOSE,id,0,(const u_char *)cf.name.data(),(uint32_t)cf.name.size());
+    last_record = std::string::npos;
+    write_index(id,cf);
+    flows.erase(it);
+}
@@ -0,0 +1,104 @@
+/*
+ * flow_container.h:
+ *
+ * Flow output appended to a few large segment files rather than a file
+ * for each flow (-S segment_mb). The directory tcpflow writes to gets
+ *
+ *   flows.NNNNNN.seg  the data, in records; a new segment is started once
+ *                     one holds segment_mb MiB
+ *   flows.idx         a line for each flow once it is closed
+ *
+ * Each segment starts with SEGMENT_MAGIC, a version and the host's byte
+ * order, and then holds records: a header (type, length, flow id, offset)
+ * and length bytes. A DATA record holds length bytes of the flow at
+ * offset, and later data wins where it overlaps earlier data, as it does
+ * when a flow file is rewritten in place. A SHIFT record moves all of the
+ * flow's data up by offset bytes (data that came before the assumed ISN).
+ * A CLOSE record ends the flow; its data is the flow's name. The records
+ * alone are enough to recover every flow.
+ *
+ * The index says the same in one line per flow:
+ *
+ *   id <tab> length <tab> tstart <tab> extents <tab> name
+ *
+ * where the extents are segment:position:offset:length, comma-separated
+ * and in the order they were written, position being where the data is in
+ * the segment; and name is the file the flow would have been written to,
+ * relative to the directory. A flow that is reopened gets another line
+ * under the same id. python/tcpflow_container.py lists the flows and
+ * expands the ones asked for into their files.
+ *
+ * The container is shared by the shards, and locks itself.
+ *
+ * #include this file after tcpflow.h
+ */
+
+#ifndef FLOW_CONTAINER_H
+#define FLOW_CONTAINER_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+class flow_container {
+    /* These are not implemented */
+    flow_container(const flow_container &);
+    flow_container &operator=(const flow_container &);
+
+    enum { RECORD_HEADER_SIZE = 24, SEGMENT_HEADER_SIZE = 16 };
+    enum { BUFFER_SIZE = 1024*1024 };
+    enum record_type { DATA = 1, SHIFT = 2, CLOSE = 3 };
+
+    struct extent {
+        extent(uint32_t segment_,uint64_t position_,uint64_t offset_,uint32_t length_):
+            segment(segment_),position(position_),offset(offset_),length(length_){}
+        uint32_t segment;
+        uint64_t position;              // of the data in the segment
+        uint64_t offset;                // of the data in the flow
+        uint32_t length;
+    };
+    struct contained_flow {
+        contained_flow():name(),tstart(),extents(){}
+        std::string name;
+        struct timeval tstart;
+        std::vector<extent> extents;
+    };
+    typedef std::map<uint64_t,contained_flow> flows_t;
+
+    std::string dir;
+    uint64_t    segment_size;
+    int         fd;                     // the segment being written
+    uint32_t    segment;                // its number
+    uint64_t    position;               // its length, counting what is buffered
+    std::vector<u_char> buf;            // the end of the segment, not yet written
+    size_t      last_record;            // where in buf the last record's header is; npos if written
+    uint64_t    last_id;                // ...and its flow
+    FILE       *index;
+    bool        failed;                 // a write failed; the container is incomplete
+    flows_t     flows;                  // the open flows
+    std::vector<uint64_t> names;        // digests of the names given out, open-addressed; 0 is free
+    size_t      names_used;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock;
+#endif
+
+    flow_container(const std::string &dir,uint64_t segment_size);
+    bool open_segment();
+    void flush_buffer();
+    void put_record(record_type type,uint64_t id,uint64_t offset,const u_char *data,uint32_t length);
+    void write_index(uint64_t id,const contained_flow &cf);
+    bool claim_name(const std::string &name); // false if it has been given out already
+
+public:
+    static const char *SEGMENT_MAGIC;   // 8 bytes
+    static flow_container *open(const std::string &dir,uint64_t segment_size); // 0 if it can't
+    virtual ~flow_container();          // closes the flows still open, and the files
+
+    std::string new_flow(const flow &f);        // the new flow's name, unique in the container
+    void reopen(const flow &f,const std::string &name); // a flow that was closed
+    bool write(uint64_t id,uint64_t offset,const u_char *data,size_t length);
+    void shift(uint64_t id,uint64_t inslen);
+    void close(uint64_t id);            // writes its index line
+};
+
+#endif
@@ -0,0 +1,218 @@
+/*
+ * flow_db.cpp:
+ *
+ * Batched SQLite flow records; see flow_db.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "flow_db.h"
+
+#ifdef HAVE_FLOW_DB
+
+static const char *create_sql = "CREATE TABLE IF NOT EXISTS connections ("
+    "starttime TEXT NOT NULL,"
+    "endtime TEXT NOT NULL,"
+    "src_ipn TEXT,"
+    "dst_ipn TEXT,"
+    "mac_daddr TEXT,"
+    "mac_saddr TEXT,"
+    "packets INTEGER,"
+    "srcport INTEGER,"
+    "dstport INTEGER,"
+    "hashdigest_md5 TEXT);";
+
+static const char *insert_sql = "INSERT INTO connections (starttime,endtime,src_ipn,dst_ipn,mac_daddr,"
+    "mac_saddr,packets,srcport,dstport,hashdigest_md5) VALUES (?,?,?,?,?,?,?,?,?,?)";
+
+static uint64_t ms_since(const struct timeval &t0)
+{
+    struct timeval now;
+    gettimeofday(&now,0);
+    int64_t us = ((int64_t)now.tv_sec - t0.tv_sec)*1000000 + (now.tv_usec - t0.tv_usec);
+    return us>0 ? (uint64_t)us/1000 : 0;
+}
+
+/* An empty string is stored as NULL, as the missing attribute is in the DFXML */
+static int bind_text(sqlite3_stmt *s,int col,const std::string &str)
+{
+    if(str.size()==0) return sqlite3_bind_null(s,col);
+    return sqlite3_bind_text(s,col,str.c_str(),(int)str.size(),SQLITE_STATIC);
+}
+
+flow_db::flow_db(sqlite3 *db_,sqlite3_stmt *insert_flow_,uint32_t batch_size_,uint32_t batch_ms_):
+    db(db_),insert_flow(insert_flow_),batch_size(batch_size_ ? batch_size_ : 1),batch_ms(batch_ms_),
+    queue(),first_queued(),written(0),failed(0)
+#ifdef HAVE_PTHREAD
+    ,lock(),work(),room(),writer(),stopping(false)
+#endif
+{
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init(&lock,0);
+    pthread_cond_init(&work,0);
+    pthread_cond_init(&room,0);
+#endif
+}
+
+flow_db *flow_db::open(const std::string &fname,uint32_t batch_size,uint32_t batch_ms,bool wal,
+                       std::string &err)
+{
+    sqlite3 *db = 0;
+    sqlite3_stmt *insert_flow = 0;
+    if(sqlite3_open(fname.c_str(),&db)!=SQLITE_OK){
+        err = std::string("cannot open ") + fname + ": " + (db ? sqlite3_errmsg(db) : "out of memory");
+        if(db) sqlite3_close(db);
+        return 0;
+    }
+    const char *setup[] = {"PRAGMA journal_mode=WAL;",
+                           "PRAGMA synchronous=NORMAL;", // WAL stays consistent; the last commits may be lost on a crash
+                           create_sql};
+    for(size_t i = wal ? 0 : 2;i<sizeof(setup)/sizeof(setup[0]);i++){
+        char *msg = 0;
+        if(sqlite3_exec(db,setup[i],0,0,&msg)!=SQLITE_OK){
+            err = std::string(fname) + ": " + (msg ? msg : "SQL error");
+            sqlite3_free(msg);
+            sqlite3_close(db);
+            return 0;
+        }
+    }
+    if(sqlite3_prepare_v2(db,insert_sql,-1,&insert_flow,0)!=SQLITE_OK){
+        err = std::string(fname) + ": " + sqlite3_errmsg(db);
+        sqlite3_close(db);
+        return 0;
+    }
+    flow_db *f = new flow_db(db,insert_flow,batch_size,batch_ms);
+#ifdef HAVE_PTHREAD
+    if(pthread_create(&f->writer,0,run,f)!=0){
+        err = "cannot start the database writer thread";
+        f->stopping = true;             // nothing to join
+        delete f;
+        return 0;
+    }
+#endif
+    DEBUG(2)("flow records to %s in batches of %u or %u ms%s",fname.c_str(),f->batch_size,batch_ms,
+             wal ? " (WAL)" : "");
+    return f;
+}
+
+flow_db::~flow_db()
+{
+#ifdef HAVE_PTHREAD
+    bool join = false;
+    {
+        demux_lock l(&lock);
+        join = !stopping;
+        stopping = true;
+        pthread_cond_signal(&work);
+    }
+    if(join) pthread_join(writer,0);    // the writer commits what is left before it returns
+    pthread_cond_destroy(&room);
+    pthread_cond_destroy(&work);
+    pthread_mutex_destroy(&lock);
+#endif
+    if(queue.size()) commit(queue);
+    DEBUG(2)("flow records written: %" PRIu64 " failed: %" PRIu64,written,failed);
+    sqlite3_finalize(insert_flow);
+    sqlite3_close(db);
+}
+
+bool flow_db::exec(const char *sql)
+{
+    char *msg = 0;
+    if(sqlite3_exec(db,sql,0,0,&msg)==SQLITE_OK) return true;
+    DEBUG(1)("flow database: %s: %s",sql,msg ? msg : "error");
+    sqlite3_free(msg);
+    return false;
+}
+
+void flow_db::commit(const std::vector<record> &batch)
+{
+    bool in_transaction = exec("BEGIN");
+    for(std::vector<record>::const_iterator it=batch.begin();it!=batch.end();it++){
+        bind_text(insert_flow,1,it->starttime);
+        bind_text(insert_flow,2,it->endtime);
+        bind_text(insert_flow,3,it->src_ipn);
+        bind_text(insert_flow,4,it->dst_ipn);
+        bind_text(insert_flow,5,it->mac_daddr);
+        bind_text(insert_flow,6,it->mac_saddr);
+        sqlite3_bind_int64(insert_flow,7,(sqlite3_int64)it->packets);
+        sqlite3_bind_int(insert_flow,8,it->srcport);
+        sqlite3_bind_int(insert_flow,9,it->dstport);
+        bind_text(insert_flow,10,it->hashdigest_md5);
+        if(sqlite3_step(insert_flow)==SQLITE_DONE){
+            written++;
+        } else {
+            if(failed==0) DEBUG(1)("flow database insert: %s",sqlite3_errmsg(db));
+            failed++;
+        }
+        sqlite3_reset(insert_flow);
+    }
+    sqlite3_clear_bindings(insert_flow);
+    if(in_transaction && !exec("COMMIT")) exec("ROLLBACK");
+}
+
+bool flow_db::batch_due() const
+{
+    return queue.size()>=batch_size || (queue.size()>0 && ms_since(first_queued)>=batch_ms);
+}
+
+#ifdef HAVE_PTHREAD
+void flow_db::write(const record &r)
+{
+    demux_lock l(&lock);
+    while(queue.size()>=(size_t)batch_size*MAX_QUEUED_BATCHES && !stopping) pthread_cond_wait(&room,&lock);
+    if(queue.size()==0) gettimeofday(&first_queued,0);
+    queue.push_back(r);
+    if(queue.size()==1 || queue.size()>=batch_size) pthread_cond_signal(&work); // start the clock, or commit now
+}
+
+void *flow_db::run(void *arg)
+{
+    reinterpret_cast<flow_db *>(arg)->writer_loop();
+    return 0;
+}
+
+void flow_db::writer_loop()
+{
+    std::vector<record> batch;
+    pthread_mutex_lock(&lock);
+    while(true){
+        while(queue.size()==0 && !stopping) pthread_cond_wait(&work,&lock);
+        if(queue.size()==0) break;      // stopping, and nothing left to do
+        /* Let the batch fill until it is big enough or old enough */
+        struct timespec deadline;
+        deadline.tv_sec  = first_queued.tv_sec + batch_ms/1000;
+        deadline.tv_nsec = (long)first_queued.tv_usec*1000 + (long)(batch_ms%1000)*1000000;
+        if(deadline.tv_nsec>=1000000000){
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while(queue.size()<batch_size && !stopping){
+            if(pthread_cond_timedwait(&work,&lock,&deadline)==ETIMEDOUT) break;
+        }
+        batch.swap(queue);
+        pthread_cond_broadcast(&room);
+        pthread_mutex_unlock(&lock);
+        commit(batch);
+        batch.clear();
+        pthread_mutex_lock(&lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+#else
+void flow_db::write(const record &r)
+{
+    if(queue.size()==0) gettimeofday(&first_queued,0);
+    queue.push_back(r);
+    if(batch_due()){
+        commit(queue);
+        queue.clear();
+    }
+}
+#endif
+
+#endif
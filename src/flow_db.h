@@ -0,0 +1,91 @@
+/*
+ * flow_db.h:
+ *
+ * A SQLite database with one row for each finished flow.
+ *
+ * Outside a transaction SQLite commits, and syncs its journal, after every
+ * INSERT. Here records are queued as plain structs and written by a thread
+ * of their own, many to a transaction: a batch is committed when it holds
+ * batch_size records or when batch_ms have passed since its first record,
+ * whichever is sooner. The packet path only copies the record into the
+ * queue. It waits only if the queue gets MAX_QUEUED_BATCHES behind, which
+ * bounds the memory held on a database that can't keep up.
+ *
+ * With wal set the database is put in write-ahead-log mode, in which
+ * a commit is an append to the log rather than a rewrite of the journal.
+ *
+ * Without pthreads the batches are committed by write() itself.
+ *
+ * #include this file after tcpflow.h
+ */
+
+#ifndef FLOW_DB_H
+#define FLOW_DB_H
+
+#if defined(HAVE_SQLITE3_H) && defined(HAVE_LIBSQLITE3)
+#include <sqlite3.h>
+#define HAVE_FLOW_DB
+
+class flow_db {
+    /* These are not implemented */
+    flow_db(const flow_db &);
+    flow_db &operator=(const flow_db &);
+
+public:
+    class record {
+    public:
+        record():starttime(),endtime(),src_ipn(),dst_ipn(),mac_daddr(),mac_saddr(),
+                 packets(0),srcport(0),dstport(0),hashdigest_md5(){}
+        std::string starttime;
+        std::string endtime;
+        std::string src_ipn;
+        std::string dst_ipn;
+        std::string mac_daddr;
+        std::string mac_saddr;
+        uint64_t    packets;
+        uint16_t    srcport;
+        uint16_t    dstport;
+        std::string hashdigest_md5;
+    };
+
+    enum { DEFAULT_BATCH_SIZE = 1000,
+           DEFAULT_BATCH_MS = 1000,
+           MAX_QUEUED_BATCHES = 16 };
+
+private:
+    sqlite3      *db;
+    sqlite3_stmt *insert_flow;
+    uint32_t     batch_size;
+    uint32_t     batch_ms;
+    std::vector<record> queue;          // waiting for the writer
+    struct timeval first_queued;        // when the oldest record in queue arrived
+    uint64_t     written;               // counted by whoever commits
+    uint64_t     failed;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock;
+    pthread_cond_t  work;               // the writer has something to do
+    pthread_cond_t  room;               // the queue is no longer full
+    pthread_t    writer;
+    bool         stopping;
+    static void *run(void *arg);
+    void         writer_loop();
+#endif
+
+    flow_db(sqlite3 *db,sqlite3_stmt *insert_flow,uint32_t batch_size,uint32_t batch_ms);
+    bool         exec(const char *sql);
+    void         commit(const std::vector<record> &batch); // one transaction
+    bool         batch_due() const;     // queue is full enough or old enough to commit
+
+public:
+    /** Open (creating if need be) the database fname.
+     * Returns 0 and sets err on failure.
+     */
+    static flow_db *open(const std::string &fname,uint32_t batch_size,uint32_t batch_ms,bool wal,
+                         std::string &err);
+    virtual ~flow_db();                 // commits everything still queued
+
+    void     write(const record &r);    // thread-safe
+};
+
+#endif
+#endif
@@ -0,0 +1,383 @@
+/*
+ * flow_gzip.cpp:
+ *
+ * Flow files written as BGZF; see flow_gzip.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "flow_gzip.h"
+
+#include <algorithm>
+#include <stdlib.h>
+#include <zlib.h>
+
+/* static */ const char *flow_gzip::SUFFIX = ".gz";
+
+/* An empty member, which BGZF readers take as the end of the file */
+/* static */ const u_char flow_gzip::END_MARKER[28] = {
+    0x1f,0x8b,0x08,0x04,0x00,0x00,0x00,0x00,0x00,0xff,0x06,0x00,0x42,0x43,0x02,0x00,
+    0x1b,0x00,0x03,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00
+};
+
+#define MEMBER_HEADER_SIZE  18          // gzip header with the BC extra field
+#define MEMBER_TRAILER_SIZE 8           // CRC32 and ISIZE
+#define MEMBER_MAX          65536
+
+static void put_le32(u_char *p,uint32_t v)
+{
+    p[0] = v; p[1] = v>>8; p[2] = v>>16; p[3] = v>>24;
+}
+
+static uint32_t get_le32(const u_char *p)
+{
+    return p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+/* The length of the BGZF member whose header this is; 0 if it isn't one */
+/* static */ size_t gzip_codec::member_size(const u_char *h)
+{
+    if(h[0]!=0x1f || h[1]!=0x8b || h[2]!=8 || (h[3]&4)==0) return 0;
+    if(h[10]!=6 || h[11]!=0 || h[12]!='B' || h[13]!='C' || h[14]!=2 || h[15]!=0) return 0;
+    return (h[16] | (h[17]<<8)) + 1;
+}
+
+gzip_codec::~gzip_codec()
+{
+    if(def){
+        deflateEnd(def);
+        delete def;
+    }
+    if(inf){
+        inflateEnd(inf);
+        delete inf;
+    }
+}
+
+void gzip_codec::deflate(const u_char *data,size_t len,std::vector<u_char> &block)
+{
+    static const u_char header[16] = {0x1f,0x8b,0x08,0x04,0,0,0,0,0,0xff,0x06,0x00,'B','C',0x02,0x00};
+    const size_t room = MEMBER_MAX - MEMBER_HEADER_SIZE - MEMBER_TRAILER_SIZE;
+    block.resize(MEMBER_MAX);
+    memcpy(&block[0],header,sizeof(header));
+
+    if(def==0){
+        def = new z_stream();
+        if(deflateInit2(def,level,Z_DEFLATED,-15,8,Z_DEFAULT_STRATEGY)!=Z_OK){
+            delete def;
+            def = 0;
+        }
+    }
+    size_t cdata = 0;
+    if(def){
+        deflateReset(def);
+        def->next_in   = const_cast<u_char *>(data);
+        def->avail_in  = len;
+        def->next_out  = &block[MEMBER_HEADER_SIZE];
+        def->avail_out = room;
+        if(::deflate(def,Z_FINISH)==Z_STREAM_END) cdata = room - def->avail_out;
+    }
+    if(cdata==0){
+        /* It doesn't compress (or zlib couldn't be set up); store it as one stored block */
+        u_char *p = &block[MEMBER_HEADER_SIZE];
+        p[0] = 1;                       // BFINAL, stored
+        p[1] = len; p[2] = len>>8;
+        p[3] = ~len; p[4] = (~len)>>8;
+        memcpy(p+5,data,len);
+        cdata = 5 + len;
+    }
+    size_t total = MEMBER_HEADER_SIZE + cdata + MEMBER_TRAILER_SIZE;
+    block[16] = (total-1);
+    block[17] = (total-1)>>8;
+    put_le32(&block[MEMBER_HEADER_SIZE+cdata],crc32(0,data,len));
+    put_le32(&block[MEMBER_HEADER_SIZE+cdata+4],len);
+    block.resize(total);
+}
+
+bool gzip_codec::inflate(const u_char *block,size_t len,u_char *out,size_t outlen)
+{
+    if(len < MEMBER_HEADER_SIZE+MEMBER_TRAILER_SIZE || member_size(block)!=len) return false;
+    if(get_le32(block+len-4)!=outlen) return false;
+    if(inf==0){
+        inf = new z_stream();
+        if(inflateInit2(inf,-15)!=Z_OK){
+            delete inf;
+            inf = 0;
+            return false;
+        }
+    }
+    inflateReset(inf);
+    inf->next_in   = const_cast<u_char *>(block + MEMBER_HEADER_SIZE);
+    inf->avail_in  = len - MEMBER_HEADER_SIZE - MEMBER_TRAILER_SIZE;
+    inf->next_out  = out;
+    inf->avail_out = outlen;
+    int rv = ::inflate(inf,Z_FINISH);
+    if(rv!=Z_STREAM_END || inf->avail_out!=0) return false;
+    return crc32(0,out,outlen)==get_le32(block+len-8);
+}
+
+bool flow_gzip::write_all(int fd,const u_char *data,size_t len,uint64_t offset)
+{
+    while(len>0){
+        ssize_t count = ::pwrite(fd,data,len,offset);
+        if(count<0 && errno==EINTR) continue;
+        if(count<=0) return false;
+        data   += count;
+        len    -= count;
+        offset += count;
+    }
+    return true;
+}
+
+/* As shift_file(), a piece at a time, from the end when moving up */
+bool flow_gzip::move(int fd,uint64_t start,uint64_t end,int64_t delta)
+{
+    enum { BUFFERSIZE = 64 * 1024 };
+    u_char buffer[BUFFERSIZE];
+    uint64_t left = end - start;
+    while(left>0){
+        size_t n = std::min(left,(uint64_t)BUFFERSIZE);
+        uint64_t from = delta>0 ? start + left - n : end - left;
+        if(::pread(fd,buffer,n,from)!=(ssize_t)n) return false;
+        if(!write_all(fd,buffer,n,from+delta)) return false;
+        left -= n;
+    }
+    return true;
+}
+
+bool flow_gzip::put_block(int fd,uint64_t uoff,const u_char *data,size_t len)
+{
+    codec.deflate(data,len,scratch);
+    if(!write_all(fd,&scratch[0],scratch.size(),cend)) return false;
+    blocks.push_back(block(uoff,cend,len,scratch.size()));
+    cend += scratch.size();
+    return true;
+}
+
+/* Put the member for block i in its place, moving the members after it if it isn't the same size */
+bool flow_gzip::replace(int fd,size_t i,const std::vector<u_char> &member)
+{
+    block &b = blocks[i];
+    int64_t delta = (int64_t)member.size() - b.clen;
+    if(delta!=0){
+        if(!move(fd,b.coff+b.clen,cend,delta)) return false;
+        for(size_t j=i+1;j<blocks.size();j++) blocks[j].coff += delta;
+        cend += delta;
+        if(delta<0 && ftruncate(fd,cend)!=0) return false;
+    }
+    b.clen = member.size();
+    return write_all(fd,&member[0],member.size(),b.coff);
+}
+
+/* Write [offset,offset+length), all of which is in block i */
+bool flow_gzip::patch(int fd,size_t i,uint64_t offset,const u_char *data,size_t length)
+{
+    const block &b = blocks[i];
+    scratch.resize(b.clen);
+    std::vector<u_char> plain(b.ulen);
+    if(::pread(fd,&scratch[0],b.clen,b.coff)!=(ssize_t)b.clen) return false;
+    if(!codec.inflate(&scratch[0],b.clen,&plain[0],b.ulen)) return false;
+    if(memcmp(&plain[offset-b.uoff],data,length)==0) return true; // the same bytes again
+    memcpy(&plain[offset-b.uoff],data,length);
+    codec.deflate(&plain[0],b.ulen,scratch);
+    return replace(fd,i,scratch);
+}
+
+bool flow_gzip::write(int fd,uint64_t offset,const u_char *data,size_t length)
+{
+    while(length>0){
+        size_t n;
+        if(offset < cur_start){
+            /* In a block that has been written; the blocks cover [0,cur_start) */
+            size_t lo = 0, hi = blocks.size();
+            while(hi-lo > 1){
+                size_t mid = (lo+hi)/2;
+                if(offset < blocks[mid].uoff) hi = mid;
+                else lo = mid;
+            }
+            const block &b = blocks[lo];
+            n = (size_t)std::min((uint64_t)length,b.uoff + b.ulen - offset);
+            if(!patch(fd,lo,offset,data,n)) return false;
+        } else {
+            size_t at = offset - cur_start;
+            if(at >= BLOCK_DATA_MAX){       // past the block; it ends with a hole
+                cur.resize(BLOCK_DATA_MAX,0);
+                if(!put_block(fd,cur_start,&cur[0],cur.size())) return false;
+                cur_start += BLOCK_DATA_MAX;
+                cur.clear();
+                continue;
+            }
+            n = std::min(length,(size_t)BLOCK_DATA_MAX - at);
+            if(cur.size() < at+n) cur.resize(at+n,0);
+            memcpy(&cur[at],data,n);
+            if(cur.size()==BLOCK_DATA_MAX){
+                if(!put_block(fd,cur_start,&cur[0],cur.size())) return false;
+                cur_start += BLOCK_DATA_MAX;
+                cur.clear();
+            }
+        }
+        offset += n;
+        data   += n;
+        length -= n;
+    }
+    return true;
+}
+
+/* Open up inslen bytes of zeros at the start */
+bool flow_gzip::insert(int fd,uint64_t inslen)
+{
+    if(blocks.empty()){
+        if(cur.empty()) return true;    // an empty file stays empty, as with shift_file()
+        cur.insert(cur.begin(),inslen,0);
+        while(cur.size() >= BLOCK_DATA_MAX){
+            if(!put_block(fd,cur_start,&cur[0],BLOCK_DATA_MAX)) return false;
+            cur.erase(cur.begin(),cur.begin()+BLOCK_DATA_MAX);
+            cur_start += BLOCK_DATA_MAX;
+        }
+        return true;
+    }
+    /* Members for the zeros, then everything else after them */
+    std::vector<u_char> zeros(std::min(inslen,(uint64_t)BLOCK_DATA_MAX),0);
+    std::vector<u_char> members;
+    std::vector<block> front;
+    for(uint64_t u=0;u<inslen;u+=zeros.size()){
+        size_t n = (size_t)std::min(inslen-u,(uint64_t)zeros.size());
+        codec.deflate(&zeros[0],n,scratch);
+        front.push_back(block(u,members.size(),n,scratch.size()));
+        members.insert(members.end(),scratch.begin(),scratch.end());
+    }
+    if(!move(fd,0,cend,members.size())) return false;
+    if(!write_all(fd,&members[0],members.size(),0)) return false;
+    for(std::vector<block>::iterator it=blocks.begin();it!=blocks.end();it++){
+        it->uoff += inslen;
+        it->coff += members.size();
+    }
+    blocks.insert(blocks.begin(),front.begin(),front.end());
+    cur_start += inslen;
+    cend += members.size();
+    return true;
+}
+
+bool flow_gzip::sync(int fd)
+{
+    if(cur.size()){
+        if(!put_block(fd,cur_start,&cur[0],cur.size())) return false;
+        cur_start += cur.size();
+        std::vector<u_char>().swap(cur);
+    }
+    std::vector<u_char>().swap(scratch);
+    return write_all(fd,END_MARKER,sizeof(END_MARKER),cend) && ftruncate(fd,cend+sizeof(END_MARKER))==0;
+}
+
+/* static */ bool flow_gzip::compressed(const std::string &path)
+{
+    size_t len = strlen(SUFFIX);
+    return path.size() > len && path.compare(path.size()-len,len,SUFFIX)==0;
+}
+
+/* Steps through the members of a BGZF file, reading just their headers
+ * and lengths unless the member itself is wanted.
+ */
+namespace {
+    struct member_walk {
+        member_walk(int fd_):fd(fd_),pos(0),uoff(0),member(){}
+        int fd;
+        uint64_t pos;
+        uint64_t uoff;
+        std::vector<u_char> member;
+
+        /* the next member's place; false at the end, or if it isn't BGZF */
+        bool next(size_t &clen,uint32_t &ulen){
+            u_char h[MEMBER_HEADER_SIZE];
+            if(::pread(fd,h,sizeof(h),pos)!=(ssize_t)sizeof(h)) return false;
+            clen = gzip_codec::member_size(h);
+            if(clen < MEMBER_HEADER_SIZE+MEMBER_TRAILER_SIZE) return false;
+            u_char isize[4];
+            if(::pread(fd,isize,4,pos+clen-4)!=4) return false;
+            ulen = get_le32(isize);
+            return true;
+        }
+        bool read(size_t clen){
+            member.resize(clen);
+            return ::pread(fd,&member[0],clen,pos)==(ssize_t)clen;
+        }
+        void skip(size_t clen,uint32_t ulen){
+            pos  += clen;
+            uoff += ulen;
+        }
+    };
+}
+
+/* The blocks of a file that sync() finished, found from its members; the
+ * end marker is the first empty one.
+ */
+bool flow_gzip::resume(int fd)
+{
+    blocks.clear();
+    std::vector<u_char>().swap(cur);
+    member_walk w(fd);
+    size_t clen;
+    uint32_t ulen;
+    while(w.next(clen,ulen)){
+        if(ulen==0){
+            cur_start = w.uoff;
+            cend = w.pos;
+            return true;
+        }
+        blocks.push_back(block(w.uoff,w.pos,ulen,(uint32_t)clen));
+        w.skip(clen,ulen);
+    }
+    blocks.clear();
+    return false;
+}
+
+/* static */ sbuf_t *flow_gzip::map_file(const std::string &path,int fd)
+{
+    if(!compressed(path)) return fd>=0 ? sbuf_t::map_file(path,fd) : sbuf_t::map_file(path);
+    int ifd = fd>=0 ? fd : ::open(path.c_str(),O_RDONLY|O_BINARY);
+    if(ifd<0) return 0;
+    size_t clen;
+    uint32_t ulen;
+    member_walk sizes(ifd);
+    while(sizes.next(clen,ulen)) sizes.skip(clen,ulen);
+    u_char *buf = sizes.uoff ? (u_char *)malloc(sizes.uoff) : 0;
+    bool ok = buf!=0;
+    gzip_codec codec(0);
+    member_walk w(ifd);
+    while(ok && w.next(clen,ulen)){
+        ok = w.read(clen) && (ulen==0 || codec.inflate(&w.member[0],clen,buf+w.uoff,ulen));
+        w.skip(clen,ulen);
+    }
+    if(fd<0) ::close(ifd);
+    if(!ok){
+        DEBUG(1)("%s: cannot read the compressed flow",path.c_str());
+        free(buf);
+        return 0;
+    }
+    return new sbuf_t(pos0_t(path),buf,sizes.uoff,sizes.uoff,true); // the sbuf frees buf
+}
+
+/* static */ ssize_t flow_gzip::pread(const std::string &path,int fd,u_char *buf,size_t len,uint64_t offset)
+{
+    if(!compressed(path)) return ::pread(fd,buf,len,offset);
+    gzip_codec codec(0);
+    std::vector<u_char> plain;
+    member_walk w(fd);
+    size_t clen;
+    uint32_t ulen;
+    size_t got = 0;
+    while(got<len && w.next(clen,ulen)){
+        if(w.uoff+ulen > offset+got){
+            plain.resize(ulen);
+            if(!w.read(clen) || !codec.inflate(&w.member[0],clen,&plain[0],ulen)) return -1;
+            size_t from = offset+got - w.uoff;
+            size_t n = std::min(len-got,(size_t)ulen-from);
+            memcpy(buf+got,&plain[from],n);
+            got += n;
+        }
+        w.skip(clen,ulen);
+    }
+    return got;
+}
@@ -0,0 +1,95 @@
+/*
+ * flow_gzip.h:
+ *
+ * Flow files written compressed (-S flow_gzip=level), as BGZF: a series of
+ * gzip members, each holding at most BLOCK_DATA_MAX bytes of the flow and
+ * saying in its header how long it is, and an empty member at the end.
+ * gzip -d and zcat read the file as one stream; a reader that knows the
+ * format can hop from member to member and inflate only the part it
+ * wants. The files are named with SUFFIX.
+ *
+ * The tcpip writes to its flow_gzip just where it would have written to
+ * the file. Data at or beyond the start of the block being filled is put
+ * in it, in memory; the block is compressed and appended when the data
+ * passes its end. Data that lands in a block already written (a
+ * retransmission, usually identical) is compared with it after inflating
+ * it, and if it differs the block is compressed again and whatever
+ * follows it moved to make room. Data inserted at the start goes in a
+ * block of its own, and everything else is moved up, as with shift_file().
+ *
+ * sync() writes the block being filled and the end marker, leaving a
+ * complete file; writing after it carries on from where the marker was.
+ * The blocks' places are kept, so a flow whose file was closed for want
+ * of fds carries on when it is reopened; resume() finds them again in a
+ * file left by an earlier run (-S restore).
+ *
+ * The compressor is shared by the flows of a demux; see tcpdemux::gzip().
+ * map_file() and pread() read a flow's file, compressed or not, for the
+ * post-processing scanners and for matching stragglers.
+ *
+ * #include this file after tcpflow.h
+ */
+
+#ifndef FLOW_GZIP_H
+#define FLOW_GZIP_H
+
+#include <string>
+#include <vector>
+
+/* deflates and inflates single blocks; one for each thread that writes flows */
+class gzip_codec {
+    gzip_codec(const gzip_codec &);
+    gzip_codec &operator=(const gzip_codec &);
+    int level;
+    struct z_stream_s *def;             // each made when first needed
+    struct z_stream_s *inf;
+public:
+    gzip_codec(int level_):level(level_),def(0),inf(0){}
+    virtual ~gzip_codec();
+    void deflate(const u_char *data,size_t len,std::vector<u_char> &block); // the whole BGZF member
+    bool inflate(const u_char *block,size_t len,u_char *out,size_t outlen); // false if it isn't that
+    static size_t member_size(const u_char *header); // from its first 18 bytes; 0 if it isn't BGZF
+};
+
+class flow_gzip {
+    /* These are not implemented */
+    flow_gzip(const flow_gzip &);
+    flow_gzip &operator=(const flow_gzip &);
+
+    struct block {
+        block(uint64_t uoff_,uint64_t coff_,uint32_t ulen_,uint32_t clen_):uoff(uoff_),coff(coff_),ulen(ulen_),clen(clen_){}
+        uint64_t uoff;                  // where its data is in the flow
+        uint64_t coff;                  // where the member is in the file
+        uint32_t ulen;
+        uint32_t clen;
+    };
+    gzip_codec &codec;
+    std::vector<block> blocks;          // written, in order
+    std::vector<u_char> cur;            // the block being filled, from cur_start
+    uint64_t cur_start;
+    uint64_t cend;                      // end of the members written; the end marker goes here
+    std::vector<u_char> scratch;
+
+    bool put_block(int fd,uint64_t uoff,const u_char *data,size_t len); // appends a member at cend
+    bool patch(int fd,size_t i,uint64_t offset,const u_char *data,size_t length);
+    bool replace(int fd,size_t i,const std::vector<u_char> &member); // moves what follows
+    static bool write_all(int fd,const u_char *data,size_t len,uint64_t offset);
+    static bool move(int fd,uint64_t start,uint64_t end,int64_t delta); // [start,end) by delta bytes
+
+public:
+    enum { BLOCK_DATA_MAX = 0xff00 };       // as bgzip, so that a member always fits in 64KiB
+    static const char *SUFFIX;
+    static const u_char END_MARKER[28];
+
+    flow_gzip(gzip_codec &codec_):codec(codec_),blocks(),cur(),cur_start(0),cend(0),scratch(){}
+    bool write(int fd,uint64_t offset,const u_char *data,size_t length);
+    bool insert(int fd,uint64_t inslen);        // at the start
+    bool sync(int fd);
+    bool resume(int fd);                        // carry on with a file another process sync()ed
+
+    static bool compressed(const std::string &path); // by its name
+    static sbuf_t *map_file(const std::string &path,int fd=-1); // inflated if need be
+    static ssize_t pread(const std::string &path,int fd,u_char *buf,size_t len,uint64_t offset);
+};
+
+#endif
@@ -0,0 +1,118 @@
+/*
+ * flow_hash.cpp:
+ *
+ * Digests of a flow file computed as it is written; see flow_hash.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "flow_hash.h"
+
+#include <algorithm>
+#include <map>
+#include <sstream>
+
+/* static */ std::string flow_hash::digest_names("md5");
+
+/* The <hashdigest>s of the flows hashed as they were written, by flow
+ * file, until scan_md5 is called for the flow.
+ */
+static std::map<std::string,std::string> hashed_flows;
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t hashed_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+#define HASH_CHUNK (1024*1024)          // hash_buf() gives each digest this much at a time
+
+/* static */ uint32_t flow_hash::enabled()
+{
+    std::vector<std::string> scanners;
+    be13::plugin::get_enabled_scanners(scanners);
+    if(std::find(scanners.begin(),scanners.end(),"md5")==scanners.end()) return 0;
+
+    uint32_t wanted = 0;
+    std::stringstream ss(digest_names);
+    std::string name;
+    while(std::getline(ss,name,',')){
+        std::transform(name.begin(),name.end(),name.begin(),::tolower);
+        if(name=="md5") wanted |= MD5;
+        else if(name=="sha1" || name=="sha-1") wanted |= SHA1;
+        else if(name=="sha256" || name=="sha-256") wanted |= SHA256;
+        else if(name.size()){
+            std::cerr << "Invalid hash name: " << name << "\n";
+            std::cerr << "flow_digests may name MD5, SHA1, and SHA256\n";
+            exit(1);
+        }
+    }
+    return wanted;
+}
+
+flow_hash::flow_hash(uint32_t wanted):
+    md5(wanted & MD5 ? new md5_generator() : 0),
+    sha1(wanted & SHA1 ? new sha1_generator() : 0),
+    sha256(wanted & SHA256 ? new sha256_generator() : 0)
+{
+}
+
+/* static */ flow_hash *flow_hash::open(uint32_t wanted)
+{
+    if(wanted==0) return 0;
+    return new flow_hash(wanted);
+}
+
+flow_hash::~flow_hash()
+{
+    delete md5;
+    delete sha1;
+    delete sha256;
+}
+
+void flow_hash::update(const uint8_t *data,size_t length)
+{
+    if(md5) md5->update(data,length);
+    if(sha1) sha1->update(data,length);
+    if(sha256) sha256->update(data,length);
+}
+
+std::string flow_hash::hashdigests()
+{
+    std::stringstream ss;
+    if(md5) ss << "<hashdigest type='MD5'>" << md5->final().hexdigest() << "</hashdigest>";
+    if(sha1) ss << "<hashdigest type='SHA1'>" << sha1->final().hexdigest() << "</hashdigest>";
+    if(sha256) ss << "<hashdigest type='SHA256'>" << sha256->final().hexdigest() << "</hashdigest>";
+    return ss.str();
+}
+
+void flow_hash::finish(const std::string &path)
+{
+    std::string xml = hashdigests();
+#ifdef HAVE_PTHREAD
+    demux_lock lock(&hashed_lock);
+#endif
+    hashed_flows[path].swap(xml);
+}
+
+/* static */ bool flow_hash::take(const std::string &path,std::string &xml)
+{
+#ifdef HAVE_PTHREAD
+    demux_lock lock(&hashed_lock);
+#endif
+    std::map<std::string,std::string>::iterator it = hashed_flows.find(path);
+    if(it==hashed_flows.end()) return false;
+    xml.swap(it->second);
+    hashed_flows.erase(it);
+    return true;
+}
+
+/* static */ std::string flow_hash::hash_buf(uint32_t wanted,const uint8_t *buf,size_t bufsize)
+{
+    flow_hash h(wanted);
+    for(size_t i=0;i<bufsize;i+=HASH_CHUNK){
+        h.update(buf+i,std::min((size_t)HASH_CHUNK,bufsize-i)); // every digest, while it is in cache
+    }
+    return h.hashdigests();
+}
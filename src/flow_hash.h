@@ -0,0 +1,48 @@
+/*
+ * flow_hash.h:
+ *
+ * Digests of a flow file computed as the file is written, for scan_md5
+ * (-FM, -e md5). -S flow_digests=md5,sha1,sha256 chooses which.
+ *
+ * Each new flow file gets a flow_hash, and the tcpip hands it the bytes
+ * it appends at the end of the file, which is all of the file as long as
+ * the data arrives in order. When that stops being so (data is inserted
+ * before the start, a hole is left, or a retransmission rewrites the file
+ * with bytes we can't tell are the same) the tcpip drops its flow_hash,
+ * and scan_md5 reads the file back as before. A flow_hash that lasted
+ * leaves its <hashdigest>s for scan_md5 to add to the flow's <fileobject>.
+ *
+ * #include this file after tcpflow.h
+ */
+
+#ifndef FLOW_HASH_H
+#define FLOW_HASH_H
+
+#include <string>
+
+class flow_hash {
+    /* These are not implemented */
+    flow_hash(const flow_hash &);
+    flow_hash &operator=(const flow_hash &);
+
+    md5_generator    *md5;
+    sha1_generator   *sha1;
+    sha256_generator *sha256;
+
+    flow_hash(uint32_t wanted);
+    std::string hashdigests();          // finishes the digests
+
+public:
+    enum { MD5=1, SHA1=2, SHA256=4 };
+    static std::string digest_names;    // -S flow_digests
+    static uint32_t enabled();          // the digests wanted; call after the scanners are enabled
+    static flow_hash *open(uint32_t wanted);
+    static bool take(const std::string &path,std::string &xml); // for scan_md5's PHASE_SCAN
+    static std::string hash_buf(uint32_t wanted,const uint8_t *buf,size_t bufsize); // the same, read back
+    virtual ~flow_hash();
+
+    void        update(const uint8_t *data,size_t length); // the next bytes of the file
+    void        finish(const std::string &path);  // the file is complete and will be scanned
+};
+
+#endif
@@ -0,0 +1,230 @@
+/*
+ * flow_table.h:
+ *
+ * An open-addressing hash table from flows to objects, used for the
+ * demultiplexer's table of active flows.
+ *
+ * The flow is packed into flow_key: five 64-bit words with no vtable and no
+ * padding, so comparing two keys is five integer compares and every slot
+ * of the table is one flat struct. Collisions are resolved with Robin Hood
+ * probing and deletion shifts later entries back, so there are no
+ * tombstones and a lookup never probes further than the longest run.
+ *
+ * Call reserve() with the expected number of flows to keep the table from
+ * rehashing while packets are being processed. A caller with a batch of
+ * packets can prefetch() the slots their flows hash to, so the lookups
+ * that follow don't each wait on a cache miss.
+ *
+ * The table counts its finds, inserts and the slots looked at past the
+ * first, for perf_counters.
+ *
+ * #include this file after tcpip.h
+ */
+
+#ifndef FLOW_TABLE_H
+#define FLOW_TABLE_H
+
+#include <stdint.h>
+#include <vector>
+
+/* A flow_addr packed for hashing and comparison. */
+class flow_key {
+public:
+    uint64_t w[5];                      // src, dst, then ports and family
+
+    flow_key(){ w[0]=w[1]=w[2]=w[3]=w[4]=0; }
+    explicit flow_key(const flow_addr &f){
+        memcpy(&w[0],f.src.addr,16);
+        memcpy(&w[2],f.dst.addr,16);
+        w[4] = (uint64_t)f.sport | ((uint64_t)f.dport<<16) | ((uint64_t)f.family<<32);
+    }
+    flow_addr addr() const {            // the flow_addr it was made from
+        flow_addr f;
+        memcpy(f.src.addr,&w[0],16);
+        memcpy(f.dst.addr,&w[2],16);
+        f.sport  = (uint16_t)w[4];
+        f.dport  = (uint16_t)(w[4]>>16);
+        f.family = (sa_family_t)(w[4]>>32);
+        return f;
+    }
+    bool operator==(const flow_key &b) const {
+        return w[0]==b.w[0] && w[2]==b.w[2] && w[4]==b.w[4] && w[1]==b.w[1] && w[3]==b.w[3];
+    }
+
+    static uint64_t mix(uint64_t h){    // finalizer from MurmurHash3
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+    uint64_t hash() const {
+        /* IPv4 addresses are 4 octets followed by 12 zeros; both fit in one word */
+        if((w[1] | w[3] | (w[0]>>32) | (w[2]>>32))==0){
+            return mix(((w[0]<<32) | w[2]) ^ (w[4] * 0x9e3779b97f4a7c15ULL));
+        }
+        uint64_t h = w[4] * 0x9e3779b97f4a7c15ULL;
+        for(int i=0;i<4;i++){
+            h = (h ^ w[i]) * 0xff51afd7ed558ccdULL;
+            h ^= h >> 29;
+        }
+        return mix(h);
+    }
+};
+
+template <typename V> class flow_table {
+    /* Assignment and copy are not implemented */
+    flow_table(const flow_table &);
+    flow_table &operator=(const flow_table &);
+
+    enum { MIN_CAPACITY = 64 };
+    struct slot {
+        slot():key(),value(),hash(0),dist(0){}
+        flow_key key;
+        V        value;
+        uint32_t hash;                  // low bits of the key's hash; saves most key compares
+        uint32_t dist;                  // 1 + distance from the home slot; 0 if empty
+    };
+    std::vector<slot> slots;            // size is a power of two
+    size_t   count;
+    size_t   mask;
+    mutable uint64_t n_lookups;
+    mutable uint64_t n_probes;
+    uint64_t n_inserts;
+
+    /* Index of key, or -1 if it is not in the table */
+    ssize_t locate(const flow_key &key,uint64_t h) const {
+        if(slots.size()==0) return -1;
+        size_t   i = (size_t)h & mask;
+        uint32_t d = 1;
+        while(true){
+            const slot &s = slots[i];
+            if(s.dist < d){             // empty, or an entry we would have displaced
+                n_probes += d-1;
+                return -1;
+            }
+            if(s.hash==(uint32_t)h && s.key==key){
+                n_probes += d-1;
+                return (ssize_t)i;
+            }
+            i = (i+1) & mask;
+            d++;
+        }
+    }
+
+    /* Place an entry that is known not to be in the table */
+    void place(slot e){
+        size_t i = (size_t)e.hash & mask;
+        e.dist = 1;
+        while(true){
+            slot &s = slots[i];
+            if(s.dist==0){
+                s = e;
+                return;
+            }
+            if(s.dist < e.dist){        // take from the rich
+                slot t = s;
+                s = e;
+                e = t;
+            }
+            i = (i+1) & mask;
+            e.dist++;
+        }
+    }
+
+    void rehash(size_t capacity){
+        std::vector<slot> old;
+        old.swap(slots);
+        slots.resize(capacity);
+        mask = capacity-1;
+        for(typename std::vector<slot>::const_iterator it=old.begin();it!=old.end();it++){
+            if(it->dist) place(*it);
+        }
+    }
+
+public:
+    flow_table():slots(),count(0),mask(0),n_lookups(0),n_probes(0),n_inserts(0){}
+
+    size_t size() const { return count; }
+    size_t capacity() const { return slots.size(); }
+    size_t memory() const { return slots.size()*sizeof(slot); } // bytes of the table itself
+    uint64_t lookups() const { return n_lookups; }
+    uint64_t inserts() const { return n_inserts; }
+    uint64_t probes() const { return n_probes; }
+
+    /** Make room for n entries without rehashing (load factor 7/8) */
+    void reserve(size_t n){
+        size_t capacity = MIN_CAPACITY;
+        while(capacity - capacity/8 < n) capacity *= 2;
+        if(capacity > slots.size()) rehash(capacity);
+    }
+
+    /** Start loading the slot where the search for a key with hash h begins */
+    void prefetch(uint64_t h) const {
+#ifdef __GNUC__
+        if(slots.size()) __builtin_prefetch(&slots[(size_t)h & mask]);
+#endif
+    }
+
+    V find(const flow_addr &f) const { return find(flow_key(f)); }
+    V find(const flow_key &key) const { return find(key,key.hash()); }
+    V find(const flow_key &key,uint64_t h) const { // h is key.hash()
+        n_lookups++;
+        ssize_t i = locate(key,h);
+        return i<0 ? V() : slots[i].value;
+    }
+
+    /** Add f, or replace its value if it is already there */
+    void insert(const flow_addr &f,V value){ insert(flow_key(f),value); }
+    void insert(const flow_key &key,V value){
+        uint64_t h = key.hash();
+        ssize_t i = locate(key,h);
+        if(i>=0){
+            slots[i].value = value;
+            return;
+        }
+        reserve(count+1);
+        slot e;
+        e.key   = key;
+        e.value = value;
+        e.hash  = (uint32_t)h;
+        place(e);
+        count++;
+        n_inserts++;
+    }
+
+    /** Remove f; returns false if it was not there */
+    bool erase(const flow_addr &f){ return erase(flow_key(f)); }
+    bool erase(const flow_key &key){
+        ssize_t found = locate(key,key.hash());
+        if(found<0) return false;
+        size_t i = (size_t)found;
+        while(true){                    // shift the rest of the run back one slot
+            size_t next = (i+1) & mask;
+            if(slots[next].dist<=1) break;
+            slots[i] = slots[next];
+            slots[i].dist--;
+            i = next;
+        }
+        slots[i] = slot();
+        count--;
+        return true;
+    }
+
+    /** Append every value to out, in table order */
+    void values(std::vector<V> &out) const {
+        for(typename std::vector<slot>::const_iterator it=slots.begin();it!=slots.end();it++){
+            if(it->dist) out.push_back(it->value);
+        }
+    }
+
+    void clear(){
+        for(typename std::vector<slot>::iterator it=slots.begin();it!=slots.end();it++){
+            *it = slot();
+        }
+        count = 0;
+    }
+};
+
+#endif
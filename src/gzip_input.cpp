@@ -0,0 +1,313 @@
+/*
+ * gzip_input.cpp:
+ *
+ * gzip-compressed captures inflated in the process; see gzip_input.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "pcap_reader.h"
+#include "gzip_input.h"
+
+#ifdef HAVE_GZIP_INPUT
+#include "flow_gzip.h"
+
+#include <algorithm>
+#include <zlib.h>
+
+#define MEMBER_MIN  26                  // BGZF header and trailer
+#define MEMBER_MAX  65536
+
+static uint32_t get_le32(const u_char *p)
+{
+    return p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+gzip_input::gzip_input(const std::string &fname_,const u_char *base_,size_t size_):
+    pcap_source(),fname(fname_),base(base_),size(size_),blocked(false),planned(0),z(0),fed(0),
+    stream_end(false),codec(0),queue(),todo(),spare(),current(0),depth(1)
+#ifdef HAVE_PTHREAD
+    ,workers(),lock(),work(),done(),stopping(false)
+#endif
+{
+}
+
+/* static */ gzip_input *gzip_input::open(const std::string &fname,uint32_t threads)
+{
+    int fd = ::open(fname.c_str(),O_RDONLY|O_BINARY);
+    if(fd<0) return 0;
+    struct stat st;
+    if(fstat(fd,&st) || !S_ISREG(st.st_mode) || st.st_size < MEMBER_MIN
+       || (uint64_t)st.st_size != (uint64_t)(size_t)st.st_size){
+        close(fd);
+        return 0;
+    }
+    void *m = mmap(0,(size_t)st.st_size,PROT_READ,MAP_SHARED,fd,0);
+    close(fd);
+    if(m==MAP_FAILED) return 0;
+    const u_char *b = (const u_char *)m;
+    if(b[0]!=0x1f || b[1]!=0x8b || b[2]!=8){
+        munmap(m,(size_t)st.st_size);
+        return 0;
+    }
+#ifdef HAVE_MADVISE
+    madvise(m,(size_t)st.st_size,MADV_SEQUENTIAL);
+#endif
+    gzip_input *g = new gzip_input(fname,b,(size_t)st.st_size);
+    g->blocked = gzip_codec::member_size(b)!=0;
+    if(!g->blocked){
+        g->z = new z_stream();
+        if(inflateInit2(g->z,16+MAX_WBITS)!=Z_OK){ // a gzip header, not raw deflate
+            delete g->z;
+            g->z = 0;
+            delete g;
+            return 0;
+        }
+        threads = 1;                    // it can only be inflated in order
+    }
+    if(threads==0){
+#ifdef _SC_NPROCESSORS_ONLN
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = n>0 ? (uint32_t)n : 1;
+#else
+        threads = 1;
+#endif
+    }
+    g->start(threads);
+    return g;
+}
+
+void gzip_input::start(uint32_t threads)
+{
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init(&lock,0);
+    pthread_cond_init(&work,0);
+    pthread_cond_init(&done,0);
+    for(uint32_t i=0;i<threads;i++){
+        pthread_t t;
+        if(pthread_create(&t,0,run_worker,this)) break;
+        workers.push_back(t);
+    }
+    if(workers.size()){
+        depth = workers.size()*2 + 1;
+        DEBUG(2)("%s: inflating with %u threads",fname.c_str(),(unsigned)workers.size());
+        return;
+    }
+#endif
+    codec = new gzip_codec(0);          // no threads; next() inflates each piece
+}
+
+gzip_input::~gzip_input()
+{
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&work);
+    pthread_mutex_unlock(&lock);
+    for(std::vector<pthread_t>::const_iterator it=workers.begin();it!=workers.end();it++){
+        pthread_join(*it,0);
+    }
+    pthread_cond_destroy(&done);
+    pthread_cond_destroy(&work);
+    pthread_mutex_destroy(&lock);
+#endif
+    for(std::deque<piece_t *>::const_iterator it=queue.begin();it!=queue.end();it++) delete *it;
+    for(std::vector<piece_t *>::const_iterator it=spare.begin();it!=spare.end();it++) delete *it;
+    delete current;
+    if(z){
+        inflateEnd(z);
+        delete z;
+    }
+    delete codec;
+    munmap((void *)base,size);
+}
+
+gzip_input::piece_t *gzip_input::new_piece()
+{
+    piece_t *p = 0;
+    if(spare.size()){
+        p = spare.back();
+        spare.pop_back();
+    } else {
+        p = new piece_t();
+    }
+    p->ready  = false;
+    p->failed = false;
+    p->why.clear();
+    return p;
+}
+
+bool gzip_input::plan(piece_t *p)
+{
+    p->cstart = planned;
+    p->ulen = 0;
+    while(planned < size && p->ulen < PIECE_SIZE){
+        size_t clen = size - planned >= 18 ? gzip_codec::member_size(base+planned) : 0;
+        uint32_t ulen = clen >= MEMBER_MIN && clen <= size - planned ? get_le32(base+planned+clen-4) : 0;
+        if(clen < MEMBER_MIN || clen > size - planned || ulen > MEMBER_MAX){
+            p->why = ssprintf("no BGZF member at offset %" PRIu64,(uint64_t)planned);
+            planned = size;
+            return false;
+        }
+        p->ulen += ulen;
+        planned += clen;
+    }
+    p->cend = planned;
+    return true;
+}
+
+void gzip_input::inflate_run(piece_t *p,gzip_codec &c)
+{
+    p->len = p->ulen;
+    p->data.resize(p->len + PIECE_PAD);
+    memset(&p->data[p->len],0,PIECE_PAD);
+    size_t out = 0;
+    for(size_t pos=p->cstart;pos<p->cend;){
+        size_t clen = gzip_codec::member_size(base+pos);
+        uint32_t ulen = get_le32(base+pos+clen-4);
+        if(ulen && !c.inflate(base+pos,clen,&p->data[out],ulen)){
+            p->failed = true;
+            p->why = ssprintf("corrupt BGZF member at offset %" PRIu64,(uint64_t)pos);
+            return;
+        }
+        pos += clen;
+        out += ulen;
+    }
+}
+
+bool gzip_input::inflate_stream(piece_t *p)
+{
+    p->data.resize(PIECE_SIZE + PIECE_PAD);
+    z->next_out  = &p->data[0];
+    z->avail_out = PIECE_SIZE;
+    bool end = false;
+    while(z->avail_out>0){
+        if(z->avail_in==0){
+            if(fed==size){
+                p->failed = true;
+                p->why = "unexpected end of the compressed file";
+                end = true;
+                break;
+            }
+            size_t n = std::min(size-fed,(size_t)1<<30); // avail_in is a uInt
+            z->next_in  = const_cast<u_char *>(base+fed);
+            z->avail_in = n;
+            fed += n;
+        }
+        int rv = ::inflate(z,Z_NO_FLUSH);
+        if(rv==Z_STREAM_END){
+            /* Another member may follow, as when gzip files are concatenated;
+             * anything else after the stream is ignored, as gzip -d does.
+             */
+            size_t at = fed - z->avail_in;
+            if(size-at >= 2 && base[at]==0x1f && base[at+1]==0x8b){
+                inflateReset(z);
+                continue;
+            }
+            end = true;
+            break;
+        }
+        if(rv!=Z_OK){
+            p->failed = true;
+            p->why = ssprintf("corrupt compressed data at offset %" PRIu64 ": %s",
+                              (uint64_t)(fed - z->avail_in),z->msg ? z->msg : "inflate failed");
+            end = true;
+            break;
+        }
+    }
+    p->len = PIECE_SIZE - z->avail_out;
+    memset(&p->data[p->len],0,PIECE_PAD);
+    return end;
+}
+
+#ifdef HAVE_PTHREAD
+/* static */ void *gzip_input::run_worker(void *arg)
+{
+    ((gzip_input *)arg)->worker();
+    return 0;
+}
+
+void gzip_input::worker()
+{
+    gzip_codec c(0);
+    pthread_mutex_lock(&lock);
+    while(!stopping){
+        piece_t *p = 0;
+        if(blocked && todo.size()){
+            p = todo.front();
+            todo.pop_front();
+        } else if(!blocked && !stream_end && queue.size() < depth){
+            p = new_piece();
+            queue.push_back(p);         // in place, so that the reader waits for it
+        }
+        if(p==0){
+            pthread_cond_wait(&work,&lock);
+            continue;
+        }
+        pthread_mutex_unlock(&lock);
+        bool end = false;
+        if(blocked) inflate_run(p,c);
+        else end = inflate_stream(p);
+        pthread_mutex_lock(&lock);
+        if(end) stream_end = true;
+        p->ready = true;
+        pthread_cond_broadcast(&done);
+    }
+    pthread_mutex_unlock(&lock);
+}
+#endif
+
+bool gzip_input::next(const uint8_t **piece,size_t *len)
+{
+#ifdef HAVE_PTHREAD
+    demux_lock l(workers.size() ? &lock : 0);
+#endif
+    for(;;){
+        if(current){
+            spare.push_back(current);
+            current = 0;
+        }
+        if(blocked){
+            while(queue.size() < depth && planned < size){
+                piece_t *p = new_piece();
+                queue.push_back(p);
+                if(plan(p)) todo.push_back(p);
+                else p->failed = p->ready = true;
+            }
+        }
+#ifdef HAVE_PTHREAD
+        pthread_cond_broadcast(&work);  // there is room in the queue, or runs to inflate
+        while(workers.size() && (queue.empty() ? !(blocked || stream_end) : !queue.front()->ready)){
+            pthread_cond_wait(&done,&lock);
+        }
+#endif
+        if(codec){
+            if(blocked && todo.size()){
+                inflate_run(todo.front(),*codec);
+                todo.front()->ready = true;
+                todo.pop_front();
+            } else if(!blocked && !stream_end){
+                piece_t *p = new_piece();
+                queue.push_back(p);
+                stream_end = inflate_stream(p);
+                p->ready = true;
+            }
+        }
+        if(queue.empty()) return false;
+        current = queue.front();
+        queue.pop_front();
+        if(current->failed){
+            errmsg = current->why;
+            return false;
+        }
+        if(current->len==0) continue;   // the end of a stream that filled the last piece
+        *piece = &current->data[0];
+        *len   = current->len;
+        return true;
+    }
+}
+#endif
@@ -0,0 +1,87 @@
+/*
+ * gzip_input.h:
+ *
+ * gzip-compressed captures (-r file.pcap.gz) inflated in the process and
+ * handed to a pcap_reader in pieces, rather than read from a gunzip at
+ * the other end of a pipe.
+ *
+ * A file in BGZF (from bgzip, say) gives each member's length in its
+ * header, so it can be cut into runs of members without inflating any of
+ * them. The runs are inflated on -S inflate_threads threads at once and
+ * handed over in order. Any other gzip file, a single stream or several
+ * end to end, has to be inflated from the start; one thread does that a
+ * few pieces ahead of the reader, so that inflating and demultiplexing
+ * at least overlap.
+ *
+ * The compressed file is mapped; a piece is a few MiB of the capture.
+ *
+ * #include this file after tcpflow.h and pcap_reader.h
+ */
+
+#ifndef GZIP_INPUT_H
+#define GZIP_INPUT_H
+
+#if defined(HAVE_PCAP_READER) && defined(HAVE_LIBZ)
+#define HAVE_GZIP_INPUT
+
+#include <deque>
+#include <string>
+#include <vector>
+
+class gzip_input : public pcap_source {
+    /* These are not implemented */
+    gzip_input(const gzip_input &);
+    gzip_input &operator=(const gzip_input &);
+
+    enum { PIECE_SIZE = 4*1024*1024,    // of the capture; a run of members is cut after this
+           PIECE_PAD  = 4096 };         // zeros after a piece, as after the end of a mapping
+    struct piece_t {
+        piece_t():data(),len(0),cstart(0),cend(0),ulen(0),ready(false),failed(false),why(){}
+        std::vector<u_char> data;       // len bytes of the capture, then PIECE_PAD zeros
+        size_t      len;
+        size_t      cstart;             // blocked: its members, in the file
+        size_t      cend;
+        size_t      ulen;               // ...and their length, inflated
+        bool        ready;
+        bool        failed;
+        std::string why;
+    };
+    std::string fname;
+    const u_char *base;                 // the compressed file, mapped
+    size_t      size;
+    bool        blocked;                // BGZF, so runs of members are inflated in parallel
+    size_t      planned;                // blocked: where the next run starts
+    struct z_stream_s *z;               // otherwise the one stream
+    size_t      fed;                    // ...how much of the file it has been given
+    bool        stream_end;             // ...and whether it has all been inflated
+    class gzip_codec *codec;            // for inflating in next(), without threads
+    std::deque<piece_t *> queue;        // in the file's order
+    std::deque<piece_t *> todo;         // blocked: those not yet being inflated
+    std::vector<piece_t *> spare;
+    piece_t    *current;                // what next() last returned
+    size_t      depth;                  // how many pieces may be queued
+#ifdef HAVE_PTHREAD
+    std::vector<pthread_t> workers;
+    pthread_mutex_t lock;
+    pthread_cond_t work;                // a run to inflate, or room in the queue
+    pthread_cond_t done;                // a piece is ready
+    bool        stopping;
+    static void *run_worker(void *arg);
+    void worker();
+#endif
+
+    gzip_input(const std::string &fname,const u_char *base,size_t size);
+    void start(uint32_t threads);
+    piece_t *new_piece();
+    bool plan(piece_t *p);              // blocked: the next run
+    void inflate_run(piece_t *p,gzip_codec &codec);
+    bool inflate_stream(piece_t *p);    // true at the end of the stream
+
+public:
+    static gzip_input *open(const std::string &fname,uint32_t threads); // 0 if it isn't gzip
+    virtual ~gzip_input();
+    virtual bool next(const uint8_t **piece,size_t *len);
+};
+#endif
+
+#endif
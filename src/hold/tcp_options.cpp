@@ -1,196 +1,10 @@
 /*
  * tcp option parser. 
  * Originally by Doug Madory
+ *
+ * The parser itself is now tcp_opt_iter, in wifipcap/tcp.h; the options
+ * are left to the callbacks, which can read them with that.
  */
-/* These tcp optinos do not have the size octet */
-#define ZEROLENOPT(o) ((o) == TCPOPT_EOL || (o) == TCPOPT_NOP)
-void parse_tcp_opts(std::list<tcp_opt_t>& opts, const u_char *cp, u_int hlen)
-{
-
-    if (hlen == 0) 
-	return;
-
-    register u_int i, opt, datalen;
-    register u_int len;
-
-    //putchar(' ');
-    //ch = '<';
-    while (hlen > 0) {
-	tcp_opt_t tcpopt;
-
-	//putchar(ch);
-	//TCHECK(*cp);
-	opt = *cp++;
-	if (ZEROLENOPT(opt))
-	    len = 1;
-	else {
-	    //TCHECK(*cp);
-	    len = *cp++;	/* total including type, len */
-	    if (len < 2 || len > hlen)
-		// stop processing on bad opt
-		break;
-	    --hlen;		/* account for length byte */
-	}
-	--hlen;			/* account for type byte */
-	datalen = 0;
-
-/* Bail if "l" bytes of data are not left or were not captured  */
-#define LENCHECK(l) { if ((l) > hlen) break; }
-
-	tcpopt.type = opt;
-	tcpopt.data_raw = cp;
-
-	switch (opt) {
-
-	case TCPOPT_MAXSEG:
-	    //(void)printf("mss");
-	    datalen = 2;
-	    LENCHECK(datalen);
-	    //(void)printf(" %u", EXTRACT_16BITS(cp));
-	    tcpopt.data.mss = EXTRACT_16BITS(cp);
-	    break;
-	    
-	case TCPOPT_EOL:
-	    //(void)printf("eol");
-	    break;
-	    
-	case TCPOPT_NOP:
-	    //(void)printf("nop");
-	    break;
-	    
-	case TCPOPT_WSCALE:
-	    //(void)printf("wscale");
-	    datalen = 1;
-	    LENCHECK(datalen);
-	    //(void)printf(" %u", *cp);
-	    tcpopt.data.wscale = *cp;
-	    break;
-	    
-	case TCPOPT_SACKOK:
-	    //(void)printf("sackOK");
-	    break;
-	    
-	case TCPOPT_SACK:
-	    datalen = len - 2;
-	    if (datalen % 8 != 0) {
-		//(void)printf("malformed sack");
-	    } else {
-		u_int32_t s, e;
-		
-		//(void)printf("sack %d ", datalen / 8);
-		for (i = 0; i < datalen; i += 8) {
-		    LENCHECK(i + 4);
-		    s = EXTRACT_32BITS(cp + i);
-		    LENCHECK(i + 8);
-		    e = EXTRACT_32BITS(cp + i + 4);
-		    /* XXX leave application to do this translation?
-		    if (threv) {
-			s -= thseq;
-			e -= thseq;
-		    } else {
-			s -= thack;
-			e -= thack;
-		    }
-		    (void)printf("{%u:%u}", s, e);
-		    */
-		    tcpopt.data_sack.push_back(std::pair<u_int32_t,u_int32_t>(s,e));
-		}
-	    }
-	    break;
-	    
-	case TCPOPT_ECHO:
-	    //(void)printf("echo");
-	    datalen = 4;
-	    LENCHECK(datalen);
-	    //(void)printf(" %u", EXTRACT_32BITS(cp));
-	    tcpopt.data.echo = EXTRACT_32BITS(cp);
-	    break;
-	    
-	case TCPOPT_ECHOREPLY:
-	    //(void)printf("echoreply");
-	    datalen = 4;
-	    LENCHECK(datalen);
-	    //(void)printf(" %u", EXTRACT_32BITS(cp));
-	    tcpopt.data.echoreply = EXTRACT_32BITS(cp);
-	    break;
-	    
-	case TCPOPT_TIMESTAMP:
-	    //(void)printf("timestamp");
-	    datalen = 8;
-	    //LENCHECK(4);
-	    //(void)printf(" %u", EXTRACT_32BITS(cp));
-	    LENCHECK(datalen);
-	    //(void)printf(" %u", EXTRACT_32BITS(cp + 4));
-	    tcpopt.data.timestamp.tsval = EXTRACT_32BITS(cp);
-	    tcpopt.data.timestamp.tsecr = EXTRACT_32BITS(cp + 4);
-	    break;
-	    
-	case TCPOPT_CC:
-	    //(void)printf("cc");
-	    datalen = 4;
-	    LENCHECK(datalen);
-	    //(void)printf(" %u", EXTRACT_32BITS(cp));
-	    tcpopt.data.cc = EXTRACT_32BITS(cp);
-	    break;
-	    
-	case TCPOPT_CCNEW:
-	    //(void)printf("ccnew");
-	    datalen = 4;
-	    LENCHECK(datalen);
-	    //(void)printf(" %u", EXTRACT_32BITS(cp));
-	    tcpopt.data.ccnew = EXTRACT_32BITS(cp);
-	    break;
-	    
-	case TCPOPT_CCECHO:
-	    //(void)printf("ccecho");
-	    datalen = 4;
-	    LENCHECK(datalen);
-	    //(void)printf(" %u", EXTRACT_32BITS(cp));
-	    tcpopt.data.ccecho = EXTRACT_32BITS(cp);
-	    break;
-	    
-	case TCPOPT_SIGNATURE:
-	    //(void)printf("md5:");
-	    datalen = TCP_SIGLEN;
-	    LENCHECK(datalen);
-	    for (i = 0; i < TCP_SIGLEN; ++i)
-		//(void)printf("%02x", cp[i]);
-		tcpopt.data.signature[i] = cp[i];
-	    break;
-	    
-	default:
-	    //(void)printf("opt-%u:", opt);
-	    datalen = len - 2;
-	    /*
-	    for (i = 0; i < datalen; ++i) {
-		LENCHECK(i);
-		(void)printf("%02x", cp[i]);
-	    }
-	    */
-	    break;
-	}
-	
-	/* Account for data printed */
-	cp += datalen;
-	hlen -= datalen;
-	
-	/* Check specification against observed length */
-	//++datalen;			/* option octet */
-	//if (!ZEROLENOPT(opt))
-	//    ++datalen;		/* size octet */
-	//if (datalen != len)
-	//    (void)printf("[len %d]", len);
-	//ch = ',';
-
-	tcpopt.len = datalen;
-	opts.push_back(tcpopt);
-
-	if (opt == TCPOPT_EOL)
-	    break;
-    }
-    //putchar('>');
-
-}
 
 void
 handle_tcp(const struct timeval& t, WifipcapCallbacks *cbs, 
@@ -226,8 +40,6 @@ handle_tcp(const struct timeval& t, WifipcapCallbacks *cbs,
     hdr.cksum = EXTRACT_16BITS(&tp->th_sum);
     hdr.urgptr = EXTRACT_16BITS(&tp->th_urp);
 
-    //parse_tcp_opts(hdr.opts, bp+sizeof(*tp), hlen-sizeof(*tp));
-
     cbs->HandleTCP(t, ip4h, ip6h, &hdr, hlen==sizeof(*tp)?NULL:bp+sizeof(*tp), hlen-sizeof(*tp), bp+hlen, length-hlen);
 }
 
@@ -15,6 +15,7 @@
 #include <assert.h>
 #include <iostream>
 #include <iomanip>
+#include <vector>
 
 #ifdef HAVE_ARPA_INET_H
 #include <arpa/inet.h>
@@ -26,7 +27,16 @@
 /**
  * the iptree.
  *
+ * The tree is path-compressed (a Patricia tree): there is a node only
+ * where there is a count or where the addresses below it branch, and
+ * each node has the whole prefix that it stands for. The nodes are kept
+ * in one vector and refer to each other by index; pruned nodes are
+ * reused. An address costs about two nodes, rather than one per bit.
+ *
  * pruning a node means cutting off its leaves (the node remains in the tree).
+ * The nodes that can be pruned (those whose children are all leaves) are
+ * kept in a heap, in the order they are to be pruned, from the first
+ * time the tree is pruned on; each prune after that is O(log n).
  */
 
 /* addrbytes is the number of bytes in the address */
@@ -35,192 +45,48 @@ template <typename TYPE,size_t ADDRBYTES> class iptreet {
 private:;
     /**
      * the node class.
-     * Each node tracks the sum that it currently has and its two children.
-     * A node has pointers to the 0 and 1 children, as well as a sum for everything below.
-     * A short address or prefix being tallied may result in BOTH a sum and one or more PTR values.
-     * If a node is pruned, ptr0=ptr1=0 and tsum>0.  
-     * If tsum>0 and ptr0=0 and ptr1=0, then the node cannot be extended.
-     * Nodes need to know their parent so that nodes found through the cache can be made dirty,
-     * which requires knowing their parents.
-     *
-     * Note: currently we get a slightly different answer when the pruning cache is enabled.
-     * Not sure why. It's probably not worth fixing at the moment.
+     * Each node tracks the sum that it currently has, its prefix, and its two children.
+     * A node has the indexes of the 0 and 1 children (0 if there is none; the
+     * root is node 0, which is nobody's child).
+     * A short address or prefix being tallied may result in BOTH a sum and children.
+     * If a node is pruned, it has no children and tsum>0.
+     * If tsum>0 and there are no children, then the node cannot be extended.
+     * Nodes need to know their parent, whose place in the prune heap a
+     * change to them can move.
      */
     class node {
-        /** best describes the best node to prune */
     public:
-        class best {
-        public:
-            best &operator=(const best &that){
-                ptr  = that.ptr;
-                depth = that.depth;
-                return *this;
-            }
-            const node *ptr;
-            int depth;
-            best():ptr(0),depth(-1){}; // don't use this one
-            best(const node *ptr_,int depth_): ptr(ptr_),depth(depth_){}
-            best(const best &b):ptr(b.ptr),depth(b.depth){ }
-            virtual ~best(){}
-            friend std::ostream & operator<<(std::ostream &os,best const & foo) {
-                os << "node=" << foo.ptr << " depth=" << foo.depth << " ";
-                return os;
-            }
-        };
-    private:
-        /* Assignment and copy are not implemented */
-        node &operator=(const iptreet::node &that);
-        node(const node &n);
-    public:
-        class node *parent;
-        class node *ptr0;               // 0 bit next
-        class node *ptr1;               // 1 bit next
-    private:
-    public:;
-        TYPE    tsum;                   // this node and pruned children.
-
-        /* Caching system */
-        mutable bool    dirty;                  // add() has been called and cached data is no longer valid
-        mutable best    cached_best;
-    public:
-        node(node *p):parent(p),ptr0(0),ptr1(0),tsum(),dirty(false),cached_best(){ }
-        int children() const {return (ptr0 ? 1 : 0) + (ptr1 ? 1 : 0);}
-        ~node(){
-            if(ptr0){ delete ptr0; ptr0 = 0; }
-            if(ptr1){ delete ptr1; ptr1 = 0; }
-        };
-        // a node is leaf if tsum>0 and both ptrs are 0.
-        bool isLeaf() const {             
-            if(tsum>0 && ptr0==0 && ptr1==0) return true;
-            return false;
-        }
-        /**
-         * prune():
-         * Cut this node's children off the tree.
-         * Returns the number removed, which should be larger than 0 (or we shouldn't have been called).
-         */
-        int prune(class iptreet &tree){                    // prune this node
-            //std::cerr << "prune " << this << " ptr0= " << ptr0 << " ptr1=" << ptr1 << " parent= " << parent << "\n";
-            /* If prune() on a node is called, then both ptr0 and ptr1 nodes, if present,
-             * must not have children.
-             * Now delete those that we counted out
-             */
-            int removed = 0;
-            if(ptr0){
-                assert(ptr0->isLeaf());   // only prune leaf nodes
-                tsum += ptr0->tsum;
-                tree.cache_remove(ptr0); // remove it from the cache
-                tree.pruned++;
-                delete ptr0;
-                ptr0=0;
-                tree.nodes--;
-                removed++;
-            }
-            if(ptr1){
-                assert(ptr1->isLeaf()); 
-                tsum += ptr1->tsum;
-                tree.cache_remove(ptr1);
-                tree.pruned++;
-                delete ptr1;
-                ptr1=0;
-                tree.nodes--;
-                removed++;
-            }
-            assert(removed>0);
-            assert(isLeaf());           // I am now a leaf!
-            set_dirty();                // should be able to just set parent
-            //std::cerr << "   parent dirty=" << parent->dirty << "  this=" << this << " isLeaf()=" << isLeaf() << "\n";
-            //if(parent){
-            //parent->dirty=true; // parent is dirty, but no need to propigate it up
-            //}
-            return removed;
-        }
-
-        /**
-         * Return the best node to prune (the node with the leaves to remove)
-         * Possible outputs:
-         * case 1 - no node (if this is a leaf node, it can't be pruned; should not have been called)
-         * case 2 - this node (if all of the children are leaf)
-         * case 3 - the best node of the one child (if there is only one child)
-         * case 4 - the of the non-leaf child (if one child is leaf and one is not)
-         * case 5 - the better node of each child's best node.
-         */
-            
-        class best best_to_prune(int my_depth) const {
-            if(dirty==false && cached_best.ptr){
-                //return cached_best;     // haven't changed, so return
-            }
-            dirty = false;              // we will be cleaning
-            // case 1 - this is a leaf; it was an error to call best_to_prune
-            assert(isLeaf()==0);          
-            // case 2 - our only children are leaves; this is the best node
-            if ((ptr0==0 || ptr0->isLeaf()) &&
-                (ptr1==0 || ptr1->isLeaf())){
-                return cached_best = best(this,my_depth); // case 2
-            }
-            // case 3 - one of our children is a node and not a leaf,
-            //        - and the other is a child or not present.
-            //        - The best to prune is the child's best
-
-            if ((ptr0==0 || ptr0->isLeaf()) &&
-                (ptr1!=0 && !ptr1->isLeaf())){
-                return cached_best = ptr1->best_to_prune(my_depth+1); // case 3
-            }
-
-            if ((ptr1==0 || ptr1->isLeaf()) &&
-                (ptr0!=0 && !ptr0->isLeaf())){
-                return cached_best = ptr0->best_to_prune(my_depth+1); // case 3
-            }
-
-            // case 5 - the better node of each child's best node.
-            best ptr0_best = ptr0->best_to_prune(my_depth+1);
-            best ptr1_best = ptr1->best_to_prune(my_depth+1);
-
-            // The better to prune of two children is the one with a lower sum,
-            // or the one that is deeper if they have the same sum.
-            TYPE ptr0_best_sum = ptr0_best.ptr->sum();
-            TYPE ptr1_best_sum = ptr1_best.ptr->sum();
-            if(ptr0_best_sum < ptr1_best_sum ||
-               (ptr0_best_sum == ptr1_best_sum && ptr0_best.depth > ptr1_best.depth)){
-                return cached_best = ptr0_best;
-               }
-            return cached_best = ptr1_best;
-        }
-
-        /** The nodesum is the sum of just the node.
-         * This exists purely because tsum is a private variable.
-         */
-        TYPE nodesum() const {
-            return tsum;
-        }
-
-        /** The sum is the sum of this node and its children (if they exist) */
-        TYPE sum() const {
-            TYPE s = tsum;
-            if(ptr0) s+=ptr0->sum();
-            if(ptr1) s+=ptr1->sum();
-            return s;
-        }
-        /** Increment this node by the given amount */
-        void add(TYPE val) {
-            tsum+=val;                  // increment
-            set_dirty();
-        }          
-
-        void set_dirty() {              // make us dirty and our parent dirty
-            if(dirty==false){
-                dirty = true;
-                if(parent && parent->dirty==false){
-                    parent->set_dirty();    // recurses to the root or the first dirty node.
-                } 
-            }
+        node():tsum(),parent(0),heap_pos(0),depth(0){
+            memset(addr,0,sizeof(addr));
+            child[0] = child[1] = 0;
         }
-
-    }; /* end of node class */
-    class node *root;                  
-    enum {root_depth=0,
-          max_histogram_depth=128,
-          ipv4_bits=32,
+        uint8_t  addr[ADDRBYTES];       // the prefix; the bits from depth on are 0
+        TYPE     tsum;                  // this node and pruned children.
+        uint32_t child[2];              // 0 bit next, 1 bit next
+        uint32_t parent;
+        uint32_t heap_pos;              // in prunable, plus 1; 0 if not there
+        uint16_t depth;                 // the length of the prefix, in bits
+
+        bool childless() const { return child[0]==0 && child[1]==0; }
+        // a node is leaf if tsum>0 and it has no children.
+        bool isLeaf() const { return tsum>0 && childless(); }
+    };
+    typedef std::vector<node> arena_t;
+    arena_t  arena;                     // arena[0] is the root
+    std::vector<uint32_t> free_nodes;   // pruned, for reuse
+    /* an entry in the prune heap; the sum and depth are kept here so that
+     * entries can mostly be compared without looking at their nodes.
+     */
+    class prune_entry {
+    public:
+        prune_entry(TYPE sum_,uint32_t n_,uint16_t depth_):sum(sum_),n(n_),depth(depth_){}
+        TYPE     sum;                   // what n would have if pruned
+        uint32_t n;
+        uint16_t depth;
+    };
+    std::vector<prune_entry> prunable;  // heap of the nodes that can be pruned, next first
+    bool       prunable_built;          // prunable is kept up to date
+    enum {ipv4_bits=32,
           ipv6_bits=128,
     };
     iptreet &operator=(const iptreet &that); // not implemented
@@ -244,14 +110,27 @@ public:
     static void setbit(uint8_t *addr,size_t i){
         addr[i / 8] |= (1<<((7-i)&7));
     }
+    /* the first bit from start up to limit where a and b differ, or limit if none does */
+    static size_t first_difference(const uint8_t *a,const uint8_t *b,size_t start,size_t limit){
+        size_t i = start;
+        while(i<limit){
+            if(i%8==0 && i+8<=limit && a[i/8]==b[i/8]){
+                i += 8;                 // a whole byte at a time where we can
+                continue;
+            }
+            if(bit(a,i)!=bit(b,i)) return i;
+            i++;
+        }
+        return limit;
+    }
     
     virtual ~iptreet(){}                // required per compiler warnings
     /* copy is a deep copy */
-    iptreet(const iptreet &n):root(n.root ? new node(*n.root) : 0),
-                              nodes(n.nodes),maxnodes(n.maxnodes),ctr_added(),pruned(),cache(),cachenext(),cache_hits(),cache_misses(){};
+    iptreet(const iptreet &n):arena(n.arena),free_nodes(n.free_nodes),prunable(n.prunable),prunable_built(n.prunable_built),
+                              nodes(n.nodes),maxnodes(n.maxnodes),ctr_added(),pruned(),cache(n.cache),cachenext(),cache_hits(),cache_misses(){};
 
     /* create an empty tree */
-    iptreet(int maxnodes_):root(new node(0)),nodes(0),maxnodes(maxnodes_),
+    iptreet(int maxnodes_):arena(1),free_nodes(),prunable(),prunable_built(false),nodes(0),maxnodes(maxnodes_),
                            ctr_added(),pruned(),cache(),cachenext(),cache_hits(),cache_misses(){
         for(size_t i=0;i<cache_size;i++){
             cache.push_back(cache_element(0,0,0));
@@ -262,10 +141,49 @@ public:
     size_t size() const {return nodes;};
 
     /* sum the tree; the total number of adds that have been performed */
-    TYPE sum() const {return root->sum();};
+    TYPE sum() const {return sum(0);};
+
+    /** The sum is the sum of this node and its children (if they exist) */
+    TYPE sum(uint32_t n) const {
+        TYPE s = arena[n].tsum;
+        if(arena[n].child[0]) s+=sum(arena[n].child[0]);
+        if(arena[n].child[1]) s+=sum(arena[n].child[1]);
+        return s;
+    }
 
     /* add a node; implementation below */
-    void add(const uint8_t *addr,size_t addrlen,TYPE val); 
+    void add(const uint8_t *addr,size_t addrlen,TYPE val,size_t max_depth=ADDRBYTES*8); 
+
+    /****************************************************************
+     *** nodes
+     ****************************************************************/
+
+    /* a node for the first depth bits of addr; this may move the arena */
+    uint32_t new_node(const uint8_t *addr,size_t depth,uint32_t parent){
+        uint32_t n = 0;
+        if(free_nodes.size()){
+            n = free_nodes.back();
+            free_nodes.pop_back();
+            arena[n] = node();
+        } else {
+            n = arena.size();
+            arena.push_back(node());
+        }
+        node &nd = arena[n];
+        memcpy(nd.addr,addr,(depth+7)/8);
+        if(depth%8) nd.addr[depth/8] &= (uint8_t)(0xff << (8 - depth%8));
+        nd.depth  = depth;
+        nd.parent = parent;
+        nodes++;
+        ctr_added++;
+        return n;
+    }
+
+    /** Increment node n by the given amount */
+    void add_to(uint32_t n,TYPE val){
+        arena[n].tsum += val;           // increment
+        changed(n);
+    }
 
     /****************************************************************
      *** cache
@@ -273,8 +191,9 @@ public:
     class cache_element {
     public:
         uint8_t addr[ADDRBYTES];
-        node *ptr;                      // 0 means cache entry is not in use
-        cache_element(const uint8_t addr_[ADDRBYTES],size_t addrlen,node *p):addr(),ptr(p){
+        uint16_t depth;                 // of the address, as add() was given it
+        uint32_t ptr;                   // 0 means cache entry is not in use (the root isn't cached)
+        cache_element(const uint8_t addr_[ADDRBYTES],size_t addrlen,uint32_t p):addr(),depth(addrlen*8),ptr(p){
             memcpy(addr,addr_,addrlen);
         }
     };
@@ -285,7 +204,7 @@ public:
     uint64_t cache_hits;
     uint64_t cache_misses;
 
-    void cache_remove(const node *p){
+    void cache_remove(uint32_t p){
         for(size_t i=0;i<cache.size();i++){
             if(cache[i].ptr==p){
                 cache[i].ptr = 0;
@@ -294,9 +213,10 @@ public:
         }
     }
 
-    ssize_t cache_search(const uint8_t *addr,size_t addrlen){
+    /* a prefix and an address may have the same bytes, so the depth must match too */
+    ssize_t cache_search(const uint8_t *addr,size_t addrlen,size_t depth){
         for(size_t i = 0; i<cache.size(); i++){
-            if(cache[i].ptr && memcmp(cache[i].addr,addr,addrlen)==0){
+            if(cache[i].ptr && cache[i].depth==depth && memcmp(cache[i].addr,addr,addrlen)==0){
                 cache_hits++;
                 return i;
             }
@@ -305,9 +225,10 @@ public:
         return -1;
     }
 
-    void cache_replace(const uint8_t *addr,size_t addrlen,node *ptr) {
+    void cache_replace(const uint8_t *addr,size_t addrlen,size_t depth,uint32_t ptr) {
         if(++cachenext>=cache.size()) cachenext = 0;
         memcpy(cache[cachenext].addr,addr,addrlen);
+        cache[cachenext].depth = depth;
         cache[cachenext].ptr = ptr;
     }
 
@@ -316,26 +237,167 @@ public:
      *** pruning
      ****************************************************************/
 
-    /* prune the tree, starting at the root. Find the node to prune and then prune it.
-     * node that best_to_prune() returns a const pointer. But we want to modify it, so we
-     * do a const_cast (which is completely fine).
+    /**
+     * prune():
+     * Cut node n's children off the tree.
+     * Returns the number removed, which should be larger than 0 (or we shouldn't have been called).
      */
-    int prune_best_node(){
-        if(root->isLeaf()) return 0;        // leaf nodes can't be pruned
-        class node::best b = root->best_to_prune(root_depth);
-        node *tnode = const_cast<node *>(b.ptr);
-        if(tnode){
-            return tnode->prune(*this);
+    int prune(uint32_t n){
+        /* If prune() on a node is called, then its children, if present,
+         * must not have children.
+         */
+        int removed = 0;
+        for(int i=0;i<2;i++){
+            uint32_t c = arena[n].child[i];
+            if(c==0) continue;
+            assert(arena[c].childless()); // only prune leaf nodes
+            arena[n].tsum += arena[c].tsum;
+            arena[n].child[i] = 0;
+            cache_remove(c);            // remove it from the cache
+            free_nodes.push_back(c);
+            pruned++;
+            nodes--;
+            removed++;
         }
-        return 0;
+        assert(removed>0);
+        changed(n);
+        return removed;
+    }
+
+    /* the sum that pruning n would leave it with */
+    TYPE prune_sum(uint32_t n) const {
+        const node &nd = arena[n];
+        TYPE s = nd.tsum;
+        if(nd.child[0]) s+=arena[nd.child[0]].tsum;
+        if(nd.child[1]) s+=arena[nd.child[1]].tsum;
+        return s;
+    }
+
+    /* n can be pruned if it has children and they are all leaves */
+    bool can_prune(uint32_t n) const {
+        const node &nd = arena[n];
+        if(nd.childless()) return false;
+        return (nd.child[0]==0 || arena[nd.child[0]].childless()) &&
+               (nd.child[1]==0 || arena[nd.child[1]].childless());
+    }
+
+    /**
+     * Whether a is to be pruned before b: the one with the lower sum is, or
+     * the one that is deeper if they have the same sum, or the one with the
+     * higher address if they are as deep.
+     */
+    bool prune_before(const prune_entry &a,const prune_entry &b) const {
+        if(a.sum != b.sum) return a.sum < b.sum;
+        if(a.depth != b.depth) return a.depth > b.depth;
+        return memcmp(arena[a.n].addr,arena[b.n].addr,ADDRBYTES) > 0;
+    }
+
+    void heap_set(size_t pos,const prune_entry &e){
+        prunable[pos] = e;
+        arena[e.n].heap_pos = pos+1;
+    }
+    void heap_up(size_t pos){
+        prune_entry e = prunable[pos];
+        while(pos>0){
+            size_t up = (pos-1)/2;
+            if(!prune_before(e,prunable[up])) break;
+            heap_set(pos,prunable[up]);
+            pos = up;
+        }
+        heap_set(pos,e);
+    }
+    void heap_down(size_t pos){
+        prune_entry e = prunable[pos];
+        while(true){
+            size_t down = pos*2+1;
+            if(down>=prunable.size()) break;
+            if(down+1<prunable.size() && prune_before(prunable[down+1],prunable[down])) down++;
+            if(!prune_before(prunable[down],e)) break;
+            heap_set(pos,prunable[down]);
+            pos = down;
+        }
+        heap_set(pos,e);
+    }
+
+    /* put n in the heap, take it out, or move it, as it now needs */
+    void reconsider(uint32_t n){
+        bool wanted = can_prune(n);
+        uint32_t pos = arena[n].heap_pos;
+        if(wanted && pos==0){
+            prunable.push_back(prune_entry(prune_sum(n),n,arena[n].depth));
+            heap_up(prunable.size()-1);
+        } else if(!wanted && pos!=0){
+            prune_entry last = prunable.back();
+            prunable.pop_back();
+            arena[n].heap_pos = 0;
+            if(last.n!=n){
+                heap_set(pos-1,last);
+                heap_up(pos-1);
+                heap_down(arena[last.n].heap_pos-1);
+            }
+        } else if(wanted){
+            TYPE sum = prune_sum(n);
+            TYPE was = prunable[pos-1].sum;
+            if(sum==was) return;
+            prunable[pos-1].sum = sum;
+            if(sum < was) heap_up(pos-1);
+            else heap_down(pos-1);
+        }
+    }
+
+    /* n's sum or children have changed, which can change whether n and
+     * its parent can be pruned, and when.
+     */
+    void changed(uint32_t n){
+        if(!prunable_built) return;
+        reconsider(n);
+        if(n!=0) reconsider(arena[n].parent);
+    }
+
+    void find_prunable(uint32_t n){
+        if(can_prune(n)){
+            prunable.push_back(prune_entry(prune_sum(n),n,arena[n].depth));
+            return;
+        }
+        if(arena[n].child[0]) find_prunable(arena[n].child[0]);
+        if(arena[n].child[1]) find_prunable(arena[n].child[1]);
+    }
+
+    /* the first time the tree is pruned, make the heap */
+    void build_prunable(){
+        find_prunable(0);
+        for(size_t i=0;i<prunable.size();i++){
+            arena[prunable[i].n].heap_pos = i+1;
+        }
+        for(size_t i=prunable.size()/2;i>0;i--){
+            heap_down(i-1);
+        }
+        prunable_built = true;
+    }
+
+    /* prune the tree until it has no more than target nodes, or can't be pruned further.
+     * Returns the number of nodes removed.
+     */
+    size_t prune_to(size_t target){
+        if(!prunable_built) build_prunable();
+        size_t removed = 0;
+        while(nodes > target && prunable.size()){
+            removed += prune(prunable[0].n);
+        }
+        return removed;
+    }
+
+    /* Find the node to prune and then prune it. */
+    int prune_best_node(){
+        if(!prunable_built) build_prunable();
+        if(prunable.empty()) return 0;  // leaf nodes can't be pruned
+        return prune(prunable[0].n);
     }
 
     /* Simple implementation to prune the table if over the limit.
      */
     void prune_if_needed(){
-        while(nodes > maxnodes){
-            if(prune_best_node()==0) return; // cannot prune
-        }
+        if(nodes > maxnodes) prune_to(maxnodes);
     }
 
     /****************************************************************
@@ -362,7 +424,7 @@ public:
         uint8_t depth;                         // in bits; /depth
         TYPE count;
         
-        bool is4() const { return isipv4(addr,ADDRBYTES);};
+        bool is4() const { return depth<=ipv4_bits && isipv4(addr,ADDRBYTES);};
         std::string str() const { return ipstr(addr,ADDRBYTES,depth); }
     };
 
@@ -371,33 +433,30 @@ public:
      * This is leaf nodes and inleafediate nodes.
      * This means that there must be a way for converting TYPE(count) to a boolean.
      *
-     * @param depth - tracks current depth (in bits) into address.
-     * @param ptr   - the node currently being queried
+     * @param n     - the node currently being queried
      * @param histogram - where the histogram is written
      */
     typedef std::vector<addr_elem> histogram_t;
-    void get_histogram(int depth,const uint8_t *addr,const class node *ptr,histogram_t  &histogram) const{
-        if(ptr->nodesum()){
-            histogram.push_back(addr_elem(addr,depth,ptr->nodesum()));
-            //return;
+    void get_histogram(uint32_t n,histogram_t &histogram) const{
+        const node &nd = arena[n];
+        if(nd.tsum){
+            histogram.push_back(addr_elem(nd.addr,nd.depth,nd.tsum));
         }
-        if(depth>max_histogram_depth) return;               // can't go deeper than this now
-        
-        /* create address with 0 and 1 added */
-        uint8_t addr0[ADDRBYTES];
-        uint8_t addr1[ADDRBYTES];
-        
-        memset(addr0,0,sizeof(addr0)); memcpy(addr0,addr,(depth+7)/8);
-        memset(addr1,0,sizeof(addr1)); memcpy(addr1,addr,(depth+7)/8); setbit(addr1,depth);
-        
-        if(ptr->ptr0) get_histogram(depth+1,addr0,ptr->ptr0,histogram);
-        if(ptr->ptr1) get_histogram(depth+1,addr1,ptr->ptr1,histogram);
+        if(nd.child[0]) get_histogram(nd.child[0],histogram);
+        if(nd.child[1]) get_histogram(nd.child[1],histogram);
     }
         
     void get_histogram(histogram_t &histogram) const { // adds the histogram to the passed in vector
-        uint8_t addr[ADDRBYTES];
-        memset(addr,0,sizeof(addr));
-        get_histogram(0,addr,root,histogram);
+        get_histogram(0,histogram);
+    }
+
+    /* add everything counted in that, each count at its own depth; this tree is pruned as needed */
+    void merge(const iptreet &that){
+        histogram_t histogram;
+        that.get_histogram(histogram);
+        for(size_t i=0;i<histogram.size();i++){
+            add(histogram[i].addr,ADDRBYTES,histogram[i].count,histogram[i].depth);
+        }
     }
 
     /****************************************************************
@@ -417,8 +476,9 @@ public:
         }
         return true;
     }
+    /* an IPv6 prefix may end in zeros too, but it is deeper than any IPv4 address */
     static std::string ipstr(const uint8_t *addr,size_t addrlen,size_t depth){
-        if(isipv4(addr,addrlen)){
+        if(depth<=ipv4_bits && isipv4(addr,addrlen)){
             return ipv4(addr) + (depth<ipv4_bits  ? (std::string("/") + itos(depth)) : "");
         } else {
             return ipv6(addr) + (depth<ipv6_bits ? (std::string("/") + itos(depth)) : "");
@@ -465,59 +525,76 @@ public:
  * @param val - what to add. Use "1" to tally the number of packets,
  * "bytes" to count the number of bytes associated with each IP
  * address.
+ *
+ * @param max_depth - count the address under its prefix of this many bits,
+ * so that no node is made below it (e.g. 64 for IPv6 clients whose
+ * privacy addresses change)
  */ 
 template <typename TYPE,size_t ADDRBYTES>
-void iptreet<TYPE,ADDRBYTES>::add(const uint8_t *addr,size_t addrlen,TYPE val)
+void iptreet<TYPE,ADDRBYTES>::add(const uint8_t *addr,size_t addrlen,TYPE val,size_t max_depth)
 {
     prune_if_needed();
     if(addrlen > ADDRBYTES) addrlen=ADDRBYTES;
 
     u_int addr_bits = addrlen * 8;  // in bits
+    uint8_t prefix[ADDRBYTES];
+    if(max_depth < addr_bits){
+        addr_bits = max_depth;
+        memset(prefix,0,sizeof(prefix));
+        memcpy(prefix,addr,(addr_bits+7)/8);
+        if(addr_bits%8) prefix[addr_bits/8] &= (uint8_t)(0xff << (8 - addr_bits%8));
+        addr = prefix;                  // so the cache finds it by its prefix too
+    }
 
     
     /* check the cache first */
-    ssize_t i = cache_search(addr,addrlen);
+    ssize_t i = cache_search(addr,addrlen,addr_bits);
     if(i>=0){
-        cache[i].ptr->add(val);
+        add_to(cache[i].ptr,val);
         return;
     }
 
     /* descend the radix tree until we run out of bits, or we have a
-       node with no pointers and a non-zero sum.
+       node with no children and a non-zero sum.
      */
 
-    node *ptr = root;               // start at the root
-    for(u_int depth=0;depth<=addr_bits;depth++){
-        if(depth==addr_bits){       // reached end of address
-            ptr->add(val);          // increment this node (and all of its descendants 
-            cache_replace(addr,addrlen,ptr);
-            return;
-        }
-        if((ptr->tsum > 0) && (ptr->ptr0==0) && (ptr->ptr1==0)){
-            ptr->add(val);
-            cache_replace(addr,addrlen,ptr);
+    uint32_t n = 0;                     // start at the root
+    while(true){
+        if(arena[n].depth==addr_bits || arena[n].isLeaf()){
+            add_to(n,val);              // increment this node
+            cache_replace(addr,addrlen,addr_bits,n);
             return;
         }
         /* Not a leaf node, so go down a level based on the next bit,
          * extending if necessary.
          */
-        if(bit(addr,depth)==0){
-            if(ptr->ptr0==0){
-                ptr->ptr0 = new node(ptr);
-                nodes++;
-                ctr_added++;
-            }
-            ptr = ptr->ptr0;
-        } else {
-            if(ptr->ptr1==0){
-                ptr->ptr1 = new node(ptr); 
-                nodes++;
-                ctr_added++;
-            }
-            ptr = ptr->ptr1;
+        bool b = bit(addr,arena[n].depth);
+        uint32_t c = arena[n].child[b];
+        if(c==0){                       // nothing this way yet: a leaf for the whole address
+            c = new_node(addr,addr_bits,n);
+            arena[n].child[b] = c;
+            changed(n);
+            add_to(c,val);
+            cache_replace(addr,addrlen,addr_bits,c);
+            return;
+        }
+        size_t limit = std::min((size_t)arena[c].depth,(size_t)addr_bits);
+        size_t split = first_difference(addr,arena[c].addr,arena[n].depth+1,limit);
+        if(split==arena[c].depth){      // the address is under c
+            n = c;
+            continue;
         }
+        /* The address leaves c's prefix, or ends, at split: a node for what
+         * they share. It is where the address is counted, if it ends there,
+         * or the parent of its new leaf.
+         */
+        uint32_t s = new_node(addr,split,n);
+        arena[n].child[b] = s;
+        arena[s].child[bit(arena[c].addr,split)] = c;
+        arena[c].parent = s;
+        changed(s);
+        n = s;
     }
-    assert(0);                          // should never happen
 }
 
 
@@ -0,0 +1,141 @@
+/*
+ * iptree_bench.cpp:
+ *
+ * Times the iptree's pruning. The addresses and counts of an iphtest
+ * histogram (../tests/iphtest-nitroba-10000.txt was made without any
+ * pruning) are replayed one packet at a time, in a shuffled order, into
+ * a tree of at most maxnodes nodes. With a churn of N, each of those
+ * packets is followed by N from addresses that are never seen again, as
+ * a scan or a flood would send. Then the packets are replayed without a
+ * limit and the tree is trimmed to maxnodes all at once, which is
+ * printed the way the iphtest files are.
+ *
+ * Built by "make iptree_bench"; "make benchiph" runs it.
+ *
+ * usage: iptree_bench maxnodes histogram.txt [churn]
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+
+#ifndef HAVE_ARPA_INET_H
+#define HAVE_ARPA_INET_H
+#endif
+#include "iptree.h"
+
+class address {
+public:
+    address():len(0){ memset(addr,0,sizeof(addr)); }
+    uint8_t addr[IP6_ADDR_LEN];
+    size_t  len;
+};
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv,0);
+    return tv.tv_sec + tv.tv_usec/1000000.0;
+}
+
+/* a full-period generator, so the churn addresses don't repeat */
+static uint32_t lcg = 1;
+static uint32_t next_random()
+{
+    lcg = lcg * 1664525 + 1013904223;
+    return lcg;
+}
+
+static void replay(iptree &tree,const std::vector<address> &addrs,const std::vector<uint32_t> &packets,int churn)
+{
+    for(size_t i=0;i<packets.size();i++){
+        const address &a = addrs[packets[i]];
+        tree.add(a.addr,a.len,1);
+        for(int j=0;j<churn;j++){
+            uint32_t scan = next_random();
+            tree.add((const uint8_t *)&scan,IP4_ADDR_LEN,1);
+        }
+    }
+}
+
+int main(int argc,char **argv)
+{
+    if(argc<3){
+        fprintf(stderr,"usage: %s maxnodes histogram.txt [churn]\n",argv[0]);
+        exit(1);
+    }
+    size_t maxnodes = atoi(argv[1]);
+    int churn = argc>3 ? atoi(argv[3]) : 0;
+
+    /* the lines are "address  count=N"; prefixes (address/len) are skipped */
+    std::ifstream in(argv[2]);
+    if(!in.is_open()){
+        perror(argv[2]);
+        exit(1);
+    }
+    std::vector<address> addrs;
+    std::vector<uint32_t> packets;      // the index in addrs of each packet
+    std::string line;
+    while(getline(in,line)){
+        size_t sp = line.find("  count=");
+        if(sp==std::string::npos || line.find('/')<sp) continue;
+        std::string name = line.substr(0,sp);
+        address a;
+        if(inet_pton(AF_INET,name.c_str(),a.addr)==1){
+            a.len = IP4_ADDR_LEN;
+        } else if(inet_pton(AF_INET6,name.c_str(),a.addr)==1){
+            a.len = IP6_ADDR_LEN;
+        } else {
+            continue;
+        }
+        long count = atol(line.c_str()+sp+8);
+        for(long i=0;i<count;i++) packets.push_back(addrs.size());
+        addrs.push_back(a);
+    }
+    for(size_t i=packets.size();i>1;i--){
+        std::swap(packets[i-1],packets[next_random()%i]);
+    }
+
+    /* pruning as packets arrive */
+    iptree limited(maxnodes);
+    double start = now();
+    replay(limited,addrs,packets,churn);
+    double elapsed = now()-start;
+    uint64_t expected = packets.size() * (uint64_t)(churn+1);
+    fprintf(stderr,"%zu addresses, %zu packets, churn %d, maxnodes %zu: %.3f s, %zu nodes\n",
+            addrs.size(),packets.size(),churn,maxnodes,elapsed,limited.size());
+    if(limited.sum()!=expected){
+        fprintf(stderr,"sum is %llu; expected %llu\n",(unsigned long long)limited.sum(),(unsigned long long)expected);
+        exit(1);
+    }
+
+    /* everything, then pruned at once */
+    iptree whole(packets.size()*2+1);
+    replay(whole,addrs,packets,0);
+    std::cout << "trim before: " << whole.size() << "\n";
+    start = now();
+    whole.prune_to(maxnodes);
+    elapsed = now()-start;
+    std::cout << "trim after: " << whole.size() << "\n";
+    iptree::histogram_t histogram;
+    whole.get_histogram(histogram);
+    std::cout << "nodes: " << whole.size() << "  histogram size: " << histogram.size() << "\n";
+    for(size_t i=0;i<histogram.size();i++){
+        std::cout << histogram.at(i).str() << "  count=" << histogram.at(i).count << "\n";
+    }
+    fprintf(stderr,"trimmed to %zu nodes in %.6f s\n",whole.size(),elapsed);
+    if(whole.sum()!=packets.size()){
+        fprintf(stderr,"trimmed sum is %llu; expected %zu\n",(unsigned long long)whole.sum(),packets.size());
+        exit(1);
+    }
+    return 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * memory_budget.h:
+ *
+ * What a demux's flows hold in memory, by what holds it, for -S memory_max.
+ *
+ * The write-behind buffers, reorder queues, held heads and saved flows each
+ * have a limit of their own (write_buffer_max, reorder_queue_max,
+ * memory_flow_max, max_saved_flows) and the flow table has none, so a SYN
+ * flood or a capture full of gaps can outgrow the machine however each is
+ * set. With memory_max, each demux (each shard gets an equal part) adds up
+ * what they hold after every packet, and when it is over, relieve_memory()
+ * frees it in the order of the uses below, stopping as soon as the total is
+ * back under 3/4 of memory_max:
+ *
+ *   WRITE_BUFFERS   written to their files
+ *   REORDER_QUEUES  written where they belong, leaving holes for the gaps
+ *   HELD_FLOWS      resident flows and held prefixes given their files
+ *   FLOWS           the least recently seen flows closed, as if they had timed out
+ *   SAVED_FLOWS     the saved flow ring halved, forgetting what it held
+ *
+ * The reorder queues and held heads count their bytes as they change;
+ * memory_used() takes the rest from what already keeps track of it, with a
+ * fixed estimate for each flow in the flow table (tcpdemux::flow_bytes()).
+ * None of it counts allocator overhead, so memory_max is best set below
+ * what the process may really use.
+ *
+ * HELD_REPORTS is only the master's: with -j reading files, the shards'
+ * finished flows held so report.xml is in flow id order. They aren't
+ * freed by relieve_memory(); record_flow() records them early, in
+ * batches, once they hold more than one shard's share of memory_max.
+ *
+ * The netviz report keeps its own limits (max_histogram_size and the
+ * iptrees' maxnodes) on its own thread and isn't counted.
+ *
+ * #include this file after tcpflow.h
+ */
+
+#ifndef MEMORY_BUDGET_H
+#define MEMORY_BUDGET_H
+
+class memory_budget {
+public:
+    enum use { WRITE_BUFFERS,           // in the order they are freed
+               REORDER_QUEUES,
+               HELD_FLOWS,
+               FLOWS,
+               SAVED_FLOWS,
+               HELD_REPORTS,            // master only; see record_flow()
+               NUM_USES };
+    uint64_t used[NUM_USES];
+
+    memory_budget(){ memset(used,0,sizeof(used)); }
+    void change(use u,uint64_t before,uint64_t after){ used[u] += after; used[u] -= before; }
+    uint64_t total() const {
+        uint64_t t = 0;
+        for(int i=0;i<NUM_USES;i++) t += used[i];
+        return t;
+    }
+    static const char *name(use u){
+        switch(u){
+        case WRITE_BUFFERS:  return "write_buffers";
+        case REORDER_QUEUES: return "reorder_queues";
+        case HELD_FLOWS:     return "held_flows";
+        case FLOWS:          return "flows";
+        case SAVED_FLOWS:    return "saved_flows";
+        case HELD_REPORTS:   return "held_reports";
+        default:             return "?";
+        }
+    }
+};
+
+#endif
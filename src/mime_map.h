@@ -12,6 +12,12 @@
 
 #include <string>
 
+#include <stddef.h>
+
+/* The file extension for a MIME type, or "" if it is not known.
+ * Case does not matter, and parameters (after a ';') are ignored.
+ */
+const char *get_extension_for_mime_type(const char *mime_type, size_t len);
 std::string get_extension_for_mime_type(const std::string& mime_type);
 
 #endif /* MIME_MAP_H */
\ No newline at end of file
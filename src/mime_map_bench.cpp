@@ -0,0 +1,115 @@
+/*
+ * mime_map_bench.cpp:
+ *
+ * Times get_extension_for_mime_type(), which looks types up through
+ * mime_map.cpp's perfect hash, against a binary search of the same sorted
+ * table, as it was looked up before. Every type in the table, upper-cased,
+ * with "; charset=utf-8" and with a letter too many or too few, is looked
+ * up both ways, and the answers must agree. Then each way is timed over
+ * the whole table and over a few types a web capture is full of; the
+ * perfect hash takes the same time whichever type it is given, where the
+ * binary search grows with the table.
+ *
+ * Built by "make mime_map_bench"; "make benchmime" runs it.
+ *
+ * usage: mime_map_bench [rounds]
+ */
+
+#include "mime_map.cpp"                 // for the table itself
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <string>
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv,0);
+    return tv.tv_sec + tv.tv_usec/1000000.0;
+}
+
+/* The lookup mime_index replaced */
+static const char *binary_search(const char *mime_type,size_t len)
+{
+    char base_type[128];
+    size_t base_len = 0;
+    for(size_t i=0;i<len && mime_type[i]!=';';i++){
+        if(base_len==sizeof(base_type) || mime_type[i]==0) return "";
+        char c = mime_type[i];
+        base_type[base_len++] = (c>='A' && c<='Z') ? c-'A'+'a' : c;
+    }
+    size_t lo = 0;
+    size_t hi = mime_map_size;
+    while(lo<hi){
+        size_t mid = lo + (hi-lo)/2;
+        int c = strncmp(mime_map[mid].mime_type,base_type,base_len);
+        if(c==0 && mime_map[mid].mime_type[base_len]!=0) c = 1;
+        if(c==0) return mime_map[mid].extension;
+        if(c<0) lo = mid+1;
+        else hi = mid;
+    }
+    return "";
+}
+
+typedef const char *(*lookup)(const char *,size_t);
+
+static double time_lookups(lookup f,const std::vector<std::string> &types,int rounds,size_t &sum)
+{
+    double start = now();
+    for(int r=0;r<rounds;r++){
+        for(std::vector<std::string>::const_iterator it=types.begin();it!=types.end();it++){
+            sum += f(it->data(),it->size())[0];
+        }
+    }
+    return (now()-start) * 1e9 / ((double)rounds*types.size());
+}
+
+int main(int argc,char **argv)
+{
+    int rounds = argc>1 ? atoi(argv[1]) : 2000;
+    if(rounds<1) rounds = 1;
+
+    std::vector<std::string> table,probes;
+    for(size_t i=0;i<mime_map_size;i++){
+        std::string t(mime_map[i].mime_type);
+        std::string upper(t);
+        for(size_t j=0;j<upper.size();j++) if(upper[j]>='a' && upper[j]<='z') upper[j] += 'A'-'a';
+        table.push_back(t);
+        probes.push_back(t);
+        probes.push_back(upper);
+        probes.push_back(t + "; charset=utf-8");
+        probes.push_back(t + "x");
+        probes.push_back(t.substr(0,t.size()-1));
+    }
+    probes.push_back("");
+    probes.push_back(";");
+    probes.push_back(std::string("text/h\0tml",10));
+
+    int mismatches = 0;
+    for(std::vector<std::string>::const_iterator it=probes.begin();it!=probes.end();it++){
+        const char *a = get_extension_for_mime_type(it->data(),it->size());
+        const char *b = binary_search(it->data(),it->size());
+        if(strcmp(a,b)){
+            printf("mismatch: '%s': '%s' by hash, '%s' by binary search\n",it->c_str(),a,b);
+            mismatches++;
+        }
+    }
+    printf("%zu types, %zu probes, %d mismatches\n",table.size(),probes.size(),mismatches);
+
+    static const char *common_types[] = {
+        "text/html; charset=utf-8", "image/png", "application/json", "IMAGE/JPEG",
+        "application/x-unknown", "text/plain", "video/mp4", "application/octet-stream",
+        "image/gif", "text/css" };
+    std::vector<std::string> common(common_types,common_types+sizeof(common_types)/sizeof(common_types[0]));
+
+    size_t sum = 0;
+    printf("every type:   %6.1f ns by hash, %6.1f ns by binary search\n",
+           time_lookups(get_extension_for_mime_type,table,rounds,sum),
+           time_lookups(binary_search,table,rounds,sum));
+    printf("common types: %6.1f ns by hash, %6.1f ns by binary search\n",
+           time_lookups(get_extension_for_mime_type,common,rounds*50,sum),
+           time_lookups(binary_search,common,rounds*50,sum));
+    if(sum==0) printf("\n");            // so the lookups aren't optimized away
+    return mismatches ? 1 : 0;
+}
@@ -134,6 +134,11 @@ const address_histogram &address_histogram_view::get_data() const
 
 string address_histogram_view::compressed_ip6_str(iptree::addr_elem address)
 {
+    // a prefix has nothing in its last group to show; show its length
+    if(address.depth < 128) {
+        return ssprintf("%x:%x.../%d", (address.addr[0] << 8) + address.addr[1],
+                (address.addr[2] << 8) + address.addr[3], address.depth);
+    }
     return ssprintf("%x:%x...%x", (address.addr[0] << 8) + address.addr[1],
             (address.addr[2] << 8) + address.addr[3],
             (address.addr[14] << 8) + address.addr[15]);
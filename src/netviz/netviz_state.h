@@ -0,0 +1,66 @@
+/**
+ * netviz_state.h:
+ * Reading and writing the numbers of a report's saved state
+ *
+ * Numbers are written 7 bits at a time, low bits first, with the high
+ * bit set on every byte but the last, so that small counts take a byte
+ * and the file doesn't depend on the host's byte order.
+ *
+ * This source file is public domain, as it is not based on the original tcpflow.
+ *
+ */
+
+#ifndef NETVIZ_STATE_H
+#define NETVIZ_STATE_H
+
+#include <sys/time.h>
+#include <istream>
+#include <ostream>
+
+namespace netviz_state {
+    inline void put(std::ostream &out, uint64_t value) {
+        while(value >= 0x80) {
+            out.put((char) (value | 0x80));
+            value >>= 7;
+        }
+        out.put((char) value);
+    }
+
+    // false at the end of the input, or if the number is too long
+    inline bool get(std::istream &in, uint64_t &value) {
+        value = 0;
+        for(int shift = 0; shift < 64; shift += 7) {
+            int c = in.get();
+            if(c == EOF) {
+                return false;
+            }
+            value |= (uint64_t) (c & 0x7f) << shift;
+            if((c & 0x80) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // as get(), and false if the number is more than max
+    inline bool get(std::istream &in, uint64_t &value, uint64_t max) {
+        return get(in, value) && value <= max;
+    }
+
+    inline void put(std::ostream &out, const struct timeval &tv) {
+        put(out, tv.tv_sec);
+        put(out, tv.tv_usec);
+    }
+
+    inline bool get(std::istream &in, struct timeval &tv) {
+        uint64_t sec = 0, usec = 0;
+        if(!get(in, sec) || !get(in, usec, 999999)) {
+            return false;
+        }
+        tv.tv_sec = sec;
+        tv.tv_usec = usec;
+        return true;
+    }
+}
+
+#endif
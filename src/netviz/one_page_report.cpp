@@ -19,8 +19,17 @@
 #include <ctime>
 #include <iomanip>
 #include <math.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include "one_page_report.h"
+#include "netviz_state.h"
+
+// panels are drawn onto recording surfaces, which came with cairo 1.10
+#if defined(HAVE_PTHREAD) && CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 10, 0)
+#define HAVE_PARALLEL_RENDER
+#endif
 
 using namespace std;
 
@@ -28,6 +37,7 @@ const unsigned int one_page_report::max_bars = 100;
 const unsigned int one_page_report::port_colors_count = 4;
 // string constants
 const string one_page_report::title_version = PACKAGE_NAME " " PACKAGE_VERSION;
+const string one_page_report::state_magic = "tcpflow netviz state 1\n";
 const string one_page_report::generic_legend_format = "Port %d";
 const vector<one_page_report::transport_type> one_page_report::display_transports =
         one_page_report::build_display_transports();
@@ -55,14 +65,17 @@ const plot_view::rgb_t one_page_report::color_yellow(0.99, 1.00, 0.00);
 const plot_view::rgb_t one_page_report::color_light_orange(1.00, 0.73, 0.00);
 const plot_view::rgb_t one_page_report::cdf_color(0.00, 0.00, 0.00);
 
-one_page_report::one_page_report(int max_histogram_size) : 
+one_page_report::one_page_report(int max_histogram_size_, int port_counters_) : 
     source_identifier(), filename("report.pdf"),
     bounds(0.0, 0.0, 611.0, 792.0), header_font_size(8.0),
     top_list_font_size(8.0), histogram_show_top_n_text(3),
+    ip4_prefix_bits(32), ip6_prefix_bits(128), packets_dropped(0),
+    parallel_render(false),
+    max_histogram_size(max_histogram_size_), port_counters(port_counters_),
     packet_count(0), byte_count(0), earliest(), latest(), transport_counts(),
     ports_in_time_histogram(), color_labels(), packet_histogram(),
-    src_port_histogram(), dst_port_histogram(), pfall(), netmap(),
-    src_tree(max_histogram_size), dst_tree(max_histogram_size), port_aliases(),
+    src_port_histogram(port_counters_), dst_port_histogram(port_counters_), pfall(), netmap(),
+    src_tree(max_histogram_size_), dst_tree(max_histogram_size_), port_aliases(),
     port_colormap()
 {
     earliest = (struct timeval) { 0 };
@@ -86,72 +99,73 @@ one_page_report::one_page_report(int max_histogram_size) :
     }
 }
 
+one_page_report::packet_summary::packet_summary(const be13::packet_info &pi) :
+    ts(pi.ts), length(pi.pcap_hdr->len), ether_type(pi.ether_type()), ip_ver(0),
+    has_tcp(false), src(), dst(), sport(0), dport(0)
+{
+    memset(src, 0, sizeof(src));
+    memset(dst, 0, sizeof(dst));
+    if(pi.is_ip4()) {
+        ip_ver = 4;
+        memcpy(src, pi.ip_data + pi.ip4_src_off, IP4_ADDR_LEN);
+        memcpy(dst, pi.ip_data + pi.ip4_dst_off, IP4_ADDR_LEN);
+        if(pi.is_ip4_tcp()) {
+            has_tcp = true;
+            sport = pi.get_ip4_tcp_sport();
+            dport = pi.get_ip4_tcp_dport();
+        }
+    }
+    else if(pi.is_ip6()) {
+        ip_ver = 6;
+        memcpy(src, pi.ip_data + pi.ip6_src_off, IP6_ADDR_LEN);
+        memcpy(dst, pi.ip_data + pi.ip6_dst_off, IP6_ADDR_LEN);
+        if(pi.is_ip6_tcp()) {
+            has_tcp = true;
+            sport = pi.get_ip6_tcp_sport();
+            dport = pi.get_ip6_tcp_dport();
+        }
+    }
+}
+
 void one_page_report::ingest_packet(const be13::packet_info &pi)
 {
-    if(earliest.tv_sec == 0 || (pi.ts.tv_sec < earliest.tv_sec ||
-                (pi.ts.tv_sec == earliest.tv_sec && pi.ts.tv_usec < earliest.tv_usec))) {
-        earliest = pi.ts;
+    ingest(packet_summary(pi));
+}
+
+void one_page_report::ingest(const packet_summary &packet)
+{
+    const struct timeval &ts = packet.ts;
+    if(earliest.tv_sec == 0 || (ts.tv_sec < earliest.tv_sec ||
+                (ts.tv_sec == earliest.tv_sec && ts.tv_usec < earliest.tv_usec))) {
+        earliest = ts;
     }
-    if(pi.ts.tv_sec > latest.tv_sec || (pi.ts.tv_sec == latest.tv_sec && pi.ts.tv_usec > latest.tv_usec)) {
-        latest = pi.ts;
+    if(ts.tv_sec > latest.tv_sec || (ts.tv_sec == latest.tv_sec && ts.tv_usec > latest.tv_usec)) {
+        latest = ts;
     }
 
-    size_t packet_length = pi.pcap_hdr->len;
+    size_t packet_length = packet.length;
     packet_count++;
     byte_count += packet_length;
-    transport_counts[pi.ether_type()] += packet_length; // should we handle VLANs?
+    transport_counts[packet.ether_type] += packet_length; // should we handle VLANs?
 
     // break out TCP/IP info and feed child views
 
     // feed IP-only views
-    uint8_t ip_ver = 0;
-    if(pi.is_ip4()) {
-        ip_ver = 4;
-
-        src_tree.add((uint8_t *) pi.ip_data + pi.ip4_src_off, IP4_ADDR_LEN, packet_length);
-        dst_tree.add((uint8_t *) pi.ip_data + pi.ip4_dst_off, IP4_ADDR_LEN, packet_length);
-    }
-    else if(pi.is_ip6()) {
-        ip_ver = 6;
-
-        src_tree.add((uint8_t *) pi.ip_data + pi.ip6_src_off, IP6_ADDR_LEN, packet_length);
-        dst_tree.add((uint8_t *) pi.ip_data + pi.ip6_dst_off, IP6_ADDR_LEN, packet_length);
+    if(packet.ip_ver == 4) {
+        src_tree.add(packet.src, IP4_ADDR_LEN, packet_length, ip4_prefix_bits);
+        dst_tree.add(packet.dst, IP4_ADDR_LEN, packet_length, ip4_prefix_bits);
     }
-    else {
-        packet_histogram.insert(pi.ts, 0, packet_length, time_histogram::F_NON_TCP);
-        return;
+    else if(packet.ip_ver == 6) {
+        src_tree.add(packet.src, IP6_ADDR_LEN, packet_length, ip6_prefix_bits);
+        dst_tree.add(packet.dst, IP6_ADDR_LEN, packet_length, ip6_prefix_bits);
     }
 
-
     // feed TCP views
-    uint16_t tcp_src = 0, tcp_dst = 0;
-    bool has_tcp = false;
-
-    switch(ip_ver) {
-        case 4:
-            if(!pi.is_ip4_tcp()) {
-                break;
-            }
-            tcp_src = pi.get_ip4_tcp_sport();
-            tcp_dst = pi.get_ip4_tcp_dport();
-            has_tcp = true;
-            break;
-        case 6:
-            if(!pi.is_ip6_tcp()) {
-                break;
-            }
-            tcp_src = pi.get_ip6_tcp_sport();
-            tcp_dst = pi.get_ip6_tcp_dport();
-            has_tcp = true;
-            break;
-        default:
-            return;
-    }
-
-    if(!has_tcp) {
-        packet_histogram.insert(pi.ts, 0, packet_length, time_histogram::F_NON_TCP);
+    if(!packet.has_tcp) {
+        packet_histogram.insert(ts, 0, packet_length, time_histogram::F_NON_TCP);
         return;
     }
+    uint16_t tcp_src = packet.sport, tcp_dst = packet.dport;
 
     // if either the TCP source or destination is a pre-colored port, submit that
     // port to the time histogram
@@ -169,12 +183,164 @@ void one_page_report::ingest_packet(const be13::packet_info &pi)
     }
     // record that this port appears in the histogram for legend building purposes
     ports_in_time_histogram[packet_histogram_port] = true;
-    packet_histogram.insert(pi.ts, packet_histogram_port, packet_length);
+    packet_histogram.insert(ts, packet_histogram_port, packet_length);
 
     src_port_histogram.increment(tcp_src, packet_length);
     dst_port_histogram.increment(tcp_dst, packet_length);
 }
 
+one_page_report *one_page_report::new_empty() const
+{
+    one_page_report *report = new one_page_report(max_histogram_size, port_counters);
+    report->filename = filename;
+    report->ip4_prefix_bits = ip4_prefix_bits;
+    report->ip6_prefix_bits = ip6_prefix_bits;
+    report->parallel_render = parallel_render;
+    return report;
+}
+
+void one_page_report::merge(const one_page_report &other)
+{
+    if(other.packet_count == 0) {
+        packets_dropped += other.packets_dropped;
+        return;
+    }
+    if(packet_count == 0 || other.earliest.tv_sec < earliest.tv_sec ||
+            (other.earliest.tv_sec == earliest.tv_sec && other.earliest.tv_usec < earliest.tv_usec)) {
+        earliest = other.earliest;
+    }
+    if(other.latest.tv_sec > latest.tv_sec ||
+            (other.latest.tv_sec == latest.tv_sec && other.latest.tv_usec > latest.tv_usec)) {
+        latest = other.latest;
+    }
+    packet_count += other.packet_count;
+    byte_count += other.byte_count;
+    packets_dropped += other.packets_dropped;
+    for(map<uint32_t, uint64_t>::const_iterator it = other.transport_counts.begin();
+            it != other.transport_counts.end(); it++) {
+        transport_counts[it->first] += it->second;
+    }
+    for(map<uint16_t, bool>::const_iterator it = other.ports_in_time_histogram.begin();
+            it != other.ports_in_time_histogram.end(); it++) {
+        if(it->second) {
+            ports_in_time_histogram[it->first] = true;
+        }
+    }
+    packet_histogram.merge(other.packet_histogram);
+    src_port_histogram.merge(other.src_port_histogram);
+    dst_port_histogram.merge(other.dst_port_histogram);
+    src_tree.merge(other.src_tree);
+    dst_tree.merge(other.dst_tree);
+}
+
+// an address is only as many bytes as its depth needs
+static void write_tree_state(ostream &out, const iptree &tree)
+{
+    iptree::histogram_t histogram;
+    tree.get_histogram(histogram);
+    netviz_state::put(out, histogram.size());
+    for(size_t ii = 0; ii < histogram.size(); ii++) {
+        const iptree::addr_elem &elem = histogram[ii];
+        netviz_state::put(out, elem.depth);
+        out.write((const char *) elem.addr, (elem.depth + 7) / 8);
+        netviz_state::put(out, elem.count);
+    }
+}
+
+static bool read_tree_state(istream &in, iptree &tree)
+{
+    uint64_t size = 0;
+    if(!netviz_state::get(in, size)) {
+        return false;
+    }
+    for(uint64_t ii = 0; ii < size; ii++) {
+        uint64_t depth = 0, count = 0;
+        uint8_t addr[IP6_ADDR_LEN];
+        memset(addr, 0, sizeof(addr));
+        if(!netviz_state::get(in, depth, IP6_ADDR_LEN * 8) ||
+                !in.read((char *) addr, (depth + 7) / 8) ||
+                !netviz_state::get(in, count)) {
+            return false;
+        }
+        tree.add(addr, IP6_ADDR_LEN, count, depth);
+    }
+    return true;
+}
+
+void one_page_report::write_state(ostream &out) const
+{
+    out << state_magic;
+    netviz_state::put(out, packet_count);
+    netviz_state::put(out, byte_count);
+    netviz_state::put(out, packets_dropped);
+    netviz_state::put(out, earliest);
+    netviz_state::put(out, latest);
+    netviz_state::put(out, transport_counts.size());
+    for(map<uint32_t, uint64_t>::const_iterator it = transport_counts.begin();
+            it != transport_counts.end(); it++) {
+        netviz_state::put(out, it->first);
+        netviz_state::put(out, it->second);
+    }
+    vector<uint16_t> ports;
+    for(map<uint16_t, bool>::const_iterator it = ports_in_time_histogram.begin();
+            it != ports_in_time_histogram.end(); it++) {
+        if(it->second) {
+            ports.push_back(it->first);
+        }
+    }
+    netviz_state::put(out, ports.size());
+    for(size_t ii = 0; ii < ports.size(); ii++) {
+        netviz_state::put(out, ports[ii]);
+    }
+    packet_histogram.write_state(out);
+    src_port_histogram.write_state(out);
+    dst_port_histogram.write_state(out);
+    write_tree_state(out, src_tree);
+    write_tree_state(out, dst_tree);
+}
+
+bool one_page_report::read_state(istream &in)
+{
+    string magic(state_magic.size(), '\0');
+    if(!in.read(&magic[0], magic.size()) || magic != state_magic) {
+        return false;
+    }
+    one_page_report *saved = new_empty();
+    uint64_t size = 0, key = 0, value = 0;
+    bool ok = netviz_state::get(in, saved->packet_count) &&
+        netviz_state::get(in, saved->byte_count) &&
+        netviz_state::get(in, saved->packets_dropped) &&
+        netviz_state::get(in, saved->earliest) &&
+        netviz_state::get(in, saved->latest) &&
+        netviz_state::get(in, size);
+    for(uint64_t ii = 0; ok && ii < size; ii++) {
+        ok = netviz_state::get(in, key, 0xffffffff) && netviz_state::get(in, value);
+        saved->transport_counts[key] += value;
+    }
+    ok = ok && netviz_state::get(in, size);
+    for(uint64_t ii = 0; ok && ii < size; ii++) {
+        ok = netviz_state::get(in, key, 65535);
+        saved->ports_in_time_histogram[key] = true;
+    }
+    ok = ok && saved->packet_histogram.read_state(in) &&
+        saved->src_port_histogram.read_state(in) &&
+        saved->dst_port_histogram.read_state(in) &&
+        read_tree_state(in, saved->src_tree) &&
+        read_tree_state(in, saved->dst_tree);
+    if(ok) {
+        merge(*saved);
+    }
+    delete saved;
+    return ok;
+}
+
+/*
+ * The page is a column of panels, normally drawn in turn by one render pass
+ * on the page itself. With parallel_render, each panel builds its views and
+ * draws them on a thread of its own instead, onto a recording surface with
+ * the panel at its top; the recordings are then painted onto the page one
+ * below the other, each as far down as the ones above it took up.
+ */
 void one_page_report::render(const string &outdir)
 {
     string fname = outdir + "/" + filename;
@@ -193,6 +359,38 @@ void one_page_report::render(const string &outdir)
             bounds.y + pad_size, bounds.width - pad_size * 2,
             bounds.height - pad_size * 2);
 
+    // the panels share the port colors, so they are settled first
+    prepare_colors();
+
+    vector<panel_t> panels;
+    panels.push_back(PANEL_HEADER);
+    panels.push_back(PANEL_TIME_HISTOGRAM);
+    panels.push_back(PANEL_LEGEND);
+    if(getenv("DEBUG")) {
+        panels.push_back(PANEL_MAP);
+        panels.push_back(PANEL_PACKETFALL);
+    }
+    panels.push_back(PANEL_ADDRESS_HISTOGRAMS);
+    panels.push_back(PANEL_PORT_HISTOGRAMS);
+
+    //
+    // run configured views through render pass
+    //
+
+    if(!parallel_render || !render_parallel(cr, pad_bounds, panels)) {
+        render_pass pass(*this, cr, pad_bounds);
+        for(vector<panel_t>::const_iterator it = panels.begin(); it != panels.end(); it++) {
+            render_panel(pass, *it);
+        }
+    }
+
+    // cleanup
+    cairo_destroy (cr);
+    cairo_surface_destroy(surface);
+}
+
+void one_page_report::prepare_colors()
+{
     // iff a colored common port appears in the time histogram, add its color to the legend
     if(ports_in_time_histogram[PORT_HTTP] ||
             ports_in_time_histogram[PORT_HTTP_ALT_0] ||
@@ -250,79 +448,151 @@ void one_page_report::render(const string &outdir)
         }
     }
     sort(color_labels.begin(), color_labels.end());
-    
-    // time histogram
-    double condension_factor = (double) packet_histogram.non_sparse_size() / (double) max_bars;
-    if(condension_factor > 1.1) {
-        // condense only by whole numbers to avoid messing up bar labels
-        packet_histogram.condense(((int) condension_factor) + 1);
-    }
-    time_histogram_view th_view(packet_histogram, port_colormap, default_color,
-            cdf_color);
+}
 
-    // color legend
-    legend_view lg_view(color_labels);
+// build a panel's views and draw them; panels share no data that a view changes
+void one_page_report::render_panel(render_pass &pass, panel_t panel)
+{
+    switch(panel) {
+    case PANEL_HEADER:
+        pass.render_header();
+        break;
+    case PANEL_TIME_HISTOGRAM: {
+        // time histogram
+        double condension_factor = (double) packet_histogram.non_sparse_size() / (double) max_bars;
+        if(condension_factor > 1.1) {
+            // condense only by whole numbers to avoid messing up bar labels
+            packet_histogram.condense(((int) condension_factor) + 1);
+        }
+        time_histogram_view th_view(packet_histogram, port_colormap, default_color,
+                cdf_color);
 
-    // address histograms
-    // histograms are built from iptree here
-    address_histogram src_addr_histogram(src_tree);
-    address_histogram dst_addr_histogram(dst_tree);
-    address_histogram_view src_ah_view(src_addr_histogram);
-    if(src_addr_histogram.size() > 0) {
-        src_ah_view.title = "Top Source Addresses";
-    }
-    else {
-        src_ah_view.title = "No Source Addresses";
-    }
-    src_ah_view.bar_color = default_color;
-    src_ah_view.cdf_color = cdf_color;
-    address_histogram_view dst_ah_view(dst_addr_histogram);
-    if(dst_addr_histogram.size() > 0) {
-        dst_ah_view.title = "Top Destination Addresses";
+        pass.render(th_view);
+        break;
     }
-    else {
-        dst_ah_view.title = "No Destination Addresses";
+    case PANEL_LEGEND: {
+        legend_view lg_view(color_labels);
+        pass.render(lg_view);
+        break;
     }
-    dst_ah_view.bar_color = default_color;
-    dst_ah_view.cdf_color = cdf_color;
+    case PANEL_MAP:
+        pass.render_map();
+        break;
+    case PANEL_PACKETFALL:
+        pass.render_packetfall();
+        break;
+    case PANEL_ADDRESS_HISTOGRAMS: {
+        // address histograms
+        // histograms are built from iptree here
+        address_histogram src_addr_histogram(src_tree);
+        address_histogram dst_addr_histogram(dst_tree);
+        address_histogram_view src_ah_view(src_addr_histogram);
+        if(src_addr_histogram.size() > 0) {
+            src_ah_view.title = "Top Source Addresses";
+        }
+        else {
+            src_ah_view.title = "No Source Addresses";
+        }
+        src_ah_view.bar_color = default_color;
+        src_ah_view.cdf_color = cdf_color;
+        address_histogram_view dst_ah_view(dst_addr_histogram);
+        if(dst_addr_histogram.size() > 0) {
+            dst_ah_view.title = "Top Destination Addresses";
+        }
+        else {
+            dst_ah_view.title = "No Destination Addresses";
+        }
+        dst_ah_view.bar_color = default_color;
+        dst_ah_view.cdf_color = cdf_color;
 
-    // port histograms
-    port_histogram_view sp_view(src_port_histogram, port_colormap, default_color,
-            cdf_color);
-    port_histogram_view dp_view(dst_port_histogram, port_colormap, default_color,
-            cdf_color);
-    if(src_port_histogram.size()) {
-        sp_view.title = "Top Source Ports";
+        pass.render(src_ah_view, dst_ah_view);
+        break;
     }
-    else {
-        sp_view.title = "No Source Ports";
-    }
-    if(dst_port_histogram.size()) {
-        dp_view.title = "Top Destination Ports";
+    case PANEL_PORT_HISTOGRAMS: {
+        // port histograms
+        port_histogram_view sp_view(src_port_histogram, port_colormap, default_color,
+                cdf_color);
+        port_histogram_view dp_view(dst_port_histogram, port_colormap, default_color,
+                cdf_color);
+        if(src_port_histogram.size()) {
+            sp_view.title = "Top Source Ports";
+        }
+        else {
+            sp_view.title = "No Source Ports";
+        }
+        if(dst_port_histogram.size()) {
+            dp_view.title = "Top Destination Ports";
+        }
+        else {
+            dp_view.title = "No Destination Ports";
+        }
+
+        pass.render(sp_view, dp_view);
+        break;
     }
-    else {
-        dp_view.title = "No Destination Ports";
     }
+}
 
-    //
-    // run configured views through render pass
-    //
-
-    render_pass pass(*this, cr, pad_bounds);
+#ifdef HAVE_PARALLEL_RENDER
+class one_page_report::panel_job {
+public:
+    panel_job(one_page_report &report_, panel_t panel_, const plot_view::bounds_t &bounds_) :
+        report(report_), panel(panel_), bounds(bounds_), recording(0), height(0.0),
+        thread(), started(false) {}
+    one_page_report &report;
+    panel_t panel;
+    plot_view::bounds_t bounds;
+    cairo_surface_t *recording;
+    double height;                      // the pass's end_of_content once drawn
+    pthread_t thread;
+    bool started;
+};
+
+void *one_page_report::render_panel_thread(void *arg)
+{
+    panel_job &job = *reinterpret_cast<panel_job *>(arg);
+    job.recording = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, 0);
+    cairo_t *cr = cairo_create(job.recording);
+    render_pass pass(job.report, cr, job.bounds);
+    job.report.render_panel(pass, job.panel);
+    job.height = pass.end_of_content;
+    cairo_destroy(cr);
+    return 0;
+}
+#endif
 
-    pass.render_header();
-    pass.render(th_view);
-    pass.render(lg_view);
-    if(getenv("DEBUG")) {
-        pass.render_map();
-        pass.render_packetfall();
+// false if this build can't, and the panels are to be drawn in turn
+bool one_page_report::render_parallel(cairo_t *cr, const plot_view::bounds_t &pad_bounds,
+        const vector<panel_t> &panels)
+{
+#ifdef HAVE_PARALLEL_RENDER
+    plot_view::bounds_t top(pad_bounds.x, 0.0, pad_bounds.width, pad_bounds.height);
+    vector<panel_job *> jobs;
+    for(vector<panel_t>::const_iterator it = panels.begin(); it != panels.end(); it++) {
+        panel_job *job = new panel_job(*this, *it, top);
+        job->started = pthread_create(&job->thread, 0, render_panel_thread, job) == 0;
+        if(!job->started) {
+            render_panel_thread(job);   // draw it here instead
+        }
+        jobs.push_back(job);
     }
-    pass.render(src_ah_view, dst_ah_view);
-    pass.render(sp_view, dp_view);
 
-    // cleanup
-    cairo_destroy (cr);
-    cairo_surface_destroy(surface);
+    double end_of_content = 0.0;
+    for(vector<panel_job *>::const_iterator it = jobs.begin(); it != jobs.end(); it++) {
+        panel_job *job = *it;
+        if(job->started) {
+            pthread_join(job->thread, 0);
+        }
+        cairo_set_source_surface(cr, job->recording, 0.0, pad_bounds.y + end_of_content);
+        cairo_paint(cr);
+        end_of_content += job->height;
+        cairo_surface_destroy(job->recording);
+        delete job;
+    }
+    return true;
+#else
+    return false;
+#endif
 }
 
 void one_page_report::render_pass::render_header()
@@ -339,7 +609,9 @@ void one_page_report::render_pass::render_header()
             title_line_space);
     //// date generated
     time_t gen_unix = time(0);
-    struct tm gen_time = *localtime(&gen_unix);
+    struct tm gen_time;
+    memset(&gen_time,0,sizeof(gen_time));
+    localtime_r(&gen_unix,&gen_time);
     formatted = ssprintf("Generated: %04d-%02d-%02d %02d:%02d:%02d",
             1900 + gen_time.tm_year, 1 + gen_time.tm_mon, gen_time.tm_mday,
             gen_time.tm_hour, gen_time.tm_min, gen_time.tm_sec);
@@ -371,6 +643,13 @@ void one_page_report::render_pass::render_header()
             plot_view::pretty_byte_total(report.byte_count).c_str());
     render_text_line(formatted.c_str(), report.header_font_size,
             title_line_space);
+    //// packets missed
+    if(report.packets_dropped > 0) {
+        formatted = ssprintf("Packets dropped before analysis: %s",
+                comma_number_string(report.packets_dropped).c_str());
+        render_text_line(formatted.c_str(), report.header_font_size,
+                title_line_space);
+    }
     //// protocol breakdown
     uint64_t transport_total = 0;
     for(map<uint32_t, uint64_t>::const_iterator ii =
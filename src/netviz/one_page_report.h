@@ -33,6 +33,25 @@ public:
     };
 
 
+    // what ingest() needs of a packet, copied out so that it can be queued
+    // for another thread after the packet itself is gone
+    class packet_summary {
+    public:
+        packet_summary() :
+            ts(), length(0), ether_type(0), ip_ver(0), has_tcp(false),
+            src(), dst(), sport(0), dport(0) {}
+        packet_summary(const be13::packet_info &pi);
+        struct timeval ts;
+        uint32_t length;
+        uint16_t ether_type;
+        uint8_t ip_ver;                 // 4, 6, or 0 if not IP
+        bool has_tcp;
+        uint8_t src[IP6_ADDR_LEN];      // an IPv4 address is the first 4 bytes
+        uint8_t dst[IP6_ADDR_LEN];
+        uint16_t sport;
+        uint16_t dport;
+    };
+
     typedef std::map<in_port_t, in_port_t> port_aliases_t;
     typedef std::map<in_port_t, plot_view::rgb_t> port_colormap_t;
     typedef std::vector<transport_type> transport_type_vector;
@@ -43,6 +62,13 @@ public:
     double header_font_size;
     double top_list_font_size;
     unsigned int histogram_show_top_n_text;
+    // addresses are counted under their prefixes of this many bits
+    unsigned int ip4_prefix_bits;
+    unsigned int ip6_prefix_bits;
+    // packets that were never ingested, because the queue to ingest() was full
+    uint64_t packets_dropped;
+    // prepare and draw each panel on a thread of its own (see render())
+    bool parallel_render;
 
     // a single render event: content moves down a bounded cairo surface as
     // indicated by end_of_content between render method invocations
@@ -73,9 +99,18 @@ public:
     };
     friend class render_pass;
 
-    one_page_report(int max_histogram_size);
+    one_page_report(int max_histogram_size, int port_counters = 0);
 
     void ingest_packet(const be13::packet_info &pi);
+    void ingest(const packet_summary &packet);
+    // an empty report with the same settings, and adding another's counts to
+    // this one's, so that reports of parts of a capture can be combined
+    one_page_report *new_empty() const;
+    void merge(const one_page_report &other);
+    // the counts in a compact binary form (-S netviz_save), and merging
+    // them into this report (-S netviz_merge); false if they're damaged
+    void write_state(std::ostream &out) const;
+    bool read_state(std::istream &in);
     void render(const std::string &outdir);
     plot_view::rgb_t port_color(uint16_t port) const;
     void dump(int debug);
@@ -86,6 +121,7 @@ public:
     static const unsigned int port_colors_count;
     // string constants
     static const std::string title_version;
+    static const std::string state_magic;
     static const std::string generic_legend_format;
     static const transport_type_vector display_transports;
     // ratio constants
@@ -113,6 +149,21 @@ public:
     static const plot_view::rgb_t cdf_color;
 
 private:
+    // the page's panels, top to bottom; each moves a render pass down by its
+    // own height only, so each can be drawn apart and put in place after
+    typedef enum {
+        PANEL_HEADER, PANEL_TIME_HISTOGRAM, PANEL_LEGEND, PANEL_MAP,
+        PANEL_PACKETFALL, PANEL_ADDRESS_HISTOGRAMS, PANEL_PORT_HISTOGRAMS
+    } panel_t;
+    class panel_job;
+    void prepare_colors();
+    void render_panel(render_pass &pass, panel_t panel);
+    bool render_parallel(cairo_t *cr, const plot_view::bounds_t &pad_bounds,
+            const std::vector<panel_t> &panels);
+    static void *render_panel_thread(void *arg);
+
+    int max_histogram_size;
+    int port_counters;
     uint64_t packet_count;
     uint64_t byte_count;
     struct timeval earliest;
@@ -14,6 +14,7 @@
 #include "tcpflow.h"
 
 #include "port_histogram.h"
+#include "netviz_state.h"
 
 #include <math.h>
 #include <algorithm>
@@ -21,6 +22,13 @@
 using namespace std;
 
 const size_t port_histogram::bucket_count = 10;
+const size_t port_histogram::port_space = 65536;
+
+bool port_histogram::ascending_ports::operator()(const port_count &a,
+        const port_count &b)
+{
+    return a.port < b.port;
+}
 
 bool port_histogram::descending_counts::operator()(const port_count &a,
         const port_count &b)
@@ -36,9 +44,80 @@ bool port_histogram::descending_counts::operator()(const port_count &a,
 
 void port_histogram::increment(uint16_t port, uint64_t delta)
 {
-    port_counts[port] += delta;
     data_bytes_ingested += delta;
     buckets_dirty = true;
+
+    if(max_counters > 0) {
+        count_approximately(port, delta);
+        return;
+    }
+    if(exact_counts.empty()) {
+        exact_counts.resize(port_space, 0);
+    }
+    uint64_t &count = exact_counts[port];
+    count += delta;
+    offer(port, count);
+}
+
+void port_histogram::merge(const port_histogram &other)
+{
+    if(other.max_counters > 0) {
+        for(size_t ii = 0; ii < other.counters.size(); ii++) {
+            increment(other.counters[ii].port, other.counters[ii].count);
+        }
+        return;
+    }
+    for(size_t port = 0; port < other.exact_counts.size(); port++) {
+        if(other.exact_counts[port] > 0) {
+            increment(port, other.exact_counts[port]);
+        }
+    }
+}
+
+// the ports with counts, ascending, each after the gap since the one before it
+void port_histogram::write_state(std::ostream &out) const
+{
+    vector<port_count> counted;
+    if(max_counters > 0) {
+        counted = counters;
+        sort(counted.begin(), counted.end(), ascending_ports());
+    }
+    else {
+        for(size_t port = 0; port < exact_counts.size(); port++) {
+            if(exact_counts[port] > 0) {
+                counted.push_back(port_count(port, exact_counts[port]));
+            }
+        }
+    }
+    netviz_state::put(out, counted.size());
+    uint32_t next = 0;
+    for(size_t ii = 0; ii < counted.size(); ii++) {
+        netviz_state::put(out, counted[ii].port - next);
+        netviz_state::put(out, counted[ii].count);
+        next = counted[ii].port + 1;
+    }
+}
+
+bool port_histogram::read_state(std::istream &in)
+{
+    uint64_t size = 0;
+    if(!netviz_state::get(in, size, port_space)) {
+        return false;
+    }
+    uint64_t port = 0;
+    for(uint64_t ii = 0; ii < size; ii++) {
+        uint64_t gap = 0, count = 0;
+        if(!netviz_state::get(in, gap, port_space) || !netviz_state::get(in, count)) {
+            return false;
+        }
+        port += gap;
+        if(port >= port_space) {
+            return false;
+        }
+        increment(port, count);
+        port++;
+    }
+    return true;
 }
 
 const port_histogram::port_count &port_histogram::at(size_t index)
@@ -90,26 +169,192 @@ void port_histogram::refresh_buckets()
     if(!buckets_dirty) {
         return;
     }
+    if(top_dirty) {
+        rebuild_top();
+    }
 
-    buckets.clear();
+    buckets = top;
+    sort(buckets.begin(), buckets.end(), descending_counts());
 
-    for(port_counts_t::const_iterator it = port_counts.begin();
-            it != port_counts.end(); it++) {
-        buckets.push_back(port_count(it->first, it->second));
+    buckets_dirty = false;
+}
+
+// Counts only grow, so a port that isn't in the top and doesn't pass the
+// least of it stays out, and one that passes it takes its place.
+void port_histogram::offer(uint16_t port, uint64_t count)
+{
+    if(top_dirty) {
+        return;
+    }
+    port_count offered(port, count);
+    if(top.size() < bucket_count) {
+        for(vector<port_count>::iterator it = top.begin(); it != top.end(); it++) {
+            if(it->port == port) {
+                it->count = count;
+                find_top_least();
+                return;
+            }
+        }
+        top.push_back(offered);
+        find_top_least();
+        return;
+    }
+    // a top port's count is at least the least one's
+    if(count < top[top_least].count) {
+        return;
     }
+    for(size_t ii = 0; ii < top.size(); ii++) {
+        if(top[ii].port == port) {
+            top[ii].count = count;
+            if(ii == top_least) {
+                find_top_least();
+            }
+            return;
+        }
+    }
+    if(descending_counts()(offered, top[top_least])) {
+        top[top_least] = offered;
+        find_top_least();
+    }
+}
 
-    if(buckets.size() <= bucket_count) {
-        sort(buckets.begin(), buckets.end(), descending_counts());
+void port_histogram::find_top_least()
+{
+    top_least = 0;
+    for(size_t ii = 1; ii < top.size(); ii++) {
+        if(descending_counts()(top[top_least], top[ii])) {
+            top_least = ii;
+        }
     }
-    else {
-        partial_sort(buckets.begin(), buckets.begin() + bucket_count,
-                buckets.end(), descending_counts());
+}
+
+void port_histogram::rebuild_top()
+{
+    top = counters;
+    if(top.size() > bucket_count) {
+        partial_sort(top.begin(), top.begin() + bucket_count, top.end(), descending_counts());
+        top.erase(top.begin() + bucket_count, top.end());
     }
+    find_top_least();
+    top_dirty = false;
+}
 
-    if(buckets.size() > bucket_count) {
-        buckets.erase(buckets.begin() + bucket_count, buckets.end());
+void port_histogram::count_approximately(uint16_t port, uint64_t delta)
+{
+    if(counter_index.empty()) {
+        // at most half full
+        uint32_t bits = 1;
+        while(((size_t) 1 << bits) < max_counters * 2) {
+            bits++;
+        }
+        counter_index.resize((size_t) 1 << bits, 0);
+        index_shift = 32 - bits;
+        counters.reserve(max_counters);
     }
 
-    buckets_dirty = false;
+    uint32_t slot = find_slot(port);
+    if(counter_index[slot] != 0) {
+        uint32_t pos = counter_index[slot] - 1;
+        counters[pos].count += delta;
+        uint64_t count = counters[pos].count;
+        sift_down(pos);
+        offer(port, count);
+        return;
+    }
+    if(counters.size() < max_counters) {
+        counters.push_back(port_count(port, delta));
+        counter_index[slot] = counters.size();
+        sift_up(counters.size() - 1);
+        offer(port, delta);
+        return;
+    }
+
+    // the smallest counter goes to port, which may have had as much as it
+    uint16_t evicted = counters[0].port;
+    erase_slot(find_slot(evicted));
+    counters[0].port = port;
+    counters[0].count += delta;
+    uint64_t count = counters[0].count;
+    counter_index[find_slot(port)] = 1;
+    sift_down(0);
+
+    for(vector<port_count>::const_iterator it = top.begin(); it != top.end(); it++) {
+        if(it->port == evicted) {
+            top_dirty = true;
+            return;
+        }
+    }
+    offer(port, count);
+}
+
+uint32_t port_histogram::find_slot(uint16_t port) const
+{
+    uint32_t mask = counter_index.size() - 1;
+    uint32_t slot = ((uint32_t) port * 2654435761u) >> index_shift;
+    while(counter_index[slot] != 0 && counters[counter_index[slot] - 1].port != port) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+// linear probing: pull back any later entries that would no longer be found
+void port_histogram::erase_slot(uint32_t slot)
+{
+    uint32_t mask = counter_index.size() - 1;
+    uint32_t next = slot;
+    while(true) {
+        next = (next + 1) & mask;
+        if(counter_index[next] == 0) {
+            break;
+        }
+        uint32_t home = ((uint32_t) counters[counter_index[next] - 1].port * 2654435761u) >> index_shift;
+        // can the entry at next move back to slot without passing its home?
+        if(((next - home) & mask) >= ((next - slot) & mask)) {
+            counter_index[slot] = counter_index[next];
+            slot = next;
+        }
+    }
+    counter_index[slot] = 0;
+}
+
+// the index is looked up before either counter moves, so it always agrees with them
+void port_histogram::swap_counters(uint32_t a, uint32_t b)
+{
+    uint32_t slot_a = find_slot(counters[a].port);
+    uint32_t slot_b = find_slot(counters[b].port);
+    swap(counters[a], counters[b]);
+    counter_index[slot_a] = b + 1;
+    counter_index[slot_b] = a + 1;
+}
+
+void port_histogram::sift_up(uint32_t pos)
+{
+    while(pos > 0) {
+        uint32_t parent = (pos - 1) / 2;
+        if(counters[parent].count <= counters[pos].count) {
+            break;
+        }
+        swap_counters(pos, parent);
+        pos = parent;
+    }
+}
+
+void port_histogram::sift_down(uint32_t pos)
+{
+    uint32_t heap_size = counters.size();
+    while(true) {
+        uint32_t child = pos * 2 + 1;
+        if(child >= heap_size) {
+            break;
+        }
+        if(child + 1 < heap_size && counters[child + 1].count < counters[child].count) {
+            child++;
+        }
+        if(counters[pos].count <= counters[child].count) {
+            break;
+        }
+        swap_counters(pos, child);
+        pos = child;
+    }
 }
 #endif
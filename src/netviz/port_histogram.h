@@ -1,7 +1,18 @@
 /**
- * port_histogram.h: 
+ * port_histogram.h:
  * Show packets received vs port
  *
+ * Only the top bucket_count ports are shown, so those are kept up to date as
+ * counts are added, and reading them never sorts more than bucket_count
+ * entries.
+ *
+ * By default every port is counted exactly, in one flat array of 2^16
+ * counters. Given max_counters, only that many ports are counted, with the
+ * Space-Saving algorithm: a port that isn't counted takes over the counter
+ * of the smallest one, and its count.  Counts are then upper bounds, each
+ * off by at most ingest_count() / max_counters, and any port with more than
+ * that share of the traffic is always counted.
+ *
  * This source file is public domain, as it is not based on the original tcpflow.
  *
  * Author: Michael Shick <mike@shick.in>
@@ -13,8 +24,11 @@
 
 class port_histogram {
 public:
-    port_histogram() :
-        port_counts(), data_bytes_ingested(0), buckets(), buckets_dirty(true) {}
+    port_histogram(size_t max_counters_ = 0) :
+        data_bytes_ingested(0), buckets(), buckets_dirty(true),
+        max_counters(max_counters_ < port_space ? max_counters_ : 0),
+        exact_counts(), counters(), counter_index(), index_shift(0),
+        top(), top_least(0), top_dirty(false) {}
 
     class port_count {
     public:
@@ -29,8 +43,15 @@ public:
     public:
         bool operator()(const port_count &a, const port_count &b);
     };
+    class ascending_ports {
+    public:
+        bool operator()(const port_count &a, const port_count &b);
+    };
 
     void increment(uint16_t port, uint64_t delta);
+    void merge(const port_histogram &other); // add all of other's counts
+    void write_state(std::ostream &out) const;
+    bool read_state(std::istream &in); // merge saved counts; false if they're damaged
     const port_count &at(size_t index);
     size_t size();
     uint64_t ingest_count() const;
@@ -43,15 +64,39 @@ public:
     port_count_vector::const_reverse_iterator rend();
 
     static const size_t bucket_count;
+    static const size_t port_space;     // the number of ports
 
 private:
-    typedef std::map<in_port_t, uint64_t> port_counts_t;
-    port_counts_t port_counts;
     uint64_t data_bytes_ingested;
     std::vector<port_count> buckets;
     bool buckets_dirty;
 
+    size_t max_counters;                // 0 to count every port exactly
+    std::vector<uint64_t> exact_counts; // by port, made on the first increment
+
+    // Space-Saving: the counters are a min-heap by count, and counter_index
+    // is an open addressed table of heap position + 1 (0 if empty), by port
+    std::vector<port_count> counters;
+    std::vector<uint32_t> counter_index;
+    uint32_t index_shift;               // 32 - log2 of counter_index.size()
+
+    // the top bucket_count ports, unordered, and the position of the least
+    std::vector<port_count> top;
+    size_t top_least;
+    bool top_dirty;                     // a top port lost its counter; rebuild from the counters
+
     void refresh_buckets();
+
+    void offer(uint16_t port, uint64_t count); // port's count is now count
+    void find_top_least();
+    void rebuild_top();
+
+    void count_approximately(uint16_t port, uint64_t delta);
+    uint32_t find_slot(uint16_t port) const; // of port, or of the empty slot it would take
+    void erase_slot(uint32_t slot);
+    void swap_counters(uint32_t a, uint32_t b);
+    void sift_up(uint32_t pos);
+    void sift_down(uint32_t pos);
 };
 
 #endif
@@ -3,6 +3,10 @@
  * organize packet count histograms of various granularities while transparently
  * exposing the best-fit
  *
+ * Only the best fit is kept: packets are counted at the finest granularity
+ * that covers them all, and the counts are rolled up into the next coarser
+ * one when they no longer do.
+ *
  * This source file is public domain, as it is not based on the original tcpflow.
  *
  * Author: Michael Shick <mike@shick.in>
@@ -12,19 +16,16 @@
 #include <vector>
 
 #include "time_histogram.h"
+#include "netviz_state.h"
 
 time_histogram::time_histogram() :
-    histograms(), best_fit_index(0), earliest_ts(), latest_ts(), insert_count(0)
+    histogram(spans.at(0)), span_index(0), first_ts(), earliest_ts(), latest_ts(), insert_count(0)
 {
     // zero value structs courtesy stackoverflow
     // http://stackoverflow.com/questions/6462093/reinitialize-timeval-struct
+    first_ts = (struct timeval) { 0 };
     earliest_ts = (struct timeval) { 0 };
     latest_ts = (struct timeval) { 0 };
-
-    for(std::vector<span_params>::const_iterator it = spans.begin();
-            it != spans.end(); it++) {
-        histograms.push_back(histogram_map(*it));
-    }
 }
 
 const float time_histogram::underflow_pad_factor = 0.1;
@@ -47,50 +48,133 @@ void time_histogram::insert(const struct timeval &ts, const in_port_t port, cons
     if(ts.tv_sec > latest_ts.tv_sec || (ts.tv_sec == latest_ts.tv_sec && ts.tv_usec > latest_ts.tv_usec)) {
         latest_ts = ts;
     }
-    for(std::vector<histogram_map>::iterator it = histograms.begin() + best_fit_index;
-            it != histograms.end(); it++) {
-        bool overflowed = it->insert(ts, port, count, flags);
-        // if there was an overflow and the best fit isn't already the least
-        // granular histogram, downgrade granularity by one step
-        if(overflowed && best_fit_index < histograms.size() - 1) {
-            best_fit_index++;
+    if(histogram.base_time == 0) {
+        first_ts = ts;
+    }
+    // if the packet doesn't fit and the histogram isn't already the least
+    // granular, roll it up into the next span and try again
+    while(histogram.insert(ts, port, count, flags)) {
+        if(span_index + 1 >= spans.size()) {
+            return;
         }
+        coarsen();
     }
 }
 
-// combine each bucket with (factor - 1) subsequent neighbors and increase bucket width by factor
-// lots of possible optimizations ignored for simplicity's sake
-void time_histogram::condense(double factor)
+// move every bucket's counts into the bucket of to that holds its start time
+void time_histogram::rebucket(const histogram_map &from, histogram_map &to)
 {
-    const histogram_map &original = histograms.at(best_fit_index);
-    histogram_map condensed(span_params(original.span.usec, (uint64_t) ((double) original.span.bucket_count / factor)));
+    for(uint32_t index = from.first_index; from.used_count > 0 && index <= from.last_index; index++) {
+        const bucket &bkt = from.buckets[index];
+        if(bkt.sum() == 0) {
+            continue;
+        }
+        to.insert(from.bucket_start(index), bkt);
+    }
+}
 
-    for(histogram_map::buckets_t::const_iterator it = original.buckets.begin(); it != original.buckets.end(); it++) {
+// Each span's bucket width is a multiple of the one before, and base times are
+// snapped to the width, so every bucket lands whole in one coarser bucket.
+void time_histogram::coarsen()
+{
+    histogram_map coarser(spans.at(span_index + 1));
+    coarser.scale_timeval(first_ts);    // the base time it would have had from the start
+    rebucket(histogram, coarser);
+    histogram = coarser;
+    span_index++;
+}
 
-        bucket &bkt = *(it->second);
-        uint64_t recons_usec = it->first * original.bucket_width + original.base_time;
+// Buckets of the same span line up whatever the first packet was, so
+// other's buckets land whole in ours once ours are at least as coarse.
+void time_histogram::merge(const time_histogram &other)
+{
+    if(other.insert_count == 0) {
+        return;
+    }
+    if(insert_count == 0) {
+        *this = other;
+        return;
+    }
+    if(other.first_ts.tv_sec < first_ts.tv_sec || (other.first_ts.tv_sec == first_ts.tv_sec &&
+                other.first_ts.tv_usec < first_ts.tv_usec)) {
+        first_ts = other.first_ts;      // so that coarser spans have room for other's
+    }
+    while(span_index < other.span_index) {
+        coarsen();
+    }
+    const histogram_map &from = other.histogram;
+    for(uint32_t index = from.first_index; from.used_count > 0 && index <= from.last_index; index++) {
+        const bucket &bkt = from.buckets[index];
+        if(bkt.sum() == 0) {
+            continue;
+        }
+        while(histogram.insert(from.bucket_start(index), bkt) && span_index + 1 < spans.size()) {
+            coarsen();
+        }
+    }
+    insert_count += other.insert_count;
+    if(other.earliest_ts.tv_sec < earliest_ts.tv_sec || (other.earliest_ts.tv_sec == earliest_ts.tv_sec &&
+                other.earliest_ts.tv_usec < earliest_ts.tv_usec)) {
+        earliest_ts = other.earliest_ts;
+    }
+    if(other.latest_ts.tv_sec > latest_ts.tv_sec || (other.latest_ts.tv_sec == latest_ts.tv_sec &&
+                other.latest_ts.tv_usec > latest_ts.tv_usec)) {
+        latest_ts = other.latest_ts;
+    }
+}
 
-        struct timeval reconstructed_ts;
-        reconstructed_ts.tv_usec = (time_t) (recons_usec % (1000LL * 1000LL));
-        reconstructed_ts.tv_sec = (time_t) (recons_usec / (1000LL * 1000LL));
+void time_histogram::write_state(std::ostream &out) const
+{
+    netviz_state::put(out, insert_count);
+    if(insert_count == 0) {
+        return;
+    }
+    netviz_state::put(out, span_index);
+    netviz_state::put(out, first_ts);
+    netviz_state::put(out, earliest_ts);
+    netviz_state::put(out, latest_ts);
+    histogram.write_state(out);
+}
 
-        for(bucket::counts_t::const_iterator jt = bkt.counts.begin(); jt != bkt.counts.end(); jt++) {
-            condensed.insert(reconstructed_ts, jt->first, jt->second);
-        }
-        condensed.insert(reconstructed_ts, 0, bkt.portless_count, F_NON_TCP);
+bool time_histogram::read_state(std::istream &in)
+{
+    time_histogram saved;
+    uint64_t value = 0;
+    if(!netviz_state::get(in, saved.insert_count)) {
+        return false;
+    }
+    if(saved.insert_count == 0) {
+        return true;
+    }
+    if(!netviz_state::get(in, value, spans.size() - 1)) {
+        return false;
+    }
+    saved.span_index = value;
+    saved.histogram = histogram_map(spans.at(saved.span_index));
+    if(!netviz_state::get(in, saved.first_ts) || !netviz_state::get(in, saved.earliest_ts) ||
+            !netviz_state::get(in, saved.latest_ts) || !saved.histogram.read_state(in)) {
+        return false;
     }
+    merge(saved);
+    return true;
+}
 
-    histograms.at(best_fit_index) = condensed;
+// combine each bucket with (factor - 1) subsequent neighbors and increase bucket width by factor
+void time_histogram::condense(double factor)
+{
+    histogram_map condensed(span_params(histogram.span.usec, (uint64_t) ((double) histogram.span.bucket_count / factor)));
+    rebucket(histogram, condensed);
+    histogram = condensed;
 }
 
 uint64_t time_histogram::usec_per_bucket() const
 {
-    return histograms.at(best_fit_index).bucket_width;
+    return histogram.bucket_width;
 }
 
 uint64_t time_histogram::packet_count() const
 {
-    return histograms.at(best_fit_index).insert_count;
+    return histogram.insert_count;
 }
 
 time_t time_histogram::start_date() const
@@ -105,50 +189,36 @@ time_t time_histogram::end_date() const
 
 uint64_t time_histogram::tallest_bar() const
 {
-    return histograms.at(best_fit_index).greatest_bucket_sum();
+    return histogram.greatest_bucket_sum();
 }
 
 const time_histogram::bucket &time_histogram::at(uint32_t index) const {
-    const histogram_map::buckets_t hgram = histograms.at(best_fit_index).buckets;
-    histogram_map::buckets_t::const_iterator bkt = hgram.find(index);
-    if(bkt == hgram.end()) {
+    const histogram_map::buckets_t &hgram = histogram.buckets;
+    if(index >= hgram.size()) {
         return empty_bucket;
     }
-    return *(bkt->second);
+    return hgram[index];
 }
 
+// the number of buckets in use
 size_t time_histogram::size() const
 {
-    return histograms.at(best_fit_index).buckets.size();
+    return histogram.used_count;
 }
 
-// calculate the number of buckets if this were a non-sparse data structure like a vector
+// the number of buckets from the first in use to the last
 size_t time_histogram::non_sparse_size() const
 {
-    histogram_map::buckets_t buckets = histograms.at(best_fit_index).buckets;
-    histogram_map::buckets_t::const_iterator least = buckets.begin();
-    if(least == buckets.end()) {
+    const histogram_map &hgram = histogram;
+    if(hgram.used_count == 0) {
         return 0;
     }
-    histogram_map::buckets_t::const_reverse_iterator most = buckets.rbegin();
-    return most->first - least->first + 1;
+    return hgram.last_index - hgram.first_index + 1;
 }
 
-time_histogram::histogram_map::buckets_t::const_iterator time_histogram::begin() const
-{
-    return histograms.at(best_fit_index).buckets.begin();
-}
-time_histogram::histogram_map::buckets_t::const_iterator time_histogram::end() const
+uint32_t time_histogram::first_index() const
 {
-    return histograms.at(best_fit_index).buckets.end();
-}
-time_histogram::histogram_map::buckets_t::const_reverse_iterator time_histogram::rbegin() const
-{
-    return histograms.at(best_fit_index).buckets.rbegin();
-}
-time_histogram::histogram_map::buckets_t::const_reverse_iterator time_histogram::rend() const
-{
-    return histograms.at(best_fit_index).buckets.rend();
+    return histogram.first_index;
 }
 
 /* This should be rewritten, because currently it is building a bunch of spans and then returning a vector which has to be copied.
@@ -192,27 +262,210 @@ time_histogram::span_params_vector_t time_histogram::build_spans()
 /*
  * Insert into the time_histogram.
  *
- * This is optimized to be as fast as possible, so we compute the sums as necessary when generating the histogram.
+ * This is optimized to be as fast as possible: a bucket is found by indexing
+ * the array, and its ports by looking through its few slots.
  */
 
-bool time_histogram::histogram_map::insert(const struct timeval &ts, const in_port_t port, const uint64_t count,
-        const unsigned int flags)
+void time_histogram::bucket::increment(in_port_t port, uint64_t delta, unsigned int flags)
 {
-    uint32_t target_index = scale_timeval(ts);
+    total += delta;
+    if(flags & F_NON_TCP) {
+        portless_count += delta;
+        return;
+    }
+    uint8_t ii = 0;
+    while(ii < port_slots && ports[ii] < port) {
+        ii++;
+    }
+    if(ii < port_slots && ports[ii] == port) {
+        port_counts[ii] += delta;
+        return;
+    }
+    if(port_slots == PORT_SLOTS) {
+        // full: the port takes the smallest slot if it has more than that
+        uint8_t smallest = 0;
+        for(uint8_t jj = 1; jj < port_slots; jj++) {
+            if(port_counts[jj] < port_counts[smallest]) {
+                smallest = jj;
+            }
+        }
+        if(port_counts[smallest] >= delta) {
+            other_count += delta;
+            return;
+        }
+        other_count += port_counts[smallest];
+        for(uint8_t jj = smallest; jj + 1 < port_slots; jj++) {
+            ports[jj] = ports[jj + 1];
+            port_counts[jj] = port_counts[jj + 1];
+        }
+        port_slots--;
+        if(smallest < ii) {
+            ii--;
+        }
+    }
+    for(uint8_t jj = port_slots; jj > ii; jj--) {
+        ports[jj] = ports[jj - 1];
+        port_counts[jj] = port_counts[jj - 1];
+    }
+    ports[ii] = port;
+    port_counts[ii] = delta;
+    port_slots++;
+}
+
+void time_histogram::bucket::merge(const bucket &b)
+{
+    for(uint8_t ii = 0; ii < b.port_slots; ii++) {
+        increment(b.ports[ii], b.port_counts[ii]);
+    }
+    other_count += b.other_count;
+    portless_count += b.portless_count;
+    total += b.other_count + b.portless_count;
+}
+
+void time_histogram::bucket::write_state(std::ostream &out) const
+{
+    netviz_state::put(out, port_slots);
+    for(uint8_t ii = 0; ii < port_slots; ii++) {
+        netviz_state::put(out, ports[ii]);
+        netviz_state::put(out, port_counts[ii]);
+    }
+    netviz_state::put(out, other_count);
+    netviz_state::put(out, portless_count);
+}
+
+bool time_histogram::bucket::read_state(std::istream &in)
+{
+    uint64_t value = 0;
+    if(!netviz_state::get(in, value, PORT_SLOTS)) {
+        return false;
+    }
+    port_slots = value;
+    total = 0;
+    for(uint8_t ii = 0; ii < port_slots; ii++) {
+        // the ports are kept ascending
+        if(!netviz_state::get(in, value, 65535) || (ii > 0 && value <= ports[ii - 1])) {
+            return false;
+        }
+        ports[ii] = value;
+        if(!netviz_state::get(in, port_counts[ii])) {
+            return false;
+        }
+        total += port_counts[ii];
+    }
+    if(!netviz_state::get(in, other_count) || !netviz_state::get(in, portless_count)) {
+        return false;
+    }
+    total += other_count + portless_count;
+    return true;
+}
+
+// the buckets in use, each after the gap since the one before it
+void time_histogram::histogram_map::write_state(std::ostream &out) const
+{
+    netviz_state::put(out, base_time);
+    netviz_state::put(out, insert_count);
+    netviz_state::put(out, used_count);
+    uint32_t next = 0;
+    for(uint32_t index = first_index; used_count > 0 && index <= last_index; index++) {
+        if(buckets[index].sum() == 0) {
+            continue;
+        }
+        netviz_state::put(out, index - next);
+        buckets[index].write_state(out);
+        next = index + 1;
+    }
+}
+
+bool time_histogram::histogram_map::read_state(std::istream &in)
+{
+    uint64_t used = 0;
+    if(!netviz_state::get(in, base_time) || !netviz_state::get(in, insert_count) ||
+            !netviz_state::get(in, used, span.bucket_count)) {
+        return false;
+    }
+    if(used > 0) {
+        buckets.resize(span.bucket_count);
+    }
+    uint64_t index = 0;
+    for(uint64_t ii = 0; ii < used; ii++) {
+        uint64_t gap = 0;
+        if(!netviz_state::get(in, gap, span.bucket_count)) {
+            return false;
+        }
+        index += gap;
+        if(index >= span.bucket_count || !buckets[index].read_state(in) || buckets[index].sum() == 0) {
+            return false;
+        }
+        counted(index, true);
+        index++;
+    }
+    return true;
+}
+
+time_histogram::bucket *time_histogram::histogram_map::target(const struct timeval &ts, uint32_t &index)
+{
+    index = scale_timeval(ts);
 
-    if(target_index >= span.bucket_count) {
-        return true;                    // overflow; will cause this histogram to be shut down
+    if(index >= span.bucket_count) {
+        return 0;                       // overflow; will cause this histogram to be shut down
     }
+    if(buckets.size() == 0) {
+        buckets.resize(span.bucket_count);
+    }
+    return &buckets[index];
+}
 
-    buckets_t::iterator it = buckets.find(target_index);
-    if(it==buckets.end()){
-        buckets[target_index] = new bucket();
+void time_histogram::histogram_map::counted(uint32_t index, bool was_empty)
+{
+    const bucket &b = buckets[index];
+    if(was_empty && b.sum() > 0) {
+        if(used_count == 0 || index < first_index) first_index = index;
+        if(used_count == 0 || index > last_index) last_index = index;
+        used_count++;
     }
-    buckets[target_index]->increment(port, count, flags);
+    if(b.sum() > greatest) {
+        greatest = b.sum();
+    }
+}
+
+bool time_histogram::histogram_map::insert(const struct timeval &ts, const in_port_t port, const uint64_t count,
+        const unsigned int flags)
+{
+    uint32_t index = 0;
+    bucket *b = target(ts, index);
+    if(b == 0) {
+        return true;
+    }
+    bool was_empty = b->sum() == 0;
+    b->increment(port, count, flags);
+    counted(index, was_empty);
 
     insert_count += count;
 
     return false;
 }
 
+struct timeval time_histogram::histogram_map::bucket_start(uint32_t index) const
+{
+    uint64_t recons_usec = index * bucket_width + base_time;
+    struct timeval reconstructed_ts;
+    reconstructed_ts.tv_usec = (time_t) (recons_usec % (1000LL * 1000LL));
+    reconstructed_ts.tv_sec = (time_t) (recons_usec / (1000LL * 1000LL));
+    return reconstructed_ts;
+}
+
+bool time_histogram::histogram_map::insert(const struct timeval &ts, const bucket &from)
+{
+    uint32_t index = 0;
+    bucket *b = target(ts, index);
+    if(b == 0) {
+        return true;
+    }
+    bool was_empty = b->sum() == 0;
+    b->merge(from);
+    counted(index, was_empty);
+
+    insert_count += from.sum();
 
+    return false;
+}
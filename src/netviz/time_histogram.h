@@ -18,7 +18,9 @@
 #define TIME_HISTOGRAM_H
 
 #include "tcpflow.h"
-#include <map>
+#include <istream>
+#include <ostream>
+#include <vector>
 
 class time_histogram {
 public:
@@ -39,51 +41,45 @@ public:
     typedef std::vector<span_params> span_params_vector_t;
 
     // a bucket counts packets received in a given timeframe, organized by TCP port
+    // The busiest ports get a slot each, kept in port order; the traffic on
+    // other ports is only summed. The total is kept as counts are added.
     class bucket {
     public:
-        typedef std::map<in_port_t, uint64_t> counts_t;
-        bucket() : counts(), portless_count(){};
-        uint64_t sum() const {
-            /* this could be done with std::accumulate */
-            uint64_t count = 0;
-            for(counts_t::const_iterator it=counts.begin();it!=counts.end();it++){
-                count += it->second;
-            }
-            count += portless_count;
-            return count;
-        };
-        counts_t counts;
-        uint64_t portless_count;
-        void increment(in_port_t port, uint64_t delta, unsigned int flags = 0x00) {
-            if(flags & F_NON_TCP) {
-                portless_count += delta;
-            }
-            else {
-                counts[port] += delta;
-            }
-        }
+        enum { PORT_SLOTS = 16 };   // enough for every port one_page_report colors
+        bucket() : port_slots(0), ports(), port_counts(), other_count(0), portless_count(0), total(0) {};
+        uint64_t sum() const { return total; };
+        uint8_t   port_slots;               // slots in use
+        in_port_t ports[PORT_SLOTS];        // ascending
+        uint64_t  port_counts[PORT_SLOTS];
+        uint64_t  other_count;              // TCP traffic on the ports without a slot
+        uint64_t  portless_count;
+        uint64_t  total;
+        void increment(in_port_t port, uint64_t delta, unsigned int flags = 0x00);
+        void merge(const bucket &b);
+        void write_state(std::ostream &out) const;
+        bool read_state(std::istream &in);
     };
 
+    // span.bucket_count buckets in one array, made on the first insert
     class histogram_map {
     public:
-        typedef std::map<uint32_t, bucket *> buckets_t;
+        typedef std::vector<bucket> buckets_t;
         buckets_t buckets;
         histogram_map(span_params span_) :
             buckets(), span(span_), bucket_width(span.usec / span.bucket_count),
-            base_time(0), insert_count(0){}
+            base_time(0), insert_count(0), first_index(0), last_index(0), used_count(0),
+            greatest(0) {}
 
         span_params span;
         uint64_t bucket_width;          // in microseconds
         uint64_t base_time;             // microseconds since Jan 1, 1970; set on first call to scale_timeval
         uint64_t insert_count;                   // of entire histogram
+        uint32_t first_index;           // of the first and last buckets in use; valid if used_count>0
+        uint32_t last_index;
+        uint32_t used_count;            // buckets with counts in them
+        uint64_t greatest;              // the largest bucket sum
 
-        uint64_t greatest_bucket_sum() const {
-            uint64_t greatest = 0;
-            for(buckets_t::const_iterator it = buckets.begin();it!=buckets.end();it++){
-                if(it->second->sum() > greatest) greatest = it->second->sum();
-            }
-            return greatest;
-        }
+        uint64_t greatest_bucket_sum() const { return greatest; }
 
         /** convert timeval to a scaled time.  */
         uint32_t scale_timeval(const struct timeval &ts) {
@@ -101,10 +97,20 @@ public:
         // returns true if the insertion resulted in over/underflow
         bool insert(const struct timeval &ts, const in_port_t port, const uint64_t count = 1,
                 const unsigned int flags = 0x00);
+        bool insert(const struct timeval &ts, const bucket &b); // all of b's counts
+        struct timeval bucket_start(uint32_t index) const;
+        void write_state(std::ostream &out) const;
+        bool read_state(std::istream &in); // into an empty one
+    private:
+        bucket *target(const struct timeval &ts, uint32_t &index); // 0 on over/underflow
+        void counted(uint32_t index, bool was_empty); // the bucket at index was added to
     };
 
     void insert(const struct timeval &ts, const in_port_t port, const uint64_t count = 1,
             const unsigned int flags = 0x00);
+    void merge(const time_histogram &other); // add all of other's counts
+    void write_state(std::ostream &out) const;
+    bool read_state(std::istream &in); // merge saved counts; false if they're damaged
     void condense(double factor);
     uint64_t usec_per_bucket() const;
     uint64_t packet_count() const;
@@ -114,20 +120,22 @@ public:
     const bucket &at(uint32_t index) const;
     size_t size() const;
     size_t non_sparse_size() const;
-
-    /* iterators for the buckets */
-    histogram_map::buckets_t::const_iterator begin() const;
-    histogram_map::buckets_t::const_iterator end() const;
-    histogram_map::buckets_t::const_reverse_iterator rbegin() const;
-    histogram_map::buckets_t::const_reverse_iterator rend() const;
+    uint32_t first_index() const;       // of the first bucket in use, when size()>0
     static span_params_vector_t build_spans();
 
 private:
-    std::vector<histogram_map> histograms;
-    uint32_t best_fit_index;
+    // Packets go into one histogram_map: the finest span that has held every
+    // packet so far. When a packet falls outside it, its buckets are merged
+    // into the next coarser span, which the packet is then tried in.
+    histogram_map histogram;
+    uint32_t span_index;                // of histogram's span in spans
+    struct timeval first_ts;            // of the first packet, which sets the base time of every span
     struct timeval earliest_ts, latest_ts;
     uint64_t insert_count;
 
+    void coarsen();
+    static void rebucket(const histogram_map &from, histogram_map &to);
+
     /** configuration:
      */
     static const uint32_t bucket_count;
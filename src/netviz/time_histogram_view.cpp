@@ -195,22 +195,25 @@ void time_histogram_view::render_data(cairo_t *cr, const bounds_t &bounds)
     double bar_allocation = bounds.width / (double) bars; // bar width with spacing
     double bar_width = bar_allocation / bar_space_factor; // bar width as rendered
     double bar_leading_pad = (bar_allocation - bar_width) / 2.0;
-    time_histogram::histogram_map::buckets_t::const_iterator it = histogram.begin();
 
-    if(it == histogram.end()) {
+    if(histogram.size() == 0) {
         return;
     }
 
-    uint32_t first_offset = it->first;
+    uint32_t first_offset = histogram.first_index();
     double tallest_bar = (double) histogram.tallest_bar();
 
-    for(; it != histogram.end(); it++) {
-        double bar_height = (double) it->second->sum() / tallest_bar * bounds.height;
-        double bar_x = bounds.x + (it->first - first_offset) * bar_allocation + bar_leading_pad;
+    for(size_t ii = 0; ii < bars; ii++) {
+        const time_histogram::bucket &bkt = histogram.at(ii + first_offset);
+        if(bkt.sum() == 0) {
+            continue;
+        }
+        double bar_height = (double) bkt.sum() / tallest_bar * bounds.height;
+        double bar_x = bounds.x + ii * bar_allocation + bar_leading_pad;
         double bar_y = bounds.y + (bounds.height - bar_height);
         bounds_t bar_bounds(bar_x, bar_y, bar_width, bar_height);
 
-        bucket_view bar(*it->second, port_colors, default_color);
+        bucket_view bar(bkt, port_colors, default_color);
 
         bar.render(cr, bar_bounds);
     }
@@ -220,7 +223,8 @@ void time_histogram_view::render_data(cairo_t *cr, const bounds_t &bounds)
     // choose initial bar value
     if(bar_time_unit.length() > 0) {
         time_t start = histogram.start_date();
-        struct tm start_time = *localtime(&start);
+        struct tm start_time;
+        localtime_r(&start, &start_time);   // reports may be drawn on several threads
         if(bar_time_unit == SECOND_NAME) {
             bar_label_numeric = start_time.tm_sec;
             distinct_label_count = 60;
@@ -301,7 +305,7 @@ void time_histogram_view::render_data(cairo_t *cr, const bounds_t &bounds)
     double histogram_sum = (double) histogram.packet_count();
     cairo_move_to(cr, bounds.x, bounds.y + bounds.height);
     for(size_t ii = 0; ii < bars; ii++) {
-        const time_histogram::bucket bkt = histogram.at(ii + first_offset);
+        const time_histogram::bucket &bkt = histogram.at(ii + first_offset);
         accumulator += (double) bkt.sum() / histogram_sum;
 
         double x = bounds.x + ii * bar_allocation;
@@ -462,42 +466,44 @@ void time_histogram_view::bucket_view::render(cairo_t *cr, const bounds_t &bound
 
     // if multiple sections of the same color follow, simply accumulate their height
     double height_accumulator = 0.0;
-    rgb_t next_color = default_color;
-
-    // The loop below is a bit confusing
-    for(time_histogram::bucket::counts_t::const_iterator it = bucket.counts.begin(); it != bucket.counts.end();) {
 
-        double height = bounds.height * ((double) it->second / (double) bucket.sum());
-
-        // on first section, preload the first color as the 'next' color
-        if(it == bucket.counts.begin()) {
-            colormap_t::const_iterator color_pair = color_map.find(it->first);
-            if(color_pair != color_map.end()) {
-                next_color = color_pair->second;
-            }
+    // The ports in their slots, then the rest of the TCP traffic in the default color
+    for(int ii = 0; ii <= bucket.port_slots; ii++) {
+        uint64_t count = ii < bucket.port_slots ? bucket.port_counts[ii] : bucket.other_count;
+        if(count == 0) {
+            continue;
         }
+        double height = bounds.height * ((double) count / (double) bucket.sum());
 
-        // advance to the next color
-        rgb_t color = next_color;
-        next_color = default_color;
-
-        // if there's a next bucket, get its color for the next color
-        // next consolidate this section with the next if the colors match
-        it++;
-        if(it != bucket.counts.end()) {
-            /* This gets after every bar except the last bar */
-            colormap_t::const_iterator color_pair = color_map.find(it->first);
+        rgb_t color = default_color;
+        if(ii < bucket.port_slots) {
+            colormap_t::const_iterator color_pair = color_map.find(bucket.ports[ii]);
             if(color_pair != color_map.end()) {
-                next_color = color_pair->second;
+                color = color_pair->second;
             }
+        }
 
-            if(color == next_color) {
-                height_accumulator += height;
+        // consolidate this section with the next if the colors match
+        rgb_t next_color = default_color;
+        bool last = true;
+        for(int jj = ii + 1; jj <= bucket.port_slots; jj++) {
+            if((jj < bucket.port_slots ? bucket.port_counts[jj] : bucket.other_count) == 0) {
                 continue;
             }
+            last = false;
+            if(jj < bucket.port_slots) {
+                colormap_t::const_iterator color_pair = color_map.find(bucket.ports[jj]);
+                if(color_pair != color_map.end()) {
+                    next_color = color_pair->second;
+                }
+            }
+            break;
+        }
+        if(!last && color == next_color) {
+            height_accumulator += height;
+            continue;
         }
 
-        /* this gets run after every bar */
         cairo_set_source_rgb(cr, color.r, color.g, color.b);
 
         // account for consolidated sections
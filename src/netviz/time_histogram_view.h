@@ -15,6 +15,8 @@
 #include "config.h"
 #ifdef HAVE_LIBCAIRO
 
+#include <map>
+
 #include "plot_view.h"
 #include "time_histogram.h"
 
@@ -0,0 +1,189 @@
+/*
+ * netviz_snapshots.cpp:
+ *
+ * Periodic netviz reports; see netviz_snapshots.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "config.h"
+#include <iostream>
+#include <sstream>
+#include <stdio.h>
+#include <sys/types.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "bulk_extractor_i.h"
+
+#ifdef HAVE_LIBCAIRO
+#include "netviz/one_page_report.h"
+#include "netviz_snapshots.h"
+
+#ifdef HAVE_NETVIZ_SNAPSHOTS
+
+netviz_snapshots::netviz_snapshots(one_page_report &report_,const std::string &outdir_,
+                                   time_t interval_,size_t window_):
+    report(report_),outdir(outdir_),interval(interval_),window(window_),
+    slice(report_.new_empty()),slice_end(0),ready(),spare(0),stopping(false),running(false),
+    lock(),work(),thread(),total(0),recent(),rendered(0)
+{
+    pthread_mutex_init(&lock,0);
+    pthread_cond_init(&work,0);
+}
+
+netviz_snapshots *netviz_snapshots::open(one_page_report &report,const std::string &outdir,
+                                         uint32_t interval,uint32_t window)
+{
+    if(interval==0) return 0;
+    size_t slices = window ? (window + interval - 1) / interval : 0;
+    netviz_snapshots *s = new netviz_snapshots(report,outdir,interval,slices);
+    if(pthread_create(&s->thread,0,run,s)!=0){
+        delete s;
+        return 0;
+    }
+    s->running = true;
+    return s;
+}
+
+netviz_snapshots::~netviz_snapshots()
+{
+    finish();
+    delete slice;
+    delete spare;
+    delete total;
+    while(ready.size()){
+        delete ready.front();
+        ready.pop_front();
+    }
+    while(recent.size()){
+        delete recent.front();
+        recent.pop_front();
+    }
+    pthread_cond_destroy(&work);
+    pthread_mutex_destroy(&lock);
+}
+
+void netviz_snapshots::hand_over()
+{
+    pthread_mutex_lock(&lock);
+    ready.push_back(slice);
+    slice = spare;
+    spare = 0;
+    pthread_cond_signal(&work);
+    pthread_mutex_unlock(&lock);
+    if(slice==0) slice = report.new_empty(); // the thread hasn't made the next one yet
+}
+
+void netviz_snapshots::ingest(const one_page_report::packet_summary &packet)
+{
+    time_t t = packet.ts.tv_sec;
+    if(slice_end==0){
+        slice_end = (t / interval + 1) * interval;
+    } else if(t >= slice_end){
+        hand_over();
+        slice_end = (t / interval + 1) * interval;
+    }
+    slice->ingest(packet);
+}
+
+void netviz_snapshots::finish()
+{
+    if(!running) return;
+    pthread_mutex_lock(&lock);
+    ready.push_back(slice);             // with stopping, so it isn't rendered twice
+    slice = 0;
+    stopping = true;
+    pthread_cond_signal(&work);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread,0);
+    running = false;
+    merge_into(report);
+}
+
+void *netviz_snapshots::run(void *arg)
+{
+    reinterpret_cast<netviz_snapshots *>(arg)->snapshot_loop();
+    return 0;
+}
+
+void netviz_snapshots::keep(one_page_report *finished)
+{
+    if(window==0){
+        if(total==0){
+            total = finished;
+        } else {
+            total->merge(*finished);
+            delete finished;
+        }
+        return;
+    }
+    recent.push_back(finished);
+    if(recent.size() > window){
+        delete recent.front();
+        recent.pop_front();
+    }
+}
+
+void netviz_snapshots::merge_into(one_page_report &to) const
+{
+    if(total) to.merge(*total);
+    for(std::deque<one_page_report *>::const_iterator it = recent.begin(); it != recent.end(); it++){
+        to.merge(**it);
+    }
+}
+
+/* Rendering changes a report (its time histogram is condensed to fit the
+ * page), so each snapshot is rendered from a copy made by merging.
+ */
+void netviz_snapshots::render()
+{
+    one_page_report *snapshot = report.new_empty();
+    merge_into(*snapshot);
+    std::stringstream ss;
+    ss << "snapshot " << ++rendered;
+    if(window) ss << ", the last " << window*interval << " seconds";
+    snapshot->source_identifier = ss.str();
+    snapshot->filename = report.filename + ".tmp";
+    snapshot->render(outdir);
+    delete snapshot;
+    std::string from = outdir + "/" + report.filename + ".tmp";
+    std::string to = outdir + "/" + report.filename;
+    if(rename(from.c_str(),to.c_str())){
+        perror(to.c_str());
+    }
+}
+
+void netviz_snapshots::snapshot_loop()
+{
+    pthread_mutex_lock(&lock);
+    while(true){
+        if(spare==0 && !stopping){
+            pthread_mutex_unlock(&lock);
+            one_page_report *next = report.new_empty();
+            pthread_mutex_lock(&lock);
+            spare = next;
+            continue;
+        }
+        if(ready.empty()){
+            if(stopping) break;
+            pthread_cond_wait(&work,&lock);
+            continue;
+        }
+        std::deque<one_page_report *> finished;
+        finished.swap(ready);
+        bool last = stopping;           // scan_netviz renders the last one
+        pthread_mutex_unlock(&lock);
+        for(std::deque<one_page_report *>::const_iterator it = finished.begin(); it != finished.end(); it++){
+            keep(*it);
+        }
+        if(!last) render();
+        pthread_mutex_lock(&lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+#endif
+#endif
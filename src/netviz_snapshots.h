@@ -0,0 +1,78 @@
+/*
+ * netviz_snapshots.h:
+ *
+ * Renders netviz's report every so often while packets keep coming
+ * (-S netviz_interval=S), rather than only when tcpflow exits, and
+ * optionally of only the last part of the capture (-S netviz_window=W).
+ *
+ * Packets are ingested into a report of their own for each S seconds of
+ * packet time. When a packet is past the end of the current one, that
+ * report is handed to the snapshot thread and a new one is started, which
+ * the thread has already made, so the ingesting thread neither copies
+ * nor waits. The thread merges what it is handed into a report of
+ * everything so far, or keeps the last W/S reports and merges those, and
+ * renders the result to the report's file, replacing it whole.
+ *
+ * finish() hands over the last report and stops the thread, and then
+ * merges the same into the report given to open(), which scan_netviz
+ * renders as it always has.
+ *
+ * #include this file after netviz/one_page_report.h
+ */
+
+#ifndef NETVIZ_SNAPSHOTS_H
+#define NETVIZ_SNAPSHOTS_H
+
+#ifdef HAVE_PTHREAD
+#define HAVE_NETVIZ_SNAPSHOTS
+
+#include <deque>
+#include <string>
+
+class netviz_snapshots {
+    /* These are not implemented */
+    netviz_snapshots(const netviz_snapshots &);
+    netviz_snapshots &operator=(const netviz_snapshots &);
+
+    one_page_report &report;            // the settings of every slice, and the result
+    std::string outdir;
+    time_t      interval;               // seconds of packets in each slice
+    size_t      window;                 // slices a snapshot covers; 0 for all of them
+
+    /* the ingesting thread's */
+    one_page_report *slice;             // being ingested
+    time_t      slice_end;              // 0 before the first packet
+
+    std::deque<one_page_report *> ready; // slices handed over and not yet merged
+    one_page_report *spare;             // the next slice, made by the snapshot thread
+    bool        stopping;
+    bool        running;
+    pthread_mutex_t lock;               // protects ready, spare and stopping
+    pthread_cond_t  work;
+    pthread_t   thread;
+
+    /* the snapshot thread's */
+    one_page_report *total;             // every slice merged, if window is 0
+    std::deque<one_page_report *> recent; // the last window slices, otherwise
+    uint64_t    rendered;
+
+    netviz_snapshots(one_page_report &report,const std::string &outdir,time_t interval,size_t window);
+    static void *run(void *arg);
+    void        snapshot_loop();
+    void        keep(one_page_report *finished);
+    void        merge_into(one_page_report &to) const;
+    void        render();
+    void        hand_over();
+
+public:
+    /** Returns 0 if interval is 0 or the thread can't be started; render at the end only then. */
+    static netviz_snapshots *open(one_page_report &report,const std::string &outdir,
+                                  uint32_t interval,uint32_t window);
+    virtual ~netviz_snapshots();        // finishes
+
+    void        ingest(const one_page_report::packet_summary &packet); // one thread at a time
+    void        finish();               // report then holds what the last snapshot would
+};
+
+#endif
+#endif
@@ -0,0 +1,111 @@
+/*
+ * netviz_worker.cpp:
+ *
+ * The netviz ingest thread; see netviz_worker.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "config.h"
+#include <iostream>
+#include <sys/types.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "bulk_extractor_i.h"
+
+#ifdef HAVE_LIBCAIRO
+#include "netviz/one_page_report.h"
+#include "netviz_worker.h"
+
+#ifdef HAVE_NETVIZ_WORKER
+
+netviz_worker::netviz_worker(ingest_t ingest_,size_t slots):
+    ingest(ingest_),ring(slots),mask(slots-1),head(0),tail(0),dropped(0),
+    worker_waiting(0),stopping(false),running(false),lock(),work(),thread()
+{
+    pthread_mutex_init(&lock,0);
+    pthread_cond_init(&work,0);
+}
+
+netviz_worker *netviz_worker::open(ingest_t ingest,size_t slots)
+{
+    if(slots==0) return 0;
+    size_t n = 1;
+    while(n<slots) n *= 2;
+    netviz_worker *w = new netviz_worker(ingest,n);
+    if(pthread_create(&w->thread,0,run,w)!=0){
+        delete w;
+        return 0;
+    }
+    w->running = true;
+    return w;
+}
+
+netviz_worker::~netviz_worker()
+{
+    stop();
+    pthread_cond_destroy(&work);
+    pthread_mutex_destroy(&lock);
+}
+
+/* The worker sets its flag and then looks at head; we move head and then
+ * look at the flag, as console_writer does, so the lock is only taken to
+ * wake a worker that has run out of packets.
+ */
+void netviz_worker::put(const be13::packet_info &pi)
+{
+    uint64_t h = head;
+    if(h - __atomic_load_n(&tail,__ATOMIC_ACQUIRE) > mask){
+        dropped++;
+        return;
+    }
+    ring[h & mask] = one_page_report::packet_summary(pi);
+    __atomic_store_n(&head,h+1,__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&worker_waiting,__ATOMIC_SEQ_CST)){
+        pthread_mutex_lock(&lock);
+        pthread_cond_signal(&work);
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+void netviz_worker::stop()
+{
+    if(!running) return;
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_signal(&work);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread,0);
+    running = false;
+}
+
+void *netviz_worker::run(void *arg)
+{
+    reinterpret_cast<netviz_worker *>(arg)->worker_loop();
+    return 0;
+}
+
+void netviz_worker::worker_loop()
+{
+    while(true){
+        uint64_t t = tail;
+        if(t != __atomic_load_n(&head,__ATOMIC_ACQUIRE)){
+            (*ingest)(ring[t & mask]);
+            __atomic_store_n(&tail,t+1,__ATOMIC_RELEASE);
+            continue;
+        }
+        pthread_mutex_lock(&lock);
+        __atomic_store_n(&worker_waiting,1,__ATOMIC_SEQ_CST);
+        while(__atomic_load_n(&head,__ATOMIC_SEQ_CST)==tail && !stopping) pthread_cond_wait(&work,&lock);
+        __atomic_store_n(&worker_waiting,0,__ATOMIC_RELAXED);
+        bool done = stopping && __atomic_load_n(&head,__ATOMIC_SEQ_CST)==tail;
+        pthread_mutex_unlock(&lock);
+        if(done) break;                 // stopping, and everything is ingested
+    }
+}
+
+#endif
+#endif
@@ -0,0 +1,63 @@
+/*
+ * netviz_worker.h:
+ *
+ * A thread that feeds netviz's one_page_report, so that the capture
+ * thread never waits on the histograms and iptrees (-S netviz_ring=N).
+ *
+ * put() copies what the report needs of a packet into a packet_summary
+ * in a ring of N of them, and the worker hands them to the ingest
+ * callback in order. The ring has one producer and one consumer: the
+ * capture threads take turns putting, as they did calling
+ * ingest_packet(). When the ring is full the packet is not waited for but
+ * counted, and scan_netviz puts the count in the report. Reading a file
+ * faster than the report can take it drops packets too, so this is for
+ * live capture.
+ *
+ * #include this file after netviz/one_page_report.h
+ */
+
+#ifndef NETVIZ_WORKER_H
+#define NETVIZ_WORKER_H
+
+#ifdef HAVE_PTHREAD
+#define HAVE_NETVIZ_WORKER
+
+#include <vector>
+
+class netviz_worker {
+    /* These are not implemented */
+    netviz_worker(const netviz_worker &);
+    netviz_worker &operator=(const netviz_worker &);
+
+public:
+    typedef void (*ingest_t)(const one_page_report::packet_summary &packet);
+private:
+    ingest_t    ingest;
+    std::vector<one_page_report::packet_summary> ring; // a power of two
+    uint64_t    mask;
+    uint64_t    head;                   // the next slot put() fills
+    uint64_t    tail;                   // the next slot the worker ingests
+    uint64_t    dropped;                // the producer's
+    int         worker_waiting;         // set while the worker sleeps on work
+    bool        stopping;
+    bool        running;
+    pthread_mutex_t lock;
+    pthread_cond_t  work;
+    pthread_t   thread;
+
+    netviz_worker(ingest_t ingest,size_t slots);
+    static void *run(void *arg);
+    void        worker_loop();
+
+public:
+    /** Returns 0 if slots is 0 or the thread can't be started; ingest synchronously then. */
+    static netviz_worker *open(ingest_t ingest,size_t slots);
+    virtual ~netviz_worker();           // stops the thread
+
+    void        put(const be13::packet_info &pi); // one thread at a time
+    void        stop();                 // ingest everything queued and stop the thread
+    uint64_t    dropped_packets() const { return dropped; } // once stopped
+};
+
+#endif
+#endif
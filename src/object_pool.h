@@ -0,0 +1,74 @@
+/*
+ * object_pool.h:
+ *
+ * Storage for objects of one type that are created and destroyed at a
+ * high rate, such as the demultiplexer's tcpip objects.
+ *
+ * Objects are carved out of slabs of SLAB_OBJECTS at a time. A released
+ * object goes on a free list and its storage is the next one handed out,
+ * so a steady churn of flows reuses the same few slabs rather than
+ * fragmenting the heap. Slabs are only given back when the pool is
+ * destroyed.
+ *
+ * The pool hands out raw storage; construct with placement new and call
+ * the destructor before release(). It is not thread-safe: each demux
+ * shard has its own.
+ */
+
+#ifndef OBJECT_POOL_H
+#define OBJECT_POOL_H
+
+#include <new>
+#include <vector>
+
+template <typename T> class object_pool {
+    /* Assignment and copy are not implemented */
+    object_pool(const object_pool &);
+    object_pool &operator=(const object_pool &);
+
+    enum { SLAB_OBJECTS = 256,
+           ALIGN = 16 };                // what ::operator new guarantees on 64-bit platforms
+    enum { STRIDE = ((sizeof(T) > sizeof(void *) ? sizeof(T) : sizeof(void *)) + ALIGN-1) & ~(ALIGN-1) };
+
+    std::vector<void *> slabs;
+    void    *free_list;                 // each free object holds the next one
+    size_t   in_use;
+
+    void grow(){
+        char *slab = static_cast<char *>(::operator new(STRIDE * SLAB_OBJECTS));
+        slabs.push_back(slab);
+        for(size_t i=SLAB_OBJECTS;i>0;i--){ // so that the first object is handed out first
+            void *p = slab + (i-1)*STRIDE;
+            *static_cast<void **>(p) = free_list;
+            free_list = p;
+        }
+    }
+
+public:
+    object_pool():slabs(),free_list(0),in_use(0){}
+    ~object_pool(){
+        for(std::vector<void *>::iterator it=slabs.begin();it!=slabs.end();it++){
+            ::operator delete(*it);
+        }
+    }
+
+    size_t size() const { return in_use; }
+    size_t capacity() const { return slabs.size() * SLAB_OBJECTS; }
+
+    void *allocate(){
+        if(free_list==0) grow();
+        void *p = free_list;
+        free_list = *static_cast<void **>(p);
+        in_use++;
+        return p;
+    }
+
+    void release(T *obj){
+        void *p = obj;
+        *static_cast<void **>(p) = free_list;
+        free_list = p;
+        in_use--;
+    }
+};
+
+#endif
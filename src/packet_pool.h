@@ -0,0 +1,117 @@
+/*
+ * packet_pool.h:
+ *
+ * Blocks of packets for the demux shards, filled by the master and shared
+ * by the shards' batches.
+ *
+ * be13::packet_info borrows libpcap's buffer, which is only good until the
+ * callback returns, so a packet queued for a shard has to be copied. The
+ * master copies each into the block it is filling, a BLOCK_BYTES run of
+ * them one after another whichever shard they are for, and the batch
+ * queued for that shard takes a reference to the block; a batch of 256
+ * packets holds the few blocks they are in rather than a buffer of its
+ * own. Once every batch with packets in a block has been processed, and
+ * the master has moved on to the next, the block goes back on the free
+ * list for the master to fill again. Steady traffic reuses the same few
+ * blocks; none are freed until the pool is.
+ *
+ * A shard that gets few packets would keep its batch filling, and the
+ * blocks it refers to held, for a long time; so a batch that refers to a
+ * block MAX_HELD_BLOCKS older than the one being filled is queued then,
+ * full or not (see tcpdemux::shard::add()).
+ *
+ * A -r file read through pcap_reader is mapped for as long as its packets
+ * are being processed, so the master doesn't copy those: the batch points
+ * into the mapping (see tcpdemux::set_stable_input()).
+ *
+ * One thread fills, and any thread releases.
+ *
+ * #include this file after tcpflow.h
+ */
+
+#ifndef PACKET_POOL_H
+#define PACKET_POOL_H
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#include <vector>
+
+class packet_pool {
+    /* These are not implemented */
+    packet_pool(const packet_pool &);
+    packet_pool &operator=(const packet_pool &);
+
+public:
+    enum { BLOCK_BYTES = 512*1024,       // room for the largest frame libpcap gives, with its IP copy
+           MAX_HELD_BLOCKS = 16 };
+
+    class block {
+        /* These are not implemented */
+        block(const block &);
+        block &operator=(const block &);
+        friend class packet_pool;
+
+        packet_pool &pool;
+        uint32_t refs;
+        block(packet_pool &pool_):pool(pool_),refs(0),seq(0),used(0),data(new uint8_t[BLOCK_BYTES]){}
+        ~block(){ delete [] data; }
+    public:
+        uint64_t seq;                   // when the master began filling it; see sequence()
+        size_t   used;
+        uint8_t *data;
+
+        void hold(){ __atomic_add_fetch(&refs,1,__ATOMIC_RELAXED); }
+        void release(){ if(__atomic_sub_fetch(&refs,1,__ATOMIC_ACQ_REL)==0) pool.put(this); }
+    };
+
+private:
+    std::vector<block *> spare;
+    pthread_mutex_t lock;               // protects spare
+    block   *filling;                   // the master's; it holds a reference
+    uint64_t seq;                       // blocks begun
+    uint64_t made;
+
+    void put(block *b){
+        pthread_mutex_lock(&lock);
+        spare.push_back(b);
+        pthread_mutex_unlock(&lock);
+    }
+
+public:
+    packet_pool():spare(),lock(),filling(0),seq(0),made(0){ pthread_mutex_init(&lock,0); }
+    virtual ~packet_pool(){             // every other reference must have been released
+        if(filling) filling->release();
+        for(std::vector<block *>::iterator it=spare.begin();it!=spare.end();it++) delete *it;
+        pthread_mutex_destroy(&lock);
+    }
+
+    /** n bytes in the block being filled, which is set in b; n is at most BLOCK_BYTES */
+    uint8_t *reserve(size_t n,block *&b){
+        if(filling==0 || BLOCK_BYTES - filling->used < n){
+            if(filling) filling->release();
+            filling = 0;
+            pthread_mutex_lock(&lock);
+            if(spare.size()){
+                filling = spare.back();
+                spare.pop_back();
+            }
+            pthread_mutex_unlock(&lock);
+            if(filling==0){
+                filling = new block(*this);
+                made++;
+            }
+            filling->refs = 1;
+            filling->used = 0;
+            filling->seq  = ++seq;
+        }
+        b = filling;
+        uint8_t *p = filling->data + filling->used;
+        filling->used += n;
+        return p;
+    }
+    uint64_t sequence() const { return seq; } // of the block being filled
+    uint64_t blocks() const { return made; }
+};
+
+#endif
+#endif
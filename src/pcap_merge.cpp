@@ -0,0 +1,183 @@
+/*
+ * pcap_merge.cpp:
+ *
+ * Capture files merged by timestamp; see pcap_merge.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "pcap_reader.h"
+#include "pcap_merge.h"
+
+#ifdef HAVE_PCAP_MERGE
+#include <queue>
+
+pcap_merge::input::input(const std::string &name_,pcap_reader *reader_,pcap_t *pd_):
+    name(name_),reader(reader_),pd(pd_),dlt(0),handler(0),dead(0),fcode(),filtered(false),
+    thread(),started(false),lock(),changed(),full(),spare(),eof(false),stopping(false),errmsg(),
+    filling(0),cur(0),next(0)
+{
+    pthread_mutex_init(&lock,0);
+    pthread_cond_init(&changed,0);
+}
+
+pcap_merge::~pcap_merge()
+{
+    for(std::vector<input *>::const_iterator it=inputs.begin();it!=inputs.end();it++){
+        input *in = *it;
+        if(in->started){
+            pthread_mutex_lock(&in->lock);
+            in->stopping = true;
+            if(in->pd) pcap_breakloop(in->pd);
+            pthread_cond_broadcast(&in->changed);
+            pthread_mutex_unlock(&in->lock);
+            pthread_join(in->thread,0);
+        }
+        for(std::deque<batch *>::const_iterator b=in->full.begin();b!=in->full.end();b++) delete *b;
+        for(std::vector<batch *>::const_iterator b=in->spare.begin();b!=in->spare.end();b++) delete *b;
+        delete in->filling;
+        delete in->cur;
+        if(in->filtered) pcap_freecode(&in->fcode);
+        if(in->dead) pcap_close(in->dead);
+#ifdef HAVE_PCAP_READER
+        delete in->reader;
+#endif
+        if(in->pd) pcap_close(in->pd);
+        pthread_cond_destroy(&in->changed);
+        pthread_mutex_destroy(&in->lock);
+        delete in;
+    }
+}
+
+bool pcap_merge::add(const std::string &name,pcap_reader *reader,pcap_t *pd,const std::string &expression)
+{
+    input *in = new input(name,reader,pd);
+    inputs.push_back(in);
+#ifdef HAVE_PCAP_READER
+    if(reader){
+        in->dlt = reader->datalink();
+        if(expression.size()){
+            /* compiled as process_mapped_infile() does; the reader runs it */
+            in->dead = pcap_open_dead(in->dlt,reader->snapshot());
+            if(pcap_compile(in->dead,&in->fcode,expression.c_str(),1,0) < 0){
+                errmsg = pcap_geterr(in->dead);
+                return false;
+            }
+            in->filtered = true;
+        }
+    }
+#endif
+    if(pd) in->dlt = pcap_datalink(pd);
+    in->handler = find_handler(in->dlt,name.c_str());
+    return true;
+}
+
+/* static */ void pcap_merge::queue_batch(input *in)
+{
+    in->filling->data.insert(in->filling->data.end(),PAD,0);
+    pthread_mutex_lock(&in->lock);
+    while(in->full.size() >= BATCH_DEPTH && !in->stopping) pthread_cond_wait(&in->changed,&in->lock);
+    in->full.push_back(in->filling);
+    in->filling = 0;
+    if(in->spare.size()){
+        in->filling = in->spare.back();
+        in->spare.pop_back();
+    }
+    pthread_cond_broadcast(&in->changed);
+    pthread_mutex_unlock(&in->lock);
+    if(in->filling==0) in->filling = new batch();
+    in->filling->data.clear();
+    in->filling->packets.clear();
+}
+
+/* static */ void pcap_merge::collect(u_char *user,const struct pcap_pkthdr *h,const u_char *p)
+{
+    input *in = (input *)user;
+    batch *b = in->filling;
+    b->packets.push_back(packet(*h,b->data.size()));
+    b->data.insert(b->data.end(),p,p+h->caplen);
+    if(b->data.size() >= BATCH_SIZE) queue_batch(in);
+}
+
+/* static */ void *pcap_merge::run_input(void *arg)
+{
+    input *in = (input *)arg;
+    int count = 0;
+#ifdef HAVE_PCAP_READER
+    if(in->reader){
+        count = in->reader->loop(collect,(u_char *)in,in->filtered ? &in->fcode : 0);
+        if(count<0) in->errmsg = in->reader->errmsg;
+    }
+#endif
+    if(in->pd){
+        count = pcap_loop(in->pd,-1,collect,(u_char *)in);
+        if(count==-1) in->errmsg = pcap_geterr(in->pd);
+    }
+    if(in->filling->packets.size()) queue_batch(in);
+    pthread_mutex_lock(&in->lock);
+    in->eof = true;
+    pthread_cond_broadcast(&in->changed);
+    pthread_mutex_unlock(&in->lock);
+    return 0;
+}
+
+bool pcap_merge::fetch(input *in)
+{
+    if(in->cur && in->next < in->cur->packets.size()) return true;
+    pthread_mutex_lock(&in->lock);
+    if(in->cur) in->spare.push_back(in->cur);
+    in->cur = 0;
+    pthread_cond_broadcast(&in->changed);
+    while(in->full.empty() && !in->eof) pthread_cond_wait(&in->changed,&in->lock);
+    if(in->full.size()){
+        in->cur = in->full.front();
+        in->full.pop_front();
+        in->next = 0;
+    }
+    pthread_mutex_unlock(&in->lock);
+    return in->cur!=0;
+}
+
+int64_t pcap_merge::loop(u_char *user)
+{
+    for(std::vector<input *>::const_iterator it=inputs.begin();it!=inputs.end();it++){
+        input *in = *it;
+        in->filling = new batch();
+        if(pthread_create(&in->thread,0,run_input,in)){
+            errmsg = in->name + ": cannot start a thread to read it";
+            return -1;
+        }
+        in->started = true;
+    }
+    std::priority_queue<head> heap;
+    for(size_t i=0;i<inputs.size();i++){
+        if(fetch(inputs[i])) heap.push(head(inputs[i]->cur->packets[0].h.ts,i));
+    }
+    int64_t count = 0;
+    int dlt = -1;
+    while(!heap.empty()){
+        size_t which = heap.top().which;
+        input *in = inputs[which];
+        heap.pop();
+        const packet &pkt = in->cur->packets[in->next++];
+        if(in->dlt != dlt){
+            dlt = in->dlt;
+            tcpdemux::getInstance()->set_datalink(dlt);
+        }
+        (*in->handler)(user,&pkt.h,&in->cur->data[0] + pkt.offset);
+        count++;
+        if(fetch(in)) heap.push(head(in->cur->packets[in->next].h.ts,which)); // may give back the batch pkt was in
+    }
+    for(std::vector<input *>::const_iterator it=inputs.begin();it!=inputs.end();it++){
+        if((*it)->errmsg.size()){
+            errmsg = (*it)->name + ": " + (*it)->errmsg;
+            return -1;
+        }
+    }
+    return count;
+}
+#endif
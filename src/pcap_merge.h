@@ -0,0 +1,110 @@
+/*
+ * pcap_merge.h:
+ *
+ * Several capture files read at once and handed on as one stream in
+ * timestamp order (-S merge_inputs=1), as mergecap would merge them but
+ * without writing the merged file first. Rotated captures from several
+ * taps of one link can be given as they are.
+ *
+ * Each input is read and filtered on a thread of its own, with the
+ * pcap_reader or pcap_t that process_infile() would have used. The
+ * packets that pass are copied into batches, a few of which are queued
+ * for each input. The caller's thread keeps the first packet of every
+ * input in a heap ordered by timestamp and hands the earliest to its
+ * input's datalink handler. Packets with the same timestamp come in the
+ * order the files were given, and each file's packets in their own order.
+ *
+ * #include this file after tcpflow.h
+ */
+
+#ifndef PCAP_MERGE_H
+#define PCAP_MERGE_H
+
+#ifdef HAVE_PTHREAD
+#define HAVE_PCAP_MERGE
+
+#include <deque>
+#include <string>
+#include <vector>
+
+class pcap_reader;
+
+class pcap_merge {
+    /* These are not implemented */
+    pcap_merge(const pcap_merge &);
+    pcap_merge &operator=(const pcap_merge &);
+
+    enum { BATCH_SIZE = 1024*1024,      // of packet data, copied by an input's thread
+           BATCH_DEPTH = 4,             // batches queued for each input
+           PAD = 4096,                  // zeros after a batch, for decoders that look past caplen
+    };
+    struct packet {
+        packet(const struct pcap_pkthdr &h_,size_t offset_):h(h_),offset(offset_){}
+        struct pcap_pkthdr h;
+        size_t offset;                  // of its data in the batch
+    };
+    struct batch {
+        batch():data(),packets(){}
+        std::vector<u_char> data;
+        std::vector<packet> packets;
+    };
+    struct input {
+        input(const std::string &name_,pcap_reader *reader_,pcap_t *pd_);
+        std::string name;
+        pcap_reader *reader;            // one or the other
+        pcap_t      *pd;
+        int         dlt;
+        pcap_handler handler;
+        pcap_t      *dead;              // reader: what the filter was compiled for
+        struct bpf_program fcode;
+        bool        filtered;
+        pthread_t   thread;
+        bool        started;
+        pthread_mutex_t lock;
+        pthread_cond_t  changed;        // a batch is queued or given back, or the input ended
+        std::deque<batch *> full;
+        std::vector<batch *> spare;
+        bool        eof;
+        bool        stopping;
+        std::string errmsg;
+        batch      *filling;            // the input's thread's
+        batch      *cur;                // the caller's, and its next packet
+        size_t      next;
+    };
+    struct head {                       // for the heap: an input's next packet
+        head(const struct timeval &ts_,size_t which_):ts(ts_),which(which_){}
+        struct timeval ts;
+        size_t which;
+        bool operator<(const head &b) const { // priority_queue keeps the largest on top
+            if(ts.tv_sec != b.ts.tv_sec)   return ts.tv_sec > b.ts.tv_sec;
+            if(ts.tv_usec != b.ts.tv_usec) return ts.tv_usec > b.ts.tv_usec;
+            return which > b.which;
+        }
+    };
+    std::vector<input *> inputs;
+
+    static void *run_input(void *arg);
+    static void collect(u_char *user,const struct pcap_pkthdr *h,const u_char *p);
+    static void queue_batch(input *in);
+    bool fetch(input *in);              // make in->cur[in->next] its next packet; false at its end
+
+public:
+    std::string errmsg;                 // set when add() or loop() fails
+
+    pcap_merge():inputs(),errmsg(){}
+    virtual ~pcap_merge();              // stops the inputs' threads; deletes their readers
+    /**
+     * Add an input: reader or pd, as opened for process_infile(). The merge
+     * owns it from now on. pd's filter must be set; reader is filtered here
+     * with expression.
+     */
+    bool add(const std::string &name,pcap_reader *reader,pcap_t *pd,const std::string &expression);
+    /**
+     * Start the inputs and hand every packet to its input's handler.
+     * Returns the number of packets, or -1 if an input could not be read.
+     */
+    int64_t loop(u_char *user);
+};
+#endif
+
+#endif
@@ -0,0 +1,279 @@
+/*
+ * pcap_reader.h:
+ *
+ * A class for reading pcap files through mmap.
+ *
+ * Packets are handed to the pcap_handler pointing straight into the
+ * mapping, so unlike pcap_loop() nothing is copied through a read buffer.
+ * Filtering is done with pcap_offline_filter(), so the tcpdump expression
+ * means exactly what it does with libpcap.
+ *
+ * Only classic pcap files (either byte order, micro- or nanosecond
+ * timestamps) are handled. open() returns 0 for anything else --- pcapng,
+ * pipes, files too large to map --- and the caller should use libpcap.
+ *
+ * A pcap_reader can also read a file that arrives in pieces from a
+ * pcap_source, such as a capture being inflated (see gzip_input.h). The
+ * packets are still handed over in place, except for the few that
+ * straddle two pieces, which are put together in a copy.
+ *
+ * #include this file after tcpflow.h
+ */
+
+#ifndef HAVE_PCAP_READER_H
+#define HAVE_PCAP_READER_H
+
+class pcap_reader;                      // declared even where it isn't built, for pointers that stay 0
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+#include <sys/mman.h>
+#include <algorithm>
+#define HAVE_PCAP_READER
+
+/* A file given in pieces */
+class pcap_source {
+public:
+    std::string errmsg;                 // set when next() fails
+    virtual ~pcap_source(){}
+    /* The next piece, valid until the following call; false at the end or on an error */
+    virtual bool next(const uint8_t **piece,size_t *len)=0;
+};
+
+class pcap_reader {
+    /* These are not implemented */
+    pcap_reader &operator=(const pcap_reader &that);
+    pcap_reader(const pcap_reader &t);
+
+    enum {PCAP_RECORD_HEADER_SIZE = 16,
+          PCAP_HEADER_SIZE = 4+2+2+4+4+4+4,
+          PCAP_MAX_CAPLEN  = 262144,    // what libpcap accepts
+          READAHEAD = 64*1024*1024,     // madvise() this far ahead of the packet being read
+          TAIL_SLACK = 256,             // decoders may peek this far past caplen on short captures
+    };
+    const uint8_t *base;                // the mapping
+    size_t      size;
+    pcap_source *src;                   // or where the pieces come from, if there is no mapping
+    const uint8_t *piece;               // what is left of src's last piece
+    size_t      piece_len;
+    std::vector<u_char> carry;          // a header or record begun at the end of a piece
+    bool        swapped;                // file is in the other byte order
+    bool        nanosecond;             // timestamps are in nanoseconds
+    int         dlt;
+    uint32_t    snap;
+    std::vector<u_char> tail;           // copy of a packet too close to the end of the mapping
+
+    uint32_t get4(const uint8_t *p) const {
+        uint32_t v = p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24);
+        return swapped ? ((v>>24) | ((v>>8)&0xff00) | ((v<<8)&0xff0000) | (v<<24)) : v;
+    }
+    void advise(size_t offset,size_t len,int advice) const {
+#ifdef HAVE_MADVISE
+        size_t page = (size_t)getpagesize();
+        size_t start = offset / page * page;
+        if(start >= size) return;
+        if(start + len > size) len = size - start;
+        madvise((void *)(base + start),len,advice);
+#endif
+    }
+    pcap_reader(const uint8_t *base_,size_t size_):base(base_),size(size_),src(0),piece(0),
+                                                  piece_len(0),carry(),swapped(false),
+                                                  nanosecond(false),dlt(0),snap(0),tail(),
+                                                  errmsg(){}
+    pcap_reader(pcap_source *src_):base(0),size(0),src(src_),piece(0),piece_len(0),carry(),
+                                   swapped(false),nanosecond(false),dlt(0),snap(0),tail(),
+                                   errmsg(){}
+    bool read_header(){
+        if(src){
+            if(!gather(PCAP_HEADER_SIZE)) return false;
+            base = &carry[0];           // just while the header is read
+            size = PCAP_HEADER_SIZE;
+        }
+        if(size < PCAP_HEADER_SIZE) return false;
+        uint32_t magic = base[0] | (base[1]<<8) | (base[2]<<16) | ((uint32_t)base[3]<<24);
+        switch(magic){
+        case 0xa1b2c3d4: break;
+        case 0xd4c3b2a1: swapped = true; break;
+        case 0xa1b23c4d: nanosecond = true; break;
+        case 0x4d3cb2a1: swapped = true; nanosecond = true; break;
+        default: return false;          // pcapng or not a capture
+        }
+        snap = get4(base+16);
+        dlt  = (int)(get4(base+20) & 0x0fffffff); // upper bits may hold the FCS length
+        if(src){
+            base = 0;
+            size = 0;
+            carry.clear();
+        }
+        return true;
+    }
+
+    /* Fill carry to n bytes from the pieces; false if the source ends first */
+    bool gather(size_t n){
+        while(carry.size() < n){
+            if(piece_len==0 && !src->next(&piece,&piece_len)) return false;
+            size_t take = std::min(n - carry.size(),piece_len);
+            carry.insert(carry.end(),piece,piece+take);
+            piece     += take;
+            piece_len -= take;
+        }
+        return true;
+    }
+
+    /* The record header at rec; false if caplen is bogus */
+    bool decode(const uint8_t *rec,struct pcap_pkthdr &h){
+        h.ts.tv_sec  = get4(rec);
+        h.ts.tv_usec = nanosecond ? get4(rec+4)/1000 : get4(rec+4);
+        h.caplen     = get4(rec+8);
+        h.len        = get4(rec+12);
+        if(h.caplen > PCAP_MAX_CAPLEN){
+            errmsg = ssprintf("bogus savefile header: caplen %u",(unsigned)h.caplen);
+            return false;
+        }
+        return true;
+    }
+
+    int loop_pieces(pcap_handler handler,u_char *user,const struct bpf_program *filter){
+        int count = 0;
+        for(;;){
+            if(carry.empty()){
+                if(piece_len==0 && !src->next(&piece,&piece_len)) break;
+                if(piece_len==0) continue;
+                size_t want = piece_len < PCAP_RECORD_HEADER_SIZE ? piece_len :
+                    PCAP_RECORD_HEADER_SIZE + (size_t)get4(piece+8);
+                if(piece_len - std::min(want,piece_len) < TAIL_SLACK){
+                    /* At the end of the piece: copy the record, finishing it from the next */
+                    want = std::min(want,piece_len);
+                    carry.assign(piece,piece+want);
+                    piece     += want;
+                    piece_len -= want;
+                }
+            }
+            const uint8_t *rec = carry.size() ? 0 : piece;
+            if(rec==0 && !gather(PCAP_RECORD_HEADER_SIZE)) break;
+            struct pcap_pkthdr h;
+            if(!decode(rec ? rec : &carry[0],h)) return -1;
+            const u_char *p;
+            if(rec){
+                p = rec + PCAP_RECORD_HEADER_SIZE;
+                piece     += PCAP_RECORD_HEADER_SIZE + h.caplen;
+                piece_len -= PCAP_RECORD_HEADER_SIZE + h.caplen;
+            } else {
+                if(!gather(PCAP_RECORD_HEADER_SIZE + h.caplen)) break;
+                carry.resize(PCAP_RECORD_HEADER_SIZE + h.caplen + TAIL_SLACK,0);
+                p = &carry[PCAP_RECORD_HEADER_SIZE];
+            }
+            if(!filter || pcap_offline_filter(filter,&h,p)!=0){
+                (*handler)(user,&h,p);
+                count++;
+            }
+            carry.clear();
+        }
+        if(src->errmsg.size()){
+            errmsg = src->errmsg;
+            return -1;
+        }
+        if(carry.size()){
+            errmsg = ssprintf("truncated dump file; the last record has only %u bytes",(unsigned)carry.size());
+            return -1;
+        }
+        return count;
+    }
+
+public:
+    std::string errmsg;                 // set when loop() returns -1
+
+    static pcap_reader *open(const std::string &fname){
+        int fd = ::open(fname.c_str(),O_RDONLY|O_BINARY);
+        if(fd<0) return 0;
+        struct stat st;
+        if(fstat(fd,&st) || !S_ISREG(st.st_mode) || st.st_size < PCAP_HEADER_SIZE
+           || (uint64_t)st.st_size != (uint64_t)(size_t)st.st_size){
+            close(fd);
+            return 0;
+        }
+        void *m = mmap(0,(size_t)st.st_size,PROT_READ,MAP_SHARED,fd,0);
+        close(fd);                      // the mapping stays valid
+        if(m==MAP_FAILED) return 0;
+        pcap_reader *r = new pcap_reader((const uint8_t *)m,(size_t)st.st_size);
+        if(!r->read_header()){
+            delete r;
+            return 0;
+        }
+#ifdef HAVE_MADVISE
+        madvise(m,(size_t)st.st_size,MADV_SEQUENTIAL);
+#endif
+        return r;
+    }
+    /**
+     * A reader for the pieces src gives, which it then owns. Returns 0 if src
+     * doesn't start a classic pcap file (or fails first; see src->errmsg),
+     * leaving src to the caller.
+     */
+    static pcap_reader *open(pcap_source *src){
+        pcap_reader *r = new pcap_reader(src);
+        if(!r->read_header()){
+            r->src = 0;
+            delete r;
+            return 0;
+        }
+        return r;
+    }
+    virtual ~pcap_reader(){
+        if(src) delete src;
+        else if(base) munmap((void *)base,size);
+    }
+    int datalink() const { return dlt; }
+    int snapshot() const { return (int)snap; }
+    /** The mapping the packets are handed from, or 0 if they come from a pcap_source */
+    const uint8_t *mapping(size_t *len) const {
+        *len = src ? 0 : size;
+        return src ? 0 : base;
+    }
+
+    /**
+     * Call handler for every packet that passes filter (which may be null).
+     * Returns the number of packets read, or -1 on a truncated or corrupt file.
+     */
+    int loop(pcap_handler handler,u_char *user,const struct bpf_program *filter){
+        if(src) return loop_pieces(handler,user,filter);
+        int count = 0;
+        size_t off = PCAP_HEADER_SIZE;
+        size_t advised = 0;             // we have asked for everything up to here
+        while(off < size){
+            if(off + READAHEAD/2 > advised){
+                advise(advised,READAHEAD,MADV_WILLNEED);
+                if(advised >= READAHEAD) advise(advised-READAHEAD,READAHEAD/2,MADV_DONTNEED);
+                advised += READAHEAD/2;
+            }
+            if(size - off < PCAP_RECORD_HEADER_SIZE){
+                errmsg = ssprintf("truncated dump file; tried to read %d header bytes, only got %d",
+                                  (int)PCAP_RECORD_HEADER_SIZE,(int)(size-off));
+                return -1;
+            }
+            const uint8_t *rec = base + off;
+            struct pcap_pkthdr h;
+            if(!decode(rec,h)) return -1;
+            off += PCAP_RECORD_HEADER_SIZE;
+            if(size - off < h.caplen){
+                errmsg = ssprintf("truncated dump file; tried to read %u captured bytes, only got %u",
+                                  (unsigned)h.caplen,(unsigned)(size-off));
+                return -1;
+            }
+            const u_char *p = base + off;
+            if(size - off < h.caplen + TAIL_SLACK){
+                /* Don't let a read past caplen run off the end of the mapping */
+                tail.assign(h.caplen + TAIL_SLACK,0);
+                memcpy(&tail[0],p,h.caplen);
+                p = &tail[0];
+            }
+            off += h.caplen;
+            if(filter && pcap_offline_filter(filter,&h,p)==0) continue;
+            (*handler)(user,&h,p);
+            count++;
+        }
+        return count;
+    }
+};
+#endif
+
+#endif
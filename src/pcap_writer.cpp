@@ -0,0 +1,267 @@
+/*
+ * pcap_writer.cpp:
+ *
+ * Buffered pcap and pcapng writer; see pcap_writer.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "pcap_writer.h"
+
+#include <stdlib.h>
+
+static u_char *alloc_buffer(size_t size)
+{
+    void *p = 0;
+#ifdef HAVE_POSIX_MEMALIGN
+    if(posix_memalign(&p,4096,size)!=0) p = 0;
+#else
+    p = malloc(size);
+#endif
+    return (u_char *)p;
+}
+
+pcap_writer::pcap_writer(size_t buffer_size_):
+    fd(-1),pcapng(false),buffer_size(std::max(buffer_size_,(size_t)BUFFER_MIN)),
+    buffers(),filling(&buffers[0]),interfaces(),datalink(DLT_EN10MB)
+#ifdef HAVE_PTHREAD
+    ,threaded(false),stopping(false),failed(false),writing(0),thread(),lock(),work(),done()
+#endif
+{
+    buffers[0].data = alloc_buffer(buffer_size);
+    if(buffers[0].data==0) throw new write_error();
+}
+
+pcap_writer::~pcap_writer()
+{
+    try {
+        flush();
+    } catch (write_error *e) {
+        delete e;
+    }
+#ifdef HAVE_PTHREAD
+    if(threaded){
+        pthread_mutex_lock(&lock);
+        stopping = true;
+        pthread_cond_signal(&work);
+        pthread_mutex_unlock(&lock);
+        pthread_join(thread,0);
+        pthread_cond_destroy(&done);
+        pthread_cond_destroy(&work);
+        pthread_mutex_destroy(&lock);
+    }
+#endif
+    if(fd>=0) ::close(fd);
+    free(buffers[0].data);
+    free(buffers[1].data);
+}
+
+bool pcap_writer::write_all(int fd,const u_char *data,size_t len)
+{
+    while(len>0){
+        ssize_t count = ::write(fd,data,len);
+        if(count<0 && errno==EINTR) continue;
+        if(count<=0) return false;
+        data += count;
+        len  -= count;
+    }
+    return true;
+}
+
+void pcap_writer::open(const std::string &fname)
+{
+    fd = ::open(fname.c_str(),O_WRONLY|O_CREAT|O_TRUNC|O_BINARY,0666); // write the output
+    if(fd<0) throw new write_error();
+}
+
+void pcap_writer::write_header(int dlt)
+{
+    uint32_t header[6];
+    uint16_t version[2] = {2,4};        // major and minor version numbers
+    header[0] = 0xa1b2c3d4;
+    memcpy(&header[1],version,4);
+    header[2] = 0;                      // time zone offset; always 0
+    header[3] = 0;                      // accuracy of time stamps in the file; always 0
+    header[4] = PCAP_MAX_PKT_LEN;       // snapshot length
+    header[5] = dlt;                    // link layer encapsulation
+    put(header,sizeof(header));
+}
+
+void pcap_writer::copy_header(const std::string &ifname)
+{
+    /* assert byte order is correct */
+    FILE *f2 = fopen(ifname.c_str(),"rb");
+    if(f2==0) throw new write_error();
+    u_char buf[PCAP_HEADER_SIZE];
+    if(fread(buf,1,sizeof(buf),f2)!=sizeof(buf)) throw new write_error();
+    if((buf[0]!=0xd4) || (buf[1]!=0xc3) || (buf[2]!=0xb2) || (buf[3]!=0xa1)){
+        std::cout << "pcap file " << ifname << " is in wrong byte order. Cannot continue.\n";
+        throw new write_error();
+    }
+    put(buf,sizeof(buf));
+    if(fclose(f2)!=0) throw new write_error();
+}
+
+void pcap_writer::write_section_header()
+{
+    uint32_t shb[7];
+    shb[0] = 0x0a0d0d0a;                // section header block
+    shb[1] = sizeof(shb);
+    uint16_t version[2] = {1,0};
+    shb[2] = 0x1a2b3c4d;                // byte-order magic; the blocks are in host order
+    memcpy(&shb[3],version,4);
+    shb[4] = 0xffffffff;                // section length: not given
+    shb[5] = 0xffffffff;
+    shb[6] = sizeof(shb);
+    put(shb,sizeof(shb));
+}
+
+uint32_t pcap_writer::interface_of(int dlt)
+{
+    for(size_t i=0;i<interfaces.size();i++){
+        if(interfaces[i]==dlt) return i;
+    }
+    uint32_t idb[8];
+    uint16_t tsresol[2] = {9,1};        // if_tsresol, one byte long
+    u_char   nanoseconds[4] = {9,0,0,0};// 10^-9 seconds, and padding
+    idb[0] = 1;                         // interface description block
+    idb[1] = sizeof(idb);
+    idb[2] = (uint32_t)(dlt & 0xffff);  // link type, and 16 reserved bits
+    idb[3] = 0;                         // snapshot length: none
+    memcpy(&idb[4],tsresol,4);
+    memcpy(&idb[5],nanoseconds,4);
+    idb[6] = 0;                         // opt_endofopt
+    idb[7] = sizeof(idb);
+    make_room(sizeof(idb));
+    put(idb,sizeof(idb));
+    interfaces.push_back(dlt);
+    return interfaces.size()-1;
+}
+
+void pcap_writer::write_filling()
+{
+#ifdef HAVE_PTHREAD
+    if(threaded){
+        pthread_mutex_lock(&lock);
+        while(writing && !failed) pthread_cond_wait(&done,&lock);
+        bool ok = !failed;
+        if(ok){
+            writing = filling;
+            filling = (filling==&buffers[0]) ? &buffers[1] : &buffers[0];
+            pthread_cond_signal(&work);
+        }
+        pthread_mutex_unlock(&lock);
+        if(!ok) throw new write_error();
+        return;
+    }
+#endif
+    size_t used = filling->used;
+    filling->used = 0;
+    write_bytes(filling->data,used);
+}
+
+void pcap_writer::flush()
+{
+    if(filling->used) write_filling();
+#ifdef HAVE_PTHREAD
+    if(threaded){
+        pthread_mutex_lock(&lock);
+        while(writing && !failed) pthread_cond_wait(&done,&lock);
+        bool ok = !failed;
+        pthread_mutex_unlock(&lock);
+        if(!ok) throw new write_error();
+    }
+#endif
+}
+
+void pcap_writer::write_record(const void *header,size_t header_len,const u_char *p,size_t caplen,size_t pad)
+{
+    static const u_char zeros[4] = {0,0,0,0};
+    size_t len = header_len + caplen + pad;
+    if(len <= buffer_size){
+        make_room(len);
+        put(header,header_len);
+        put(p,caplen);
+        put(zeros,pad);
+        return;
+    }
+    flush();                            // too big to buffer; write it after everything before it
+    write_bytes((const u_char *)header,header_len);
+    write_bytes(p,caplen);
+    write_bytes(zeros,pad);
+}
+
+void pcap_writer::writepkt(const struct pcap_pkthdr *h,const u_char *p)
+{
+    if(!pcapng){
+        uint32_t record[4];
+        record[0] = h->ts.tv_sec;       // time stamp, seconds avalue
+        record[1] = h->ts.tv_usec;      // time stamp, microseconds
+        record[2] = h->caplen;
+        record[3] = h->len;
+        write_record(record,sizeof(record),p,h->caplen,0);
+        return;
+    }
+    uint32_t id = interface_of(datalink);
+    size_t pad = (4 - (h->caplen & 3)) & 3;
+    uint32_t total = PCAPNG_EPB_HEADER_SIZE + h->caplen + pad + PCAPNG_EPB_TRAILER_SIZE;
+    uint64_t ns = (uint64_t)h->ts.tv_sec * 1000000000 + (uint64_t)h->ts.tv_usec * 1000;
+    uint32_t epb[7];
+    epb[0] = 6;                         // enhanced packet block
+    epb[1] = total;
+    epb[2] = id;
+    epb[3] = (uint32_t)(ns >> 32);      // timestamp, high and low
+    epb[4] = (uint32_t)ns;
+    epb[5] = h->caplen;
+    epb[6] = h->len;
+    write_record(epb,sizeof(epb),p,h->caplen,pad);
+    make_room(sizeof(total));
+    put(&total,sizeof(total));
+}
+
+#ifdef HAVE_PTHREAD
+bool pcap_writer::start_thread()
+{
+    if(threaded) return true;
+    if(buffers[1].data==0) buffers[1].data = alloc_buffer(buffer_size);
+    if(buffers[1].data==0) return false;
+    pthread_mutex_init(&lock,0);
+    pthread_cond_init(&work,0);
+    pthread_cond_init(&done,0);
+    if(pthread_create(&thread,0,run,this)!=0){
+        pthread_cond_destroy(&done);
+        pthread_cond_destroy(&work);
+        pthread_mutex_destroy(&lock);
+        return false;
+    }
+    threaded = true;
+    return true;
+}
+
+void *pcap_writer::run(void *arg)
+{
+    pcap_writer *w = reinterpret_cast<pcap_writer *>(arg);
+    pthread_mutex_lock(&w->lock);
+    while(true){
+        while(w->writing==0 && !w->stopping) pthread_cond_wait(&w->work,&w->lock);
+        if(w->writing==0) break;        // stopping, and nothing left to write
+        buffer *b = w->writing;
+        pthread_mutex_unlock(&w->lock);
+        bool ok = write_all(w->fd,b->data,b->used);
+        b->used = 0;
+        pthread_mutex_lock(&w->lock);
+        if(!ok) w->failed = true;
+        w->writing = 0;
+        pthread_cond_broadcast(&w->done);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
+#else
+bool pcap_writer::start_thread()
+{
+    return false;
+}
+#endif
@@ -1,11 +1,31 @@
 /*
  * pcap_writer.h:
- * 
+ *
  * A class for writing pcap files
+ *
+ * Records are built in a page-aligned buffer, each record header with one
+ * copy, and the buffer is written with one write() when it fills. A packet
+ * too big for the buffer is written on its own, after what is buffered.
+ *
+ * open_copy() writes classic pcap with the header of the file being read,
+ * so with its datalink and snaplen. open_pcapng() writes pcapng instead: a
+ * section header, an interface description block for each datalink the
+ * packets come from, written when it is first seen, and an enhanced packet
+ * block for each packet, with nanosecond timestamps.
+ *
+ * After start_thread() there are two buffers: a full one is written by a
+ * thread of its own while the other fills, so the packet path waits for
+ * the disk only when both are full. A write that fails on that thread is
+ * thrown from the next writepkt() or flush().
+ *
+ * #include this file after tcpflow.h
  */
 
 #ifndef HAVE_PCAP_WRITER_H
 #define HAVE_PCAP_WRITER_H
+
+#include <vector>
+
 class pcap_writer {
     /* These are not implemented */
     pcap_writer &operator=(const pcap_writer &that);
@@ -15,77 +35,89 @@ class pcap_writer {
             return "write error in pcap_write";
         }
     };
-    
+
     enum {PCAP_RECORD_HEADER_SIZE = 16,
           PCAP_MAX_PKT_LEN = 65535,      // wire shark may reject larger
           PCAP_HEADER_SIZE = 4+2+2+4+4+4+4,
+          PCAPNG_EPB_HEADER_SIZE = 28,   // enhanced packet block, up to the packet
+          PCAPNG_EPB_TRAILER_SIZE = 4,   // ...and after it, with the padding
     };
-    FILE *fcap;                         // where file is written
-    void write_bytes(const uint8_t * const val, size_t num_bytes) {
-        size_t count = fwrite(val,1,num_bytes,fcap);
-        if (count != num_bytes) throw new write_error();
-    }
-    void write2(const uint16_t val) {
-        size_t count = fwrite(&val,1,2,fcap);
-        if (count != 2)  throw new write_error();
-    }
-    void write4(const uint32_t val) {
-        size_t count = fwrite(&val,1,4,fcap);
-        if (count != 4) throw new write_error();
-    }
-    void open(const std::string &fname) {
-        fcap = fopen(fname.c_str(),"wb"); // write the output
-        if(fcap==0) throw new write_error();
+    enum { BUFFER_MIN = 65536 };
+
+    struct buffer {
+        buffer():data(0),used(0){}
+        u_char *data;
+        size_t  used;
+    };
+    int      fd;                        // where file is written
+    bool     pcapng;
+    size_t   buffer_size;
+    buffer   buffers[2];                // the second only with a thread
+    buffer  *filling;
+    std::vector<int> interfaces;        // pcapng: the datalink of each interface, by id
+    int      datalink;                  // pcapng: of the packets being written
+#ifdef HAVE_PTHREAD
+    bool     threaded;
+    bool     stopping;
+    bool     failed;                    // the thread's write failed
+    buffer  *writing;                   // the buffer the thread is writing; 0 when idle
+    pthread_t       thread;
+    pthread_mutex_t lock;               // protects stopping, failed and writing
+    pthread_cond_t  work;               // signaled when writing is set, or when stopping
+    pthread_cond_t  done;               // signaled when writing is cleared
+    static void *run(void *arg);
+#endif
+
+    static bool write_all(int fd,const u_char *data,size_t len);
+    void open(const std::string &fname);
+    void write_bytes(const u_char *data,size_t len) {
+        if(!write_all(fd,data,len)) throw new write_error();
     }
-    void write_header(){
-        write4(0xa1b2c3d4);
-        write2(2);			// major version number
-        write2(4);			// minor version number
-        write4(0);			// time zone offset; always 0
-        write4(0);			// accuracy of time stamps in the file; always 0
-        write4(PCAP_MAX_PKT_LEN);	// snapshot length
-        write4(DLT_EN10MB);             // link layer encapsulation
+    void put(const void *data,size_t len) { // the caller has made room
+        memcpy(filling->data + filling->used,data,len);
+        filling->used += len;
     }
-    void copy_header(const std::string &ifname){
-        /* assert byte order is correct */
-        FILE *f2 = fopen(ifname.c_str(),"rb");
-        if(f2==0) throw new write_error();
-        u_char buf[PCAP_HEADER_SIZE];
-        if(fread(buf,1,sizeof(buf),f2)!=sizeof(buf)) throw new write_error();
-        if((buf[0]!=0xd4) || (buf[1]!=0xc3) || (buf[2]!=0xb2) || (buf[3]!=0xa1)){
-            std::cout << "pcap file " << ifname << " is in wrong byte order. Cannot continue.\n";
-            throw new write_error();
-        }
-        if(fwrite(buf,1,sizeof(buf),fcap)!=sizeof(buf)) throw new write_error();
-        if(fclose(f2)!=0) throw new write_error();
+    void make_room(size_t len) {
+        if(filling->used + len > buffer_size) write_filling();
     }
-    pcap_writer():fcap(0){}
+    void write_filling();               // write the buffer being filled, or give it to the thread
+    void write_header(int dlt);
+    void copy_header(const std::string &ifname);
+    void write_section_header();
+    uint32_t interface_of(int dlt);     // writes the interface's block the first time
+    void write_record(const void *header,size_t header_len,const u_char *p,size_t caplen,size_t pad);
+    pcap_writer(size_t buffer_size);
 
 public:
-    static pcap_writer *open_new(const std::string &ofname){
-        pcap_writer *pcw = new pcap_writer();
+    enum { DEFAULT_BUFFER_SIZE = 1024*1024 };
+
+    static pcap_writer *open_new(const std::string &ofname,int dlt=DLT_EN10MB,
+                                 size_t buffer_size=DEFAULT_BUFFER_SIZE){
+        pcap_writer *pcw = new pcap_writer(buffer_size);
         pcw->open(ofname);
-        pcw->write_header();
+        pcw->write_header(dlt);
         return pcw;
     }
-    static pcap_writer *open_copy(const std::string &ofname,const std::string &ifname){
-        pcap_writer *pcw = new pcap_writer();
+    static pcap_writer *open_copy(const std::string &ofname,const std::string &ifname,
+                                  size_t buffer_size=DEFAULT_BUFFER_SIZE){
+        pcap_writer *pcw = new pcap_writer(buffer_size);
         pcw->open(ofname);
         pcw->copy_header(ifname);
         return pcw;
     }
-    virtual ~pcap_writer(){
-        if(fcap) fclose(fcap);
-    }
-    void writepkt(const struct pcap_pkthdr *h,const u_char *p) {
-        /* Write a packet */
-        write4(h->ts.tv_sec);		// time stamp, seconds avalue
-        write4(h->ts.tv_usec);		// time stamp, microseconds
-        write4(h->caplen);
-        write4(h->len);
-        size_t count = fwrite(p,1,h->caplen,fcap);	// the packet
-        if(count!=h->caplen) throw new write_error();
+    static pcap_writer *open_pcapng(const std::string &ofname,size_t buffer_size=DEFAULT_BUFFER_SIZE){
+        pcap_writer *pcw = new pcap_writer(buffer_size);
+        pcw->pcapng = true;
+        pcw->open(ofname);
+        pcw->write_section_header();
+        return pcw;
     }
+    virtual ~pcap_writer();             // flushes, stops the thread and closes the file
+
+    bool start_thread();                // false if it can't be started; writes stay on this thread
+    void set_datalink(int dlt) { datalink = dlt; } // of the packets that follow, for pcapng
+    void writepkt(const struct pcap_pkthdr *h,const u_char *p);
+    void flush();                       // write everything so far, and wait for it
 };
-    
+
 #endif
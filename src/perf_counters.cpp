@@ -0,0 +1,115 @@
+/*
+ * perf_counters.cpp:
+ *
+ * Counts of what the packet path does; see perf_counters.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+
+#include <algorithm>
+#include <sstream>
+
+/* static */ const char *perf_counters::name(counter c)
+{
+    switch(c){
+    case FLOW_LOOKUPS:       return "flow_lookups";
+    case FLOW_INSERTS:       return "flow_inserts";
+    case FLOW_PROBES:        return "flow_probes";
+    case FD_EVICTIONS:       return "fd_evictions";
+    case FILE_WRITES:        return "file_writes";
+    case FILE_WRITE_BYTES:   return "file_write_bytes";
+    case LSEEKS:             return "lseeks";
+    case SHIFT_FILES:        return "shift_files";
+    case SAVED_FLOW_MATCHES: return "saved_flow_matches";
+    case SAVED_FLOW_READS:   return "saved_flow_reads";
+    case FLOWS_SCANNED:      return "flows_scanned";
+    case SCAN_USEC:          return "scan_usec";
+    case MEMORY_RELIEFS:     return "memory_reliefs";
+    case PREFILTER_DROPS:    return "prefilter_drops";
+    case DUPLICATE_SEGMENTS: return "duplicate_segments";
+    case DUPLICATE_BYTES:    return "duplicate_bytes";
+    case SAMPLED_OUT:        return "sampled_out";
+    case SAMPLE_CHANGES:     return "sample_changes";
+    case DIR_CACHE_HITS:     return "dir_cache_hits";
+    case DIR_CACHE_MISSES:   return "dir_cache_misses";
+    case WRITE_FAILURES:     return "write_failures";
+    case NUM_COUNTERS:       break;
+    }
+    return "";
+}
+
+/* static */ uint64_t perf_counters::now_usec()
+{
+    struct timeval tv;
+    gettimeofday(&tv,0);
+    return (uint64_t)tv.tv_sec*1000000 + tv.tv_usec;
+}
+
+void perf_counters::find_datalink(int dlt)
+{
+    for(size_t i=0;i<dls;i++){
+        if(dl[i].dlt==dlt){
+            std::swap(dl[i],dl[dls-1]);
+            return;
+        }
+    }
+    if(dls==MAX_DATALINKS){
+        dl[dls-1].dlt = -1;             // the rest are counted together
+        return;
+    }
+    dl[dls].dlt = dlt;
+    dl[dls].packets = 0;
+    dl[dls].bytes = 0;
+    dls++;
+}
+
+void perf_counters::add(const perf_counters &b)
+{
+    for(int i=0;i<NUM_COUNTERS;i++) n[i] += b.n[i];
+    for(size_t i=0;i<b.dls;i++){
+        find_datalink(b.dl[i].dlt);
+        dl[dls-1].packets += b.dl[i].packets;
+        dl[dls-1].bytes   += b.dl[i].bytes;
+    }
+}
+
+static bool by_dlt(const perf_counters::datalink &a,const perf_counters::datalink &b)
+{
+    return a.dlt < b.dlt;
+}
+
+void perf_counters::write(dfxml_writer &x) const
+{
+    x.push("performance");
+    std::vector<datalink> sorted(dl,dl+dls);
+    std::sort(sorted.begin(),sorted.end(),by_dlt);
+    for(std::vector<datalink>::const_iterator it=sorted.begin();it!=sorted.end();it++){
+        std::string dlt = it->dlt<0 ? std::string("other") : ssprintf("%d",it->dlt);
+        x.xmlout("datalink","",ssprintf("dlt='%s' packets='%" PRIu64 "' bytes='%" PRIu64 "'",
+                                        dlt.c_str(),it->packets,it->bytes),false);
+    }
+    for(int i=0;i<NUM_COUNTERS;i++){
+        x.xmlout(name((counter)i),(int64_t)n[i]);
+    }
+    x.pop();
+}
+
+std::string perf_counters::line() const
+{
+    std::stringstream ss;
+    uint64_t packets = 0, bytes = 0;
+    for(size_t i=0;i<dls;i++){
+        packets += dl[i].packets;
+        bytes   += dl[i].bytes;
+    }
+    ss << "packets=" << packets << " bytes=" << bytes;
+    for(int i=0;i<NUM_COUNTERS;i++){
+        ss << " " << name((counter)i) << "=" << n[i];
+    }
+    return ss.str();
+}
@@ -0,0 +1,85 @@
+/*
+ * perf_counters.h:
+ *
+ * Counts of what the packet path does, for tuning without DEBUG(): the
+ * packets and bytes handed on by each datalink, flow table lookups, fd
+ * evictions, flow file writes and seeks, shift_file() calls, stragglers
+ * checked against a saved flow's file, and the time the scanners took.
+ *
+ * Each demux has its own and only its own thread counts into them, so
+ * counting is a plain increment and they are always kept. Once the
+ * flows are closed, perf_totals() adds up the master's and the shards'
+ * (and the scan_pool's), and tcpflow writes the sum as the <performance>
+ * section of report.xml. With -S perf_interval=S, each demux also prints
+ * its own to stderr every S seconds as it goes.
+ *
+ * The flow table counts its own lookups, and the dir_cache its own hits;
+ * see flow_table.h and dir_cache.h.
+ *
+ * #include this file after tcpflow.h
+ */
+
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <string>
+
+class dfxml_writer;
+
+class perf_counters {
+public:
+    enum counter { FLOW_LOOKUPS,        // find() on the flow table
+                   FLOW_INSERTS,
+                   FLOW_PROBES,         // slots looked at past the one a flow hashes to
+                   FD_EVICTIONS,        // flow files closed to make room for another
+                   FILE_WRITES,         // to flow files, however they are written
+                   FILE_WRITE_BYTES,
+                   LSEEKS,
+                   SHIFT_FILES,         // data inserted before the start of a flow file
+                   SAVED_FLOW_MATCHES,  // stragglers matched to a saved flow's digests
+                   SAVED_FLOW_READS,    // and those checked against its file
+                   FLOWS_SCANNED,
+                   SCAN_USEC,           // in the post-processing scanners
+                   MEMORY_RELIEFS,      // times the flows were over memory_max
+                   PREFILTER_DROPS,     // packets the -S prefilter dropped
+                   DUPLICATE_SEGMENTS,  // retransmissions of bytes already stored, not written
+                   DUPLICATE_BYTES,     // their bytes, and those cut from partial overlaps
+                   SAMPLED_OUT,         // packets of flows that -S sample_rate left out
+                   SAMPLE_CHANGES,      // times -S sample_max moved the sampling rate
+                   DIR_CACHE_HITS,      // flow files opened through a held directory
+                   DIR_CACHE_MISSES,    // and those whose directory had to be opened
+                   WRITE_FAILURES,      // io_uring writes that pwrite() couldn't finish either
+                   NUM_COUNTERS };
+    enum { MAX_DATALINKS = 8 };         // more than one capture has
+    struct datalink {
+        int      dlt;
+        uint64_t packets;
+        uint64_t bytes;
+    };
+
+    uint64_t n[NUM_COUNTERS];
+    datalink dl[MAX_DATALINKS];
+    size_t   dls;                       // in use; the last is the one -r files mostly give
+
+    perf_counters():dls(0){
+        memset(n,0,sizeof(n));
+        memset(dl,0,sizeof(dl));
+    }
+    void count(counter c,uint64_t v=1){ n[c] += v; }
+    void packet(int dlt,uint32_t caplen){
+        if(dls==0 || dl[dls-1].dlt!=dlt) find_datalink(dlt);
+        dl[dls-1].packets++;
+        dl[dls-1].bytes += caplen;
+    }
+    void add(const perf_counters &b);
+    void write(dfxml_writer &x) const;  // the <performance> section
+    std::string line() const;           // for stderr
+
+    static const char *name(counter c);
+    static uint64_t now_usec();
+
+private:
+    void find_datalink(int dlt);        // make dlt's entry the last
+};
+
+#endif
@@ -0,0 +1,163 @@
+/*
+ * recon_set.h:
+ *
+ * The set of stream offsets that have been reconstructed for a flow,
+ * kept as disjoint ranges with a running total of their size.
+ *
+ * Nearly every segment extends the last range, so insert() checks that
+ * first and size() is just the total; both are O(1) for in-order data.
+ * The ranges are a sorted vector while there are few of them (one, plus a
+ * range for each hole); a flow that develops more than MAX_VECTOR_RANGES
+ * moves them to a std::map and stays there.
+ *
+ * Touching ranges are joined, as with a boost::icl::interval_set.
+ */
+
+#ifndef RECON_SET_H
+#define RECON_SET_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <vector>
+
+class recon_set {
+public:
+    struct range {
+        range(uint64_t start_,uint64_t end_):start(start_),end(end_){}
+        uint64_t start;
+        uint64_t end;                   // one past the last byte
+    };
+    typedef std::vector<range> ranges_t;
+
+private:
+    enum { MAX_VECTOR_RANGES = 32 };
+    typedef std::map<uint64_t,uint64_t> tree_t; // start -> end, once there are too many holes
+    ranges_t ranges;
+    tree_t   tree;
+    bool     use_tree;
+    uint64_t total;
+
+    static bool ends_before(const range &r,uint64_t start){ return r.end < start; }
+    static bool ends_by(const range &r,uint64_t pos){ return r.end <= pos; }
+
+    void insert_vector(uint64_t start,uint64_t end){
+        ranges_t::iterator lo = std::lower_bound(ranges.begin(),ranges.end(),start,ends_before);
+        ranges_t::iterator hi = lo;
+        while(hi!=ranges.end() && hi->start <= end){ // everything that overlaps or touches
+            start = std::min(start,hi->start);
+            end   = std::max(end,hi->end);
+            total -= hi->end - hi->start;
+            hi++;
+        }
+        total += end - start;
+        if(lo==hi){
+            ranges.insert(lo,range(start,end));
+        } else {
+            *lo = range(start,end);
+            ranges.erase(lo+1,hi);
+        }
+        if(ranges.size() > MAX_VECTOR_RANGES) move_to_tree();
+    }
+
+    void move_to_tree(){
+        for(ranges_t::const_iterator it=ranges.begin();it!=ranges.end();it++){
+            tree[it->start] = it->end;
+        }
+        ranges_t().swap(ranges);
+        use_tree = true;
+    }
+
+    void insert_tree(uint64_t start,uint64_t end){
+        tree_t::iterator it = tree.upper_bound(start);
+        if(it!=tree.begin()){
+            tree_t::iterator prev = it;
+            prev--;
+            if(prev->second >= start) it = prev; // overlaps or touches the range before
+        }
+        while(it!=tree.end() && it->first <= end){
+            start = std::min(start,it->first);
+            end   = std::max(end,it->second);
+            total -= it->second - it->first;
+            tree.erase(it++);
+        }
+        total += end - start;
+        tree[start] = end;
+    }
+
+public:
+    recon_set():ranges(),tree(),use_tree(false),total(0){}
+
+    /** Add [start,end) */
+    void insert(uint64_t start,uint64_t end){
+        if(end<=start) return;
+        if(!use_tree){
+            if(ranges.empty()){
+                ranges.push_back(range(start,end));
+                total = end - start;
+                return;
+            }
+            range &last = ranges.back();
+            if(start >= last.start && start <= last.end){ // the usual case: extends the last range
+                if(end > last.end){
+                    total += end - last.end;
+                    last.end = end;
+                }
+                return;
+            }
+            if(start > last.end){       // a hole, then more data
+                ranges.push_back(range(start,end));
+                total += end - start;
+                if(ranges.size() > MAX_VECTOR_RANGES) move_to_tree();
+                return;
+            }
+            insert_vector(start,end);
+            return;
+        }
+        insert_tree(start,end);
+    }
+
+    /** The range that holds pos, if there is one; the last is looked at first */
+    bool find(uint64_t pos,range &r) const {
+        if(!use_tree){
+            if(ranges.empty()) return false;
+            ranges_t::const_iterator it = ranges.end()-1;
+            if(pos < it->start){
+                it = std::lower_bound(ranges.begin(),ranges.end(),pos,ends_by);
+                if(it==ranges.end() || pos < it->start) return false;
+            }
+            if(pos >= it->end) return false;
+            r = *it;
+            return true;
+        }
+        tree_t::const_iterator it = tree.upper_bound(pos);
+        if(it==tree.begin()) return false;
+        it--;
+        if(pos >= it->second) return false;
+        r = range(it->first,it->second);
+        return true;
+    }
+
+    uint64_t size() const { return total; } // bytes in the set
+    size_t   range_count() const { return use_tree ? tree.size() : ranges.size(); }
+    void     clear(){
+        ranges_t().swap(ranges);
+        tree.clear();
+        use_tree = false;
+        total = 0;
+    }
+
+    /** Append the ranges, in order */
+    void get_ranges(ranges_t &out) const {
+        if(!use_tree){
+            out.insert(out.end(),ranges.begin(),ranges.end());
+            return;
+        }
+        for(tree_t::const_iterator it=tree.begin();it!=tree.end();it++){
+            out.push_back(range(it->first,it->second));
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,157 @@
+/*
+ * report_writer.cpp:
+ *
+ * The report.xml writer thread; see report_writer.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "report_writer.h"
+
+#include <sstream>
+
+void flow_report::write(class dfxml_writer *xreport) const
+{
+    static const std::string fileobject_str("fileobject");
+    static const std::string filesize_str("filesize");
+    static const std::string filename_str("filename");
+    static const std::string tcpflow_str("tcpflow");
+
+    xreport->push(fileobject_str);
+    if(flow_pathname.size()) xreport->xmlout(filename_str,flow_pathname);
+
+    xreport->xmlout(filesize_str,last_byte);
+
+    const flow &f = myflow;
+    std::stringstream attrs;
+    attrs << "startime='" << dfxml_writer::to8601(f.tstart) << "' ";
+    attrs << "endtime='"  << dfxml_writer::to8601(f.tlast)  << "' ";
+    attrs << "src_ipn='"  << f.src << "' ";
+    attrs << "dst_ipn='"  << f.dst << "' ";
+    char mac[MACADDR_BUFSIZE];
+    if(f.has_mac_daddr()) attrs << "mac_daddr='" << macaddr(f.mac_daddr,mac) << "' ";
+    if(f.has_mac_saddr()) attrs << "mac_saddr='" << macaddr(f.mac_saddr,mac) << "' ";
+    attrs << "packets='"  << f.packet_count << "' ";
+    attrs << "srcport='"  << f.sport << "' ";
+    attrs << "dstport='"  << f.dport << "' ";
+    attrs << "family='"   << (int)f.family << "' ";
+    if(out_of_order_count) attrs << "out_of_order_count='" << out_of_order_count << "' ";
+    if(violations)         attrs << "violations='" << violations << "' ";
+    if(sample_rate>1)      attrs << "sample_rate='" << sample_rate << "' ";
+
+    xreport->xmlout(tcpflow_str,"",attrs.str(),false);
+    if(xmladd.size()>0) xreport->xmlout("",xmladd,"",false);
+    xreport->pop();
+}
+
+#ifdef HAVE_REPORT_WRITER
+
+report_writer::report_writer(class dfxml_writer *xreport_):
+    xreport(xreport_),queued(),spare(),writer_waiting(0),producer_waiting(0),stopping(false),running(false),
+    lock(),work(),room(),thread()
+{
+    pthread_mutex_init(&lock,0);
+    pthread_cond_init(&work,0);
+    pthread_cond_init(&room,0);
+}
+
+report_writer *report_writer::open(class dfxml_writer *xreport)
+{
+    report_writer *w = new report_writer(xreport);
+    if(pthread_create(&w->thread,0,run,w)!=0){
+        DEBUG(2)("cannot start the report writer thread; writing report.xml synchronously");
+        delete w;
+        return 0;
+    }
+    w->running = true;
+    return w;
+}
+
+report_writer::~report_writer()
+{
+    stop();
+    flow_report *fr = 0;
+    while(spare.pop(fr)) delete fr;
+    pthread_cond_destroy(&room);
+    pthread_cond_destroy(&work);
+    pthread_mutex_destroy(&lock);
+}
+
+/* Wake the other thread if it is asleep, or about to be.
+ * The sleeper sets *waiting and then looks at the ring; we have changed the
+ * ring and then look at *waiting. The fences make sure at least one of us
+ * sees what the other did, and the sleeper holds lock from setting *waiting
+ * until it is waiting, so the signal can't come too early.
+ */
+void report_writer::wake(int *waiting,pthread_cond_t *cond)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(waiting,__ATOMIC_RELAXED)){
+        demux_lock l(&lock);
+        pthread_cond_signal(cond);
+    }
+}
+
+flow_report *report_writer::get()
+{
+    flow_report *fr = 0;
+    if(spare.pop(fr)) return fr;
+    return new flow_report();
+}
+
+void report_writer::put(flow_report *fr)
+{
+    while(!queued.push(fr)){
+        demux_lock l(&lock);
+        __atomic_store_n(&producer_waiting,1,__ATOMIC_SEQ_CST);
+        while(queued.full()) pthread_cond_wait(&room,&lock);
+        __atomic_store_n(&producer_waiting,0,__ATOMIC_RELAXED);
+    }
+    wake(&writer_waiting,&work);
+}
+
+void report_writer::stop()
+{
+    if(!running) return;
+    {
+        demux_lock l(&lock);
+        stopping = true;
+        pthread_cond_signal(&work);
+    }
+    pthread_join(thread,0);
+    running = false;
+}
+
+void *report_writer::run(void *arg)
+{
+    reinterpret_cast<report_writer *>(arg)->writer_loop();
+    return 0;
+}
+
+void report_writer::writer_loop()
+{
+    bool wrote = false;
+    while(true){
+        flow_report *fr = 0;
+        if(queued.pop(fr)){
+            wake(&producer_waiting,&room);
+            fr->write(xreport);
+            if(!spare.push(fr)) delete fr;
+            wrote = true;
+            continue;
+        }
+        if(wrote) xreport->flush();     // caught up
+        wrote = false;
+        demux_lock l(&lock);
+        __atomic_store_n(&writer_waiting,1,__ATOMIC_SEQ_CST);
+        while(queued.empty() && !stopping) pthread_cond_wait(&work,&lock);
+        __atomic_store_n(&writer_waiting,0,__ATOMIC_RELAXED);
+        if(queued.empty()) break;       // stopping, and nothing left to do
+    }
+}
+
+#endif
@@ -0,0 +1,103 @@
+/*
+ * report_writer.h:
+ *
+ * Writes the <fileobject> for each finished flow to report.xml on a
+ * thread of its own.
+ *
+ * post_process() copies what the report says about a flow into a
+ * flow_report and queues it; formatting it and writing it to the
+ * dfxml_writer happen on the report thread. Written flow_reports are
+ * handed back for reuse, so their strings keep their capacity.
+ *
+ * The queues are single-producer, single-consumer rings. Shards make their
+ * calls to get() and put() under the demux shared_lock, so there is one
+ * producer at a time, and flow_reports are written in the order they were
+ * put: the order the flows were post-processed, as when the report is
+ * written synchronously. A thread sleeps only when its ring is empty (the
+ * writer) or full (the producer).
+ *
+ * Nothing else may use the dfxml_writer until stop() has returned.
+ *
+ * #include this file after tcpip.h
+ */
+
+#ifndef REPORT_WRITER_H
+#define REPORT_WRITER_H
+
+/* What report.xml says about one flow */
+class flow_report {
+public:
+    flow_report():myflow(),flow_pathname(),last_byte(0),out_of_order_count(0),violations(0),sample_rate(1),xmladd(){}
+    flow        myflow;
+    std::string flow_pathname;
+    uint64_t    last_byte;
+    uint64_t    out_of_order_count;
+    uint64_t    violations;
+    uint32_t    sample_rate;            // see tcpip::sample_rate
+    std::string xmladd;                 // from the post-processing scanners
+    void write(class dfxml_writer *xreport) const; // the <fileobject>
+};
+
+#ifdef HAVE_PTHREAD
+#define HAVE_REPORT_WRITER
+
+/* N must be a power of two */
+template <typename T,uint32_t N> class spsc_ring {
+    T        items[N];
+    uint32_t head;                      // written only by the consumer
+    uint32_t tail;                      // written only by the producer
+public:
+    spsc_ring():head(0),tail(0){}
+    bool push(const T &v){
+        uint32_t t = tail;
+        if(t - __atomic_load_n(&head,__ATOMIC_ACQUIRE) == N) return false;
+        items[t & (N-1)] = v;
+        __atomic_store_n(&tail,t+1,__ATOMIC_RELEASE);
+        return true;
+    }
+    bool pop(T &v){
+        uint32_t h = head;
+        if(h == __atomic_load_n(&tail,__ATOMIC_ACQUIRE)) return false;
+        v = items[h & (N-1)];
+        __atomic_store_n(&head,h+1,__ATOMIC_RELEASE);
+        return true;
+    }
+    bool empty() const { return __atomic_load_n(&head,__ATOMIC_ACQUIRE)==__atomic_load_n(&tail,__ATOMIC_ACQUIRE); }
+    bool full() const { return __atomic_load_n(&tail,__ATOMIC_ACQUIRE)-__atomic_load_n(&head,__ATOMIC_ACQUIRE)==N; }
+};
+
+class report_writer {
+    /* These are not implemented */
+    report_writer(const report_writer &);
+    report_writer &operator=(const report_writer &);
+
+    enum { RING_SIZE = 1024 };
+    class dfxml_writer *xreport;
+    spsc_ring<flow_report *,RING_SIZE> queued; // put() to the writer
+    spsc_ring<flow_report *,RING_SIZE> spare;  // the writer back to get()
+    int         writer_waiting;         // set while the writer sleeps on work
+    int         producer_waiting;       // set while put() sleeps on room
+    bool        stopping;
+    bool        running;
+    pthread_mutex_t lock;
+    pthread_cond_t  work;
+    pthread_cond_t  room;
+    pthread_t   thread;
+
+    report_writer(class dfxml_writer *xreport);
+    static void *run(void *arg);
+    void        writer_loop();
+    void        wake(int *waiting,pthread_cond_t *cond);
+
+public:
+    /** Returns 0 if the thread can't be started; write synchronously then. */
+    static report_writer *open(class dfxml_writer *xreport);
+    virtual ~report_writer();           // stops the thread
+
+    flow_report *get();                 // a flow_report to fill in
+    void        put(flow_report *fr);   // queue it to be written
+    void        stop();                 // write everything queued and stop the thread
+};
+
+#endif
+#endif
@@ -0,0 +1,166 @@
+/*
+ * scan_fanout.cpp:
+ *
+ * A flow's scanners on threads of their own; see scan_fanout.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "scan_fanout.h"
+#include "cpu_layout.h"
+
+#include <algorithm>
+#include <sstream>
+
+#ifdef HAVE_SCAN_FANOUT
+
+/* The builtin scanners, in scanners_builtin order, and whether they read
+ * flows; those that don't return at once from PHASE_SCAN.
+ */
+static const struct {
+    const char *name;
+    scanner_t  *scanner;
+    bool        reads_flows;
+} builtins[] = {
+    {"md5",     scan_md5,      true},
+    {"http",    scan_http,     true},
+    {"netviz",  scan_netviz,   false},
+    {"tcpdemux",scan_tcpdemux, false},
+#ifdef USE_WIFI
+    {"wifiviz", scan_wifiviz,  false},
+#endif
+};
+#define NUM_BUILTINS (sizeof(builtins)/sizeof(builtins[0]))
+
+scan_fanout::scan_fanout():
+    scanners(),todo(),stopping(false),threads(),lock(),work(),finished()
+{
+    pthread_mutex_init(&lock,0);
+    pthread_cond_init(&work,0);
+    pthread_cond_init(&finished,0);
+}
+
+scan_fanout *scan_fanout::open(uint32_t nthreads)
+{
+    if(nthreads<2) return 0;
+    std::vector<std::string> enabled;
+    be13::plugin::get_enabled_scanners(enabled);
+    std::vector<scanner_t *> use;
+    for(size_t i=0;i<NUM_BUILTINS;i++){
+        if(std::find(enabled.begin(),enabled.end(),builtins[i].name)==enabled.end()) continue;
+        if(builtins[i].reads_flows) use.push_back(builtins[i].scanner);
+    }
+    for(std::vector<std::string>::const_iterator it=enabled.begin();it!=enabled.end();it++){
+        size_t i = 0;
+        while(i<NUM_BUILTINS && *it!=builtins[i].name) i++;
+        if(i==NUM_BUILTINS){
+            DEBUG(2)("scanner %s is not a builtin; scanning flows with one thread",it->c_str());
+            return 0;
+        }
+    }
+    if(use.size()<2) return 0;          // nothing to run alongside
+
+    scan_fanout *f = new scan_fanout();
+    f->scanners = use;
+    for(uint32_t i=0;i+1<nthreads;i++){
+        pthread_t t;
+        if(pthread_create(&t,0,run,f)!=0) break;
+        f->threads.push_back(t);
+    }
+    if(f->threads.size()==0){
+        DEBUG(2)("cannot start scanner threads; scanning flows with one thread");
+        delete f;
+        return 0;
+    }
+    DEBUG(2)("%u scanners of each flow on %u threads",(unsigned)use.size(),(unsigned)f->threads.size()+1);
+    return f;
+}
+
+scan_fanout::~scan_fanout()
+{
+    {
+        demux_lock l(&lock);
+        stopping = true;
+        pthread_cond_broadcast(&work);
+    }
+    for(std::vector<pthread_t>::const_iterator it=threads.begin();it!=threads.end();it++){
+        pthread_join(*it,0);
+    }
+    pthread_cond_destroy(&finished);
+    pthread_cond_destroy(&work);
+    pthread_mutex_destroy(&lock);
+}
+
+void *scan_fanout::run(void *arg)
+{
+    reinterpret_cast<scan_fanout *>(arg)->worker_loop();
+    return 0;
+}
+
+void scan_fanout::worker_loop()
+{
+    tcpdemux::mark_scan_worker();
+    if(tcpdemux::getInstance()->cpus) tcpdemux::getInstance()->cpus->pin_worker();
+    pthread_mutex_lock(&lock);
+    while(true){
+        while(todo.empty() && !stopping) pthread_cond_wait(&work,&lock);
+        if(todo.empty()) break;         // stopping; every caller has had its batch done
+        task t = todo.front();
+        todo.pop_front();
+        pthread_mutex_unlock(&lock);
+        run_task(t);
+        pthread_mutex_lock(&lock);
+        done(t.b);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void scan_fanout::run_task(const task &t)
+{
+    std::stringstream xml;
+    scanner_params sp(scanner_params::PHASE_SCAN,t.b->sbuf,t.b->fs,&xml);
+    recursion_control_block rcb;
+    (*scanners[t.i])(sp,rcb);
+    t.b->xml[t.i] = xml.str();
+}
+
+void scan_fanout::done(batch *b)
+{
+    b->left--;
+    pthread_cond_broadcast(&finished);
+}
+
+void scan_fanout::scan(const sbuf_t &sbuf,feature_recorder_set &fs,std::stringstream &xmladd)
+{
+    batch b(sbuf,fs,scanners.size());
+    pthread_mutex_lock(&lock);
+    for(size_t i=1;i<scanners.size();i++) todo.push_back(task(&b,i));
+    pthread_cond_broadcast(&work);
+    pthread_mutex_unlock(&lock);
+
+    run_task(task(&b,0));
+
+    /* Help with whatever is queued, ours or another caller's, until ours are done */
+    pthread_mutex_lock(&lock);
+    done(&b);
+    while(b.left){
+        if(todo.empty()){
+            pthread_cond_wait(&finished,&lock);
+            continue;
+        }
+        task t = todo.front();
+        todo.pop_front();
+        pthread_mutex_unlock(&lock);
+        run_task(t);
+        pthread_mutex_lock(&lock);
+        done(t.b);
+    }
+    pthread_mutex_unlock(&lock);
+    for(size_t i=0;i<b.xml.size();i++) xmladd << b.xml[i];
+}
+
+#endif
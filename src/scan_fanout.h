@@ -0,0 +1,83 @@
+/*
+ * scan_fanout.h:
+ *
+ * The post-processing scanners of one flow run at once (-S scan_threads=N).
+ *
+ * be13::plugin::process_sbuf() runs the enabled scanners one after
+ * another on a flow's mapped file, so a large flow waits for the sum of
+ * md5's digests and http's parsing and inflating. With scan_threads, each
+ * scanner that reads the flow is given to a thread of its own on the same
+ * read-only sbuf, and writes its <fileobject> XML into a string of its
+ * own; when all are done the strings are appended to xmladd in the order
+ * process_sbuf() would have run them, so report.xml is the same either way.
+ *
+ * The caller runs a scanner itself and, while it waits, any other queued
+ * one; the N-1 threads of the fanout are shared by every caller, the
+ * packet thread or the shards without scan_pool, or the scan_pool workers
+ * with it, so post_workers and scan_threads multiply.
+ *
+ * The scanners are already run on scan_pool's threads at once, each on
+ * its own flow; here two different scanners share one. The plugin
+ * interface has no way to run one scanner by name, so the fanout knows
+ * the builtin scanners (scanners_builtin in tcpflow.cpp) by name; if one
+ * it doesn't know is enabled, or fewer than two read flows, open() gives
+ * 0 and process_sbuf() is used as before.
+ *
+ * #include this file after tcpflow.h
+ */
+
+#ifndef SCAN_FANOUT_H
+#define SCAN_FANOUT_H
+
+#ifdef HAVE_PTHREAD
+#define HAVE_SCAN_FANOUT
+
+#include <deque>
+#include <vector>
+
+class scan_fanout {
+    /* These are not implemented */
+    scan_fanout(const scan_fanout &);
+    scan_fanout &operator=(const scan_fanout &);
+
+    /* One flow's scanners */
+    class batch {
+    public:
+        batch(const sbuf_t &sbuf_,feature_recorder_set &fs_,size_t n):
+            sbuf(sbuf_),fs(fs_),xml(n),left(n){}
+        const sbuf_t         &sbuf;
+        feature_recorder_set &fs;
+        std::vector<std::string> xml;   // by scanner
+        size_t left;                    // scanners not yet done
+    };
+    struct task {
+        task(batch *b_,size_t i_):b(b_),i(i_){}
+        batch *b;
+        size_t i;                       // in scanners
+    };
+
+    std::vector<scanner_t *> scanners;  // that read flows, in process_sbuf() order
+    std::deque<task> todo;
+    bool        stopping;
+    std::vector<pthread_t> threads;
+    pthread_mutex_t lock;               // protects todo, stopping and each batch's left
+    pthread_cond_t  work;               // signaled when tasks are queued or we are stopping
+    pthread_cond_t  finished;           // broadcast when a task is done
+
+    scan_fanout();
+    static void *run(void *arg);
+    void        worker_loop();
+    void        run_task(const task &t);
+    void        done(batch *b);         // call with lock held
+
+public:
+    /** Returns 0 if the scanners are better run by process_sbuf(), or no thread can be started */
+    static scan_fanout *open(uint32_t threads);
+    virtual ~scan_fanout();
+
+    /** Run the scanners on sbuf, adding what they write to xmladd */
+    void        scan(const sbuf_t &sbuf,feature_recorder_set &fs,std::stringstream &xmladd);
+};
+
+#endif
+#endif
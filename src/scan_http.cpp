@@ -12,6 +12,7 @@
 #include "tcpdemux.h"
 
 #include "http-parser/http_parser.h"
+#include "scan_http.h"
 
 #include "mime_map.h"
 
@@ -29,8 +30,10 @@
 #  ifdef HAVE_ZLIB_H
 #    include <zlib.h>
 #  endif
-#else
-#  define z_stream void *               // prevents z_stream from generating an error
+#  if defined(HAVE_LIBDEFLATE_H) && defined(HAVE_LIBDEFLATE)
+#    define USE_LIBDEFLATE
+#    include <libdeflate.h>
+#  endif
 #endif
 
 #define MIN_HTTP_BUFSIZE 80             // don't bother parsing smaller than this
@@ -39,57 +42,311 @@
 #include <iostream>
 #include <algorithm>
 #include <map>
+#include <deque>
 #include <iomanip>
 
 #define HTTP_CMD "http_cmd"
 #define HTTP_ALERT_FD "http_alert_fd"
+#define HTTP_STREAM "http_stream"
+#define HTTP_HEADERS "http_headers"
+#define HTTP_INFLATE_WINDOW "http_inflate_window"
+#define HTTP_DEDUP "http_dedup"
 
 /* options */
 std::string http_cmd;                   // command to run on each http object
 int http_subproc_max = 10;              // how many subprocesses are we allowed?
 int http_subproc = 0;                   // how many do we currently have?
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t http_subproc_lock = PTHREAD_MUTEX_INITIALIZER; // post-processing workers share http_subproc
+#endif
 int http_alert_fd = -1;                 // where should we send alerts?
+bool http_stream_mode = false;          // carve from the stream as it is written; see scan_http.h
+bool http_headers_xml = false;          // put every response header in the DFXML
+uint32_t http_inflate_window = 256*1024; // decompressed data is written in pieces this big
+uint32_t http_dedup = 0;                // bodies remembered for deduplication; 0 for none
+
+
+#ifdef HAVE_LIBZ
+/***
+ * Inflate contexts.
+ *
+ * Each thread keeps the contexts its responses are done with, and the
+ * next gzip or deflate body it sees takes one and resets it, so a
+ * keep-alive connection with many small compressed responses does not
+ * set zlib up and tear it down for every one. Decompressed data collects
+ * in the context's window and is written when the window fills or the
+ * body ends.
+ */
+#define INFLATE_SPARE_MAX 16            // contexts kept per thread
+
+class inflater {
+    /* These are not implemented */
+    inflater(const inflater &);
+    inflater &operator=(const inflater &);
+public:
+    inflater():zs(),ok(false),window(http_inflate_window ? http_inflate_window : 1),used(0)
+#ifdef USE_LIBDEFLATE
+              ,ld(0)
+#endif
+    {
+        memset(&zs,0,sizeof(zs));
+        ok = (inflateInit2(&zs, 32 + MAX_WBITS)==Z_OK); /* 32 auto-detects gzip or deflate */
+    }
+    virtual ~inflater(){
+        if(ok) inflateEnd(&zs);
+#ifdef USE_LIBDEFLATE
+        if(ld) libdeflate_free_decompressor(ld);
+#endif
+    }
+    z_stream    zs;
+    bool        ok;                     // zs is initialized
+    std::vector<char> window;           // decompressed data not yet written
+    size_t      used;
+#ifdef USE_LIBDEFLATE
+    struct libdeflate_decompressor *ld; // for bodies that are all in memory; made when first needed
+#endif
+
+    static inflater *get();             // 0 if zlib cannot be set up
+    static void put(inflater *z);
+    static void free_spares();          // this thread's
+};
+
+typedef std::vector<inflater *> inflater_list;
+
+static void free_inflaters(void *arg)
+{
+    inflater_list *spares = reinterpret_cast<inflater_list *>(arg);
+    for(inflater_list::const_iterator it=spares->begin();it!=spares->end();it++){
+        delete *it;
+    }
+    delete spares;
+}
+
+#ifdef HAVE_PTHREAD
+static pthread_key_t  inflater_key;
+static pthread_once_t inflater_once = PTHREAD_ONCE_INIT;
+static void make_inflater_key()
+{
+    pthread_key_create(&inflater_key,free_inflaters);
+}
+#else
+static inflater_list *the_spares = 0;
+#endif
+
+static inflater_list *thread_spares(bool create)
+{
+#ifdef HAVE_PTHREAD
+    pthread_once(&inflater_once,make_inflater_key);
+    inflater_list *spares = reinterpret_cast<inflater_list *>(pthread_getspecific(inflater_key));
+    if(spares==0 && create){
+        spares = new inflater_list();
+        pthread_setspecific(inflater_key,spares);
+    }
+    return spares;
+#else
+    if(the_spares==0 && create) the_spares = new inflater_list();
+    return the_spares;
+#endif
+}
+
+/* static */ inflater *inflater::get()
+{
+    inflater_list *spares = thread_spares(true);
+    while(spares->size()){
+        inflater *z = spares->back();
+        spares->pop_back();
+        if(inflateReset2(&z->zs, 32 + MAX_WBITS)==Z_OK){
+            z->used = 0;
+            return z;
+        }
+        delete z;
+    }
+    inflater *z = new inflater();
+    if(z->ok) return z;
+    delete z;
+    return 0;
+}
+
+/* static */ void inflater::put(inflater *z)
+{
+    inflater_list *spares = thread_spares(true);
+    if(spares->size()<INFLATE_SPARE_MAX){
+        spares->push_back(z);
+    } else {
+        delete z;
+    }
+}
+
+/* static */ void inflater::free_spares()
+{
+    inflater_list *spares = thread_spares(false);
+    if(spares==0) return;
+#ifdef HAVE_PTHREAD
+    pthread_setspecific(inflater_key,0);
+#else
+    the_spares = 0;
+#endif
+    free_inflaters(spares);
+}
+#endif
 
+/***
+ * Deduplication of bodies (-S http_dedup=N).
+ *
+ * Each body is hashed as it is written. When it is done, a body with the
+ * same SHA1 and size as one of the last N stored is replaced by a hard
+ * link to the first copy, and its <fileobject> names that copy in a
+ * <duplicate_of>. If the link can't be made the body is kept as written.
+ */
+class body_index {
+    struct stored {
+        stored():path(),size(0){}
+        std::string path;
+        uint64_t    size;
+    };
+    typedef std::map<std::string,stored> stored_map; // by raw digest
+    stored_map  bodies;
+    std::deque<std::string> age;        // digests in bodies, oldest first
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock;
+#endif
+public:
+    body_index():bodies(),age()
+#ifdef HAVE_PTHREAD
+                ,lock()
+#endif
+    {
+#ifdef HAVE_PTHREAD
+        pthread_mutex_init(&lock,0);
+#endif
+    }
+    /* Returns the path of the first body like this one, or adds this one and returns "" */
+    std::string find_or_add(const sha1_t &digest,uint64_t size,const std::string &path){
+        std::string key(reinterpret_cast<const char *>(digest.digest),sha1_t::size());
+#ifdef HAVE_PTHREAD
+        demux_lock l(&lock);
+#endif
+        stored_map::const_iterator it = bodies.find(key);
+        if(it!=bodies.end()){
+            if(it->second.size==size) return it->second.path;
+            return std::string();       // a collision; keep both
+        }
+        while(age.size()>=http_dedup){
+            bodies.erase(age.front());
+            age.pop_front();
+        }
+        stored &s = bodies[key];
+        s.path = path;
+        s.size = size;
+        age.push_back(key);
+        return std::string();
+    }
+};
+static body_index stored_bodies;
+
+/* A header value where it lies in the buffer being parsed. It is copied
+ * only if it arrives in pieces, or the buffer is about to go away.
+ */
+class header_view {
+    const char  *at;
+    size_t      len;
+    std::string copy;                   // keeps its capacity from message to message
+    bool        copied;
+public:
+    header_view():at(0),len(0),copy(),copied(false){}
+    void clear(){ at = 0; len = 0; copied = false; }
+    void set(const char *at_,size_t len_){ at = at_; len = len_; copied = false; }
+    void append(const char *at_,size_t len_){
+        if(!copied) detach();
+        copy.append(at_,len_);
+    }
+    void detach(){
+        if(copied) return;
+        copy.assign(at ? at : "",len);
+        copied = true;
+    }
+    const char *data() const { return copied ? copy.data() : at; }
+    size_t size() const { return copied ? copy.size() : len; }
+    bool equals(const char *str) const { return size()==strlen(str) && memcmp(data(),str,size())==0; }
+};
 
 /* define a callback object for sharing state between scan_http() and its callbacks
  */
 class scan_http_cbo {
 private:
     typedef enum {NOTHING,FIELD,VALUE} last_on_header_t;
+
+    /* The headers we act on; the others are skipped unless http_headers is set */
+    typedef enum {CONTENT_TYPE,CONTENT_ENCODING,CONTENT_LENGTH,TRANSFER_ENCODING,KNOWN_HEADERS,UNKNOWN=KNOWN_HEADERS} header_t;
+    enum { MAX_KNOWN_FIELD = 17 };      // strlen("transfer-encoding")
+    static header_t known_header(const char *name,size_t len);
     scan_http_cbo(const scan_http_cbo& c); // not implemented
     scan_http_cbo &operator=(const scan_http_cbo &c); // not implemented
 
 public:
     virtual ~scan_http_cbo(){
         on_message_complete();          // make sure message was ended
+        if(src_fd>=0) ::close(src_fd);
+        delete body_hash;
+    }
+    scan_http_cbo(const std::string& path_,const char *base_,std::stringstream *xmlstream_,bool streaming_=false) :
+        path(path_), base(base_),base_offset(0),streaming(streaming_),
+        source_offset(0),source_size(0),src_fd(-2),xmlstream(xmlstream_),xml_fo(),request_no(0),
+        known(), current(UNKNOWN), field(), field_len(0),
+        all_headers(), all_count(0), last_on_header(NOTHING),
+        output_path(), fd(-1), first_body(true),bytes_written(0),body_hash(0),unzip(false),z(0),zfail(false){};
+    /* In streaming mode each piece of the flow is parsed where it lies in memory */
+    void set_base(const char *base_,uint64_t base_offset_){
+        base = base_;
+        base_offset = base_offset_;
+    }
+    /* In post-processing base is at source_offset in the flow file, which
+     * is source_size bytes long. Bodies that are not decompressed are then
+     * copied from it with copy_file_range() where we can.
+     */
+    void set_source(uint64_t source_offset_,uint64_t source_size_){
+        source_offset = source_offset_;
+        source_size = source_size_;
+        if(src_fd==-2) src_fd = -1;
+    }
+    /* The buffer given to the parser is going away; keep the header values seen so far */
+    void detach(){
+        if(last_on_header==NOTHING) return; // not in the headers
+        for(int i=0;i<KNOWN_HEADERS;i++) known[i].detach();
     }
-    scan_http_cbo(const std::string& path_,const char *base_,std::stringstream *xmlstream_) :
-        path(path_), base(base_),xmlstream(xmlstream_),xml_fo(),request_no(0),
-        headers(), last_on_header(NOTHING), header_value(), header_field(),
-        output_path(), fd(-1), first_body(true),bytes_written(0),unzip(false),zs(),zinit(false),zfail(false){};
 private:        
         
     const std::string path;             // where data gets written
     const char *base;                   // where data started in memory
+    uint64_t base_offset;               // where base is in the flow
+    bool streaming;                     // called from the packet path, not post-processing
+    uint64_t source_offset;             // see set_source()
+    uint64_t source_size;
+    int src_fd;                         // path opened for copying; -1 until needed, -2 if not to be used
     std::stringstream *xmlstream;       // if present, where to put the fileobject annotations
     std::stringstream xml_fo;           // xml stream for this file object
     int request_no;                     // request number
         
     /* parsed headers */
-    std::map<std::string, std::string> headers;
-        
-    /* placeholders for possibly-incomplete header data */
+    header_view known[KNOWN_HEADERS];
+    header_t    current;                // the header on_header_value() is called for
+    char        field[MAX_KNOWN_FIELD]; // its name, lowercased, while it could be a known one
+    size_t      field_len;              // MAX_KNOWN_FIELD+1 once it can't be
+
+    /* every header, for the DFXML, with http_headers; the entries are reused */
+    std::vector<std::pair<std::string,std::string> > all_headers;
+    size_t      all_count;
+
     last_on_header_t last_on_header;
-    std::string header_value, header_field;
     std::string output_path;
     int         fd;                         // fd for writing
     bool        first_body;                 // first call to on_body after headers
     uint64_t    bytes_written;
+    sha1_generator *body_hash;            // of what has been written, with http_dedup
 
     /* decompression for gzip-encoded streams. */
     bool     unzip;           // should we be decompressing?
-    z_stream zs;              // zstream (avoids casting and memory allocation)
-    bool     zinit;           // we have initialized the zstream 
+    class inflater *z;        // taken from this thread's spares for the body
     bool     zfail;           // zstream failed in some manner, so ignore the rest of this stream
 
     /* The static functions are callbacks; they wrap the method calls */
@@ -100,7 +357,10 @@ public:
     static int scan_http_cb_on_header_field(http_parser * parser, const char *at, size_t length) { return CBO->on_header_field(at,length);}
     static int scan_http_cb_on_header_value(http_parser * parser, const char *at, size_t length) { return CBO->on_header_value(at,length); }
     static int scan_http_cb_on_headers_complete(http_parser * parser) { return CBO->on_headers_complete();}
-    static int scan_http_cb_on_body(http_parser * parser, const char *at, size_t length) { return CBO->on_body(at,length);}
+    /* The parser counts content_length down before it calls on_body; at 0 this is the end of the body */
+    static int scan_http_cb_on_body(http_parser * parser, const char *at, size_t length) {
+        return CBO->on_body(at,length,(parser->flags & F_CHUNKED)==0 && parser->content_length==0);
+    }
     static int scan_http_cb_on_message_complete(http_parser * parser) {return CBO->on_message_complete();}
 #undef CBO
 private:
@@ -109,8 +369,14 @@ private:
     int on_header_field(const char *at, size_t length);
     int on_header_value(const char *at, size_t length);
     int on_headers_complete();
-    int on_body(const char *at, size_t length);
+    int on_body(const char *at, size_t length, bool last);
     int on_message_complete();          
+    int write_inflated();
+    void dedup();
+    size_t copy_body(const char *at, size_t length);
+#ifdef USE_LIBDEFLATE
+    bool inflate_whole(const char *at, size_t length);
+#endif
 };
     
 
@@ -140,28 +406,51 @@ int scan_http_cbo::on_url(const char *at, size_t length)
  *         This is consistent with the RFC.
  */
 
+/* The known names have different lengths, and different lengths modulo 8,
+ * so the length alone picks the only name a field can be.
+ */
+scan_http_cbo::header_t scan_http_cbo::known_header(const char *name,size_t len)
+{
+    static const char *names[8] = {
+        "content-encoding",             // 16
+        "transfer-encoding",            // 17
+        0, 0,
+        "content-type",                 // 12
+        0,
+        "content-length",               // 14
+        0
+    };
+    static const header_t headers[8] = {
+        CONTENT_ENCODING, TRANSFER_ENCODING, UNKNOWN, UNKNOWN,
+        CONTENT_TYPE, UNKNOWN, CONTENT_LENGTH, UNKNOWN
+    };
+    const char *candidate = names[len & 7];
+    if(candidate && strlen(candidate)==len && memcmp(candidate,name,len)==0) return headers[len & 7];
+    return UNKNOWN;
+}
+
 int scan_http_cbo::on_header_field(const char *at,size_t length)
 {
-    std::string field(at,length);
-    std::transform(field.begin(), field.end(), field.begin(), ::tolower);
-    
-    switch(last_on_header){
-    case NOTHING:                       
-        // Allocate new buffer and copy callback data into it
-        header_field = field;
-        break;
-    case VALUE:
-        // New header started.
-        // Copy current name,value buffers to headers
-        // list and allocate new buffer for new name
-        headers[header_field] = header_value;
-        header_field = field;
-        break;
-    case FIELD:
-        // Previous name continues. Reallocate name
-        // buffer and append callback data to it
-        header_field.append(field);
-        break;
+    if(last_on_header!=FIELD){          // a new header starts
+        field_len = 0;
+        if(http_headers_xml){
+            if(all_count==all_headers.size()) all_headers.resize(all_count+1);
+            all_headers[all_count].first.clear();
+            all_headers[all_count].second.clear();
+            all_count++;
+        }
+    }
+    /* The field may arrive in pieces; collect as much of it as could be a known name */
+    for(size_t i=0;i<length && field_len<=MAX_KNOWN_FIELD;i++){
+        if(field_len==MAX_KNOWN_FIELD){
+            field_len++;                // too long
+            break;
+        }
+        field[field_len++] = ::tolower(at[i]);
+    }
+    if(http_headers_xml){
+        std::string &name = all_headers[all_count-1].first;
+        for(size_t i=0;i<length;i++) name.push_back(::tolower(at[i]));
     }
     last_on_header = FIELD;
     return 0;
@@ -169,22 +458,22 @@ int scan_http_cbo::on_header_field(const char *at,size_t length)
 
 int scan_http_cbo::on_header_value(const char *at, size_t length)
 {
-    const std::string value(at,length);
     switch(last_on_header){
     case FIELD:
-        //Value for current header started. Allocate
-        //new buffer and copy callback data to it
-        header_value = value;
+        // Value for current header started.
+        current = field_len<=MAX_KNOWN_FIELD ? known_header(field,field_len) : UNKNOWN;
+        if(current!=UNKNOWN) known[current].set(at,length); // a repeated header replaces the earlier one
+        if(http_headers_xml) all_headers[all_count-1].second.assign(at,length);
         break;
     case VALUE:
-        //Value continues. Reallocate value buffer
-        //and append callback data to it
-        header_value.append(value);
+        // Value continues.
+        if(current!=UNKNOWN) known[current].append(at,length);
+        if(http_headers_xml) all_headers[all_count-1].second.append(at,length);
         break;
     case NOTHING:
         // this shouldn't happen
         DEBUG(10)("Internal error in http-parser");
-        break;
+        return 0;
     }
     last_on_header = VALUE;
 
@@ -200,12 +489,7 @@ int scan_http_cbo::on_header_value(const char *at, size_t length)
 int scan_http_cbo::on_headers_complete()
 {
     tcpdemux *demux = tcpdemux::getInstance();
-
-    /* Add the most recently read header to the map, if any */
-    if (last_on_header==VALUE) {
-        headers[header_field] = header_value;
-        header_field="";
-    }
+    last_on_header = NOTHING;
         
     /* Set output path to <path>-HTTPBODY-nnn.ext for each part.
      * This is not consistent with tcpflow <= 1.3.0, which supported only one HTTPBODY,
@@ -216,17 +500,18 @@ int scan_http_cbo::on_headers_complete()
     os << path << "-HTTPBODY-" << std::setw(3) << std::setfill('0') << request_no << std::setw(0);
 
     /* See if we can guess a file extension */
-    std::string extension = get_extension_for_mime_type(headers["content-type"]);
-    if (extension.size()) {
+    const header_view &content_type = known[CONTENT_TYPE];
+    const char *extension = get_extension_for_mime_type(content_type.data(),content_type.size());
+    if (extension[0]) {
         os << "." << extension;
     }
         
     output_path = os.str();
         
     /* Choose an output function based on the content encoding */
-    std::string content_encoding(headers["content-encoding"]);
+    const header_view &content_encoding = known[CONTENT_ENCODING];
 
-    if ((content_encoding == "gzip" || content_encoding == "deflate") && (demux->opt.gzip_decompress)){
+    if ((content_encoding.equals("gzip") || content_encoding.equals("deflate")) && (demux->opt.gzip_decompress)){
 #ifdef HAVE_LIBZ
         DEBUG(10) ( "%s: detected zlib content, decompressing", output_path.c_str());
         unzip = true;
@@ -237,8 +522,16 @@ int scan_http_cbo::on_headers_complete()
 #endif
     } 
         
-    /* Open the output path */
-    fd = demux->retrying_open(output_path.c_str(), O_WRONLY|O_CREAT|O_BINARY|O_TRUNC, 0644);
+    /* Open the output path.
+     * From the packet path retrying_open() could choose to close the flow
+     * we are being called for; if this open fails the stream stops, and
+     * the flow is carved in post-processing.
+     */
+    if(streaming){
+        fd = ::open(output_path.c_str(), O_WRONLY|O_CREAT|O_BINARY|O_TRUNC, 0644);
+    } else {
+        fd = demux->retrying_open(output_path.c_str(), O_WRONLY|O_CREAT|O_BINARY|O_TRUNC, 0644);
+    }
     if (fd < 0) {
         DEBUG(1) ("unable to open HTTP body file %s", output_path.c_str());
     }
@@ -264,18 +557,25 @@ int scan_http_cbo::on_headers_complete()
 }
 
 /* Write to fd, optionally decompressing as we go */
-int scan_http_cbo::on_body(const char *at,size_t length)
+int scan_http_cbo::on_body(const char *at,size_t length,bool last)
 {
     if (fd < 0)    return -1;              // no open fd? (internal error)x
     if (length==0) return 0;               // nothing to write
 
     if(first_body){                      // stuff for first time on_body is called
-        xml_fo << "     <byte_run file_offset='" << (at-base) << "'><fileobject><filename>" << output_path << "</filename>";
+        xml_fo << "     <byte_run file_offset='" << (base_offset+(at-base)) << "'><fileobject><filename>" << output_path << "</filename>";
         first_body = false;
+        if(http_dedup) body_hash = new sha1_generator();
     }
 
     /* If not decompressing, just write the data and return. */
     if(unzip==false){
+        if(body_hash) body_hash->update(reinterpret_cast<const uint8_t *>(at),length);
+        size_t copied = copy_body(at,length);
+        bytes_written += copied;
+        if(copied==length) return 0;
+        at += copied;
+        length -= copied;
         int rv = write(fd,at,length);
         if(rv<0) return -1;             // write error; that's bad
         bytes_written += rv;
@@ -284,42 +584,39 @@ int scan_http_cbo::on_body(const char *at,size_t length)
 
 #ifndef HAVE_LIBZ
     assert(0);                          // shoudln't have gotten here
-#endif    
+#else
     if(zfail) return 0;                 // stream was corrupt; ignore rest
-    /* set up this round of decompression, using a small local buffer */
 
-    /* Call init if we are not initialized */
-    char decompressed[65536];           // where decompressed data goes
-    if (!zinit) {
-        memset(&zs,0,sizeof(zs));
-        zs.next_in = (Bytef*)at;
-        zs.avail_in = length;
-        zs.next_out = (Bytef*)decompressed;
-        zs.avail_out = sizeof(decompressed);
-        
-        int rv = inflateInit2(&zs, 32 + MAX_WBITS);      /* 32 auto-detects gzip or deflate */
-        if (rv != Z_OK) {
+    /* Take an inflate context if we do not have one */
+    if (z==0) {
+        z = inflater::get();
+        if (z==0) {
             /* fail! */
-            DEBUG(3) ("decompression failed at stream initialization; rv=%d bad Content-Encoding?",rv);
+            DEBUG(3) ("decompression failed at stream initialization; bad Content-Encoding?");
             zfail = true;
             return 0;
         }
-        zinit = true;                   // successfully initted
-    } else {
-        zs.next_in = (Bytef*)at;
-        zs.avail_in = length;
-        zs.next_out = (Bytef*)decompressed;
-        zs.avail_out = sizeof(decompressed);
     }
-        
-    /* iteratively decompress, writing each time */
-    while (zs.avail_in > 0) {
+#ifdef USE_LIBDEFLATE
+    /* Nothing has gone in yet and this is the end: the whole body is here */
+    if (last && z->zs.total_in==0 && inflate_whole(at,length)) return 0;
+#endif
+
+    /* iteratively decompress into the window, writing it each time it fills */
+    z->zs.next_in = (Bytef*)at;
+    z->zs.avail_in = length;
+    while (z->zs.avail_in > 0) {
+        if (z->used == z->window.size() && write_inflated()!=0) return 0;
+        z->zs.next_out = (Bytef*)&z->window[z->used];
+        z->zs.avail_out = z->window.size() - z->used;
+
         /* decompress as much as possible */
-        int rv = inflate(&zs, Z_SYNC_FLUSH);
+        int rv = inflate(&z->zs, Z_SYNC_FLUSH);
+        z->used = z->window.size() - z->zs.avail_out;
                 
         if (rv == Z_STREAM_END) {
             /* are we done with the stream? */
-            if (zs.avail_in > 0) {
+            if (z->zs.avail_in > 0) {
                 /* ...no. */
                 DEBUG(3) ("decompression completed, but with trailing garbage");
                 return 0;
@@ -330,27 +627,125 @@ int scan_http_cbo::on_body(const char *at,size_t length)
             zfail = true;               // ignore the rest of this stream
             return 0;
         }
-                
-        /* successful decompression, at least partly */
-        /* write the result */
-        int bytes_decompressed = sizeof(decompressed) - zs.avail_out;
-        ssize_t written = write(fd, decompressed, bytes_decompressed);
-
-        if (written < bytes_decompressed) {
-            DEBUG(3) ("writing decompressed data failed");
-            zfail= true;
+    }
+#endif
+    return 0;
+}
+
+#ifdef USE_LIBDEFLATE
+/* The whole body is in memory: decompress it in one call if it fits the
+ * window. Returns false to have zlib do it.
+ */
+bool scan_http_cbo::inflate_whole(const char *at,size_t length)
+{
+    if (z->ld==0) z->ld = libdeflate_alloc_decompressor();
+    if (z->ld==0) return false;
+
+    size_t in_used = 0;
+    size_t out_used = 0;
+    enum libdeflate_result rv;
+    if (length>=2 && (uint8_t)at[0]==0x1f && (uint8_t)at[1]==0x8b) {
+        rv = libdeflate_gzip_decompress_ex(z->ld, at, length, &z->window[0], z->window.size(), &in_used, &out_used);
+    } else {
+        rv = libdeflate_zlib_decompress_ex(z->ld, at, length, &z->window[0], z->window.size(), &in_used, &out_used);
+    }
+    if (rv != LIBDEFLATE_SUCCESS) return false;
+    if (in_used < length) {
+        DEBUG(3) ("decompression completed, but with trailing garbage");
+    }
+    z->used = out_used;
+    return true;
+}
+#endif
+
+/* Have the kernel copy the body from the flow file, which can share the
+ * extents on filesystems that support it. Returns how much was copied;
+ * the caller writes the rest.
+ */
+size_t scan_http_cbo::copy_body(const char *at,size_t length)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+    if(src_fd==-2) return 0;
+    if(src_fd<0){
+        src_fd = ::open(path.c_str(),O_RDONLY|O_BINARY);
+        struct stat st;
+        if(src_fd>=0 && (fstat(src_fd,&st)!=0 || (uint64_t)st.st_size!=source_size)){
+            ::close(src_fd);            // not the file we were given
+            src_fd = -1;
+        }
+        if(src_fd<0){
+            src_fd = -2;
             return 0;
         }
-        bytes_written += written;
-                
-        /* reset the buffer for the next iteration */
-        zs.next_out = (Bytef*)decompressed;
-        zs.avail_out = sizeof(decompressed);
     }
+    loff_t in = source_offset + (at-base);
+    size_t copied = 0;
+    while(copied<length){
+        ssize_t n = copy_file_range(src_fd,&in,fd,0,length-copied,0);
+        if(n<=0){
+            if(n<0 && copied==0 && (errno==EXDEV || errno==ENOSYS || errno==EINVAL || errno==EOPNOTSUPP)){
+                DEBUG(10)("copy_file_range: %s; writing HTTP bodies",strerror(errno));
+                ::close(src_fd);
+                src_fd = -2;            // not here; don't try again
+            }
+            break;
+        }
+        copied += n;
+    }
+    return copied;
+#else
+    return 0;
+#endif
+}
+
+/* Write the window out */
+int scan_http_cbo::write_inflated()
+{
+#ifdef HAVE_LIBZ
+    if (z->used==0) return 0;
+    size_t bytes_decompressed = z->used;
+    z->used = 0;
+    if(body_hash) body_hash->update(reinterpret_cast<const uint8_t *>(&z->window[0]),bytes_decompressed);
+    ssize_t written = write(fd, &z->window[0], bytes_decompressed);
+    if (written < (ssize_t)bytes_decompressed) {
+        DEBUG(3) ("writing decompressed data failed");
+        zfail= true;
+        return -1;
+    }
+    bytes_written += written;
+#endif
     return 0;
 }
 
 
+/* The body file is complete; if we have it already, link to that copy instead */
+void scan_http_cbo::dedup()
+{
+    sha1_t digest = body_hash->final();
+    std::string first = stored_bodies.find_or_add(digest,bytes_written,output_path);
+    if(xmlstream) xml_fo << "<hashdigest type='sha1'>" << digest.hexdigest() << "</hashdigest>";
+    if(first.size()==0 || first==output_path) return; // new, or carved again (streaming fell back)
+
+    /* Replace the file in one step, so that it is never missing */
+    std::string tmp = output_path + ".dedup";
+    if(::link(first.c_str(),tmp.c_str())!=0){
+        DEBUG(5)("%s: cannot link to %s: %s",output_path.c_str(),first.c_str(),strerror(errno));
+        return;
+    }
+    struct stat st;
+    if(::stat(tmp.c_str(),&st)!=0 || (uint64_t)st.st_size!=bytes_written){
+        ::unlink(tmp.c_str());          // the first copy has been rewritten since
+        return;
+    }
+    if(::rename(tmp.c_str(),output_path.c_str())!=0){
+        DEBUG(5)("%s: cannot replace with a link: %s",output_path.c_str(),strerror(errno));
+        ::unlink(tmp.c_str());
+        return;
+    }
+    ::unlink(tmp.c_str());              // rename() leaves it if the two were linked already
+    if(xmlstream) xml_fo << "<duplicate_of>" << dfxml_writer::xmlescape(first) << "</duplicate_of>";
+}
+
 /**
  * called at the conclusion of each HTTP body.
  * Clean out all of the state for this HTTP header/body pair.
@@ -359,11 +754,10 @@ int scan_http_cbo::on_body(const char *at,size_t length)
 int scan_http_cbo::on_message_complete()
 {
     /* Close the file */
-    headers.clear();
-    header_field = "";
-    header_value = "";
+    for(int i=0;i<KNOWN_HEADERS;i++) known[i].clear();
     last_on_header = NOTHING;
     if(fd >= 0) {
+        if (z) write_inflated();        // what is left in the window
         if (::close(fd) != 0) {
             perror("close() of http body");
         }
@@ -371,10 +765,19 @@ int scan_http_cbo::on_message_complete()
     }
 
     /* Erase zero-length files and update the DFXML */
+    size_t header_count = all_count;
+    all_count = 0;
     if(bytes_written>0){
+        if(body_hash) dedup();
+
         /* Update DFXML */
         if(xmlstream){
-            xml_fo << "<filesize>" << bytes_written << "</filesize></fileobject></byte_run>\n";
+            xml_fo << "<filesize>" << bytes_written << "</filesize>";
+            for(size_t i=0;i<header_count;i++){
+                xml_fo << "<http_header name='" << dfxml_writer::xmlescape(all_headers[i].first) << "'>"
+                       << dfxml_writer::xmlescape(all_headers[i].second) << "</http_header>";
+            }
+            xml_fo << "</fileobject></byte_run>\n";
             if(xmlstream) *xmlstream << xml_fo.str();
         }
         if(http_alert_fd>=0){
@@ -389,6 +792,9 @@ int scan_http_cbo::on_message_complete()
             /* If we are at maximum number of subprocesses, wait for one to exit */
             std::string cmd = http_cmd + " " + output_path;
 #ifdef HAVE_FORK
+#ifdef HAVE_PTHREAD
+            demux_lock lock(&http_subproc_lock);
+#endif
             int status=0;
             pid_t pid = 0;
             while(http_subproc >= http_subproc_max){
@@ -418,16 +824,148 @@ int scan_http_cbo::on_message_complete()
     xml_fo.str("");
     output_path = "";
     bytes_written=0;
+    delete body_hash;
+    body_hash = 0;
     unzip = false;
-    if(zinit){
-        inflateEnd(&zs);
-        zinit = false;
+#ifdef HAVE_LIBZ
+    if(z){
+        inflater::put(z);
+        z = 0;
     }
+#endif
     zfail = false;
     return 0;
 }
 
 
+static void init_parser_settings(http_parser_settings &settings)
+{
+    memset(&settings,0,sizeof(settings)); // in the event that new callbacks get created
+    settings.on_message_begin          = scan_http_cbo::scan_http_cb_on_message_begin;
+    settings.on_url                    = scan_http_cbo::scan_http_cb_on_url;
+    settings.on_header_field           = scan_http_cbo::scan_http_cb_on_header_field;
+    settings.on_header_value           = scan_http_cbo::scan_http_cb_on_header_value;
+    settings.on_headers_complete       = scan_http_cbo::scan_http_cb_on_headers_complete;
+    settings.on_body                   = scan_http_cbo::scan_http_cb_on_body;
+    settings.on_message_complete       = scan_http_cbo::scan_http_cb_on_message_complete;
+}
+
+
+/***
+ * Streaming mode; see scan_http.h
+ */
+
+/* The <byte_runs> of the streams that got to the end, by flow file,
+ * until scan_http is called for the flow. Streams finish on the shards;
+ * the scan may be on a post-processing worker.
+ */
+static std::map<std::string,std::string> streamed_byte_runs;
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t streamed_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static http_parser_settings stream_parser_settings; // set up in PHASE_STARTUP
+
+bool http_stream::enabled()
+{
+    if(!http_stream_mode) return false;
+    std::vector<std::string> scanners;
+    be13::plugin::get_enabled_scanners(scanners);
+    return std::find(scanners.begin(),scanners.end(),"http")!=scanners.end();
+}
+
+http_stream *http_stream::open(const std::string &path)
+{
+    return new http_stream(path);
+}
+
+http_stream::http_stream(const std::string &path_):
+    path(path_),prefix(),fed(0),parser(new http_parser()),cbo(0),xml(),state(PREFIX)
+{
+    http_parser_init(parser, HTTP_RESPONSE);
+}
+
+http_stream::~http_stream()
+{
+    delete cbo;
+    delete parser;
+}
+
+bool http_stream::take(const std::string &path,std::string &byte_runs)
+{
+#ifdef HAVE_PTHREAD
+    demux_lock lock(&streamed_lock);
+#endif
+    std::map<std::string,std::string>::iterator it = streamed_byte_runs.find(path);
+    if(it==streamed_byte_runs.end()) return false;
+    byte_runs.swap(it->second);
+    streamed_byte_runs.erase(it);
+    return true;
+}
+
+void http_stream::parse(const char *data,size_t length)
+{
+    cbo->set_base(data,fed);
+    size_t parsed = http_parser_execute(parser,&stream_parser_settings,data,length);
+    cbo->detach();                      // the header values may be in data
+    fed += length;
+    if(parsed == length) return;
+    if(parser->upgrade){
+        DEBUG(9) ("upgrade connection detected (WebSockets?); cowardly refusing to dump further");
+        state = DONE;
+        return;
+    }
+    state = FAILED;                     // let post-processing see what it makes of it
+}
+
+void http_stream::write(const uint8_t *data,size_t length)
+{
+    if(state==PARSING){
+        parse(reinterpret_cast<const char *>(data),length);
+        return;
+    }
+    if(state!=PREFIX) return;
+
+    /* Decide as scan_http does, on the first MIN_HTTP_BUFSIZE bytes */
+    size_t n = std::min(length,(size_t)MIN_HTTP_BUFSIZE-prefix.size());
+    prefix.append(reinterpret_cast<const char *>(data),n);
+    if(prefix.size()<MIN_HTTP_BUFSIZE) return;
+    if(prefix.compare(0,7,"HTTP/1.")!=0){
+        state = NOT_HTTP;
+        std::string().swap(prefix);
+        return;
+    }
+    state = PARSING;
+    cbo = new scan_http_cbo(path,prefix.data(),&xml,true);
+    parser->data = cbo;
+    parse(prefix.data(),prefix.size());
+    std::string().swap(prefix);
+    if(state==PARSING && n<length) parse(reinterpret_cast<const char *>(data)+n,length-n);
+}
+
+void http_stream::gap()
+{
+    if(state==PREFIX && prefix.size()==0) return; // nothing seen yet, so nothing lost
+    if(state==PREFIX || state==PARSING) state = FAILED;
+}
+
+void http_stream::finish(bool scan)
+{
+    if(state==PARSING){
+        http_parser_execute(parser,&stream_parser_settings,NULL,0); // EOF, as for a complete buffer
+        state = DONE;
+    }
+    delete cbo;                         // ends the last message, before post-processing may redo it
+    cbo = 0;
+    if(state==DONE && scan){
+#ifdef HAVE_PTHREAD
+        demux_lock lock(&streamed_lock);
+#endif
+        streamed_byte_runs[path] = "\n    <byte_runs>\n" + xml.str() + "    </byte_runs>";
+    }
+}
+
+
 /***
  * the HTTP scanner plugin itself
  */
@@ -446,23 +984,35 @@ void  scan_http(const class scanner_params &sp,const recursion_control_block &rc
         sp.info->flags = scanner_info::SCANNER_DISABLED; // default disabled
         sp.info->get_config(HTTP_CMD,&http_cmd,"Command to execute on each HTTP attachment");
         sp.info->get_config(HTTP_ALERT_FD,&http_alert_fd,"File descriptor to send information about completed HTTP attachments");
+        sp.info->get_config(HTTP_STREAM,&http_stream_mode,"Carve HTTP bodies as each flow is written, not after it closes");
+        sp.info->get_config(HTTP_HEADERS,&http_headers_xml,"Record every response header in the DFXML");
+        sp.info->get_config(HTTP_INFLATE_WINDOW,&http_inflate_window,"Bytes of decompressed HTTP body to collect before each write");
+        sp.info->get_config(HTTP_DEDUP,&http_dedup,"Link HTTP bodies seen before to the first copy, remembering this many");
+        init_parser_settings(stream_parser_settings);
         return;         /* No feature files created */
     }
 
+    if(sp.phase==scanner_params::PHASE_SHUTDOWN){
+#ifdef HAVE_LIBZ
+        inflater::free_spares();        // the other threads' go when they exit
+#endif
+        return;
+    }
+
     if(sp.phase==scanner_params::PHASE_SCAN){
+        /* Streamed flows have been carved already */
+        std::string byte_runs;
+        if(http_stream_mode && http_stream::take(sp.sbuf.pos0.path,byte_runs)){
+            if(sp.sxml) (*sp.sxml) << byte_runs;
+            return;
+        }
+
         /* See if there is an HTTP response */
         if(sp.sbuf.bufsize>=MIN_HTTP_BUFSIZE && sp.sbuf.memcmp(reinterpret_cast<const uint8_t *>("HTTP/1."),0,7)==0){
             /* Smells enough like HTTP to try parsing */
             /* Set up callbacks */
             http_parser_settings scan_http_parser_settings;
-            memset(&scan_http_parser_settings,0,sizeof(scan_http_parser_settings)); // in the event that new callbacks get created
-            scan_http_parser_settings.on_message_begin          = scan_http_cbo::scan_http_cb_on_message_begin;
-            scan_http_parser_settings.on_url                    = scan_http_cbo::scan_http_cb_on_url;
-            scan_http_parser_settings.on_header_field           = scan_http_cbo::scan_http_cb_on_header_field;
-            scan_http_parser_settings.on_header_value           = scan_http_cbo::scan_http_cb_on_header_value;
-            scan_http_parser_settings.on_headers_complete       = scan_http_cbo::scan_http_cb_on_headers_complete;
-            scan_http_parser_settings.on_body                   = scan_http_cbo::scan_http_cb_on_body;
-            scan_http_parser_settings.on_message_complete       = scan_http_cbo::scan_http_cb_on_message_complete;
+            init_parser_settings(scan_http_parser_settings);
                         
             if(sp.sxml) (*sp.sxml) << "\n    <byte_runs>\n";
             for(size_t offset=0;;){
@@ -484,6 +1034,7 @@ void  scan_http(const class scanner_params &sp,const recursion_control_block &rc
                 http_parser_init(&parser, HTTP_RESPONSE);
 
                 scan_http_cbo cbo(sp.sbuf.pos0.path,base,sp.sxml);
+                if(sp.sbuf.pos0.offset==0) cbo.set_source(offset,sp.sbuf.bufsize); // sbuf is the flow file
                 parser.data = &cbo;
 
                 /* Parse */
@@ -0,0 +1,56 @@
+/*
+ * scan_http.h:
+ *
+ * The streaming mode of scan_http (-S http_stream=1).
+ *
+ * Normally scan_http runs when a flow is post-processed: it maps the
+ * closed flow file and parses the HTTP responses in it. In streaming mode
+ * each new flow gets an http_stream, and the tcpip hands it the flow's
+ * bytes in file order as they are written. Bodies are carved as they
+ * arrive, and a response's body file is complete as soon as the response
+ * is, not when the connection closes.
+ *
+ * The stream sees the flow exactly as the file has it, or not at all:
+ * when the data becomes discontiguous (a gap is left in the file, or data
+ * is inserted before the start) or the parser gives up, the stream stops
+ * and the flow is parsed from its file in post-processing as before. A
+ * stream that got to the end leaves its <byte_runs> for scan_http to add
+ * to the flow's <fileobject> in its turn, so report.xml does not depend
+ * on which way the flow was carved.
+ */
+
+#ifndef SCAN_HTTP_H
+#define SCAN_HTTP_H
+
+#include <string>
+#include <sstream>
+
+class http_stream {
+    /* These are not implemented */
+    http_stream(const http_stream &);
+    http_stream &operator=(const http_stream &);
+
+    typedef enum {PREFIX,PARSING,DONE,FAILED,NOT_HTTP} state_t;
+    const std::string path;             // the flow file
+    std::string prefix;                 // the start of the flow, until we know if it is HTTP
+    uint64_t    fed;                    // bytes given to the parser
+    struct http_parser *parser;
+    class scan_http_cbo *cbo;
+    std::stringstream xml;              // the cbo's <byte_run>s
+    state_t     state;
+
+    http_stream(const std::string &path);
+    void        parse(const char *data,size_t length);
+
+public:
+    static bool enabled();              // call after the scanners are enabled
+    static http_stream *open(const std::string &path);
+    static bool take(const std::string &path,std::string &byte_runs); // for scan_http's PHASE_SCAN
+    virtual ~http_stream();
+
+    void        write(const uint8_t *data,size_t length); // the next bytes of the file
+    void        gap();                  // the file is no longer what we were given
+    void        finish(bool scan);      // the flow is complete; scan if it will be post-processed
+};
+
+#endif
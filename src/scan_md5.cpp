@@ -3,9 +3,15 @@
  * scan_md5:
  * plug-in demonstration that shows how to write a simple plug-in scanner that calculates
  * the MD5 of each file..
+ * The digests are usually computed as the flow is written (see flow_hash.h);
+ * the file is only read back for the flows where that could not be done.
  */
 
 #include "config.h"
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "flow_hash.h"
 #include "bulk_extractor_i.h"
 #include "dfxml/src/hash_t.h"
 
@@ -26,15 +32,19 @@ void  scan_md5(const class scanner_params &sp,const recursion_control_block &rcb
     if(sp.phase==scanner_params::PHASE_STARTUP){
 	sp.info->name  = "md5";
 	sp.info->flags = scanner_info::SCANNER_DISABLED;
+        sp.info->get_config("flow_digests",&flow_hash::digest_names,"Digests to record for each flow (md5,sha1,sha256)");
         return;     /* No feature files created */
     }
 
 #ifdef HAVE_EVP_GET_DIGESTBYNAME
     if(sp.phase==scanner_params::PHASE_SCAN){
-	static const std::string hash0("<hashdigest type='MD5'>");
-	static const std::string hash1("</hashdigest>");
+        std::string hashdigests;
+        if(!flow_hash::take(sp.sbuf.pos0.path,hashdigests) && sp.sxml){
+            uint32_t wanted = tcpdemux::getInstance()->opt.flow_hashes;
+            hashdigests = flow_hash::hash_buf(wanted ? wanted : flow_hash::MD5,sp.sbuf.buf,sp.sbuf.bufsize);
+        }
 	if(sp.sxml){
-            (*sp.sxml) << hash0 << md5_generator::hash_buf(sp.sbuf.buf,sp.sbuf.bufsize).hexdigest() << hash1;
+            (*sp.sxml) << hashdigests;
         }
 	return;
     }
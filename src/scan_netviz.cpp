@@ -7,12 +7,21 @@
 
 #include "config.h"
 #include <iostream>
+#include <fstream>
 #include <sys/types.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include "bulk_extractor_i.h"
 
 #ifdef HAVE_LIBCAIRO
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
 #include "netviz/one_page_report.h"
+#include "netviz_worker.h"
+#include "netviz_snapshots.h"
 
 /* These control the size of the iptable histogram
  * and whether or not it is dumped. The histogram should be kept
@@ -22,18 +31,113 @@
 
 #define HISTOGRAM_SIZE "netviz_histogram_size"
 #define HISTOGRAM_DUMP "netviz_histogram_dump"
-#define DEFAULT_MAX_HISTOGRAM_SIZE 1000 
+#define DEFAULT_MAX_HISTOGRAM_SIZE 10000
+
+/* The port histograms count every port exactly unless this is set, in
+ * which case they count only this many ports each.
+ */
+#define PORT_COUNTERS "netviz_port_counters"
+
+/* Addresses are counted under their prefixes of these lengths, so that
+ * e.g. a /64 of IPv6 clients shows as one bar however often their privacy
+ * addresses change, and the tree is never made below them.
+ */
+#define IP4_PREFIX "netviz_ip4_prefix"
+#define IP6_PREFIX "netviz_ip6_prefix"
+
+/* If this is set, packets are summarized into a ring of this many and
+ * ingested on a thread of their own; see netviz_worker.h
+ */
+#define RING_SIZE "netviz_ring"
+
+/* If this is set, the report is rendered every this many seconds of
+ * packets, of the last NETVIZ_WINDOW seconds if that is set, or else of
+ * everything so far; see netviz_snapshots.h
+ */
+#define SNAPSHOT_INTERVAL "netviz_interval"
+#define SNAPSHOT_WINDOW "netviz_window"
+
+/* Reports of parts of a capture can be combined without the packets:
+ * with NETVIZ_SAVE, the report's counts are also written to report.netviz,
+ * and NETVIZ_MERGE is a comma-separated list of such files to add to the
+ * report before it is rendered (and saved). With no -r files, tcpflow
+ * captures nothing and only merges them.
+ */
+#define NETVIZ_SAVE "netviz_save"
+#define NETVIZ_MERGE "netviz_merge"    // tcpflow.cpp looks for it too
+
+/* If this is set, each panel of the page is drawn on a thread of its own;
+ * see one_page_report::render()
+ */
+#define PARALLEL_RENDER "netviz_parallel_render"
 
 static one_page_report *report=0;
+#ifdef HAVE_NETVIZ_WORKER
+static netviz_worker *worker=0;
+#endif
+#ifdef HAVE_NETVIZ_SNAPSHOTS
+static netviz_snapshots *snapshots=0;
+#endif
+
+static void netviz_ingest(const one_page_report::packet_summary &packet)
+{
+#ifdef HAVE_NETVIZ_SNAPSHOTS
+    if(snapshots){
+        snapshots->ingest(packet);
+        return;
+    }
+#endif
+    report->ingest(packet);
+}
+
 static void netviz_process_packet(void *user,const be13::packet_info &pi)
 {
-    report->ingest_packet(pi);
+#ifdef HAVE_PTHREAD
+    /* packets arrive on several threads when capturing with PACKET_FANOUT */
+    static pthread_mutex_t m = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&m);
+#ifdef HAVE_NETVIZ_WORKER
+    if(worker){
+        worker->put(pi);
+    } else {
+        netviz_ingest(one_page_report::packet_summary(pi));
+    }
+#else
+    netviz_ingest(one_page_report::packet_summary(pi));
+#endif
+    pthread_mutex_unlock(&m);
+#else
+    netviz_ingest(one_page_report::packet_summary(pi));
+#endif
 }
 
 #endif
 
 #ifdef HAVE_LIBCAIRO
 static int histogram_dump = 0;
+static int save_state = 0;
+static std::string merge_files;
+
+/* report.pdf's state is in report.netviz */
+static std::string state_fname(const std::string &outdir,const std::string &pdf)
+{
+    std::string name = pdf;
+    if(name.size()>4 && name.substr(name.size()-4)==".pdf") name.resize(name.size()-4);
+    return outdir + "/" + name + ".netviz";
+}
+
+static void merge_state(const std::string &fname)
+{
+    std::ifstream in(fname.c_str(),std::ios::binary);
+    if(!in.is_open()){
+        perror(fname.c_str());
+        exit(1);
+    }
+    if(!report->read_state(in)){
+        std::cerr << fname << ": not netviz state, or damaged\n";
+        exit(1);
+    }
+}
 #endif
 
 extern "C"
@@ -57,7 +161,34 @@ void  scan_netviz(const class scanner_params &sp,const recursion_control_block &
         sp.info->get_config(HISTOGRAM_DUMP,&histogram_dump,"Dumps the histogram");
         int max_histogram_size = DEFAULT_MAX_HISTOGRAM_SIZE;
         sp.info->get_config(HISTOGRAM_SIZE,&max_histogram_size,"Maximum histogram size");
-        report = new one_page_report(max_histogram_size);
+        int port_counters = 0;
+        sp.info->get_config(PORT_COUNTERS,&port_counters,"Ports counted for each port histogram (0 for all)");
+        int ip4_prefix = 32;
+        sp.info->get_config(IP4_PREFIX,&ip4_prefix,"Prefix length IPv4 addresses are counted under");
+        int ip6_prefix = 128;
+        sp.info->get_config(IP6_PREFIX,&ip6_prefix,"Prefix length IPv6 addresses are counted under");
+        report = new one_page_report(max_histogram_size,port_counters > 0 ? port_counters : 0);
+        report->ip4_prefix_bits = ip4_prefix < 0 ? 0 : (ip4_prefix > 32 ? 32 : ip4_prefix);
+        report->ip6_prefix_bits = ip6_prefix < 0 ? 0 : (ip6_prefix > 128 ? 128 : ip6_prefix);
+        int parallel_render = 0;
+        sp.info->get_config(PARALLEL_RENDER,&parallel_render,"Draw the netviz report's panels in parallel");
+        report->parallel_render = parallel_render != 0;
+        int ring_size = 0;
+        sp.info->get_config(RING_SIZE,&ring_size,"Packets queued for a netviz thread (0 to ingest them as they arrive)");
+        int snapshot_interval = 0;
+        sp.info->get_config(SNAPSHOT_INTERVAL,&snapshot_interval,"Seconds of packets between netviz reports (0 for one at the end)");
+        int snapshot_window = 0;
+        sp.info->get_config(SNAPSHOT_WINDOW,&snapshot_window,"Seconds of packets each netviz report shows (0 for all of them)");
+        sp.info->get_config(NETVIZ_SAVE,&save_state,"Also save the netviz report's counts, for netviz_merge");
+        sp.info->get_config(NETVIZ_MERGE,&merge_files,"Saved netviz counts to add to the report (comma-separated files)");
+#ifdef HAVE_NETVIZ_WORKER
+        worker = netviz_worker::open(netviz_ingest,ring_size > 0 ? ring_size : 0);
+#endif
+#ifdef HAVE_NETVIZ_SNAPSHOTS
+        snapshots = netviz_snapshots::open(*report,tcpdemux::getInstance()->outdir,
+                                           snapshot_interval > 0 ? snapshot_interval : 0,
+                                           snapshot_window > 0 ? snapshot_window : 0);
+#endif
 #else
         sp.info->description = "Disabled (compiled without libcairo";
 #endif
@@ -66,11 +197,48 @@ void  scan_netviz(const class scanner_params &sp,const recursion_control_block &
 
     if(sp.phase==scanner_params::PHASE_SHUTDOWN){
         assert(report!=0);
+#ifdef HAVE_NETVIZ_WORKER
+        uint64_t dropped = 0;
+        if(worker){
+            worker->stop();             // after it has ingested what it has
+            dropped = worker->dropped_packets();
+            delete worker;
+            worker = 0;
+        }
+#endif
+#ifdef HAVE_NETVIZ_SNAPSHOTS
+        delete snapshots;               // after it has merged what it has into report
+        snapshots = 0;
+#endif
+#ifdef HAVE_NETVIZ_WORKER
+        if(dropped){
+            report->packets_dropped += dropped;
+            std::cerr << "netviz: " << dropped << " packets dropped because the ring was full\n";
+        }
+#endif
+        std::string source = sp.fs.get_input_fname();
+        if(merge_files.size()){
+            for(size_t start=0;start<=merge_files.size();){
+                size_t comma = merge_files.find(',',start);
+                if(comma==std::string::npos) comma = merge_files.size();
+                if(comma>start) merge_state(merge_files.substr(start,comma-start));
+                start = comma+1;
+            }
+            /* with no packets of its own, the report is only of what it merged */
+            source = tcpdemux::getInstance()->packet_counter ? source + " + " + merge_files : merge_files;
+        }
+        if(save_state){
+            std::string fname = state_fname(sp.fs.get_outdir(),report->filename);
+            std::ofstream out(fname.c_str(),std::ios::binary);
+            report->write_state(out);   // before render(), which condenses the time histogram
+            out.close();
+            if(out.fail()) perror(fname.c_str());
+        }
         if(histogram_dump){
             report->src_tree.dump_stats(std::cout);
             report->dump(histogram_dump);
         }
-        report->source_identifier = sp.fs.get_input_fname();
+        report->source_identifier = source;
         report->render(sp.fs.get_outdir());
         delete report;
         report = 0;
@@ -0,0 +1,175 @@
+/*
+ * scan_pool.cpp:
+ *
+ * Post-processing scanners on worker threads; see scan_pool.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "scan_pool.h"
+#include "cpu_layout.h"
+#include "flow_gzip.h"
+#include "tcpflow_probes.h"
+
+#include <sstream>
+
+#ifdef HAVE_SCAN_POOL
+
+scan_pool::scan_pool(tcpdemux &demux_,uint32_t depth_,bool skip_when_full_):
+    demux(demux_),depth(depth_ ? depth_ : 1),skip_when_full(skip_when_full_),
+    order(),todo(),spare(),scanning(0),recording(false),stopping(false),scanned(0),skipped(0),
+    scan_usec(0),threads(),lock(),work(),room(),idle()
+{
+    pthread_mutex_init(&lock,0);
+    pthread_cond_init(&work,0);
+    pthread_cond_init(&room,0);
+    pthread_cond_init(&idle,0);
+}
+
+scan_pool *scan_pool::open(tcpdemux &demux,uint32_t workers,uint32_t depth,bool skip_when_full)
+{
+    scan_pool *p = new scan_pool(demux,depth,skip_when_full);
+    for(uint32_t i=0;i<workers;i++){
+        pthread_t t;
+        if(pthread_create(&t,0,run,p)!=0) break;
+        p->threads.push_back(t);
+    }
+    if(p->threads.size()==0){
+        DEBUG(2)("cannot start post-processing workers; scanning synchronously");
+        delete p;
+        return 0;
+    }
+    DEBUG(2)("%u post-processing workers, queue depth %u%s",(unsigned)p->threads.size(),p->depth,
+             skip_when_full ? " (skip when full)" : "");
+    return p;
+}
+
+scan_pool::~scan_pool()
+{
+    flush();
+    {
+        demux_lock l(&lock);
+        stopping = true;
+        pthread_cond_broadcast(&work);
+    }
+    for(std::vector<pthread_t>::const_iterator it=threads.begin();it!=threads.end();it++){
+        pthread_join(*it,0);
+    }
+    if(threads.size()) DEBUG(2)("post-processing: %" PRIu64 " flows scanned, %" PRIu64 " skipped",scanned,skipped);
+    demux.perf.count(perf_counters::FLOWS_SCANNED,scanned);
+    demux.perf.count(perf_counters::SCAN_USEC,scan_usec);
+    for(std::vector<job *>::const_iterator it=spare.begin();it!=spare.end();it++){
+        delete *it;
+    }
+    pthread_cond_destroy(&idle);
+    pthread_cond_destroy(&room);
+    pthread_cond_destroy(&work);
+    pthread_mutex_destroy(&lock);
+}
+
+void scan_pool::submit(const tcpip &tcp,bool want_scan)
+{
+    demux_lock l(&lock);
+    if(want_scan && scanning>=depth){
+        if(skip_when_full){
+            want_scan = false;
+            skipped++;
+        } else {
+            while(scanning>=depth) pthread_cond_wait(&room,&lock);
+        }
+    }
+    job *j = 0;
+    if(spare.size()){
+        j = spare.back();
+        spare.pop_back();
+    } else {
+        j = new job();
+    }
+    tcp.report(j->report,"");
+    j->scan = want_scan;
+    j->done = !want_scan;
+    order.push_back(j);
+    if(want_scan){
+        todo.push_back(j);
+        scanning++;
+        pthread_cond_signal(&work);
+    } else {
+        record_done();
+    }
+}
+
+void scan_pool::flush()
+{
+    demux_lock l(&lock);
+    while(order.size()) pthread_cond_wait(&idle,&lock);
+}
+
+/* Record the done jobs at the front of order, one thread at a time.
+ * The lock is dropped while each is recorded so the workers carry on;
+ * a job that finishes meanwhile is picked up by the same loop.
+ */
+void scan_pool::record_done()
+{
+    if(recording) return;
+    recording = true;
+    while(order.size() && order.front()->done){
+        job *j = order.front();
+        order.pop_front();
+        pthread_mutex_unlock(&lock);
+        demux.record_flow(j->report);
+        pthread_mutex_lock(&lock);
+        spare.push_back(j);
+    }
+    recording = false;
+    if(order.empty()) pthread_cond_broadcast(&idle);
+}
+
+void scan_pool::scan(job *j)
+{
+    std::stringstream xmladd;
+    sbuf_t *sbuf = flow_gzip::map_file(j->report.flow_pathname);
+    if(sbuf){
+        TCPFLOW_PROBE2(scan_start,j->report.myflow.id,sbuf->bufsize);
+        demux.scan_flow(*sbuf,xmladd);
+        TCPFLOW_PROBE2(scan_end,j->report.myflow.id,sbuf->bufsize);
+        delete sbuf;
+    }
+    j->report.xmladd = xmladd.str();
+}
+
+void *scan_pool::run(void *arg)
+{
+    reinterpret_cast<scan_pool *>(arg)->worker_loop();
+    return 0;
+}
+
+void scan_pool::worker_loop()
+{
+    tcpdemux::mark_scan_worker();
+    if(demux.cpus) demux.cpus->pin_worker();
+    pthread_mutex_lock(&lock);
+    while(true){
+        while(todo.empty() && !stopping) pthread_cond_wait(&work,&lock);
+        if(todo.empty()) break;         // stopping, and nothing left to do
+        job *j = todo.front();
+        todo.pop_front();
+        pthread_mutex_unlock(&lock);
+        uint64_t start = perf_counters::now_usec();
+        scan(j);
+        uint64_t took = perf_counters::now_usec() - start;
+        pthread_mutex_lock(&lock);
+        j->done = true;
+        scanning--;
+        scanned++;
+        scan_usec += took;
+        pthread_cond_signal(&room);
+        record_done();
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+#endif
@@ -0,0 +1,80 @@
+/*
+ * scan_pool.h:
+ *
+ * Worker threads that run the post-processing scanners (-a, -e) on
+ * closed flows, so a large flow does not hold up the packet path.
+ *
+ * post_process() finishes writing the flow file, closes it and submits
+ * the flow's flow_report. A worker maps the file, runs the scanners on it
+ * and fills in the report's xmladd. Flows are recorded (report.xml, flow
+ * database) in the order they were submitted: a flow whose scan finishes
+ * early waits for the flows submitted before it. Flows that need no
+ * scanning go through the same queue so that order holds for them too.
+ *
+ * At most depth flows wait for or are in a scan. When that many are, a
+ * flow that needs scanning either waits for room or, with skip_when_full,
+ * is recorded without being scanned.
+ *
+ * #include this file after tcpdemux.h
+ */
+
+#ifndef SCAN_POOL_H
+#define SCAN_POOL_H
+
+#ifdef HAVE_PTHREAD
+#define HAVE_SCAN_POOL
+
+#include <deque>
+
+class scan_pool {
+    /* These are not implemented */
+    scan_pool(const scan_pool &);
+    scan_pool &operator=(const scan_pool &);
+
+    class job {
+    public:
+        job():report(),scan(false),done(false){}
+        flow_report report;
+        bool        scan;               // run the scanners on report.flow_pathname
+        bool        done;               // ready to be recorded
+    };
+
+    tcpdemux   &demux;                  // the master; its record_flow() gets the results
+    uint32_t    depth;
+    bool        skip_when_full;
+    std::deque<job *> order;            // submitted and not yet recorded, in submission order
+    std::deque<job *> todo;             // waiting for a worker
+    std::vector<job *> spare;           // recorded jobs, for reuse
+    uint32_t    scanning;               // jobs in todo or being scanned
+    bool        recording;              // a thread is recording the done jobs at the front of order
+    bool        stopping;
+    uint64_t    scanned;
+    uint64_t    skipped;
+    uint64_t    scan_usec;              // in the scanners, over all the workers
+    std::vector<pthread_t> threads;
+    pthread_mutex_t lock;               // protects everything above
+    pthread_cond_t  work;               // signaled when a job is queued or we are stopping
+    pthread_cond_t  room;               // signaled when a scan finishes
+    pthread_cond_t  idle;               // signaled when order empties
+
+    scan_pool(tcpdemux &demux,uint32_t depth,bool skip_when_full);
+    static void *run(void *arg);
+    void        worker_loop();
+    void        scan(job *j);
+    void        record_done();          // call with lock held
+
+public:
+    /** Returns 0 if no worker can be started; scan synchronously then. */
+    static scan_pool *open(tcpdemux &demux,uint32_t workers,uint32_t depth,bool skip_when_full);
+    virtual ~scan_pool();               // records every submitted flow, then stops the workers
+
+    void        submit(const tcpip &tcp,bool scan); // tcp's file must be complete and closed
+    void        flush();                // wait until every submitted flow is recorded
+
+    /* For the stats server, without the lock; a moment out of date */
+    uint32_t    queued() const { return __atomic_load_n(&scanning,__ATOMIC_RELAXED); }
+    uint64_t    completed() const { return __atomic_load_n(&scanned,__ATOMIC_RELAXED); }
+};
+
+#endif
+#endif
@@ -44,6 +44,78 @@ void  scan_tcpdemux(const class scanner_params &sp,const recursion_control_block
 	sp.info->packet_cb = packet_handler;
         
         sp.info->get_config("tcp_timeout",&tcpdemux::getInstance()->tcp_timeout,"Timeout for TCP connections");
+        sp.info->get_config("write_buffer_size",&tcpdemux::getInstance()->opt.write_buffer_size,
+                            "Bytes to collect for each flow before writing (0 to write every packet)");
+        sp.info->get_config("write_buffer_max",&tcpdemux::getInstance()->opt.write_buffer_max,
+                            "Maximum bytes held in all write buffers");
+        sp.info->get_config("reorder_queue_max",&tcpdemux::getInstance()->opt.reorder_queue_max,
+                            "Out-of-order bytes to hold for each flow until the gap fills (0 to seek and write)");
+        sp.info->get_config("prefix_hold_max",&tcpdemux::getInstance()->opt.prefix_hold_max,
+                            "Bytes of a flow without a SYN to keep in memory, so earlier data can be prepended cheaply");
+        sp.info->get_config("memory_flow_max",&tcpdemux::getInstance()->opt.memory_flow_max,
+                            "Bytes of each new flow to keep in memory before creating its file (0 to create it at once)");
+        sp.info->get_config("memory_max",&tcpdemux::getInstance()->opt.memory_max,
+                            "Bytes the flows may hold in memory before buffers are written, and then flows closed, to free it (0 for no limit)");
+        sp.info->get_config("stats_socket",&tcpdemux::getInstance()->opt.stats_socket,
+                            "Unix socket to serve live statistics on as JSON (empty for none)");
+        sp.info->get_config("stats_interval",&tcpdemux::getInstance()->opt.stats_interval,
+                            "Seconds between statistics sent to each stats_socket client (0 to send one and close)");
+        sp.info->get_config("prefilter",&tcpdemux::getInstance()->opt.prefilter,
+                            "File of CIDR prefixes to allow and deny, checked before the flow lookup (empty for none)");
+        sp.info->get_config("pair_close",&tcpdemux::getInstance()->opt.pair_close,
+                            "Post-process the two directions of a connection together, once both are complete");
+        sp.info->get_config("sample_rate",&tcpdemux::getInstance()->opt.sample_rate,
+                            "Keep 1 in this many connections, chosen by a hash of their addresses so both directions are kept or left out together (0 or 1 keeps them all)");
+        sp.info->get_config("sample_max",&tcpdemux::getInstance()->opt.sample_max,
+                            "Double the sampling rate, up to 1 in this many connections, while the capture drops packets or the post-processing queue is nearly full, and halve it again once they recover (0 to keep sample_rate)");
+        sp.info->get_config("cpus",&tcpdemux::getInstance()->opt.cpus,
+                            "CPUs to pin the capture, shard and post-processing threads to, as a list like 0-3,8 or auto from the NIC's NUMA node (empty to leave them be)");
+        sp.info->get_config("flow_table_size",&tcpdemux::getInstance()->opt.flow_table_size,
+                            "Number of simultaneous flows to size the flow table for, so it does not grow during capture");
+        sp.info->get_config("dir_cache",&tcpdemux::getInstance()->opt.dir_cache_size,
+                            "Directories of flow files to keep open for each thread, so files are opened with openat() rather than by their whole path (0 for none)");
+        sp.info->get_config("io_uring_depth",&tcpdemux::getInstance()->opt.io_uring_depth,
+                            "Flow-file writes to keep in flight through io_uring (0 to write synchronously)");
+        sp.info->get_config("packet_index_binary",&tcpdemux::getInstance()->opt.packet_index_binary,
+                            "Write the -I index as fixed-width binary records (.bfindx) rather than text");
+        sp.info->get_config("max_saved_flows",&tcpdemux::max_saved_flows,
+                            "Closed flows to remember, so later packets that repeat their data are ignored");
+        sp.info->get_config("straggler_index",&tcpdemux::getInstance()->opt.straggler_index,
+                            "Segments of each flow to keep digests of, so packets after it closes are matched without reading it back (0 for none; 64 is plenty)");
+        sp.info->get_config("flow_db",&tcpdemux::getInstance()->opt.flow_db,
+                            "SQLite database in the output directory to record each finished flow in (empty for none)");
+        sp.info->get_config("catalog",&tcpdemux::getInstance()->opt.catalog,
+                            "Binary catalog of the flows in the output directory, indexed by time and address for python/tcpflow_catalog.py (empty for none)");
+        sp.info->get_config("flow_db_batch",&tcpdemux::getInstance()->opt.flow_db_batch,
+                            "Flow records to commit to the flow database in one transaction");
+        sp.info->get_config("flow_db_batch_ms",&tcpdemux::getInstance()->opt.flow_db_batch_ms,
+                            "Milliseconds after which a partial batch of flow records is committed");
+        sp.info->get_config("flow_db_wal",&tcpdemux::getInstance()->opt.flow_db_wal,
+                            "Put the flow database in write-ahead-log mode");
+        sp.info->get_config("post_workers",&tcpdemux::getInstance()->opt.post_workers,
+                            "Threads to run the post-processing scanners on (0 to run them on the packet thread)");
+        sp.info->get_config("post_queue_depth",&tcpdemux::getInstance()->opt.post_queue_depth,
+                            "Closed flows that may wait for a post-processing worker");
+        sp.info->get_config("post_queue_skip",&tcpdemux::getInstance()->opt.post_queue_skip,
+                            "When the post-processing queue is full, record a flow without scanning it rather than wait");
+        sp.info->get_config("scan_threads",&tcpdemux::getInstance()->opt.scan_threads,
+                            "Threads to run each flow's post-processing scanners on at once (0 or 1 runs them one after another)");
+        sp.info->get_config("console_batch",&tcpdemux::getInstance()->opt.console_batch,
+                            "Bytes of -c/-C/-D output to gather on a writer thread and print at once (0 to print each packet)");
+        sp.info->get_config("perf_interval",&tcpdemux::getInstance()->opt.perf_interval,
+                            "Seconds between lines of performance counters on stderr (0 for none)");
+        sp.info->get_config("console_splice",&tcpdemux::getInstance()->opt.console_splice,
+                            "With -cB into a pipe, vmsplice() the payloads from the mapped -r file rather than copy them");
+        sp.info->get_config("unk_pcapng",&tcpdemux::getInstance()->opt.unk_pcapng,
+                            "Write the -w file as pcapng, with nanosecond timestamps and a block for each datalink");
+        sp.info->get_config("unk_buffer_size",&tcpdemux::getInstance()->opt.unk_buffer_size,
+                            "Bytes of -w packets to gather before each write");
+        sp.info->get_config("unk_thread",&tcpdemux::getInstance()->opt.unk_thread,
+                            "Write the -w file from a thread of its own, while the next buffer fills");
+        sp.info->get_config("segment_mb",&tcpdemux::getInstance()->opt.segment_mb,
+                            "Append the flows to segment files of this many MiB with an index, flows.idx, rather than write a file for each (0 for a file each); the post-processing scanners are not run");
+        sp.info->get_config("flow_gzip",&tcpdemux::getInstance()->opt.flow_gzip,
+                            "Write each flow file compressed at this zlib level (1-9), as seekable BGZF named with .gz; the scanners read it inflated (0 writes them raw)");
 
         return;     /* No feature files created */
     }
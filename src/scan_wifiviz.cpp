@@ -28,16 +28,35 @@ void  scan_wifiviz(const class scanner_params &sp,const recursion_control_block
 	sp.info->packet_user = 0;
         sp.info->description = "Performs wifi isualization";
         sp.info->get_config("check_fcs",&TFCB::theTFCB.opt_check_fcs,"Require valid Frame Check Sum (FCS)");
+        sp.info->get_config("wifiviz_max_ssids",&TFCB::theTFCB.mac_to_ssid.max_entries,
+                            "Most MACs and SSIDs counted before the least-seen are evicted");
+        sp.info->get_config("wifiviz_evicted_ssids",&TFCB::theTFCB.mac_to_ssid.summary_size,
+                            "Evicted MACs and SSIDs of the most beacons to report");
     }
     if(sp.phase==scanner_params::PHASE_SHUTDOWN){
         if(sp.sxml){
+            const mac_ssid_table &table = TFCB::theTFCB.mac_to_ssid;
+            std::vector<const mac_ssid_table::entry *> ssids;
+            table.sorted(ssids);
             (*sp.sxml) << "<ssids>\n";
-            for(TFCB::mac_ssid_map_t::const_iterator it=TFCB::theTFCB.mac_to_ssid.begin();
-                it!=TFCB::theTFCB.mac_to_ssid.end();it++){
-                (*sp.sxml) << "  <ssid mac='" << (*it).first.mac <<"' ssid='" << dfxml_writer::xmlescape((*it).first.ssid) << "' count='" <<
-                    (*it).second << "'/>\n";
+            for(std::vector<const mac_ssid_table::entry *>::const_iterator it=ssids.begin();
+                it!=ssids.end();it++){
+                (*sp.sxml) << "  <ssid mac='" << (*it)->mac() <<"' ssid='" << dfxml_writer::xmlescape((*it)->get_ssid()) << "' count='" <<
+                    (*it)->count << "'/>\n";
             }
             (*sp.sxml) << "</ssids>\n";
+            if(table.evicted()){
+                std::vector<const mac_ssid_table::heavy_hitter *> heaviest;
+                table.sorted_summary(heaviest);
+                (*sp.sxml) << "<evicted_ssids entries='" << table.evicted() << "' count='"
+                           << table.evicted_beacons() << "'>\n";
+                for(std::vector<const mac_ssid_table::heavy_hitter *>::const_iterator it=heaviest.begin();
+                    it!=heaviest.end();it++){
+                    (*sp.sxml) << "  <ssid mac='" << (*it)->e.mac() <<"' ssid='" << dfxml_writer::xmlescape((*it)->e.get_ssid())
+                               << "' count='" << (*it)->e.count << "' error='" << (*it)->error << "'/>\n";
+                }
+                (*sp.sxml) << "</evicted_ssids>\n";
+            }
         }
     }
 }
@@ -0,0 +1,244 @@
+/*
+ * stats_server.cpp:
+ *
+ * Live statistics on a Unix domain socket; see stats_server.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "tcpip.h"
+#include "tcpdemux.h"
+#include "scan_pool.h"
+
+void demux_stats::add(const demux_stats &b)
+{
+    packets          += load(b.packets);
+    bytes            += load(b.bytes);
+    flows_created    += load(b.flows_created);
+    active_flows     += load(b.active_flows);
+    open_fds         += load(b.open_fds);
+    max_open_flows   += load(b.max_open_flows);
+    saved_flows      += load(b.saved_flows);
+    write_bytes      += load(b.write_bytes);
+    flows_scanned    += load(b.flows_scanned);
+    capture_valid    += load(b.capture_valid);
+    capture_received += load(b.capture_received);
+    capture_dropped  += load(b.capture_dropped);
+}
+
+#ifdef HAVE_STATS_SERVER
+
+#include <sys/un.h>
+#include <poll.h>
+#include <sstream>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0                  // BSDs; SIGPIPE is ignored by stats_server::open() there
+#endif
+
+stats_server::stats_server(tcpdemux &demux_,const std::string &path_,uint32_t interval_):
+    demux(demux_),path(path_),interval(interval_),listen_fd(-1),wake(),clients(),thread(),
+    start_usec(perf_counters::now_usec()),last_usec(start_usec),last()
+{
+    wake[0] = wake[1] = -1;
+}
+
+stats_server *stats_server::open(tcpdemux &demux,const std::string &path,uint32_t interval,std::string &err)
+{
+    struct sockaddr_un addr;
+    memset(&addr,0,sizeof(addr));
+    if(path.size() >= sizeof(addr.sun_path)){
+        err = ssprintf("%s: the path is too long for a socket",path.c_str());
+        return 0;
+    }
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path,path.c_str(),sizeof(addr.sun_path)-1);
+#if MSG_NOSIGNAL==0
+    signal(SIGPIPE,SIG_IGN);
+#endif
+
+    stats_server *s = new stats_server(demux,path,interval);
+    s->listen_fd = socket(AF_UNIX,SOCK_STREAM,0);
+    if(s->listen_fd<0){
+        err = ssprintf("socket(AF_UNIX): %s",strerror(errno));
+        delete s;
+        return 0;
+    }
+    struct stat st;
+    if(lstat(path.c_str(),&st)==0){
+        if(!S_ISSOCK(st.st_mode)){      // not ours to remove
+            err = ssprintf("%s: exists and is not a socket",path.c_str());
+            close(s->listen_fd);
+            s->listen_fd = -1;          // so the destructor leaves it
+            delete s;
+            return 0;
+        }
+        unlink(path.c_str());           // left by an earlier run
+    }
+    if(bind(s->listen_fd,(struct sockaddr *)&addr,sizeof(addr))<0){
+        err = ssprintf("%s: %s",path.c_str(),strerror(errno));
+        close(s->listen_fd);
+        s->listen_fd = -1;              // whatever is at path isn't ours
+        delete s;
+        return 0;
+    }
+    if(listen(s->listen_fd,8)<0){
+        err = ssprintf("%s: %s",path.c_str(),strerror(errno));
+        delete s;
+        return 0;
+    }
+    if(pipe(s->wake)<0){
+        err = ssprintf("pipe: %s",strerror(errno));
+        s->wake[0] = s->wake[1] = -1;
+        delete s;
+        return 0;
+    }
+    if(pthread_create(&s->thread,0,run,s)){
+        err = ssprintf("cannot create the stats thread: %s",strerror(errno));
+        close(s->wake[1]);
+        s->wake[1] = -1;
+        delete s;
+        return 0;
+    }
+    return s;
+}
+
+stats_server::~stats_server()
+{
+    if(wake[1]>=0){
+        char c = 0;
+        if(write(wake[1],&c,1)==1) pthread_join(thread,0);
+        close(wake[1]);
+    }
+    if(wake[0]>=0) close(wake[0]);
+    for(std::vector<int>::const_iterator it=clients.begin();it!=clients.end();it++) close(*it);
+    if(listen_fd>=0){
+        close(listen_fd);
+        unlink(path.c_str());
+    }
+}
+
+void *stats_server::run(void *arg)
+{
+    ((stats_server *)arg)->loop();
+    return 0;
+}
+
+void stats_server::loop()
+{
+    uint64_t due = perf_counters::now_usec() + (uint64_t)interval*1000000;
+    while(true){
+        struct pollfd fds[2];
+        fds[0].fd = wake[0];    fds[0].events = POLLIN; fds[0].revents = 0;
+        fds[1].fd = listen_fd;  fds[1].events = POLLIN; fds[1].revents = 0;
+        int timeout = -1;
+        if(interval && clients.size()){
+            uint64_t now = perf_counters::now_usec();
+            timeout = now >= due ? 0 : (int)((due-now)/1000) + 1;
+        }
+        if(poll(fds,2,timeout)<0 && errno!=EINTR) return;
+        if(fds[0].revents) return;
+        if(fds[1].revents & POLLIN){
+            int fd = accept(listen_fd,0,0);
+            if(fd>=0){
+                if(send(fd,json()) && interval){
+                    if(clients.empty()) due = perf_counters::now_usec() + (uint64_t)interval*1000000;
+                    clients.push_back(fd);
+                } else {
+                    close(fd);
+                }
+            }
+        }
+        if(interval && clients.size() && perf_counters::now_usec() >= due){
+            std::string s = json();
+            for(size_t i=0;i<clients.size();){
+                if(send(clients[i],s)){
+                    i++;
+                } else {
+                    close(clients[i]);  // hung up, or not reading
+                    clients[i] = clients.back();
+                    clients.pop_back();
+                }
+            }
+            due += (uint64_t)interval*1000000;
+        }
+    }
+}
+
+bool stats_server::send(int fd,const std::string &s)
+{
+    return ::send(fd,s.data(),s.size(),MSG_NOSIGNAL|MSG_DONTWAIT)==(ssize_t)s.size();
+}
+
+static void json_counts(std::stringstream &ss,const demux_stats &st)
+{
+    ss << "\"packets\":"          << st.packets
+       << ",\"bytes\":"           << st.bytes
+       << ",\"flows_created\":"   << st.flows_created
+       << ",\"active_flows\":"    << st.active_flows
+       << ",\"open_fds\":"        << st.open_fds
+       << ",\"max_open_flows\":"  << st.max_open_flows
+       << ",\"saved_flows\":"     << st.saved_flows
+       << ",\"write_bytes\":"     << st.write_bytes
+       << ",\"flows_scanned\":"   << st.flows_scanned;
+}
+
+static double per_second(uint64_t now,uint64_t then,double secs)
+{
+    return now>then ? (now-then)/secs : 0;
+}
+
+std::string stats_server::json()
+{
+    std::vector<tcpdemux *> shards;
+    demux.flow_demuxes(shards);
+    if(shards.size()==1 && shards[0]==&demux) shards.clear();
+
+    demux_stats total;
+    total.add(demux.published);         // with -j, what the master couldn't queue
+    std::vector<demux_stats> each(shards.size());
+    for(size_t i=0;i<shards.size();i++){
+        each[i].add(shards[i]->published);
+        total.add(each[i]);
+    }
+    if(demux.scans) total.flows_scanned += demux.scans->completed();
+
+    uint64_t now = perf_counters::now_usec();
+    double secs = (now - last_usec) / 1000000.0;
+    if(secs<=0) secs = 0.000001;
+
+    std::stringstream ss;
+    ss.precision(1);
+    ss << std::fixed;
+    ss << "{\"uptime_s\":" << (now - start_usec) / 1000000.0 << ",";
+    json_counts(ss,total);
+    ss << ",\"post_queue\":" << (demux.scans ? demux.scans->queued() : 0);
+    if(total.capture_valid){
+        ss << ",\"capture\":{\"received\":" << total.capture_received
+           << ",\"dropped\":" << total.capture_dropped << "}";
+    }
+    ss << ",\"rates\":{\"packets_per_s\":"     << per_second(total.packets,last.packets,secs)
+       << ",\"bytes_per_s\":"                 << per_second(total.bytes,last.bytes,secs)
+       << ",\"flows_per_s\":"                 << per_second(total.flows_created,last.flows_created,secs)
+       << ",\"write_bytes_per_s\":"           << per_second(total.write_bytes,last.write_bytes,secs)
+       << ",\"flows_scanned_per_s\":"         << per_second(total.flows_scanned,last.flows_scanned,secs)
+       << "}";
+    if(shards.size()){
+        ss << ",\"shards\":[";
+        for(size_t i=0;i<each.size();i++){
+            if(i) ss << ",";
+            ss << "{";
+            json_counts(ss,each[i]);
+            ss << "}";
+        }
+        ss << "]";
+    }
+    ss << "}\n";
+    last = total;
+    last_usec = now;
+    return ss.str();
+}
+
+#endif
@@ -0,0 +1,91 @@
+/*
+ * stats_server.h:
+ *
+ * Live statistics as JSON on a Unix domain socket (-S stats_socket=PATH).
+ *
+ * Each client that connects is sent one JSON object, a line long, and the
+ * connection is closed; with -S stats_interval=S it is kept open instead
+ * and sent another object every S seconds until it hangs up:
+ *
+ *   socat - UNIX-CONNECT:/var/run/tcpflow.stats
+ *
+ * The object has the packets and bytes the demuxes have processed, the
+ * flows they have made and hold now, their open files and saved flows,
+ * max_open_flows, the closed flows waiting for the post-processing
+ * scanners, and the capture's received and dropped packets where libpcap
+ * can tell them; "shards" has the same for each shard with -j. "rates" has
+ * packets, bytes, new flows, bytes written to flow files and flows scanned
+ * per second since the last object the server sent.
+ *
+ * The server runs on a thread of its own and takes no lock. Each demux
+ * copies its counters into its demux_stats every STATS_TICK_PACKETS
+ * packets, with relaxed atomic stores from its own thread, and the server
+ * reads them with relaxed atomic loads; the copies are at most that many
+ * packets old.
+ *
+ * #include this file after tcpflow.h
+ */
+
+#ifndef STATS_SERVER_H
+#define STATS_SERVER_H
+
+/* What a demux publishes for the stats server */
+class demux_stats {
+public:
+    demux_stats():packets(0),bytes(0),flows_created(0),active_flows(0),open_fds(0),
+                  max_open_flows(0),saved_flows(0),write_bytes(0),flows_scanned(0),
+                  capture_valid(0),capture_received(0),capture_dropped(0){}
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t flows_created;
+    uint64_t active_flows;
+    uint64_t open_fds;
+    uint64_t max_open_flows;
+    uint64_t saved_flows;
+    uint64_t write_bytes;               // to flow files
+    uint64_t flows_scanned;
+    uint64_t capture_valid;             // the master's, from pcap_stats() on a live capture
+    uint64_t capture_received;
+    uint64_t capture_dropped;
+
+    static void store(uint64_t &field,uint64_t v){ __atomic_store_n(&field,v,__ATOMIC_RELAXED); }
+    static uint64_t load(const uint64_t &field){ return __atomic_load_n(&field,__ATOMIC_RELAXED); }
+    void add(const demux_stats &b);     // b's fields, each loaded
+};
+
+#if defined(HAVE_PTHREAD) && defined(HAVE_SYS_UN_H)
+#define HAVE_STATS_SERVER
+
+#include <pthread.h>
+#include <vector>
+
+class stats_server {
+    /* These are not implemented */
+    stats_server(const stats_server &);
+    stats_server &operator=(const stats_server &);
+
+    class tcpdemux &demux;              // the master
+    std::string path;
+    uint32_t    interval;               // seconds between objects to each client; 0 sends one
+    int         listen_fd;
+    int         wake[2];                // written to by the destructor
+    std::vector<int> clients;           // kept open by interval
+    pthread_t   thread;
+    uint64_t    start_usec;
+    uint64_t    last_usec;              // when the last object was made
+    demux_stats last;                   // and what it said, for the rates
+
+    stats_server(class tcpdemux &demux,const std::string &path,uint32_t interval);
+    static void *run(void *arg);
+    void        loop();
+    bool        send(int fd,const std::string &s); // false if the client can't take it
+    std::string json();
+
+public:
+    /** Returns 0 and sets err if the socket can't be made */
+    static stats_server *open(class tcpdemux &demux,const std::string &path,uint32_t interval,std::string &err);
+    virtual ~stats_server();            // stops the thread and removes the socket
+};
+
+#endif
+#endif
@@ -14,120 +14,717 @@
 #include "tcpflow.h"
 #include "tcpip.h"
 #include "tcpdemux.h"
-
+#include "uring_writer.h"
+#include "flow_db.h"
+#include "flow_catalog.h"
+#include "scan_pool.h"
+#include "scan_fanout.h"
+#include "cpu_layout.h"
+#include "packet_pool.h"
+#include "flow_hash.h"
+#include "scan_http.h"
+#include "console_output.h"
+#include "tcpflow_probes.h"
+#include "flow_container.h"
+#include "flow_gzip.h"
+#include "cidr_filter.h"
+
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <vector>
 
+static tcpdemux *shard_demux(tcpdemux::shard *sh); // shard support at end of file
+
+#ifdef HAVE_PTHREAD
+/* Set on scan_pool workers. They share the master demux with the packet
+ * thread, so retrying_open() must not touch its open flows for them.
+ */
+static pthread_key_t  scan_worker_key;
+static pthread_once_t scan_worker_once = PTHREAD_ONCE_INIT;
+static bool           have_scan_worker_key = false;
+static void make_scan_worker_key()
+{
+    pthread_key_create(&scan_worker_key,0);
+    have_scan_worker_key = true;        // before any worker starts
+}
+#endif
+
 /* static */ uint32_t tcpdemux::max_saved_flows = 100;
 /* static */ uint32_t tcpdemux::tcp_timeout = 0;
 
 tcpdemux::tcpdemux():
-#ifdef HAVE_SQLITE3
-    db(),insert_flow(),
-#endif
     outdir("."),flow_counter(0),packet_counter(0),
     xreport(0),pwriter(0),max_open_flows(),max_fds(get_max_fds()-NUM_RESERVED_FDS),
-    flow_map(),open_flows(),saved_flow_map(),
-    saved_flows(),start_new_connections(false),opt(),fs()
+    tcpip_pool(),flow_map(),open_flows(),dirs(),expiry(),buffered_flows(),buffered_bytes(0),uring(0),db(0),catalog(0),reports(0),scans(0),fanout(0),report_scratch(),console_buf(),
+    console(0),console_spares(0),splice(0),container(0),gz_codec(0),cidrs(0),cpus(0),cidr_hits(),
+    saved_flows(),start_new_connections(false),opt(),fs(),
+    master(0),shard_index(0),shard_count(1),shards(),held_reports(),order_reports(false),
+    packets(0),stable_base(0),stable_len(0),clock(0),
+    perf(),perf_ticks(0),perf_due(0),memory(),memory_warned(false),
+    published(),stats_ticks(0),capture_polled(0),live_capture(0),stats(0),
+    sample_n(1),sample_ticks(0),sample_checked(0),sample_drops(0),sample_calm(0),
+#ifdef HAVE_PTHREAD
+    shared_lock(0),
+#endif
+    pipeline(&tcpdemux::process_tcp_as<store_pipeline>)
+{
+}
+
+/* A shard shares the master's options, output and report, but has its own flow
+ * state and its own share of the file descriptor budget.
+ */
+tcpdemux::tcpdemux(tcpdemux &master_,uint32_t shard_index_,uint32_t shard_count_):
+    outdir(master_.outdir),flow_counter(0),packet_counter(0),
+    xreport(master_.xreport),pwriter(master_.pwriter),max_open_flows(),
+    max_fds(master_.max_fds/shard_count_ > 1 ? master_.max_fds/shard_count_ : 1),
+    tcpip_pool(),flow_map(),open_flows(),dirs(),expiry(),buffered_flows(),buffered_bytes(0),uring(0),db(0),catalog(0),reports(0),scans(0),fanout(0),report_scratch(),console_buf(),
+    console(master_.console),console_spares(0),splice(0),container(master_.container),gz_codec(0),
+    cidrs(master_.cidrs),cpus(master_.cpus),cidr_hits(master_.cidr_hits.size(),0),
+    saved_flows(),start_new_connections(master_.start_new_connections),opt(master_.opt),fs(master_.fs),
+    master(&master_),shard_index(shard_index_),shard_count(shard_count_),shards(),held_reports(),order_reports(false),
+    packets(0),stable_base(0),stable_len(0),clock(0),
+    perf(),perf_ticks(0),perf_due(0),memory(),memory_warned(false),
+    published(),stats_ticks(0),capture_polled(0),live_capture(0),stats(0),
+    sample_n(1),sample_ticks(0),sample_checked(0),sample_drops(0),sample_calm(0),
+#ifdef HAVE_PTHREAD
+    shared_lock(master_.shared_lock),
+#endif
+    pipeline(master_.pipeline)
 {
+    opt.write_buffer_max = master_.opt.write_buffer_max / shard_count_;
+    opt.flow_table_size  = master_.opt.flow_table_size / shard_count_;
+    opt.memory_max       = master_.opt.memory_max / shard_count_;
+}
+
+tcpdemux::~tcpdemux()
+{
+#ifdef HAVE_URING_WRITER
+    if(uring) delete uring;
+#endif
+#ifdef HAVE_CONSOLE_WRITER
+    console_writer::free_chunks(console_spares);
+#endif
+    if(gz_codec) delete gz_codec;
+    if(master) return;              // xreport, pwriter, console and container belong to the master
+    stop_stats_server();
+    stop_scan_pool();
+    stop_report_writer();
+    stop_console_writer();
+    if(xreport) delete xreport;
+    if(pwriter) delete pwriter;
+    if(cidrs) delete cidrs;
+    if(cpus) delete cpus;
+    close_container();
+    close_catalog();
+}
+
+/* The io_uring writer is made on first use, so each shard's ring is
+ * created (and only used) by the shard's own thread.
+ */
+uring_writer *tcpdemux::async_writer()
+{
+#ifdef HAVE_URING_WRITER
+    if(uring==0 && opt.io_uring_depth>0){
+        uring = uring_writer::open(opt.io_uring_depth,perf);
+        if(uring==0){
+            DEBUG(1)("io_uring is not available; writing flow files synchronously");
+            opt.io_uring_depth = 0;
+        }
+    }
+#endif
+    return uring;
+}
+
+/* Each shard compresses its own flows, so each has its own codec */
+gzip_codec *tcpdemux::gzip()
+{
+    if(gz_codec==0) gz_codec = new gzip_codec(opt.flow_gzip);
+    return gz_codec;
+}
+
+void tcpdemux::drain_writes(int fd)
+{
+#ifdef HAVE_URING_WRITER
+    if(uring) uring->drain(fd);
+#endif
+}
+
+/* On the thread that made the ring, before it exits: the kernel cancels
+ * the writes a thread submitted when it goes. Whatever this demux writes
+ * after that, from the master's thread, is written synchronously.
+ */
+void tcpdemux::close_async_writer()
+{
+#ifdef HAVE_URING_WRITER
+    if(uring){
+        delete uring;                   // which drains it
+        uring = 0;
+    }
+#endif
+    opt.io_uring_depth = 0;
 }
 
 void tcpdemux::openDB()
 {
-#ifdef HAVE_SQLITE3
-    int rc = sqlite3_open("test.db", &db);
-    if( rc ){
-        fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(db));
-        db = 0;
-    }
-    /* Create SQL statement */
-    const char *sql = "CREATE TABLE connections ("
-        "starttime TEXT NOT NULL,"
-        "endtime TEXT NOT NULL,"
-        "src_ipn TEXT,"  
-        "dst_ipn TEXT,"
-        "mac_daddr TEXT,"
-        "mac_saddr TEXT,"
-        "packets INTEGER,"
-        "srcport INTEGER,"
-        "dstport INTEGER,"
-        "hashdigest_md5 TEXT);";
-
-    /* Execute SQL statement */
-    rc = sqlite3_exec(db, sql, callback, 0, &zErrMsg);
-    if( rc != SQLITE_OK ){
-        fprintf(stderr, "SQL error: %s\n", zErrMsg);
-        sqlite3_free(zErrMsg);
-        sqlite3_close(db);
-        return 0;
+    if(db || opt.flow_db.size()==0) return;
+#ifdef HAVE_FLOW_DB
+    std::string err;
+    db = flow_db::open(outdir + "/" + opt.flow_db,opt.flow_db_batch,opt.flow_db_batch_ms,opt.flow_db_wal,err);
+    if(db==0) DEBUG(1)("flow database: %s",err.c_str());
+#else
+    DEBUG(1)("flow database: tcpflow was compiled without SQLite");
+#endif
+}
+
+void tcpdemux::closeDB()
+{
+#ifdef HAVE_FLOW_DB
+    if(db) delete db;
+#endif
+    db = 0;
+}
+
+void tcpdemux::open_catalog()
+{
+    if(catalog || opt.catalog.size()==0) return;
+    catalog = flow_catalog::open(outdir + "/" + opt.catalog);
+}
+
+void tcpdemux::close_catalog()
+{
+    if(catalog) delete catalog;
+    catalog = 0;
+}
+
+void tcpdemux::start_report_writer()
+{
+#ifdef HAVE_REPORT_WRITER
+    if(xreport && reports==0) reports = report_writer::open(xreport);
+#endif
+}
+
+void tcpdemux::stop_report_writer()
+{
+#ifdef HAVE_REPORT_WRITER
+    if(reports) delete reports;
+#endif
+    reports = 0;
+}
+
+void tcpdemux::start_stats_server()
+{
+#ifdef HAVE_STATS_SERVER
+    if(opt.stats_socket.size() && stats==0){
+        std::string err;
+        stats = stats_server::open(*this,opt.stats_socket,opt.stats_interval,err);
+        if(stats==0) fprintf(stderr,"%s: stats_socket: %s\n",progname,err.c_str());
+    }
+#else
+    if(opt.stats_socket.size()) fprintf(stderr,"%s: stats_socket is not supported on this platform\n",progname);
+#endif
+}
+
+void tcpdemux::stop_stats_server()
+{
+#ifdef HAVE_STATS_SERVER
+    if(stats) delete stats;
+#endif
+    stats = 0;
+}
+
+void tcpdemux::start_console_writer()
+{
+#ifdef HAVE_CONSOLE_WRITER
+    if(opt.console_output && console==0){
+        console = console_writer::open(opt.console_batch,opt.output_strip_nonprint && !opt.output_hex);
+    }
+#endif
+#ifdef HAVE_CONSOLE_SPLICE
+    if(opt.console_output && console==0 && splice==0 && opt.console_splice
+       && !opt.output_strip_nonprint && !opt.output_hex){
+        splice = console_splice::open(fileno(stdout));
+    }
+#endif
+}
+
+void tcpdemux::stop_console_writer()
+{
+#ifdef HAVE_CONSOLE_WRITER
+    if(console) delete console;
+#endif
+    console = 0;
+#ifdef HAVE_CONSOLE_SPLICE
+    if(splice) delete splice;
+#endif
+    splice = 0;
+}
+
+void tcpdemux::start_scan_pool()
+{
+#ifdef HAVE_SCAN_POOL
+    if(!opt.post_processing) return;
+    pthread_once(&scan_worker_once,make_scan_worker_key);
+    if(scans==0 && opt.post_workers) scans = scan_pool::open(*this,opt.post_workers,opt.post_queue_depth,opt.post_queue_skip);
+#endif
+#ifdef HAVE_SCAN_FANOUT
+    if(fanout==0) fanout = scan_fanout::open(opt.scan_threads);
+#endif
+}
+
+/* static */ void tcpdemux::mark_scan_worker()
+{
+#ifdef HAVE_PTHREAD
+    pthread_once(&scan_worker_once,make_scan_worker_key);
+    pthread_setspecific(scan_worker_key,&scan_worker_key);
+#endif
+}
+
+void tcpdemux::flush_scans()
+{
+#ifdef HAVE_SCAN_POOL
+    if(scans) scans->flush();
+#endif
+}
+
+void tcpdemux::stop_scan_pool()
+{
+#ifdef HAVE_SCAN_POOL
+    if(scans) delete scans;
+#endif
+    scans = 0;
+#ifdef HAVE_SCAN_FANOUT
+    if(fanout) delete fanout;           // after the workers that use it
+#endif
+    fanout = 0;
+}
+
+void tcpdemux::scan_flow(const sbuf_t &sbuf,std::stringstream &xmladd)
+{
+#ifdef HAVE_SCAN_FANOUT
+    scan_fanout *f = master ? master->fanout : fanout;
+    if(f){
+        f->scan(sbuf,*fs,xmladd);
+        return;
+    }
+#endif
+    be13::plugin::process_sbuf(scanner_params(scanner_params::PHASE_SCAN,sbuf,*fs,&xmladd));
+}
+
+/* Called on the master, by one thread at a time: post_process() holds
+ * shared_lock, and the scan_pool records one flow at a time.
+ * With shards reading files (order_reports) the report is held, so the
+ * order doesn't depend on the threads. MAX_HELD_REPORTS, and with
+ * memory_max a shard's share of it, bound what a long file holds; a live
+ * capture has no order to keep, so its reports are recorded at once.
+ */
+void tcpdemux::record_flow(const flow_report &fr)
+{
+    tcpdemux *m = master ? master : this;
+    if(m->shards.size() && m->order_reports){
+        m->held_reports.push_back(fr);
+        m->memory.used[memory_budget::HELD_REPORTS] += report_bytes(fr);
+        if(m->held_reports.size() >= MAX_HELD_REPORTS ||
+           (m->opt.memory_max && m->memory.used[memory_budget::HELD_REPORTS] > m->opt.memory_max/m->shards.size())){
+            m->record_held_flows();
+        }
+    } else {
+        m->record_report(fr);
     }
-    const char* zSql = "INSERT INTO connections (starttime,endtime,src_ipn,dst_ipn,mac_daddr,mac_saddr,packets,srcport,dstport,hashdigest_md5) VALUES (?,?,?,?,?,?,?,?,?,?)";
-    if(sqlite3_prepare_v2(db, zSql, strlen(zSql), &insert_stmt, NULL)!=SQLITE_OK ){
-        fprintf(stderr, "SQL prepare error");
-        db = 0;
-        insert_stmt=0;
-        return(0);
+}
+
+/* static */ size_t tcpdemux::report_bytes(const flow_report &fr)
+{
+    return sizeof(fr) + fr.flow_pathname.capacity() + fr.xmladd.capacity();
+}
+
+static bool earlier_id(const flow_report *a,const flow_report *b)
+{
+    return a->myflow.id < b->myflow.id;
+}
+
+void tcpdemux::record_held_flows()
+{
+    std::vector<const flow_report *> order;
+    order.reserve(held_reports.size());
+    for(std::vector<flow_report>::const_iterator it=held_reports.begin();it!=held_reports.end();it++){
+        order.push_back(&*it);
     }
+    std::sort(order.begin(),order.end(),earlier_id);
+    for(std::vector<const flow_report *>::const_iterator it=order.begin();it!=order.end();it++){
+        record_report(**it);
+    }
+    held_reports.clear();
+    memory.used[memory_budget::HELD_REPORTS] = 0;
+}
+
+void tcpdemux::record_report(const flow_report &fr)
+{
+    if(xreport){
+#ifdef HAVE_REPORT_WRITER
+        if(reports){
+            flow_report *out = reports->get();
+            *out = fr;
+            reports->put(out);
+        } else
 #endif
+        {
+            fr.write(xreport);
+            xreport->flush();
+        }
+    }
+    if(db){
+        static const std::string md5_start("<hashdigest type='MD5'>");
+        std::string md5;
+        size_t p = fr.xmladd.find(md5_start);
+        if(p!=std::string::npos){
+            p += md5_start.size();
+            md5 = fr.xmladd.substr(p,fr.xmladd.find('<',p)-p);
+        }
+        std::stringstream src,dst;
+        src << fr.myflow.src;
+        dst << fr.myflow.dst;
+        write_flow_record(dfxml_writer::to8601(fr.myflow.tstart),dfxml_writer::to8601(fr.myflow.tlast),
+                          src.str(),dst.str(),
+                          fr.myflow.has_mac_daddr() ? macaddr(fr.myflow.mac_daddr) : std::string(),
+                          fr.myflow.has_mac_saddr() ? macaddr(fr.myflow.mac_saddr) : std::string(),
+                          fr.myflow.packet_count,fr.myflow.sport,fr.myflow.dport,md5);
+    }
+    if(catalog) catalog->add(fr);
 }
 
+/* Queue a finished flow for the database writer; returns at once */
 void  tcpdemux::write_flow_record(const std::string &starttime,const std::string &endtime,
                         const std::string &src_ipn,const std::string &dst_ipn,
                         const std::string &mac_daddr,const std::string &mac_saddr,
                         uint64_t packets,uint16_t srcport,uint16_t dstport,
                         const std::string &hashdigest_md5)
 {
+#ifdef HAVE_FLOW_DB
+    flow_db *d = master ? master->db : db;
+    if(d==0) return;
+    flow_db::record r;
+    r.starttime = starttime;
+    r.endtime   = endtime;
+    r.src_ipn   = src_ipn;
+    r.dst_ipn   = dst_ipn;
+    r.mac_daddr = mac_daddr;
+    r.mac_saddr = mac_saddr;
+    r.packets   = packets;
+    r.srcport   = srcport;
+    r.dstport   = dstport;
+    r.hashdigest_md5 = hashdigest_md5;
+    d->write(r);
+#endif
 }
 
 
+#ifdef HAVE_PTHREAD
+static pthread_key_t  current_shard_key;    // the shard being run by this thread
+#endif
 
 /* static */ tcpdemux *tcpdemux::getInstance()
 {
     static tcpdemux * theInstance = 0;
     if(theInstance==0) theInstance = new tcpdemux();
+#ifdef HAVE_PTHREAD
+    if(theInstance->shards.size()>0){
+        tcpdemux *current = reinterpret_cast<tcpdemux *>(pthread_getspecific(current_shard_key));
+        if(current) return current;
+    }
+#endif
     return theInstance;
 }
 
+uint64_t tcpdemux::next_flow_id()
+{
+    return (flow_counter++) * shard_count + shard_index;
+}
+
 
 
 /**
  * Implement a list of open_flows, each with an associated file descriptor.
  * When a new file needs to be opened, we can close a flow if necessary.
  */
-void tcpdemux::close_all_fd()
+void open_flow_ring::insert(tcpip *tcp)
+{
+    if(tcp->ring_prev || tcp->ring_next || head==tcp) return; // already open
+    /* A flow is normally opened to write the packet just seen, so it goes at the tail.
+     * post_process() and shutdown reopen flows older than anything open; they go
+     * at the head, to be closed first, rather than being walked back to their place.
+     */
+    if(tail==0 || tail->last_packet_number <= tcp->last_packet_number){
+        tcp->ring_prev = tail;
+        tcp->ring_next = 0;
+        if(tail) tail->ring_next = tcp; else head = tcp;
+        tail = tcp;
+    } else {
+        tcp->ring_prev = 0;
+        tcp->ring_next = head;
+        head->ring_prev = tcp;
+        head = tcp;
+    }
+    count++;
+}
+
+void open_flow_ring::erase(tcpip *tcp)
+{
+    if(tcp->ring_prev==0 && tcp->ring_next==0 && head!=tcp) return; // not open
+    if(tcp->ring_prev) tcp->ring_prev->ring_next = tcp->ring_next; else head = tcp->ring_next;
+    if(tcp->ring_next) tcp->ring_next->ring_prev = tcp->ring_prev; else tail = tcp->ring_prev;
+    tcp->ring_prev = tcp->ring_next = 0;
+    count--;
+}
+
+void open_flow_ring::touch(tcpip *tcp)
+{
+    if(tail==tcp) return;
+    if(tcp->ring_prev==0 && tcp->ring_next==0 && head!=tcp) return; // not open
+    erase(tcp);
+    insert(tcp);                        // the newest packet number, so this is O(1)
+}
+
+void saved_flow_ring::reserve(size_t capacity)
+{
+    std::vector<saved_flow>(capacity).swap(flows);
+    first = 0;
+    count = 0;
+    std::vector<char>(capacity ? std::max(capacity*NAME_BYTES,(size_t)4096) : 0).swap(names);
+    names_end = 0;
+    digest_bytes = 0;
+    index.clear();
+    if(capacity) index.reserve(capacity);
+}
+
+size_t saved_flow_ring::memory() const
+{
+    return flows.capacity()*sizeof(saved_flow) + names.capacity() + digest_bytes + index.memory();
+}
+
+/* Where a name of length bytes (including the NUL) can go without
+ * overwriting the names of the flows we still have.
+ */
+bool saved_flow_ring::name_fits(size_t length,size_t &at) const
+{
+    if(count==0){
+        at = 0;
+        return length <= names.size();
+    }
+    size_t start = flows[first].name_offset; // the oldest name still needed
+    if(names_end > start){              // the names in use are [start,names_end)
+        if(names_end + length <= names.size()){
+            at = names_end;
+            return true;
+        }
+        at = 0;                         // wrap around
+        return length <= start;
+    }
+    at = names_end;                     // they are [start,end) and [0,names_end)
+    return names_end < start && names_end + length <= start;
+}
+
+/* Make names large enough for another length bytes, packing the names in use at the front */
+void saved_flow_ring::grow_names(size_t length)
+{
+    std::vector<char> bigger(names.size()*2 + length);
+    size_t end = 0;
+    for(size_t i=0;i<count;i++){
+        saved_flow &sf = flows[(first+i) % flows.size()];
+        memcpy(&bigger[end],&names[sf.name_offset],sf.name_length+1);
+        sf.name_offset = (uint32_t)end;
+        end += sf.name_length+1;
+    }
+    names.swap(bigger);
+    names_end = end;
+}
+
+void saved_flow_ring::forget_oldest()
+{
+    saved_flow &sf = flows[first];
+    if(index.find(sf.key)==&sf) index.erase(sf.key); // unless the address was saved again since
+    sf.digests.segments.clear();
+    first = (first+1) % flows.size();
+    count--;
+    if(count==0) names_end = 0;
+}
+
+void saved_flow_ring::save(tcpip *tcp)
 {
-    tcpset open_flows_copy(open_flows);	// make a copy because we're going to modify it
+    save(tcp->myflow,tcp->isn,tcp->flow_pathname,tcp->digests);
+}
 
-    for(tcpset::const_iterator it = open_flows_copy.begin();it!=open_flows_copy.end();it++){
-	(*it)->close_file();
+void saved_flow_ring::save(const flow_addr &addr,be13::tcp_seq isn,const std::string &name,segment_index &digests)
+{
+    if(flows.size()==0) return;
+    if(count==flows.size()) forget_oldest();
+    size_t length = name.size()+1;
+    size_t at = 0;
+    while(!name_fits(length,at)) grow_names(length);
+    memcpy(&names[at],name.c_str(),length);
+    names_end = at + length;
+
+    saved_flow &sf = flows[(first+count) % flows.size()];
+    sf.key         = flow_key(addr);
+    sf.isn         = isn;
+    sf.name_offset = (uint32_t)at;
+    sf.name_length = (uint32_t)(length-1);
+    digest_bytes -= sf.digests.segments.capacity()*sizeof(segment_index::segment);
+    sf.digests.segments.swap(digests.segments); // the slot's old storage goes with the caller's
+    digest_bytes += sf.digests.segments.capacity()*sizeof(segment_index::segment);
+    count++;
+    index.insert(sf.key,&sf);
+}
+
+void tcpdemux::close_all_fd()
+{
+    for(std::vector<shard *>::const_iterator it = shards.begin();it!=shards.end();it++){
+        shard_demux(*it)->close_all_fd();
+    }
+    if(opt.memory_flow_max){
+        std::vector<tcpip *> flows;     // resident flows aren't in open_flows
+        flow_map.values(flows);
+        for(std::vector<tcpip *>::const_iterator it=flows.begin();it!=flows.end();it++){
+            if((*it)->resident) (*it)->close_file();
+        }
+    }
+    while(open_flows.head){
+	open_flows.head->close_file();  // removes it from open_flows
     }
     assert(open_flows.size()==0);	// we've closed them all
+    drain_writes(-1);                   // and the closes have completed
 }
 
 
 /**
- * find the flow that has been written to in the furthest past and close it.
+ * close the count flows that have been written to in the furthest past.
  */
-void tcpdemux::close_oldest_fd()
+void tcpdemux::close_oldest_fd(size_t count)
 {
-    tcpip *oldest_tcp=0;
-    for(tcpset::iterator it = open_flows.begin();it!=open_flows.end();it++){
-	if(oldest_tcp==0 || (*it)->last_packet_number < oldest_tcp->last_packet_number){
-	    oldest_tcp = (*it);
-	}
+    while(count-- > 0 && open_flows.head){
+        tcpip *tcp = open_flows.head;
+        TCPFLOW_PROBE2(fd_evict,tcp->myflow.id,open_flows.size());
+        tcp->close_file();
+        perf.count(perf_counters::FD_EVICTIONS);
+        if(tcp->sibling && tcp->sibling->has_output() && count>0){ // the connection's other fd goes too
+            count--;
+            tcp->sibling->close_file();
+            perf.count(perf_counters::FD_EVICTIONS);
+        }
+    }
+}
+
+static bool larger_buffer(const tcpip *a,const tcpip *b)
+{
+    return a->wbuf.size() > b->wbuf.size();
+}
+
+/**
+ * flush write-behind buffers, largest first, until they hold no more than
+ * 3/4 of write_buffer_max, so that we aren't back here on the next packet.
+ */
+void tcpdemux::trim_write_buffers()
+{
+    std::vector<tcpip *> by_size(buffered_flows); // copy; flushing modifies buffered_flows
+    std::sort(by_size.begin(),by_size.end(),larger_buffer);
+    for(std::vector<tcpip *>::const_iterator it = by_size.begin();it!=by_size.end();it++){
+        if(buffered_bytes <= opt.write_buffer_max/4*3) break;
+        (*it)->flush_buffer(true);
+    }
+}
+
+size_t tcpdemux::flow_bytes() const
+{
+    return sizeof(tcpip) + opt.straggler_index*sizeof(segment_index::segment) + saved_flow_ring::NAME_BYTES;
+}
+
+uint64_t tcpdemux::memory_used()
+{
+    memory.used[memory_budget::WRITE_BUFFERS] = buffered_bytes;
+    memory.used[memory_budget::FLOWS]         = flow_map.size()*flow_bytes() + flow_map.memory();
+    memory.used[memory_budget::SAVED_FLOWS]   = saved_flows.memory();
+    return memory.total();
+}
+
+static bool larger_reorder_queue(const tcpip *a,const tcpip *b)
+{
+    return a->reorder_bytes > b->reorder_bytes;
+}
+
+static bool larger_head(const tcpip *a,const tcpip *b)
+{
+    return a->head.size() > b->head.size();
+}
+
+static bool seen_earlier(const tcpip *a,const tcpip *b)
+{
+    return timercmp(&a->myflow.tlast,&b->myflow.tlast,<);
+}
+
+/**
+ * Called when the flows hold more than memory_max. Each use in memory_budget
+ * is freed in turn, largest first within each, until they hold no more than
+ * 3/4 of it.
+ */
+void tcpdemux::relieve_memory()
+{
+    uint64_t low = opt.memory_max/4*3;
+    perf.count(perf_counters::MEMORY_RELIEFS);
+    if(!memory_warned){
+        std::stringstream ss;
+        for(int u=0;u<memory_budget::NUM_USES;u++){
+            ss << " " << memory_budget::name((memory_budget::use)u) << "=" << memory.used[u];
+        }
+        fprintf(stderr,"%s: over memory_max (%" PRIu64 " bytes); freeing memory:%s\n",
+                progname,opt.memory_max,ss.str().c_str());
+        memory_warned = true;
+    }
+    while(buffered_flows.size()) buffered_flows.back()->flush_buffer(true);
+    if(memory_used() <= low) return;
+
+    std::vector<tcpip *> flows;
+    flow_map.values(flows);
+    std::sort(flows.begin(),flows.end(),larger_reorder_queue);
+    for(std::vector<tcpip *>::const_iterator it=flows.begin();it!=flows.end() && (*it)->reorder_bytes;it++){
+        (*it)->flush_reorder_queue();
+        if(memory_used() <= low) return;
+    }
+    std::sort(flows.begin(),flows.end(),larger_head);
+    for(std::vector<tcpip *>::const_iterator it=flows.begin();it!=flows.end() && (*it)->holding;it++){
+        (*it)->settle_head();
+        if(memory_used() <= low) return;
+    }
+    std::sort(flows.begin(),flows.end(),seen_earlier);
+    std::vector<flow_addr> addrs;       // a flow's finished sibling is removed with it
+    addrs.reserve(flows.size());
+    for(std::vector<tcpip *>::const_iterator it=flows.begin();it!=flows.end();it++){
+        addrs.push_back((*it)->myflow);
+    }
+    for(std::vector<flow_addr>::const_iterator it=addrs.begin();it!=addrs.end();it++){
+        remove_flow(*it);               // post-processed and saved, as if it had timed out
+        if(memory_used() <= low) return;
+    }
+    while(saved_flows.capacity() > 1 && memory_used() > low){
+        saved_flows.reserve(saved_flows.capacity()/2);
     }
-    if(oldest_tcp) oldest_tcp->close_file();
 }
 
 /* Open a file, closing one of the existing flows f necessary.
  */
 int tcpdemux::retrying_open(const std::string &filename,int oflag,int mask)
 {
+#ifdef HAVE_PTHREAD
+    if(have_scan_worker_key && pthread_getspecific(scan_worker_key)) return ::open(filename.c_str(),oflag,mask);
+#endif
     while(true){
     //Packet index file reduces max_fds by 1/2 as the index files also take a fd
-	if(open_flows.size() >= (opt.output_packet_index ?  max_fds/2 : max_fds)) close_oldest_fd();
-	int fd = ::open(filename.c_str(),oflag,mask);
+        size_t limit = (opt.output_packet_index && !opt.packet_index_binary) ?  max_fds/2 : max_fds;
+        limit = limit > dirs.size() ? limit - dirs.size() : 1; // the held directories count too
+        /* Close a batch of flows at once so that a thrashing ring doesn't pay for
+         * an eviction on every open.
+         */
+	if(open_flows.size() >= limit) close_oldest_fd(std::max((size_t)1,limit/FD_EVICT_FRACTION));
+	int fd = dirs.open(filename,oflag,mask,opt.dir_cache_size);
 	DEBUG(2)("retrying_open ::open(fn=%s,oflag=x%x,mask:x%x)=%d",filename.c_str(),oflag,mask,fd);
 	if(fd>=0){
             /* Open was successful */
@@ -139,7 +736,7 @@ int tcpdemux::retrying_open(const std::string &filename,int oflag,int mask)
 	    return -1;		// wonder what it was
 	}
 	DEBUG(5) ("too many open files -- contracting FD ring (size=%d)", (int)open_flows.size());
-	close_oldest_fd();
+	close_oldest_fd(std::max((size_t)1,open_flows.size()/FD_EVICT_FRACTION));
     }
 }
 
@@ -147,11 +744,7 @@ int tcpdemux::retrying_open(const std::string &filename,int oflag,int mask)
  */
 tcpip *tcpdemux::find_tcpip(const flow_addr &flow)
 {
-    flow_map_t::const_iterator it = flow_map.find(flow);
-    if (it==flow_map.end()){
-	return NULL; // flow not found
-    }
-    return it->second;
+    return flow_map.find(flow);         // NULL if flow not found
 }
 
 /* Create a new flow state structure for a given flow.
@@ -166,24 +759,50 @@ tcpip *tcpdemux::find_tcpip(const flow_addr &flow)
  * the structures themselves. This makes the map slightly more efficient,
  * since it doesn't need to shuffle entire structures.
  *
- *
- * TK: Note that the flow() is created on the stack and then used in new tcpip().
- * This is resulting in an unnecessary copy. 
+ * The tcpip is built in place in storage from tcpip_pool; post_process()
+ * destroys it and gives the storage back.
  */
 
 tcpip *tcpdemux::create_tcpip(const flow_addr &flowa, be13::tcp_seq isn,const be13::packet_info &pi)
 {
     /* create space for the new state */
-    flow flow(flowa,flow_counter++,pi);
-
-    tcpip *new_tcpip = new tcpip(*this,flow,isn);
+    tcpip *new_tcpip = new(tcpip_pool.allocate()) tcpip(*this,flowa,next_flow_id(),pi,isn);
     new_tcpip->nsn   = isn+1;		// expected sequence number of the first byte
     DEBUG(5) ("new flow %s. path: %s next seq num (nsn):%d",
               flowa.str().c_str(),new_tcpip->flow_pathname.c_str(),new_tcpip->nsn);
-    flow_map[flow] = new_tcpip;
+    if(flow_map.capacity()==0) flow_map.reserve(opt.flow_table_size);
+    flow_map.insert(flowa,new_tcpip);
+    pair(new_tcpip);
+    TCPFLOW_PROBE4(flow_create,new_tcpip->myflow.id,flowa.family,flowa.sport,flowa.dport);
     return new_tcpip;
 }
 
+void tcpdemux::pair(tcpip *tcp)
+{
+    const flow_addr &f = tcp->myflow;
+    tcpip *peer = flow_map.find(flow_addr(f.dst,f.src,f.dport,f.sport,f.family));
+    if(peer==0 || peer==tcp || peer->sibling) return;
+    peer->sibling = tcp;
+    tcp->sibling  = peer;
+    if(tcp->dir==tcpip::unknown && peer->dir!=tcpip::unknown){
+        tcp->dir = peer->dir==tcpip::dir_cs ? tcpip::dir_sc : tcpip::dir_cs;
+    }
+}
+
+void tcpdemux::remove_connection(tcpip *tcp)
+{
+    tcpip *peer = tcp->sibling;
+    flow_addr f(tcp->myflow);            // either may be gone once the other is removed
+    flow_addr pf(peer ? peer->myflow : flow_addr());
+    if(peer && peer->dir==tcpip::dir_cs){   // the client's side first
+        remove_flow(pf);
+        remove_flow(f);
+    } else {
+        remove_flow(f);
+        if(peer) remove_flow(pf);
+    }
+}
+
 /**
  * Remove a flow from the database.
  * Close the flow file.
@@ -202,8 +821,20 @@ tcpip *tcpdemux::create_tcpip(const flow_addr &flowa, be13::tcp_seq isn,const be
 
 void tcpdemux::post_process(tcpip *tcp)
 {
+    TCPFLOW_PROBE2(post_process_start,tcp->myflow.id,tcp->last_byte);
+    tcpip *waiting = 0;                 // a finished sibling that was waiting for this flow
+    if(tcp->sibling){
+        if(opt.pair_close && tcp->sibling->finished) waiting = tcp->sibling;
+        tcp->sibling->sibling = 0;
+        tcp->sibling = 0;
+    }
     std::stringstream xmladd;		// for this <fileobject>
-    if(opt.post_processing && tcp->file_created && tcp->last_byte>0){
+    bool scan = opt.post_processing && tcp->file_created && tcp->last_byte>0
+        && container==0;                // the scanners read the flow's file
+#ifdef HAVE_SCAN_POOL
+    scan_pool *pool = master ? master->scans : scans;
+#endif
+    if(scan){
         /** 
          * After the flow is finished, if more than a byte was
          * written, then put it in an SBUF and process it.  if we are
@@ -213,39 +844,101 @@ void tcpdemux::post_process(tcpip *tcp)
 
         /* Open the fd if it is not already open */
         tcp->open_file();
+        bool in_memory = tcp->resident;     // the scanners are given what it held
+#ifdef HAVE_SCAN_POOL
+        if(pool) in_memory = false;         // the workers read the file
+#endif
+        std::string held;
+        if(tcp->fd>=0 || tcp->resident) tcp->settle_head(in_memory ? &held : 0); // the scanners read the file
+        tcp->flush_reorder_queue();
+        tcp->flush_buffer(true);
+        if(tcp->hstream) tcp->hstream->finish(tcp->fd>=0); // before scan_http is called for the flow
+        if(tcp->hashes && tcp->fd>=0) tcp->hashes->finish(tcp->flow_pathname); // and scan_md5
         if(tcp->fd>=0){
-            sbuf_t *sbuf = sbuf_t::map_file(tcp->flow_pathname,tcp->fd);
-            if(sbuf){
-                be13::plugin::process_sbuf(scanner_params(scanner_params::PHASE_SCAN,*sbuf,*(fs),&xmladd));
-                delete sbuf;
-                sbuf = 0;
+            drain_writes(tcp->fd);
+            if(tcp->gz) tcp->gz->sync(tcp->fd); // the scanners read it inflated
+#ifdef HAVE_SCAN_POOL
+            if(pool==0)
+#endif
+            {
+                sbuf_t *sbuf = held.size() ?
+                    new sbuf_t(pos0_t(tcp->flow_pathname),reinterpret_cast<const uint8_t *>(held.data()),held.size(),held.size(),false) :
+                    flow_gzip::map_file(tcp->flow_pathname,tcp->fd);
+                if(sbuf){
+#ifdef HAVE_PTHREAD
+                    demux_lock lock(shared_lock); // scanners are not thread-safe
+#endif
+                    uint64_t start = perf_counters::now_usec();
+                    TCPFLOW_PROBE2(scan_start,tcp->myflow.id,sbuf->bufsize);
+                    scan_flow(*sbuf,xmladd);
+                    TCPFLOW_PROBE2(scan_end,tcp->myflow.id,sbuf->bufsize);
+                    perf.count(perf_counters::FLOWS_SCANNED);
+                    perf.count(perf_counters::SCAN_USEC,perf_counters::now_usec() - start);
+                    delete sbuf;
+                    sbuf = 0;
+                }
             }
+        } else {
+            scan = false;
         }
     }
     tcp->close_file();
-    if(xreport) tcp->dump_xml(xreport,xmladd.str());
+    if(tcp->pindex) tcp->pindex->finish(tcp->flow_pathname + ".bfindx");
+#ifdef HAVE_SCAN_POOL
+    if(pool){
+        pool->submit(*tcp,scan);        // the pool records it when its turn comes
+    } else
+#endif
+    if(xreport || (master ? master->db : db) || (master ? master->catalog : catalog)){
+#ifdef HAVE_PTHREAD
+        demux_lock lock(shared_lock);
+#endif
+        tcp->report(report_scratch,xmladd.str());
+        record_flow(report_scratch);
+    }
     /**
      * Before we delete the tcp structure, save information about the saved flow
      */
     save_flow(tcp);
-    delete tcp;
+    expiry.cancel(tcp);
+    TCPFLOW_PROBE2(post_process_end,tcp->myflow.id,tcp->last_byte);
+    tcp->~tcpip();
+    tcpip_pool.release(tcp);
+
+    /* Whatever removed this flow, the other direction goes right after it */
+    if(waiting) remove_flow(waiting->myflow);
 }
 
 void tcpdemux::remove_flow(const flow_addr &flow)
 {
-    flow_map_t::iterator it = flow_map.find(flow);
-    if(it!=flow_map.end()){
-        post_process(it->second);
-	flow_map.erase(it);
+    tcpip *tcp = flow_map.find(flow);
+    if(tcp){
+	flow_map.erase(flow);           // first, because flow may belong to tcp
+        post_process(tcp);
     }
 }
 
 void tcpdemux::remove_all_flows()
 {
-    for(flow_map_t::iterator it=flow_map.begin();it!=flow_map.end();it++){
-        post_process(it->second);
+    for(std::vector<shard *>::const_iterator it = shards.begin();it!=shards.end();it++){
+        shard_demux(*it)->remove_all_flows();
+    }
+    if(shards.size()){
+        flush_scans();
+        record_held_flows();
+    }
+    std::vector<tcpip *> flows;
+    flow_map.values(flows);
+    std::vector<flow_addr> addrs;       // a flow's finished sibling is removed with it
+    addrs.reserve(flows.size());
+    for(std::vector<tcpip *>::const_iterator it=flows.begin();it!=flows.end();it++){
+        addrs.push_back((*it)->myflow);
+    }
+    for(std::vector<flow_addr>::const_iterator it=addrs.begin();it!=addrs.end();it++){
+        remove_flow(*it);
     }
     flow_map.clear();
+    drain_writes(-1);
 }
 
 /****************************************************************
@@ -320,34 +1013,108 @@ unsigned int tcpdemux::get_max_fds(void)
  */
 void tcpdemux::save_unk_packets(const std::string &ofname,const std::string &ifname)
 {
-    pwriter = pcap_writer::open_copy(ofname,ifname);
+    pwriter = opt.unk_pcapng ? pcap_writer::open_pcapng(ofname,opt.unk_buffer_size)
+                             : pcap_writer::open_copy(ofname,ifname,opt.unk_buffer_size);
+    if(opt.unk_thread && !pwriter->start_thread()){
+        DEBUG(1)("cannot start the -w writer thread; writing packets on this one");
+    }
+}
+
+void tcpdemux::set_datalink(int dlt)
+{
+    if(pwriter) pwriter->set_datalink(dlt);
+}
+
+void tcpdemux::close_unk_packets()
+{
+    if(pwriter) delete pwriter;
+    pwriter = 0;
+}
+
+/*
+ * open the segment files the flows are appended to, instead of a file each
+ */
+void tcpdemux::open_container()
+{
+    if(container || opt.segment_mb==0) return;
+    container = flow_container::open(outdir,(uint64_t)opt.segment_mb*1024*1024);
+    if(container==0) die("cannot create the flow segments in %s",outdir.c_str());
+}
+
+void tcpdemux::close_container()
+{
+    if(container) delete container;
+    container = 0;
+}
+
+bool tcpdemux::open_prefilter(std::string &err)
+{
+    if(opt.prefilter.size()==0 || cidrs) return true;
+    cidrs = cidr_filter::open(opt.prefilter,err);
+    if(cidrs==0) return false;
+    cidr_hits.assign(cidrs->rules.size()+1,0);
+    DEBUG(2)("prefilter: %d rules from %s",(int)cidrs->rules.size(),opt.prefilter.c_str());
+    return true;
+}
+
+bool tcpdemux::open_cpu_layout(const char *device,uint32_t nshards,std::string &err)
+{
+    if(opt.cpus.size()==0 || cpus) return true;
+    cpus = cpu_layout::open(opt.cpus,device,nshards,err);
+    return cpus!=0;
+}
+
+bool tcpdemux::prefiltered(const ipaddr &src,const ipaddr &dst,sa_family_t family)
+{
+    if(cidrs==0) return false;
+    int32_t hit = -1;
+    bool pass = cidrs->pass(src,dst,family,hit);
+    if(hit>=0) cidr_hits[hit]++;
+    if(!pass) perf.count(perf_counters::PREFILTER_DROPS);
+    return !pass;
+}
+
+void tcpdemux::write_prefilter(dfxml_writer &x)
+{
+    if(cidrs==0) return;
+    std::vector<uint64_t> hits(cidr_hits);
+    std::vector<tcpdemux *> demuxes;
+    flow_demuxes(demuxes);
+    for(std::vector<tcpdemux *>::const_iterator it=demuxes.begin();it!=demuxes.end();it++){
+        if(*it==this) continue;
+        for(size_t i=0;i<hits.size();i++) hits[i] += (*it)->cidr_hits[i];
+    }
+    cidrs->write(x,hits);
 }
 
 /**
  * save information on this flow needed to handle strangling packets
  */
-int c = 0;
 void tcpdemux::save_flow(tcpip *tcp)
 {
-    /* First remove the oldest flow if we are in overload */
-    if(saved_flows.size()>0 && saved_flows.size()>max_saved_flows){
-        saved_flow *flow0 = saved_flows.at(0);
-        saved_flow_map.erase(flow0->addr);    // remove from the map
-        saved_flows.erase(saved_flows.begin()); // remove from the vector
-        delete flow0;                           // and delete the saved flow
-    }
-
-    /* Now save the flow */
-    saved_flow *sf = new saved_flow(tcp);
-    saved_flow_map[sf->addr] = sf;
-    saved_flows.push_back(sf);
+    if(saved_flows.capacity()==0) saved_flows.reserve(max_saved_flows); // relieve_memory() may shrink it
+    saved_flows.save(tcp);
 }
 
 
 /**
- * process_tcp():
+ * Choose the process_tcp() for the options. -c (console_output) prints
+ * rather than stores, whatever -FX says; -I (output_packet_index) only
+ * matters when storing.
+ */
+void tcpdemux::select_pipeline()
+{
+    if(opt.console_output)          pipeline = &tcpdemux::process_tcp_as<console_pipeline>;
+    else if(!opt.store_output)      pipeline = &tcpdemux::process_tcp_as<count_pipeline>;
+    else if(opt.output_packet_index) pipeline = &tcpdemux::process_tcp_as<index_pipeline>;
+    else                            pipeline = &tcpdemux::process_tcp_as<store_pipeline>;
+}
+
+/**
+ * process_tcp_as():
  *
- * Called to processes a tcp packet from either process_ip4() or process_ip6().
+ * Called to processes a tcp packet from either process_ip4() or process_ip6(),
+ * through process_tcp() and the pipeline P that select_pipeline() chose.
  * The caller breaks out the ip addresses and finds the start of the tcp header.
  *
  * Skips but otherwise ignores TCP options.
@@ -363,9 +1130,10 @@ void tcpdemux::save_flow(tcpip *tcp)
 #pragma GCC diagnostic ignored "-Wcast-align"
 #include "iptree.h"
 
-int tcpdemux::process_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t family,
-                          const u_char *ip_data, uint32_t ip_payload_len,
-                          const be13::packet_info &pi)
+template <class P>
+int tcpdemux::process_tcp_as(const ipaddr &src, const ipaddr &dst,sa_family_t family,
+                             const u_char *ip_data, uint32_t ip_payload_len,
+                             const be13::packet_info &pi)
 {
     if (ip_payload_len < sizeof(struct be13::tcphdr)) {
 	DEBUG(6) ("received truncated TCP segment! (%u<%u)",
@@ -405,6 +1173,12 @@ int tcpdemux::process_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t famil
     /* If this_flow is not in the database and the start_new_connections flag is false, just return */
     if(tcp==0 && start_new_connections==false) return 0; 
 
+    if(tcp && tcp->finished){            // complete, and waiting for its sibling
+        if(!syn_set) return 0;          // a retransmission
+        remove_connection(tcp);         // the ports are being used again
+        tcp = 0;
+    }
+
     if(syn_set && tcp && tcp->syn_count>0 && tcp->pos>0){
         std::cerr << "SYN TO IGNORE! SYN tcp="<<tcp << " flow="<<this_flow<<"\n";
         return 1;
@@ -421,24 +1195,24 @@ int tcpdemux::process_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t famil
              * matches what is on the disk. If so, return.
              *
              */
-            saved_flow_map_t::const_iterator it = saved_flow_map.find(this_flow);
-            if(it!=saved_flow_map.end()){
-                uint32_t offset = seq - it->second->isn - 1;
-                bool data_match = false;
-                int fd = open(it->second->saved_filename.c_str(),O_RDONLY | O_BINARY);
+            const saved_flow *sf = saved_flows.find(this_flow);
+            if(sf){
+                uint32_t offset = seq - sf->isn - 1;
+                bool data_match = sf->digests.matches(offset,tcp_data,tcp_datalen);
+                int fd = data_match ? -1 : open(saved_flows.filename(*sf),O_RDONLY | O_BINARY);
+                perf.count(data_match ? perf_counters::SAVED_FLOW_MATCHES : perf_counters::SAVED_FLOW_READS);
                 if(fd>0){
                     char *buf = (char *)malloc(tcp_datalen);
                     if(buf){
-                        DEBUG(100)("lseek(fd,%" PRId64 ",SEEK_SET)",(int64_t)(offset));
-                        lseek(fd,offset,SEEK_SET);
-                        ssize_t r = read(fd,buf,tcp_datalen);
+                        DEBUG(100)("pread(fd,%" PRId64 ")",(int64_t)(offset));
+                        ssize_t r = flow_gzip::pread(saved_flows.filename(*sf),fd,(u_char *)buf,tcp_datalen,offset);
                         data_match = (r==(ssize_t)tcp_datalen) && memcmp(buf,tcp_data,tcp_datalen)==0;
                         free(buf);
                     }
                     close(fd);
                 }
                 DEBUG(60)("Packet matches saved flow. offset=%u len=%d filename=%s data match=%d\n",
-                          (u_int)offset,(u_int)tcp_datalen,it->second->saved_filename.c_str(),(u_int)data_match);
+                          (u_int)offset,(u_int)tcp_datalen,saved_flows.filename(*sf),(u_int)data_match);
                 if(data_match) return 0;
             }
         }
@@ -480,16 +1254,31 @@ int tcpdemux::process_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t famil
         /* Don't process if this is not a SYN and there is no data. */
         if(syn_set==false && tcp_datalen==0) return 0;
 
+        /* The other direction decides if it is tracked, since the rate may
+         * have changed since it began.
+         */
+        uint32_t rate = sampling();
+        const tcpip *peer = rate>1 || opt.sample_max ?
+            flow_map.find(flow_addr(dst,src,this_flow.dport,this_flow.sport,family)) : 0;
+        if(peer) rate = peer->sample_rate;
+        else if(sampled_out(this_flow.symmetric_hash(),rate)){
+            perf.count(perf_counters::SAMPLED_OUT);
+            return 0;                   // left out on purpose; not for -w
+        }
+
 	/* Create a new connection.
 	 * delta will be 0, because it's a new connection!
 	 */
         be13::tcp_seq isn = syn_set ? seq : seq-1;
 	tcp = create_tcpip(this_flow, isn, pi);
+        tcp->sample_rate = rate > 1 ? rate : 1;
     }
 
     /* Now tcp is valid */
     tcp->myflow.tlast = pi.ts;		// most recently seen packet
+    if(tcp_timeout) expiry.schedule(tcp,pi.ts.tv_sec + tcp_timeout + 1);
     tcp->last_packet_number = packet_counter++;
+    if(tcp->has_output()) open_flows.touch(tcp);
     tcp->myflow.packet_count++;
 
     /*
@@ -518,6 +1307,9 @@ int tcpdemux::process_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t famil
 	    DEBUG(50) ("packet is handshake SYN/ACK"); /* second packet of three-way handshake  */
 	    tcp->dir = tcpip::dir_sc;	// server->client
 	}
+	if(tcp->sibling && tcp->sibling->dir==tcpip::unknown){
+	    tcp->sibling->dir = tcp->dir==tcpip::dir_cs ? tcpip::dir_sc : tcpip::dir_cs;
+	}
 	if(tcp_datalen>0){
 	    tcp->violations++;
 	    DEBUG(1) ("TCP PROTOCOL VIOLATION: SYN with data! (length=%d)",(int)tcp_datalen);
@@ -530,17 +1322,16 @@ int tcpdemux::process_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t famil
      * since they both have no data by definition.
      */
     if (tcp_datalen>0){
-	if (opt.console_output) {
+	if (P::PRINT) {
 	    tcp->print_packet(tcp_data, tcp_datalen);
-	} else {
-	    if (opt.store_output){
-		tcp->store_packet(tcp_data, tcp_datalen, delta,pi.ts);
-	    }
+	} else if (P::STORE) {
+	    tcp->store_packet<P::INDEX!=0>(tcp_data, tcp_datalen, delta,pi.ts);
 	}
     }
 
     if (rst_set){
-        remove_flow(this_flow);	// take it out of the map  
+        if(opt.pair_close) remove_connection(tcp);
+        else remove_flow(this_flow);	// take it out of the map  
         return 0;
     }
 
@@ -558,8 +1349,15 @@ int tcpdemux::process_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t famil
     DEBUG(50)("%d>0 && %d == %d",tcp->fin_count,tcp->seen_bytes(),tcp->fin_size);
 
     if (tcp->fin_count>0 && tcp->seen_bytes() == tcp->fin_size){
-        DEBUG(50)("all bytes have been received; removing flow");
-        remove_flow(this_flow);	// take it out of the map  
+        if(opt.pair_close && tcp->sibling && !tcp->sibling->finished){
+            DEBUG(50)("all bytes have been received; waiting for the other direction");
+            tcp->finished = true;
+            if(tcp->has_output()) tcp->close_file();
+        } else {
+            DEBUG(50)("all bytes have been received; removing flow");
+            if(opt.pair_close) remove_connection(tcp);
+            else remove_flow(this_flow);	// take it out of the map  
+        }
     }
 
     DEBUG(50)("fin_set=%d  seq=%u fin_count=%d  seq_count=%d len=%d isn=%u",
@@ -631,6 +1429,7 @@ int tcpdemux::process_ip4(const be13::packet_info &pi)
     uint16_t ip_payload_len = ip_len - ip_header_len;
     ipaddr src(ip_header->ip_src.addr);
     ipaddr dst(ip_header->ip_dst.addr);
+    if(prefiltered(src,dst,AF_INET)) return 0; // dropped on purpose; not for -w
     return process_tcp(src, dst, AF_INET,
                        pi.ip_data + ip_header_len, ip_payload_len,
                        pi);
@@ -665,22 +1464,65 @@ int tcpdemux::process_ip6(const be13::packet_info &pi)
     uint16_t ip_payload_len = ntohs(ip_header->ip6_ctlun.ip6_un1.ip6_un1_plen);
     ipaddr src(ip_header->ip6_src.addr.addr8);
     ipaddr dst(ip_header->ip6_dst.addr.addr8);
+    if(prefiltered(src,dst,AF_INET6)) return 0;
     
     return process_tcp(src, dst ,AF_INET6,
                        pi.ip_data + sizeof(struct be13::ip6_hdr),ip_payload_len,pi);
 }
 
+/* Close the flows that have not seen a packet for more than tcp_timeout seconds.
+ * Only the wheel buckets for the seconds since the last call are visited.
+ */
+void tcpdemux::expire_idle_flows(time_t now)
+{
+    std::vector<tcpip *> to_close;
+    expiry.expire(now,to_close);
+    /* Close them. This removes the flows from the flow_map(), which is why we need
+     * to create the list first. Removing a flow can remove its finished sibling
+     * too, so they are removed by address once all have been looked at.
+     */
+    std::vector<flow_addr> expired;
+    for(std::vector<tcpip *>::iterator it = to_close.begin(); it!=to_close.end(); it++){
+        time_t last = (*it)->myflow.tlast.tv_sec;
+        if((*it)->sibling && (*it)->sibling->myflow.tlast.tv_sec > last){
+            last = (*it)->sibling->myflow.tlast.tv_sec; // the connection is still alive
+        }
+        int64_t age = (int64_t)now - (int64_t)last;
+        if (age > (int64_t)tcp_timeout){
+            expired.push_back((*it)->myflow);
+        } else {
+            expiry.schedule(*it,last + tcp_timeout + 1); // moved up when time went backwards
+        }
+    }
+    for(std::vector<flow_addr>::const_iterator it=expired.begin();it!=expired.end();it++){
+        remove_flow(*it);
+    }
+}
+
 /* This is called when we receive an IPv4 or IPv6 datagram.
  * This function calls process_ip4 or process_ip6
  * Returns 0 if packet is processed, 1 if it is not processed, -1 if error.
  */
 
 #pragma GCC diagnostic ignored "-Wcast-align"
-int tcpdemux::process_pkt(const be13::packet_info &pi)
+int tcpdemux::process_pkt(const be13::packet_info &pi,const tcp_segment *seg)
 {
     DEBUG(10)("process_pkt..............................................................................");
+    if(opt.stats_socket.size() && ++stats_ticks >= STATS_TICK_PACKETS) publish_stats();
+    if(opt.sample_max && master==0 && ++sample_ticks >= SAMPLE_TICK_PACKETS) sample_tick();
+    if(shards.size()>0){
+        tcpdemux *bound = getInstance();
+        if(bound!=this) return bound->process_pkt(pi); // fanout capture thread; the kernel chose the shard
+        bool queued = dispatch_to_shard(pi);
+        clock = pi.ts.tv_sec;
+        if(queued) return 0;            // a shard will process it
+    }
+    perf.packet(pi.pcap_dlt,pi.pcap_hdr->caplen);
+    TCPFLOW_PROBE2(packet,pi.pcap_dlt,pi.pcap_hdr->caplen);
     int r = 1;                          // not processed yet
-    switch(pi.ip_version()){
+    if(seg){
+        r = process_tcp(seg->src,seg->dst,seg->family,seg->data,seg->length,pi);
+    } else switch(pi.ip_version()){
     case 4:
         r = process_ip4(pi);
         break;
@@ -690,27 +1532,560 @@ int tcpdemux::process_pkt(const be13::packet_info &pi)
     }
     if(r!=0){                           // packet not processed?
         /* Write the packet if we didn't process it */
-        if(pwriter) pwriter->writepkt(pi.pcap_hdr,pi.pcap_data);
+        if(pwriter){
+#ifdef HAVE_PTHREAD
+            demux_lock lock(shared_lock);
+#endif
+            pwriter->writepkt(pi.pcap_hdr,pi.pcap_data);
+        }
     }
 
     /* Process the timeout, if there is any */
-    if(tcp_timeout){
-        /* Get a list of the flows that need to be closed.  */
-        std::vector<flow_addr *> to_close;
-        for(flow_map_t::iterator it = flow_map.begin(); it!=flow_map.end(); it++){
-            tcpip &tcp = *(it->second);
-            uint32_t age = pi.ts.tv_sec - tcp.myflow.tlast.tv_sec;
-            if (age > tcp_timeout){
-                to_close.push_back(&tcp.myflow);
+    if(tcp_timeout) expire_idle_flows(pi.ts.tv_sec);
+    if(opt.perf_interval && ++perf_ticks >= PERF_TICK_PACKETS) perf_tick();
+    if(opt.memory_max && memory_used() > opt.memory_max) relieve_memory();
+    return r;     
+}
+
+/* Called every PERF_TICK_PACKETS packets, so the clock is read that seldom. */
+void tcpdemux::perf_tick()
+{
+    perf_ticks = 0;
+    uint64_t now = perf_counters::now_usec();
+    if(perf_due==0) perf_due = now + (uint64_t)opt.perf_interval*1000000;
+    if(now < perf_due) return;
+    perf_due = now + (uint64_t)opt.perf_interval*1000000;
+    perf_counters p(perf);
+    p.count(perf_counters::FLOW_LOOKUPS,flow_map.lookups());
+    p.count(perf_counters::FLOW_INSERTS,flow_map.inserts());
+    p.count(perf_counters::FLOW_PROBES,flow_map.probes());
+    p.count(perf_counters::DIR_CACHE_HITS,dirs.hits());
+    p.count(perf_counters::DIR_CACHE_MISSES,dirs.misses());
+    if(master) fprintf(stderr,"%s: shard %u: %s\n",progname,(unsigned)shard_index,p.line().c_str());
+    else       fprintf(stderr,"%s: %s\n",progname,p.line().c_str());
+}
+
+/* Runs on this demux's own thread, so none of what it reads it needs a lock */
+void tcpdemux::publish_stats()
+{
+    stats_ticks = 0;
+    uint64_t packets = 0, bytes = 0;
+    for(size_t i=0;i<perf.dls;i++){
+        packets += perf.dl[i].packets;
+        bytes   += perf.dl[i].bytes;
+    }
+    demux_stats::store(published.packets,packets);
+    demux_stats::store(published.bytes,bytes);
+    demux_stats::store(published.flows_created,flow_counter);
+    demux_stats::store(published.active_flows,flow_map.size());
+    demux_stats::store(published.open_fds,open_flows.size());
+    demux_stats::store(published.max_open_flows,max_open_flows);
+    demux_stats::store(published.saved_flows,saved_flows.size());
+    demux_stats::store(published.write_bytes,perf.n[perf_counters::FILE_WRITE_BYTES]);
+    demux_stats::store(published.flows_scanned,perf.n[perf_counters::FLOWS_SCANNED]);
+    if(live_capture){                   // on the capture thread, as libpcap needs
+        uint64_t now = perf_counters::now_usec()/1000000;
+        struct pcap_stat ps;
+        if(now!=capture_polled && pcap_stats(live_capture,&ps)==0){
+            demux_stats::store(published.capture_received,ps.ps_recv);
+            demux_stats::store(published.capture_dropped,ps.ps_drop);
+            demux_stats::store(published.capture_valid,1);
+        }
+        capture_polled = now;
+    }
+}
+
+/* Called every SAMPLE_TICK_PACKETS packets on the master's thread, which is
+ * the capture thread, as pcap_stats() needs. Looks at the load once a second.
+ */
+void tcpdemux::sample_tick()
+{
+    sample_ticks = 0;
+    uint64_t now = perf_counters::now_usec()/1000000;
+    if(now==sample_checked) return;
+    bool first = sample_checked==0;
+    sample_checked = now;
+
+    bool overloaded = false;
+    bool calm = true;
+    if(live_capture){
+        struct pcap_stat ps;
+        if(pcap_stats(live_capture,&ps)==0){
+            if(!first && ps.ps_drop!=sample_drops) overloaded = true; // dropped since we last looked
+            sample_drops = ps.ps_drop;
+        }
+    }
+#ifdef HAVE_SCAN_POOL
+    if(scans){
+        uint64_t queued = scans->queued();
+        if(queued*4 >= (uint64_t)opt.post_queue_depth*3) overloaded = true;
+        else if(queued*4 > opt.post_queue_depth) calm = false;
+    }
+#endif
+
+    uint32_t base = opt.sample_rate > 1 ? opt.sample_rate : 1;
+    uint32_t n = sample_n > base ? sample_n : base;
+    uint32_t next = n;
+    if(overloaded){
+        sample_calm = 0;
+        if((uint64_t)n*2 <= opt.sample_max) next = n*2;
+    } else if(!calm){
+        sample_calm = 0;
+    } else if(n>base && ++sample_calm >= SAMPLE_CALM_SECONDS){
+        sample_calm = 0;
+        next = n/2;
+    }
+    if(next!=n){
+        DEBUG(1)("keeping 1 in %u flows",(unsigned)next);
+        perf.count(perf_counters::SAMPLE_CHANGES);
+    }
+    __atomic_store_n(&sample_n,next,__ATOMIC_RELAXED);
+}
+
+perf_counters tcpdemux::perf_totals()
+{
+    perf_counters total(perf);
+    std::vector<tcpdemux *> demuxes;
+    flow_demuxes(demuxes);
+    if(shards.size()) demuxes.push_back(this); // the master processes what it couldn't queue
+    for(std::vector<tcpdemux *>::const_iterator it=demuxes.begin();it!=demuxes.end();it++){
+        if(*it!=this) total.add((*it)->perf);
+        total.count(perf_counters::FLOW_LOOKUPS,(*it)->flow_map.lookups());
+        total.count(perf_counters::FLOW_INSERTS,(*it)->flow_map.inserts());
+        total.count(perf_counters::FLOW_PROBES,(*it)->flow_map.probes());
+        total.count(perf_counters::DIR_CACHE_HITS,(*it)->dirs.hits());
+        total.count(perf_counters::DIR_CACHE_MISSES,(*it)->dirs.misses());
+    }
+    return total;
+}
+#pragma GCC diagnostic warning "-Wcast-align"
+
+
+/****************************************************************
+ *** Sharded (multi-threaded) demultiplexing
+ ****************************************************************
+ *
+ * Packets are only valid for the duration of the pcap callback, so the
+ * master copies each one into a batch for its shard. Full batches are
+ * queued to the shard's worker thread; the queue is bounded, so a slow
+ * shard applies back-pressure to the capture loop.
+ */
+
+#ifdef HAVE_PTHREAD
+class tcpdemux::shard {
+    shard(const shard &);
+    shard &operator=(const shard &);
+public:
+    enum { BATCH_PACKETS = 256, MAX_QUEUED_BATCHES = 64,
+           PREFETCH_AHEAD = 16,         // see process()
+           SLACK = 60 };                // zero bytes after each frame; see add()
+
+    struct queued_packet {
+        struct pcap_pkthdr hdr;
+        struct timeval ts;              // packet_info holds a reference, so keep our own
+        int      dlt;
+        time_t   clock;                 // master's clock before this packet; drives tcp_timeout
+        const uint8_t *data;            // pcap_data, in one of the batch's blocks or the stable input
+        const uint8_t *ip;              // ip_data, likewise
+        size_t   ip_len;
+        tcp_segment seg;                // its data moved with the packet
+    };
+    struct flow_lookup {
+        flow_lookup():seg(),key(),hash(0){}
+        tcp_segment seg;                // the queued_packet's, pointing into the batch
+        flow_key key;
+        uint64_t hash;                  // key.hash()
+    };
+    struct batch {
+        batch():pkts(),blocks(),start_new_connections(false){}
+        std::vector<queued_packet> pkts;
+        std::vector<packet_pool::block *> blocks; // that pkts are in, each held once, oldest first
+        bool start_new_connections;     // the master's setting when the batch was filled
+        void release(){
+            for(std::vector<packet_pool::block *>::iterator it=blocks.begin();it!=blocks.end();it++){
+                (*it)->release();
             }
+            blocks.clear();
         }
-        /* Close them. This removes the flows from the flow_map(), which is why we need
-         * to create the list first.
-         */
-        for(std::vector<flow_addr *>::iterator it = to_close.begin(); it!=to_close.end(); it++){
-            remove_flow(*(*it));
+    };
+
+    shard(tcpdemux &master,uint32_t index,uint32_t count):
+        demux(master,index,count),thread(),lock(),work(),room(),idle(),
+        queue(),spare(),filling(0),busy(false),stopping(false),lookups(){
+        pthread_mutex_init(&lock,0);
+        pthread_cond_init(&work,0);
+        pthread_cond_init(&room,0);
+        pthread_cond_init(&idle,0);
+    }
+    ~shard(){
+        while(queue.size()){ queue.front()->release(); delete queue.front(); queue.pop_front(); }
+        for(std::vector<batch *>::iterator it=spare.begin();it!=spare.end();it++) delete *it;
+        if(filling){ filling->release(); delete filling; }
+        pthread_cond_destroy(&idle);
+        pthread_cond_destroy(&room);
+        pthread_cond_destroy(&work);
+        pthread_mutex_destroy(&lock);
+    }
+
+    tcpdemux        demux;
+    pthread_t       thread;
+    pthread_mutex_t lock;               // protects everything below
+    pthread_cond_t  work;               // signaled when a batch is queued or we are stopping
+    pthread_cond_t  room;               // signaled when a batch is dequeued
+    pthread_cond_t  idle;               // signaled when the queue is drained
+    std::deque<batch *>  queue;
+    std::vector<batch *> spare;         // recycled batches
+    batch          *filling;            // batch being filled by the master; not locked
+    bool            busy;               // worker is processing a batch
+    bool            stopping;
+    std::vector<flow_lookup> lookups;   // the worker's; one for each packet of the batch being processed
+
+    /* Copy a packet into the batch being filled; queue the batch when it is full. */
+    void add(const be13::packet_info &pi,const tcp_segment &seg,bool start_new_connections,time_t clock){
+        if(filling==0){
+            demux_lock l(&lock);
+            if(spare.size()){
+                filling = spare.back();
+                spare.pop_back();
+            }
         }
+        if(filling==0) filling = new batch();
+        if(filling->pkts.size()==0) filling->start_new_connections = start_new_connections;
+        if(filling->start_new_connections != start_new_connections){
+            push();                     // don't mix -r and -R packets in a batch
+            add(pi,seg,start_new_connections,clock);
+            return;
+        }
+        queued_packet qp;
+        qp.hdr      = *pi.pcap_hdr;
+        qp.ts       = pi.ts;
+        qp.dlt      = pi.pcap_dlt;
+        qp.clock    = clock;
+        qp.ip_len   = pi.ip_datalen;
+        qp.seg      = seg;
+        size_t caplen = pi.pcap_hdr->caplen;
+        bool ip_in_frame = pi.ip_data>=pi.pcap_data && pi.ip_data+pi.ip_datalen<=pi.pcap_data+caplen;
+        tcpdemux &m = *demux.master;
+        if(ip_in_frame && m.stable_input(pi.pcap_data,caplen)){
+            qp.data = pi.pcap_data;     // good until the master's flush_shards()
+            qp.ip   = pi.ip_data;
+        } else {
+            /* process_ip4() trusts ip_len, so a frame cut short by the snaplen can
+             * have its TCP header read past caplen. Keep such reads inside the block.
+             */
+            size_t len = caplen + (ip_in_frame ? 0 : pi.ip_datalen);
+            packet_pool::block *b = 0;
+            uint8_t *p = m.packets->reserve(len + SLACK,b);
+            memcpy(p,pi.pcap_data,caplen);
+            qp.data = p;
+            if(ip_in_frame){
+                qp.ip = p + (pi.ip_data - pi.pcap_data);
+            } else {
+                qp.ip = p + caplen;     // ip data was not inside the frame; copy it too
+                memcpy(p + caplen,pi.ip_data,pi.ip_datalen);
+            }
+            memset(p + len,0,SLACK);
+            if(filling->blocks.empty() || filling->blocks.back()!=b){
+                b->hold();
+                filling->blocks.push_back(b);
+            }
+        }
+        qp.seg.data = qp.ip + (seg.data - pi.ip_data);
+        filling->pkts.push_back(qp);
+        if(filling->pkts.size()>=BATCH_PACKETS) push();
     }
-    return r;     
+
+    /* Queue the batch being filled if it holds a block the master finished
+     * with long ago, so a quiet shard doesn't keep the pool's blocks from it.
+     */
+    void push_if_stale(uint64_t seq){
+        if(filling && filling->blocks.size() && filling->blocks[0]->seq + packet_pool::MAX_HELD_BLOCKS <= seq){
+            push();
+        }
+    }
+
+    /* Queue the batch being filled, waiting for room if necessary. */
+    void push(){
+        if(filling==0 || filling->pkts.size()==0) return;
+        demux_lock l(&lock);
+        while(queue.size()>=MAX_QUEUED_BATCHES) pthread_cond_wait(&room,&lock);
+        queue.push_back(filling);
+        filling = 0;
+        pthread_cond_signal(&work);
+    }
+
+    void flush(){
+        push();
+        demux_lock l(&lock);
+        while(queue.size()>0 || busy) pthread_cond_wait(&idle,&lock);
+    }
+
+    void stop(){
+        flush();
+        {
+            demux_lock l(&lock);
+            stopping = true;
+            pthread_cond_signal(&work);
+        }
+        pthread_join(thread,0);
+    }
+
+    /* Hash every packet's flow before processing any of them, so the flow
+     * table can be read ahead of find_tcpip(): the slot PREFETCH_AHEAD
+     * packets on, and the tcpip half as far on, by when its slot is in
+     * cache. With a large flow table nearly every lookup would otherwise
+     * start with a cache miss, and so would the flow it found.
+     */
+    void process(batch *b){
+        demux.start_new_connections = b->start_new_connections;
+        size_t n = b->pkts.size();
+        lookups.resize(n);
+        for(size_t i=0;i<n;i++){
+            flow_lookup &l = lookups[i];
+            l.seg      = b->pkts[i].seg;
+            l.key      = flow_key(l.seg.flow());
+            l.hash     = l.key.hash();
+        }
+        for(size_t i=0;i<n && i<PREFETCH_AHEAD;i++){
+            demux.flow_map.prefetch(lookups[i].hash);
+        }
+        for(size_t i=0;i<n;i++){
+            if(i+PREFETCH_AHEAD<n) demux.flow_map.prefetch(lookups[i+PREFETCH_AHEAD].hash);
+            if(i+PREFETCH_AHEAD/2<n) prefetch_flow(lookups[i+PREFETCH_AHEAD/2]);
+            const queued_packet &qp = b->pkts[i];
+            be13::packet_info pi(qp.dlt,&qp.hdr,qp.data,qp.ts,qp.ip,qp.ip_len);
+            /* Time out flows as of the packets that went to other shards, as the
+             * master would have done if it were not sharded.
+             */
+            if(tcp_timeout) demux.expire_idle_flows(qp.clock);
+            demux.process_pkt(pi,&lookups[i].seg);
+        }
+        b->pkts.clear();
+        b->release();
+    }
+
+    void prefetch_flow(const flow_lookup &l) const {
+#ifdef __GNUC__
+        tcpip *t = demux.flow_map.find(l.key,l.hash);
+        if(t) __builtin_prefetch(t);
+#endif
+    }
+
+    static void *run(void *arg){
+        shard *sh = reinterpret_cast<shard *>(arg);
+        pthread_setspecific(current_shard_key,&sh->demux);
+        if(sh->demux.cpus) sh->demux.cpus->pin_shard(sh->demux.shard_index); // before its flows are made
+        pthread_mutex_lock(&sh->lock);
+        while(true){
+            while(sh->queue.size()==0 && !sh->stopping){
+                sh->busy = false;
+                pthread_cond_broadcast(&sh->idle);
+                pthread_cond_wait(&sh->work,&sh->lock);
+            }
+            if(sh->queue.size()==0) break; // stopping, and nothing left to do
+            batch *b = sh->queue.front();
+            sh->queue.pop_front();
+            sh->busy = true;
+            pthread_cond_signal(&sh->room);
+            pthread_mutex_unlock(&sh->lock);
+            sh->process(b);
+            pthread_mutex_lock(&sh->lock);
+            sh->spare.push_back(b);
+        }
+        sh->busy = false;
+        pthread_cond_broadcast(&sh->idle);
+        pthread_mutex_unlock(&sh->lock);
+        sh->demux.close_async_writer(); // while this thread's writes can still complete
+        return 0;
+    }
+};
+#else
+class tcpdemux::shard {
+public:
+    tcpdemux demux;
+};
+#endif
+
+static tcpdemux *shard_demux(tcpdemux::shard *sh)
+{
+    return &sh->demux;
+}
+
+void tcpdemux::start_shards(uint32_t count)
+{
+    if(count<2 || shards.size()>0) return;
+#ifdef HAVE_PTHREAD
+    pthread_key_create(&current_shard_key,0);
+    shared_lock = new pthread_mutex_t;
+    pthread_mutex_init(shared_lock,0);
+    packets = new packet_pool();        // kept, like the shards whose batches hold its blocks
+    for(uint32_t i=0;i<count;i++){
+        shards.push_back(new shard(*this,i,count));
+    }
+    for(uint32_t i=0;i<count;i++){
+        if(pthread_create(&shards[i]->thread,0,shard::run,shards[i])){
+            die("cannot create demux thread %d: %s",(int)i,strerror(errno));
+        }
+    }
+    DEBUG(2)("demultiplexing with %d threads; %d fds per thread",(int)count,(int)shards[0]->demux.max_fds);
+#else
+    die("multi-threaded demultiplexing requires pthreads");
+#endif
+}
+
+void tcpdemux::flush_shards()
+{
+#ifdef HAVE_PTHREAD
+    for(std::vector<shard *>::const_iterator it = shards.begin();it!=shards.end();it++){
+        (*it)->flush();
+    }
+    if(shards.size()){
+        flush_scans();                  // the last of the shards' flows reach record_flow()
+        record_held_flows();
+    }
+#endif
+}
+
+void tcpdemux::stop_shards()
+{
+#ifdef HAVE_PTHREAD
+    if(shards.size()==0) return;
+    for(std::vector<shard *>::const_iterator it = shards.begin();it!=shards.end();it++){
+        (*it)->stop();
+    }
+    flush_scans();
+    record_held_flows();
+    /* The shard objects are kept so their remaining flows can be closed and reported. */
+    flow_counter = 0;
+    max_open_flows = 0;
+    for(std::vector<shard *>::const_iterator it = shards.begin();it!=shards.end();it++){
+        flow_counter   += (*it)->demux.flow_counter;
+        packet_counter += (*it)->demux.packet_counter;
+        max_open_flows += (*it)->demux.max_open_flows; // upper bound; shards peak independently
+    }
+#endif
+}
+
+/*
+ * With PACKET_FANOUT each shard has its own capture thread, and the kernel
+ * has already put both directions of every flow on the same socket. The
+ * capture thread binds itself to the shard so process_pkt() skips the queue.
+ */
+void tcpdemux::bind_thread_to_shard(uint32_t index)
+{
+#ifdef HAVE_PTHREAD
+    if(index>=shards.size()) return;
+    shards[index]->demux.start_new_connections = start_new_connections;
+    pthread_setspecific(current_shard_key,&shards[index]->demux);
+#endif
+}
+
+void tcpdemux::flow_demuxes(std::vector<tcpdemux *> &out)
+{
+    for(std::vector<shard *>::const_iterator it = shards.begin();it!=shards.end();it++){
+        out.push_back(shard_demux(*it));
+    }
+    if(shards.empty()) out.push_back(this);
+}
+
+/* The shard dispatch_to_shard() sends flow's packets to */
+tcpdemux *tcpdemux::demux_for(const flow_addr &flow)
+{
+    if(shards.empty()) return this;
+    return shard_demux(shards[(uint32_t)flow.symmetric_hash() % shards.size()]);
+}
+
+size_t tcpdemux::open_flow_count() const
+{
+    size_t count = open_flows.size();
+    for(std::vector<shard *>::const_iterator it = shards.begin();it!=shards.end();it++){
+        count += shard_demux(*it)->open_flows.size();
+    }
+    return count;
+}
+
+size_t tcpdemux::flow_map_count() const
+{
+    size_t count = flow_map.size();
+    for(std::vector<shard *>::const_iterator it = shards.begin();it!=shards.end();it++){
+        count += shard_demux(*it)->flow_map.size();
+    }
+    return count;
+}
+
+/*
+ * The TCP segment of a packet, as process_tcp() will see it.
+ * Applies the same checks as process_ip4()/process_ip6() before process_tcp()
+ * is reached, and returns false for packets that fail them.
+ */
+#pragma GCC diagnostic ignored "-Wcast-align"
+bool tcpdemux::tcp_segment_of(const be13::packet_info &pi,tcp_segment &seg)
+{
+    switch(pi.ip_version()){
+    case 4: {
+        if (pi.ip_datalen < sizeof(struct be13::ip4)) return false;
+        const struct be13::ip4 *ip_header = (struct be13::ip4 *) pi.ip_data;
+        if (ip_header->ip_p != IPPROTO_TCP) return false;
+        if (ntohs(ip_header->ip_off) & 0x1fff) return false;
+        size_t ip_len = ntohs(ip_header->ip_len);
+        size_t ip_header_len = ip_header->ip_hl * 4;
+        if (ip_header_len > ip_len) return false;
+        seg.length = (uint16_t)(ip_len - ip_header_len);
+        seg.src = ipaddr(ip_header->ip_src.addr);
+        seg.dst = ipaddr(ip_header->ip_dst.addr);
+        seg.family = AF_INET;
+        seg.data = pi.ip_data + ip_header_len;
+        break;
+    }
+    case 6: {
+        if (pi.ip_datalen < sizeof(struct be13::ip6_hdr)) return false;
+        const struct be13::ip6_hdr *ip_header = (struct be13::ip6_hdr *) pi.ip_data;
+        if (ip_header->ip6_ctlun.ip6_un1.ip6_un1_nxt != IPPROTO_TCP) return false;
+        seg.length = ntohs(ip_header->ip6_ctlun.ip6_un1.ip6_un1_plen);
+        seg.src = ipaddr(ip_header->ip6_src.addr.addr8);
+        seg.dst = ipaddr(ip_header->ip6_dst.addr.addr8);
+        seg.family = AF_INET6;
+        seg.data = pi.ip_data + sizeof(struct be13::ip6_hdr);
+        break;
+    }
+    default:
+        return false;
+    }
+    return seg.length >= sizeof(struct be13::tcphdr);
+}
+
+flow_addr tcpdemux::tcp_segment::flow() const
+{
+    const struct be13::tcphdr *tcp_header = (const struct be13::tcphdr *) data;
+    return flow_addr(src,dst,ntohs(tcp_header->th_sport),ntohs(tcp_header->th_dport),family);
+}
+
+/*
+ * Pick the shard for a packet and queue it. Packets that process_tcp()
+ * won't see are left to the master, which rejects them without touching
+ * any flow state.
+ */
+bool tcpdemux::dispatch_to_shard(const be13::packet_info &pi)
+{
+    tcp_segment seg;
+    if(!tcp_segment_of(pi,seg)) return false;
+    if(prefiltered(seg.src,seg.dst,seg.family)) return true; // as good as processed
+    uint64_t hash = seg.flow().symmetric_hash();
+    if(sampled_out(hash,opt.sample_rate)){ // never kept, whatever sample_tick() does
+        perf.count(perf_counters::SAMPLED_OUT);
+        return true;
+    }
+#ifdef HAVE_PTHREAD
+    uint64_t seq = packets->sequence();
+    shards[(uint32_t)hash % shards.size()]->add(pi,seg,start_new_connections,clock);
+    if(packets->sequence()!=seq){       // a new block; see packet_pool.h
+        for(std::vector<shard *>::const_iterator it=shards.begin();it!=shards.end();it++){
+            (*it)->push_if_stale(packets->sequence());
+        }
+    }
+    return true;
+#else
+    return false;
+#endif
 }
 #pragma GCC diagnostic warning "-Wcast-align"
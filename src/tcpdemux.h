@@ -20,10 +20,13 @@
 #include "pcap_writer.h"
 #include "dfxml/src/dfxml_writer.h"
 #include "dfxml/src/hash_t.h"
-
-#if defined(HAVE_SQLITE3_H)
-#include <sqlite3.h>
-#endif
+#include "flow_table.h"
+#include "object_pool.h"
+#include "dir_cache.h"
+#include "memory_budget.h"
+#include "perf_counters.h"
+#include "report_writer.h"
+#include "stats_server.h"
 
 #if defined(HAVE_UNORDERED_MAP)
 # include <unordered_map>
@@ -40,6 +43,95 @@
 
 #include <queue>
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+
+/* Lock a mutex for the lifetime of this object. A null mutex is not locked,
+ * which lets the single-threaded demux skip locking entirely.
+ */
+class demux_lock {
+    demux_lock(const demux_lock &);
+    demux_lock &operator=(const demux_lock &);
+    pthread_mutex_t *m;
+public:
+    demux_lock(pthread_mutex_t *m_):m(m_){ if(m) pthread_mutex_lock(m); }
+    ~demux_lock(){ if(m) pthread_mutex_unlock(m); }
+};
+#endif
+
+/**
+ * The flows that have open files, least recently written first (flows
+ * reopened for post-processing are put first, whatever their age).
+ * The list is threaded through tcpip::ring_prev and tcpip::ring_next, so
+ * touching or closing a flow is O(1) and the flow to close when we run out
+ * of file descriptors is always at the head.
+ */
+class open_flow_ring {
+    open_flow_ring(const open_flow_ring &);
+    open_flow_ring &operator=(const open_flow_ring &);
+    size_t count;
+public:
+    open_flow_ring():count(0),head(0),tail(0){}
+    tcpip  *head;                       // least recently written
+    tcpip  *tail;                       // most recently written
+    size_t size() const { return count; }
+    void   insert(tcpip *tcp);          // at the tail if newest, else at the head; O(1)
+    void   erase(tcpip *tcp);           // does nothing if tcp is not in the ring
+    void   touch(tcpip *tcp);           // tcp was just given a new last_packet_number
+};
+
+/*
+ * An saved_flow is a flow for which all of the packets have been received and tcpip state
+ * has been discarded. The saved_flow allows matches against newly received packets
+ * that are not SYN or ACK packets but have data. We can see if the data matches data that's
+ * been written to disk. To do this we need ot know the filename and the ISN...
+ */
+class saved_flow {
+public:
+    saved_flow():key(),isn(0),name_offset(0),name_length(0),digests(){}
+    flow_key          key;              // flow address
+    be13::tcp_seq     isn;              // the flow's ISN
+    uint32_t          name_offset;      // where the flow was saved, in saved_flow_ring::names
+    uint32_t          name_length;
+    segment_index     digests;          // the last segments written to the file
+};
+
+/**
+ * The most recently saved flows, in a ring of fixed capacity; saving a flow
+ * when the ring is full forgets the oldest one. The filenames are stored
+ * end to end in a second ring, names, which wraps in the same order. Neither
+ * saving nor forgetting a flow allocates memory once the rings are sized,
+ * except when a run of long filenames makes names grow.
+ */
+class saved_flow_ring {
+    saved_flow_ring(const saved_flow_ring &);
+    saved_flow_ring &operator=(const saved_flow_ring &);
+    std::vector<saved_flow> flows;
+    size_t first;                       // the oldest flow
+    size_t count;
+    std::vector<char> names;            // NUL-terminated
+    size_t names_end;                   // where the next name goes
+    size_t digest_bytes;                // held by the flows' digests, including cleared ones
+    flow_table<saved_flow *> index;     // the newest flow saved for each address
+
+    bool name_fits(size_t length,size_t &at) const;
+    void grow_names(size_t length);
+    void forget_oldest();
+public:
+    saved_flow_ring():flows(),first(0),count(0),names(),names_end(0),digest_bytes(0),index(){}
+    enum { NAME_BYTES=64 };             // expected filename length, for sizing names
+
+    void   reserve(size_t capacity);   // forgets every saved flow
+    size_t capacity() const { return flows.size(); }
+    size_t size() const { return count; }
+    size_t memory() const;              // bytes held, for memory_budget
+    void   save(tcpip *tcp);            // takes tcp->digests
+    void   save(const flow_addr &addr,be13::tcp_seq isn,const std::string &name,segment_index &digests); // takes digests
+    const saved_flow &at(size_t i) const { return flows[(first+i) % flows.size()]; } // the ith oldest
+    const saved_flow *find(const flow_addr &addr) const { return index.find(addr); }
+    const char *filename(const saved_flow &sf) const { return &names[sf.name_offset]; }
+};
+
 /**
  * the tcp demultiplixer
  * This is a singleton class; we only need a single demultiplexer.
@@ -51,49 +143,63 @@ class tcpdemux {
 
     /* see http://mikecvet.wordpress.com/tag/hashing/ */
     typedef struct {
-        long operator() (const flow_addr &k) const {return k.hash(); }
+        long operator() (const flow_addr &k) const {return flow_key(k).hash(); }
     } flow_addr_hash;
 
     typedef struct {
         bool operator() (const flow_addr &x, const flow_addr &y) const { return x==y;}
     } flow_addr_key_eq;
 
-#ifdef HAVE_TR1_UNORDERED_MAP
-    typedef std::tr1::unordered_set<class tcpip *> tcpset;
-    typedef std::tr1::unordered_map<flow_addr,tcpip *,flow_addr_hash,flow_addr_key_eq> flow_map_t; // active flows
-    typedef std::tr1::unordered_map<flow_addr,saved_flow *,flow_addr_hash,flow_addr_key_eq> saved_flow_map_t; // flows that have been saved
-#else
-    typedef std::unordered_set<class tcpip *> tcpset;
-    typedef std::unordered_map<flow_addr,tcpip *,flow_addr_hash,flow_addr_key_eq> flow_map_t; // active flows
-    typedef std::unordered_map<flow_addr,saved_flow *,flow_addr_hash,flow_addr_key_eq> saved_flow_map_t; // flows that have been saved
-#endif
-    typedef std::vector<class saved_flow *> saved_flows_t; // needs to be ordered
+    typedef flow_table<tcpip *> flow_map_t; // active flows
+
+    /* A TCP segment as process_tcp() takes it: its addresses, and its header
+     * and payload within the packet. tcp_segment_of() finds it, once; the
+     * master keeps it with each packet it queues to a shard, so the shard
+     * starts at process_tcp() rather than parsing the IP header again.
+     */
+    struct tcp_segment {
+        tcp_segment():src(),dst(),family(0),data(0),length(0){}
+        ipaddr        src;
+        ipaddr        dst;
+        sa_family_t   family;
+        const u_char *data;             // the TCP header
+        uint32_t      length;           // of the header and payload; at least a tcphdr
+        flow_addr flow() const;
+    };
 
 
     tcpdemux();
-#ifdef HAVE_SQLITE3
-    sqlite3 *db;
-    sqlite3_stmt *insert_flow;
-#endif
+    tcpdemux(tcpdemux &master,uint32_t shard_index,uint32_t shard_count); // a shard of master
 
 public:
     static uint32_t tcp_timeout;
     static unsigned int get_max_fds(void);             // returns the max
-    virtual ~tcpdemux(){
-        if(xreport) delete xreport;
-        if(pwriter) delete pwriter;
-    }
+    virtual ~tcpdemux();
 
     /* The pure options class means we can add new options without having to modify the tcpdemux constructor. */
     class options {
     public:;
         enum { MAX_SEEK=1024*1024*16 };
+        enum { DEFAULT_WRITE_BUFFER_MAX=1024*1024*64 };
+        enum { DEFAULT_STRAGGLER_INDEX=0 };  // opt-in: every write would be hashed, and every flow hold the digests
+        enum { DEFAULT_FLOW_DB_BATCH=1000, DEFAULT_FLOW_DB_BATCH_MS=1000 };
+        enum { DEFAULT_POST_QUEUE_DEPTH=64 };
         options():console_output(false),store_output(true),opt_md5(false),
                   post_processing(false),gzip_decompress(true),
                   max_bytes_per_flow(),
                   max_flows(0),suppress_header(0),
                   output_strip_nonprint(true),output_hex(false),use_color(0),
-                  output_packet_index(false),max_seek(MAX_SEEK) {
+                  output_packet_index(false),packet_index_binary(false),max_seek(MAX_SEEK),
+                  write_buffer_size(0),write_buffer_max(DEFAULT_WRITE_BUFFER_MAX),
+                  reorder_queue_max(0),prefix_hold_max(0),memory_flow_max(0),flow_table_size(0),
+                  io_uring_depth(0),straggler_index(DEFAULT_STRAGGLER_INDEX),
+                  flow_db(),flow_db_batch(DEFAULT_FLOW_DB_BATCH),flow_db_batch_ms(DEFAULT_FLOW_DB_BATCH_MS),
+                  flow_db_wal(false),post_workers(0),post_queue_depth(DEFAULT_POST_QUEUE_DEPTH),
+                  post_queue_skip(false),scan_threads(0),http_stream(false),flow_hashes(0),console_batch(0),
+                  console_splice(true),unk_pcapng(false),unk_buffer_size(pcap_writer::DEFAULT_BUFFER_SIZE),unk_thread(false),
+                  segment_mb(0),flow_gzip(0),perf_interval(0),memory_max(0),
+                  stats_socket(),stats_interval(0),prefilter(),
+                  pair_close(false),cpus(),sample_rate(0),sample_max(0),catalog(),dir_cache_size(dir_cache::DEFAULT_CAPACITY) {
         }
         bool    console_output;
         bool    store_output;   // do we output?
@@ -108,10 +214,53 @@ public:
         bool    use_color;
         bool    output_packet_index;    // Generate a packet index file giving the timestamp and location
                                         // bytes written to the flow file.
+        bool    packet_index_binary;    // write it in the packet_index format rather than as text
         int32_t max_seek;               // signed becuase we compare with abs()
+        uint32_t write_buffer_size;     // per-flow write-behind buffer; 0 writes each packet as it arrives
+        uint64_t write_buffer_max;      // flush the largest buffers when they hold more than this in total
+        uint32_t reorder_queue_max;     // per-flow bytes of out-of-order data held until the gap fills
+        uint32_t prefix_hold_max;       // keep up to this much of a SYN-less flow in memory
+        uint32_t memory_flow_max;       // keep new flows in memory until this large, then create the file
+        uint32_t flow_table_size;       // active flows to make room for before the first packet
+        uint32_t io_uring_depth;        // flow-file writes in flight through io_uring; 0 writes synchronously
+        uint32_t straggler_index;       // segment digests kept per flow for matching stragglers; 0 for none
+        std::string flow_db;            // SQLite file in outdir with a row per finished flow; empty for none
+        uint32_t flow_db_batch;         // flow records per transaction
+        uint32_t flow_db_batch_ms;      // commit a partial batch after this long
+        bool    flow_db_wal;            // put the database in write-ahead-log mode
+        uint32_t post_workers;          // threads running the post-processing scanners; 0 runs them in post_process
+        uint32_t post_queue_depth;      // closed flows that may wait for or be in a scan
+        bool    post_queue_skip;        // when that many are, record a flow unscanned rather than wait
+        uint32_t scan_threads;          // threads to run each flow's scanners on at once; see scan_fanout.h
+        bool    http_stream;            // give each new flow an http_stream; see scan_http.h
+        uint32_t flow_hashes;           // digests to compute as each new flow is written; see flow_hash.h
+        uint32_t console_batch;         // bytes of console output to write at once; 0 prints each packet itself
+        bool    console_splice;         // vmsplice() -cB payloads from the mapped -r file when stdout is a pipe
+        bool    unk_pcapng;             // write -w packets as pcapng rather than classic pcap
+        uint32_t unk_buffer_size;       // bytes of -w packets to write at once
+        bool    unk_thread;             // write them from a thread of their own
+        uint32_t segment_mb;            // append the flows to segment files of this many MiB; 0 for a file each
+        uint32_t flow_gzip;             // compress each flow's file at this zlib level; 0 writes them raw
+        uint32_t perf_interval;         // seconds between each demux's perf_counters on stderr; 0 for none
+        uint64_t memory_max;            // bytes the flows may hold before relieve_memory(); 0 for no limit
+        std::string stats_socket;       // Unix socket to serve live statistics on; empty for none
+        uint32_t stats_interval;        // seconds between objects to each stats client; 0 sends one
+        std::string prefilter;          // file of prefixes to allow and deny; see cidr_filter.h
+        bool    pair_close;             // post-process the directions of a connection together; see pair()
+        std::string cpus;               // CPUs to pin the threads to, or "auto"; see cpu_layout.h
+        uint32_t sample_rate;           // keep 1 in this many connections; 0 or 1 keeps them all; see sampling()
+        uint32_t sample_max;            // raise sample_rate as far as this under load; 0 doesn't
+        std::string catalog;            // binary catalog of the flows in outdir; empty for none; see flow_catalog.h
+        uint32_t dir_cache_size;        // flow-file directories each demux holds open; 0 for none; see dir_cache.h
     };
 
     enum { WARN_TOO_MANY_FILES=10000};  // warn if more than this number of files in a directory
+    enum { FD_EVICT_FRACTION=32 };      // out of fds? close this fraction of the open flows at once
+    enum { PERF_TICK_PACKETS=1024 };    // with perf_interval, look at the clock this often
+    enum { STATS_TICK_PACKETS=64 };     // with stats_socket, update published this often
+    enum { SAMPLE_TICK_PACKETS=1024 };  // with sample_max, look at the clock this often
+    enum { SAMPLE_CALM_SECONDS=10 };    // halve the sampling rate after this long without load
+    enum { MAX_HELD_REPORTS=65536 };    // with shards, record the held reports once there are this many
 
     std::string outdir;                 /* output directory */
     uint64_t    flow_counter;           // how many flows have we seen?
@@ -121,22 +270,150 @@ public:
     unsigned int max_open_flows;        // how large did it ever get?
     unsigned int max_fds;               // maximum number of file descriptors for this tcpdemux
 
+    object_pool<tcpip> tcpip_pool;      // storage for the tcpip objects in flow_map
     flow_map_t  flow_map;               // db of open tcpip objects, indexed by flow
-    tcpset      open_flows;              // the tcpip flows with open files
+    open_flow_ring open_flows;           // the tcpip flows with open files
+    dir_cache   dirs;                    // what retrying_open() opens files through
+    timer_wheel<tcpip> expiry;          // flows by when they time out; only used with tcp_timeout
+    std::vector<tcpip *> buffered_flows; // flows with data in their write-behind buffer
+    uint64_t    buffered_bytes;          // data held in those buffers
+    class uring_writer *uring;           // see async_writer()
+    class flow_db *db;                   // see openDB(); only the master's is used
+    class flow_catalog *catalog;         // see open_catalog(); only the master's is used
+    class report_writer *reports;        // writes xreport on its own thread; only the master's is used
+    class scan_pool *scans;              // runs the post-processing scanners; only the master's is used
+    class scan_fanout *fanout;           // runs a flow's scanners at once; only the master's is used
+    flow_report report_scratch;          // reused by post_process() when there is no scan_pool
+    std::string console_buf;             // reused by print_packet()
+    class console_writer *console;       // prints packets on its own thread; shared with the shards, like pwriter
+    class console_chunk *console_spares; // this demux's chunks for print_packet() to fill
+    class console_splice *splice;        // hands -cB payloads to a pipe; only the master's is used
+    class flow_container *container;     // see open_container(); shared with the shards, like pwriter
+    class gzip_codec *gz_codec;          // see gzip()
+    class cidr_filter *cidrs;            // see open_prefilter(); shared with the shards, like pwriter
+    class cpu_layout *cpus;              // see open_cpu_layout(); shared with the shards
+    std::vector<uint64_t> cidr_hits;     // this demux's, by cidr_filter::pass()'s hit
 
-    saved_flow_map_t saved_flow_map;  // db of saved flows, indexed by flow
-    saved_flows_t    saved_flows;     // the flows that were saved
+    saved_flow_ring  saved_flows;     // the flows that were saved, sized on first use
     bool             start_new_connections;  // true if we should start new connections
 
     options     opt;
     class       feature_recorder_set *fs; // where features extracted from each flow should be stored
     
-    static uint32_t max_saved_flows;       // how many saved flows are kept in the saved_flow_map
-    static tcpdemux *getInstance();
+    static uint32_t max_saved_flows;       // how many saved flows are kept in saved_flows
+    static tcpdemux *getInstance();        // the shard running on this thread, or the master
+
+    /* Sharding.
+     * With -j N the master demux does not track flows itself. It parses just
+     * enough of each TCP packet to compute flow_addr::symmetric_hash(), copies
+     * the packet into a shared block (see packet_pool.h), or not at all for a
+     * mapped -r file, and hands it to one of N shards, each a complete tcpdemux with
+     * its own flow_map, open_flows, fd budget and saved flows, running on its
+     * own thread. Both directions of a connection land on the same shard, so
+     * every flow is reassembled exactly as in single-threaded mode.
+     *
+     * Flow ids are assigned deterministically as (shard-local count * N + shard).
+     * Which shard finishes a flow first is up to the threads, so when the
+     * input is files the master holds the shards' reports and records them
+     * by id at each flush_shards(); see record_flow().
+     */
+    class shard;                        // worker thread and queue; see tcpdemux.cpp
+    tcpdemux   *master;                  // the demux that owns this shard; 0 for the master
+    uint32_t    shard_index;             // this shard's position in master->shards
+    uint32_t    shard_count;             // number of shards; 1 when not sharded
+    std::vector<shard *> shards;         // only the master has shards
+    std::vector<flow_report> held_reports; // master: the shards' finished flows, not yet recorded
+    bool        order_reports;           // master: hold them; set for -r and -R, before start_shards()
+    class packet_pool *packets;          // master: the blocks queued packets are copied into; see packet_pool.h
+    const uint8_t *stable_base;          // master: see set_stable_input()
+    size_t      stable_len;
+    time_t      clock;                   // master: time of the latest packet handed to process_pkt
+    perf_counters perf;                  // counted by this demux's thread; see perf_counters.h
+    uint32_t    perf_ticks;              // packets since perf_interval was last checked
+    uint64_t    perf_due;                // when this demux next prints perf to stderr
+    memory_budget memory;                // what this demux's flows hold; see memory_budget.h
+    bool        memory_warned;           // relieve_memory() has said so on stderr
+    demux_stats published;               // for the stats server; see stats_server.h
+    uint32_t    stats_ticks;             // packets since published was updated
+    uint64_t    capture_polled;          // when pcap_stats() was last asked, in seconds
+    pcap_t     *live_capture;            // master: the libpcap live capture, for publish_stats()
+    class stats_server *stats;           // only the master's is used
+    uint32_t    sample_n;                // master: the sampling rate sample_tick() has set; see sampling()
+    uint32_t    sample_ticks;            // packets since sample_tick()
+    uint64_t    sample_checked;          // when sample_tick() last looked, in seconds
+    uint64_t    sample_drops;            // the capture's drop count then
+    uint32_t    sample_calm;             // seconds in a row without load
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t *shared_lock;        // serializes xreport, pwriter, scanners and console output; 0 if unsharded
+#endif
+    void  start_shards(uint32_t count);  // called once after option processing
+    void  flush_shards();                // wait until every shard has processed all queued packets
+    void  stop_shards();                 // flush, stop the threads and fold shard counters into ours
+    size_t open_flow_count() const;      // open_flows.size(), summed over shards
+    size_t flow_map_count() const;       // flow_map.size(), summed over shards
+    uint64_t next_flow_id();             // allocates the id for a new flow
+    void  bind_thread_to_shard(uint32_t index); // packets from this thread go straight to that shard
+    /** Packets in [base,base+len) stay put until flush_shards(), so they are queued without a copy; 0 for none */
+    void  set_stable_input(const uint8_t *base,size_t len){ stable_base = base; stable_len = base ? len : 0; }
+    bool  stable_input(const uint8_t *p,size_t len) const {
+        return p>=stable_base && len<=stable_len && (size_t)(p-stable_base)<=stable_len-len;
+    }
+    void  flow_demuxes(std::vector<tcpdemux *> &out); // those that track flows: the shards, or just this one
+    perf_counters perf_totals();         // after stop_shards(): ours, the shards' and the flow tables'
+    void  perf_tick();                   // print perf if perf_interval has passed
+    void  publish_stats();               // copy our counters into published
+    void  start_stats_server();          // after start_shards(), with -S stats_socket
+    void  stop_stats_server();           // before stop_shards()
+    tcpdemux *demux_for(const flow_addr &flow); // the one of them that tracks flow
+
+    /* Flow sampling.
+     * With -S sample_rate=N, a connection is kept only if the high half of
+     * its symmetric_hash() is a multiple of N, so both directions are kept
+     * or left out together, and a shard (chosen by the low half) sees as
+     * many kept flows as any other. Only the start of a flow is sampled; a
+     * flow already being tracked is kept to its end, and a flow whose other
+     * direction is tracked is kept too, at that direction's rate, since
+     * sample_max may have moved the rate in between. An overloaded sensor
+     * then captures fewer flows whole, rather than many with holes.
+     *
+     * With -S sample_max=M, the master's sample_tick() doubles the rate,
+     * up to M, in any second in which libpcap reports drops or the
+     * post-processing queue is 3/4 full, and halves it, down to
+     * sample_rate, after SAMPLE_CALM_SECONDS without either. Since the rate
+     * is always sample_rate times a power of two, a flow kept at one rate
+     * is kept at any lower one. Each flow's report.xml entry records the rate it was kept at.
+     * With -j the master leaves out what sample_rate would, before queuing;
+     * the shards do the rest.
+     */
+    uint32_t sampling() const {          // the rate for a new flow, on any demux
+        uint32_t n = __atomic_load_n(master ? &master->sample_n : &sample_n,__ATOMIC_RELAXED);
+        return n > opt.sample_rate ? n : opt.sample_rate;
+    }
+    static bool sampled_out(uint64_t symmetric_hash,uint32_t rate){
+        return rate>1 && (symmetric_hash >> 32) % rate != 0;
+    }
+    void  sample_tick();                 // master, with sample_max: adjust sample_n
+
+    void  start_report_writer();         // once xreport is set
+    void  stop_report_writer();          // write the queued fileobjects; xreport is ours again
+    void  start_console_writer();        // before start_shards(), with -S console_batch
+    void  stop_console_writer();         // after stop_shards(); print what is queued
+    void  start_scan_pool();             // once fs is set, if opt.post_workers or opt.scan_threads
+    static void mark_scan_worker();      // called on each scan_pool thread
+    void  flush_scans();                 // wait for the queued scans; before the scanners shut down
+    void  stop_scan_pool();              // record every queued flow and stop the workers
+    void  scan_flow(const sbuf_t &sbuf,std::stringstream &xmladd); // the scanners, on the fanout if there is one
+    void  record_flow(const flow_report &fr); // to report.xml, the flow database and the catalog, in that order
+    void  record_held_flows();           // the shards' held reports, by flow id; when no shard is running
+    void  record_report(const flow_report &fr); // what record_flow() does, now
+    static size_t report_bytes(const flow_report &fr); // what a held report holds, for memory_budget
 
-    /* Databse */
+    /* Database */
 
-    void  openDB();                    // open the database file if we are using it in outdir directory.
+    void  openDB();                    // open opt.flow_db in outdir, if it is set
+    void  closeDB();                   // commit the queued records and close it
+    void  open_catalog();              // open opt.catalog in outdir, if it is set
+    void  close_catalog();             // write its indexes and close it
     void  write_flow_record(const std::string &starttime,const std::string &endtime,
                             const std::string &src_ipn,const std::string &dst_ipn,
                             const std::string &mac_daddr,const std::string &mac_saddr,
@@ -145,13 +422,29 @@ public:
 
 
     void  save_unk_packets(const std::string &wfname,const std::string &ifname);
+    void  set_datalink(int dlt);         // of the packets from the next input, for -w
+    void  close_unk_packets();           // after stop_shards(); writes what is buffered
                                        // save unknown packets at this location
     void  post_process(tcpip *tcp);    // just before closing; writes XML and closes fd
+    void  open_container();              // with -S segment_mb, once outdir is set and before start_shards()
+    void  close_container();             // after close_all_fd(); writes the index of what is still open
+    bool  open_prefilter(std::string &err); // opt.prefilter, before start_shards(); false if it can't be read
+    bool  prefiltered(const ipaddr &src,const ipaddr &dst,sa_family_t family); // true if the packet is dropped
+    void  write_prefilter(dfxml_writer &x); // after stop_shards(); the rules' hits, if there is a prefilter
+    bool  open_cpu_layout(const char *device,uint32_t nshards,std::string &err); // opt.cpus, before any thread starts
 
     /* management of open fds and in-process tcpip flows*/
     void  close_all_fd();
     void  close_tcpip_fd(tcpip *);         
-    void  close_oldest_fd();
+    void  close_oldest_fd(size_t count=1);
+    void  trim_write_buffers();               // flush the largest write buffers until under write_buffer_max
+    size_t flow_bytes() const;                // memory_budget's estimate of what a tcpip holds
+    uint64_t memory_used();                   // memory.total(), with the uses it doesn't count updated
+    void  relieve_memory();                   // free memory, use by use, until under 3/4 of memory_max
+    class uring_writer *async_writer();       // 0 unless io_uring_depth is set and io_uring works
+    void  drain_writes(int fd);               // let fd's queued writes finish before touching the file
+    void  close_async_writer();               // drain and close the ring, on its thread; later writes are synchronous
+    class gzip_codec *gzip();                 // compresses this demux's flows with -S flow_gzip; made on first use
     void  remove_flow(const flow_addr &flow); // remove a flow from the database, closing open files if necessary
     void  remove_all_flows();                 // stop processing all tcpip connections
 
@@ -162,21 +455,70 @@ public:
     tcpip *create_tcpip(const flow_addr &flow, be13::tcp_seq isn, const be13::packet_info &pi);
     tcpip *find_tcpip(const flow_addr &flow);
 
+    /* The two directions of a connection.
+     * When a flow is created, the other direction is looked up once; if it is
+     * there, each becomes the other's sibling, and each reaches the other
+     * through the pointer from then on. A pair:
+     * - learns its direction from either side's SYN or SYN/ACK;
+     * - times out only when neither direction has seen a packet for
+     *   tcp_timeout, so a quiet side isn't closed under a busy one;
+     * - gives up its files together when fds run short.
+     * With -S pair_close=1, a direction that is complete while its sibling
+     * isn't is marked finished and gives up its file but waits; when the
+     * sibling completes, or a RST ends the connection, both are
+     * post-processed one after the other, the client's side first, so the
+     * scanners and report.xml see a connection's request and response
+     * together. However else the sibling is removed (max_seek, timeout,
+     * memory_max), post_process() takes a finished direction right after
+     * it. Packets for a finished direction are ignored unless they start a
+     * new connection.
+     */
+    void   pair(tcpip *tcp);                 // with its sibling, if that is in flow_map
+    void   remove_connection(tcpip *tcp);    // remove tcp and its sibling, in the pair_close order
+
     /* saved flows are completed flows that we remember in case straggling packets
      * show up. Remembering the flows lets us resolve the packets rather than creating
      * new flows.
      */
     void  save_flow(tcpip *);
 
+    /* Packet pipelines.
+     * What process_tcp() does with a segment's data depends on options that
+     * are set before the first packet and never change: print it, store it,
+     * store it and index it, or neither (-FX, which just counts flows).
+     * Each is a policy below, and process_tcp_as<P>() is compiled once for
+     * each, so the per-packet tests of those options become constants.
+     * select_pipeline() picks one after option processing; a shard uses
+     * the master's.
+     */
+    struct console_pipeline { enum { PRINT=1, STORE=0, INDEX=0 }; };
+    struct store_pipeline   { enum { PRINT=0, STORE=1, INDEX=0 }; };
+    struct index_pipeline   { enum { PRINT=0, STORE=1, INDEX=1 }; };
+    struct count_pipeline   { enum { PRINT=0, STORE=0, INDEX=0 }; };
+    typedef int (tcpdemux::*tcp_pipeline)(const ipaddr &src, const ipaddr &dst,sa_family_t family,
+                                          const u_char *tcp_data, uint32_t tcp_length,
+                                          const be13::packet_info &pi);
+    tcp_pipeline pipeline;               // a process_tcp_as<>(); see select_pipeline()
+    void  select_pipeline();             // after option processing and before start_shards()
+    template <class P>
+    int  process_tcp_as(const ipaddr &src, const ipaddr &dst,sa_family_t family,
+                        const u_char *tcp_data, uint32_t tcp_length,
+                        const be13::packet_info &pi);
+
     /** packet processing.
      * Each returns 0 if processed, 1 if not processed, -1 if error.
      */
     int  process_tcp(const ipaddr &src, const ipaddr &dst,sa_family_t family,
                      const u_char *tcp_data, uint32_t tcp_length,
-                     const be13::packet_info &pi);
+                     const be13::packet_info &pi){
+        return (this->*pipeline)(src,dst,family,tcp_data,tcp_length,pi);
+    }
     int  process_ip4(const be13::packet_info &pi);
     int  process_ip6(const be13::packet_info &pi);
-    int  process_pkt(const be13::packet_info &pi);
+    int  process_pkt(const be13::packet_info &pi,const tcp_segment *seg=0); // seg: already found in pi
+    void expire_idle_flows(time_t now);       // close flows idle for more than tcp_timeout
+    bool dispatch_to_shard(const be13::packet_info &pi); // true if the packet was queued to a shard
+    static bool tcp_segment_of(const be13::packet_info &pi,tcp_segment &seg); // false if process_tcp() won't see it
 };
 
 
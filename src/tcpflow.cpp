@@ -17,6 +17,16 @@
 #include "tcpdemux.h"
 #include "bulk_extractor_i.h"
 #include "iptree.h"
+#include "pcap_reader.h"
+#include "gzip_input.h"
+#include "pcap_merge.h"
+#include "demux_checkpoint.h"
+#include "demux_bench.h"
+#include "console_output.h"
+#include "tpacket_capture.h"
+#include "scan_http.h"
+#include "flow_hash.h"
+#include "cpu_layout.h"
 
 #include "be13_api/utils.h"
 
@@ -75,6 +85,15 @@ scanner_t *scanners_builtin[] = {
     0};
 
 bool opt_no_promisc = false;		// true if we should not use promiscious mode
+static bool opt_pcap_mmap = true;	// read -r files with pcap_reader when we can
+static uint32_t opt_inflate_threads = 0; // for a BGZF -r file; 0 for one per processor
+static bool opt_merge_inputs = false;   // read the -r files at once, merged by timestamp
+static std::string opt_checkpoint;      // save the flows still open at exit here
+static std::string opt_restore;         // carry on with the flows saved here
+#define DEFAULT_TPACKET_RING_MB 32
+static uint32_t opt_tpacket_ring_mb = DEFAULT_TPACKET_RING_MB; // per socket; 0 captures with pcap_open_live
+static uint32_t opt_bench_loops = 0;    // replay the -r files from memory this many times; see demux_bench.h
+static uint64_t opt_bin_dirs = 0;       // flows whose %K/%M/%G directories are made at startup
 
 /****************************************************************
  *** USAGE
@@ -84,7 +103,7 @@ static void usage(int level)
 {
     std::cout << PACKAGE_NAME << " version " << PACKAGE_VERSION << "\n\n";
     std::cout << "usage: " << progname << " [-aBcCDhJpsvVZ] [-b max_bytes] [-d debug_level] \n";
-    std::cout << "     [-[eE] scanner] [-f max_fds] [-F[ctTXMkmg]] [-i iface] [-L semlock]\n";
+    std::cout << "     [-[eE] scanner] [-f max_fds] [-F[ctTXMkmg]] [-i iface] [-j threads] [-L semlock]\n";
     std::cout << "     [-m min_bytes] [-o outdir] [-r file] [-R file] \n";
     std::cout << "     [-S name=value] [-T template] [-w file] [-x scanner] [-X xmlfile]\n";
     std::cout << "      [expression]\n\n";
@@ -96,6 +115,7 @@ static void usage(int level)
     std::cout << "   -H: print detailed information about each scanner\n";
     std::cout << "   -i: network interface on which to listen\n";
     std::cout << "   -I: generate temporal packet-> byte index files for each flow (.findex)\n";
+    std::cout << "   -j threads: demultiplex flows on this many threads (default 1)\n";
     std::cout << "   -g: output each flow in alternating colors (note change!)\n";
     std::cout << "   -l: treat non-flag arguments as input files rather than a pcap expression\n";
     std::cout << "   -L  semlock - specifies that writes are locked using a named semaphore\n";
@@ -195,6 +215,14 @@ void replace(std::string &str,const std::string &from,const std::string &to)
 /* These must be global variables so they are available in the signal handler */
 feature_recorder_set *the_fs = 0;
 dfxml_writer *xreport = 0;
+static volatile sig_atomic_t capture_stop = 0; // set by stop_capture()
+static pcap_t *live_pd = 0;                    // the libpcap live capture, if any
+
+/* Drop counters for the report, in the sense of pcap_stats() */
+static bool     capture_stats_valid = false;
+static uint64_t capture_received = 0;
+static uint64_t capture_dropped = 0;
+static int64_t  capture_ifdropped = -1;        // -1 if the backend can't tell
 void terminate(int sig)
 {
     DEBUG(1) ("terminating");
@@ -272,48 +300,258 @@ static inflaters_t *build_inflaters()
 #define HAVE_INFLATER
 #endif
 
+/* set up signal handlers for graceful exit (pcap uses onexit to put
+ * interface back into non-promiscuous mode
+ */
+static void install_signal_handlers(void (*handler)(int))
+{
+    portable_signal(SIGTERM, handler);
+    portable_signal(SIGINT, handler);
+#ifdef SIGHUP
+    portable_signal(SIGHUP, handler);
+#endif
+}
+
+/* The first signal during live capture just stops the capture, so that
+ * flows are closed and the report (with its drop counters) is finished.
+ * A second signal terminates at once.
+ */
+static void stop_capture(int sig)
+{
+    DEBUG(1) ("stopping capture");
+    capture_stop = 1;
+    if(live_pd) pcap_breakloop(live_pd);
+    install_signal_handlers(terminate);
+}
+
+#ifdef HAVE_TPACKET_CAPTURE
+struct tpacket_worker {
+    tpacket_capture *cap;
+    pcap_handler handler;
+    uint32_t     shard;
+    int          status;
+};
+
+static void *tpacket_worker_run(void *arg)
+{
+    tpacket_worker *w = reinterpret_cast<tpacket_worker *>(arg);
+    tcpdemux::getInstance()->bind_thread_to_shard(w->shard);
+    if(tcpdemux::getInstance()->cpus) tcpdemux::getInstance()->cpus->pin_shard(w->shard);
+    w->status = w->cap->loop(w->handler,(u_char *)tcpdemux::getInstance(),&capture_stop);
+    return 0;
+}
+
 /*
- * process an input file or device
- * May be repeated.
- * If start is false, do not initiate new connections
+ * Live capture through TPACKET_V3 rings; see tpacket_capture.h
+ * With -j each shard gets its own socket in a PACKET_FANOUT_HASH group and
+ * its own capture thread, so packets never pass through the master.
+ * Returns false if the device can't be captured this way, and the caller
+ * should use libpcap.
+ */
+static bool process_tpacket_device(const std::string &expression,const char *device)
+{
+    tcpdemux &demux = *tcpdemux::getInstance();
+    uint32_t nsockets = demux.shards.size()>0 ? demux.shards.size() : 1;
+
+    /* compile the filter once; each socket gets a copy in the kernel */
+    pcap_t *pd = pcap_open_dead(DLT_EN10MB, SNAPLEN);
+    struct bpf_program	fcode;
+    if (pcap_compile(pd, &fcode, expression.c_str(), 1, 0) < 0){
+	die("%s", pcap_geterr(pd));
+    }
+    int fanout_group = nsockets>1 ? (int)(getpid() & 0xffff) : -1;
+    std::vector<tpacket_capture *> caps;
+    for(uint32_t i=0;i<nsockets;i++){
+        std::string err;
+        tpacket_capture *cap = tpacket_capture::open(device,!opt_no_promisc,opt_tpacket_ring_mb,fanout_group,
+                                                     expression.size() ? &fcode : 0,err);
+        if(cap==0){
+            DEBUG(2) ("cannot use TPACKET_V3 on %s (%s); using libpcap",device,err.c_str());
+            for(std::vector<tpacket_capture *>::iterator it=caps.begin();it!=caps.end();it++) delete *it;
+            pcap_freecode(&fcode);
+            pcap_close(pd);
+            return false;
+        }
+        caps.push_back(cap);
+    }
+    pcap_freecode(&fcode);
+    pcap_close(pd);
+#if defined(HAVE_SETUID) && defined(HAVE_GETUID)
+    /* drop root privileges - we don't need them any more */
+    if(setuid(getuid())){
+        perror("setuid");
+    }
+#endif
+    pcap_handler handler = find_handler(DLT_EN10MB, device);
+    tcpdemux::getInstance()->set_datalink(DLT_EN10MB);
+
+    install_signal_handlers(stop_capture);
+    DEBUG(1) ("listening on %s with %d TPACKET_V3 socket%s",device,(int)nsockets,nsockets>1 ? "s" : "");
+    std::vector<tpacket_worker> workers(nsockets);
+    for(uint32_t i=0;i<nsockets;i++){
+        workers[i].cap     = caps[i];
+        workers[i].handler = handler;
+        workers[i].shard   = i;
+        workers[i].status  = 0;
+    }
+#ifdef HAVE_PTHREAD
+    if(nsockets>1){
+        std::vector<pthread_t> threads(nsockets);
+        for(uint32_t i=0;i<nsockets;i++){
+            if(pthread_create(&threads[i],0,tpacket_worker_run,&workers[i])){
+                die("cannot create capture thread %d: %s",(int)i,strerror(errno));
+            }
+        }
+        for(uint32_t i=0;i<nsockets;i++) pthread_join(threads[i],0);
+    } else
+#endif
+    {
+        workers[0].status = caps[0]->loop(handler,(u_char *)&demux,&capture_stop);
+    }
+
+    capture_stats_valid = true;
+    for(uint32_t i=0;i<nsockets;i++){
+        if(workers[i].status<0) die("%s: %s",device,caps[i]->errmsg.c_str());
+        uint64_t received=0,dropped=0;
+        caps[i]->stats(received,dropped);
+        capture_received += received;
+        capture_dropped  += dropped;
+        delete caps[i];
+    }
+    demux.flush_shards();
+    return true;
+}
+#endif
+
+#ifdef HAVE_PCAP_READER
+/*
+ * process a pcap file mapped into memory; see pcap_reader.h
  */
+static void process_mapped_infile(pcap_reader &reader,const std::string &expression,const std::string &infile)
+{
+    pcap_handler handler = find_handler(reader.datalink(), infile.c_str());
+    tcpdemux::getInstance()->set_datalink(reader.datalink());
+
+    DEBUG(20) ("filter expression: '%s'",expression.c_str());
+
+    /* compile the filter expression; pcap_reader runs it with pcap_offline_filter() */
+    pcap_t *pd = pcap_open_dead(reader.datalink(), reader.snapshot());
+    struct bpf_program	fcode;
+    if (pcap_compile(pd, &fcode, expression.c_str(), 1, 0) < 0){
+	die("%s", pcap_geterr(pd));
+    }
+
+    install_signal_handlers(terminate);
+#ifdef HAVE_CONSOLE_SPLICE
+    console_splice *splice = tcpdemux::getInstance()->splice;
+    size_t mapped_len = 0;
+    const uint8_t *mapped = reader.mapping(&mapped_len);
+    if(splice) splice->input(mapped,mapped_len);
+#endif
+    size_t stable_len = 0;
+    const uint8_t *stable = reader.mapping(&stable_len);
+    tcpdemux::getInstance()->set_stable_input(stable,stable_len); // the shards read it in place
+    if (reader.loop(handler, (u_char *)tcpdemux::getInstance(), expression.size() ? &fcode : 0) < 0){
+	die("%s: %s", infile.c_str(), reader.errmsg.c_str());
+    }
+#ifdef HAVE_CONSOLE_SPLICE
+    if(splice) splice->input(0,0);      // written before the file is unmapped
+#endif
+    pcap_freecode(&fcode);
+    pcap_close(pd);
+    tcpdemux::getInstance()->flush_shards(); // finish this file before -R changes start_new_connections
+    tcpdemux::getInstance()->set_stable_input(0,0); // and before it is unmapped
+}
+#endif
+
 #ifdef HAVE_INFLATER
 static inflaters_t *inflaters = 0;
 #endif
-static void process_infile(const std::string &expression,const char *device,const std::string &infile)
+
+/*
+ * open a capture file: with a pcap_reader when we can (inflating a .gz
+ * here), otherwise with libpcap, through an inflater if it is compressed.
+ * Returns the pcap_t, or 0 with *reader set. Dies if it can't be opened.
+ */
+static pcap_t *open_infile(const std::string &expression,const std::string &infile,pcap_reader **reader)
 {
     char error[PCAP_ERRBUF_SIZE];
+    std::string file_path = infile;
     pcap_t *pd=0;
-    int dlt=0;
-    pcap_handler handler;
+    *reader = 0;
 
 #ifdef HAVE_INFLATER
     if(inflaters==0) inflaters = build_inflaters();
 #endif
-
-    if (infile!=""){
-        std::string file_path = infile;
-        // decompress input if necessary
+#ifdef HAVE_PCAP_READER
+#ifndef HAVE_PCAP_OFFLINE_FILTER
+    if(expression.size()>0) opt_pcap_mmap = false; // can't filter without libpcap
+#endif
+#endif
+#ifdef HAVE_GZIP_INPUT
+    /* inflate a gzip'ed classic pcap file here; anything else goes to gunzip */
+    if(opt_pcap_mmap && ends_with(infile,".gz")){
+        gzip_input *gz = gzip_input::open(infile,opt_inflate_threads);
+        if(gz){
+            *reader = pcap_reader::open(gz);
+            if(*reader) return 0;
+            if(gz->errmsg.size()) die("%s: %s", infile.c_str(), gz->errmsg.c_str());
+            delete gz;
+        }
+    }
+#endif
+    // decompress input if necessary
 #ifdef HAVE_INFLATER
-        for(inflaters_t::const_iterator it = inflaters->begin(); it != inflaters->end(); it++) {
-            if((*it)->appropriate(infile)) {
-                int fd = (*it)->invoke(infile);
-                file_path = ssprintf("/dev/fd/%d", fd);
-                if(fd < 0) {
-                    std::cerr << "decompression of '" << infile << "' failed" << std::endl;
-                    exit(1);
-                }
-                if(access(file_path.c_str(), R_OK)) {
-                    std::cerr << "decompression of '" << infile << "' is not available on this system" << std::endl;
-                    exit(1);
-                }
-                break;
+    for(inflaters_t::const_iterator it = inflaters->begin(); it != inflaters->end(); it++) {
+        if((*it)->appropriate(infile)) {
+            int fd = (*it)->invoke(infile);
+            file_path = ssprintf("/dev/fd/%d", fd);
+            if(fd < 0) {
+                std::cerr << "decompression of '" << infile << "' failed" << std::endl;
+                exit(1);
+            }
+            if(access(file_path.c_str(), R_OK)) {
+                std::cerr << "decompression of '" << infile << "' is not available on this system" << std::endl;
+                exit(1);
             }
+            break;
+        }
+    }
+#endif
+#ifdef HAVE_PCAP_READER
+    if(opt_pcap_mmap){
+        *reader = pcap_reader::open(file_path);
+        if(*reader) return 0;
+    }
+#endif
+    if ((pd = pcap_open_offline(file_path.c_str(), error)) == NULL){	/* open the capture file */
+        die("%s", error);
+    }
+    return pd;
+}
+
+/*
+ * process an input file or device
+ * May be repeated.
+ * If start is false, do not initiate new connections
+ */
+static void process_infile(const std::string &expression,const char *device,const std::string &infile)
+{
+    char error[PCAP_ERRBUF_SIZE];
+    pcap_t *pd=0;
+    int dlt=0;
+    pcap_handler handler;
+
+    if (infile!=""){
+        pcap_reader *reader = 0;
+        pd = open_infile(expression,infile,&reader);
+#ifdef HAVE_PCAP_READER
+        if(reader){
+            process_mapped_infile(*reader,expression,infile);
+            delete reader;
+            return;
         }
 #endif
-	if ((pd = pcap_open_offline(file_path.c_str(), error)) == NULL){	/* open the capture file */
-	    die("%s", error);
-	}
 	dlt = pcap_datalink(pd);	/* get the handler for this kind of packets */
 	handler = find_handler(dlt, infile.c_str());
     } else {
@@ -323,11 +561,16 @@ static void process_infile(const std::string &expression,const char *device,cons
 		die("%s", error);
 	    }
 	}
+#ifdef HAVE_TPACKET_CAPTURE
+	if (opt_tpacket_ring_mb>0 && process_tpacket_device(expression,device)) return;
+#endif
 
 	/* make sure we can open the device */
 	if ((pd = pcap_open_live(device, SNAPLEN, !opt_no_promisc, 1000, error)) == NULL){
 	    die("%s", error);
 	}
+	live_pd = pd;
+	tcpdemux::getInstance()->live_capture = pd;
 #if defined(HAVE_SETUID) && defined(HAVE_GETUID)
 	/* drop root privileges - we don't need them any more */
 	if(setuid(getuid())){
@@ -338,6 +581,7 @@ static void process_infile(const std::string &expression,const char *device,cons
 	dlt = pcap_datalink(pd);
 	handler = find_handler(dlt, device);
     }
+    tcpdemux::getInstance()->set_datalink(dlt);
 
     DEBUG(20) ("filter expression: '%s'",expression.c_str());
 
@@ -353,21 +597,91 @@ static void process_infile(const std::string &expression,const char *device,cons
 
     /* initialize our flow state structures */
 
-    /* set up signal handlers for graceful exit (pcap uses onexit to put
-     * interface back into non-promiscuous mode
-     */
-    portable_signal(SIGTERM, terminate);
-    portable_signal(SIGINT, terminate);
-#ifdef SIGHUP
-    portable_signal(SIGHUP, terminate);
-#endif
+    install_signal_handlers(live_pd ? stop_capture : terminate);
 
     /* start listening or reading from the input file */
     if (infile == "") DEBUG(1) ("listening on %s", device);
-    if (pcap_loop(pd, -1, handler, (u_char *)tcpdemux::getInstance()) < 0){
+    if (pcap_loop(pd, -1, handler, (u_char *)tcpdemux::getInstance()) == -1){ // -2 is pcap_breakloop()
 	
 	die("%s: %s", infile.c_str(),pcap_geterr(pd));
     }
+    if (live_pd){
+        struct pcap_stat ps;
+        if (pcap_stats(pd, &ps) == 0){
+            capture_stats_valid = true;
+            capture_received    = ps.ps_recv;
+            capture_dropped     = ps.ps_drop;
+            capture_ifdropped   = ps.ps_ifdrop;
+        }
+        live_pd = 0;
+        tcpdemux::getInstance()->live_capture = 0;
+    }
+    tcpdemux::getInstance()->flush_shards(); // finish this file before -R changes start_new_connections
+}
+
+#ifdef HAVE_PCAP_MERGE
+/*
+ * process several input files at once, merged by timestamp; see pcap_merge.h
+ */
+static void process_merged_infiles(const std::string &expression,const std::vector<std::string> &infiles)
+{
+    pcap_merge merge;
+    for(std::vector<std::string>::const_iterator it=infiles.begin();it!=infiles.end();it++){
+        pcap_reader *reader = 0;
+        pcap_t *pd = open_infile(expression,*it,&reader);
+        if(pd){
+            struct bpf_program fcode;
+            if (pcap_compile(pd, &fcode, expression.c_str(), 1, 0) < 0 || pcap_setfilter(pd, &fcode) < 0){
+                die("%s", pcap_geterr(pd));
+            }
+            pcap_freecode(&fcode);
+        }
+        if(!merge.add(*it,reader,pd,expression)){
+            die("%s: %s", it->c_str(), merge.errmsg.c_str());
+        }
+    }
+    install_signal_handlers(terminate);
+    if (merge.loop((u_char *)tcpdemux::getInstance()) < 0){
+        die("%s", merge.errmsg.c_str());
+    }
+    tcpdemux::getInstance()->flush_shards(); // finish these files before -R changes start_new_connections
+}
+#endif
+
+/*
+ * read the -r and -R files into memory for -S bench_loops
+ */
+static void load_bench_infiles(demux_bench &bench,const std::string &expression,const std::vector<std::string> &infiles)
+{
+    opt_pcap_mmap = false;              // libpcap reads them; only the replay is timed
+    for(std::vector<std::string>::const_iterator it=infiles.begin();it!=infiles.end();it++){
+        pcap_reader *reader = 0;
+        pcap_t *pd = open_infile(expression,*it,&reader);
+        struct bpf_program fcode;
+        if (pcap_compile(pd, &fcode, expression.c_str(), 1, 0) < 0 || pcap_setfilter(pd, &fcode) < 0){
+            die("%s", pcap_geterr(pd));
+        }
+        pcap_freecode(&fcode);
+        std::string err;
+        if(!bench.load(pd,err)) die("%s: %s", it->c_str(), err.c_str());
+        pcap_close(pd);
+    }
+}
+
+/*
+ * process the -r (or -R) files: one after another, or merged with -S merge_inputs
+ */
+static void process_infiles(const std::string &expression,const char *device,const std::vector<std::string> &infiles)
+{
+#ifdef HAVE_PCAP_MERGE
+    if(opt_merge_inputs && infiles.size()>1){
+        process_merged_infiles(expression,infiles);
+        return;
+    }
+#endif
+    for(std::vector<std::string>::const_iterator it=infiles.begin();it!=infiles.end();it++){
+        process_infile(expression,device,*it);
+    }
 }
 
 
@@ -411,6 +725,7 @@ int main(int argc, char *argv[])
     const char *device = 0;             // default device
     const char *lockname = 0;
     int need_usage = 0;
+    int opt_threads = 1;
     std::string reportfilename;
     std::vector<std::string> Rfiles;	// files for finishing
     std::vector<std::string> rfiles;	// files to read
@@ -434,7 +749,7 @@ int main(int argc, char *argv[])
 
     bool trailing_input_list = false;
     int arg;
-    while ((arg = getopt(argc, argv, "aA:Bb:cCd:DE:e:E:F:f:gHhIi:lL:m:o:pqR:r:S:sT:Vvw:x:X:Z")) != EOF) {
+    while ((arg = getopt(argc, argv, "aA:Bb:cCd:DE:e:E:F:f:gHhIi:j:lL:m:o:pqR:r:S:sT:Vvw:x:X:Z")) != EOF) {
 	switch (arg) {
 	case 'a':
 	    demux.opt.post_processing = true;
@@ -511,6 +826,11 @@ int main(int argc, char *argv[])
  		DEBUG(10) ("creating packet index files");
  		demux.opt.output_packet_index = true;
  		break;
+	case 'j':
+	    opt_threads = atoi(optarg);
+	    if(opt_threads<1) opt_threads = 1;
+	    DEBUG(10) ("demultiplexing with %d threads",opt_threads);
+	    break;
 	case 'g':
 	    demux.opt.use_color  = 1;
 	    DEBUG(10) ("using colors");
@@ -591,8 +911,12 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    flow::compile_filename_template();
+
     if(demux.opt.opt_md5) be13::plugin::scanners_enable("md5");
     be13::plugin::scanners_process_enable_disable_commands();
+    demux.opt.http_stream = demux.opt.post_processing && http_stream::enabled();
+    demux.opt.flow_hashes = demux.opt.post_processing ? flow_hash::enabled() : 0;
 
     /* If there is no report filename, call it report.xml in the output directory */
     if( reportfilename.size()==0 ){
@@ -684,6 +1008,41 @@ int main(int argc, char *argv[])
     demux.fs = &fs;
 
     si.get_config("tdelta",&datalink_tdelta,"Time offset for packets");
+    si.get_config("pcap_mmap",&opt_pcap_mmap,"Read pcap files through mmap rather than libpcap");
+    si.get_config("inflate_threads",&opt_inflate_threads,"Threads inflating a BGZF .gz capture (0 for one per processor)");
+    si.get_config("merge_inputs",&opt_merge_inputs,"Read the -r files (and then the -R files) at once, merging their packets by time");
+    si.get_config("checkpoint",&opt_checkpoint,"At exit, save the flows still open to this file for -S restore");
+    si.get_config("restore",&opt_restore,"Carry on with the flows saved by -S checkpoint in this file");
+    si.get_config("tpacket_ring_mb",&opt_tpacket_ring_mb,"MiB of TPACKET_V3 ring per capture socket (0 to use libpcap)");
+    si.get_config("bench_loops",&opt_bench_loops,"Time this many passes over the -r files, read into memory first (0 to process them as usual)");
+    si.get_config("bin_dirs",&opt_bin_dirs,"Number of flows whose -Fk/-Fm/-Fg directories to make before capture starts");
+
+    if(opt_bin_dirs && demux.opt.store_output) flow::make_bin_dirs(opt_bin_dirs);
+
+    if(demux.opt.flow_db.size()) demux.openDB();
+    demux.open_catalog();
+    if(demux.opt.store_output) demux.open_container();
+    if(demux.opt.prefilter.size()){
+        std::string err;
+        if(!demux.open_prefilter(err)) die("prefilter: %s",err.c_str());
+    }
+    {
+        std::string err;
+        const char *nic = rfiles.size() || Rfiles.size() ? 0 : device;
+        if(!demux.open_cpu_layout(nic,opt_threads>1 ? opt_threads : 0,err)) die("cpus: %s",err.c_str());
+        if(demux.cpus) demux.cpus->pin_capture();
+    }
+    demux.select_pipeline();            // before the shards, which copy it
+    demux.start_scan_pool();
+    demux.start_console_writer();       // before the shards, which share it
+    demux.order_reports = rfiles.size() || Rfiles.size(); // a live capture has no order to keep
+    if(opt_threads>1) demux.start_shards(opt_threads);
+    demux.start_stats_server();         // after the shards, whose counters it reads
+    if(opt_checkpoint.size() && demux.container) die("-S checkpoint can't be used with -S segment_mb");
+    if(opt_restore.size()){
+        std::string err;
+        if(!demux_checkpoint::load(demux,opt_restore,err)) die("cannot restore: %s",err.c_str());
+    }
 
     /* Record the configuration */
     if(xreport){
@@ -695,10 +1054,15 @@ int main(int argc, char *argv[])
 
 
     /* Process r files and R files */
+    demux_bench *bench = 0;
     if(xreport){
         xreport->push("configuration");
+        demux.start_report_writer();    // xreport belongs to it until stop_report_writer()
     }
-    if(rfiles.size()==0 && Rfiles.size()==0){
+    if(rfiles.size()==0 && Rfiles.size()==0 && be_config.namevals.count("netviz_merge")){
+        /* nothing to capture; netviz only combines the reports it is given */
+    }
+    else if(rfiles.size()==0 && Rfiles.size()==0){
 	/* live capture */
 #if defined(HAVE_SETUID) && defined(HAVE_GETUID)
         /* Since we don't need network access, drop root privileges */
@@ -710,30 +1074,48 @@ int main(int argc, char *argv[])
         process_infile(expression,device,"");
         input_fname = device;
     }
+    else if(opt_bench_loops>0){
+        bench = new demux_bench(opt_bench_loops);
+        load_bench_infiles(*bench,expression,rfiles);
+        load_bench_infiles(*bench,expression,Rfiles);
+        demux.start_new_connections = true;
+        install_signal_handlers(terminate);
+        bench->run(demux);
+    }
     else {
 	/* first pick up the new connections with -r */
 	demux.start_new_connections = true;
-	for(std::vector<std::string>::const_iterator it=rfiles.begin();it!=rfiles.end();it++){
-	    process_infile(expression,device,*it);
-	}
+	process_infiles(expression,device,rfiles);
 	/* now pick up the outstanding connection with -R, but don't start new connections */
 	demux.start_new_connections = false;
-	for(std::vector<std::string>::const_iterator it=Rfiles.begin();it!=Rfiles.end();it++){
-	    process_infile(expression,device,*it);
-	}
+	process_infiles(expression,device,Rfiles);
     }
 
     /* -1 causes pcap_loop to loop forever, but it finished when the input file is exhausted. */
 
-    DEBUG(2)("Open FDs at end of processing:      %d",(int)demux.open_flows.size());
+    demux.stop_stats_server();          // before the shards go
+    demux.stop_shards();
+    demux.stop_console_writer();        // print what the shards queued
+    demux.close_unk_packets();
+    if(opt_checkpoint.size()){
+        std::string err;
+        if(!demux_checkpoint::save(demux,opt_checkpoint,err)) die("cannot checkpoint: %s",err.c_str());
+    }
+
+    DEBUG(2)("Open FDs at end of processing:      %d",(int)demux.open_flow_count());
     DEBUG(2)("demux.max_open_flows:               %d",(int)demux.max_open_flows);
-    DEBUG(2)("Flow map size at end of processing: %d",(int)demux.flow_map.size());
+    DEBUG(2)("Flow map size at end of processing: %d",(int)demux.flow_map_count());
     DEBUG(2)("Flows seen:                         %d",(int)demux.flow_counter);
 
-    int open_fds = (int)demux.open_flows.size();
-    int flow_map_size = (int)demux.flow_map.size();
+    int open_fds = (int)demux.open_flow_count();
+    int flow_map_size = (int)demux.flow_map_count();
 
     demux.close_all_fd();
+    demux.flush_scans();                // before the scanners shut down
+    if(bench){
+        bench->finish(demux);
+        delete bench;
+    }
     std::stringstream ss;
     be13::plugin::phase_shutdown(fs,xreport ? &ss : 0);
 
@@ -749,6 +1131,8 @@ int main(int argc, char *argv[])
     if(xreport){
 
 	demux.remove_all_flows();	// empty the map to capture the state
+	demux.stop_scan_pool();
+	demux.stop_report_writer();	// the fileobjects are written; the rest is ours
         xreport->pop();                 // fileobjects
         xreport->xmlout("summary",ss.str(),"",false);
         xreport->xmlout("open_fds_at_end",open_fds);
@@ -756,13 +1140,27 @@ int main(int argc, char *argv[])
         xreport->xmlout("total_flows",demux.flow_counter);
         xreport->xmlout("flow_map_size",flow_map_size);
         xreport->xmlout("total_packets",demux.packet_counter);
+        demux.perf_totals().write(*xreport);
+        demux.write_prefilter(*xreport);
+        if(capture_stats_valid){
+            xreport->push("capture_stats");
+            xreport->xmlout("packets_received",capture_received);
+            xreport->xmlout("packets_dropped",capture_dropped);
+            if(capture_ifdropped>=0) xreport->xmlout("packets_ifdropped",capture_ifdropped);
+            xreport->pop();
+        }
 	xreport->add_rusage();
 	xreport->pop();                 // bulk_extractor
 	xreport->close();
 	delete xreport;                 
     }
+    demux.stop_scan_pool();             // if there was no report
+    demux.closeDB();                    // after remove_all_flows() has recorded the last flows
+    demux.close_catalog();              // likewise
+
+    demux.close_container();            // after remove_all_flows() has closed the last flows
 
-    if(demux.flow_counter > tcpdemux::WARN_TOO_MANY_FILES){
+    if(demux.flow_counter > tcpdemux::WARN_TOO_MANY_FILES && demux.opt.segment_mb==0){
         if(!opt_quiet){
             /* Start counting how many files we have in the output directory.
              * If we find more than 10,000, print the warning, and keep counting...
@@ -269,6 +269,7 @@ WINSOCK_API_LINKAGE LPCWSTR WSAAPI inet_ntop(INT Family, PVOID pAddr, LPWSTR pSt
 #endif
 
 #ifdef HAVE_PTHREAD
+#include <pthread.h>
 #include <semaphore.h>
 extern sem_t *semlock;
 #endif
@@ -311,6 +312,8 @@ extern int debug;
 std::string ssprintf(const char *fmt,...);
 std::string comma_number_string(int64_t input);
 void mkdirs_for_path(std::string path); // creates any directories necessary for the path
+#define MACADDR_BUFSIZE 18                                  // xx:xx:xx:xx:xx:xx and its NUL
+char *macaddr(const uint8_t *addr,char *buf);               // into buf[MACADDR_BUFSIZE]; returns buf
 std::string macaddr(const uint8_t *addr);
 
 #define DEBUG_PEDANTIC    0x0001       // check values more rigorously
@@ -0,0 +1,46 @@
+/*
+ * tcpflow_probes.h:
+ *
+ * USDT probes on the packet and flow lifecycle, for perf and bpftrace.
+ * Where configure finds systemtap's <sys/sdt.h>, each is a nop in the
+ * code and a note in the ELF file, so it costs nothing until something
+ * attaches to it; without it they compile to nothing.
+ *
+ * The provider is tcpflow; the arguments are integers.
+ *
+ *   packet(dlt,caplen)                  a packet reaches the demux that processes it
+ *   flow_create(id,family,sport,dport)  a new tcpip
+ *   fd_open(id,fd,open)                 a flow's file is opened; open is how many are now
+ *   fd_evict(id,open)                   it is closed to make room for another
+ *   insert(id,bytes)                    data from before the ISN; the file is shifted
+ *   out_of_order(id,delta,length)       a segment that isn't where the last one ended
+ *   post_process_start(id,bytes)
+ *   post_process_end(id,bytes)          a histogram of the time between is post_process()'s
+ *   scan_start(id,bytes)                the scanners are given the flow
+ *   scan_end(id,bytes)
+ *   flow_close(id,bytes,packets)        the tcpip is destroyed
+ *
+ * For example:
+ *
+ *   bpftrace -e 'usdt:./tcpflow:tcpflow:post_process_start { @s[arg0] = nsecs }
+ *                usdt:./tcpflow:tcpflow:post_process_end /@s[arg0]/
+ *                    { @us = hist((nsecs - @s[arg0])/1000); delete(@s[arg0]) }'
+ *
+ * #include this file after tcpflow.h
+ */
+
+#ifndef TCPFLOW_PROBES_H
+#define TCPFLOW_PROBES_H
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TCPFLOW_PROBE2(name,a,b)       DTRACE_PROBE2(tcpflow,name,a,b)
+#define TCPFLOW_PROBE3(name,a,b,c)     DTRACE_PROBE3(tcpflow,name,a,b,c)
+#define TCPFLOW_PROBE4(name,a,b,c,d)   DTRACE_PROBE4(tcpflow,name,a,b,c,d)
+#else
+#define TCPFLOW_PROBE2(name,a,b)
+#define TCPFLOW_PROBE3(name,a,b,c)
+#define TCPFLOW_PROBE4(name,a,b,c,d)
+#endif
+
+#endif
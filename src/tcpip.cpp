@@ -15,7 +15,15 @@
 #include "tcpflow.h"
 #include "tcpip.h"
 #include "tcpdemux.h"
+#include "uring_writer.h"
+#include "scan_http.h"
+#include "flow_hash.h"
+#include "console_output.h"
+#include "tcpflow_probes.h"
+#include "flow_container.h"
+#include "flow_gzip.h"
 
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <vector>
@@ -32,64 +40,46 @@
  *
  * called from tcpdemux::create_tcpip()
  */
-tcpip::tcpip(tcpdemux &demux_,const flow &flow_,be13::tcp_seq isn_):
-    demux(demux_),myflow(flow_),dir(unknown),isn(isn_),nsn(0),
+tcpip::tcpip(tcpdemux &demux_,const flow_addr &flowa,uint64_t id,const be13::packet_info &pi,
+             be13::tcp_seq isn_):
+    demux(demux_),myflow(flowa,id,pi),dir(unknown),isn(isn_),nsn(0),
     syn_count(0),fin_count(0),fin_size(0),pos(0),
-    flow_pathname(),fd(-1),file_created(false),
-    flow_index_pathname(),idx_file(),
-    seen(new recon_set()),
+    flow_pathname(),fd(-1),contained(false),resident(false),file_created(false),
+    flow_index_pathname(),idx_file(0),pindex(0),
+    seen(),track_seen(true),
     last_byte(),
-    last_packet_number(),out_of_order_count(0),violations(0)
+    last_packet_number(),out_of_order_count(0),violations(0),sample_rate(1),expiry(),
+    ring_prev(0),ring_next(0),sibling(0),finished(false),
+    wbuf(),wbuf_index(0),wend(0),fpos(-1),reorder(),reorder_bytes(0),
+    holding(false),head(),digests(),hstream(0),hashes(0),gz(0)
 {
 }
 
 
 uint32_t tcpip::seen_bytes()
 {
-    if(seen) return seen->size();
-    return 0;
+    return seen.size();
 }
 
 void tcpip::dump_seen()
 {
-    if(seen){
-        for(recon_set::const_iterator it = seen->begin(); it!=seen->end(); it++){
-            std::cerr << *it << ", ";
-        }
-        std::cerr << std::endl;
+    recon_set::ranges_t ranges;
+    seen.get_ranges(ranges);
+    for(recon_set::ranges_t::const_iterator it = ranges.begin(); it!=ranges.end(); it++){
+        std::cerr << "[" << it->start << "," << it->end-1 << "], ";
     }
+    std::cerr << std::endl;
 }
 
-void tcpip::dump_xml(class dfxml_writer *xreport,const std::string &xmladd)
+void tcpip::report(flow_report &fr,const std::string &xmladd) const
 {
-    static const std::string fileobject_str("fileobject");
-    static const std::string filesize_str("filesize");
-    static const std::string filename_str("filename");
-    static const std::string tcpflow_str("tcpflow");
-
-    xreport->push(fileobject_str);
-    if(flow_pathname.size()) xreport->xmlout(filename_str,flow_pathname);
-
-    xreport->xmlout(filesize_str,last_byte);
-	
-    std::stringstream attrs;
-    attrs << "startime='" << dfxml_writer::to8601(myflow.tstart) << "' ";
-    attrs << "endtime='"  << dfxml_writer::to8601(myflow.tlast)  << "' ";
-    attrs << "src_ipn='"  << myflow.src << "' ";
-    attrs << "dst_ipn='"  << myflow.dst << "' ";
-    if(myflow.has_mac_daddr()) attrs << "mac_daddr='" << macaddr(myflow.mac_daddr) << "' ";
-    if(myflow.has_mac_saddr()) attrs << "mac_saddr='" << macaddr(myflow.mac_saddr) << "' ";
-    attrs << "packets='"  << myflow.packet_count << "' ";
-    attrs << "srcport='"  << myflow.sport << "' ";
-    attrs << "dstport='"  << myflow.dport << "' ";
-    attrs << "family='"   << (int)myflow.family << "' ";
-    if(out_of_order_count) attrs << "out_of_order_count='" << out_of_order_count << "' ";
-    if(violations)         attrs << "violations='" << violations << "' ";
-	
-    xreport->xmlout(tcpflow_str,"",attrs.str(),false);
-    if(xmladd.size()>0) xreport->xmlout("",xmladd,"",false);
-    xreport->pop();
-    xreport->flush();
+    fr.myflow             = myflow;
+    fr.flow_pathname      = flow_pathname;
+    fr.last_byte          = last_byte;
+    fr.out_of_order_count = out_of_order_count;
+    fr.violations         = violations;
+    fr.sample_rate        = sample_rate;
+    fr.xmladd             = xmladd;
 }
 
 
@@ -101,8 +91,15 @@ void tcpip::dump_xml(class dfxml_writer *xreport,const std::string &xmladd)
  */
 tcpip::~tcpip()
 {
-    assert(fd<0);                       // file must be closed
-    if(seen) delete seen;
+    assert(!has_output());              // file must be closed
+    demux.memory.change(memory_budget::REORDER_QUEUES,reorder_bytes,0);
+    demux.memory.change(memory_budget::HELD_FLOWS,head.size(),0);
+    TCPFLOW_PROBE3(flow_close,myflow.id,last_byte,myflow.packet_count);
+    if(idx_file) delete idx_file;
+    if(pindex) delete pindex;
+    if(hstream) delete hstream;
+    if(hashes) delete hashes;
+    if(gz) delete gz;
 }
 
 #pragma GCC diagnostic warning "-Weffc++"
@@ -126,7 +123,18 @@ tcpip::~tcpip()
  */
 void tcpip::close_file()
 {
+    if(has_output()) settle_head();
+    flush_reorder_queue();
+    flush_buffer(true);
+    if(contained){
+        demux.container->close(myflow.id);
+        contained = false;
+    }
     if (fd>=0){
+	demux.drain_writes(fd);         // a write that completed later would change the times
+	if(gz && !gz->sync(fd)){
+	    DEBUG(1) ("%s: cannot finish the compressed file", flow_pathname.c_str());
+	}
 	struct timeval times[2];
 	times[0] = myflow.tstart;
 	times[1] = myflow.tstart;
@@ -147,18 +155,454 @@ void tcpip::close_file()
 	if(futimens(fd,tstimes)){
 	    perror("futimens(fd=%d)",fd);
 	}
+#endif
+#ifdef HAVE_URING_WRITER
+	if(demux.uring){
+	    demux.uring->close(fd);
+	} else
 #endif
 	close(fd);
 	fd = -1;
+	fpos = -1;
     }
     demux.open_flows.erase(this);           // we are no longer open
     // Also close the flow_index file, if flow indexing is in use --GDD
-    if(demux.opt.output_packet_index && idx_file.is_open()){
-    	idx_file.close();
+    if(pindex) pindex->flush(flow_pathname + ".bfindx");
+    if(demux.opt.output_packet_index && idx_file && idx_file->is_open()){
+    	idx_file->close();
     }
     //std::cerr << "close_file1 " << *this << "\n";
 }
 
+/*
+ * extend_file_and_insert():
+ * A handy function for inserting in the middle or beginning of a file.
+ *
+ * Based on:
+ * http://stackoverflow.com/questions/10467711/c-write-in-the-middle-of-a-binary-file-without-overwriting-any-existing-content
+ */
+
+static int shift_file(int fd, size_t inslen)
+{
+    enum { BUFFERSIZE = 64 * 1024 };
+    char buffer[BUFFERSIZE];
+    struct stat sb;
+
+    DEBUG(100)("shift_file(%d,%d)",fd,(int)inslen);
+
+    if (fstat(fd, &sb) != 0) return -1;
+
+    /* Move data after offset up by inslen bytes */
+    size_t bytes_to_move = sb.st_size;
+    off_t read_end_offset = sb.st_size; 
+    while (bytes_to_move != 0) {
+	ssize_t bytes_this_time = bytes_to_move < BUFFERSIZE ? bytes_to_move : BUFFERSIZE ;
+	ssize_t rd_off = read_end_offset - bytes_this_time;
+	ssize_t wr_off = rd_off + inslen;
+	lseek(fd, rd_off, SEEK_SET);
+	if (read(fd, buffer, bytes_this_time) != bytes_this_time)
+	    return -1;
+	lseek(fd, wr_off, SEEK_SET);
+	if (write(fd, buffer, bytes_this_time) != bytes_this_time)
+	    return -1;
+	bytes_to_move -= bytes_this_time;
+    }   
+    return 0;
+}
+
+/****************************************************************
+ ** FILE OUTPUT
+ ****************************************************************
+ *
+ * store_packet() decides where each segment goes; these functions put it there.
+ * wend is the end of the data written so far (including wbuf). Data at wend is
+ * appended, through wbuf if write buffering is on. Data beyond wend is held in
+ * the reorder queue until the gap before it fills; data before wend rewrites
+ * the file in place. fpos tracks where fd is positioned (-1 if unknown) so that
+ * we only lseek() when we have to.
+ *
+ * A flow that starts without a SYN is kept in head, in memory, until it grows
+ * past prefix_hold_max (or is closed): until then, data that arrives from
+ * before the assumed ISN is inserted there rather than with shift_file().
+ *
+ * With memory_flow_max, every new flow starts in head, resident: it has no
+ * file (or name) until it grows past that, or is closed, when spill()
+ * creates the file and head is written in one go. Most flows are small, so
+ * most are written with a single open, write and close, and post_process()
+ * gives their data to the scanners from memory rather than reading it back.
+ *
+ * The digest of every segment is kept in digests (up to straggler_index
+ * entries) so that the flow's stragglers can be matched once it is saved.
+ */
+
+/* MurmurHash64A; the digests are only compared within this process */
+uint64_t segment_index::digest(const u_char *data,size_t length)
+{
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ (length * m);
+    size_t i = 0;
+    for(;i+8<=length;i+=8){
+        uint64_t k;
+        memcpy(&k,data+i,8);
+        k *= m;
+        k ^= k >> 47;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    if(i<length){
+        uint64_t k = 0;
+        for(size_t j=length;j>i;j--) k = (k<<8) | data[j-1];
+        h ^= k;
+        h *= m;
+    }
+    h ^= h >> 47;
+    h *= m;
+    h ^= h >> 47;
+    return h;
+}
+
+/* The segments are sorted and do not overlap, so their ends are sorted too */
+static bool ends_before(const segment_index::segment &s,uint64_t offset)
+{
+    return s.offset + s.length <= offset;
+}
+
+void segment_index::add(uint64_t offset,const u_char *data,size_t length,size_t limit)
+{
+    if(length==0 || length>UINT32_MAX || limit==0) return;
+    segment s;
+    s.offset = offset;
+    s.digest = digest(data,length);
+    s.length = (uint32_t)length;
+    if(segments.empty() || segments.back().offset + segments.back().length <= offset){
+        segments.push_back(s);          // the usual case
+    } else {
+        std::vector<segment>::iterator lo = std::lower_bound(segments.begin(),segments.end(),offset,ends_before);
+        std::vector<segment>::iterator hi = lo;
+        while(hi!=segments.end() && hi->offset < offset+length) hi++;
+        segments.insert(segments.erase(lo,hi),s);
+    }
+    if(segments.size() > limit){        // forget the start of the flow, a quarter at a time
+        segments.erase(segments.begin(),segments.begin() + (segments.size() - limit + limit/4));
+    }
+}
+
+void segment_index::shift(uint64_t inslen)
+{
+    for(std::vector<segment>::iterator it=segments.begin();it!=segments.end();it++){
+        it->offset += inslen;
+    }
+}
+
+bool segment_index::matches(uint64_t offset,const u_char *data,size_t length) const
+{
+    std::vector<segment>::const_iterator it = std::lower_bound(segments.begin(),segments.end(),offset,ends_before);
+    return it!=segments.end() && it->offset==offset && it->length==length && it->digest==digest(data,length);
+}
+
+/* Write at an absolute offset in the file. */
+void tcpip::write_file(uint64_t offset,const u_char *data,size_t length)
+{
+    demux.perf.count(perf_counters::FILE_WRITES);
+    demux.perf.count(perf_counters::FILE_WRITE_BYTES,length);
+    if(contained){
+        if(!demux.container->write(myflow.id,offset,data,length)) drop_hashes();
+        return;
+    }
+    if(gz){
+        if(!gz->write(fd,offset,data,length)){
+            DEBUG(1) ("compressed write to %s failed", flow_pathname.c_str());
+            drop_hashes();
+        }
+        fpos = -1;                      // it uses pwrite()
+        return;
+    }
+#ifdef HAVE_URING_WRITER
+    if(uring_writer *w = demux.async_writer()){
+        w->write(fd,offset,data,length,&flow_pathname);
+        fpos = -1;                      // we never moved it
+        return;
+    }
+#endif
+    if(fpos != (int64_t)offset){
+	lseek(fd,(off_t)offset,SEEK_SET);
+        demux.perf.count(perf_counters::LSEEKS);
+    }
+    if ((size_t)write(fd,data,length) != length) {
+	DEBUG(1) ("write to %s failed: ", flow_pathname.c_str());
+	if (debug >= 1) perror("");
+	fpos = -1;
+	drop_hashes();
+	return;
+    }
+    fpos = offset + length;
+}
+
+/* Writes out the write-behind buffer, which ends at wend.
+ * Does not change pos.
+ */
+void tcpip::flush_buffer(bool release)
+{
+    if(wbuf.size()==0) return;
+    if(has_output()) write_file(wend-wbuf.size(),&wbuf[0],wbuf.size());
+    /* Take us out of buffered_flows by moving the last entry into our slot */
+    demux.buffered_bytes -= wbuf.size();
+    tcpip *last = demux.buffered_flows.back();
+    demux.buffered_flows[wbuf_index] = last;
+    last->wbuf_index = wbuf_index;
+    demux.buffered_flows.pop_back();
+    if(release){
+        std::vector<uint8_t>().swap(wbuf);
+    } else {
+        wbuf.clear();                   // keep the memory; this flow is busy
+    }
+}
+
+/* Append at wend */
+void tcpip::write_sequential(const u_char *data,size_t length)
+{
+    if(hstream) hstream->write(data,length);
+    if(hashes) hashes->update(data,length);
+    if(demux.opt.write_buffer_size==0){
+        write_file(wend,data,length);
+        wend += length;
+        return;
+    }
+    /* Collect in-order data and write it in large pieces */
+    if(wbuf.size()==0){
+        wbuf.reserve(demux.opt.write_buffer_size);
+        wbuf_index = demux.buffered_flows.size();
+        demux.buffered_flows.push_back(this);
+    }
+    wbuf.insert(wbuf.end(),data,data+length);
+    wend += length;
+    demux.buffered_bytes += length;
+    if(wbuf.size() >= demux.opt.write_buffer_size){
+        flush_buffer();
+    } else if(demux.buffered_bytes > demux.opt.write_buffer_max){
+        demux.trim_write_buffers();
+    }
+}
+
+/* Add a segment beyond wend to the reorder queue. The queue holds
+ * non-overlapping runs of bytes; where the new segment overlaps earlier ones,
+ * the new data wins, just as it would have if it were written to the file.
+ */
+void tcpip::queue_segment(uint64_t offset,const u_char *data,size_t length)
+{
+    uint64_t end = offset+length;
+    size_t before = reorder_bytes;
+    reorder_t::iterator it = reorder.upper_bound(offset);
+    if(it!=reorder.begin()){
+        reorder_t::iterator prev = it;
+        prev--;
+        uint64_t prev_end = prev->first + prev->second.size();
+        if(prev_end > offset){          // prev starts before us and overlaps
+            if(prev_end > end){         // ...and extends past us; keep its tail
+                reorder[end] = prev->second.substr(end - prev->first);
+                reorder_bytes += prev_end - end;
+            }
+            reorder_bytes -= prev_end - offset;
+            prev->second.resize(offset - prev->first);
+        }
+    }
+    while(it!=reorder.end() && it->first < end){
+        uint64_t it_end = it->first + it->second.size();
+        if(it_end > end){               // keep the part after us
+            reorder[end] = it->second.substr(end - it->first);
+            reorder_bytes += it_end - end;
+        }
+        reorder_bytes -= it->second.size();
+        reorder.erase(it++);
+    }
+    reorder[offset].assign(reinterpret_cast<const char *>(data),length);
+    reorder_bytes += length;
+    demux.memory.change(memory_budget::REORDER_QUEUES,before,reorder_bytes);
+}
+
+/* Write the start of a SYN-less flow, or all of a resident one, out of
+ * memory; from now on it goes to the file.
+ */
+void tcpip::settle_head(std::string *keep)
+{
+    if(!holding) return;
+    if(resident) spill(keep==0);        // a flow that is kept is about to be scanned whole
+    holding = false;
+    if(head.size()) write_file(0,reinterpret_cast<const u_char *>(head.data()),head.size());
+    if(hstream && head.size()) hstream->write(reinterpret_cast<const u_char *>(head.data()),head.size());
+    if(hashes && head.size()) hashes->update(reinterpret_cast<const u_char *>(head.data()),head.size());
+    demux.memory.change(memory_budget::HELD_FLOWS,head.size(),0);
+    if(keep) keep->swap(head);
+    std::string().swap(head);
+}
+
+/* Create the file of a flow that has been resident until now. streams
+ * gives it the http_stream and flow_hash it would have had from the start;
+ * settle_head() then hands them what it held.
+ */
+void tcpip::spill(bool streams)
+{
+    resident = false;
+    flow_pathname = myflow.new_filename(&fd,O_RDWR|O_BINARY|O_CREAT|O_EXCL,0666,
+                                        demux.opt.flow_gzip ? flow_gzip::SUFFIX : "");
+    if(demux.opt.flow_gzip) gz = new flow_gzip(*demux.gzip());
+    fpos = 0;
+    if(streams && demux.opt.http_stream) hstream = http_stream::open(flow_pathname);
+    if(streams) hashes = flow_hash::open(demux.opt.flow_hashes);
+    DEBUG(5) ("%s: created file for resident flow",flow_pathname.c_str());
+    demux.open_flows.insert(this);
+    if(demux.open_flows.size() > demux.max_open_flows) demux.max_open_flows = demux.open_flows.size();
+    TCPFLOW_PROBE3(fd_open,myflow.id,fd,demux.open_flows.size());
+}
+
+size_t tcpip::hold_max() const
+{
+    return resident ? std::max(demux.opt.memory_flow_max,demux.opt.prefix_hold_max) : demux.opt.prefix_hold_max;
+}
+
+/* The file is no longer just what the hashes were given */
+void tcpip::drop_hashes()
+{
+    if(hashes==0) return;
+    delete hashes;
+    hashes = 0;
+}
+
+/* Open up inslen bytes at the start of the data, for bytes that came
+ * before what we thought was the ISN.
+ */
+void tcpip::shift_data(size_t inslen)
+{
+    if(holding){
+        if(head.size()){                // an empty file stays empty, as with shift_file()
+            head.insert((size_t)0,inslen,'\0');
+            digests.shift(inslen);
+            demux.memory.change(memory_budget::HELD_FLOWS,0,inslen);
+        }
+        wend = head.size();
+        if(wend > hold_max()) settle_head();
+        return;
+    }
+    flush_reorder_queue();
+    flush_buffer();
+    if(hstream) hstream->gap();         // what it has seen is no longer at the start
+    drop_hashes();
+    if(contained){
+        demux.container->shift(myflow.id,inslen); // the data stays where it is; its offsets move
+        digests.shift(inslen);
+    } else {
+        demux.drain_writes(fd);
+        demux.perf.count(perf_counters::SHIFT_FILES);
+        if(gz ? gz->insert(fd,inslen) : shift_file(fd,inslen)==0) digests.shift(inslen);
+        else digests.segments.clear();  // we no longer know what is where
+    }
+    if(wend>0) wend += inslen;
+    fpos = -1;
+}
+
+/* Whether bytes that seen says we have are the same as data. They are
+ * compared where they are still in memory: head, wbuf, or a queued
+ * segment that starts at offset. Bytes already in the file are taken to be
+ * the same, as reading them back would cost more than writing them again.
+ */
+bool tcpip::same_as_held(uint64_t offset,const u_char *data,size_t length) const
+{
+    if(holding && offset+length <= head.size()) return memcmp(&head[offset],data,length)==0;
+    uint64_t wbuf_start = wend - wbuf.size();
+    if(offset >= wbuf_start && offset+length <= wend) return memcmp(&wbuf[offset-wbuf_start],data,length)==0;
+    reorder_t::const_iterator it = reorder.find(offset);
+    if(it!=reorder.end() && it->second.size() >= length) return memcmp(it->second.data(),data,length)==0;
+    return true;
+}
+
+/* Cut from [offset,offset+length) the bytes at either end that seen
+ * already has, if they are the same. Returns false if nothing is left.
+ */
+bool tcpip::trim_seen(uint64_t &offset,const u_char *&data,uint32_t &length) const
+{
+    uint64_t start = offset;
+    uint64_t end   = offset + length;
+    recon_set::range r(0,0);
+    if(seen.find(start,r)) start = std::min(r.end,end);
+    if(start<end && seen.find(end-1,r)) end = r.start; // after start, which isn't in a range
+    if(start>offset && !same_as_held(offset,data,start-offset)) return true;
+    if(end<offset+length && !same_as_held(end,data+(end-offset),offset+length-end)) return true;
+    if(start==end) return false;
+    data  += start - offset;
+    length = end - start;
+    offset = start;
+    return true;
+}
+
+/* Write the segment [offset,offset+length) of the stream. */
+void tcpip::write_segment(uint64_t offset,const u_char *data,size_t length)
+{
+    bool repeat = hashes && offset < wend && digests.matches(offset,data,length); // before we add it
+    digests.add(offset,data,length,demux.opt.straggler_index);
+    if(holding){
+        if(offset+length <= hold_max()){
+            if(head.size() < offset+length){
+                demux.memory.change(memory_budget::HELD_FLOWS,head.size(),offset+length);
+                head.resize(offset+length,'\0');
+            }
+            memcpy(&head[offset],data,length);
+            wend = head.size();
+            return;
+        }
+        settle_head();                  // the flow has outgrown the memory copy
+    }
+    if(offset < wend){
+        /* Rewrites data we already have (usually a retransmission) */
+        if(!repeat) drop_hashes();      // we can't tell the bytes are the same
+        size_t n = (size_t)(std::min(offset+length,wend) - offset);
+        uint64_t wbuf_start = wend - wbuf.size();
+        if(offset >= wbuf_start){
+            memcpy(&wbuf[offset-wbuf_start],data,n); // still in memory
+        } else {
+            flush_buffer();
+            write_file(offset,data,n);
+        }
+        if(n==length) return;
+        offset += n;
+        data   += n;
+        length -= n;
+    }
+    if(offset==wend && reorder.empty()){
+        write_sequential(data,length);  // the common case
+        return;
+    }
+    queue_segment(offset,data,length);
+
+    /* Write out whatever the gap before has filled */
+    while(reorder.size() && reorder.begin()->first==wend){
+        reorder_t::iterator it = reorder.begin();
+        write_sequential(reinterpret_cast<const u_char *>(it->second.data()),it->second.size());
+        reorder_bytes -= it->second.size();
+        demux.memory.change(memory_budget::REORDER_QUEUES,it->second.size(),0);
+        reorder.erase(it);
+    }
+    if(reorder_bytes > demux.opt.reorder_queue_max) flush_reorder_queue();
+}
+
+/* Write everything in the reorder queue where it belongs, leaving holes for
+ * the gaps. Data that fills the gaps later is written in place.
+ */
+void tcpip::flush_reorder_queue()
+{
+    if(reorder.size()==0) return;
+    flush_buffer();                     // wend is about to move past it
+    if(hstream) hstream->gap();         // the first segment in the queue is beyond wend
+    drop_hashes();
+    for(reorder_t::const_iterator it = reorder.begin();it!=reorder.end();it++){
+        if(has_output()) write_file(it->first,reinterpret_cast<const u_char *>(it->second.data()),it->second.size());
+        wend = it->first + it->second.size();
+    }
+    reorder.clear();
+    demux.memory.change(memory_budget::REORDER_QUEUES,reorder_bytes,0);
+    reorder_bytes = 0;
+}
+
 /*
  * Opens the file transcript file (creating file if necessary).
  * Called by store_packet()
@@ -168,23 +612,45 @@ void tcpip::close_file()
 int tcpip::open_file()
 {
 	int create_idx_needed = false;
-    if(fd<0){
+    if(!has_output()){
         //std::cerr << "open_file0 " << ct << " " << *this << "\n";
         /* If we don't have a filename, create the flow */
         if(flow_pathname.size()==0) {
-            flow_pathname = myflow.new_filename(&fd,O_RDWR|O_BINARY|O_CREAT|O_EXCL,0666);
+            if(demux.container){
+                flow_pathname = demux.container->new_flow(myflow);
+                contained = true;
+            } else if(demux.opt.memory_flow_max>0 && !demux.opt.output_packet_index){
+                resident = true;        // -I names the index after the file, so it can't wait
+            } else {
+                flow_pathname = myflow.new_filename(&fd,O_RDWR|O_BINARY|O_CREAT|O_EXCL,0666,
+                                                    demux.opt.flow_gzip ? flow_gzip::SUFFIX : "");
+                if(demux.opt.flow_gzip) gz = new flow_gzip(*demux.gzip());
+            }
             file_created = true;		// remember we made it
             create_idx_needed = true;	// We created a new stream, so we need to create a new flow file. --GDD
+            fpos = 0;
+            /* Without a SYN we may yet see earlier data that must be prepended */
+            holding = resident || (syn_count==0 && demux.opt.prefix_hold_max>0);
+            if(resident){
+                DEBUG(5) ("%s: keeping new flow in memory",myflow.str().c_str());
+                return 0;               // it takes no fd until spill()
+            }
+            if(demux.opt.http_stream) hstream = http_stream::open(flow_pathname);
+            hashes = flow_hash::open(demux.opt.flow_hashes);
             DEBUG(5) ("%s: created new file",flow_pathname.c_str());
+        } else if(demux.container){
+            demux.container->reopen(myflow,flow_pathname);
+            contained = true;
+            DEBUG(5) ("%s: reopening flow in the container", flow_pathname.c_str());
         } else {
             /* open an existing flow */
             fd = demux.retrying_open(flow_pathname,O_RDWR | O_BINARY | O_CREAT,0666);
-            lseek(fd,pos,SEEK_SET);  
+            fpos = -1;                  // write_file() will position it
             DEBUG(5) ("%s: opening existing file", flow_pathname.c_str());
         }
         
         /* If the file isn't open at this point, there's a problem */
-        if (fd < 0 ) {
+        if (!has_output()) {
             /* we had some problem opening the file -- set FINISHED so we
              * don't keep trying over and over again to reopen it
              */
@@ -194,23 +660,25 @@ int tcpip::open_file()
         /* Remember that we have this open */
         demux.open_flows.insert(this);
         if(demux.open_flows.size() > demux.max_open_flows) demux.max_open_flows = demux.open_flows.size();
+        TCPFLOW_PROBE3(fd_open,myflow.id,fd,demux.open_flows.size());
         //std::cerr << "open_file1 " << *this << "\n";
     }
-    if(demux.opt.output_packet_index){
+    if(demux.opt.output_packet_index && !demux.opt.packet_index_binary){
     	//Open the file for the flow index.  We don't do this if the flow file could not be
     	//	opened.  The file must be opened for append, in case this is a reopen.  The filename
     	//	standard is the flow name followed by ".findx", which google currently says does not
     	//	conflict with anything major.
     	flow_index_pathname = flow_pathname + ".findx";
     	DEBUG(10)("opening index file: %s",flow_index_pathname.c_str());
+    	if(idx_file==0) idx_file = new std::fstream();
     	if(create_idx_needed){
     		//New flow file, even if there was an old one laying around --GDD
-    		idx_file.open(flow_index_pathname.c_str(),std::ios::trunc|std::ios::in|std::ios::out);
+    		idx_file->open(flow_index_pathname.c_str(),std::ios::trunc|std::ios::in|std::ios::out);
     	}else{
     		//Use existing flow file --GDD
-    		idx_file.open(flow_index_pathname.c_str(),std::ios::ate|std::ios::in|std::ios::out);
+    		idx_file->open(flow_index_pathname.c_str(),std::ios::ate|std::ios::in|std::ios::out);
     	}
-    	if(idx_file.bad()){
+    	if(idx_file->bad()){
     		perror(flow_index_pathname.c_str());
     		// Be nice and be sure the flow has been closed in the demultiplexer.
     		// demux.close_tcpip_fd(this);  Need to fix this.  Also, when called, it will
@@ -244,7 +712,54 @@ void tcpip::print_packet(const u_char *data, uint32_t length)
 	}
     }
 
+    /* Render the packet into the demux's buffer, so that it is written all at
+     * once, or into a chunk for the console writer.
+     */
+#ifdef HAVE_CONSOLE_WRITER
+    console_chunk *chunk = demux.console ? demux.console->get(&demux.console_spares) : 0;
+    std::string &out = chunk ? chunk->text : demux.console_buf;
+#else
+    std::string &out = demux.console_buf;
+#endif
+    out.clear();
+    if (demux.opt.use_color) out.append(dir==dir_cs ? color[1] : color[2]);
+    if (demux.opt.suppress_header == 0){
+        if(flow_pathname.size()==0) flow_pathname = myflow.filename(0);
+        out.append(flow_pathname);
+        out.append(": ");
+        if(demux.opt.output_hex) out.push_back('\n');
+    }
+    bool raw = false;
+    if(demux.opt.output_hex){
+        console_format::hex_dump(out,data,length);
+    } else if(demux.opt.output_strip_nonprint){
+        console_format::printable(out,data,length);
+    } else {
+        raw = true;                     // the data goes straight from the packet
+    }
+    const char *tail = demux.opt.use_color ? "\033[0m\n" : "\n";
+#ifdef HAVE_CONSOLE_WRITER
+    if(chunk && raw){
+        out.append(reinterpret_cast<const char *>(data),length);
+        raw = false;
+    }
+#endif
+    if(!raw) out.append(tail);
+
+    last_byte += length;
+
+#ifdef HAVE_CONSOLE_SPLICE
+    if(raw && demux.splice && demux.splice->print(out,data,length,tail)) return;
+#endif
+#ifdef HAVE_CONSOLE_WRITER
+    if(chunk){
+        demux.console->put(chunk);      // the writer takes the semaphore
+        return;
+    }
+#endif
+
 #ifdef HAVE_PTHREAD
+    demux_lock lock(demux.shared_lock); // keep packets from different shards from interleaving
     if(semlock){
 	if(sem_wait(semlock)){
 	    fprintf(stderr,"%s: attempt to acquire semaphore failed: %s\n",progname,strerror(errno));
@@ -253,77 +768,18 @@ void tcpip::print_packet(const u_char *data, uint32_t length)
     }
 #endif
 
-    if (demux.opt.use_color) fputs(dir==dir_cs ? color[1] : color[2], stdout);
-    if (demux.opt.suppress_header == 0){
-        if(flow_pathname.size()==0) flow_pathname = myflow.filename(0);
-        printf("%s: ", flow_pathname.c_str());
-        if(demux.opt.output_hex) putchar('\n');
-    }
-
-    size_t written = 0;
-    if(demux.opt.output_hex){
-        const size_t bytes_per_line = 32;
-        size_t max_spaces = 0;
-        for(u_int i=0;i<length;i+=bytes_per_line){
-            size_t spaces=0;
-            
-            /* Print the offset */
-            char b[64];
-            size_t count = snprintf(b,sizeof(b),"%04x: ",(int)i);
-            if(fwrite(b,1,count,stdout)!=count){
-	      perror("fwrite");
-	    }
-            spaces += count;
-            
-            /* Print the hext bytes */
-            for(size_t j=0;j<bytes_per_line && i+j<length ;j++){
-                unsigned char ch = data[i+j];
-                fprintf(stdout,"%02x",ch);  spaces += 2;
-                if(j%2==1){
-                    fputc(' ',stdout);
-                    spaces += 1;
-                }
-            }
-            /* space out to where the ASCII region is */
-            if(spaces>max_spaces) max_spaces=spaces;
-            for(;spaces<max_spaces;spaces++){
-                fputc(' ',stdout);
-            }
-            putchar(' ');
-            /* Print the ascii */
-            for(size_t j=0;j<bytes_per_line && i+j<length;j++){
-                unsigned char ch = data[i+j];
-                if(ch>=' ' && ch<='~') fputc(ch,stdout);
-                else fputc('.',stdout);
-            }
-            fputc('\n',stdout);
+    if(fwrite(out.data(),1,out.size(),stdout)!=out.size()){
+        if(demux.opt.output_strip_nonprint && !demux.opt.output_hex){
+            std::cerr << "EOF on write to stdout\n";
+            exit(1);
         }
-        written = length;               // just fake it.
-    }
-    else if(demux.opt.output_strip_nonprint){
-	for(const u_char *cc = data;cc<data+length;cc++){
-	    if(isprint(*cc) || (*cc=='\n') || (*cc=='\r')){
-                int ret = fputc(*cc,stdout);
-                if(ret==EOF){
-                    std::cerr << "EOF on write to stdout\n";
-                    exit(1);
-                
-                }
-	    }
-            written += 1; // treat even unprintable characters as "written". It
-                          // really means "processed"
-	}
+        perror("fwrite");
     }
-    else {
-	written = fwrite(data,1,length,stdout);
+    if(raw){
+        size_t written = fwrite(data,1,length,stdout);
         if(length != written) std::cerr << "\nwrite error to stdout (" << length << "!=" << written << ") \n";
+        fputs(tail,stdout);
     }
-
-    last_byte += length;
-
-    if (demux.opt.use_color) printf("\033[0m");
-
-    putchar('\n');
     fflush(stdout);
 
 #ifdef HAVE_PTHREAD
@@ -336,50 +792,6 @@ void tcpip::print_packet(const u_char *data, uint32_t length)
 #endif
 }
 
-/*
- * extend_file_and_insert():
- * A handy function for inserting in the middle or beginning of a file.
- *
- * Based on:
- * http://stackoverflow.com/questions/10467711/c-write-in-the-middle-of-a-binary-file-without-overwriting-any-existing-content
- */
-
-static int shift_file(int fd, size_t inslen)
-{
-    enum { BUFFERSIZE = 64 * 1024 };
-    char buffer[BUFFERSIZE];
-    struct stat sb;
-
-    DEBUG(100)("shift_file(%d,%d)",fd,(int)inslen);
-
-    if (fstat(fd, &sb) != 0) return -1;
-
-    /* Move data after offset up by inslen bytes */
-    size_t bytes_to_move = sb.st_size;
-    off_t read_end_offset = sb.st_size; 
-    while (bytes_to_move != 0) {
-	ssize_t bytes_this_time = bytes_to_move < BUFFERSIZE ? bytes_to_move : BUFFERSIZE ;
-	ssize_t rd_off = read_end_offset - bytes_this_time;
-	ssize_t wr_off = rd_off + inslen;
-	lseek(fd, rd_off, SEEK_SET);
-	if (read(fd, buffer, bytes_this_time) != bytes_this_time)
-	    return -1;
-	lseek(fd, wr_off, SEEK_SET);
-	if (write(fd, buffer, bytes_this_time) != bytes_this_time)
-	    return -1;
-	bytes_to_move -= bytes_this_time;
-    }   
-    return 0;
-}
-
-#pragma GCC diagnostic ignored "-Weffc++"
-void update_seen(recon_set *seen,uint64_t pos,uint32_t length)
-{
-    if(seen){
-        (*seen) += boost::icl::discrete_interval<uint64_t>::closed(pos,pos+length-1);
-    }
-}
-
 /* store the contents of this packet to its place in its file
  * This has to handle out-of-order packets as well as writes
  * past the 4GiB boundary. 
@@ -392,8 +804,10 @@ void update_seen(recon_set *seen,uint64_t pos,uint32_t length)
  * to insert.  A relative seek more than max_seek means that we have a
  * different flow that needs to be separately handled.
  *
- * called from tcpdemux::process_tcp_packet()
+ * called from tcpdemux::process_tcp(). INDEX is opt.output_packet_index,
+ * fixed for the pipeline that tcpdemux::select_pipeline() chose.
  */
+template <bool INDEX>
 void tcpip::store_packet(const u_char *data, uint32_t length, int32_t delta,struct timeval ts)
 {
     if(length==0) return;               // no need to do anything
@@ -413,6 +827,32 @@ void tcpip::store_packet(const u_char *data, uint32_t length, int32_t delta,stru
 	}
 	insert_bytes = -offset;		// open up this much space
 	offset = 0;			// and write the data here
+        TCPFLOW_PROBE2(insert,myflow.id,insert_bytes);
+    }
+
+    /* A retransmission of bytes we already have is a no-op, and one that
+     * overlaps them is cut down to the new bytes, so the file isn't seeked
+     * back and rewritten with what it holds. The -I index has an entry for
+     * every packet written, so with it they are all written as before.
+     */
+    if(track_seen && insert_bytes==0 && !(delta == -1 && length == 1) && !INDEX){
+        uint64_t start = offset;
+        uint32_t before = length;
+        if(!trim_seen(offset,data,length)){
+            demux.perf.count(perf_counters::DUPLICATE_SEGMENTS);
+            demux.perf.count(perf_counters::DUPLICATE_BYTES,before);
+            if(delta<0) out_of_order_count++; // as the seek back would have
+            int64_t moved = (int64_t)delta + before; // as if it had been written
+            pos += moved;
+            nsn += moved;
+            if(pos>last_byte) last_byte = pos;
+            return;
+        }
+        if(length<before){
+            demux.perf.count(perf_counters::DUPLICATE_BYTES,before-length);
+            if(delta<0 && offset==pos) out_of_order_count++;
+            delta += offset - start;
+        }
     }
 
     /* reduce length to write if it goes beyond the number of bytes per flow,
@@ -434,7 +874,7 @@ void tcpip::store_packet(const u_char *data, uint32_t length, int32_t delta,stru
      * save the return value because open_tcpfile() puts the file pointer
      * into the structure for us.
      */
-    if (fd < 0 && wlength>0) {
+    if (!has_output() && wlength>0) {
 	if (open_file()) {
 	    DEBUG(1)("unable to open TCP file %s  fd=%d  wlength=%d",
                      flow_pathname.c_str(),fd,(int)wlength);
@@ -445,24 +885,20 @@ void tcpip::store_packet(const u_char *data, uint32_t length, int32_t delta,stru
     /* Shift the file now if we were going shift it */
 
     if(insert_bytes>0){
-	if(fd>=0) shift_file(fd,insert_bytes);
+	if(has_output()) shift_data(insert_bytes);
 	isn -= insert_bytes;		// it's really earlier
-	lseek(fd,(off_t)0,SEEK_SET);	// put at the beginning
 	pos = 0;
 	nsn = isn+1;
 	out_of_order_count++;
-	DEBUG(25)("%s: insert(0,%d); lseek(%d,0,SEEK_SET) out_of_order_count=%" PRId64,
-		  flow_pathname.c_str(), insert_bytes,
-		  fd,out_of_order_count);
+	DEBUG(25)("%s: insert(0,%d) out_of_order_count=%" PRId64,
+		  flow_pathname.c_str(), insert_bytes, out_of_order_count);
 
         /* TK: If we have seen packets, everything in the recon set needs to be shifted as well.*/
-        if(seen){
-            delete seen;
-            seen = 0;
-        }
+        seen.clear();
+        track_seen = false;
     }
 
-    /* if we're not at the correct point in the file, seek there */
+    /* if we're not at the correct point in the file, move there */
     if (offset != pos) {
         /* Check for a keepalive */
         if(delta == -1 && length == 1) {
@@ -470,10 +906,10 @@ void tcpip::store_packet(const u_char *data, uint32_t length, int32_t delta,stru
             return;
         }
 
-	if(fd>=0) lseek(fd,(off_t)delta,SEEK_CUR);
 	if(delta<0) out_of_order_count++; // only increment for backwards seeks
-	DEBUG(25)("%s: lseek(%d,%d,SEEK_CUR) offset=%" PRId64 " pos=%" PRId64 " out_of_order_count=%" PRId64,
-		  flow_pathname.c_str(), fd,(int)delta,offset,pos,out_of_order_count);
+        TCPFLOW_PROBE3(out_of_order,myflow.id,delta,length);
+	DEBUG(25)("%s: seek %d offset=%" PRId64 " pos=%" PRId64 " out_of_order_count=%" PRId64,
+		  flow_pathname.c_str(), (int)delta,offset,pos,out_of_order_count);
 	pos += delta;			// where we are now
 	nsn += delta;			// what we expect the nsn to be now
     }
@@ -481,33 +917,31 @@ void tcpip::store_packet(const u_char *data, uint32_t length, int32_t delta,stru
     /* write the data into the file */
     DEBUG(25) ("%s: %s write %ld bytes @%" PRId64,
                flow_pathname.c_str(),
-               fd>=0 ? "will" : "won't",
+               has_output() ? "will" : "won't",
                (long) wlength, offset);
     
-    if(fd>=0){
-      if ((uint32_t)write(fd,data, wlength) != wlength) {
-	    DEBUG(1) ("write to %s failed: ", flow_pathname.c_str());
-	    if (debug >= 1) perror("");
-	}
+    if(has_output()){
+        if(wlength>0) write_segment(offset,data,wlength);
 	// Write to the index file if needed.  Note, index file is sorted before close, so no need to jump around --GDD
-		if (demux.opt.output_packet_index && idx_file.is_open()) {
-			idx_file << offset << "|" << ts.tv_sec << "." << ts.tv_usec << "|"
+		if (INDEX && demux.opt.packet_index_binary) {
+			if (pindex==0) pindex = new packet_index();
+			pindex->add(offset,ts,wlength);
+			if (pindex->full()) pindex->flush(flow_pathname + ".bfindx");
+		}
+		if (INDEX && idx_file && idx_file->is_open()) {
+			*idx_file << offset << "|" << ts.tv_sec << "." << ts.tv_usec << "|"
 					<< wlength << "\n";
-			if (idx_file.bad()){
+			if (idx_file->bad()){
 				DEBUG(1)("write to index file %s failed: ",flow_index_pathname.c_str());
 				if(debug >= 1){
 					perror("");
 				}
 			}
 		}
-	if(wlength != length){
-	    off_t p = lseek(fd,length-wlength,SEEK_CUR); // seek out the space we didn't write
-            DEBUG(100)("   lseek(%" PRId64 ",SEEK_CUR)=%" PRId64,(int64_t)(length-wlength),(int64_t)p);
-	}
     }
 
     /* Update the database of bytes that we've seen */
-    if(seen) update_seen(seen,pos,length);
+    if(track_seen) seen.insert(pos,pos+length);
 
     /* Update the position in the file and the next expected sequence number */
     pos += length;
@@ -515,11 +949,8 @@ void tcpip::store_packet(const u_char *data, uint32_t length, int32_t delta,stru
 
     if(pos>last_byte) last_byte = pos;
 
-    if(debug>=100){
-        uint64_t rpos = lseek(fd,(off_t)0,SEEK_CUR);
-        DEBUG(100)("    pos=%" PRId64 "  lseek(fd,0,SEEK_CUR)=%" PRId64,pos,rpos);
-        assert(pos==rpos);
-    }
+    DEBUG(100)("    pos=%" PRId64 " wend=%" PRId64 " buffered=%d queued=%d",
+               pos,wend,(int)wbuf.size(),(int)reorder_bytes);
 
 #ifdef DEBUG_REOPEN_LOGIC
     /* For debugging, force this connection closed */
@@ -527,6 +958,101 @@ void tcpip::store_packet(const u_char *data, uint32_t length, int32_t delta,stru
 #endif
 }
 
+template void tcpip::store_packet<false>(const u_char *data, uint32_t length, int32_t delta,struct timeval ts);
+template void tcpip::store_packet<true>(const u_char *data, uint32_t length, int32_t delta,struct timeval ts);
+
+/****************************************************************
+ ** BINARY PACKET INDEX
+ ****************************************************************/
+
+static void put_le(uint8_t *p,uint64_t v,int n)
+{
+    for(int i=0;i<n;i++) p[i] = (uint8_t)(v >> (8*i));
+}
+
+static uint64_t get_le(const uint8_t *p,int n)
+{
+    uint64_t v = 0;
+    for(int i=n-1;i>=0;i--) v = (v<<8) | p[i];
+    return v;
+}
+
+void packet_index::add(uint64_t offset,const struct timeval &ts,uint32_t length)
+{
+    if(offset < last_offset) sorted = false;
+    last_offset = offset;
+    size_t at = buf.size();
+    buf.resize(at + RECORD_SIZE);
+    put_le(&buf[at],offset,8);
+    put_le(&buf[at+8],(uint64_t)(int64_t)ts.tv_sec,8);
+    put_le(&buf[at+16],(uint64_t)ts.tv_usec,4);
+    put_le(&buf[at+20],length,4);
+}
+
+void packet_index::flush(const std::string &path)
+{
+    if(buf.size()==0 && created) return;
+    int fd = ::open(path.c_str(),O_WRONLY|O_CREAT|O_BINARY|(created ? O_APPEND : O_TRUNC),0666);
+    if(fd<0){
+        perror(path.c_str());
+        return;                         // keep the records; the next flush may work
+    }
+    created = true;
+    if(buf.size() && write(fd,&buf[0],buf.size())!=(ssize_t)buf.size()){
+        DEBUG(1)("write to index file %s failed: %s",path.c_str(),strerror(errno));
+    }
+    close(fd);
+    buf.clear();
+}
+
+static bool record_before(const packet_index::record &a,const packet_index::record &b)
+{
+    return a.offset < b.offset;
+}
+
+/* After the last flush. Records for the same offset stay in the order they were written. */
+void packet_index::finish(const std::string &path)
+{
+    flush(path);
+    if(sorted) return;
+    int fd = ::open(path.c_str(),O_RDWR|O_BINARY);
+    if(fd<0){
+        perror(path.c_str());
+        return;
+    }
+    struct stat st;
+    if(fstat(fd,&st)==0 && st.st_size>=RECORD_SIZE){
+        size_t n = (size_t)st.st_size / RECORD_SIZE;
+        std::vector<uint8_t> raw(n*RECORD_SIZE);
+        if(pread(fd,&raw[0],raw.size(),0)==(ssize_t)raw.size()){
+            std::vector<record> recs(n);
+            for(size_t i=0;i<n;i++){
+                const uint8_t *p = &raw[i*RECORD_SIZE];
+                recs[i].offset = get_le(p,8);
+                recs[i].sec    = (int64_t)get_le(p+8,8);
+                recs[i].usec   = (uint32_t)get_le(p+16,4);
+                recs[i].length = (uint32_t)get_le(p+20,4);
+            }
+            size_t prefix = 1;          // usually most of the flow came in order
+            while(prefix<n && recs[prefix].offset >= recs[prefix-1].offset) prefix++;
+            std::stable_sort(recs.begin()+prefix,recs.end(),record_before);
+            std::inplace_merge(recs.begin(),recs.begin()+prefix,recs.end(),record_before);
+            for(size_t i=0;i<n;i++){
+                uint8_t *p = &raw[i*RECORD_SIZE];
+                put_le(p,recs[i].offset,8);
+                put_le(p+8,(uint64_t)recs[i].sec,8);
+                put_le(p+16,recs[i].usec,4);
+                put_le(p+20,recs[i].length,4);
+            }
+            if(pwrite(fd,&raw[0],raw.size(),0)!=(ssize_t)raw.size()){
+                DEBUG(1)("write to index file %s failed: %s",path.c_str(),strerror(errno));
+            }
+        }
+    }
+    close(fd);
+    sorted = true;
+}
+
 /*
  * Compare two index strings and return the result.  Called by
  * the vector::sort in sort_index.
@@ -555,7 +1081,7 @@ void tcpip::sort_index(std::fstream *ix_file) {
 	std::string line;
 
 	if (demux.opt.output_packet_index) {
-		if (!(idx_file.good() && idx_file.is_open())) {
+		if (!(idx_file && idx_file->good() && idx_file->is_open())) {
 			DEBUG(5)("Skipping index file sort.  Unusual behavior.\n");
 			return; //Nothing to do
 		}
@@ -583,7 +1109,7 @@ void tcpip::sort_index(std::fstream *ix_file) {
  * --GDD
  */
 void tcpip::sort_index(){
-	tcpip::sort_index(&(this->idx_file));
+	if (idx_file) tcpip::sort_index(idx_file);
 }
 
 #pragma GCC diagnostic ignored "-Weffc++"
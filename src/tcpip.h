@@ -2,6 +2,7 @@
 #define TCPIP_H
 
 #include <fstream>
+#include <map>
 
 /** On windows, there is no in_addr_t; this is from
  * /usr/include/netinet/in.h
@@ -106,6 +107,18 @@ public:
 	}
     }
 
+    /* A hash that is identical for both directions of a connection.
+     * Used to keep both halves of a connection on the same demux shard.
+     */
+    uint64_t symmetric_hash() const {
+        uint64_t h = (src.dquad(0) ^ dst.dquad(0)) * 0x9e3779b97f4a7c15ULL;
+        h ^= (src.dquad(1) ^ dst.dquad(1)) + ((uint64_t)(sport ^ dport) << 32) + (uint64_t)(sport + dport);
+        h ^= h >> 33;                   // finalizer from MurmurHash3
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h;
+    }
+
     inline bool operator ==(const flow_addr &b) const {
 	return this->src==b.src &&
 	    this->dst==b.dst &&
@@ -174,15 +187,18 @@ public:;
 
     // return a filename for a flow based on the template and the connection count
     std::string filename(uint32_t connection_count); 
+    void filename(std::string &out,uint32_t connection_count) const; // into out, reusing its storage
+    static void compile_filename_template();    // call once filename_template and outdir are set
+    static void make_bin_dirs(uint64_t ids);    // the directories of the first ids flows
     // return a new filename for a flow based on the temlate,
     // optionally opening the file and returning a fd if &fd is provided
-    std::string new_filename(int *fd,int flags,int mode);	
+    std::string new_filename(int *fd,int flags,int mode,const char *suffix="");
 
-    bool has_mac_daddr(){
+    bool has_mac_daddr() const {
         return mac_daddr[0] || mac_daddr[1] || mac_daddr[2] || mac_daddr[3] || mac_daddr[4] || mac_daddr[5];
     }
 
-    bool has_mac_saddr(){
+    bool has_mac_saddr() const {
         return mac_saddr[0] || mac_saddr[1] || mac_saddr[2] || mac_saddr[3] || mac_saddr[4] || mac_saddr[5];
     }
 };
@@ -234,25 +250,63 @@ public:
  *   - the flow (as an embedded object)
  *   - Information about where the flow is written.
  *   - Information about how much of the flow has been captured.
- * Currently flows only go in one direction and do not know about their sibling flow
+ * Each tcpip is one direction of a connection. While both directions are
+ * tracked they are paired through sibling; see tcpdemux::pair().
  */
 
-#pragma GCC diagnostic ignored "-Weffc++"
-#pragma GCC diagnostic ignored "-Wshadow"
-#pragma GCC diagnostic ignored "-Wall"
-#pragma GCC diagnostic ignored "-Wmissing-noreturn"
+#include "recon_set.h"                  // bytes that were reconstructed
+#include "timer_wheel.h"
 
-#if defined(HAVE_BOOST_ICL_INTERVAL_HPP) && defined(HAVE_BOOST_ICL_INTERVAL_MAP_HPP) && defined(HAVE_BOOST_ICL_INTERVAL_SET_HPP)
-#include <boost/icl/interval.hpp>
-#include <boost/icl/interval_map.hpp>
-#include <boost/icl/interval_set.hpp>
-typedef boost::icl::interval_set<uint64_t> recon_set; // Boost interval set of bytes that were reconstructed.
-#endif
+/* Digests of the segments most recently written to a flow file, by offset.
+ * A retransmission that arrives after the flow is closed usually repeats a
+ * segment exactly, so it can be recognized without reading the file back.
+ * Entries never overlap: a write drops the entries for the data it replaces.
+ * matches() is only ever a positive answer; otherwise the file is read.
+ */
+class segment_index {
+public:
+    struct segment {
+        uint64_t offset;
+        uint64_t digest;
+        uint32_t length;
+    };
+    std::vector<segment> segments;      // sorted by offset
+
+    segment_index():segments(){}
+    static uint64_t digest(const u_char *data,size_t length);
+    void add(uint64_t offset,const u_char *data,size_t length,size_t limit); // keeps at most limit entries
+    void shift(uint64_t inslen);        // the data moved inslen bytes further into the file
+    bool matches(uint64_t offset,const u_char *data,size_t length) const;
+};
 
-#pragma GCC diagnostic warning "-Weffc++"
-#pragma GCC diagnostic warning "-Wshadow"
-#pragma GCC diagnostic warning "-Wall"
-#pragma GCC diagnostic warning "-Wmissing-noreturn"
+/* The -I packet index in binary form (-S packet_index_binary=1): one
+ * fixed-width little-endian record of offset (8), seconds (8), microseconds (4)
+ * and length (4) per write. Records are collected in buf and appended to the
+ * file with a descriptor that is opened only for the append, so unlike the
+ * text index this needs no descriptor while the flow is open. The records
+ * are in offset order unless segments arrived out of order; finish() then
+ * sorts the file by merging its sorted prefix with the sorted remainder.
+ */
+class packet_index {
+public:
+    enum { RECORD_SIZE = 24, BUFFER_RECORDS = 256 };
+    struct record {
+        uint64_t offset;
+        int64_t  sec;
+        uint32_t usec;
+        uint32_t length;
+    };
+    packet_index():buf(),last_offset(0),sorted(true),created(false){}
+    std::vector<uint8_t> buf;           // records not yet in the file
+    uint64_t last_offset;
+    bool     sorted;                    // no record is before the one added ahead of it
+    bool     created;                   // the file has been started for this flow
+
+    void add(uint64_t offset,const struct timeval &ts,uint32_t length);
+    bool full() const { return buf.size() >= BUFFER_RECORDS*RECORD_SIZE; }
+    void flush(const std::string &path);
+    void finish(const std::string &path); // flush, then sort if needed
+};
 
 class tcpip {
 public:
@@ -272,7 +326,8 @@ private:
     /*** End Effective C++ error suppression */
 
 public:;
-    tcpip(class tcpdemux &demux_,const flow &flow_,be13::tcp_seq isn_);    /* constructor in tcpip.cpp */
+    tcpip(class tcpdemux &demux_,const flow_addr &flowa,uint64_t id,const be13::packet_info &pi,
+          be13::tcp_seq isn_);          /* constructor in tcpip.cpp */
     virtual ~tcpip();			// destructor
 
     class tcpdemux &demux;		// our demultiplexer
@@ -290,28 +345,71 @@ public:;
     /* Archiving information */
     std::string flow_pathname;		// path where flow is saved
     int		fd;			// file descriptor for file storing this flow's data 
+    bool	contained;		// open in demux.container rather than in a file (fd is -1)
+    bool	resident;		// all in head, with no file yet (fd is -1); see memory_flow_max
     bool	file_created;		// true if file was created
 
     /* Flow Index information - only used if flow packet/data indexing is requested --GDD */
     std::string flow_index_pathname;	// Path for the flow index file
-    std::fstream		idx_file;				// File descriptor for storing the flow index data
+    std::fstream		*idx_file;				// File for storing the flow index data; created when first opened
+    packet_index *pindex;               // the binary index, instead of idx_file
 
     /* Stats */
-    recon_set   *seen;                  // what we've seen; it must be * due to boost lossage
+    recon_set   seen;                   // what we've seen
+    bool        track_seen;             // false once seen can no longer be kept
     uint64_t    last_byte;              // last byte in flow processed
     uint64_t	last_packet_number;	// for finding most recent packet written
     uint64_t	out_of_order_count;	// all packets were contigious
     uint64_t    violations;		// protocol violation count
+    uint32_t    sample_rate;            // 1 in this many flows were kept when this one began
+    timer_wheel<tcpip>::handle expiry;  // where the flow is in demux.expiry (tcp_timeout)
+    tcpip       *ring_prev;             // neighbours in demux.open_flows while fd is open
+    tcpip       *ring_next;
+    tcpip       *sibling;               // the other direction, while both are in demux.flow_map
+    bool        finished;               // with pair_close, complete and waiting for sibling to be
+
+    /* File output; see "FILE OUTPUT" in tcpip.cpp.
+     * wbuf is the write-behind buffer, used when demux.opt.write_buffer_size is set.
+     * reorder holds segments that arrived ahead of wend, by offset.
+     */
+    typedef std::map<uint64_t,std::string> reorder_t;
+    std::vector<uint8_t> wbuf;
+    size_t      wbuf_index;             // where we are in demux.buffered_flows
+    uint64_t    wend;                   // end of the data written to the file or wbuf
+    int64_t     fpos;                   // where fd is positioned; -1 if unknown
+    reorder_t   reorder;
+    size_t      reorder_bytes;          // data in reorder
+    bool        holding;                // the file's contents are in head, not yet written
+    std::string head;
+    segment_index digests;              // for matching stragglers once the flow is saved
+    class http_stream *hstream;         // scan_http's streaming mode; given what is written, in order
+    class flow_hash *hashes;            // digests of the file so far; 0 once they can't be kept up
+    class flow_gzip *gz;                // with -S flow_gzip, what the file is written through
 
     /* Methods */
+    bool has_output() const { return fd>=0 || contained || resident; }
     void close_file();			// close fd
+    void flush_buffer(bool release=false); // write wbuf; release frees its memory
+    void flush_reorder_queue();         // write the queued segments, leaving holes for the gaps
+    void write_file(uint64_t offset,const u_char *data,size_t length);
+    void write_sequential(const u_char *data,size_t length);
+    void queue_segment(uint64_t offset,const u_char *data,size_t length);
+    void write_segment(uint64_t offset,const u_char *data,size_t length);
+    bool same_as_held(uint64_t offset,const u_char *data,size_t length) const; // false if it is known to differ
+    bool trim_seen(uint64_t &offset,const u_char *&data,uint32_t &length) const; // see store_packet()
+    void shift_data(size_t inslen);
+    void settle_head(std::string *keep=0); // keep: given the data, rather than it being freed
+    void spill(bool streams);           // give a resident flow its file
+    size_t hold_max() const;            // how large head may grow
+    void drop_hashes();
     int  open_file();                   // opens save file; return -1 if failure, 0 if success
     void print_packet(const u_char *data, uint32_t length);
+    template <bool INDEX>               // INDEX: opt.output_packet_index; see tcpdemux::select_pipeline()
     void store_packet(const u_char *data, uint32_t length, int32_t delta,struct timeval ts);
     void process_packet(const struct timeval &ts,const int32_t delta,const u_char *data,const uint32_t length);
     uint32_t seen_bytes();
     void dump_seen();
-    void dump_xml(class dfxml_writer *xmlreport,const std::string &xmladd);
+    void report(class flow_report &fr,const std::string &xmladd) const; // what report.xml says about us
     static bool compare(std::string a, std::string b);
     void sort_index(std::fstream *idx_file);
     void sort_index();
@@ -329,24 +427,4 @@ inline std::ostream & operator <<(std::ostream &os,const tcpip &f) {
     return os;
 }
 
-/*
- * An saved_flow is a flow for which all of the packets have been received and tcpip state
- * has been discarded. The saved_flow allows matches against newly received packets
- * that are not SYN or ACK packets but have data. We can see if the data matches data that's
- * been written to disk. To do this we need ot know the filename and the ISN...
- */
-
-class saved_flow  {
-public:
-    saved_flow(tcpip *tcp):addr(tcp->myflow),
-                           saved_filename(tcp->flow_pathname),
-                           isn(tcp->isn) {}
-                           
-    flow_addr         addr;                  // flow address
-    std::string       saved_filename;        // where the flow was saved
-    be13::tcp_seq     isn;                    // the flow's ISN
-    virtual ~saved_flow(){};
-};
-
-
 #endif
@@ -0,0 +1,121 @@
+/*
+ * timer_wheel.h:
+ *
+ * A timing wheel for expiring idle objects in amortized O(1) time.
+ *
+ * Each object is kept in the bucket for the second at which it becomes
+ * due; rescheduling moves it between buckets with a list splice, and
+ * expire() only visits the buckets for the seconds that have gone by.
+ * The wheel has a fixed number of one-second buckets, so an object due
+ * further in the future than that shares a bucket with nearer objects and
+ * is skipped over until its own time comes.
+ *
+ * The wheel does not own the objects. Each object embeds a
+ * timer_wheel<T>::handle named expiry that records where it is scheduled.
+ *
+ * #include this file after config.h (or whatever you are calling it)
+ */
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <time.h>
+#include <list>
+#include <vector>
+
+template <typename T> class timer_wheel {
+public:
+    typedef std::list<T *> bucket_t;
+    enum { SLOTS = 1024 };              // one per second; need not cover the timeout
+
+    class handle {
+    public:
+        handle():scheduled(false),when(0),slot(0),pos(){}
+        bool     scheduled;
+        time_t   when;                  // second at which the object is due
+        size_t   slot;
+        typename bucket_t::iterator pos;
+    };
+
+private:
+    /* Assignment and copy are not implemented */
+    timer_wheel(const timer_wheel &);
+    timer_wheel &operator=(const timer_wheel &);
+
+    std::vector<bucket_t> buckets;
+    bucket_t spare;                     // list nodes of cancelled objects, reused by schedule()
+    bool     started;
+    time_t   next;                      // first second that has not been expired
+    size_t   count;
+
+    void drain(size_t slot,time_t now,std::vector<T *> &due){
+        bucket_t &b = buckets[slot];
+        for(typename bucket_t::iterator it = b.begin(); it!=b.end(); ){
+            typename bucket_t::iterator cur = it++;
+            if((*cur)->expiry.when <= now){
+                (*cur)->expiry.scheduled = false;
+                due.push_back(*cur);
+                spare.splice(spare.end(),b,cur);
+                count--;
+            }
+        }
+    }
+
+public:
+    timer_wheel():buckets(SLOTS),spare(),started(false),next(0),count(0){}
+
+    size_t size() const { return count; }
+
+    /** Schedule (or reschedule) obj to be due at second when.
+     * A time that has already been expired is moved up to the next second.
+     */
+    void schedule(T *obj,time_t when){
+        handle &h = obj->expiry;
+        if(started && when < next) when = next;
+        size_t slot = (size_t)((uint64_t)when % SLOTS);
+        h.when = when;
+        if(h.scheduled){
+            if(h.slot!=slot){
+                buckets[slot].splice(buckets[slot].end(),buckets[h.slot],h.pos);
+                h.slot = slot;
+            }
+            return;
+        }
+        if(spare.size()){
+            spare.front() = obj;
+            buckets[slot].splice(buckets[slot].end(),spare,spare.begin());
+            h.pos = --buckets[slot].end();
+        } else {
+            h.pos = buckets[slot].insert(buckets[slot].end(),obj);
+        }
+        h.slot = slot;
+        h.scheduled = true;
+        count++;
+    }
+
+    void cancel(T *obj){
+        handle &h = obj->expiry;
+        if(!h.scheduled) return;
+        spare.splice(spare.end(),buckets[h.slot],h.pos);
+        h.scheduled = false;
+        count--;
+    }
+
+    /** Append to due every object that is due at or before now; they are unscheduled. */
+    void expire(time_t now,std::vector<T *> &due){
+        if(!started){
+            started = true;
+            next = now;
+        }
+        if(now < next) return;          // time went backwards; nothing new is due
+        if(now - next >= (time_t)SLOTS){
+            for(size_t slot=0;slot<SLOTS;slot++) drain(slot,now,due);
+        } else {
+            for(time_t t=next;t<=now;t++) drain((size_t)((uint64_t)t % SLOTS),now,due);
+        }
+        next = now+1;
+    }
+};
+
+#endif
@@ -0,0 +1,231 @@
+/*
+ * tpacket_capture.cpp:
+ *
+ * TPACKET_V3 live capture; see tpacket_capture.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "tpacket_capture.h"
+
+#ifdef HAVE_TPACKET_CAPTURE
+
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+
+tpacket_capture *tpacket_capture::open(const std::string &device,bool promisc,uint32_t ring_mb,
+                                       int fanout_group,const struct bpf_program *filter,std::string &err)
+{
+    tpacket_capture *cap = new tpacket_capture();
+    /* Protocol 0 receives nothing until bind() names the device and
+     * ETH_P_ALL, so the ring never holds frames from other interfaces.
+     */
+    cap->fd = socket(AF_PACKET,SOCK_RAW,0);
+    if(cap->fd<0){
+        err = ssprintf("socket(AF_PACKET): %s",strerror(errno));
+        delete cap;
+        return 0;
+    }
+
+    /* Only devices whose frames start with an Ethernet header */
+    struct ifreq ifr;
+    memset(&ifr,0,sizeof(ifr));
+    strncpy(ifr.ifr_name,device.c_str(),sizeof(ifr.ifr_name)-1);
+    if(ioctl(cap->fd,SIOCGIFINDEX,&ifr)<0){
+        err = ssprintf("%s: %s",device.c_str(),strerror(errno));
+        delete cap;
+        return 0;
+    }
+    int ifindex = ifr.ifr_ifindex;
+    if(ioctl(cap->fd,SIOCGIFHWADDR,&ifr)<0 ||
+       (ifr.ifr_hwaddr.sa_family!=ARPHRD_ETHER && ifr.ifr_hwaddr.sa_family!=ARPHRD_LOOPBACK)){
+        err = ssprintf("%s: not an Ethernet device",device.c_str());
+        delete cap;
+        return 0;
+    }
+    cap->loopback = ifr.ifr_hwaddr.sa_family==ARPHRD_LOOPBACK;
+
+    int version = TPACKET_V3;
+    if(setsockopt(cap->fd,SOL_PACKET,PACKET_VERSION,&version,sizeof(version))<0){
+        err = ssprintf("PACKET_VERSION: %s",strerror(errno));
+        delete cap;
+        return 0;
+    }
+
+    struct tpacket_req3 req;
+    memset(&req,0,sizeof(req));
+    cap->block_count      = (uint32_t)((uint64_t)ring_mb * 1024*1024 / BLOCK_SIZE);
+    if(cap->block_count==0) cap->block_count = 1;
+    req.tp_block_size     = BLOCK_SIZE;
+    req.tp_block_nr       = cap->block_count;
+    req.tp_frame_size     = FRAME_SIZE;
+    req.tp_frame_nr       = (BLOCK_SIZE / FRAME_SIZE) * cap->block_count;
+    req.tp_retire_blk_tov = BLOCK_TIMEOUT_MS;
+    req.tp_feature_req_word = TP_FT_REQ_FILL_RXHASH;
+    if(setsockopt(cap->fd,SOL_PACKET,PACKET_RX_RING,&req,sizeof(req))<0){
+        err = ssprintf("PACKET_RX_RING: %s",strerror(errno));
+        delete cap;
+        return 0;
+    }
+    cap->ring_size = (size_t)req.tp_block_size * req.tp_block_nr;
+    void *m = mmap(0,cap->ring_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_LOCKED,cap->fd,0);
+    if(m==MAP_FAILED){
+        m = mmap(0,cap->ring_size,PROT_READ|PROT_WRITE,MAP_SHARED,cap->fd,0); // MAP_LOCKED needs privilege
+    }
+    if(m==MAP_FAILED){
+        err = ssprintf("mmap of capture ring: %s",strerror(errno));
+        delete cap;
+        return 0;
+    }
+    cap->ring = (uint8_t *)m;
+
+    /* Attach the filter before binding so that nothing unfiltered is queued.
+     * libpcap produces classic BPF, which is what the kernel runs.
+     */
+    if(filter && filter->bf_len>0){
+        struct sock_fprog prog;
+        prog.len    = (unsigned short)filter->bf_len;
+        prog.filter = reinterpret_cast<struct sock_filter *>(filter->bf_insns);
+        if(setsockopt(cap->fd,SOL_SOCKET,SO_ATTACH_FILTER,&prog,sizeof(prog))<0){
+            err = ssprintf("SO_ATTACH_FILTER: %s",strerror(errno));
+            delete cap;
+            return 0;
+        }
+    }
+
+    struct sockaddr_ll sll;
+    memset(&sll,0,sizeof(sll));
+    sll.sll_family   = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex  = ifindex;
+    if(bind(cap->fd,(struct sockaddr *)&sll,sizeof(sll))<0){
+        err = ssprintf("bind %s: %s",device.c_str(),strerror(errno));
+        delete cap;
+        return 0;
+    }
+
+    if(promisc){
+        struct packet_mreq mr;
+        memset(&mr,0,sizeof(mr));
+        mr.mr_ifindex = ifindex;
+        mr.mr_type    = PACKET_MR_PROMISC;
+        if(setsockopt(cap->fd,SOL_PACKET,PACKET_ADD_MEMBERSHIP,&mr,sizeof(mr))<0){
+            err = ssprintf("PACKET_MR_PROMISC: %s",strerror(errno));
+            delete cap;
+            return 0;
+        }
+    }
+
+    if(fanout_group>=0){
+        int arg = (fanout_group & 0xffff) | (PACKET_FANOUT_HASH << 16);
+        if(setsockopt(cap->fd,SOL_PACKET,PACKET_FANOUT,&arg,sizeof(arg))<0){
+            err = ssprintf("PACKET_FANOUT: %s",strerror(errno));
+            delete cap;
+            return 0;
+        }
+    }
+    return cap;
+}
+
+tpacket_capture::~tpacket_capture()
+{
+    if(ring) munmap(ring,ring_size);
+    if(fd>=0) close(fd);
+}
+
+/* Hand every packet in a block that the kernel has passed to us to handler */
+void tpacket_capture::walk_block(struct tpacket_block_desc *block,pcap_handler handler,u_char *user)
+{
+    uint32_t count = block->hdr.bh1.num_pkts;
+    const uint8_t *p = (const uint8_t *)block + block->hdr.bh1.offset_to_first_pkt;
+    for(uint32_t i=0;i<count;i++){
+        const struct tpacket3_hdr *tp = (const struct tpacket3_hdr *)p;
+        p += tp->tp_next_offset;
+        if(loopback){
+            const struct sockaddr_ll *sll = (const struct sockaddr_ll *)
+                ((const uint8_t *)tp + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+            if(sll->sll_pkttype==PACKET_OUTGOING) continue;
+        }
+        struct pcap_pkthdr h;
+        h.ts.tv_sec  = tp->tp_sec;
+        h.ts.tv_usec = tp->tp_nsec / 1000;
+        h.caplen     = tp->tp_snaplen;
+        h.len        = tp->tp_len;
+        const u_char *frame = (const u_char *)tp + tp->tp_mac;
+        if(h.caplen > SNAPLEN) h.caplen = SNAPLEN;
+
+        /* The kernel strips the 802.1Q tag into the header. Put it back so
+         * the frame looks as it did on the wire, which is what dl_ethernet() expects.
+         */
+        if((tp->tp_status & TP_STATUS_VLAN_VALID) && h.caplen >= 12){
+            uint16_t tpid = ETH_P_8021Q;
+#ifdef TP_STATUS_VLAN_TPID_VALID
+            if(tp->tp_status & TP_STATUS_VLAN_TPID_VALID) tpid = tp->hv1.tp_vlan_tpid;
+#endif
+            uint16_t tci = tp->hv1.tp_vlan_tci;
+            vlan_buf.resize(h.caplen + 4);
+            memcpy(&vlan_buf[0],frame,12);
+            vlan_buf[12] = (u_char)(tpid >> 8);
+            vlan_buf[13] = (u_char)(tpid & 0xff);
+            vlan_buf[14] = (u_char)(tci >> 8);
+            vlan_buf[15] = (u_char)(tci & 0xff);
+            memcpy(&vlan_buf[16],frame+12,h.caplen-12);
+            frame = &vlan_buf[0];
+            h.caplen += 4;
+            h.len    += 4;
+        }
+        (*handler)(user,&h,frame);
+    }
+}
+
+int tpacket_capture::loop(pcap_handler handler,u_char *user,volatile sig_atomic_t *stop)
+{
+    while(!*stop){
+        struct tpacket_block_desc *block =
+            (struct tpacket_block_desc *)(ring + (size_t)current * BLOCK_SIZE);
+        if((block->hdr.bh1.block_status & TP_STATUS_USER)==0){
+            struct pollfd pfd;
+            pfd.fd      = fd;
+            pfd.events  = POLLIN | POLLERR;
+            pfd.revents = 0;
+            if(poll(&pfd,1,POLL_MS)<0 && errno!=EINTR){
+                errmsg = ssprintf("poll: %s",strerror(errno));
+                return -1;
+            }
+            continue;
+        }
+        __sync_synchronize();           // read the packets only after seeing the status
+        walk_block(block,handler,user);
+        __sync_synchronize();
+        block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+        current = (current + 1) % block_count;
+    }
+    return 0;
+}
+
+/* PACKET_STATISTICS resets the kernel's counters, so keep running totals */
+void tpacket_capture::read_stats()
+{
+    struct tpacket_stats_v3 st;
+    socklen_t len = sizeof(st);
+    memset(&st,0,sizeof(st));
+    if(getsockopt(fd,SOL_PACKET,PACKET_STATISTICS,&st,&len)<0) return;
+    received += st.tp_packets;          // the kernel already counts drops in tp_packets
+    dropped  += st.tp_drops;
+}
+
+void tpacket_capture::stats(uint64_t &received_,uint64_t &dropped_)
+{
+    read_stats();
+    received_ = received;
+    dropped_  = dropped;
+}
+
+#endif
@@ -0,0 +1,79 @@
+/*
+ * tpacket_capture.h:
+ *
+ * Live capture on Linux through an AF_PACKET socket with a TPACKET_V3
+ * ring of blocks shared with the kernel. The kernel fills whole blocks
+ * while we walk earlier ones, so a burst of packets is absorbed by the
+ * ring rather than dropped, and there is no copy or system call per packet.
+ *
+ * Several captures can be joined into a PACKET_FANOUT_HASH group. The
+ * kernel then spreads packets over the sockets by a symmetric flow hash,
+ * so both directions of a connection always arrive on the same socket.
+ *
+ * Only Ethernet (and loopback) devices are handled. open() returns 0 for
+ * anything else and the caller should use pcap_open_live().
+ *
+ * #include this file after tcpflow.h
+ */
+
+#ifndef TPACKET_CAPTURE_H
+#define TPACKET_CAPTURE_H
+
+#if defined(HAVE_LINUX_IF_PACKET_H) && defined(HAVE_SYS_MMAN_H)
+#include <linux/if_packet.h>
+#ifdef TPACKET3_HDRLEN
+#define HAVE_TPACKET_CAPTURE
+
+#include <signal.h>
+
+class tpacket_capture {
+    /* These are not implemented */
+    tpacket_capture(const tpacket_capture &);
+    tpacket_capture &operator=(const tpacket_capture &);
+
+    enum { BLOCK_SIZE = 1024*1024,      // the kernel hands us one block at a time
+           FRAME_SIZE = 2048,           // only used to size the ring; V3 packs frames
+           BLOCK_TIMEOUT_MS = 100,      // retire a partly filled block after this long
+           POLL_MS = 250,               // how often loop() checks for a stop request
+    };
+    int         fd;
+    uint8_t    *ring;
+    size_t      ring_size;
+    uint32_t    block_count;
+    uint32_t    current;                // next block to look at
+    bool        loopback;               // lo shows each packet twice; skip the outgoing copy
+    std::vector<u_char> vlan_buf;       // frame with its VLAN tag put back
+    uint64_t    received;               // accumulated from PACKET_STATISTICS
+    uint64_t    dropped;
+
+    tpacket_capture():fd(-1),ring(0),ring_size(0),block_count(0),current(0),loopback(false),vlan_buf(),
+                      received(0),dropped(0),errmsg(){}
+    void walk_block(struct tpacket_block_desc *block,pcap_handler handler,u_char *user);
+    void read_stats();
+
+public:
+    std::string errmsg;                 // set when open() or loop() fails
+
+    /** Open device with a ring of ring_mb megabytes.
+     * If fanout_group is non-negative, the socket joins that PACKET_FANOUT_HASH group.
+     * filter (which may be null) is attached before any packet is received.
+     * Returns 0 and sets err if the device cannot be captured this way.
+     */
+    static tpacket_capture *open(const std::string &device,bool promisc,uint32_t ring_mb,
+                                 int fanout_group,const struct bpf_program *filter,std::string &err);
+    virtual ~tpacket_capture();
+
+    int datalink() const { return DLT_EN10MB; }
+
+    /** Call handler for every packet until *stop becomes nonzero.
+     * Returns 0 when stopped, -1 on error.
+     */
+    int loop(pcap_handler handler,u_char *user,volatile sig_atomic_t *stop);
+
+    /** Counters in the sense of pcap_stats(): received includes dropped. */
+    void stats(uint64_t &received,uint64_t &dropped);
+};
+
+#endif
+#endif
+#endif
@@ -0,0 +1,350 @@
+/*
+ * traffic_gen.cpp:
+ *
+ * Makes TCP traffic for scale testing: many flows at once, so that the
+ * flow table, the fd ring and the saved flows are pushed as far as the
+ * captures in ../tests never push them. The same options and seed always
+ * give the same packets.
+ *
+ * Each flow is a connection from its own client to one of 16 servers:
+ * a handshake, a request, a response and a FIN each way. Concurrent flows
+ * are open at once; the next packet comes from one of them at random, and
+ * a new flow starts as each one ends, until there have been flows in all.
+ * The data is 'a' to 'z' over and over, offset by the flow's number, so a
+ * flow file can be checked. Percentages of the segments are lost (never
+ * sent), sent again later, or sent after the segment that follows them;
+ * a percentage of the flows start mid-stream, without a handshake, and a
+ * percentage are IPv6.
+ *
+ * The packets are written as an Ethernet pcap to the file, or to stdout,
+ * so they can go straight into tcpflow:
+ *
+ *     traffic_gen -n 1000000 -c 100000 -l 1 | tcpflow -o out -r -
+ *
+ * Built by "make traffic_gen"; "make benchscale" runs it into tcpflow.
+ *
+ * usage: traffic_gen [options] [file]
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <vector>
+
+struct options {
+    options():flows(10000),concurrent(1000),request(200),response(4000),mss(1460),
+              loss(0),retransmit(0),reorder(0),midstream(0),ipv6(0),seed(1),usec(10){}
+    uint64_t flows;                     // in all
+    uint64_t concurrent;                // open at once
+    uint32_t request;                   // bytes from the client
+    uint32_t response;                  // and from the server
+    uint32_t mss;
+    double   loss;                      // percent of the data segments
+    double   retransmit;
+    double   reorder;
+    double   midstream;                 // percent of the flows
+    double   ipv6;
+    uint64_t seed;
+    uint32_t usec;                      // between packets
+};
+
+/* xorshift64*, so that a seed gives the same traffic everywhere */
+static uint64_t rng_state = 1;
+static uint64_t next_random()
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+static bool chance(double percent)
+{
+    return percent > 0 && (next_random() >> 11) * (100.0 / 9007199254740992.0) < percent;
+}
+
+enum { TH_FIN=0x01, TH_SYN=0x02, TH_PSH=0x08, TH_ACK=0x10 };
+
+class flow {
+public:
+    enum state { SYN, SYN_ACK, ACK, REQUEST, RESPONSE, FIN_CLIENT, FIN_SERVER, DONE };
+    flow():id(0),v6(false),st(SYN),cisn(0),sisn(0),csent(0),ssent(0),late(),late_at(0){}
+    uint64_t id;
+    bool     v6;
+    state    st;
+    uint32_t cisn, sisn;                // initial sequence numbers
+    uint32_t csent, ssent;              // bytes of data sent each way
+    struct segment {
+        segment():from_client(false),offset(0),length(0){}
+        bool     from_client;
+        uint32_t offset;
+        uint32_t length;
+    };
+    std::vector<segment> late;          // to be sent again, or after the next one
+    uint64_t late_at;                   // packets of this flow until the first of them is sent
+};
+
+class writer {
+    FILE    *out;
+    uint64_t usec;                      // time of the next packet
+    uint32_t step;
+    std::vector<uint8_t> pkt;
+
+    static void put16(uint8_t *p,uint16_t v){ p[0]=(uint8_t)(v>>8); p[1]=(uint8_t)v; }
+    static void put32(uint8_t *p,uint32_t v){ put16(p,(uint16_t)(v>>16)); put16(p+2,(uint16_t)v); }
+    static uint32_t sum(const uint8_t *p,size_t len,uint32_t s){
+        for(size_t i=0;i+1<len;i+=2) s += (p[i]<<8) | p[i+1];
+        if(len & 1) s += p[len-1]<<8;
+        return s;
+    }
+    static uint16_t fold(uint32_t s){
+        while(s>>16) s = (s & 0xffff) + (s>>16);
+        return (uint16_t)~s;
+    }
+    void record(size_t len){
+        uint8_t h[16];
+        uint32_t sec = (uint32_t)(usec/1000000), us = (uint32_t)(usec%1000000);
+        memcpy(h,&sec,4);               // in our byte order, as the magic number is
+        memcpy(h+4,&us,4);
+        uint32_t l = (uint32_t)len;
+        memcpy(h+8,&l,4);
+        memcpy(h+12,&l,4);
+        fwrite(h,1,16,out);
+        fwrite(&pkt[0],1,len,out);
+        usec += step;
+    }
+
+public:
+    writer(FILE *out_,uint32_t step_):out(out_),usec(1000000000ULL*1000000),step(step_),pkt(){
+        uint32_t magic = 0xa1b2c3d4;
+        uint16_t major = 2, minor = 4;
+        int32_t  zone = 0;
+        uint32_t sigfigs = 0, snaplen = 65535, linktype = 1; // DLT_EN10MB
+        fwrite(&magic,4,1,out);
+        fwrite(&major,2,1,out);
+        fwrite(&minor,2,1,out);
+        fwrite(&zone,4,1,out);
+        fwrite(&sigfigs,4,1,out);
+        fwrite(&snaplen,4,1,out);
+        fwrite(&linktype,4,1,out);
+    }
+
+    /* A segment of f; the client's addresses come from its id, the server's from id%16 */
+    void send(const flow &f,bool from_client,uint8_t flags,uint32_t seq,uint32_t ack,uint32_t offset,uint32_t length){
+        size_t iplen = f.v6 ? 40 : 20;
+        size_t len = 14 + iplen + 20 + length;
+        if(pkt.size() < len) pkt.resize(len);
+        uint8_t *p = &pkt[0];
+        memset(p,0,14 + iplen + 20);
+        p[0] = 0x02; p[5] = from_client ? 2 : 1; // locally administered MACs
+        p[6] = 0x02; p[11] = from_client ? 1 : 2;
+        put16(p+12,f.v6 ? 0x86dd : 0x0800);
+        uint8_t *ip = p+14;
+        uint8_t client[16], server[16];
+        memset(client,0,16);
+        memset(server,0,16);
+        size_t alen = f.v6 ? 16 : 4;
+        if(f.v6){
+            client[0] = 0xfd; put32(client+12,(uint32_t)f.id); put16(client+10,(uint16_t)(f.id>>32));
+            server[0] = 0xfd; server[1] = 0x01; server[15] = (uint8_t)(f.id % 16 + 1);
+        } else {
+            client[0] = 10; client[1] = (uint8_t)(f.id>>16); client[2] = (uint8_t)(f.id>>8); client[3] = (uint8_t)f.id;
+            server[0] = 192; server[1] = 168; server[2] = (uint8_t)(f.id % 16); server[3] = 1;
+        }
+        uint16_t cport = (uint16_t)(1024 + (f.id>>24) % 60000), sport = 80;
+        const uint8_t *src = from_client ? client : server, *dst = from_client ? server : client;
+        if(f.v6){
+            ip[0] = 0x60;
+            put16(ip+4,(uint16_t)(20 + length));
+            ip[6] = 6;                  // TCP
+            ip[7] = 64;
+            memcpy(ip+8,src,16);
+            memcpy(ip+24,dst,16);
+        } else {
+            ip[0] = 0x45;
+            put16(ip+2,(uint16_t)(20 + 20 + length));
+            ip[6] = 0x40;               // DF
+            ip[8] = 64;
+            ip[9] = 6;
+            memcpy(ip+12,src,4);
+            memcpy(ip+16,dst,4);
+            put16(ip+10,fold(sum(ip,20,0)));
+        }
+        uint8_t *tcp = ip + iplen;
+        put16(tcp,from_client ? cport : sport);
+        put16(tcp+2,from_client ? sport : cport);
+        put32(tcp+4,seq);
+        put32(tcp+8,ack);
+        tcp[12] = 5<<4;
+        tcp[13] = flags;
+        put16(tcp+14,65535);
+        uint8_t *data = tcp + 20;
+        for(uint32_t i=0;i<length;i++) data[i] = (uint8_t)('a' + (f.id + offset + i) % 26);
+        uint32_t s = sum(src,alen,0);   // the pseudo-header
+        s = sum(dst,alen,s);
+        s += 6 + 20 + length;
+        put16(tcp+16,fold(sum(tcp,20 + length,s)));
+        record(len);
+    }
+};
+
+/* The next packet of f, or the late ones it is owed */
+static void step(flow &f,writer &w,const options &o)
+{
+    if(f.late.size() && f.late_at-- == 0){
+        flow::segment s = f.late.front();
+        f.late.erase(f.late.begin());
+        f.late_at = 1;
+        uint32_t seq = (s.from_client ? f.cisn : f.sisn) + 1 + s.offset;
+        uint32_t ack = (s.from_client ? f.sisn + 1 + f.ssent : f.cisn + 1 + f.csent);
+        w.send(f,s.from_client,TH_ACK|TH_PSH,seq,ack,s.offset,s.length);
+        return;
+    }
+    switch(f.st){
+    case flow::SYN:
+        w.send(f,true,TH_SYN,f.cisn,0,0,0);
+        f.st = flow::SYN_ACK;
+        return;
+    case flow::SYN_ACK:
+        w.send(f,false,TH_SYN|TH_ACK,f.sisn,f.cisn+1,0,0);
+        f.st = flow::ACK;
+        return;
+    case flow::ACK:
+        w.send(f,true,TH_ACK,f.cisn+1,f.sisn+1,0,0);
+        f.st = flow::REQUEST;
+        return;
+    case flow::REQUEST:
+    case flow::RESPONSE: {
+        bool from_client = f.st==flow::REQUEST;
+        uint32_t &sent = from_client ? f.csent : f.ssent;
+        uint32_t total = from_client ? o.request : o.response;
+        uint32_t length = total - sent < o.mss ? total - sent : o.mss;
+        flow::segment s;
+        s.from_client = from_client;
+        s.offset = sent;
+        s.length = length;
+        sent += length;
+        if(sent==total) f.st = from_client ? flow::RESPONSE : flow::FIN_CLIENT;
+        if(length && chance(o.loss)) return;    // gone
+        if(length && chance(o.reorder) && f.st!=flow::FIN_CLIENT && sent<total){
+            f.late.push_back(s);        // after the segment that follows it
+            f.late_at = 1;
+            return;
+        }
+        uint32_t seq = (from_client ? f.cisn : f.sisn) + 1 + s.offset;
+        uint32_t ack = from_client ? f.sisn + 1 + f.ssent : f.cisn + 1 + f.csent;
+        if(length) w.send(f,from_client,TH_ACK|TH_PSH,seq,ack,s.offset,length);
+        if(length && chance(o.retransmit)){
+            f.late.push_back(s);
+            f.late_at = next_random() % 4;
+        }
+        return;
+    }
+    case flow::FIN_CLIENT:
+        if(f.late.size()) return;       // they go first
+        w.send(f,true,TH_FIN|TH_ACK,f.cisn+1+f.csent,f.sisn+1+f.ssent,0,0);
+        f.st = flow::FIN_SERVER;
+        return;
+    case flow::FIN_SERVER:
+        w.send(f,false,TH_FIN|TH_ACK,f.sisn+1+f.ssent,f.cisn+2+f.csent,0,0);
+        f.st = flow::DONE;
+        return;
+    case flow::DONE:
+        return;
+    }
+}
+
+static void start(flow &f,uint64_t id,const options &o)
+{
+    f = flow();
+    f.id = id;
+    f.v6 = chance(o.ipv6);
+    f.cisn = (uint32_t)next_random();
+    f.sisn = (uint32_t)next_random();
+    if(chance(o.midstream)){
+        f.st = flow::REQUEST;           // picked up after the handshake, part way in
+        f.csent = (uint32_t)(next_random() % (o.request + 1));
+    }
+}
+
+static void usage(const char *progname)
+{
+    fprintf(stderr,"usage: %s [options] [file]\n",progname);
+    fprintf(stderr,"  -n flows       flows in all (10000)\n");
+    fprintf(stderr,"  -c concurrent  flows open at once (1000)\n");
+    fprintf(stderr,"  -q bytes       request size (200)\n");
+    fprintf(stderr,"  -p bytes       response size (4000)\n");
+    fprintf(stderr,"  -m mss         largest segment (1460)\n");
+    fprintf(stderr,"  -l percent     of the data segments lost\n");
+    fprintf(stderr,"  -R percent     of them sent again\n");
+    fprintf(stderr,"  -r percent     of them sent after the next one\n");
+    fprintf(stderr,"  -M percent     of the flows picked up mid-stream\n");
+    fprintf(stderr,"  -6 percent     of the flows over IPv6\n");
+    fprintf(stderr,"  -t usec        between packets (10)\n");
+    fprintf(stderr,"  -s seed        (1)\n");
+    fprintf(stderr,"The pcap goes to file, or to stdout.\n");
+    exit(1);
+}
+
+int main(int argc,char **argv)
+{
+    options o;
+    int ch;
+    while((ch = getopt(argc,argv,"n:c:q:p:m:l:R:r:M:6:t:s:h")) != -1){
+        switch(ch){
+        case 'n': o.flows      = strtoull(optarg,0,10); break;
+        case 'c': o.concurrent = strtoull(optarg,0,10); break;
+        case 'q': o.request    = (uint32_t)atoi(optarg); break;
+        case 'p': o.response   = (uint32_t)atoi(optarg); break;
+        case 'm': o.mss        = (uint32_t)atoi(optarg); break;
+        case 'l': o.loss       = atof(optarg); break;
+        case 'R': o.retransmit = atof(optarg); break;
+        case 'r': o.reorder    = atof(optarg); break;
+        case 'M': o.midstream  = atof(optarg); break;
+        case '6': o.ipv6       = atof(optarg); break;
+        case 't': o.usec       = (uint32_t)atoi(optarg); break;
+        case 's': o.seed       = strtoull(optarg,0,10); break;
+        default:  usage(argv[0]);
+        }
+    }
+    if(o.mss==0 || o.mss>1460 || o.concurrent==0) usage(argv[0]);
+    if(o.concurrent > o.flows) o.concurrent = o.flows;
+    rng_state = o.seed ? o.seed : 1;
+
+    FILE *out = stdout;
+    if(optind < argc && strcmp(argv[optind],"-")!=0){
+        out = fopen(argv[optind],"wb");
+        if(out==0){
+            perror(argv[optind]);
+            exit(1);
+        }
+    }
+    static char obuf[1<<20];
+    setvbuf(out,obuf,_IOFBF,sizeof(obuf));
+    writer w(out,o.usec);
+
+    std::vector<flow> open(o.concurrent);
+    uint64_t started = 0;
+    for(size_t i=0;i<open.size();i++) start(open[i],started++,o);
+    size_t live = open.size();
+    while(live>0){
+        size_t i = (size_t)(next_random() % live);
+        step(open[i],w,o);
+        if(open[i].st==flow::DONE && open[i].late.empty()){
+            if(started < o.flows){
+                start(open[i],started++,o);
+            } else {
+                std::swap(open[i],open[live-1]);
+                live--;
+            }
+        }
+    }
+    if(fclose(out)){
+        perror("write");
+        exit(1);
+    }
+    return 0;
+}
@@ -0,0 +1,254 @@
+/*
+ * uring_writer.cpp:
+ *
+ * io_uring flow-file writer; see uring_writer.h
+ *
+ * This source code is under the GNU Public License (GPL).  See
+ * COPYING for details.
+ */
+
+#include "tcpflow.h"
+#include "uring_writer.h"
+#include "perf_counters.h"
+
+#ifdef HAVE_URING_WRITER
+
+#include <sys/mman.h>
+
+static int sys_io_uring_enter(int fd,unsigned to_submit,unsigned min_complete,unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter,fd,to_submit,min_complete,flags,(void *)0,(size_t)0);
+}
+
+uring_writer::uring_writer(perf_counters &perf_):ring_fd(-1),sq_ring(0),sq_ring_size(0),cq_ring(0),cq_ring_size(0),
+                             sqes(0),sqes_size(0),sq_tail(0),sq_mask(0),sq_array(0),
+                             cq_head(0),cq_tail(0),cq_mask(0),cqes(0),async_close(true),
+                             requests(),free_requests(),in_flight(0),perf(perf_)
+{
+}
+
+uring_writer *uring_writer::open(uint32_t depth,perf_counters &perf)
+{
+    struct io_uring_params p;
+    memset(&p,0,sizeof(p));
+    int fd = (int)syscall(__NR_io_uring_setup,depth,&p);
+    if(fd<0){
+        DEBUG(2)("io_uring_setup: %s",strerror(errno));
+        return 0;
+    }
+    uring_writer *w = new uring_writer(perf);
+    w->ring_fd = fd;
+    w->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    w->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = false;
+#ifdef IORING_FEAT_SINGLE_MMAP
+    if(p.features & IORING_FEAT_SINGLE_MMAP){
+        single = true;
+        w->sq_ring_size = std::max(w->sq_ring_size,w->cq_ring_size);
+    }
+#endif
+    void *sq = mmap(0,w->sq_ring_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQ_RING);
+    if(sq==MAP_FAILED){
+        delete w;
+        return 0;
+    }
+    w->sq_ring = (uint8_t *)sq;
+    if(single){
+        w->cq_ring = w->sq_ring;
+    } else {
+        void *cq = mmap(0,w->cq_ring_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_CQ_RING);
+        if(cq==MAP_FAILED){
+            delete w;
+            return 0;
+        }
+        w->cq_ring = (uint8_t *)cq;
+    }
+    w->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *s = mmap(0,w->sqes_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQES);
+    if(s==MAP_FAILED){
+        delete w;
+        return 0;
+    }
+    w->sqes     = (struct io_uring_sqe *)s;
+    w->sq_tail  = (unsigned *)(w->sq_ring + p.sq_off.tail);
+    w->sq_mask  = (unsigned *)(w->sq_ring + p.sq_off.ring_mask);
+    w->sq_array = (unsigned *)(w->sq_ring + p.sq_off.array);
+    w->cq_head  = (unsigned *)(w->cq_ring + p.cq_off.head);
+    w->cq_tail  = (unsigned *)(w->cq_ring + p.cq_off.tail);
+    w->cq_mask  = (unsigned *)(w->cq_ring + p.cq_off.ring_mask);
+    w->cqes     = (struct io_uring_cqe *)(w->cq_ring + p.cq_off.cqes);
+
+    /* No more requests than submission entries, so the completion ring,
+     * which is at least as large, can never overflow.
+     */
+    w->requests.resize(p.sq_entries);
+    for(uint32_t i=0;i<p.sq_entries;i++) w->free_requests.push_back(p.sq_entries-1-i);
+    DEBUG(2)("io_uring writer with %u entries",p.sq_entries);
+    return w;
+}
+
+uring_writer::~uring_writer()
+{
+    if(ring_fd>=0 && sqes) drain(-1);
+    if(sqes) munmap(sqes,sqes_size);
+    if(cq_ring && cq_ring!=sq_ring) munmap(cq_ring,cq_ring_size);
+    if(sq_ring) munmap(sq_ring,sq_ring_size);
+    if(ring_fd>=0) ::close(ring_fd);
+}
+
+uint32_t uring_writer::get_request()
+{
+    reap();
+    while(free_requests.size()==0) wait_one(); // back-pressure
+    uint32_t i = free_requests.back();
+    free_requests.pop_back();
+    return i;
+}
+
+void uring_writer::submit(uint32_t index,uint8_t opcode)
+{
+    request &r = requests[index];
+    unsigned tail = *sq_tail;           // only we write the tail
+    unsigned slot = tail & *sq_mask;
+    struct io_uring_sqe *sqe = &sqes[slot];
+    memset(sqe,0,sizeof(*sqe));
+    sqe->opcode    = opcode;
+    sqe->fd        = r.fd;
+    sqe->user_data = index;
+    if(!r.closing){
+        sqe->off   = r.offset;
+        sqe->addr  = (uint64_t)(uintptr_t)&r.iov;
+        sqe->len   = 1;
+    }
+    sq_array[slot] = slot;
+    __atomic_store_n(sq_tail,tail+1,__ATOMIC_RELEASE);
+    in_flight++;
+    while(sys_io_uring_enter(ring_fd,1,0,0)<0){
+        if(errno==EINTR) continue;
+        if(errno==EAGAIN || errno==EBUSY){ // kernel is short of resources; let some requests finish
+            wait_one();
+            continue;
+        }
+        die("io_uring_enter: %s",strerror(errno));
+    }
+}
+
+void uring_writer::complete(request &r,int32_t res)
+{
+    if(r.closing){
+        if(res==-EINVAL){               // IORING_OP_CLOSE is newer than io_uring itself
+            async_close = false;
+            ::close(r.fd);
+        }
+        r.fd = -1;
+        return;
+    }
+    /* A short write, or one that failed or was cancelled (-ECANCELED or
+     * -EINTR when the submitting thread went away), is finished the
+     * ordinary way.
+     */
+    size_t done = res>0 ? (size_t)res : 0;
+    int err = 0;
+    while(done<r.buf.size()){
+        ssize_t more = pwrite(r.fd,&r.buf[done],r.buf.size()-done,(off_t)(r.offset+done));
+        if(more<0 && errno==EINTR) continue;
+        if(more<=0){
+            err = more<0 ? errno : ENOSPC;
+            break;
+        }
+        done += (size_t)more;
+    }
+    if(done<r.buf.size()){
+        fprintf(stderr,"%s: write to %s failed: %s\n",progname,
+                r.name ? r.name->c_str() : "flow file",strerror(err));
+        perf.count(perf_counters::WRITE_FAILURES);
+    }
+    r.fd = -1;
+    r.name = 0;
+}
+
+void uring_writer::reap()
+{
+    unsigned head = *cq_head;
+    while(head != __atomic_load_n(cq_tail,__ATOMIC_ACQUIRE)){
+        const struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+        uint32_t index = (uint32_t)cqe->user_data;
+        complete(requests[index],cqe->res);
+        if(requests[index].buf.capacity() > 1024*1024){
+            std::vector<u_char>().swap(requests[index].buf); // don't keep a rare huge write around
+        }
+        free_requests.push_back(index);
+        in_flight--;
+        head++;
+        __atomic_store_n(cq_head,head,__ATOMIC_RELEASE);
+    }
+}
+
+void uring_writer::wait_one()
+{
+    if(in_flight==0) return;
+    if(sys_io_uring_enter(ring_fd,0,1,IORING_ENTER_GETEVENTS)<0 && errno!=EINTR){
+        die("io_uring_enter: %s",strerror(errno));
+    }
+    reap();
+}
+
+bool uring_writer::busy(int fd) const
+{
+    for(std::vector<request>::const_iterator it=requests.begin();it!=requests.end();it++){
+        if(it->fd>=0 && (fd<0 || it->fd==fd)) return true;
+    }
+    return false;
+}
+
+bool uring_writer::overlaps(int fd,uint64_t offset,size_t length) const
+{
+    for(std::vector<request>::const_iterator it=requests.begin();it!=requests.end();it++){
+        if(it->fd==fd && !it->closing &&
+           it->offset < offset+length && offset < it->offset+it->buf.size()) return true;
+    }
+    return false;
+}
+
+void uring_writer::write(int fd,uint64_t offset,const u_char *data,size_t length,const std::string *name)
+{
+    if(length==0) return;
+    reap();
+    while(overlaps(fd,offset,length)) wait_one();
+    uint32_t i = get_request();
+    request &r = requests[i];
+    r.buf.assign(data,data+length);
+    r.iov.iov_base = &r.buf[0];
+    r.iov.iov_len  = length;
+    r.fd      = fd;
+    r.offset  = offset;
+    r.name    = name;
+    r.closing = false;
+    submit(i,IORING_OP_WRITEV);
+}
+
+void uring_writer::close(int fd)
+{
+    drain(fd);
+#ifdef IORING_FEAT_RW_CUR_POS           // these headers know IORING_OP_CLOSE
+    if(async_close){
+        uint32_t i = get_request();
+        request &r = requests[i];
+        r.fd      = fd;
+        r.offset  = 0;
+        r.name    = 0;
+        r.closing = true;
+        submit(i,IORING_OP_CLOSE);
+        return;
+    }
+#endif
+    ::close(fd);
+}
+
+void uring_writer::drain(int fd)
+{
+    reap();
+    while(busy(fd)) wait_one();
+}
+
+#endif
@@ -0,0 +1,95 @@
+/*
+ * uring_writer.h:
+ *
+ * Asynchronous flow-file writes and closes through Linux io_uring.
+ *
+ * Each write is copied into one of a fixed number of request slots and
+ * submitted at once; its completion is reaped later, so a stalled
+ * filesystem holds up the packet path only when every slot is in flight.
+ * That bound is the back-pressure: write() waits for a completion when no
+ * slot is free.
+ *
+ * Writes to the same fd are not ordered by the kernel, so a write that
+ * overlaps one still in flight waits for it first; the later data wins, as
+ * it would with write(). drain() must be called before anything else
+ * touches the file (reading it, shifting it, setting its times) and
+ * close() drains the fd before its close is queued.
+ *
+ * A write that fails, or comes back cancelled because the thread that
+ * submitted it has exited, is done again with pwrite(); if that fails too
+ * it is reported on stderr and counted in the demux's perf counters. The
+ * owner must drain() before its thread exits.
+ *
+ * The system calls are made directly, so liburing is not needed.
+ *
+ * #include this file after tcpflow.h
+ */
+
+#ifndef URING_WRITER_H
+#define URING_WRITER_H
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_SYS_SYSCALL_H) && defined(HAVE_SYS_MMAN_H)
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define HAVE_URING_WRITER
+
+class uring_writer {
+    /* These are not implemented */
+    uring_writer(const uring_writer &);
+    uring_writer &operator=(const uring_writer &);
+
+    struct request {
+        request():buf(),iov(),fd(-1),offset(0),name(0),closing(false){}
+        std::vector<u_char> buf;
+        struct iovec iov;
+        int      fd;
+        uint64_t offset;
+        const std::string *name;        // for error messages; valid until the fd is drained
+        bool     closing;               // a close rather than a write
+    };
+
+    int         ring_fd;
+    uint8_t    *sq_ring;
+    size_t      sq_ring_size;
+    uint8_t    *cq_ring;                // may be sq_ring
+    size_t      cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t      sqes_size;
+    unsigned   *sq_tail;
+    unsigned   *sq_mask;
+    unsigned   *sq_array;
+    unsigned   *cq_head;
+    unsigned   *cq_tail;
+    unsigned   *cq_mask;
+    struct io_uring_cqe *cqes;
+    bool        async_close;            // the kernel has IORING_OP_CLOSE
+
+    std::vector<request> requests;
+    std::vector<uint32_t> free_requests;
+    size_t      in_flight;
+    class perf_counters &perf;          // of the demux whose thread uses the ring
+
+    uring_writer(class perf_counters &perf);
+    uint32_t get_request();             // waits for a free slot
+    void     submit(uint32_t index,uint8_t opcode);
+    void     reap();                    // handle the completions that are ready
+    void     wait_one();                // block until at least one completion
+    void     complete(request &r,int32_t res);
+    bool     busy(int fd) const;
+    bool     overlaps(int fd,uint64_t offset,size_t length) const;
+
+public:
+    /** Returns 0 if io_uring can't be set up (old kernel, seccomp, ...) */
+    static uring_writer *open(uint32_t depth,class perf_counters &perf);
+    virtual ~uring_writer();
+
+    void write(int fd,uint64_t offset,const u_char *data,size_t length,const std::string *name);
+    void close(int fd);                 // drains fd, then queues its close
+    void drain(int fd);                 // wait for every request on fd; -1 for all requests
+};
+
+#endif
+#endif
+#endif
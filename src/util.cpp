@@ -12,6 +12,12 @@
 
 #include <iomanip>
 
+#if defined(HAVE_UNORDERED_MAP)
+# include <unordered_set>
+#else
+# include <tr1/unordered_set>
+#endif
+
 static char *debug_prefix = NULL;
 
 /*
@@ -58,12 +64,33 @@ std::string comma_number_string(int64_t input)
 }
 
 
+/* "00" to "ff", so that each byte of an address is a two-byte copy */
+static const char hex_pairs[] =
+    "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+    "202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+    "404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+    "606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+    "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+    "a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+    "c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+    "e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+char *macaddr(const uint8_t *addr,char *buf)
+{
+    char *p = buf;
+    for(int i=0;i<6;i++){
+        if(i) *p++ = ':';
+        memcpy(p,hex_pairs + addr[i]*2,2);
+        p += 2;
+    }
+    *p = '\0';
+    return buf;
+}
+
 std::string macaddr(const uint8_t *addr)
 {
-    char buf[256];
-    snprintf(buf,sizeof(buf),"%02x:%02x:%02x:%02x:%02x:%02x",
-             addr[0],addr[1],addr[2],addr[3],addr[4],addr[5]);
-    return std::string(buf);
+    char buf[MACADDR_BUFSIZE];
+    return std::string(macaddr(addr,buf),MACADDR_BUFSIZE-1);
 }
 
 /*
@@ -108,40 +135,50 @@ static std::vector<std::string> split(const std::string &s, char delim)
 
 /* mkdir all of the containing directories in path.
  * keep track of those made so we don't need to keep remaking them.
+ *
+ * The directory of nearly every flow has been made before, so that is looked
+ * up first and the path is only taken apart for a new directory. The set is
+ * forgotten if it grows past MAX_MADE_DIRS; that only costs an EEXIST per
+ * directory as they come up again.
  */
+#if defined(HAVE_UNORDERED_MAP)
+typedef std::unordered_set<std::string> made_dirs_t;
+#else
+typedef std::tr1::unordered_set<std::string> made_dirs_t;
+#endif
+
 void mkdirs_for_path(std::string path)
 {
-    static std::set<std::string> made_dirs; // track what we made
-
-    std::string mpath;                  // the path we are making
-
-    if(path.at(0)=='/'){
-        mpath = "/";
-        path = path.substr(1);
-    }
-
-    std::vector<std::string> parts = split(path,'/');
+    enum { MAX_MADE_DIRS = 100000 };
+    static made_dirs_t made_dirs;       // track what we made
+#ifdef HAVE_PTHREAD
+    static pthread_mutex_t made_dirs_lock = PTHREAD_MUTEX_INITIALIZER; // demux shards share made_dirs
+    pthread_mutex_lock(&made_dirs_lock);
+#endif
 
     /* Notice that this won't mkdir for the last part.
      * That's okay, because it's a filename.
      */
-    for(std::vector<std::string>::const_iterator it=parts.begin();it!=parts.end();it++){
-        if(made_dirs.find(mpath)==made_dirs.end()){
-            if(mpath.size()){
-                int r = MKDIR(mpath.c_str(),0777);
-                if(r<0){
-                    /* Can't make path; see if we can execute it*/
-                    if(access(mpath.c_str(),X_OK)<0){
-                        perror(mpath.c_str());
-                        exit(1);
-                    }
+    size_t end = path.rfind('/');
+    if(end!=std::string::npos && end>0 && made_dirs.find(path.substr(0,end))==made_dirs.end()){
+        if(made_dirs.size() > MAX_MADE_DIRS) made_dirs.clear();
+        for(size_t slash = path.find('/',1); slash!=std::string::npos && slash<=end; slash = path.find('/',slash+1)){
+            std::string mpath = path.substr(0,slash); // the path we are making
+            if(made_dirs.find(mpath)!=made_dirs.end()) continue;
+            int r = MKDIR(mpath.c_str(),0777);
+            if(r<0){
+                /* Can't make path; see if we can execute it*/
+                if(access(mpath.c_str(),X_OK)<0){
+                    perror(mpath.c_str());
+                    exit(1);
                 }
-                made_dirs.insert(mpath);
             }
+            made_dirs.insert(mpath);
         }
-        if(mpath.size()>0) mpath += "/";
-        mpath += *it;
     }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&made_dirs_lock);
+#endif
 }
 
 /*
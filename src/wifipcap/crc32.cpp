@@ -0,0 +1,258 @@
+/* crc32.cpp
+ * CRC-32 routine
+ *
+ * $Id: crc32.cpp,v 1.1 2007/02/14 00:05:50 jpang Exp $
+ *
+ * Slices for eight bytes at a time, and the PCLMULQDQ and ARMv8 versions,
+ * added for tcpflow; see crc32.h.
+ *
+ * Ethereal - Network traffic analyzer
+ * By Gerald Combs <gerald@ethereal.com>
+ * Copyright 1998 Gerald Combs
+ *
+ * Copied from README.developer
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Credits:
+ *
+ * Table from Solomon Peachy
+ * Routine from Chris Waters
+ */
+
+#include "config.h"
+#include "crc32.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRC32_PCLMUL
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__aarch64__) && defined(__linux__)
+#define CRC32_ARMV8
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+
+/*
+ * Tables for the AUTODIN/HDLC/802.x CRC.
+ *
+ * Polynomial is
+ *
+ *  x^32 + x^26 + x^23 + x^22 + x^16 + x^12 + x^11 + x^8 + x^7 +
+ *      x^5 + x^4 + x^2 + x + 1
+ *
+ * [0] is the CRC of each byte; [k] is that of the byte followed by k
+ * zero bytes, filled in from [0] by crc32_select().
+ */
+static uint32_t crc32_ccitt_table[8][256] = {{
+    0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419,
+    0x706af48f, 0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4,
+    0xe0d5e91e, 0x97d2d988, 0x09b64c2b, 0x7eb17cbd, 0xe7b82d07,
+    0x90bf1d91, 0x1db71064, 0x6ab020f2, 0xf3b97148, 0x84be41de,
+    0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7, 0x136c9856,
+    0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9,
+    0xfa0f3d63, 0x8d080df5, 0x3b6e20c8, 0x4c69105e, 0xd56041e4,
+    0xa2677172, 0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b,
+    0x35b5a8fa, 0x42b2986c, 0xdbbbc9d6, 0xacbcf940, 0x32d86ce3,
+    0x45df5c75, 0xdcd60dcf, 0xabd13d59, 0x26d930ac, 0x51de003a,
+    0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423, 0xcfba9599,
+    0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
+    0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d, 0x76dc4190,
+    0x01db7106, 0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f,
+    0x9fbfe4a5, 0xe8b8d433, 0x7807c9a2, 0x0f00f934, 0x9609a88e,
+    0xe10e9818, 0x7f6a0dbb, 0x086d3d2d, 0x91646c97, 0xe6635c01,
+    0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e, 0x6c0695ed,
+    0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
+    0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3,
+    0xfbd44c65, 0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2,
+    0x4adfa541, 0x3dd895d7, 0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a,
+    0x346ed9fc, 0xad678846, 0xda60b8d0, 0x44042d73, 0x33031de5,
+    0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa, 0xbe0b1010,
+    0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
+    0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17,
+    0x2eb40d81, 0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6,
+    0x03b6e20c, 0x74b1d29a, 0xead54739, 0x9dd277af, 0x04db2615,
+    0x73dc1683, 0xe3630b12, 0x94643b84, 0x0d6d6a3e, 0x7a6a5aa8,
+    0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1, 0xf00f9344,
+    0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
+    0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a,
+    0x67dd4acc, 0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5,
+    0xd6d6a3e8, 0xa1d1937e, 0x38d8c2c4, 0x4fdff252, 0xd1bb67f1,
+    0xa6bc5767, 0x3fb506dd, 0x48b2364b, 0xd80d2bda, 0xaf0a1b4c,
+    0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55, 0x316e8eef,
+    0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
+    0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe,
+    0xb2bd0b28, 0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31,
+    0x2cd99e8b, 0x5bdeae1d, 0x9b64c2b0, 0xec63f226, 0x756aa39c,
+    0x026d930a, 0x9c0906a9, 0xeb0e363f, 0x72076785, 0x05005713,
+    0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38, 0x92d28e9b,
+    0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
+    0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1,
+    0x18b74777, 0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c,
+    0x8f659eff, 0xf862ae69, 0x616bffd3, 0x166ccf45, 0xa00ae278,
+    0xd70dd2ee, 0x4e048354, 0x3903b3c2, 0xa7672661, 0xd06016f7,
+    0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc, 0x40df0b66,
+    0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
+    0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605,
+    0xcdd70693, 0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8,
+    0x5d681b02, 0x2a6f2b94, 0xb40bbe37, 0xc30c8ea1, 0x5a05df1b,
+    0x2d02ef8d
+}};
+
+static uint32_t crc32_bytes(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++){
+        crc = crc32_ccitt_table[0][(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    const uint32_t (*t)[256] = crc32_ccitt_table;
+    for (; len >= 8; buf += 8, len -= 8) {
+        uint32_t a = crc ^ (buf[0] | buf[1] << 8 | buf[2] << 16 | (uint32_t)buf[3] << 24);
+        crc = t[7][a & 0xff] ^ t[6][(a >> 8) & 0xff] ^ t[5][(a >> 16) & 0xff] ^ t[4][a >> 24] ^
+            t[3][buf[4]] ^ t[2][buf[5]] ^ t[1][buf[6]] ^ t[0][buf[7]];
+    }
+    return crc32_bytes(crc, buf, len);
+}
+
+#ifdef CRC32_PCLMUL
+/*
+ * Folds 64 bytes at a time into four 128-bit remainders with carry-less
+ * multiplies, then those into one, and reduces that to 32 bits (Barrett
+ * reduction). The constants are x^n mod P, bit-reflected, as in Intel's
+ * "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ" and
+ * Linux's crc32-pclmul. Frames shorter than 64 bytes use the tables.
+ */
+__attribute__((target("pclmul,sse2")))
+static __m128i crc32_fold(__m128i x, __m128i k, __m128i next)
+{
+    __m128i lo = _mm_clmulepi64_si128(x, k, 0x00);
+    __m128i hi = _mm_clmulepi64_si128(x, k, 0x11);
+    return _mm_xor_si128(_mm_xor_si128(lo, hi), next);
+}
+
+__attribute__((target("pclmul,sse2")))
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    if (len < 64) return crc32_slice8(crc, buf, len);
+
+    const __m128i r2r1 = _mm_set_epi64x(0x1c6e41596LL, 0x154442bd4LL);
+    const __m128i r4r3 = _mm_set_epi64x(0x0ccaa009eLL, 0x1751997d0LL);
+    const __m128i r5   = _mm_set_epi64x(0, 0x163cd6124LL);
+    const __m128i ru   = _mm_set_epi64x(0x1f7011641LL, 0x1db710641LL);
+    const __m128i mask32 = _mm_set_epi32(0, 0, 0, -1);
+
+    __m128i x1 = _mm_loadu_si128((const __m128i *)(buf + 0));
+    __m128i x2 = _mm_loadu_si128((const __m128i *)(buf + 16));
+    __m128i x3 = _mm_loadu_si128((const __m128i *)(buf + 32));
+    __m128i x4 = _mm_loadu_si128((const __m128i *)(buf + 48));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    buf += 64;
+    len -= 64;
+
+    for (; len >= 64; buf += 64, len -= 64) {
+        x1 = crc32_fold(x1, r2r1, _mm_loadu_si128((const __m128i *)(buf + 0)));
+        x2 = crc32_fold(x2, r2r1, _mm_loadu_si128((const __m128i *)(buf + 16)));
+        x3 = crc32_fold(x3, r2r1, _mm_loadu_si128((const __m128i *)(buf + 32)));
+        x4 = crc32_fold(x4, r2r1, _mm_loadu_si128((const __m128i *)(buf + 48)));
+    }
+    x1 = crc32_fold(x1, r4r3, x2);
+    x1 = crc32_fold(x1, r4r3, x3);
+    x1 = crc32_fold(x1, r4r3, x4);
+    for (; len >= 16; buf += 16, len -= 16) {
+        x1 = crc32_fold(x1, r4r3, _mm_loadu_si128((const __m128i *)buf));
+    }
+
+    /* 128 bits to 64, with 32 zero bits appended */
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), _mm_clmulepi64_si128(r4r3, x1, 0x01));
+    /* to 64 */
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), r5, 0x00);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 4), x2);
+    /* and Barrett to 32 */
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), ru, 0x10);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask32), ru, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    crc = _mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+
+    return crc32_slice8(crc, buf, len);
+}
+#endif
+
+#ifdef CRC32_ARMV8
+/* The ARMv8 CRC32 instructions use this polynomial (CRC32C ones the other) */
+__attribute__((target("+crc")))
+static uint32_t crc32_armv8(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    for (; len >= 8; buf += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, buf, 8);
+        crc = __crc32d(crc, w);
+    }
+    for (; len; buf++, len--) {
+        crc = __crc32b(crc, *buf);
+    }
+    return crc;
+}
+#endif
+
+typedef uint32_t (*crc32_fn)(uint32_t crc, const uint8_t *buf, size_t len);
+static const char *crc32_name = "slice-by-8";
+
+static crc32_fn crc32_select()
+{
+    for (int k = 1; k < 8; k++) {
+        for (int i = 0; i < 256; i++) {
+            uint32_t c = crc32_ccitt_table[k-1][i];
+            crc32_ccitt_table[k][i] = (c >> 8) ^ crc32_ccitt_table[0][c & 0xff];
+        }
+    }
+#ifdef CRC32_PCLMUL
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_PCLMUL) && (edx & bit_SSE2)) {
+        crc32_name = "pclmul";
+        return crc32_pclmul;
+    }
+#endif
+#ifdef CRC32_ARMV8
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        crc32_name = "armv8";
+        return crc32_armv8;
+    }
+#endif
+    return crc32_slice8;
+}
+
+static const crc32_fn crc32_update = crc32_select();
+
+uint32_t crc32_ieee(const unsigned char *buf, size_t len)
+{
+    return ~crc32_update(0xFFFFFFFF, buf, len);
+}
+
+const char *crc32_ieee_name()
+{
+    return crc32_name;
+}
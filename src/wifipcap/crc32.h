@@ -0,0 +1,25 @@
+/**
+ * crc32.h:
+ * The AUTODIN/HDLC/802.x CRC-32, which is the FCS of 802.11 frames.
+ *
+ * crc32_ieee() is the CRC of a buffer, computed eight bytes at a time
+ * with tables (slice-by-8), or with the CPU's carry-less multiply
+ * (x86 PCLMULQDQ) or CRC-32 (ARMv8) instructions when it has them;
+ * which is worked out once, when the program starts.
+ *
+ * Released under GPLv3.
+ */
+
+#ifndef _WIFIPCAP_CRC32_H_
+#define _WIFIPCAP_CRC32_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/** The CRC of buf, as Ethereal's crc32_ccitt() computes it */
+uint32_t crc32_ieee(const unsigned char *buf, size_t len);
+
+/** The implementation crc32_ieee() uses ("slice-by-8", "pclmul" or "armv8") */
+const char *crc32_ieee_name();
+
+#endif
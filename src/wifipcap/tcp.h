@@ -86,34 +86,80 @@ struct tcphdr {
 #define TCPOPT_TSTAMP_HDR	\
     (TCPOPT_NOP<<24|TCPOPT_NOP<<16|TCPOPT_TIMESTAMP<<8|TCPOLEN_TIMESTAMP)
 
-#include <map>
-#include <list>
+/*
+ * The options of a TCP header (HandleTCP()'s options and optlen), read
+ * where they are, one at a time, with nothing copied or allocated:
+ *
+ *	for (tcp_opt_iter o(options, optlen); o.more(); o.next())
+ *	    if (o.type() == TCPOPT_MAXSEG && o.valid())
+ *		mss = o.mss();
+ *
+ * more() is false at the end of the options, after an EOL, and at an
+ * option whose length is bad. The typed accessors are only meaningful
+ * for an option of their type that is valid().
+ */
+class tcp_opt_iter {
+    const u_char *cp;			/* the option */
+    u_int left;				/* bytes from cp to the end of the options */
+    u_int size;				/* of the option, with its type and length; 0 at the end */
 
-class tcp_opt_t {
-    tcp_opt_t &operator=(const tcp_opt_t &);       // not implemented
+    static u_int32_t get32(const u_char *p) {
+	return (u_int32_t)p[0] << 24 | (u_int32_t)p[1] << 16 | (u_int32_t)p[2] << 8 | p[3];
+    }
+    void find() {
+	size = 0;
+	if (left == 0)
+	    return;
+	if (*cp == TCPOPT_EOL || *cp == TCPOPT_NOP)	/* no length octet */
+	    size = 1;
+	else if (left >= 2 && cp[1] >= 2 && cp[1] <= left)
+	    size = cp[1];			/* total including type, len */
+    }
 public:
-    tcp_opt_t(const tcp_opt_t &t):type(t.type),len(t.len),data_raw(t.data_raw),data(t.data),data_sack(t.data_sack){};
-    tcp_opt_t():type(),len(),data_raw(),data(),data_sack(){};
-    u_int type;
-    u_int len;
-    const u_char *data_raw;
+    tcp_opt_iter(const u_char *options, u_int optlen):cp(options),left(options ? optlen : 0),size(0) {
+	find();
+    }
+    bool more() const { return size != 0; }
+    void next() {
+	if (*cp == TCPOPT_EOL) {
+	    left = size = 0;
+	    return;
+	}
+	cp += size;
+	left -= size;
+	find();
+    }
+
+    u_int type() const { return *cp; }
+    u_int len() const { return size < 2 ? 0 : size - 2; }	/* of the data */
+    const u_char *data() const { return cp + 2; }
 
-    union {
-	u_int16_t mss;
-	u_int8_t  wscale;
-	u_int32_t echo;
-	u_int32_t echoreply;
-	u_int32_t cc;
-	u_int32_t ccnew;
-	u_int32_t ccecho;
-	struct {
-	    u_int32_t tsval;
-	    u_int32_t tsecr;
-	} timestamp;
-	u_int8_t  signature[TCP_SIGLEN];
-    } data;
+    /* whether the data is as long as the type needs */
+    bool valid() const {
+	switch (type()) {
+	case TCPOPT_MAXSEG:	return len() >= 2;
+	case TCPOPT_WSCALE:	return len() >= 1;
+	case TCPOPT_SACK:	return len() % 8 == 0;
+	case TCPOPT_ECHO:
+	case TCPOPT_ECHOREPLY:
+	case TCPOPT_CC:
+	case TCPOPT_CCNEW:
+	case TCPOPT_CCECHO:	return len() >= 4;
+	case TCPOPT_TIMESTAMP:	return len() >= 8;
+	case TCPOPT_SIGNATURE:	return len() >= TCP_SIGLEN;
+	default:		return true;
+	}
+    }
 
-    std::list< std::pair<u_int32_t,u_int32_t> > data_sack;
+    u_int16_t mss() const { return (u_int16_t)(cp[2] << 8 | cp[3]); }
+    u_int8_t  wscale() const { return cp[2]; }
+    u_int32_t tsval() const { return get32(cp + 2); }
+    u_int32_t tsecr() const { return get32(cp + 6); }
+    u_int32_t value32() const { return get32(cp + 2); }	/* of ECHO, ECHOREPLY, CC, CCNEW and CCECHO */
+    const u_char *signature() const { return cp + 2; }	/* TCP_SIGLEN bytes */
+    u_int     sack_blocks() const { return len() / 8; }
+    u_int32_t sack_left(u_int i) const { return get32(cp + 2 + i * 8); }
+    u_int32_t sack_right(u_int i) const { return get32(cp + 2 + i * 8 + 4); }
 };
 
 /* Jeff: endian-fixed, fully decoded tcp header */
@@ -127,7 +173,5 @@ struct tcp_hdr_t {
     u_int16_t	win;	       	/* window */
     u_int16_t	cksum;	       	/* checksum */
     u_int16_t	urgptr;	       	/* urgent pointer */
-
-    //std::list<tcp_opt_t> opts;
 };
 #endif
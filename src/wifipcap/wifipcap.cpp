@@ -14,7 +14,9 @@
 #include <stdint.h>
 #include <inttypes.h>
 
+#include <algorithm>
 #include <iostream>
+#include <vector>
 #include <cstdlib>
 #include <cstdio>
 #include <cstring>
@@ -33,9 +35,15 @@
 #include <unistd.h>
 #endif
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 #pragma GCC diagnostic ignored "-Wcast-align"
 
 #include "wifipcap.h"
+#include "wifipcap_decode.h"
+#include "crc32.h"
 
 #include "cpack.h"
 #include "extract.h"
@@ -51,20 +59,31 @@ MAC MAC::null((uint64_t)0);
 int WifiPacket::debug=0;
 int MAC::print_fmt(MAC::PRINT_FMT_COLON);
 
+/* "00" to "ff", so that each byte of an address is a two-byte copy */
+static const char hex_pairs[] =
+    "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+    "202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+    "404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+    "606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+    "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+    "a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+    "c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+    "e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+size_t MAC::format(char *buf, int fmt) const {
+    char *p = buf;
+    for (int shift = 40; shift >= 0; shift -= 8) {
+        if (shift != 40 && fmt == PRINT_FMT_COLON) *p++ = ':';
+        memcpy(p, hex_pairs + ((val >> shift) & 0xff) * 2, 2);
+        p += 2;
+    }
+    *p = '\0';
+    return p - buf;
+}
+
 std::ostream& operator<<(std::ostream& out, const MAC& mac) {
-    const char *fmt = MAC::print_fmt == MAC::PRINT_FMT_COLON ? 
-	"%02x:%02x:%02x:%02x:%02x:%02x" :
-	"%02x%02x%02x%02x%02x%02x";
-    char buf[24];
-    sprintf(buf, fmt, 
-	    (int)((mac.val>>40)&0xff),
-	    (int)((mac.val>>32)&0xff),
-	    (int)((mac.val>>24)&0xff),
-	    (int)((mac.val>>16)&0xff),
-	    (int)((mac.val>>8)&0xff),
-	    (int)((mac.val)&0xff)
-        );
-    out << buf;
+    char buf[MAC::STR_LEN];
+    out.write(buf, mac.format(buf));
     return out;
 }
 
@@ -124,15 +143,10 @@ static const struct tok ethertype_values[] = {
 #endif
 
 /* from ethereal packet-prism.c */
-#define pletohs(p)  ((u_int16_t)					\
-		     ((u_int16_t)*((const u_int8_t *)(p)+1)<<8|		\
-		      (u_int16_t)*((const u_int8_t *)(p)+0)<<0))
 #define pntohl(p)   ((u_int32_t)*((const u_int8_t *)(p)+0)<<24|	\
 		     (u_int32_t)*((const u_int8_t *)(p)+1)<<16|	\
 		     (u_int32_t)*((const u_int8_t *)(p)+2)<<8|	\
 		     (u_int32_t)*((const u_int8_t *)(p)+3)<<0)
-#define COOK_FRAGMENT_NUMBER(x) ((x) & 0x000F)
-#define COOK_SEQUENCE_NUMBER(x) (((x) & 0xFFF0) >> 4)
 /* end ethereal code */
 
 /* Sequence number gap */
@@ -194,137 +208,20 @@ static const char * data_subtype_text[] = {
 };
 #endif
 
-///////////////////////////////////////////////////////////////////////////////
-// crc32 implementation needed for wifi checksum
-
-/* crc32.c
- * CRC-32 routine
- *
- * $Id: crc32.cpp,v 1.1 2007/02/14 00:05:50 jpang Exp $
- *
- * Ethereal - Network traffic analyzer
- * By Gerald Combs <gerald@ethereal.com>
- * Copyright 1998 Gerald Combs
- *
- * Copied from README.developer
- *
- * This program is free software; you can redistribute it and/or
- * modify it under the terms of the GNU General Public License
- * as published by the Free Software Foundation; either version 2
- * of the License, or (at your option) any later version.
- *
- * This program is distributed in the hope that it will be useful,
- * but WITHOUT ANY WARRANTY; without even the implied warranty of
- * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
- * GNU General Public License for more details.
- *
- * You should have received a copy of the GNU General Public License
- * along with this program; if not, write to the Free Software
- * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
- *
- * Credits:
- *
- * Table from Solomon Peachy
- * Routine from Chris Waters
- */
-
-/*
- * Table for the AUTODIN/HDLC/802.x CRC.
- *
- * Polynomial is
- *
- *  x^32 + x^26 + x^23 + x^22 + x^16 + x^12 + x^11 + x^8 + x^7 +
- *      x^5 + x^4 + x^2 + x + 1
- */
-static const uint32_t crc32_ccitt_table[256] = {
-    0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419,
-    0x706af48f, 0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4,
-    0xe0d5e91e, 0x97d2d988, 0x09b64c2b, 0x7eb17cbd, 0xe7b82d07,
-    0x90bf1d91, 0x1db71064, 0x6ab020f2, 0xf3b97148, 0x84be41de,
-    0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7, 0x136c9856,
-    0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9,
-    0xfa0f3d63, 0x8d080df5, 0x3b6e20c8, 0x4c69105e, 0xd56041e4,
-    0xa2677172, 0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b,
-    0x35b5a8fa, 0x42b2986c, 0xdbbbc9d6, 0xacbcf940, 0x32d86ce3,
-    0x45df5c75, 0xdcd60dcf, 0xabd13d59, 0x26d930ac, 0x51de003a,
-    0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423, 0xcfba9599,
-    0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
-    0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d, 0x76dc4190,
-    0x01db7106, 0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f,
-    0x9fbfe4a5, 0xe8b8d433, 0x7807c9a2, 0x0f00f934, 0x9609a88e,
-    0xe10e9818, 0x7f6a0dbb, 0x086d3d2d, 0x91646c97, 0xe6635c01,
-    0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e, 0x6c0695ed,
-    0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
-    0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3,
-    0xfbd44c65, 0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2,
-    0x4adfa541, 0x3dd895d7, 0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a,
-    0x346ed9fc, 0xad678846, 0xda60b8d0, 0x44042d73, 0x33031de5,
-    0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa, 0xbe0b1010,
-    0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
-    0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17,
-    0x2eb40d81, 0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6,
-    0x03b6e20c, 0x74b1d29a, 0xead54739, 0x9dd277af, 0x04db2615,
-    0x73dc1683, 0xe3630b12, 0x94643b84, 0x0d6d6a3e, 0x7a6a5aa8,
-    0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1, 0xf00f9344,
-    0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
-    0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a,
-    0x67dd4acc, 0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5,
-    0xd6d6a3e8, 0xa1d1937e, 0x38d8c2c4, 0x4fdff252, 0xd1bb67f1,
-    0xa6bc5767, 0x3fb506dd, 0x48b2364b, 0xd80d2bda, 0xaf0a1b4c,
-    0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55, 0x316e8eef,
-    0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
-    0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe,
-    0xb2bd0b28, 0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31,
-    0x2cd99e8b, 0x5bdeae1d, 0x9b64c2b0, 0xec63f226, 0x756aa39c,
-    0x026d930a, 0x9c0906a9, 0xeb0e363f, 0x72076785, 0x05005713,
-    0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38, 0x92d28e9b,
-    0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
-    0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1,
-    0x18b74777, 0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c,
-    0x8f659eff, 0xf862ae69, 0x616bffd3, 0x166ccf45, 0xa00ae278,
-    0xd70dd2ee, 0x4e048354, 0x3903b3c2, 0xa7672661, 0xd06016f7,
-    0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc, 0x40df0b66,
-    0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
-    0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605,
-    0xcdd70693, 0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8,
-    0x5d681b02, 0x2a6f2b94, 0xb40bbe37, 0xc30c8ea1, 0x5a05df1b,
-    0x2d02ef8d
-};
-
-#define CRC32_CCITT_SEED    0xFFFFFFFF
-
-static uint32_t crc32_ccitt_seed(const uint8_t *buf, size_t len, uint32_t seed);
-
-static uint32_t crc32_ccitt(const uint8_t *buf, size_t len)
-{
-    return ( crc32_ccitt_seed(buf, len, CRC32_CCITT_SEED) );
-}
-
-static uint32_t crc32_ccitt_seed(const uint8_t *buf, size_t len, uint32_t seed)
-{
-    uint32_t crc32 = seed;
-
-    for (unsigned int i = 0; i < len; i++){
-        crc32 = crc32_ccitt_table[(crc32 ^ buf[i]) & 0xff] ^ (crc32 >> 8);
-    }
-
-    return ( ~crc32 );
-}
-
 /*
  * IEEE 802.x version (Ethernet and 802.11, at least) - byte-swap
- * the result of "crc32()".
+ * the result of "crc32()", for which see crc32.h.
  *
  * XXX - does this mean we should fetch the Ethernet and 802.11
  * Frame Checksum (FCS) with "tvb_get_letohl()" rather than "tvb_get_ntohl()",
  * or is fetching it big-endian and byte-swapping the CRC done
  * to cope with 802.x sending stuff out in reverse bit order?
  */
-static uint32_t crc32_802(const unsigned char *buf, size_t len)
+uint32_t WifiPacket::crc32_802(const unsigned char *buf, size_t len)
 {
     uint32_t c_crc;
 
-    c_crc = crc32_ccitt(buf, len);
+    c_crc = crc32_ieee(buf, len);
 
     /* Byte reverse. */
     c_crc = ((unsigned char)(c_crc>>0)<<24) |
@@ -340,7 +237,7 @@ static uint32_t crc32_802(const unsigned char *buf, size_t len)
 
 /* Translate Ethernet address, as seen in struct ether_header, to type MAC. */
 /* Extract header length. */
-static size_t extract_header_length(u_int16_t fc)
+size_t WifiPacket::extract_header_length(u_int16_t fc)
 {
     switch (FC_TYPE(fc)) {
     case T_MGMT:
@@ -371,69 +268,6 @@ static size_t extract_header_length(u_int16_t fc)
 
 ///////////////////////////////////////////////////////////////////////////////
 
-///////////////////////////////////////////////////////////////////////////////
-
-#pragma GCC diagnostic ignored "-Wcast-align"
-void WifiPacket::handle_llc(const mac_hdr_t &mac,const u_char *ptr, size_t len,u_int16_t fc)
-{
-    if (len < 7) {
-	// truncated header!
-	cbs->HandleLLC(*this,NULL, ptr, len);
-	return;
-    }
-
-    // http://www.wildpackets.com/resources/compendium/wireless_lan/wlan_packets
-
-    llc_hdr_t hdr;
-    hdr.dsap   = EXTRACT_LE_8BITS(ptr); // Destination Service Access point
-    hdr.ssap   = EXTRACT_LE_8BITS(ptr + 1); // Source Service Access Point
-    hdr.control= EXTRACT_LE_8BITS(ptr + 2); // ignored by most protocols
-    hdr.oui    = EXTRACT_24BITS(ptr + 3);
-    hdr.type   = EXTRACT_16BITS(ptr + 6);
-
-
-    /* "When both the DSAP and SSAP are set to 0xAA, the type is
-     * interpreted as a protocol not defined by IEEE and the LSAP is
-     * referred to as SubNetwork Access Protocol (SNAP).  In SNAP, the
-     * 5 bytes that follow the DSAP, SSAP, and control byte are called
-     * the Protocol Discriminator."
-     */
-
-    if(hdr.dsap==0xAA && hdr.ssap==0xAA){
-        cbs->HandleLLC(*this,&hdr,ptr+8,len-8);
-        return;
-    }
-
-    if (hdr.oui == OUI_ENCAP_ETHER || hdr.oui == OUI_CISCO_90) {
-        cbs->HandleLLC(*this,&hdr, ptr+8, len-8);
-        return;
-    }
-        
-    cbs->HandleLLCUnknown(*this,ptr, len);
-}
-
-void WifiPacket::handle_wep(const u_char *ptr, size_t len)
-{
-    // Jeff: XXX handle TKIP/CCMP ? how can we demultiplex different
-    // protection protocols?
-
-    struct wep_hdr_t hdr;
-    u_int32_t iv;
-
-    if (len < IEEE802_11_IV_LEN + IEEE802_11_KID_LEN) {
-	// truncated!
-	cbs->HandleWEP(*this,NULL, ptr, len);
-	return;
-    }
-    iv = EXTRACT_LE_32BITS(ptr);
-    hdr.iv = IV_IV(iv);
-    hdr.pad = IV_PAD(iv);
-    hdr.keyid = IV_KEYID(iv);
-    cbs->HandleWEP(*this,&hdr, ptr, len);
-}
-
-///////////////////////////////////////////////////////////////////////////////
-
 static const char *auth_alg_text[]={"Open System","Shared Key","EAP"};
 #define NUM_AUTH_ALGS	(sizeof auth_alg_text / sizeof auth_alg_text[0])
 
@@ -488,10 +322,8 @@ const char *Wifipcap::WifiUtil::MgmtReasonCode2Txt(uint v) {
 
 ///////////////////////////////////////////////////////////////////////////////
 
-// Jeff: HACK -- tcpdump uses a global variable to check truncation
-#define TTEST2(_p, _l) ((const u_char *)&(_p) - p + (_l) <= (ssize_t)len) 
-
-void WifiPacket::parse_elements(struct mgmt_body_t *pbody, const u_char *p, int offset, size_t len)
+/* Index the elements, and decode those whose bits (1<<E_SSID and so on) are in decode */
+void WifiPacket::parse_elements(struct mgmt_body_t *pbody, const u_char *p, int offset, size_t len, u_int32_t decode)
 {
     /*
      * We haven't seen any elements yet.
@@ -502,28 +334,45 @@ void WifiPacket::parse_elements(struct mgmt_body_t *pbody, const u_char *p, int
     pbody->ds_status = NOT_PRESENT;
     pbody->cf_status = NOT_PRESENT;
     pbody->tim_status = NOT_PRESENT;
+    pbody->nelements = 0;
+    pbody->element_data = p;
 
+    /* One pass over the elements, walking by their lengths */
+    int truncated = -1;                 // the element that runs past the end
     for (;;) {
         if (!TTEST2(*(p + offset), 1))
-            return;
-        switch (*(p + offset)) {
+            break;
+        if (!TTEST2(*(p + offset), 2) || !TTEST2(*(p + offset + 2), *(p + offset + 1))) {
+            truncated = *(p + offset);
+            break;
+        }
+        if (pbody->nelements == mgmt_body_t::MAX_ELEMENTS || offset > 0xffff)
+            break;
+        mgmt_body_t::element_ref &e = pbody->elements[pbody->nelements++];
+        e.id = *(p + offset);
+        e.length = *(p + offset + 1);
+        e.offset = offset;
+        offset += e.length + 2;
+    }
+
+    /* And those asked for, in order, so that the last of each is kept */
+    for (int i = 0; i < pbody->nelements; i++) {
+        const mgmt_body_t::element_ref &e = pbody->elements[i];
+        if (e.id >= 32 || (decode & (1U << e.id)) == 0) {
+#ifdef DEBUG_WIFI
+            printf("(1) unhandled element_id (%d)  ", e.id);
+#endif
+            continue;
+        }
+        const u_char *ep = p + e.offset;
+        switch (e.id) {
         case E_SSID:
             /* Present, possibly truncated */
             pbody->ssid_status = TRUNCATED;
-            if (!TTEST2(*(p + offset), 2))
-                return;
-            memcpy(&pbody->ssid, p + offset, 2);
-            offset += 2;
-            if (pbody->ssid.length != 0) {
-                if (pbody->ssid.length >
-                    sizeof(pbody->ssid.ssid) - 1)
-                    return;
-                if (!TTEST2(*(p + offset), pbody->ssid.length))
-                    return;
-                memcpy(&pbody->ssid.ssid, p + offset,
-                       pbody->ssid.length);
-                offset += pbody->ssid.length;
-            }
+            memcpy(&pbody->ssid, ep, 2);
+            if (pbody->ssid.length > sizeof(pbody->ssid.ssid) - 1)
+                break;
+            memcpy(&pbody->ssid.ssid, ep + 2, pbody->ssid.length);
             pbody->ssid.ssid[pbody->ssid.length] = '\0';
             /* Present and not truncated */
             pbody->ssid_status = PRESENT;
@@ -531,20 +380,10 @@ void WifiPacket::parse_elements(struct mgmt_body_t *pbody, const u_char *p, int
         case E_CHALLENGE:
             /* Present, possibly truncated */
             pbody->challenge_status = TRUNCATED;
-            if (!TTEST2(*(p + offset), 2))
-                return;
-            memcpy(&pbody->challenge, p + offset, 2);
-            offset += 2;
-            if (pbody->challenge.length != 0) {
-                if (pbody->challenge.length >
-                    sizeof(pbody->challenge.text) - 1)
-                    return;
-                if (!TTEST2(*(p + offset), pbody->challenge.length))
-                    return;
-                memcpy(&pbody->challenge.text, p + offset,
-                       pbody->challenge.length);
-                offset += pbody->challenge.length;
-            }
+            memcpy(&pbody->challenge, ep, 2);
+            if (pbody->challenge.length > sizeof(pbody->challenge.text) - 1)
+                break;
+            memcpy(&pbody->challenge.text, ep + 2, pbody->challenge.length);
             pbody->challenge.text[pbody->challenge.length] = '\0';
             /* Present and not truncated */
             pbody->challenge_status = PRESENT;
@@ -552,679 +391,131 @@ void WifiPacket::parse_elements(struct mgmt_body_t *pbody, const u_char *p, int
         case E_RATES:
             /* Present, possibly truncated */
             pbody->rates_status = TRUNCATED;
-            if (!TTEST2(*(p + offset), 2))
-                return;
-            memcpy(&(pbody->rates), p + offset, 2);
-            offset += 2;
-            if (pbody->rates.length != 0) {
-                if (pbody->rates.length > sizeof pbody->rates.rate)
-                    return;
-                if (!TTEST2(*(p + offset), pbody->rates.length))
-                    return;
-                memcpy(&pbody->rates.rate, p + offset,
-                       pbody->rates.length);
-                offset += pbody->rates.length;
-            }
+            memcpy(&(pbody->rates), ep, 2);
+            if (pbody->rates.length > sizeof pbody->rates.rate)
+                break;
+            memcpy(&pbody->rates.rate, ep + 2, pbody->rates.length);
             /* Present and not truncated */
             pbody->rates_status = PRESENT;
             break;
         case E_DS:
             /* Present, possibly truncated */
             pbody->ds_status = TRUNCATED;
-            if (!TTEST2(*(p + offset), 3))
-                return;
-            memcpy(&pbody->ds, p + offset, 3);
-            offset += 3;
+            if (e.length < 1)
+                break;
+            memcpy(&pbody->ds, ep, 3);
             /* Present and not truncated */
             pbody->ds_status = PRESENT;
             break;
         case E_CF:
             /* Present, possibly truncated */
             pbody->cf_status = TRUNCATED;
-            if (!TTEST2(*(p + offset), 8))
-                return;
-            memcpy(&pbody->cf, p + offset, 8);
-            offset += 8;
+            if (e.length < 6)
+                break;
+            memcpy(&pbody->cf, ep, 8);
             /* Present and not truncated */
             pbody->cf_status = PRESENT;
             break;
         case E_TIM:
             /* Present, possibly truncated */
             pbody->tim_status = TRUNCATED;
-            if (!TTEST2(*(p + offset), 2))
-                return;
-            memcpy(&pbody->tim, p + offset, 2);
-            offset += 2;
-            if (!TTEST2(*(p + offset), 3))
-                return;
-            memcpy(&pbody->tim.count, p + offset, 3);
-            offset += 3;
-
+            if (e.length < 3)
+                break;
+            memcpy(&pbody->tim, ep, 5);
             if (pbody->tim.length <= 3)
                 break;
-            if (pbody->rates.length > sizeof pbody->tim.bitmap)
-                return;
-            if (!TTEST2(*(p + offset), pbody->tim.length - 3))
-                return;
-            memcpy(pbody->tim.bitmap, p + (pbody->tim.length - 3),
-                   (pbody->tim.length - 3));
-            offset += pbody->tim.length - 3;
+            if (pbody->tim.length - 3U > sizeof pbody->tim.bitmap)
+                break;
+            memcpy(pbody->tim.bitmap, ep + 5, pbody->tim.length - 3);
             /* Present and not truncated */
             pbody->tim_status = PRESENT;
             break;
-        default:
-#ifdef DEBUG_WIFI
-            printf("(1) unhandled element_id (%d)  ", *(p + offset) );
-#endif
-            if (!TTEST2(*(p + offset), 2))
-                return;
-            if (!TTEST2(*(p + offset + 2), *(p + offset + 1)))
-                return;
-            offset += *(p + offset + 1) + 2;
-            break;
         }
     }
-}
-
-/*********************************************************************************
- * Print Handle functions for the management frame types
- *********************************************************************************/
-
-int
-WifiPacket::handle_beacon( const struct mgmt_header_t *pmh, const u_char *p, size_t len)
-{
-    struct mgmt_body_t pbody;
-    int offset = 0;
-
-    memset(&pbody, 0, sizeof(pbody));
-
-    if (!TTEST2(*p, IEEE802_11_TSTAMP_LEN + IEEE802_11_BCNINT_LEN +
-                IEEE802_11_CAPINFO_LEN))
-        return 0;
-    memcpy(&pbody.timestamp, p, IEEE802_11_TSTAMP_LEN);
-    offset += IEEE802_11_TSTAMP_LEN;
-    pbody.beacon_interval = EXTRACT_LE_16BITS(p+offset);
-    offset += IEEE802_11_BCNINT_LEN;
-    pbody.capability_info = EXTRACT_LE_16BITS(p+offset);
-    offset += IEEE802_11_CAPINFO_LEN;
-
-    parse_elements(&pbody, p, offset, len);
-
-    /*
-      PRINT_SSID(pbody);
-      PRINT_RATES(pbody);
-      printf(" %s",
-      CAPABILITY_ESS(pbody.capability_info) ? "ESS" : "IBSS");
-      PRINT_DS_CHANNEL(pbody);
-    */
-    cbs->Handle80211MgmtBeacon(*this, pmh, &pbody);
-    return 1;
-}
-
-int WifiPacket::handle_assoc_request( const struct mgmt_header_t *pmh, const u_char *p, size_t len)
-{
-    struct mgmt_body_t pbody;
-    int offset = 0;
-
-    memset(&pbody, 0, sizeof(pbody));
-
-    if (!TTEST2(*p, IEEE802_11_CAPINFO_LEN + IEEE802_11_LISTENINT_LEN))
-        return 0;
-    pbody.capability_info = EXTRACT_LE_16BITS(p);
-    offset += IEEE802_11_CAPINFO_LEN;
-    pbody.listen_interval = EXTRACT_LE_16BITS(p+offset);
-    offset += IEEE802_11_LISTENINT_LEN;
-
-    parse_elements(&pbody, p, offset, len);
-
-    /*
-      PRINT_SSID(pbody);
-      PRINT_RATES(pbody);
-    */
-    cbs->Handle80211MgmtAssocRequest(*this, pmh, &pbody);
-
-    return 1;
-}
-
-int WifiPacket::handle_assoc_response( const struct mgmt_header_t *pmh, const u_char *p, size_t len, bool reassoc)
-{
-    struct mgmt_body_t pbody;
-    int offset = 0;
-
-    memset(&pbody, 0, sizeof(pbody));
-
-    if (!TTEST2(*p, IEEE802_11_CAPINFO_LEN + IEEE802_11_STATUS_LEN +
-                IEEE802_11_AID_LEN))
-        return 0;
-    pbody.capability_info = EXTRACT_LE_16BITS(p);
-    offset += IEEE802_11_CAPINFO_LEN;
-    pbody.status_code = EXTRACT_LE_16BITS(p+offset);
-    offset += IEEE802_11_STATUS_LEN;
-    pbody.aid = EXTRACT_LE_16BITS(p+offset);
-    offset += IEEE802_11_AID_LEN;
-
-    parse_elements(&pbody, p, offset, len);
-
-    /*
-      printf(" AID(%x) :%s: %s", ((u_int16_t)(pbody.aid << 2 )) >> 2 ,
-      CAPABILITY_PRIVACY(pbody.capability_info) ? " PRIVACY " : "",
-      (pbody.status_code < NUM_STATUSES
-      ? status_text[pbody.status_code]
-      : "n/a"));
-    */
-    if (!reassoc)
-        cbs->Handle80211MgmtAssocResponse(*this, pmh, &pbody);
-    else
-        cbs->Handle80211MgmtReassocResponse(*this, pmh, &pbody);
-
-    return 1;
-}
-
-int
-WifiPacket::handle_reassoc_request( const struct mgmt_header_t *pmh, const u_char *p, size_t len)
-{
-    struct mgmt_body_t pbody;
-    int offset = 0;
-
-    memset(&pbody, 0, sizeof(pbody));
-
-    if (!TTEST2(*p, IEEE802_11_CAPINFO_LEN + IEEE802_11_LISTENINT_LEN +
-                IEEE802_11_AP_LEN))
-        return 0;
-    pbody.capability_info = EXTRACT_LE_16BITS(p);
-    offset += IEEE802_11_CAPINFO_LEN;
-    pbody.listen_interval = EXTRACT_LE_16BITS(p+offset);
-    offset += IEEE802_11_LISTENINT_LEN;
-    memcpy(&pbody.ap, p+offset, IEEE802_11_AP_LEN);
-    offset += IEEE802_11_AP_LEN;
-
-    parse_elements(&pbody, p, offset, len);
-
-    /*
-      PRINT_SSID(pbody);
-      printf(" AP : %s", etheraddr_string( pbody.ap ));
-    */
-    cbs->Handle80211MgmtReassocRequest(*this, pmh, &pbody);
-
-    return 1;
-}
-
-int
-WifiPacket::handle_reassoc_response( const struct mgmt_header_t *pmh, const u_char *p, size_t len)
-{
-    /* Same as a Association Reponse */
-    return handle_assoc_response(pmh, p, len, true);
-}
-
-int
-WifiPacket::handle_probe_request( const struct mgmt_header_t *pmh, const u_char *p, size_t len)
-{
-    struct mgmt_body_t  pbody;
-    int offset = 0;
-
-    memset(&pbody, 0, sizeof(pbody));
-
-    parse_elements(&pbody, p, offset, len);
-
-    /*
-      PRINT_SSID(pbody);
-      PRINT_RATES(pbody);
-    */
-    cbs->Handle80211MgmtProbeRequest(*this, pmh, &pbody);
-
-    return 1;
-}
-
-int
-WifiPacket::handle_probe_response( const struct mgmt_header_t *pmh, const u_char *p, size_t len)
-{
-    struct mgmt_body_t  pbody;
-    int offset = 0;
-
-    memset(&pbody, 0, sizeof(pbody));
-
-    if (!TTEST2(*p, IEEE802_11_TSTAMP_LEN + IEEE802_11_BCNINT_LEN +
-                IEEE802_11_CAPINFO_LEN))
-        return 0;
-
-    memcpy(&pbody.timestamp, p, IEEE802_11_TSTAMP_LEN);
-    offset += IEEE802_11_TSTAMP_LEN;
-    pbody.beacon_interval = EXTRACT_LE_16BITS(p+offset);
-    offset += IEEE802_11_BCNINT_LEN;
-    pbody.capability_info = EXTRACT_LE_16BITS(p+offset);
-    offset += IEEE802_11_CAPINFO_LEN;
-
-    parse_elements(&pbody, p, offset, len);
-
-    /*
-      PRINT_SSID(pbody);
-      PRINT_RATES(pbody);
-      PRINT_DS_CHANNEL(pbody);
-    */
-    cbs->Handle80211MgmtProbeResponse(*this, pmh, &pbody);
-
-    return 1;
-}
-
-int
-WifiPacket::handle_atim( const struct mgmt_header_t *pmh, const u_char *p, size_t len)
-{
-    /* the frame body for ATIM is null. */
-
-    cbs->Handle80211MgmtATIM(*this, pmh);
-
-    return 1;
-}
-
-int
-WifiPacket::handle_disassoc( const struct mgmt_header_t *pmh, const u_char *p, size_t len)
-{
-    struct mgmt_body_t  pbody;
-
-    memset(&pbody, 0, sizeof(pbody));
-
-    if (!TTEST2(*p, IEEE802_11_REASON_LEN))
-        return 0;
-    pbody.reason_code = EXTRACT_LE_16BITS(p);
-
-    /*
-      printf(": %s",
-      (pbody.reason_code < NUM_REASONS)
-      ? reason_text[pbody.reason_code]
-      : "Reserved" );
-    */
-    cbs->Handle80211MgmtDisassoc(*this, pmh, &pbody);
-
-    return 1;
-}
-
-int
-WifiPacket::handle_auth( const struct mgmt_header_t *pmh, const u_char *p, size_t len)
-{
-    struct mgmt_body_t  pbody;
-    int offset = 0;
-
-    memset(&pbody, 0, sizeof(pbody));
-
-    if (!TTEST2(*p, 6))
-        return 0;
-    pbody.auth_alg = EXTRACT_LE_16BITS(p);
-    offset += 2;
-    pbody.auth_trans_seq_num = EXTRACT_LE_16BITS(p + offset);
-    offset += 2;
-    pbody.status_code = EXTRACT_LE_16BITS(p + offset);
-    offset += 2;
-
-    parse_elements(&pbody, p, offset, len);
-
-    /*
-      if ((pbody.auth_alg == 1) &&
-      ((pbody.auth_trans_seq_num == 2) ||
-      (pbody.auth_trans_seq_num == 3))) {
-      printf(" (%s)-%x [Challenge Text] %s",
-      (pbody.auth_alg < NUM_AUTH_ALGS)
-      ? auth_alg_text[pbody.auth_alg]
-      : "Reserved",
-      pbody.auth_trans_seq_num,
-      ((pbody.auth_trans_seq_num % 2)
-      ? ((pbody.status_code < NUM_STATUSES)
-      ? status_text[pbody.status_code]
-      : "n/a") : ""));
-      return 1;
-      }
-      printf(" (%s)-%x: %s",
-      (pbody.auth_alg < NUM_AUTH_ALGS)
-      ? auth_alg_text[pbody.auth_alg]
-      : "Reserved",
-      pbody.auth_trans_seq_num,
-      (pbody.auth_trans_seq_num % 2)
-      ? ((pbody.status_code < NUM_STATUSES)
-      ? status_text[pbody.status_code]
-      : "n/a")
-      : "");
-    */
-    cbs->Handle80211MgmtAuth(*this, pmh, &pbody);
-
-    return 1;
-}
-
-int
-WifiPacket::handle_deauth( const struct mgmt_header_t *pmh, const u_char *p, size_t len)
-{
-    struct mgmt_body_t  pbody;
-    int offset = 0;
-    //const char *reason = NULL;
-
-    memset(&pbody, 0, sizeof(pbody));
-
-    if (!TTEST2(*p, IEEE802_11_REASON_LEN))
-        return 0;
-    pbody.reason_code = EXTRACT_LE_16BITS(p);
-    offset += IEEE802_11_REASON_LEN;
-
-    /*
-      reason = (pbody.reason_code < NUM_REASONS)
-      ? reason_text[pbody.reason_code]
-      : "Reserved";
-
-      if (eflag) {
-      printf(": %s", reason);
-      } else {
-      printf(" (%s): %s", etheraddr_string(pmh->sa), reason);
-      }
-    */
-    cbs->Handle80211MgmtDeauth(*this, pmh, &pbody);
-
-    return 1;
-}
-
 
-/*********************************************************************************
- * Print Body funcs
- *********************************************************************************/
-
-
-/** Decode a management request.
- * @return 0 - failure, non-zero success
- *
- * NOTE — this function and all that it calls should be handled as methods in WifipcapCallbacks
- */
- 
-int
-WifiPacket::decode_mgmt_body(u_int16_t fc, struct mgmt_header_t *pmh, const u_char *p, size_t len)
-{
-    if(debug) std::cerr << "decode_mgmt_body FC_SUBTYPE(fc)="<<(int)FC_SUBTYPE(fc)<<" ";
-    switch (FC_SUBTYPE(fc)) {
-    case ST_ASSOC_REQUEST:
-        return handle_assoc_request(pmh, p, len);
-    case ST_ASSOC_RESPONSE:
-        return handle_assoc_response(pmh, p, len);
-    case ST_REASSOC_REQUEST:
-        return handle_reassoc_request(pmh, p, len);
-    case ST_REASSOC_RESPONSE:
-        return handle_reassoc_response(pmh, p, len);
-    case ST_PROBE_REQUEST:
-        return handle_probe_request(pmh, p, len);
-    case ST_PROBE_RESPONSE:
-        return handle_probe_response(pmh, p, len);
-    case ST_BEACON:
-        return handle_beacon(pmh, p, len);
-    case ST_ATIM:
-        return handle_atim(pmh, p, len);
-    case ST_DISASSOC:
-        return handle_disassoc(pmh, p, len);
-    case ST_AUTH:
-        if (len < 3) {
-            return 0;
-        }
-        if ((p[0] == 0 ) && (p[1] == 0) && (p[2] == 0)) {
-            //printf("Authentication (Shared-Key)-3 ");
-            cbs->Handle80211MgmtAuthSharedKey(*this, pmh, p, len);
-            return 0;
+    /* Present, and truncated */
+    if (truncated >= 0 && truncated < 32 && (decode & (1U << truncated))) {
+        switch (truncated) {
+        case E_SSID:      pbody->ssid_status = TRUNCATED; break;
+        case E_CHALLENGE: pbody->challenge_status = TRUNCATED; break;
+        case E_RATES:     pbody->rates_status = TRUNCATED; break;
+        case E_DS:        pbody->ds_status = TRUNCATED; break;
+        case E_CF:        pbody->cf_status = TRUNCATED; break;
+        case E_TIM:       pbody->tim_status = TRUNCATED; break;
         }
-        return handle_auth(pmh, p, len);
-    case ST_DEAUTH:
-        return handle_deauth(pmh, p, len);
-        break;
-    default:
-        return 0;
     }
 }
 
-int WifiPacket::decode_mgmt_frame(const u_char * ptr, size_t len, u_int16_t fc, u_int8_t hdrlen)
+const u_char *mgmt_body_t::find_element(u_int8_t id, u_int8_t *length) const
 {
-    mgmt_header_t hdr;
-    u_int16_t seq_ctl;
-
-    hdr.da    = MAC::ether2MAC(ptr + 4);
-    hdr.sa    = MAC::ether2MAC(ptr + 10);
-    hdr.bssid = MAC::ether2MAC(ptr + 16);
-
-    hdr.duration = EXTRACT_LE_16BITS(ptr+2);
-
-    seq_ctl   = pletohs(ptr + 22);
-
-    hdr.seq   = COOK_SEQUENCE_NUMBER(seq_ctl);
-    hdr.frag  = COOK_FRAGMENT_NUMBER(seq_ctl);
-
-    cbs->Handle80211(*this, fc, hdr.sa, hdr.da, MAC::null, MAC::null, ptr, len);
-
-    int ret = decode_mgmt_body(fc, &hdr, ptr+MGMT_HDRLEN, len-MGMT_HDRLEN);
-
-    if (ret==0) {
-	cbs->Handle80211Unknown(*this, fc, ptr, len);
-	return 0;
+    for (int i = 0; i < nelements; i++) {
+        if (elements[i].id == id) {
+            if (length) *length = elements[i].length;
+            return element_data + elements[i].offset + 2;
+        }
     }
-
-    return 0;
+    return NULL;
 }
 
-int WifiPacket::decode_data_frame(const u_char * ptr, size_t len, u_int16_t fc)
+/* FNV-1a, eight bytes at a time */
+static u_int64_t hash_bytes(u_int64_t h, const u_char *p, size_t len)
 {
-    mac_hdr_t hdr;
-    hdr.fc       = fc;
-    hdr.duration = EXTRACT_LE_16BITS(ptr+2);
-    hdr.seq_ctl  = pletohs(ptr + 22);
-    hdr.seq      = COOK_SEQUENCE_NUMBER(hdr.seq_ctl);
-    hdr.frag     = COOK_FRAGMENT_NUMBER(hdr.seq_ctl);
-
-    if(FC_TYPE(fc)==2 && FC_SUBTYPE(fc)==8){ // quality of service?
-        hdr.qos = 1;
-    }
-        
-    size_t hdrlen=0;
-
-    const MAC address1 = MAC::ether2MAC(ptr+4);
-    const MAC address2 = MAC::ether2MAC(ptr+10);
-    const MAC address3 = MAC::ether2MAC(ptr+16);
-    
-    /* call the 80211 callback data callback */
-
-    if (FC_TO_DS(fc)==0 && FC_FROM_DS(fc)==0) {	/* ad hoc IBSS */
-	hdr.da = address1;
-	hdr.sa = address2;
-	hdr.bssid = address3;
-	hdrlen = DATA_HDRLEN;
-        if(hdr.qos) hdrlen+=2;
-        cbs->Handle80211( *this, fc, hdr.sa, hdr.da, hdr.ra, hdr.ta, ptr, len);
-	cbs->Handle80211DataIBSS( *this, hdr, ptr+hdrlen, len-hdrlen);
-    } else if (FC_TO_DS(fc)==0 && FC_FROM_DS(fc)) { /* from AP to STA */
-        hdr.da = address1;
-        hdr.bssid = address2;
-        hdr.sa = address3;
-	hdrlen = DATA_HDRLEN;
-        if(hdr.qos) hdrlen+=2;
-        cbs->Handle80211( *this, fc, hdr.sa, hdr.da, hdr.ra, hdr.ta, ptr, len);
-	cbs->Handle80211DataFromAP( *this, hdr, ptr+hdrlen, len-hdrlen);
-    } else if (FC_TO_DS(fc) && FC_FROM_DS(fc)==0) {	/* frame from STA to AP */
-        hdr.bssid = address1;
-        hdr.sa = address2;
-        hdr.da = address3;
-	hdrlen = DATA_HDRLEN;
-        if(hdr.qos) hdrlen+=2;
-        cbs->Handle80211( *this, fc, hdr.sa, hdr.da, hdr.ra, hdr.ta, ptr, len);
-	cbs->Handle80211DataToAP( *this, hdr, ptr+hdrlen, len-hdrlen);
-    } else if (FC_TO_DS(fc) && FC_FROM_DS(fc)) {	/* WDS */
-        const MAC address4 = MAC::ether2MAC(ptr+18);
-        hdr.ra = address1;
-        hdr.ta = address2;
-        hdr.da = address3;
-        hdr.sa = address4;
-        hdrlen = DATA_WDS_HDRLEN;
-        if(hdr.qos) hdrlen+=2;
-        cbs->Handle80211( *this, fc, hdr.sa, hdr.da, hdr.ra, hdr.ta, ptr, len);
-	cbs->Handle80211DataWDS( *this, hdr, ptr+hdrlen, len-hdrlen);
+    const u_int64_t prime = 0x100000001b3ULL;
+    for (; len >= 8; p += 8, len -= 8) {
+        u_int64_t w;
+        memcpy(&w, p, 8);
+        h = (h ^ w) * prime;
     }
-
-    /* Handle either the WEP or the link layer. This handles the data itself */
-    if (FC_WEP(fc)) {
-        handle_wep(ptr+hdrlen, len-hdrlen-4 ); 
-    } else {
-        handle_llc(hdr, ptr+hdrlen, len-hdrlen-4, fc); 
+    for (; len; p++, len--) {
+        h = (h ^ *p) * prime;
     }
-    return 0;
+    return h;
 }
 
-int WifiPacket::decode_ctrl_frame(const u_char * ptr, size_t len, u_int16_t fc)
+u_int64_t beacon_cache::hash(const struct mgmt_header_t *pmh, const u_char *body, size_t len)
 {
-    u_int16_t du = EXTRACT_LE_16BITS(ptr+2);        //duration
-
-    switch (FC_SUBTYPE(fc)) {
-    case CTRL_PS_POLL: {
-	ctrl_ps_poll_t hdr;
-	hdr.fc = fc;
-	hdr.aid = du;
-	hdr.bssid =  MAC::ether2MAC(ptr+4);
-	hdr.ta =  MAC::ether2MAC(ptr+10);
-	cbs->Handle80211( *this, fc, MAC::null, MAC::null, MAC::null, hdr.ta, ptr, len);
-	cbs->Handle80211CtrlPSPoll( *this, &hdr);
-	break;
-    }
-    case CTRL_RTS: {
-	ctrl_rts_t hdr;
-	hdr.fc = fc;
-	hdr.duration = du;
-	hdr.ra =  MAC::ether2MAC(ptr+4);
-	hdr.ta =  MAC::ether2MAC(ptr+10);
-	cbs->Handle80211( *this, fc, MAC::null, MAC::null, hdr.ra, hdr.ta, ptr, len);
-	cbs->Handle80211CtrlRTS( *this, &hdr);
-	break;
-    }
-    case CTRL_CTS: {
-	ctrl_cts_t hdr;
-	hdr.fc = fc;
-	hdr.duration = du;
-	hdr.ra =  MAC::ether2MAC(ptr+4);
-	cbs->Handle80211( *this, fc, MAC::null, MAC::null, hdr.ra, MAC::null, ptr, len);
-	cbs->Handle80211CtrlCTS( *this, &hdr);
-	break;
-    }
-    case CTRL_ACK: {
-	ctrl_ack_t hdr;
-	hdr.fc = fc;
-	hdr.duration = du;
-	hdr.ra =  MAC::ether2MAC(ptr+4);
-	cbs->Handle80211( *this, fc, MAC::null, MAC::null, hdr.ra, MAC::null, ptr, len);
-	cbs->Handle80211CtrlAck( *this, &hdr);
-	break;
-    }
-    case CTRL_CF_END: {
-	ctrl_end_t hdr;
-	hdr.fc = fc;
-	hdr.duration = du;
-	hdr.ra =  MAC::ether2MAC(ptr+4);
-	hdr.bssid =  MAC::ether2MAC(ptr+10);
-	cbs->Handle80211( *this, fc, MAC::null, MAC::null, hdr.ra, MAC::null, ptr, len);
-	cbs->Handle80211CtrlCFEnd( *this, &hdr);
-	break;
-    }
-    case CTRL_END_ACK: {	
-	ctrl_end_ack_t hdr;
-	hdr.fc = fc;
-	hdr.duration = du;
-	hdr.ra =  MAC::ether2MAC(ptr+4);
-	hdr.bssid =  MAC::ether2MAC(ptr+10);
-	cbs->Handle80211( *this, fc, MAC::null, MAC::null, hdr.ra, MAC::null, ptr, len);
-	cbs->Handle80211CtrlEndAck( *this, &hdr);
-	break;
-    }
-    default: {
-	cbs->Handle80211( *this, fc, MAC::null, MAC::null, MAC::null, MAC::null, ptr, len);
-	cbs->Handle80211Unknown( *this, fc, ptr, len);
-	return -1;
-	//add the case statements for QoS control frames once ieee802_11.h is updated
-    }
+    const size_t fixed = IEEE802_11_TSTAMP_LEN + IEEE802_11_BCNINT_LEN + IEEE802_11_CAPINFO_LEN;
+    u_int64_t h = 0xcbf29ce484222325ULL;
+    u_int64_t macs[2] = {pmh->sa.val, pmh->bssid.val};
+    h = hash_bytes(h, (const u_char *)macs, sizeof(macs));
+    if (len < fixed)
+        return hash_bytes(h, body, len) | 1;
+    h = hash_bytes(h, body + IEEE802_11_TSTAMP_LEN, fixed - IEEE802_11_TSTAMP_LEN);
+
+    size_t offset = fixed;
+    while (offset + 2 <= len && offset + 2 + body[offset + 1] <= len) {
+        size_t elen = 2 + body[offset + 1];
+        if (body[offset] == E_TIM || body[offset] == E_BSS_LOAD) {
+            h = hash_bytes(h, body + offset, 1); // that it was there
+        } else {
+            h = hash_bytes(h, body + offset, elen);
+        }
+        offset += elen;
     }
-    return 0;
+    h = hash_bytes(h, body + offset, len - offset); // what's left, if it isn't an element
+    return h | 1;                       // never 0, the hash of an unused slot
 }
 
-#ifndef roundup2
-#define	roundup2(x, y)	(((x)+((y)-1))&(~((y)-1))) /* if y is powers of two */
-#endif
-
-void WifiPacket::handle_80211(const u_char * pkt, size_t len /* , int pad */)  
-{
-    if (debug) std::cerr << "handle_80211(len= " << len << " ";
-    if (len < 2) {
-	cbs->Handle80211( *this, 0, MAC::null, MAC::null, MAC::null, MAC::null, pkt, len);
-	cbs->Handle80211Unknown( *this, -1, pkt, len);
-	return;
-    }
-
-    u_int16_t fc  = EXTRACT_LE_16BITS(pkt);       //frame control
-    size_t hdrlen = extract_header_length(fc);
-    /*
-      if (pad) {
-      hdrlen = roundup2(hdrlen, 4);
-      }
-    */
-
-    if (debug) std::cerr << "FC_TYPE(fc)= " << FC_TYPE(fc) << " ";
-
-    if (len < IEEE802_11_FC_LEN || len < hdrlen) {
-	cbs->Handle80211Unknown( *this, fc, pkt, len);
-	return;
-    }
-
-    /* Always calculate the frame checksum, but only process the packets if the FCS or if we are ignoring it */
-    if (len >= hdrlen + 4) {
-        // assume fcs is last 4 bytes (?)
-        u_int32_t fcs_sent = EXTRACT_32BITS(pkt+len-4);
-        u_int32_t fcs = crc32_802(pkt, len-4);
-        
-        /*
-          if (fcs != fcs_sent) {
-          cerr << "bad fcs: ";
-          fprintf (stderr, "%08x != %08x\n", fcs_sent, fcs); 
-          }
-        */
-	
-        fcs_ok = (fcs == fcs_sent);
-    }
-    if (cbs->Check80211FCS(*this) && fcs_ok==false){
-        cbs->Handle80211Unknown(*this,fc,pkt,len);
-        return;
-    }
+union radiotap_value {
+    int8_t		i8;
+    u_int8_t	u8;
+    int16_t		i16;
+    u_int16_t	u16;
+    u_int32_t	u32;
+    u_int64_t	u64;
+};
 
-
-    // fill in current_frame: type, sn
-    switch (FC_TYPE(fc)) {
-    case T_MGMT:
-	if(decode_mgmt_frame(pkt, len, fc, hdrlen)<0)
-	    return;
-	break;
-    case T_DATA:
-	if(decode_data_frame(pkt, len, fc)<0)
-	    return;
-	break;
-    case T_CTRL:
-	if(decode_ctrl_frame(pkt, len, fc)<0)
-	    return;
-	break;
-    default:
-	cbs->Handle80211( *this, fc, MAC::null, MAC::null, MAC::null, MAC::null, pkt, len);
-	cbs->Handle80211Unknown( *this, fc, pkt, len);
-	return;
-    }
-}
+static void store_radiotap_field(u_int32_t bit, const radiotap_value &u, const radiotap_value &u2,
+                                 int *pad, radiotap_hdr *hdr);
 
 int WifiPacket::print_radiotap_field(struct cpack_state *s, u_int32_t bit, int *pad, radiotap_hdr *hdr)
 {
-    union {
-        int8_t		i8;
-        u_int8_t	u8;
-        int16_t		i16;
-        u_int16_t	u16;
-        u_int32_t	u32;
-        u_int64_t	u64;
-    } u, u2, u3;
+    radiotap_value u, u2, u3;
     int rc;
 
     switch (bit) {
     case IEEE80211_RADIOTAP_FLAGS:
         rc = cpack_uint8(s, &u.u8);
-        if (u.u8 & IEEE80211_RADIOTAP_F_DATAPAD)
-            *pad = 1;
         break;
     case IEEE80211_RADIOTAP_RATE:
     case IEEE80211_RADIOTAP_DB_ANTSIGNAL:
@@ -1292,6 +583,13 @@ int WifiPacket::print_radiotap_field(struct cpack_state *s, u_int32_t bit, int *
         return  rc ;
     }
 
+    store_radiotap_field(bit, u, u2, pad, hdr);
+    return  0 ;
+}
+
+static void store_radiotap_field(u_int32_t bit, const radiotap_value &u, const radiotap_value &u2,
+                                 int *pad, radiotap_hdr *hdr)
+{
     switch (bit) {
     case IEEE80211_RADIOTAP_CHANNEL:
         //printf("%u MHz ", u.u16);
@@ -1352,6 +650,8 @@ int WifiPacket::print_radiotap_field(struct cpack_state *s, u_int32_t bit, int *
         hdr->txpower_dbm = u.i8;
         break;
     case IEEE80211_RADIOTAP_FLAGS:
+        if (u.u8 & IEEE80211_RADIOTAP_F_DATAPAD)
+            *pad = 1;
         hdr->has_flags = true;
         if (u.u8 & IEEE80211_RADIOTAP_F_CFP)
             //printf("cfp ");
@@ -1396,150 +696,77 @@ int WifiPacket::print_radiotap_field(struct cpack_state *s, u_int32_t bit, int *
         hdr->data_retries = u.u8;
         break;
     }
-    return  0 ;
 }
 
+/* The size of each value of a field and how many there are, as
+ * print_radiotap_field() reads them; 0 for the bits it doesn't know.
+ */
+static const struct {
+    u_int8_t size;
+    u_int8_t count;
+} radiotap_field_sizes[32] = {
+    {8, 1},                             // TSFT
+    {1, 1},                             // FLAGS
+    {1, 1},                             // RATE
+    {2, 2},                             // CHANNEL
+    {2, 1},                             // FHSS
+    {1, 1},                             // DBM_ANTSIGNAL
+    {1, 1},                             // DBM_ANTNOISE
+    {2, 1},                             // LOCK_QUALITY
+    {2, 1},                             // TX_ATTENUATION
+    {1, 1},                             // DB_TX_ATTENUATION
+    {1, 1},                             // DBM_TX_POWER
+    {1, 1},                             // ANTENNA
+    {1, 1},                             // DB_ANTSIGNAL
+    {1, 1},                             // DB_ANTNOISE
+    {2, 1},                             // RX_FLAGS
+    {2, 1},                             // TX_FLAGS
+    {1, 1},                             // RTS_RETRIES
+    {1, 1},                             // DATA_RETRIES
+    {1, 1},                             // XCHANNEL
+    {1, 3},                             // MCS
+};
 
-
-void WifiPacket::handle_radiotap(const u_char *p,size_t caplen)
+const radiotap_layout &radiotap_layouts::find(u_int32_t present)
 {
-#define	BITNO_32(x) (((x) >> 16) ? 16 + BITNO_16((x) >> 16) : BITNO_16((x)))
-#define	BITNO_16(x) (((x) >> 8) ? 8 + BITNO_8((x) >> 8) : BITNO_8((x)))
-#define	BITNO_8(x) (((x) >> 4) ? 4 + BITNO_4((x) >> 4) : BITNO_4((x)))
-#define	BITNO_4(x) (((x) >> 2) ? 2 + BITNO_2((x) >> 2) : BITNO_2((x)))
-#define	BITNO_2(x) (((x) & 2) ? 1 : 0)
-#define	BIT(n)	(1 << n)
-#define	IS_EXTENDED(__p) (EXTRACT_LE_32BITS(__p) & BIT(IEEE80211_RADIOTAP_EXT)) != 0
-
-    // If caplen is too small, just give it a try and carry on.
-    if (caplen < sizeof(struct ieee80211_radiotap_header)) {
-        cbs->HandleRadiotap( *this, NULL, p, caplen);
-        return;
-    }
-
-    struct ieee80211_radiotap_header *hdr = (struct ieee80211_radiotap_header *)p;
-
-    size_t len = EXTRACT_LE_16BITS(&hdr->it_len); // length of radiotap header
-
-    if (caplen < len) {
-        //printf("[|802.11]");
-        cbs->HandleRadiotap( *this, NULL, p, caplen);
-        return;// caplen;
-    }
-    uint32_t *last_presentp=0;
-    for (last_presentp = &hdr->it_present;
-         IS_EXTENDED(last_presentp) && (u_char*)(last_presentp + 1) <= p + len;
-         last_presentp++){
-    }
-
-    /* are there more bitmap extensions than bytes in header? */
-    if (IS_EXTENDED(last_presentp)) {
-        //printf("[|802.11]");
-        cbs->HandleRadiotap( *this, NULL, p, caplen);
-        return;// caplen;
-    }
-
-    const u_char *iter = (u_char*)(last_presentp + 1);
-    struct cpack_state cpacker;
-    if (cpack_init(&cpacker, (u_int8_t*)iter, len - (iter - p)) != 0) {
-        /* XXX */
-        //printf("[|802.11]");
-        cbs->HandleRadiotap( *this, NULL, p, caplen);
-        return;// caplen;
-    }
-
-    radiotap_hdr ohdr;
-    memset(&ohdr, 0, sizeof(ohdr));
-	
-    /* Assume no Atheros padding between 802.11 header and body */
-    int pad = 0;
-    uint32_t *presentp;
-    int bit0=0;
-    for (bit0 = 0, presentp = &hdr->it_present; presentp <= last_presentp;
-         presentp++, bit0 += 32) {
-
-        u_int32_t present, next_present;
-        for (present = EXTRACT_LE_32BITS(presentp); present;
-             present = next_present) {
-            /* clear the least significant bit that is set */
-            next_present = present & (present - 1);
-
-            /* extract the least significant bit that is set */
-            enum ieee80211_radiotap_type bit = (enum ieee80211_radiotap_type)
-                (bit0 + BITNO_32(present ^ next_present));
-
-            /* print the next radiotap field */
-            int r = print_radiotap_field(&cpacker, bit, &pad, &ohdr);
-
-            /* If we got an error, break both loops */
-            if(r!=0) goto done;
-        }
+    radiotap_layout &l = slots[(u_int32_t)(present * 0x9e3779b1U) >> (32 - SLOT_BITS)];
+    if (l.present == present) return l;
+
+    l.present = present;
+    l.known = false;
+    l.nfields = 0;
+    size_t off = 0;
+    for (u_int32_t bits = present; bits; bits &= bits - 1) {
+        int bit = __builtin_ctz(bits);
+        size_t size = radiotap_field_sizes[bit].size;
+        if (size == 0) return l;        // cpack, which will say so
+        off = (off + size - 1) / size * size;
+        l.bits[l.nfields] = bit;
+        l.offsets[l.nfields] = off;
+        l.nfields++;
+        off += size * radiotap_field_sizes[bit].count;
     }
-done:;
-    cbs->HandleRadiotap( *this, &ohdr, p, caplen);
-    //return len + ieee802_11_print(p + len, length - len, caplen - len, pad);
-#undef BITNO_32
-#undef BITNO_16
-#undef BITNO_8
-#undef BITNO_4
-#undef BITNO_2
-#undef BIT
-    handle_80211(p+len, caplen-len);
+    l.end = off;
+    l.known = true;
+    return l;
 }
 
-void WifiPacket::handle_prism(const u_char *pc, size_t len)
+/* Read the fields of a header whose layout is known and that holds all of them */
+void WifiPacket::read_radiotap_fields(const radiotap_layout &layout, const u_char *fields, int *pad, radiotap_hdr *hdr)
 {
-    prism2_pkthdr hdr;
-
-    /* get the fields */
-    hdr.host_time 	= EXTRACT_LE_32BITS(pc+32);
-    hdr.mac_time 	= EXTRACT_LE_32BITS(pc+44);
-    hdr.channel 	= EXTRACT_LE_32BITS(pc+56);
-    hdr.rssi 		= EXTRACT_LE_32BITS(pc+68);
-    hdr.sq 		= EXTRACT_LE_32BITS(pc+80);
-    hdr.signal  	= EXTRACT_LE_32BITS(pc+92);
-    hdr.noise   	= EXTRACT_LE_32BITS(pc+104);
-    hdr.rate		= EXTRACT_LE_32BITS(pc+116)/2;
-    hdr.istx		= EXTRACT_LE_32BITS(pc+128);
-    cbs->HandlePrism( *this, &hdr, pc + 144, len - 144);
-    handle_80211(pc+144,len-144);
-}
-
-///////////////////////////////////////////////////////////////////////////////
-///
-/// handle_*:
-/// handle each of the packet types
-///
-
-void WifiPacket::handle_ether(const u_char *ptr, size_t len)
-{
-#if 0
-    ether_hdr_t hdr;
-
-    hdr.da = MAC::ether2MAC(ptr);
-    hdr.sa = MAC::ether2MAC(ptr+6);
-    hdr.type = EXTRACT_16BITS(ptr + 12);
-
-    ptr += 14;
-    len -= 14;
-
-    cbs->HandleEthernet(*this, &hdr, ptr, len);
-
-    switch (hdr.type) {
-    case ETHERTYPE_IP:
-	handle_ip(ptr, len);
-	return;
-    case ETHERTYPE_IPV6:
-	handle_ip6(ptr, len);
-	return;
-    case ETHERTYPE_ARP:
-	handle_arp( ptr, len);
-	return;
-    default:
-	cbs->HandleL2Unknown(*this, hdr.type, ptr, len);
-	return;
+    for (int i = 0; i < layout.nfields; i++) {
+        u_int32_t bit = layout.bits[i];
+        const u_char *f = fields + layout.offsets[i];
+        radiotap_value u[3];
+        for (int j = 0; j < radiotap_field_sizes[bit].count; j++) {
+            switch (radiotap_field_sizes[bit].size) {
+            case 1: u[j].u8 = f[j]; break;
+            case 2: u[j].u16 = EXTRACT_LE_16BITS(f + 2*j); break;
+            case 8: u[j].u64 = EXTRACT_LE_64BITS(f + 8*j); break;
+            }
+        }
+        store_radiotap_field(bit, u[0], u[1], pad, hdr);
     }
-#endif
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -1577,7 +804,8 @@ void Wifipcap::dl_ieee802_11_radio(const PcapUserData &data, const struct pcap_p
 void Wifipcap::dl_ieee802_11_radio(const u_char *user, const struct pcap_pkthdr *header, const u_char * packet)
 {
     const PcapUserData *data = reinterpret_cast<const PcapUserData *>(user);
-    WifiPacket pkt(data->cbs,data->header_type,header,packet);
+    WifiDecoder<WifipcapCallbacks> pkt(data->cbs,data->header_type,header,packet,
+                                       &data->wcap->layouts,&data->wcap->beacons);
 
     data->cbs->PacketBegin(pkt,packet,header->caplen,header->len);
     pkt.handle_radiotap(packet,header->caplen);
@@ -1603,11 +831,13 @@ bool Wifipcap::InitNext()
     return true;
 }
 
-void Wifipcap::Init(const char *name, bool live) {
+pcap_t *Wifipcap::Open(const char *name, bool live, bool verbose) {
     if (verbose){
         std::cerr << "wifipcap: initializing '" << name << "'" << std::endl;
     }
 
+    pcap_t *descr = NULL;
+
     if (!live) {
 #ifdef _WIN32
 	std::cerr << "Trace replay is unsupported in windows." << std::endl;
@@ -1653,7 +883,7 @@ void Wifipcap::Init(const char *name, bool live) {
         }
     }
 
-    datalink = pcap_datalink(descr);
+    int datalink = pcap_datalink(descr);
     if (datalink != DLT_PRISM_HEADER && datalink != DLT_IEEE802_11_RADIO && datalink != DLT_IEEE802_11) {
 	if (datalink == DLT_EN10MB) {
 	    printf("warning: ethernet datalink type: %s\n",
@@ -1663,67 +893,19 @@ void Wifipcap::Init(const char *name, bool live) {
 		   pcap_datalink_val_to_name(datalink));
 	}
     }
+    return descr;
 }
 
-
-
-
-/* object-oriented version of pcap callback. Called with the callbacks object,
- * the DLT type, the header and the packet.
- * This is the main packet processor.
- * It records some stats and then dispatches to the appropriate callback.
- */
-void Wifipcap::handle_packet(WifipcapCallbacks *cbs,int header_type,
-                             const struct pcap_pkthdr *header, const u_char * packet) 
-{
-    /* Record start time if we don't have it */
-    if (startTime == TIME_NONE) {
-	startTime = header->ts;
-	lastPrintTime = header->ts;
-    }
-    /* Print stats if necessary */
-    if (header->ts.tv_sec > lastPrintTime.tv_sec + Wifipcap::PRINT_TIME_INTERVAL) {
-	if (verbose) {
-	    int hours = (header->ts.tv_sec - startTime.tv_sec)/3600;
-	    int days  = hours/24;
-	    int left  = hours%24;
-	    fprintf(stderr, "wifipcap: %2d days %2d hours, %10" PRId64 " pkts\n", 
-		    days, left, packetsProcessed);
-	}
-	lastPrintTime = header->ts;
-    }
-    packetsProcessed++;
-
-    /* Create the packet object and call the appropriate callbacks */
-    WifiPacket pkt(cbs,header_type,header,packet);
-
-    /* Notify callback */
-    cbs->PacketBegin(pkt, packet, header->caplen, header->len);
-    //int frameLen = header->caplen;
-    switch(header_type) {
-    case DLT_PRISM_HEADER:
-        pkt.handle_prism(packet,header->caplen);
-        break;
-    case DLT_IEEE802_11_RADIO:
-        pkt.handle_radiotap(packet,header->caplen);
-        break;
-    case DLT_IEEE802_11:
-        pkt.handle_80211(packet,header->caplen);
-        break;
-    case DLT_EN10MB:
-        pkt.handle_ether(packet,header->caplen);
-        break;
-    default:
-#if 0
-	// try handling it as default IP assuming framing is ethernet 
-	// (this is for testing)
-        pkt.handle_ip(packet,header->caplen);
-#endif
-        break;
-    }
-    cbs->PacketEnd(pkt);
+void Wifipcap::Init(const char *name, bool live) {
+    descr = Open(name, live, verbose);
+    datalink = pcap_datalink(descr);
 }
 
+/* The decoder for WifipcapCallbacks, whose handlers it calls virtually;
+ * Wifipcap::handle_packet() itself is in wifipcap_decode.h
+ */
+template void Wifipcap::handle_packet<WifipcapCallbacks>(WifipcapCallbacks *cbs,int header_type,
+                                                         const struct pcap_pkthdr *header, const u_char * packet);
 
 /* The raw callback from pcap; jump back into the object-oriented domain */
 /* note: u_char *user may not be const according to spec */
@@ -1769,6 +951,146 @@ void Wifipcap::Run(WifipcapCallbacks *cbs, int maxpkts)
     } while ( InitNext() );
 }
 
+/* One of RunMerged()'s files, and its next packet */
+struct wifipcap_source {
+    pcap_t *pcap;
+    int datalink;
+    size_t order;                       // the file's, among the others
+    struct pcap_pkthdr *header;
+    const u_char *packet;
+};
+
+/* For the heap: the earliest packet on top, and of those, the first file's */
+struct wifipcap_source_later {
+    bool operator()(const wifipcap_source &a, const wifipcap_source &b) const {
+        if (a.header->ts.tv_sec != b.header->ts.tv_sec) return a.header->ts.tv_sec > b.header->ts.tv_sec;
+        if (a.header->ts.tv_usec != b.header->ts.tv_usec) return a.header->ts.tv_usec > b.header->ts.tv_usec;
+        return a.order > b.order;
+    }
+};
+
+static void add_source(std::vector<wifipcap_source> &heap, pcap_t *pcap, size_t order)
+{
+    wifipcap_source src;
+    src.pcap = pcap;
+    src.datalink = pcap_datalink(pcap);
+    src.order = order;
+    if (pcap_next_ex(pcap, &src.header, &src.packet) != 1) {
+        pcap_close(pcap);
+        return;
+    }
+    heap.push_back(src);
+    std::push_heap(heap.begin(), heap.end(), wifipcap_source_later());
+}
+
+void Wifipcap::RunMerged(WifipcapCallbacks *cbs, int maxpkts)
+{
+    std::vector<wifipcap_source> heap;
+    size_t order = 0;
+    if (descr) {
+        add_source(heap, descr, order++);
+        descr = NULL;
+    }
+    while (morefiles.size()) {
+        add_source(heap, Open(morefiles.front(), false, verbose), order++);
+        morefiles.pop_front();
+    }
+
+    packetsProcessed = 0;
+    while (heap.size() && (maxpkts <= 0 || packetsProcessed < (uint64_t)maxpkts)) {
+        std::pop_heap(heap.begin(), heap.end(), wifipcap_source_later());
+        wifipcap_source &src = heap.back();
+        handle_packet(cbs, src.datalink, src.header, src.packet);
+        if (pcap_next_ex(src.pcap, &src.header, &src.packet) == 1) {
+            std::push_heap(heap.begin(), heap.end(), wifipcap_source_later());
+        } else {
+            pcap_close(src.pcap);
+            heap.pop_back();
+        }
+    }
+    for (std::vector<wifipcap_source>::iterator it = heap.begin(); it != heap.end(); it++) {
+        pcap_close(it->pcap);
+    }
+}
+
+/* What RunFiles()'s threads share */
+struct wifipcap_files {
+    wifipcap_files(const char* const *names_, int nfiles_, WifipcapFileCallbacks *files_, bool verbose_):
+        names(names_), nfiles(nfiles_), next(0), files(files_), verbose(verbose_)
+#ifdef HAVE_PTHREAD
+        ,lock()
+#endif
+        {}
+    const char* const *names;
+    int nfiles;
+    int next;                           // the next file to run
+    WifipcapFileCallbacks *files;
+    bool verbose;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock;               // protects next, and the calls to files
+#endif
+    void lock_files() {
+#ifdef HAVE_PTHREAD
+        pthread_mutex_lock(&lock);
+#endif
+    }
+    void unlock_files() {
+#ifdef HAVE_PTHREAD
+        pthread_mutex_unlock(&lock);
+#endif
+    }
+private:
+    wifipcap_files(const wifipcap_files &);
+    wifipcap_files &operator=(const wifipcap_files &);
+};
+
+static void *run_files(void *arg)
+{
+    wifipcap_files &w = *reinterpret_cast<wifipcap_files *>(arg);
+    while (true) {
+        w.lock_files();
+        if (w.next >= w.nfiles) {
+            w.unlock_files();
+            break;
+        }
+        const char *name = w.names[w.next++];
+        WifipcapCallbacks *cbs = w.files->Open(name);
+        w.unlock_files();
+
+        {
+            Wifipcap wcap(name, false, w.verbose);
+            wcap.Run(cbs);
+        }
+
+        w.lock_files();
+        w.files->Close(name, cbs);
+        w.unlock_files();
+    }
+    return 0;
+}
+
+void Wifipcap::RunFiles(const char* const *names, int nfiles, WifipcapFileCallbacks *files,
+                        int threads, bool verbose)
+{
+    wifipcap_files w(names, nfiles, files, verbose);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init(&w.lock, 0);
+    std::vector<pthread_t> started;
+    for (int i = 1; i < threads && i < nfiles; i++) { // and this thread
+        pthread_t t;
+        if (pthread_create(&t, 0, run_files, &w) != 0) break; // fewer, then
+        started.push_back(t);
+    }
+    run_files(&w);
+    for (size_t i = 0; i < started.size(); i++) {
+        pthread_join(started[i], 0);
+    }
+    pthread_mutex_destroy(&w.lock);
+#else
+    run_files(&w);
+#endif
+}
+
 
 ///////////////////////////////////////////////////////////////////////////////
 
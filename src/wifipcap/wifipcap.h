@@ -117,6 +117,7 @@
 
 struct MAC {          
     enum { PRINT_FMT_COLON, PRINT_FMT_PLAIN };
+    enum { STR_LEN = 18 };              // what format() writes, at most, with the NUL
     uint64_t val;
     MAC():val() {}
     MAC(uint64_t val_):val(val_){}
@@ -153,6 +154,13 @@ struct MAC {
     bool operator==(const MAC& o) const { return val == o.val; }
     bool operator!=(const MAC& o) const { return val != o.val; }
     bool operator<(const MAC& o)  const { return val <  o.val; }
+
+    /* Fibonacci hashing: take the top bits for a table's index */
+    uint64_t hash() const { return val * 0x9e3779b97f4a7c15ULL; }
+
+    /* Write the address into buf[STR_LEN] as fmt, or print_fmt; returns its length */
+    size_t format(char *buf, int fmt) const;
+    size_t format(char *buf) const { return format(buf, print_fmt); }
     
     static MAC ether2MAC(const uint8_t * ether) {
         return MAC(ether);
@@ -235,7 +243,7 @@ struct tim_t {
 /* reserved 		8 */
 /* reserved 		9 */
 /* reserved 		10 */
-/* reserved 		11 */
+#define	E_BSS_LOAD	11
 /* reserved 		12 */
 /* reserved 		13 */
 /* reserved 		14 */
@@ -249,6 +257,9 @@ struct tim_t {
 /* reserved 		16 */
 /* reserved 		16 */
 
+/* The elements parse_elements() can decode into a mgmt_body_t, as bits */
+#define	E_DECODED	((1<<E_SSID)|(1<<E_RATES)|(1<<E_DS)|(1<<E_CF)|(1<<E_TIM)|(1<<E_CHALLENGE))
+
 // XXX Jeff: no FCS fields are filled in right now
 
 #define	CTRL_RTS_HDRLEN	(IEEE802_11_FC_LEN+IEEE802_11_DUR_LEN+  \
@@ -468,7 +479,7 @@ struct mgmt_body_t {
     mgmt_body_t():timestamp(),beacon_interval(),listen_interval(),status_code(),aid(),ap(),reason_code(),
                   auth_alg(),auth_trans_seq_num(),challenge_status(),challenge(),capability_info(),
                   ssid_status(),ssid(),rates_status(),rates(),ds_status(),ds(),cf_status(),cf(),
-                  fh_status(),fh(),tim_status(),tim(){};
+                  fh_status(),fh(),tim_status(),tim(),elements(),nelements(),element_data(){};
 
     u_int8_t   	timestamp[IEEE802_11_TSTAMP_LEN];
     u_int16_t  	beacon_interval;
@@ -494,6 +505,20 @@ struct mgmt_body_t {
     struct fh_t	fh;
     elem_status_t	tim_status;
     struct tim_t	tim;
+
+    /* Every element, in order; only those asked for are decoded above */
+    struct element_ref {
+        u_int8_t	id;
+        u_int8_t	length;
+        u_int16_t	offset;         // of the element id, in element_data
+    };
+    static const int MAX_ELEMENTS = 64;
+    struct element_ref  elements[MAX_ELEMENTS];
+    int			nelements;
+    const u_char	*element_data;
+
+    /** The contents of the first element id, or NULL if there is none */
+    const u_char *find_element(u_int8_t id, u_int8_t *length) const;
 };
 
 struct ctrl_rts_t {
@@ -547,12 +572,66 @@ struct ctrl_rts_t {
 
 struct WifiPacket;
 struct WifipcapCallbacks;
+struct WifipcapFileCallbacks;
 class Wifipcap;
 extern std::ostream& operator<<(std::ostream& out, const MAC& mac);
 extern std::ostream& operator<<(std::ostream& out, const struct in_addr& ip);
 
 ///////////////////////////////////////////////////////////////////////////////
 
+/*
+ * Where the fields of a radiotap header are, for one present bitmap.
+ * Offsets are from the first field, aligned as cpack aligns them.
+ */
+struct radiotap_layout {
+    radiotap_layout():present(0x80000000),known(false),nfields(0),end(0){}
+    u_int32_t present;                  // the bitmap; at first extended, which is never looked up
+    bool      known;                    // false if the size of a field is unknown
+    u_int8_t  nfields;
+    u_int8_t  bits[32];
+    u_int16_t offsets[32];
+    size_t    end;                      // length of the fields
+};
+
+/*
+ * The layouts seen recently, so that a capture whose frames all share a
+ * radiotap layout works it out once. Each Wifipcap has its own: no locking.
+ */
+class radiotap_layouts {
+    static const unsigned int SLOT_BITS = 4;
+    radiotap_layout slots[1 << SLOT_BITS];
+public:
+    radiotap_layouts():slots(){}
+    /** The layout for present, which must not be extended, worked out now if it isn't cached */
+    const radiotap_layout &find(u_int32_t present);
+};
+
+/*
+ * The last beacon seen from each BSSID. An AP beacons about ten times a
+ * second, each the same as the last but for its timestamp, its TIM and
+ * its BSS load, so a beacon whose hash without those matches the one
+ * before it isn't decoded again; see WifipcapCallbacks::Dedup80211Beacons().
+ * Direct-mapped by BSSID, like radiotap_layouts: no locking.
+ */
+struct beacon_seen {
+    beacon_seen():bssid(),hash(),count(),last_seen(){}
+    MAC       bssid;
+    u_int64_t hash;                     // of the beacon last decoded; 0 when unused
+    u_int64_t count;                    // beacons with that hash since, including it
+    struct timeval last_seen;
+};
+
+class beacon_cache {
+    static const unsigned int SLOT_BITS = 8;
+    beacon_seen slots[1 << SLOT_BITS];
+public:
+    beacon_cache():slots(){}
+    /** Of the addresses, the fixed fields and the elements that don't change from beacon to beacon */
+    static u_int64_t hash(const struct mgmt_header_t *pmh, const u_char *body, size_t len);
+    beacon_seen &slot(const MAC &bssid) {
+        return slots[bssid.hash() >> (64 - SLOT_BITS)];
+    }
+};
 
 /* 
  * This class decodes a specific packet
@@ -563,42 +642,24 @@ struct WifiPacket {
     /** 48-bit MACs in 64-bit ints */
     static int debug;                   // prints callback before they are called
 
-    WifiPacket(WifipcapCallbacks *cbs_,const int header_type_,const struct pcap_pkthdr *header_,const u_char *packet_):
-        cbs(cbs_),header_type(header_type_),header(header_),packet(packet_),fcs_ok(false){}
-    void parse_elements(struct mgmt_body_t *pbody, const u_char *p, int offset, size_t len);
-    int handle_beacon(const struct mgmt_header_t *pmh, const u_char *p, size_t len);
-    int handle_assoc_request(const struct mgmt_header_t *pmh, const u_char *p, size_t len);
-    int handle_assoc_response(const struct mgmt_header_t *pmh, const u_char *p, size_t len, bool reassoc = false);
-    int handle_reassoc_request(const struct mgmt_header_t *pmh, const u_char *p, size_t len);
-    int handle_reassoc_response(const struct mgmt_header_t *pmh, const u_char *p, size_t len);
-    int handle_probe_request(const struct mgmt_header_t *pmh, const u_char *p, size_t len);
-    int handle_probe_response(const struct mgmt_header_t *pmh, const u_char *p, size_t len);
-    int handle_atim(const struct mgmt_header_t *pmh, const u_char *p, size_t len);
-    int handle_disassoc(const struct mgmt_header_t *pmh, const u_char *p, size_t len);
-    int handle_auth(const struct mgmt_header_t *pmh, const u_char *p, size_t len);
-    int handle_deauth(const struct mgmt_header_t *pmh, const u_char *p, size_t len);
-
-    int decode_mgmt_body(u_int16_t fc, struct mgmt_header_t *pmh, const u_char *p, size_t len);
-    int decode_mgmt_frame(const u_char * ptr, size_t len, u_int16_t fc, u_int8_t hdrlen);
-    int decode_data_frame(const u_char * ptr, size_t len, u_int16_t fc);
-    int decode_ctrl_frame(const u_char * ptr, size_t len, u_int16_t fc);
-
-    /* Handle the individual packet types based on DTL callback switch */
-    void handle_llc(const mac_hdr_t &hdr,const u_char *ptr, size_t len,u_int16_t fc);
-    void handle_wep(const u_char *ptr, size_t len);
-    void handle_prism(const u_char *ptr, size_t len);
-    void handle_ether(const u_char *ptr, size_t len);
-    void handle_ip(const u_char *ptr, size_t len);
-    void handle_80211(const u_char *ptr, size_t len); 
+    /* The decoding itself, and the calls to the callbacks, are in WifiDecoder (wifipcap_decode.h) */
+    WifiPacket(const int header_type_,const struct pcap_pkthdr *header_,const u_char *packet_,
+               radiotap_layouts *layouts_ = 0,beacon_cache *beacons_ = 0):
+        header_type(header_type_),header(header_),packet(packet_),fcs_ok(false),
+        layouts(layouts_),beacons(beacons_){}
+    void parse_elements(struct mgmt_body_t *pbody, const u_char *p, int offset, size_t len, u_int32_t decode = E_DECODED);
     int print_radiotap_field(struct cpack_state *s, u_int32_t bit, int *pad, radiotap_hdr *hdr);
-    void handle_radiotap(const u_char *ptr, size_t caplen);
+    void read_radiotap_fields(const radiotap_layout &layout, const u_char *fields, int *pad, radiotap_hdr *hdr);
+    static uint32_t crc32_802(const unsigned char *buf, size_t len);
+    static size_t extract_header_length(u_int16_t fc);
 
     /* And finally the data for each packet */
-    WifipcapCallbacks *cbs;             // the callbacks to use with this packet
     const int header_type;                    // DLT
     const struct pcap_pkthdr *header;   // the actual pcap headers
     const u_char *packet;               // the actual packet data
     bool fcs_ok;                        // was it okay?
+    radiotap_layouts *layouts;          // the decoder's, or 0 to read radiotap fields with cpack
+    beacon_cache *beacons;              // the decoder's, or 0 to decode every beacon
 };
 
 
@@ -649,8 +710,26 @@ struct WifipcapCallbacks {
     // a complete packet capture for this to be meaningful
     virtual bool Check80211FCS(const WifiPacket &p ) { return false; }
 
+    // if this returns true, the fcs is only calculated for frames that
+    // reach a handler, and fcs_ok is false for the rest. Only callbacks
+    // decoded for at compile time (see wifipcap_decode.h) have any rest.
+    virtual bool Check80211FCSIfHandled(const WifiPacket &p ) { return false; }
+
+    // The elements of management frames (1<<E_SSID and so on; see
+    // E_DECODED) to decode into the mgmt_body_t given to the handlers
+    // below. The rest are only indexed: see mgmt_body_t::find_element().
+    virtual u_int32_t Mgmt80211Elements(const WifiPacket &p) { return E_DECODED; }
+
+    // Return true to have a beacon that is the same as the last one from
+    // its BSSID (see beacon_cache) given to Handle80211MgmtBeaconRepeat()
+    // instead, undecoded, with the count and time seen of such beacons;
+    // which returns false to have it decoded for Handle80211MgmtBeacon()
+    // after all, as the first of a new run of repeats.
+    virtual bool Dedup80211Beacons(const WifiPacket &p) { return false; }
+    virtual bool Handle80211MgmtBeaconRepeat(const WifiPacket &p, const struct mgmt_header_t *hdr, const struct beacon_seen &seen){ return true; }
+
     // Management
-    virtual void Handle80211MgmtBeacon(const WifiPacket &p, const struct mgmt_header_t *hdr, const struct mgmt_body_t *body)   {puts("Handle80211MgmtBeacon");}
+    virtual void Handle80211MgmtBeacon(const WifiPacket &p, const struct mgmt_header_t *hdr, const struct mgmt_body_t *body){}
     virtual void Handle80211MgmtAssocRequest(const WifiPacket &p, const struct mgmt_header_t *hdr, const struct mgmt_body_t *body){}
     virtual void Handle80211MgmtAssocResponse(const WifiPacket &p, const struct mgmt_header_t *hdr, const struct mgmt_body_t *body){}
     virtual void Handle80211MgmtReassocRequest(const WifiPacket &p, const struct mgmt_header_t *hdr, const struct mgmt_body_t *body){}
@@ -717,6 +796,18 @@ struct WifipcapCallbacks {
 
 
 
+/**
+ * For Wifipcap::RunFiles(): Open() makes the callbacks for a file and
+ * Close() is given them back when it is done, to add what they found to
+ * the totals and delete them. Neither is ever called while the other or
+ * itself is, so they need no locking of their own.
+ */
+struct WifipcapFileCallbacks {
+    virtual ~WifipcapFileCallbacks(){}
+    virtual WifipcapCallbacks *Open(const char *name) = 0;
+    virtual void Close(const char *name, WifipcapCallbacks *cbs) = 0;
+};
+
 /**
  * Applications create an instance of this to start processing a pcap
  * trace. Example:
@@ -749,11 +840,11 @@ public:
      * gzipped trace and will pipe it through zcat before parsing it.
      * @param live true if reading from a device, otherwise a trace
      */
-    Wifipcap():descr(),datalink(),morefiles(),verbose(),startTime(),lastPrintTime(),packetsProcessed(){
+    Wifipcap():descr(),datalink(),morefiles(),verbose(),startTime(),lastPrintTime(),packetsProcessed(),layouts(),beacons(){
     }; 
     Wifipcap(const char *name, bool live_ = false, bool verbose_ = false):
         descr(NULL), datalink(),morefiles(),verbose(verbose_), startTime(TIME_NONE), 
-        lastPrintTime(TIME_NONE), packetsProcessed(0) {
+        lastPrintTime(TIME_NONE), packetsProcessed(0), layouts(), beacons() {
         Init(name, live_);
     }
     
@@ -762,14 +853,16 @@ public:
      */
     Wifipcap(const char* const *names, int nfiles_, bool verbose_ = false):
         descr(NULL), datalink(),morefiles(),verbose(verbose_), startTime(TIME_NONE), 
-        lastPrintTime(TIME_NONE), packetsProcessed(0) {
+        lastPrintTime(TIME_NONE), packetsProcessed(0), layouts(), beacons() {
         for (int i=0; i<nfiles_; i++) {
             morefiles.push_back(names[i]);
         }
         InitNext();
     }
 
-    virtual ~Wifipcap(){ };
+    virtual ~Wifipcap(){
+        if (descr) pcap_close(descr);
+    };
 
     /**
      * Set a pcap filter. Returns non-null error string if fail.
@@ -803,8 +896,10 @@ public:
     };
     void dl_prism(const PcapUserData &data, const struct pcap_pkthdr *header, const u_char * packet);
     void dl_ieee802_11_radio(const PcapUserData &data, const struct pcap_pkthdr *header, const u_char * packet);
-    void handle_packet(WifipcapCallbacks *cbs,int header_type,
-                       const struct pcap_pkthdr *header, const u_char * packet);
+    /** Decode a packet for cbs. CB is WifipcapCallbacks, or the most
+     * derived class of cbs; defined in wifipcap_decode.h */
+    template <class CB> void handle_packet(CB *cbs,int header_type,
+                                           const struct pcap_pkthdr *header, const u_char * packet);
 
     static void dl_prism(const u_char *user, const struct pcap_pkthdr *header, const u_char * packet);
     static void dl_ieee802_11_radio(const u_char *user, const struct pcap_pkthdr *header, const u_char * packet);
@@ -814,7 +909,22 @@ public:
     int    GetDataLink() const { return datalink; }
     void   Run(WifipcapCallbacks *cbs, int maxpkts = 0);
 
+    /**
+     * As Run(), but with all the files given to the constructor open at
+     * once, and their packets merged into the order of their timestamps,
+     * each decoded as its file's datalink.
+     */
+    void   RunMerged(WifipcapCallbacks *cbs, int maxpkts = 0);
+
+    /**
+     * Run() each of the files with a Wifipcap and callbacks of its own,
+     * on as many as threads threads at a time (one without pthreads).
+     */
+    static void RunFiles(const char* const *names, int nfiles, WifipcapFileCallbacks *files,
+                         int threads, bool verbose = false);
+
 private:
+    static pcap_t *Open(const char *name, bool live, bool verbose);
     void  Init(const char *name, bool live);
     bool  InitNext();
     pcap_t *descr;                      // can't be const
@@ -826,6 +936,8 @@ public:
     struct timeval startTime;
     struct timeval lastPrintTime;
     uint64_t       packetsProcessed;
+    radiotap_layouts layouts;           // for the packets this decodes
+    beacon_cache   beacons;
     static const int PRINT_TIME_INTERVAL = 6*60*60; // sec
 };
 
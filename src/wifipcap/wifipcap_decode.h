@@ -0,0 +1,1060 @@
+/**
+ * wifipcap_decode.h:
+ * The 802.11 decoder, templated on the callbacks it calls.
+ *
+ * WifiDecoder<CB> decodes a packet and calls its handlers on a CB, which
+ * is a WifipcapCallbacks or a class derived from it. For a derived class
+ * the handlers are called by their qualified names, so that they are bound
+ * when the decoder is compiled: a handler the class doesn't declare is the
+ * empty default in WifipcapCallbacks, and compiles away. The decoder also
+ * leaves out work whose only use is a handler that isn't declared, such
+ * as reading the radiotap fields and the elements of management frames.
+ * CB must therefore be the most derived type of the callbacks object;
+ * handlers overridden in a further subclass would not be called.
+ * For CB = WifipcapCallbacks itself, every handler is a virtual call, as
+ * it always was, and nothing is left out.
+ *
+ * Include this header where Wifipcap::handle_packet() is called with
+ * your own callbacks; wifipcap.cpp instantiates it for WifipcapCallbacks.
+ *
+ * Released under GPLv3.
+ * Some code (c) Jeffrey Pang <jeffpang@cs.cmu.edu>, 2003
+ *           (C) Simson Garfinkel <simsong@acm.org> 2012-
+ */
+
+#ifndef _WIFIPCAP_DECODE_H_
+#define _WIFIPCAP_DECODE_H_
+
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+
+#include "wifipcap.h"
+
+#include "cpack.h"
+#include "extract.h"
+#include "oui.h"
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-align"
+
+/* from ethereal packet-prism.c */
+#define pletohs(p)  ((u_int16_t)					\
+		     ((u_int16_t)*((const u_int8_t *)(p)+1)<<8|		\
+		      (u_int16_t)*((const u_int8_t *)(p)+0)<<0))
+#define COOK_FRAGMENT_NUMBER(x) ((x) & 0x000F)
+#define COOK_SEQUENCE_NUMBER(x) (((x) & 0xFFF0) >> 4)
+/* end ethereal code */
+
+// Jeff: HACK -- tcpdump uses a global variable to check truncation
+#define TTEST2(_p, _l) ((const u_char *)&(_p) - p + (_l) <= (ssize_t)len) 
+
+/* Whether a CB's handlers are called virtually: only for the base class */
+template <class CB> struct wifipcap_callback_traits {
+    static const bool is_virtual = false;
+};
+template <> struct wifipcap_callback_traits<WifipcapCallbacks> {
+    static const bool is_virtual = true;
+};
+
+/* Which class declares a handler: the type of &CB::handler is a pointer
+ * to a member of the class that declares it, which for a handler CB
+ * doesn't override is WifipcapCallbacks.
+ */
+template <class C> struct wifipcap_declarer { typedef char (&type)[1]; };
+template <> struct wifipcap_declarer<WifipcapCallbacks> { typedef char (&type)[2]; };
+template <class C,class F> typename wifipcap_declarer<C>::type wifipcap_declared_in(F C::*);
+
+/* Call a handler on cbs, e.g. WIFIPCAP_CALL(HandleLLC(*this,&hdr,ptr,len)) */
+#define WIFIPCAP_CALL(call) \
+    (wifipcap_callback_traits<CB>::is_virtual ? cbs->call : cbs->CB::call)
+
+/* true unless CB leaves handler as the empty default */
+#define WIFIPCAP_HANDLES(handler) \
+    (wifipcap_callback_traits<CB>::is_virtual || sizeof(wifipcap_declared_in(&CB::handler))==1)
+
+template <class CB>
+struct WifiDecoder : public WifiPacket {
+    WifiDecoder(CB *cbs_,const int header_type_,const struct pcap_pkthdr *header_,const u_char *packet_,
+                radiotap_layouts *layouts_ = 0,beacon_cache *beacons_ = 0):
+        WifiPacket(header_type_,header_,packet_,layouts_,beacons_),cbs(cbs_){}
+
+    int handle_beacon(const struct mgmt_header_t *pmh, const u_char *p, size_t len);
+    int handle_assoc_request(const struct mgmt_header_t *pmh, const u_char *p, size_t len);
+    int handle_assoc_response(const struct mgmt_header_t *pmh, const u_char *p, size_t len, bool reassoc = false);
+    int handle_reassoc_request(const struct mgmt_header_t *pmh, const u_char *p, size_t len);
+    int handle_reassoc_response(const struct mgmt_header_t *pmh, const u_char *p, size_t len);
+    int handle_probe_request(const struct mgmt_header_t *pmh, const u_char *p, size_t len);
+    int handle_probe_response(const struct mgmt_header_t *pmh, const u_char *p, size_t len);
+    int handle_atim(const struct mgmt_header_t *pmh, const u_char *p, size_t len);
+    int handle_disassoc(const struct mgmt_header_t *pmh, const u_char *p, size_t len);
+    int handle_auth(const struct mgmt_header_t *pmh, const u_char *p, size_t len);
+    int handle_deauth(const struct mgmt_header_t *pmh, const u_char *p, size_t len);
+
+    int decode_mgmt_body(u_int16_t fc, struct mgmt_header_t *pmh, const u_char *p, size_t len);
+    int decode_mgmt_frame(const u_char * ptr, size_t len, u_int16_t fc, u_int8_t hdrlen);
+    int decode_data_frame(const u_char * ptr, size_t len, u_int16_t fc);
+    int decode_ctrl_frame(const u_char * ptr, size_t len, u_int16_t fc);
+    bool frame_handled(u_int16_t fc);
+
+    /* Handle the individual packet types based on DTL callback switch */
+    void handle_llc(const mac_hdr_t &hdr,const u_char *ptr, size_t len,u_int16_t fc);
+    void handle_wep(const u_char *ptr, size_t len);
+    void handle_prism(const u_char *ptr, size_t len);
+    void handle_ether(const u_char *ptr, size_t len);
+    void handle_ip(const u_char *ptr, size_t len);
+    void handle_80211(const u_char *ptr, size_t len); 
+    void handle_radiotap(const u_char *ptr, size_t caplen);
+
+    CB *cbs;                            // the callbacks to use with this packet
+};
+
+template <class CB>
+void WifiDecoder<CB>::handle_llc(const mac_hdr_t &mac,const u_char *ptr, size_t len,u_int16_t fc)
+{
+    if (len < 7) {
+	// truncated header!
+	WIFIPCAP_CALL(HandleLLC(*this,NULL, ptr, len));
+	return;
+    }
+
+    // http://www.wildpackets.com/resources/compendium/wireless_lan/wlan_packets
+
+    llc_hdr_t hdr;
+    hdr.dsap   = EXTRACT_LE_8BITS(ptr); // Destination Service Access point
+    hdr.ssap   = EXTRACT_LE_8BITS(ptr + 1); // Source Service Access Point
+    hdr.control= EXTRACT_LE_8BITS(ptr + 2); // ignored by most protocols
+    hdr.oui    = EXTRACT_24BITS(ptr + 3);
+    hdr.type   = EXTRACT_16BITS(ptr + 6);
+
+
+    /* "When both the DSAP and SSAP are set to 0xAA, the type is
+     * interpreted as a protocol not defined by IEEE and the LSAP is
+     * referred to as SubNetwork Access Protocol (SNAP).  In SNAP, the
+     * 5 bytes that follow the DSAP, SSAP, and control byte are called
+     * the Protocol Discriminator."
+     */
+
+    if(hdr.dsap==0xAA && hdr.ssap==0xAA){
+        WIFIPCAP_CALL(HandleLLC(*this,&hdr,ptr+8,len-8));
+        return;
+    }
+
+    if (hdr.oui == OUI_ENCAP_ETHER || hdr.oui == OUI_CISCO_90) {
+        WIFIPCAP_CALL(HandleLLC(*this,&hdr, ptr+8, len-8));
+        return;
+    }
+        
+    WIFIPCAP_CALL(HandleLLCUnknown(*this,ptr, len));
+}
+
+template <class CB>
+void WifiDecoder<CB>::handle_wep(const u_char *ptr, size_t len)
+{
+    // Jeff: XXX handle TKIP/CCMP ? how can we demultiplex different
+    // protection protocols?
+
+    struct wep_hdr_t hdr;
+    u_int32_t iv;
+
+    if (len < IEEE802_11_IV_LEN + IEEE802_11_KID_LEN) {
+	// truncated!
+	WIFIPCAP_CALL(HandleWEP(*this,NULL, ptr, len));
+	return;
+    }
+    iv = EXTRACT_LE_32BITS(ptr);
+    hdr.iv = IV_IV(iv);
+    hdr.pad = IV_PAD(iv);
+    hdr.keyid = IV_KEYID(iv);
+    WIFIPCAP_CALL(HandleWEP(*this,&hdr, ptr, len));
+}
+
+/*********************************************************************************
+ * Print Handle functions for the management frame types
+ *********************************************************************************/
+
+template <class CB>
+int
+WifiDecoder<CB>::handle_beacon( const struct mgmt_header_t *pmh, const u_char *p, size_t len)
+{
+    struct mgmt_body_t pbody;
+    int offset = 0;
+
+    memset(&pbody, 0, sizeof(pbody));
+
+    if (!TTEST2(*p, IEEE802_11_TSTAMP_LEN + IEEE802_11_BCNINT_LEN +
+                IEEE802_11_CAPINFO_LEN))
+        return 0;
+    if (!WIFIPCAP_HANDLES(Handle80211MgmtBeacon))
+        return 1;                       // nobody would look at the elements
+    if (beacons && WIFIPCAP_CALL(Dedup80211Beacons(*this))) {
+        u_int64_t hash = beacon_cache::hash(pmh, p, fcs_ok ? len - 4 : len);
+        beacon_seen &seen = beacons->slot(pmh->bssid);
+        seen.last_seen = header->ts;
+        if (seen.hash == hash && seen.bssid == pmh->bssid) {
+            seen.count++;
+            if (WIFIPCAP_CALL(Handle80211MgmtBeaconRepeat(*this, pmh, seen)))
+                return 1;
+        }
+        seen.bssid = pmh->bssid;
+        seen.hash = hash;
+        seen.count = 1;
+    }
+    memcpy(&pbody.timestamp, p, IEEE802_11_TSTAMP_LEN);
+    offset += IEEE802_11_TSTAMP_LEN;
+    pbody.beacon_interval = EXTRACT_LE_16BITS(p+offset);
+    offset += IEEE802_11_BCNINT_LEN;
+    pbody.capability_info = EXTRACT_LE_16BITS(p+offset);
+    offset += IEEE802_11_CAPINFO_LEN;
+
+    parse_elements(&pbody, p, offset, len, WIFIPCAP_CALL(Mgmt80211Elements(*this)));
+
+    /*
+      PRINT_SSID(pbody);
+      PRINT_RATES(pbody);
+      printf(" %s",
+      CAPABILITY_ESS(pbody.capability_info) ? "ESS" : "IBSS");
+      PRINT_DS_CHANNEL(pbody);
+    */
+    WIFIPCAP_CALL(Handle80211MgmtBeacon(*this, pmh, &pbody));
+    return 1;
+}
+
+template <class CB>
+int WifiDecoder<CB>::handle_assoc_request( const struct mgmt_header_t *pmh, const u_char *p, size_t len)
+{
+    struct mgmt_body_t pbody;
+    int offset = 0;
+
+    memset(&pbody, 0, sizeof(pbody));
+
+    if (!TTEST2(*p, IEEE802_11_CAPINFO_LEN + IEEE802_11_LISTENINT_LEN))
+        return 0;
+    if (!WIFIPCAP_HANDLES(Handle80211MgmtAssocRequest))
+        return 1;                       // nobody would look at the elements
+    pbody.capability_info = EXTRACT_LE_16BITS(p);
+    offset += IEEE802_11_CAPINFO_LEN;
+    pbody.listen_interval = EXTRACT_LE_16BITS(p+offset);
+    offset += IEEE802_11_LISTENINT_LEN;
+
+    parse_elements(&pbody, p, offset, len, WIFIPCAP_CALL(Mgmt80211Elements(*this)));
+
+    /*
+      PRINT_SSID(pbody);
+      PRINT_RATES(pbody);
+    */
+    WIFIPCAP_CALL(Handle80211MgmtAssocRequest(*this, pmh, &pbody));
+
+    return 1;
+}
+
+template <class CB>
+int WifiDecoder<CB>::handle_assoc_response( const struct mgmt_header_t *pmh, const u_char *p, size_t len, bool reassoc)
+{
+    struct mgmt_body_t pbody;
+    int offset = 0;
+
+    memset(&pbody, 0, sizeof(pbody));
+
+    if (!TTEST2(*p, IEEE802_11_CAPINFO_LEN + IEEE802_11_STATUS_LEN +
+                IEEE802_11_AID_LEN))
+        return 0;
+    if (!(reassoc ? WIFIPCAP_HANDLES(Handle80211MgmtReassocResponse)
+                  : WIFIPCAP_HANDLES(Handle80211MgmtAssocResponse)))
+        return 1;                       // nobody would look at the elements
+    pbody.capability_info = EXTRACT_LE_16BITS(p);
+    offset += IEEE802_11_CAPINFO_LEN;
+    pbody.status_code = EXTRACT_LE_16BITS(p+offset);
+    offset += IEEE802_11_STATUS_LEN;
+    pbody.aid = EXTRACT_LE_16BITS(p+offset);
+    offset += IEEE802_11_AID_LEN;
+
+    parse_elements(&pbody, p, offset, len, WIFIPCAP_CALL(Mgmt80211Elements(*this)));
+
+    /*
+      printf(" AID(%x) :%s: %s", ((u_int16_t)(pbody.aid << 2 )) >> 2 ,
+      CAPABILITY_PRIVACY(pbody.capability_info) ? " PRIVACY " : "",
+      (pbody.status_code < NUM_STATUSES
+      ? status_text[pbody.status_code]
+      : "n/a"));
+    */
+    if (!reassoc)
+        WIFIPCAP_CALL(Handle80211MgmtAssocResponse(*this, pmh, &pbody));
+    else
+        WIFIPCAP_CALL(Handle80211MgmtReassocResponse(*this, pmh, &pbody));
+
+    return 1;
+}
+
+template <class CB>
+int
+WifiDecoder<CB>::handle_reassoc_request( const struct mgmt_header_t *pmh, const u_char *p, size_t len)
+{
+    struct mgmt_body_t pbody;
+    int offset = 0;
+
+    memset(&pbody, 0, sizeof(pbody));
+
+    if (!TTEST2(*p, IEEE802_11_CAPINFO_LEN + IEEE802_11_LISTENINT_LEN +
+                IEEE802_11_AP_LEN))
+        return 0;
+    if (!WIFIPCAP_HANDLES(Handle80211MgmtReassocRequest))
+        return 1;                       // nobody would look at the elements
+    pbody.capability_info = EXTRACT_LE_16BITS(p);
+    offset += IEEE802_11_CAPINFO_LEN;
+    pbody.listen_interval = EXTRACT_LE_16BITS(p+offset);
+    offset += IEEE802_11_LISTENINT_LEN;
+    memcpy(&pbody.ap, p+offset, IEEE802_11_AP_LEN);
+    offset += IEEE802_11_AP_LEN;
+
+    parse_elements(&pbody, p, offset, len, WIFIPCAP_CALL(Mgmt80211Elements(*this)));
+
+    /*
+      PRINT_SSID(pbody);
+      printf(" AP : %s", etheraddr_string( pbody.ap ));
+    */
+    WIFIPCAP_CALL(Handle80211MgmtReassocRequest(*this, pmh, &pbody));
+
+    return 1;
+}
+
+template <class CB>
+int
+WifiDecoder<CB>::handle_reassoc_response( const struct mgmt_header_t *pmh, const u_char *p, size_t len)
+{
+    /* Same as a Association Reponse */
+    return handle_assoc_response(pmh, p, len, true);
+}
+
+template <class CB>
+int
+WifiDecoder<CB>::handle_probe_request( const struct mgmt_header_t *pmh, const u_char *p, size_t len)
+{
+    struct mgmt_body_t  pbody;
+    int offset = 0;
+
+    if (!WIFIPCAP_HANDLES(Handle80211MgmtProbeRequest))
+        return 1;                       // nobody would look at the elements
+    memset(&pbody, 0, sizeof(pbody));
+
+    parse_elements(&pbody, p, offset, len, WIFIPCAP_CALL(Mgmt80211Elements(*this)));
+
+    /*
+      PRINT_SSID(pbody);
+      PRINT_RATES(pbody);
+    */
+    WIFIPCAP_CALL(Handle80211MgmtProbeRequest(*this, pmh, &pbody));
+
+    return 1;
+}
+
+template <class CB>
+int
+WifiDecoder<CB>::handle_probe_response( const struct mgmt_header_t *pmh, const u_char *p, size_t len)
+{
+    struct mgmt_body_t  pbody;
+    int offset = 0;
+
+    memset(&pbody, 0, sizeof(pbody));
+
+    if (!TTEST2(*p, IEEE802_11_TSTAMP_LEN + IEEE802_11_BCNINT_LEN +
+                IEEE802_11_CAPINFO_LEN))
+        return 0;
+    if (!WIFIPCAP_HANDLES(Handle80211MgmtProbeResponse))
+        return 1;                       // nobody would look at the elements
+
+    memcpy(&pbody.timestamp, p, IEEE802_11_TSTAMP_LEN);
+    offset += IEEE802_11_TSTAMP_LEN;
+    pbody.beacon_interval = EXTRACT_LE_16BITS(p+offset);
+    offset += IEEE802_11_BCNINT_LEN;
+    pbody.capability_info = EXTRACT_LE_16BITS(p+offset);
+    offset += IEEE802_11_CAPINFO_LEN;
+
+    parse_elements(&pbody, p, offset, len, WIFIPCAP_CALL(Mgmt80211Elements(*this)));
+
+    /*
+      PRINT_SSID(pbody);
+      PRINT_RATES(pbody);
+      PRINT_DS_CHANNEL(pbody);
+    */
+    WIFIPCAP_CALL(Handle80211MgmtProbeResponse(*this, pmh, &pbody));
+
+    return 1;
+}
+
+template <class CB>
+int
+WifiDecoder<CB>::handle_atim( const struct mgmt_header_t *pmh, const u_char *p, size_t len)
+{
+    /* the frame body for ATIM is null. */
+
+    WIFIPCAP_CALL(Handle80211MgmtATIM(*this, pmh));
+
+    return 1;
+}
+
+template <class CB>
+int
+WifiDecoder<CB>::handle_disassoc( const struct mgmt_header_t *pmh, const u_char *p, size_t len)
+{
+    struct mgmt_body_t  pbody;
+
+    memset(&pbody, 0, sizeof(pbody));
+
+    if (!TTEST2(*p, IEEE802_11_REASON_LEN))
+        return 0;
+    pbody.reason_code = EXTRACT_LE_16BITS(p);
+
+    /*
+      printf(": %s",
+      (pbody.reason_code < NUM_REASONS)
+      ? reason_text[pbody.reason_code]
+      : "Reserved" );
+    */
+    WIFIPCAP_CALL(Handle80211MgmtDisassoc(*this, pmh, &pbody));
+
+    return 1;
+}
+
+template <class CB>
+int
+WifiDecoder<CB>::handle_auth( const struct mgmt_header_t *pmh, const u_char *p, size_t len)
+{
+    struct mgmt_body_t  pbody;
+    int offset = 0;
+
+    memset(&pbody, 0, sizeof(pbody));
+
+    if (!TTEST2(*p, 6))
+        return 0;
+    if (!WIFIPCAP_HANDLES(Handle80211MgmtAuth))
+        return 1;                       // nobody would look at the elements
+    pbody.auth_alg = EXTRACT_LE_16BITS(p);
+    offset += 2;
+    pbody.auth_trans_seq_num = EXTRACT_LE_16BITS(p + offset);
+    offset += 2;
+    pbody.status_code = EXTRACT_LE_16BITS(p + offset);
+    offset += 2;
+
+    parse_elements(&pbody, p, offset, len, WIFIPCAP_CALL(Mgmt80211Elements(*this)));
+
+    /*
+      if ((pbody.auth_alg == 1) &&
+      ((pbody.auth_trans_seq_num == 2) ||
+      (pbody.auth_trans_seq_num == 3))) {
+      printf(" (%s)-%x [Challenge Text] %s",
+      (pbody.auth_alg < NUM_AUTH_ALGS)
+      ? auth_alg_text[pbody.auth_alg]
+      : "Reserved",
+      pbody.auth_trans_seq_num,
+      ((pbody.auth_trans_seq_num % 2)
+      ? ((pbody.status_code < NUM_STATUSES)
+      ? status_text[pbody.status_code]
+      : "n/a") : ""));
+      return 1;
+      }
+      printf(" (%s)-%x: %s",
+      (pbody.auth_alg < NUM_AUTH_ALGS)
+      ? auth_alg_text[pbody.auth_alg]
+      : "Reserved",
+      pbody.auth_trans_seq_num,
+      (pbody.auth_trans_seq_num % 2)
+      ? ((pbody.status_code < NUM_STATUSES)
+      ? status_text[pbody.status_code]
+      : "n/a")
+      : "");
+    */
+    WIFIPCAP_CALL(Handle80211MgmtAuth(*this, pmh, &pbody));
+
+    return 1;
+}
+
+template <class CB>
+int
+WifiDecoder<CB>::handle_deauth( const struct mgmt_header_t *pmh, const u_char *p, size_t len)
+{
+    struct mgmt_body_t  pbody;
+    int offset = 0;
+    //const char *reason = NULL;
+
+    memset(&pbody, 0, sizeof(pbody));
+
+    if (!TTEST2(*p, IEEE802_11_REASON_LEN))
+        return 0;
+    pbody.reason_code = EXTRACT_LE_16BITS(p);
+    offset += IEEE802_11_REASON_LEN;
+
+    /*
+      reason = (pbody.reason_code < NUM_REASONS)
+      ? reason_text[pbody.reason_code]
+      : "Reserved";
+
+      if (eflag) {
+      printf(": %s", reason);
+      } else {
+      printf(" (%s): %s", etheraddr_string(pmh->sa), reason);
+      }
+    */
+    WIFIPCAP_CALL(Handle80211MgmtDeauth(*this, pmh, &pbody));
+
+    return 1;
+}
+
+
+/*********************************************************************************
+ * Print Body funcs
+ *********************************************************************************/
+
+
+/** Decode a management request.
+ * @return 0 - failure, non-zero success
+ *
+ * NOTE — this function and all that it calls should be handled as methods in WifipcapCallbacks
+ */
+ 
+template <class CB>
+int
+WifiDecoder<CB>::decode_mgmt_body(u_int16_t fc, struct mgmt_header_t *pmh, const u_char *p, size_t len)
+{
+    if(debug) std::cerr << "decode_mgmt_body FC_SUBTYPE(fc)="<<(int)FC_SUBTYPE(fc)<<" ";
+    switch (FC_SUBTYPE(fc)) {
+    case ST_ASSOC_REQUEST:
+        return handle_assoc_request(pmh, p, len);
+    case ST_ASSOC_RESPONSE:
+        return handle_assoc_response(pmh, p, len);
+    case ST_REASSOC_REQUEST:
+        return handle_reassoc_request(pmh, p, len);
+    case ST_REASSOC_RESPONSE:
+        return handle_reassoc_response(pmh, p, len);
+    case ST_PROBE_REQUEST:
+        return handle_probe_request(pmh, p, len);
+    case ST_PROBE_RESPONSE:
+        return handle_probe_response(pmh, p, len);
+    case ST_BEACON:
+        return handle_beacon(pmh, p, len);
+    case ST_ATIM:
+        return handle_atim(pmh, p, len);
+    case ST_DISASSOC:
+        return handle_disassoc(pmh, p, len);
+    case ST_AUTH:
+        if (len < 3) {
+            return 0;
+        }
+        if ((p[0] == 0 ) && (p[1] == 0) && (p[2] == 0)) {
+            //printf("Authentication (Shared-Key)-3 ");
+            WIFIPCAP_CALL(Handle80211MgmtAuthSharedKey(*this, pmh, p, len));
+            return 0;
+        }
+        return handle_auth(pmh, p, len);
+    case ST_DEAUTH:
+        return handle_deauth(pmh, p, len);
+        break;
+    default:
+        return 0;
+    }
+}
+
+template <class CB>
+int WifiDecoder<CB>::decode_mgmt_frame(const u_char * ptr, size_t len, u_int16_t fc, u_int8_t hdrlen)
+{
+    mgmt_header_t hdr;
+    u_int16_t seq_ctl;
+
+    hdr.da    = MAC::ether2MAC(ptr + 4);
+    hdr.sa    = MAC::ether2MAC(ptr + 10);
+    hdr.bssid = MAC::ether2MAC(ptr + 16);
+
+    hdr.duration = EXTRACT_LE_16BITS(ptr+2);
+
+    seq_ctl   = pletohs(ptr + 22);
+
+    hdr.seq   = COOK_SEQUENCE_NUMBER(seq_ctl);
+    hdr.frag  = COOK_FRAGMENT_NUMBER(seq_ctl);
+
+    WIFIPCAP_CALL(Handle80211(*this, fc, hdr.sa, hdr.da, MAC::null, MAC::null, ptr, len));
+
+    int ret = decode_mgmt_body(fc, &hdr, ptr+MGMT_HDRLEN, len-MGMT_HDRLEN);
+
+    if (ret==0) {
+	WIFIPCAP_CALL(Handle80211Unknown(*this, fc, ptr, len));
+	return 0;
+    }
+
+    return 0;
+}
+
+template <class CB>
+int WifiDecoder<CB>::decode_data_frame(const u_char * ptr, size_t len, u_int16_t fc)
+{
+    mac_hdr_t hdr;
+    hdr.fc       = fc;
+    hdr.duration = EXTRACT_LE_16BITS(ptr+2);
+    hdr.seq_ctl  = pletohs(ptr + 22);
+    hdr.seq      = COOK_SEQUENCE_NUMBER(hdr.seq_ctl);
+    hdr.frag     = COOK_FRAGMENT_NUMBER(hdr.seq_ctl);
+
+    if(FC_TYPE(fc)==2 && FC_SUBTYPE(fc)==8){ // quality of service?
+        hdr.qos = 1;
+    }
+        
+    size_t hdrlen=0;
+
+    const MAC address1 = MAC::ether2MAC(ptr+4);
+    const MAC address2 = MAC::ether2MAC(ptr+10);
+    const MAC address3 = MAC::ether2MAC(ptr+16);
+    
+    /* call the 80211 callback data callback */
+
+    if (FC_TO_DS(fc)==0 && FC_FROM_DS(fc)==0) {	/* ad hoc IBSS */
+	hdr.da = address1;
+	hdr.sa = address2;
+	hdr.bssid = address3;
+	hdrlen = DATA_HDRLEN;
+        if(hdr.qos) hdrlen+=2;
+        WIFIPCAP_CALL(Handle80211( *this, fc, hdr.sa, hdr.da, hdr.ra, hdr.ta, ptr, len));
+	WIFIPCAP_CALL(Handle80211DataIBSS( *this, hdr, ptr+hdrlen, len-hdrlen));
+    } else if (FC_TO_DS(fc)==0 && FC_FROM_DS(fc)) { /* from AP to STA */
+        hdr.da = address1;
+        hdr.bssid = address2;
+        hdr.sa = address3;
+	hdrlen = DATA_HDRLEN;
+        if(hdr.qos) hdrlen+=2;
+        WIFIPCAP_CALL(Handle80211( *this, fc, hdr.sa, hdr.da, hdr.ra, hdr.ta, ptr, len));
+	WIFIPCAP_CALL(Handle80211DataFromAP( *this, hdr, ptr+hdrlen, len-hdrlen));
+    } else if (FC_TO_DS(fc) && FC_FROM_DS(fc)==0) {	/* frame from STA to AP */
+        hdr.bssid = address1;
+        hdr.sa = address2;
+        hdr.da = address3;
+	hdrlen = DATA_HDRLEN;
+        if(hdr.qos) hdrlen+=2;
+        WIFIPCAP_CALL(Handle80211( *this, fc, hdr.sa, hdr.da, hdr.ra, hdr.ta, ptr, len));
+	WIFIPCAP_CALL(Handle80211DataToAP( *this, hdr, ptr+hdrlen, len-hdrlen));
+    } else if (FC_TO_DS(fc) && FC_FROM_DS(fc)) {	/* WDS */
+        const MAC address4 = MAC::ether2MAC(ptr+18);
+        hdr.ra = address1;
+        hdr.ta = address2;
+        hdr.da = address3;
+        hdr.sa = address4;
+        hdrlen = DATA_WDS_HDRLEN;
+        if(hdr.qos) hdrlen+=2;
+        WIFIPCAP_CALL(Handle80211( *this, fc, hdr.sa, hdr.da, hdr.ra, hdr.ta, ptr, len));
+	WIFIPCAP_CALL(Handle80211DataWDS( *this, hdr, ptr+hdrlen, len-hdrlen));
+    }
+
+    /* Handle either the WEP or the link layer. This handles the data itself */
+    if (FC_WEP(fc)) {
+        handle_wep(ptr+hdrlen, len-hdrlen-4 ); 
+    } else {
+        handle_llc(hdr, ptr+hdrlen, len-hdrlen-4, fc); 
+    }
+    return 0;
+}
+
+template <class CB>
+int WifiDecoder<CB>::decode_ctrl_frame(const u_char * ptr, size_t len, u_int16_t fc)
+{
+    u_int16_t du = EXTRACT_LE_16BITS(ptr+2);        //duration
+
+    switch (FC_SUBTYPE(fc)) {
+    case CTRL_PS_POLL: {
+	ctrl_ps_poll_t hdr;
+	hdr.fc = fc;
+	hdr.aid = du;
+	hdr.bssid =  MAC::ether2MAC(ptr+4);
+	hdr.ta =  MAC::ether2MAC(ptr+10);
+	WIFIPCAP_CALL(Handle80211( *this, fc, MAC::null, MAC::null, MAC::null, hdr.ta, ptr, len));
+	WIFIPCAP_CALL(Handle80211CtrlPSPoll( *this, &hdr));
+	break;
+    }
+    case CTRL_RTS: {
+	ctrl_rts_t hdr;
+	hdr.fc = fc;
+	hdr.duration = du;
+	hdr.ra =  MAC::ether2MAC(ptr+4);
+	hdr.ta =  MAC::ether2MAC(ptr+10);
+	WIFIPCAP_CALL(Handle80211( *this, fc, MAC::null, MAC::null, hdr.ra, hdr.ta, ptr, len));
+	WIFIPCAP_CALL(Handle80211CtrlRTS( *this, &hdr));
+	break;
+    }
+    case CTRL_CTS: {
+	ctrl_cts_t hdr;
+	hdr.fc = fc;
+	hdr.duration = du;
+	hdr.ra =  MAC::ether2MAC(ptr+4);
+	WIFIPCAP_CALL(Handle80211( *this, fc, MAC::null, MAC::null, hdr.ra, MAC::null, ptr, len));
+	WIFIPCAP_CALL(Handle80211CtrlCTS( *this, &hdr));
+	break;
+    }
+    case CTRL_ACK: {
+	ctrl_ack_t hdr;
+	hdr.fc = fc;
+	hdr.duration = du;
+	hdr.ra =  MAC::ether2MAC(ptr+4);
+	WIFIPCAP_CALL(Handle80211( *this, fc, MAC::null, MAC::null, hdr.ra, MAC::null, ptr, len));
+	WIFIPCAP_CALL(Handle80211CtrlAck( *this, &hdr));
+	break;
+    }
+    case CTRL_CF_END: {
+	ctrl_end_t hdr;
+	hdr.fc = fc;
+	hdr.duration = du;
+	hdr.ra =  MAC::ether2MAC(ptr+4);
+	hdr.bssid =  MAC::ether2MAC(ptr+10);
+	WIFIPCAP_CALL(Handle80211( *this, fc, MAC::null, MAC::null, hdr.ra, MAC::null, ptr, len));
+	WIFIPCAP_CALL(Handle80211CtrlCFEnd( *this, &hdr));
+	break;
+    }
+    case CTRL_END_ACK: {	
+	ctrl_end_ack_t hdr;
+	hdr.fc = fc;
+	hdr.duration = du;
+	hdr.ra =  MAC::ether2MAC(ptr+4);
+	hdr.bssid =  MAC::ether2MAC(ptr+10);
+	WIFIPCAP_CALL(Handle80211( *this, fc, MAC::null, MAC::null, hdr.ra, MAC::null, ptr, len));
+	WIFIPCAP_CALL(Handle80211CtrlEndAck( *this, &hdr));
+	break;
+    }
+    default: {
+	WIFIPCAP_CALL(Handle80211( *this, fc, MAC::null, MAC::null, MAC::null, MAC::null, ptr, len));
+	WIFIPCAP_CALL(Handle80211Unknown( *this, fc, ptr, len));
+	return -1;
+	//add the case statements for QoS control frames once ieee802_11.h is updated
+    }
+    }
+    return 0;
+}
+
+/* Whether a handler of CB would see a frame of type fc, if its FCS is good */
+template <class CB>
+bool WifiDecoder<CB>::frame_handled(u_int16_t fc)
+{
+    if (WIFIPCAP_HANDLES(Handle80211) || WIFIPCAP_HANDLES(Handle80211Unknown))
+        return true;
+    switch (FC_TYPE(fc)) {
+    case T_MGMT:
+	switch (FC_SUBTYPE(fc)) {
+	case ST_ASSOC_REQUEST:    return WIFIPCAP_HANDLES(Handle80211MgmtAssocRequest);
+	case ST_ASSOC_RESPONSE:   return WIFIPCAP_HANDLES(Handle80211MgmtAssocResponse);
+	case ST_REASSOC_REQUEST:  return WIFIPCAP_HANDLES(Handle80211MgmtReassocRequest);
+	case ST_REASSOC_RESPONSE: return WIFIPCAP_HANDLES(Handle80211MgmtReassocResponse);
+	case ST_PROBE_REQUEST:    return WIFIPCAP_HANDLES(Handle80211MgmtProbeRequest);
+	case ST_PROBE_RESPONSE:   return WIFIPCAP_HANDLES(Handle80211MgmtProbeResponse);
+	case ST_BEACON:           return WIFIPCAP_HANDLES(Handle80211MgmtBeacon);
+	case ST_ATIM:             return WIFIPCAP_HANDLES(Handle80211MgmtATIM);
+	case ST_DISASSOC:         return WIFIPCAP_HANDLES(Handle80211MgmtDisassoc);
+	case ST_AUTH:             return WIFIPCAP_HANDLES(Handle80211MgmtAuth) ||
+                                         WIFIPCAP_HANDLES(Handle80211MgmtAuthSharedKey);
+	case ST_DEAUTH:           return WIFIPCAP_HANDLES(Handle80211MgmtDeauth);
+	default:                  return false;
+	}
+    case T_CTRL:
+	switch (FC_SUBTYPE(fc)) {
+	case CTRL_PS_POLL:        return WIFIPCAP_HANDLES(Handle80211CtrlPSPoll);
+	case CTRL_RTS:            return WIFIPCAP_HANDLES(Handle80211CtrlRTS);
+	case CTRL_CTS:            return WIFIPCAP_HANDLES(Handle80211CtrlCTS);
+	case CTRL_ACK:            return WIFIPCAP_HANDLES(Handle80211CtrlAck);
+	case CTRL_CF_END:         return WIFIPCAP_HANDLES(Handle80211CtrlCFEnd);
+	case CTRL_END_ACK:        return WIFIPCAP_HANDLES(Handle80211CtrlEndAck);
+	default:                  return false;
+	}
+    default:
+	return true;                    // data frames go on to the LLC and up
+    }
+}
+
+#ifndef roundup2
+#define	roundup2(x, y)	(((x)+((y)-1))&(~((y)-1))) /* if y is powers of two */
+#endif
+
+template <class CB>
+void WifiDecoder<CB>::handle_80211(const u_char * pkt, size_t len /* , int pad */)  
+{
+    if (debug) std::cerr << "handle_80211(len= " << len << " ";
+    if (len < 2) {
+	WIFIPCAP_CALL(Handle80211( *this, 0, MAC::null, MAC::null, MAC::null, MAC::null, pkt, len));
+	WIFIPCAP_CALL(Handle80211Unknown( *this, -1, pkt, len));
+	return;
+    }
+
+    u_int16_t fc  = EXTRACT_LE_16BITS(pkt);       //frame control
+    size_t hdrlen = extract_header_length(fc);
+    /*
+      if (pad) {
+      hdrlen = roundup2(hdrlen, 4);
+      }
+    */
+
+    if (debug) std::cerr << "FC_TYPE(fc)= " << FC_TYPE(fc) << " ";
+
+    if (len < IEEE802_11_FC_LEN || len < hdrlen) {
+	WIFIPCAP_CALL(Handle80211Unknown( *this, fc, pkt, len));
+	return;
+    }
+
+    /* Calculate the frame checksum, unless asked to only for frames a handler
+     * will see and this isn't one, and only process the packets if the FCS
+     * or if we are ignoring it */
+    bool handled = !WIFIPCAP_CALL(Check80211FCSIfHandled(*this)) || frame_handled(fc);
+    if (handled && len >= hdrlen + 4) {
+        // assume fcs is last 4 bytes (?)
+        u_int32_t fcs_sent = EXTRACT_32BITS(pkt+len-4);
+        u_int32_t fcs = crc32_802(pkt, len-4);
+        
+        /*
+          if (fcs != fcs_sent) {
+          cerr << "bad fcs: ";
+          fprintf (stderr, "%08x != %08x\n", fcs_sent, fcs); 
+          }
+        */
+	
+        fcs_ok = (fcs == fcs_sent);
+    }
+    if (WIFIPCAP_CALL(Check80211FCS(*this)) && fcs_ok==false){
+        WIFIPCAP_CALL(Handle80211Unknown(*this,fc,pkt,len));
+        return;
+    }
+
+
+    // fill in current_frame: type, sn
+    switch (FC_TYPE(fc)) {
+    case T_MGMT:
+	if(decode_mgmt_frame(pkt, len, fc, hdrlen)<0)
+	    return;
+	break;
+    case T_DATA:
+	if(decode_data_frame(pkt, len, fc)<0)
+	    return;
+	break;
+    case T_CTRL:
+	if(decode_ctrl_frame(pkt, len, fc)<0)
+	    return;
+	break;
+    default:
+	WIFIPCAP_CALL(Handle80211( *this, fc, MAC::null, MAC::null, MAC::null, MAC::null, pkt, len));
+	WIFIPCAP_CALL(Handle80211Unknown( *this, fc, pkt, len));
+	return;
+    }
+}
+
+template <class CB>
+void WifiDecoder<CB>::handle_radiotap(const u_char *p,size_t caplen)
+{
+#define	BITNO_32(x) (((x) >> 16) ? 16 + BITNO_16((x) >> 16) : BITNO_16((x)))
+#define	BITNO_16(x) (((x) >> 8) ? 8 + BITNO_8((x) >> 8) : BITNO_8((x)))
+#define	BITNO_8(x) (((x) >> 4) ? 4 + BITNO_4((x) >> 4) : BITNO_4((x)))
+#define	BITNO_4(x) (((x) >> 2) ? 2 + BITNO_2((x) >> 2) : BITNO_2((x)))
+#define	BITNO_2(x) (((x) & 2) ? 1 : 0)
+#define	BIT(n)	(1 << n)
+#define	IS_EXTENDED(__p) (EXTRACT_LE_32BITS(__p) & BIT(IEEE80211_RADIOTAP_EXT)) != 0
+
+    // If caplen is too small, just give it a try and carry on.
+    if (caplen < sizeof(struct ieee80211_radiotap_header)) {
+        WIFIPCAP_CALL(HandleRadiotap( *this, NULL, p, caplen));
+        return;
+    }
+
+    struct ieee80211_radiotap_header *hdr = (struct ieee80211_radiotap_header *)p;
+
+    size_t len = EXTRACT_LE_16BITS(&hdr->it_len); // length of radiotap header
+
+    if (caplen < len) {
+        //printf("[|802.11]");
+        WIFIPCAP_CALL(HandleRadiotap( *this, NULL, p, caplen));
+        return;// caplen;
+    }
+    uint32_t *last_presentp=0;
+    for (last_presentp = &hdr->it_present;
+         IS_EXTENDED(last_presentp) && (u_char*)(last_presentp + 1) <= p + len;
+         last_presentp++){
+    }
+
+    /* are there more bitmap extensions than bytes in header? */
+    if (IS_EXTENDED(last_presentp)) {
+        //printf("[|802.11]");
+        WIFIPCAP_CALL(HandleRadiotap( *this, NULL, p, caplen));
+        return;// caplen;
+    }
+
+    const u_char *iter = (u_char*)(last_presentp + 1);
+    size_t fields_len = iter <= p + len ? len - (iter - p) : 0; // it_len may not cover the bitmap
+    struct cpack_state cpacker;
+    if (cpack_init(&cpacker, (u_int8_t*)iter, fields_len) != 0) {
+        /* XXX */
+        //printf("[|802.11]");
+        WIFIPCAP_CALL(HandleRadiotap( *this, NULL, p, caplen));
+        return;// caplen;
+    }
+
+    radiotap_hdr ohdr;
+    memset(&ohdr, 0, sizeof(ohdr));
+	
+    /* Assume no Atheros padding between 802.11 header and body */
+    int pad = 0;
+    uint32_t *presentp;
+    int bit0=0;
+    /* The fields are only read for HandleRadiotap() */
+    bool read_fields = WIFIPCAP_HANDLES(HandleRadiotap);
+
+    /* With one bitmap and room for all of its fields, read them at the
+     * offsets cached for the bitmap; cpack reads the rest.
+     */
+    if (read_fields && layouts && last_presentp == &hdr->it_present) {
+        const radiotap_layout &layout = layouts->find(EXTRACT_LE_32BITS(&hdr->it_present));
+        if (layout.known && layout.end <= fields_len) {
+            read_radiotap_fields(layout, iter, &pad, &ohdr);
+            read_fields = false;
+        }
+    }
+    for (bit0 = 0, presentp = &hdr->it_present;
+         read_fields && presentp <= last_presentp;
+         presentp++, bit0 += 32) {
+
+        u_int32_t present, next_present;
+        for (present = EXTRACT_LE_32BITS(presentp); present;
+             present = next_present) {
+            /* clear the least significant bit that is set */
+            next_present = present & (present - 1);
+
+            /* extract the least significant bit that is set */
+            enum ieee80211_radiotap_type bit = (enum ieee80211_radiotap_type)
+                (bit0 + BITNO_32(present ^ next_present));
+
+            /* print the next radiotap field */
+            int r = print_radiotap_field(&cpacker, bit, &pad, &ohdr);
+
+            /* If we got an error, break both loops */
+            if(r!=0) goto done;
+        }
+    }
+done:;
+    WIFIPCAP_CALL(HandleRadiotap( *this, &ohdr, p, caplen));
+    //return len + ieee802_11_print(p + len, length - len, caplen - len, pad);
+#undef BITNO_32
+#undef BITNO_16
+#undef BITNO_8
+#undef BITNO_4
+#undef BITNO_2
+#undef BIT
+#undef IS_EXTENDED
+    handle_80211(p+len, caplen-len);
+}
+
+template <class CB>
+void WifiDecoder<CB>::handle_prism(const u_char *pc, size_t len)
+{
+    prism2_pkthdr hdr;
+
+    /* get the fields */
+    hdr.host_time 	= EXTRACT_LE_32BITS(pc+32);
+    hdr.mac_time 	= EXTRACT_LE_32BITS(pc+44);
+    hdr.channel 	= EXTRACT_LE_32BITS(pc+56);
+    hdr.rssi 		= EXTRACT_LE_32BITS(pc+68);
+    hdr.sq 		= EXTRACT_LE_32BITS(pc+80);
+    hdr.signal  	= EXTRACT_LE_32BITS(pc+92);
+    hdr.noise   	= EXTRACT_LE_32BITS(pc+104);
+    hdr.rate		= EXTRACT_LE_32BITS(pc+116)/2;
+    hdr.istx		= EXTRACT_LE_32BITS(pc+128);
+    WIFIPCAP_CALL(HandlePrism( *this, &hdr, pc + 144, len - 144));
+    handle_80211(pc+144,len-144);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///
+/// handle_*:
+/// handle each of the packet types
+///
+
+template <class CB>
+void WifiDecoder<CB>::handle_ether(const u_char *ptr, size_t len)
+{
+#if 0
+    ether_hdr_t hdr;
+
+    hdr.da = MAC::ether2MAC(ptr);
+    hdr.sa = MAC::ether2MAC(ptr+6);
+    hdr.type = EXTRACT_16BITS(ptr + 12);
+
+    ptr += 14;
+    len -= 14;
+
+    WIFIPCAP_CALL(HandleEthernet(*this, &hdr, ptr, len));
+
+    switch (hdr.type) {
+    case ETHERTYPE_IP:
+	handle_ip(ptr, len);
+	return;
+    case ETHERTYPE_IPV6:
+	handle_ip6(ptr, len);
+	return;
+    case ETHERTYPE_ARP:
+	handle_arp( ptr, len);
+	return;
+    default:
+	WIFIPCAP_CALL(HandleL2Unknown(*this, hdr.type, ptr, len));
+	return;
+    }
+#endif
+}
+
+/* object-oriented version of pcap callback. Called with the callbacks object,
+ * the DLT type, the header and the packet.
+ * This is the main packet processor.
+ * It records some stats and then dispatches to the appropriate callback.
+ */
+template <class CB>
+void Wifipcap::handle_packet(CB *cbs,int header_type,
+                             const struct pcap_pkthdr *header, const u_char * packet) 
+{
+    /* Record start time if we don't have it */
+    if (startTime == TIME_NONE) {
+	startTime = header->ts;
+	lastPrintTime = header->ts;
+    }
+    /* Print stats if necessary */
+    if (header->ts.tv_sec > lastPrintTime.tv_sec + Wifipcap::PRINT_TIME_INTERVAL) {
+	if (verbose) {
+	    int hours = (header->ts.tv_sec - startTime.tv_sec)/3600;
+	    int days  = hours/24;
+	    int left  = hours%24;
+	    fprintf(stderr, "wifipcap: %2d days %2d hours, %10" PRId64 " pkts\n", 
+		    days, left, packetsProcessed);
+	}
+	lastPrintTime = header->ts;
+    }
+    packetsProcessed++;
+
+    /* Create the packet object and call the appropriate callbacks */
+    WifiDecoder<CB> pkt(cbs,header_type,header,packet,&layouts,&beacons);
+
+    /* Notify callback */
+    WIFIPCAP_CALL(PacketBegin(pkt, packet, header->caplen, header->len));
+    //int frameLen = header->caplen;
+    switch(header_type) {
+    case DLT_PRISM_HEADER:
+        pkt.handle_prism(packet,header->caplen);
+        break;
+    case DLT_IEEE802_11_RADIO:
+        pkt.handle_radiotap(packet,header->caplen);
+        break;
+    case DLT_IEEE802_11:
+        pkt.handle_80211(packet,header->caplen);
+        break;
+    case DLT_EN10MB:
+        pkt.handle_ether(packet,header->caplen);
+        break;
+    default:
+#if 0
+	// try handling it as default IP assuming framing is ethernet 
+	// (this is for testing)
+        pkt.handle_ip(packet,header->caplen);
+#endif
+        break;
+    }
+    WIFIPCAP_CALL(PacketEnd(pkt));
+}
+#undef WIFIPCAP_HANDLES
+#undef WIFIPCAP_CALL
+
+#pragma GCC diagnostic pop
+
+#endif
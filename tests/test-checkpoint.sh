@@ -0,0 +1,43 @@
+#!/bin/sh
+#
+# test that a capture read in two runs, joined by -S checkpoint and
+# -S restore, gives the flow files and flows of reading it in one
+#
+
+. $srcdir/test-subs.sh
+
+OUT=/tmp/out$$
+DMPFILE=$DMPDIR/test1.pcap
+PART1=$DMPDIR/test1-part1.pcap          # the first packets of test1.pcap
+echo checking $DMPFILE
+if ! [ -r $DMPFILE ] ; then echo $DMPFILE not found ; exit 1 ; fi
+/bin/rm -rf $OUT
+mkdir -p $OUT/one $OUT/split
+
+# the rest of test1.pcap, after its pcap header
+len=`wc -c < $PART1`
+(head -c 24 $DMPFILE ; tail -c +`expr $len + 1` $DMPFILE) > $OUT/part2.pcap
+
+cmd "$TCPFLOW -o $OUT/one -X $OUT/one.xml -r $DMPFILE"
+cmd "$TCPFLOW -o $OUT/split -X $OUT/split1.xml -S checkpoint=$OUT/checkpoint -r $PART1"
+cmd "$TCPFLOW -o $OUT/split -X $OUT/split2.xml -S restore=$OUT/checkpoint -r $OUT/part2.pcap"
+
+md5tree $OUT/one > $OUT/one.md5
+md5tree $OUT/split > $OUT/split.md5
+if ! cmp -s $OUT/one.md5 $OUT/split.md5 ; then
+  echo the flow files of the two runs are not those of one
+  diff $OUT/one.md5 $OUT/split.md5
+  exit 1
+fi
+
+# each flow is in the report of the run that finished it
+grep '<tcpflow ' $OUT/one.xml | sort > $OUT/one.flows
+cat $OUT/split1.xml $OUT/split2.xml | grep '<tcpflow ' | sort > $OUT/split.flows
+if ! cmp -s $OUT/one.flows $OUT/split.flows ; then
+  echo the flows reported by the two runs are not those of one
+  diff $OUT/one.flows $OUT/split.flows
+  exit 1
+fi
+
+/bin/rm -rf $OUT
+exit 0
@@ -0,0 +1,44 @@
+#!/bin/sh
+#
+# test that -S flow_gzip writes flow files that gzip -dc inflates to those
+# written without it, for flows with and without a SYN
+#
+
+. $srcdir/test-subs.sh
+
+OUT=/tmp/out$$
+for t in test1-out-of-order test1-one-packet
+do
+  DMPFILE=$DMPDIR/$t.pcap
+  echo checking $DMPFILE
+  if ! [ -r $DMPFILE ] ; then echo $DMPFILE not found ; exit 1 ; fi
+  /bin/rm -rf $OUT
+  mkdir -p $OUT/raw $OUT/gz $OUT/inflated
+
+  cmd "$TCPFLOW -o $OUT/raw -X $OUT/raw/report.xml -r $DMPFILE"
+  cmd "$TCPFLOW -o $OUT/gz -X $OUT/gz/report.xml -S flow_gzip=6 -r $DMPFILE"
+
+  for f in `ls $OUT/gz | grep -v '^report.xml$'` ; do
+    case $f in
+    *.gz) ;;
+    *) echo $t: $f was written without .gz ; exit 1 ;;
+    esac
+    if ! gzip -dc $OUT/gz/$f > $OUT/inflated/`basename $f .gz` ; then
+      echo $t: gzip -dc cannot read $f
+      exit 1
+    fi
+  done
+
+  md5tree $OUT/raw > $OUT/raw.md5
+  md5tree $OUT/inflated > $OUT/inflated.md5
+  if ! [ -s $OUT/raw.md5 ] ; then echo $t: no flow files were written ; exit 1 ; fi
+  if ! cmp -s $OUT/raw.md5 $OUT/inflated.md5 ; then
+    echo $t: the inflated flow files are not those written raw
+    diff $OUT/raw.md5 $OUT/inflated.md5
+    exit 1
+  fi
+  echo Packet file $t completed successfully
+done
+
+/bin/rm -rf $OUT
+exit 0
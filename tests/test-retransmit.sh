@@ -0,0 +1,44 @@
+#!/bin/sh
+#
+# test that skipping retransmitted bytes already stored leaves the flow
+# files and out_of_order_count as they were. With -I every segment is
+# written, as before the skip, so that run is the reference.
+#
+
+. $srcdir/test-subs.sh
+
+OUT=/tmp/out$$
+for t in bug3 test1-out-of-order
+do
+  DMPFILE=$DMPDIR/$t.pcap
+  echo checking $DMPFILE
+  if ! [ -r $DMPFILE ] ; then echo $DMPFILE not found ; exit 1 ; fi
+  /bin/rm -rf $OUT
+  mkdir -p $OUT/skip $OUT/all
+
+  cmd "$TCPFLOW -o $OUT/skip -X $OUT/skip/report.xml -r $DMPFILE"
+  cmd "$TCPFLOW -I -o $OUT/all -X $OUT/all/report.xml -r $DMPFILE"
+  /bin/rm -f $OUT/all/*.bfindx
+
+  md5tree $OUT/skip > $OUT/skip.md5
+  md5tree $OUT/all > $OUT/all.md5
+  if ! cmp -s $OUT/skip.md5 $OUT/all.md5 ; then
+    echo $t: the flow files differ when retransmissions are skipped
+    diff $OUT/all.md5 $OUT/skip.md5
+    exit 1
+  fi
+
+  # out_of_order_count is an attribute of each flow's <tcpflow>
+  for run in skip all ; do
+    grep '<tcpflow ' $OUT/$run/report.xml | sort > $OUT/$run.flows
+  done
+  if ! cmp -s $OUT/skip.flows $OUT/all.flows ; then
+    echo $t: the report differs when retransmissions are skipped
+    diff $OUT/all.flows $OUT/skip.flows
+    exit 1
+  fi
+  echo Packet file $t completed successfully
+done
+
+/bin/rm -rf $OUT
+exit 0
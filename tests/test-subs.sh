@@ -53,3 +53,11 @@ cmd()
     if ! $1 ; then echo failed; exit 1; fi
 }
 
+
+# The md5 of each file in directory $1 but report.xml, one "name md5" per line
+md5tree()
+{
+  (cd $1 && for f in `ls | grep -v '^report.xml$'` ; do
+     echo $f `openssl md5 < $f | awk '{print $NF;}'`
+   done)
+}
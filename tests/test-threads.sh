@@ -0,0 +1,42 @@
+#!/bin/sh
+#
+# test that -j 4 writes the same flow files as -j 1, and the same
+# report.xml order every run
+#
+
+. $srcdir/test-subs.sh
+
+OUT=/tmp/out$$
+for t in test1 test2 test3 test4 test7-three-flows test1-out-of-order bug3
+do
+  DMPFILE=$DMPDIR/$t.pcap
+  echo checking $DMPFILE
+  if ! [ -r $DMPFILE ] ; then echo $DMPFILE not found ; exit 1 ; fi
+  /bin/rm -rf $OUT
+  mkdir -p $OUT/j1 $OUT/j4 $OUT/j4again
+
+  cmd "$TCPFLOW -j 1 -o $OUT/j1 -X $OUT/j1/report.xml -r $DMPFILE"
+  cmd "$TCPFLOW -j 4 -o $OUT/j4 -X $OUT/j4/report.xml -r $DMPFILE"
+  cmd "$TCPFLOW -j 4 -o $OUT/j4again -X $OUT/j4again/report.xml -r $DMPFILE"
+
+  md5tree $OUT/j1 > $OUT/j1.md5
+  md5tree $OUT/j4 > $OUT/j4.md5
+  if ! cmp -s $OUT/j1.md5 $OUT/j4.md5 ; then
+    echo $t: the flow files of -j 4 are not those of -j 1
+    diff $OUT/j1.md5 $OUT/j4.md5
+    exit 1
+  fi
+
+  for run in j4 j4again ; do
+    grep '<filename>' $OUT/$run/report.xml | sed -e 's,^.*<filename>[^<]*/,,' > $OUT/$run.order
+  done
+  if ! cmp -s $OUT/j4.order $OUT/j4again.order ; then
+    echo $t: the flows of report.xml are in a different order from run to run
+    diff $OUT/j4.order $OUT/j4again.order
+    exit 1
+  fi
+  echo Packet file $t completed successfully
+done
+
+/bin/rm -rf $OUT
+exit 0